@@ -15,6 +15,8 @@ rmcond root_client_privkey.pem
 rmcond root_client_cert.pem
 rmcond client_privkey.pem
 rmcond client_cert.pem
+rmcond server_pubkey.pem
+rmcond client_pubkey.pem
 
 echo "----------------------------------------"
 echo "Root Server Private Key"
@@ -99,3 +101,21 @@ certtool --generate-certificate \
          --load-ca_certificate root_client_cert.pem \
          --load-ca-privkey root_client_privkey.pem
 echo ""
+
+echo "----------------------------------------"
+echo "Server Raw Public Key"
+echo "----------------------------------------"
+certtool --pubkey-info \
+         --load-privkey server_privkey.pem \
+         --no-text \
+         --outfile server_pubkey.pem
+echo ""
+
+echo "----------------------------------------"
+echo "Client Raw Public Key"
+echo "----------------------------------------"
+certtool --pubkey-info \
+         --load-privkey client_privkey.pem \
+         --no-text \
+         --outfile client_pubkey.pem
+echo ""
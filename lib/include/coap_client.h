@@ -45,6 +45,65 @@
 
 #define COAP_CLIENT_HOST_BUF_LEN  128                                           /**< Buffer length for host addresses */
 #define COAP_CLIENT_PORT_BUF_LEN  8                                             /**< Buffer length for port numbers */
+#define COAP_CLIENT_RPK_MAX_TRUST 4                                             /**< Maximum number of trusted raw public keys */
+#define COAP_CLIENT_NUM_VERIFIED  32                                            /**< Number of verified server certificates that are remembered */
+#define COAP_CLIENT_VERIFIED_TTL  600                                           /**< Time (sec) for which a verified server certificate is remembered */
+#define COAP_CLIENT_VERIFIED_LEN  32                                            /**< Length of the SHA-256 key of a verified server certificate */
+#define COAP_CLIENT_OBS_TOKEN_LEN     4                                         /**< Length of the token used for a subscription */
+#define COAP_CLIENT_OBS_HASH_SIZE     1024                                      /**< Number of hash buckets used to find a subscription from its token or message ID */
+#define COAP_CLIENT_OBS_MAX_AGE_SEC   60                                        /**< Max-Age assumed when a notification does not contain the option */
+#define COAP_CLIENT_OBS_MARGIN_SEC    2                                         /**< Time (sec) beyond Max-Age to wait for a notification before re-registering */
+#define COAP_CLIENT_OBS_REORDER_SEC   128                                       /**< Time (sec) after which a notification is fresh regardless of its sequence number */
+
+#define coap_client_obs_get_data(obs)   ((obs)->data)                           /**< Get the data pointer given to coap_client_observe from a subscription */
+#define coap_client_get_num_obs(client)  ((client)->num_obs)                    /**< Get the number of active subscriptions */
+
+#ifdef COAP_DTLS_EN
+
+/**
+ *  @brief Verified certificate structure
+ *
+ *  Remembers a server certificate that passed verification
+ *  so that the next connection to the server is not verified
+ *  again. The key covers the end-entity certificate, the
+ *  expected common name and the trust and certificate
+ *  revocation list file names.
+ */
+typedef struct
+{
+    unsigned char key[COAP_CLIENT_VERIFIED_LEN];                                /**< SHA-256 key of the certificate and verification parameters */
+    unsigned long long file_stamp;                                              /**< Stamp of the trust and certificate revocation list files when the certificate was verified */
+    time_t expire;                                                              /**< The time after which the certificate must be verified again, 0 if unused */
+}
+coap_client_verified_t;
+
+#endif
+
+/**
+ *  @brief Subscription structure
+ *
+ *  Keeps one observe registration (RFC 7641) alive. The
+ *  registration request is kept in its formatted form so
+ *  that it can be re-sent with a new message ID.
+ */
+typedef struct coap_client_obs
+{
+    char token[COAP_CLIENT_OBS_TOKEN_LEN];                                      /**< Token of the registration request and its notifications */
+    char *buf;                                                                  /**< Buffer containing the formatted registration request */
+    size_t len;                                                                 /**< Length of the formatted registration request */
+    unsigned msg_id;                                                            /**< Message ID of the last registration request sent */
+    int (* notify)(struct coap_client_obs *, coap_msg_t *);                     /**< Call-back function to handle notifications, returns non-zero to end the subscription */
+    void *data;                                                                 /**< Pointer given to coap_client_observe */
+    int have_seq;                                                               /**< Flag to indicate if a notification has been delivered */
+    unsigned seq;                                                               /**< Observe sequence number of the last notification delivered */
+    struct timespec seq_time;                                                   /**< The time (CLOCK_MONOTONIC) that the last notification was delivered */
+    struct timespec renew;                                                      /**< The time (CLOCK_MONOTONIC) at which the registration is re-sent */
+    unsigned num_retries;                                                       /**< Number of registration requests sent without a response */
+    unsigned heap_index;                                                        /**< Index of this subscription in the renewal heap */
+    struct coap_client_obs *next;                                               /**< Pointer to the next subscription in the same hash bucket */
+    struct coap_client_obs *id_next;                                            /**< Pointer to the next subscription in the same message ID hash bucket */
+}
+coap_client_obs_t;
 
 /**
  *  @brief Client structure
@@ -55,13 +114,26 @@ typedef struct
     int timer_fd;                                                               /**< Timer file descriptor */
     struct timespec timeout;                                                    /**< Timeout value */
     unsigned num_retrans;                                                       /**< Current number of retransmissions */
+    unsigned ack_timeout_sec;                                                   /**< Minimum delay to wait before retransmitting a confirmable message */
+    unsigned max_retransmit;                                                    /**< Maximum number of times a confirmable message can be retransmitted */
+    unsigned resp_timeout_sec;                                                  /**< Maximum amount of time to wait for a response */
+    struct timespec deadline;                                                   /**< Absolute time (CLOCK_MONOTONIC) at which an exchange is abandoned, zero for none */
+    int cancel_fd;                                                              /**< File descriptor that cancels an exchange when readable, -1 for none */
     coap_ipv_sockaddr_in_t server_sin;                                          /**< Socket structture */
     socklen_t server_sin_len;                                                   /**< Socket structure length */
     char server_host[COAP_CLIENT_HOST_BUF_LEN];                                 /**< String to hold the server host address */
     char server_port[COAP_CLIENT_PORT_BUF_LEN];                                 /**< String to hold the server port number */
+    coap_client_obs_t **obs_hash;                                               /**< Hash table of subscriptions indexed by token, allocated on first use */
+    coap_client_obs_t **obs_id_hash;                                            /**< Hash table of subscriptions indexed by the message ID of the last registration request, allocated on first use */
+    coap_client_obs_t **obs_heap;                                               /**< Binary heap of subscriptions ordered by renewal time */
+    unsigned num_obs;                                                           /**< Number of active subscriptions */
+    unsigned max_obs;                                                           /**< Allocated length of the renewal heap */
 #ifdef COAP_DTLS_EN
     gnutls_session_t session;                                                   /**< DTLS session */
-    gnutls_certificate_credentials_t cred;                                      /**< DTLS credentials */
+    gnutls_certificate_credentials_t cred;                                      /**< DTLS credentials for X.509 certificates and raw public keys */
+    gnutls_psk_client_credentials_t psk_cred;                                   /**< DTLS credentials for pre-shared keys */
+    gnutls_datum_t rpk_trust[COAP_CLIENT_RPK_MAX_TRUST];                        /**< Array of trusted server raw public keys (DER) */
+    unsigned num_rpk_trust;                                                     /**< Number of trusted server raw public keys */
     gnutls_priority_t priority;                                                 /**< DTLS priorities */
 #endif
 }
@@ -94,6 +166,51 @@ int coap_client_create(coap_client_t *client,
                        const char *crl_file_name,
                        const char *common_name);
 
+/**
+ *  @brief Initialise a client structure that uses a pre-shared key
+ *
+ *  @param[out] client Pointer to a client structure
+ *  @param[in] host Pointer to a string containing the host address of the server
+ *  @param[in] port Port number of the server
+ *  @param[in] identity String containing the PSK identity
+ *  @param[in] key Pointer to the pre-shared key
+ *  @param[in] key_len Length of the pre-shared key
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+int coap_client_create_psk(coap_client_t *client,
+                           const char *host,
+                           const char *port,
+                           const char *identity,
+                           const unsigned char *key,
+                           size_t key_len);
+
+/**
+ *  @brief Initialise a client structure that uses raw public keys
+ *
+ *  The server is required to present one of the public
+ *  keys in the trust file.
+ *
+ *  @param[out] client Pointer to a client structure
+ *  @param[in] host Pointer to a string containing the host address of the server
+ *  @param[in] port Port number of the server
+ *  @param[in] key_file_name String containing the DTLS private key file name
+ *  @param[in] pub_key_file_name String containing the DTLS public key file name
+ *  @param[in] trust_file_name String containing the name of a file of trusted server public keys (PEM)
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+int coap_client_create_rpk(coap_client_t *client,
+                           const char *host,
+                           const char *port,
+                           const char *key_file_name,
+                           const char *pub_key_file_name,
+                           const char *trust_file_name);
+
 #else  /* !COAP_DTLS_EN */
 
 /**
@@ -120,6 +237,46 @@ int coap_client_create(coap_client_t *client,
  */
 void coap_client_destroy(coap_client_t *client);
 
+/**
+ *  @brief Override the default transmission parameters in a client structure
+ *
+ *  The new values apply to subsequent exchanges.
+ *
+ *  @param[in,out] client Pointer to a client structure
+ *  @param[in] ack_timeout_sec Minimum delay to wait before retransmitting a confirmable message
+ *  @param[in] max_retransmit Maximum number of times a confirmable message can be retransmitted
+ *  @param[in] resp_timeout_sec Maximum amount of time to wait for a response
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+int coap_client_set_timeouts(coap_client_t *client, unsigned ack_timeout_sec, unsigned max_retransmit, unsigned resp_timeout_sec);
+
+/**
+ *  @brief Set the deadline for subsequent exchanges
+ *
+ *  An exchange that is still waiting for an acknowledgement
+ *  or a response when the deadline passes returns -ETIMEDOUT
+ *  regardless of the transmission parameters.
+ *
+ *  @param[in,out] client Pointer to a client structure
+ *  @param[in] deadline Absolute time measured against CLOCK_MONOTONIC or NULL to clear the deadline
+ */
+void coap_client_set_deadline(coap_client_t *client, const struct timespec *deadline);
+
+/**
+ *  @brief Set a file descriptor that cancels subsequent exchanges
+ *
+ *  An exchange that is still waiting for an acknowledgement
+ *  or a response when the file descriptor becomes readable
+ *  returns -ECANCELED. The file descriptor is not read.
+ *
+ *  @param[in,out] client Pointer to a client structure
+ *  @param[in] fd File descriptor or -1 to clear the cancellation file descriptor
+ */
+void coap_client_set_cancel_fd(coap_client_t *client, int fd);
+
 /**
  *  @brief Send a request to the server and receive the response
  *
@@ -137,4 +294,86 @@ void coap_client_destroy(coap_client_t *client);
  **/
 int coap_client_exchange(coap_client_t *client, coap_msg_t *req, coap_msg_t *resp);
 
+/**
+ *  @brief Check that the server is reachable
+ *
+ *  Send an empty confirmable message (CoAP ping) to the
+ *  server and wait for the matching reset or acknowledgement
+ *  message using the normal retransmission schedule.
+ *
+ *  @param[in,out] client Pointer to a client structure
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ **/
+int coap_client_ping(coap_client_t *client);
+
+/**
+ *  @brief Register interest in a resource (RFC 7641)
+ *
+ *  Send the request with an Observe option and keep the
+ *  registration alive. Notifications are delivered to the
+ *  notify call-back function from coap_client_run or from
+ *  an exchange that receives them. Reordered notifications
+ *  are discarded. The registration is re-sent when Max-Age
+ *  passes without a notification and when it is not answered.
+ *
+ *  The subscription ends when a notification without an
+ *  Observe option or with an error code is delivered, when
+ *  the server answers the registration with a reset message,
+ *  which is passed to the notify call-back function, or when
+ *  the notify call-back function returns a non-zero value.
+ *  The structure pointed to by obs is freed at that point.
+ *
+ *  All subscriptions share the socket and the timer of the
+ *  client structure.
+ *
+ *  @param[in,out] client Pointer to a client structure
+ *  @param[in,out] req Pointer to a GET request message
+ *  @param[in] notify Call-back function to handle notifications
+ *  @param[in] data Pointer passed to the notify call-back function in the subscription structure
+ *  @param[out] obs Pointer to receive the subscription or NULL
+ *
+ *  This function sets the message ID and token fields of
+ *  the request message overriding any values set by the
+ *  calling function.
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+int coap_client_observe(coap_client_t *client,
+                        coap_msg_t *req,
+                        int (* notify)(coap_client_obs_t *, coap_msg_t *),
+                        void *data,
+                        coap_client_obs_t **obs);
+
+/**
+ *  @brief End a subscription
+ *
+ *  The subscription is forgotten and the next notification
+ *  for it is answered with a reset message, which ends the
+ *  registration on the server.
+ *
+ *  @param[in,out] client Pointer to a client structure
+ *  @param[in] obs Pointer to a subscription structure
+ */
+void coap_client_cancel_observe(coap_client_t *client, coap_client_obs_t *obs);
+
+/**
+ *  @brief Deliver notifications and keep subscriptions registered
+ *
+ *  Wait for notifications and re-send registrations that are
+ *  due until no subscriptions remain, the deadline passes or
+ *  the cancellation file descriptor becomes readable.
+ *
+ *  @param[in,out] client Pointer to a client structure
+ *
+ *  @returns Operation status
+ *  @retval 0 No subscriptions remain
+ *  @retval <0 Error
+ */
+int coap_client_run(coap_client_t *client);
+
 #endif
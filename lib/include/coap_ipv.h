@@ -43,6 +43,7 @@
 #define COAP_IPV_SIN_PORT    sin6_port
 
 typedef struct sockaddr_in6  coap_ipv_sockaddr_in_t;
+typedef struct in6_addr      coap_ipv_in_addr_t;
 
 #else  /* COAP_IP4 */
 
@@ -51,6 +52,7 @@ typedef struct sockaddr_in6  coap_ipv_sockaddr_in_t;
 #define COAP_IPV_SIN_PORT    sin_port
 
 typedef struct sockaddr_in   coap_ipv_sockaddr_in_t;
+typedef struct in_addr       coap_ipv_in_addr_t;
 
 #endif  /* COAP_IP6 */
 
@@ -42,6 +42,7 @@
 #define COAP_MSG_MAX_CODE_CLASS                7                                /**< Maximum code class */
 #define COAP_MSG_MAX_CODE_DETAIL               31                               /**< Maximum code detail */
 #define COAP_MSG_MAX_MSG_ID                    ((1 << 16) - 1)                  /**< Maximum message ID */
+#define COAP_MSG_MAX_OPS                       256                              /**< Maximum number of options in a message */
 
 #define COAP_MSG_OP_URI_PATH_NUM               11                               /**< Uri-path option number */
 #define COAP_MSG_OP_URI_PATH_MAX_LEN           256                              /**< Maximum buffer length for a reconstructed URI path */
@@ -164,6 +165,7 @@ typedef enum
     COAP_MSG_URI_HOST = 3,                                                      /**< URI-Host option number */
     COAP_MSG_ETAG = 4,                                                          /**< Entity-Tag option number */
     COAP_MSG_IF_NONE_MATCH = 5,                                                 /**< If-None-Match option number */
+    COAP_MSG_OBSERVE = 6,                                                       /**< Observe option number (RFC 7641) */
     COAP_MSG_URI_PORT = 7,                                                      /**< URI-Port option number */
     COAP_MSG_LOCATION_PATH = 8,                                                 /**< Location-Path option number */
     COAP_MSG_URI_PATH = 11,                                                     /**< URI-Path option number */
@@ -197,6 +199,7 @@ typedef struct
 {
     coap_msg_op_t *first;                                                       /**< Pointer to the first option structure in the list */
     coap_msg_op_t *last;                                                        /**< Pointer to the last option structure in the list */
+    unsigned num;                                                               /**< Number of options in the list */
 }
 coap_msg_op_list_t;
 
@@ -362,7 +365,12 @@ int coap_msg_set_msg_id(coap_msg_t *msg, unsigned msg_id);
 int coap_msg_set_token(coap_msg_t *msg, char *buf, size_t len);
 
 /**
- *  @brief Add a token to a message structure
+ *  @brief Add an option to a message structure
+ *
+ *  Options are kept in order of option number. Adding an
+ *  option with a number no less than that of the last option
+ *  takes constant time. A message holds at most
+ *  COAP_MSG_MAX_OPS options.
  *
  *  @param[in,out] msg Pointer to a message structure
  *  @param[in] num Option number
@@ -0,0 +1,194 @@
+/*
+ * Copyright (c) 2015 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ *  @file coap_pub.h
+ *
+ *  @brief Include file for the FreeCoAP non-confirmable publisher library
+ *
+ *  A publisher sends non-confirmable messages to one or more
+ *  destinations without waiting for replies. Messages are
+ *  formatted into a batch as they are published and the batch
+ *  is sent with a single sendmmsg call once it holds a given
+ *  number of messages or its oldest message reaches a given age.
+ *
+ *  Each destination is paced so that the average data rate
+ *  towards it does not exceed its PROBING_RATE (RFC7252 section
+ *  4.7). Messages that would exceed the rate stay in the batch
+ *  until the destination can accept them.
+ */
+
+#ifndef COAP_PUB_H
+#define COAP_PUB_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include "coap_msg.h"
+#include "coap_ipv.h"
+
+#define COAP_PUB_MAX_BATCH     64                                               /**< Maximum number of messages in a batch */
+#define COAP_PUB_MAX_DEST      16                                               /**< Maximum number of destinations */
+#define COAP_PUB_PROBING_RATE  1                                                /**< Default PROBING_RATE (bytes/sec) towards a destination */
+
+#define coap_pub_get_num_sent(pub)     ((pub)->num_sent)                        /**< Get the number of messages sent */
+#define coap_pub_get_num_queued(pub)   ((pub)->num_queued)                      /**< Get the number of messages waiting in the batch */
+
+/**
+ *  @brief Publisher destination structure
+ */
+typedef struct
+{
+    coap_ipv_sockaddr_in_t sin;                                                 /**< Socket structure for the destination */
+    socklen_t sin_len;                                                          /**< Socket structure length for the destination */
+    unsigned probing_rate;                                                      /**< Maximum average data rate (bytes/sec) towards the destination */
+    uint64_t next_ns;                                                           /**< Earliest time (nsec) at which the next message may be sent */
+}
+coap_pub_dest_t;
+
+/**
+ *  @brief Publisher message slot structure
+ */
+typedef struct
+{
+    char buf[COAP_MSG_MAX_BUF_LEN];                                             /**< Formatted message */
+    size_t len;                                                                 /**< Length of the formatted message */
+    unsigned dest;                                                              /**< Index of the destination */
+}
+coap_pub_slot_t;
+
+/**
+ *  @brief Publisher structure
+ */
+typedef struct
+{
+    int sd;                                                                     /**< Socket descriptor */
+    unsigned batch;                                                             /**< Number of messages that triggers a flush */
+    uint64_t flush_ns;                                                          /**< Age (nsec) of the oldest message that triggers a flush */
+    uint64_t first_ns;                                                          /**< Time (nsec) at which the oldest message was queued */
+    unsigned msg_id;                                                            /**< Message ID of the most recent message */
+    coap_pub_dest_t dest[COAP_PUB_MAX_DEST];                                    /**< Array of destinations */
+    unsigned num_dest;                                                          /**< Number of destinations */
+    coap_pub_slot_t slot[COAP_PUB_MAX_BATCH];                                   /**< Array of message slots */
+    unsigned num_queued;                                                        /**< Number of messages waiting in the batch */
+    unsigned long num_sent;                                                     /**< Number of messages sent */
+}
+coap_pub_t;
+
+/**
+ *  @brief Initialise a publisher structure
+ *
+ *  @param[out] pub Pointer to a publisher structure
+ *  @param[in] batch Number of messages that triggers a flush (1 to COAP_PUB_MAX_BATCH)
+ *  @param[in] flush_usec Age (usec) of the oldest message that triggers a flush
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+int coap_pub_create(coap_pub_t *pub, unsigned batch, unsigned flush_usec);
+
+/**
+ *  @brief Deinitialise a publisher structure
+ *
+ *  Messages that are still waiting in the batch are discarded.
+ *
+ *  @param[in,out] pub Pointer to a publisher structure
+ */
+void coap_pub_destroy(coap_pub_t *pub);
+
+/**
+ *  @brief Add a destination
+ *
+ *  The destination starts with the default PROBING_RATE.
+ *
+ *  @param[in,out] pub Pointer to a publisher structure
+ *  @param[in] host Pointer to a string containing the host address of the destination
+ *  @param[in] port Port number of the destination as a string
+ *
+ *  @returns Destination index or error code
+ *  @retval >=0 Destination index
+ *  @retval <0 Error
+ */
+int coap_pub_add_dest(coap_pub_t *pub, const char *host, const char *port);
+
+/**
+ *  @brief Set the PROBING_RATE towards a destination
+ *
+ *  @param[in,out] pub Pointer to a publisher structure
+ *  @param[in] dest Destination index
+ *  @param[in] probing_rate Maximum average data rate (bytes/sec)
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+int coap_pub_set_probing_rate(coap_pub_t *pub, unsigned dest, unsigned probing_rate);
+
+/**
+ *  @brief Publish a non-confirmable message
+ *
+ *  Assign a message ID to the message, format it into the
+ *  batch and flush the batch if it is full or old enough.
+ *  The message can be reused as soon as this returns.
+ *
+ *  @param[in,out] pub Pointer to a publisher structure
+ *  @param[in] dest Destination index
+ *  @param[in,out] msg Pointer to a non-confirmable message
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval -ENOBUFS The batch is full of messages held back by pacing
+ *  @retval <0 Error
+ */
+int coap_pub_publish(coap_pub_t *pub, unsigned dest, coap_msg_t *msg);
+
+/**
+ *  @brief Flush the batch if its oldest message is old enough
+ *
+ *  This should be called periodically when messages are not
+ *  published often enough to fill the batch.
+ *
+ *  @param[in,out] pub Pointer to a publisher structure
+ *
+ *  @returns Number of messages sent or error code
+ *  @retval >=0 Number of messages sent
+ *  @retval <0 Error
+ */
+int coap_pub_poll(coap_pub_t *pub);
+
+/**
+ *  @brief Send every message in the batch that pacing allows
+ *
+ *  @param[in,out] pub Pointer to a publisher structure
+ *
+ *  @returns Number of messages sent or error code
+ *  @retval >=0 Number of messages sent
+ *  @retval <0 Error
+ */
+int coap_pub_flush(coap_pub_t *pub);
+
+#endif
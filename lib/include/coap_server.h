@@ -43,9 +43,46 @@
 #include "coap_msg.h"
 #include "coap_ipv.h"
 
+#define COAP_SERVER_MAX_NUM_TRANS     512                                       /**< Upper limit for COAP_SERVER_NUM_TRANS, the timer file descriptor of each transaction must fit in the fd_set used by coap_server_run */
+#ifndef COAP_SERVER_NUM_TRANS
 #define COAP_SERVER_NUM_TRANS         8                                         /**< Maximum number of active transactions per server */
+#endif
+#if COAP_SERVER_NUM_TRANS > COAP_SERVER_MAX_NUM_TRANS
+#error "COAP_SERVER_NUM_TRANS must not exceed COAP_SERVER_MAX_NUM_TRANS"
+#endif
 #define COAP_SERVER_ADDR_BUF_LEN      128                                       /**< Buffer length for host addresses */
 #define COAP_SERVER_DIAG_PAYLOAD_LEN  128                                       /**< Buffer length for diagnostic payloads */
+#define COAP_SERVER_NUM_BUCKETS       256                                       /**< Number of per-client token buckets used for admission control */
+#define COAP_SERVER_BUCKET_WAYS       4                                         /**< Number of token buckets that may hold a given client address */
+#define COAP_SERVER_MAX_AGE_OPT_LEN   6                                         /**< Buffer length for the pre-encoded Max-Age option */
+#define COAP_SERVER_NUM_RES           32                                        /**< Number of resources for which handler latency and entity-tags are tracked */
+#define COAP_SERVER_ETAG_MAX_LEN      8                                         /**< Maximum length of an entity-tag */
+#define COAP_SERVER_PSK_MAX_LEN       64                                        /**< Maximum length of a pre-shared key */
+#define COAP_SERVER_RPK_MAX_TRUST     16                                        /**< Maximum number of trusted raw public keys */
+#define COAP_SERVER_NUM_VERIFIED      32                                        /**< Number of verified client certificates that are remembered */
+#define COAP_SERVER_VERIFIED_TTL      600                                       /**< Time (sec) for which a verified client certificate is remembered */
+#define COAP_SERVER_FINGERPRINT_LEN   32                                        /**< Length of a SHA-256 certificate fingerprint */
+
+#define coap_server_get_num_shed_rate(server)  ((server)->num_shed_rate)       /**< Number of requests shed because a client exceeded its rate */
+#define coap_server_get_num_shed_busy(server)  ((server)->num_shed_busy)       /**< Number of requests shed because the server was overloaded */
+#define coap_server_get_num_verify_hit(server) ((server)->num_verify_hit)      /**< Number of client certificates accepted from the verification cache */
+
+#define coap_server_res_get_path(res)             ((res)->path)                 /**< URI path of a resource */
+#define coap_server_res_get_avg_latency(res)      ((res)->avg_latency)          /**< Moving average of the handler latency (usec) for a resource */
+#define coap_server_res_get_num_piggybacked(res)  ((res)->num_piggybacked)      /**< Number of piggy-backed responses sent for a resource */
+#define coap_server_res_get_num_separate(res)     ((res)->num_separate)         /**< Number of separate responses sent for a resource */
+#define coap_server_res_get_num_valid(res)        ((res)->num_valid)            /**< Number of 2.03 (Valid) responses sent for a resource */
+
+/**
+ *  @brief DTLS credential type enumeration
+ */
+typedef enum
+{
+    COAP_SERVER_DTLS_X509 = 0,                                                  /**< X.509 certificates */
+    COAP_SERVER_DTLS_PSK = 1,                                                   /**< Pre-shared keys */
+    COAP_SERVER_DTLS_RPK = 2                                                    /**< Raw public keys */
+}
+coap_server_dtls_type_t;
 
 /**
  *  @brief Response type enumeration
@@ -77,15 +114,97 @@ typedef struct
 }
 coap_server_path_list_t;
 
+/**
+ *  @brief Token bucket structure
+ *
+ *  Limits the request rate from one client address.
+ */
+typedef struct
+{
+    int active;                                                                 /**< Flag to indicate if this token bucket structure contains valid data */
+    coap_ipv_in_addr_t addr;                                                    /**< Client address */
+    unsigned tokens;                                                            /**< Available tokens in thousandths of a request */
+    struct timespec last_fill;                                                  /**< The time that tokens were last added */
+}
+coap_server_bucket_t;
+
+/**
+ *  @brief Resource structure
+ *
+ *  Records the handler latency and the response type
+ *  decisions for one URI path.
+ */
+typedef struct
+{
+    int active;                                                                 /**< Flag to indicate if this resource structure contains valid data */
+    unsigned long last_use;                                                     /**< Request sequence number when this resource structure was last used */
+    unsigned hits;                                                              /**< Number of recent requests, an entry with more than one is only replaced after it has aged */
+    char path[COAP_MSG_OP_URI_PATH_MAX_LEN];                                    /**< URI path */
+    unsigned avg_latency;                                                       /**< Moving average of the handler latency (usec) */
+    unsigned long num_piggybacked;                                              /**< Number of piggy-backed responses */
+    unsigned long num_separate;                                                 /**< Number of separate responses */
+    unsigned long num_valid;                                                    /**< Number of 2.03 (Valid) responses */
+    char etag[COAP_SERVER_ETAG_MAX_LEN];                                        /**< Current entity-tag */
+    unsigned etag_len;                                                          /**< Length of the current entity-tag, 0 if unknown */
+}
+coap_server_res_t;
+
+/**
+ *  @brief Response template structure
+ *
+ *  Holds a pre-encoded response whose code, options and
+ *  payload are fixed. Only the type, message ID and token
+ *  are filled in when it is sent.
+ */
+typedef struct
+{
+    unsigned code;                                                              /**< Encoded code byte */
+    char buf[COAP_MSG_MAX_BUF_LEN];                                             /**< Encoded options and payload */
+    size_t len;                                                                 /**< Length of the encoded options and payload */
+    char etag[COAP_SERVER_ETAG_MAX_LEN];                                        /**< Entity-tag taken from the response */
+    unsigned etag_len;                                                          /**< Length of the entity-tag, 0 if none */
+}
+coap_server_tmpl_t;
+
+#ifdef COAP_DTLS_EN
+
+/**
+ *  @brief Verified certificate structure
+ *
+ *  Remembers a client certificate that passed verification
+ *  so that a reconnecting client is not verified again.
+ */
+typedef struct
+{
+    unsigned char fingerprint[COAP_SERVER_FINGERPRINT_LEN];                     /**< SHA-256 fingerprint of the end-entity certificate */
+    time_t expire;                                                              /**< The time after which the certificate must be verified again, 0 if unused */
+}
+coap_server_verified_t;
+
+#endif
+
 struct coap_server;
 
+/**
+ *  @brief Transaction slot structure
+ *
+ *  Holds the fields of a transaction that are read when searching
+ *  for a transaction. The slots are kept in an array parallel to
+ *  the transaction structures so that a search does not pull the
+ *  much larger transaction structures into the cache.
+ */
+typedef struct
+{
+    uint32_t key;                                                               /**< Hash of the client socket structure with the active bit set, 0 if the transaction structure is empty */
+    uint32_t last_use;                                                          /**< The time (sec) that the transaction structure was last used */
+}
+coap_server_slot_t;
+
 /**
  *  @brief Transaction structure
  */
 typedef struct coap_server_trans
 {
-    int active;                                                                 /**< Flag to indicate if this transaction structure contains valid data */
-    time_t last_use;                                                            /**< The time that this transaction structure was last used */
     int timer_fd;                                                               /**< Timer file descriptor */
     struct timespec timeout;                                                    /**< Timeout value */
     unsigned num_retrans;                                                       /**< Current number of retransmissions */
@@ -94,6 +213,8 @@ typedef struct coap_server_trans
     char client_addr[COAP_SERVER_ADDR_BUF_LEN];                                 /**< String to hold the client address */
     coap_msg_t req;                                                             /**< Last request message received for this transaction */
     coap_msg_t resp;                                                            /**< Last response message sent for this transaction */
+    char resp_buf[COAP_MSG_MAX_BUF_LEN];                                        /**< Last response sent for this transaction from a response template */
+    size_t resp_len;                                                            /**< Length of the last response sent from a response template, 0 if none */
     struct coap_server *server;                                                 /**< Pointer to the containing server structure */
 #ifdef COAP_DTLS_EN
     gnutls_session_t session;                                                   /**< DTLS session */
@@ -109,12 +230,37 @@ typedef struct coap_server
     int sd;                                                                     /**< Socket descriptor */
     unsigned msg_id;                                                            /**< Last message ID value used in a response message */
     coap_server_path_list_t sep_list;                                           /**< List of URI paths that require separate responses */
+    coap_server_slot_t slot[COAP_SERVER_NUM_TRANS];                             /**< Array of transaction slot structures, parallel to trans */
     coap_server_trans_t trans[COAP_SERVER_NUM_TRANS];                           /**< Array of transaction structures */
     int (* handle)(struct coap_server *, coap_msg_t *, coap_msg_t *);           /**< Call-back function to handle requests and generate responses */
+    unsigned rate;                                                              /**< Sustained requests per second admitted from each client address, 0 for no limit */
+    unsigned burst;                                                             /**< Maximum burst of requests admitted from each client address */
+    unsigned busy_watermark;                                                    /**< Percentage of time spent processing above which requests are shed, 0 for none */
+    unsigned busy_pct;                                                          /**< Moving average of the percentage of time spent processing */
+    uint64_t busy_ns;                                                           /**< Time spent processing in the current measurement window */
+    uint64_t window_ns;                                                         /**< Length of the current measurement window */
+    unsigned long num_shed_rate;                                                /**< Number of requests shed because a client exceeded its rate */
+    unsigned long num_shed_busy;                                                /**< Number of requests shed because the server was overloaded */
+    char max_age_opt[COAP_SERVER_MAX_AGE_OPT_LEN];                              /**< Pre-encoded Max-Age option for 5.03 responses */
+    unsigned max_age_opt_len;                                                   /**< Length of the pre-encoded Max-Age option */
+    coap_server_bucket_t bucket[COAP_SERVER_NUM_BUCKETS];                       /**< Array of token bucket structures */
+    unsigned sep_budget;                                                        /**< Handler latency (msec) above which separate responses are sent, 0 to disable */
+    unsigned long res_seq;                                                      /**< Request sequence number used to find the least recently used resource */
+    coap_server_res_t res[COAP_SERVER_NUM_RES];                                 /**< Array of resource structures */
+    const coap_server_tmpl_t *resp_tmpl;                                        /**< Response template set by the handle call-back function for the current request */
+    int cond_resp;                                                              /**< Flag to indicate if conditional requests are answered from the entity-tags supplied by the application */
 #ifdef COAP_DTLS_EN
-    gnutls_certificate_credentials_t cred;                                      /**< DTLS credentials */
+    coap_server_dtls_type_t dtls_type;                                          /**< DTLS credential type */
+    gnutls_certificate_credentials_t cred;                                      /**< DTLS credentials for X.509 certificates and raw public keys */
+    gnutls_psk_server_credentials_t psk_cred;                                   /**< DTLS credentials for pre-shared keys */
+    int (* psk_lookup)(const char *, unsigned char *, size_t);                  /**< Call-back function to find the pre-shared key for an identity */
+    gnutls_datum_t rpk_trust[COAP_SERVER_RPK_MAX_TRUST];                        /**< Array of trusted client raw public keys (DER) */
+    unsigned num_rpk_trust;                                                     /**< Number of trusted client raw public keys */
     gnutls_priority_t priority;                                                 /**< DTLS priorities */
     gnutls_dh_params_t dh_params;                                               /**< Diffie-Hellman parameters */
+    coap_server_verified_t verified[COAP_SERVER_NUM_VERIFIED];                  /**< Array of verified certificate structures */
+    unsigned verified_index;                                                    /**< Index of the next verified certificate structure to replace */
+    unsigned long num_verify_hit;                                               /**< Number of client certificates accepted from the verification cache */
 #endif
 }
 coap_server_t;
@@ -124,6 +270,12 @@ coap_server_t;
 /**
  *  @brief Initialise a server structure
  *
+ *  The trust file and the certificate revocation list file
+ *  are read here. Client certificates verified against them
+ *  are remembered until the server structure is destroyed,
+ *  so changes to the files take effect when a new server
+ *  structure is created.
+ *
  *  @param[out] server Pointer to a server structure
  *  @param[in] handle Call-back function to handle client requests
  *  @param[in] host Pointer to a string containing the host address of the server
@@ -146,6 +298,58 @@ int coap_server_create(coap_server_t *server,
                        const char *trust_file_name,
                        const char *crl_file_name);
 
+/**
+ *  @brief Initialise a server structure that uses pre-shared keys
+ *
+ *  The DTLS handshake does no public key operations.
+ *  Clients identify themselves with a PSK identity and the
+ *  server finds the matching key with the psk_lookup call-back
+ *  function, which is called once per handshake and should
+ *  use a fast lookup such as a hash table.
+ *
+ *  @param[out] server Pointer to a server structure
+ *  @param[in] handle Call-back function to handle client requests
+ *  @param[in] host Pointer to a string containing the host address of the server
+ *  @param[in] port Port number of the server
+ *  @param[in] psk_lookup Call-back function that copies the key for an identity into a buffer and returns the key length, or returns <0 if the identity is unknown
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+int coap_server_create_psk(coap_server_t *server,
+                           int (* handle)(coap_server_t *, coap_msg_t *, coap_msg_t *),
+                           const char *host,
+                           const char *port,
+                           int (* psk_lookup)(const char *, unsigned char *, size_t));
+
+/**
+ *  @brief Initialise a server structure that uses raw public keys
+ *
+ *  The server and the clients authenticate with bare public
+ *  keys (RFC 7250) instead of certificate chains. Clients are
+ *  required to present one of the public keys in the trust file.
+ *
+ *  @param[out] server Pointer to a server structure
+ *  @param[in] handle Call-back function to handle client requests
+ *  @param[in] host Pointer to a string containing the host address of the server
+ *  @param[in] port Port number of the server
+ *  @param[in] key_file_name String containing the DTLS private key file name
+ *  @param[in] pub_key_file_name String containing the DTLS public key file name
+ *  @param[in] trust_file_name String containing the name of a file of trusted client public keys (PEM)
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+int coap_server_create_rpk(coap_server_t *server,
+                           int (* handle)(coap_server_t *, coap_msg_t *, coap_msg_t *),
+                           const char *host,
+                           const char *port,
+                           const char *key_file_name,
+                           const char *pub_key_file_name,
+                           const char *trust_file_name);
+
 #else  /* !COAP_DTLS_EN */
 
 /**
@@ -195,6 +399,142 @@ unsigned coap_server_get_next_msg_id(coap_server_t *server);
  */ 
 int coap_server_add_sep_resp_uri_path(coap_server_t *server, const char *str);
 
+/**
+ *  @brief Initialise a response template from a message
+ *
+ *  The message is encoded once. The type, message ID and
+ *  token of the message are ignored.
+ *
+ *  @param[out] tmpl Pointer to a response template structure
+ *  @param[in] msg Pointer to a message structure containing the response
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+int coap_server_tmpl_create(coap_server_tmpl_t *tmpl, coap_msg_t *msg);
+
+/**
+ *  @brief Respond to the current request with a response template
+ *
+ *  Called from the handle call-back function instead of filling
+ *  in the response message. The template must remain valid
+ *  until the handle call-back function returns.
+ *
+ *  @param[in,out] server Pointer to a server structure
+ *  @param[in] tmpl Pointer to a response template structure
+ */
+void coap_server_set_resp_tmpl(coap_server_t *server, const coap_server_tmpl_t *tmpl);
+
+/**
+ *  @brief Set the current entity-tag of a resource
+ *
+ *  The entity-tag is also taken from the ETag option of a
+ *  successful response template returned by the handle
+ *  call-back function, and withdrawn by a successful
+ *  response template without an ETag option. Other
+ *  responses are not inspected, so the application must
+ *  call this function whenever the representation changes.
+ *  A resource holding an entity-tag is never forgotten.
+ *
+ *  When conditional responses are enabled with
+ *  coap_server_set_cond_resp, the server answers without
+ *  calling the handle call-back function:
+ *
+ *  - a GET request carrying a matching ETag option with 2.03 (Valid)
+ *  - a request whose If-Match option matches nothing, or whose
+ *    If-None-Match option is present, with 4.12 (Precondition Failed)
+ *
+ *  Entity-tags are recorded per URI path, so requests carrying
+ *  a Uri-Query or Accept option are always passed to the handle
+ *  call-back function and response templates returned for them
+ *  are ignored.
+ *
+ *  @param[in,out] server Pointer to a server structure
+ *  @param[in] path String representation of a URI path
+ *  @param[in] etag Pointer to the entity-tag
+ *  @param[in] len Length of the entity-tag, 0 to forget it
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval -EINVAL Invalid argument
+ *  @retval -ENOSPC Every resource structure holds an entity-tag
+ */
+int coap_server_set_etag(coap_server_t *server, const char *path, const char *etag, unsigned len);
+
+/**
+ *  @brief Answer conditional requests from the entity-tags supplied by the application
+ *
+ *  Disabled by default. See coap_server_set_etag.
+ *
+ *  @param[in,out] server Pointer to a server structure
+ *  @param[in] enable 1 to enable, 0 to disable
+ */
+void coap_server_set_cond_resp(coap_server_t *server, int enable);
+
+/**
+ *  @brief Choose between piggy-backed and separate responses adaptively
+ *
+ *  The server keeps a moving average of the time taken by the
+ *  handle call-back function for each URI path. A confirmable
+ *  request for a URI path whose average exceeds the budget is
+ *  acknowledged before the handle call-back function is called
+ *  and answered with a separate response. Other requests are
+ *  answered with piggy-backed responses unless the URI path was
+ *  added with coap_server_add_sep_resp_uri_path.
+ *
+ *  @param[in,out] server Pointer to a server structure
+ *  @param[in] budget Handler latency (msec), 0 to disable
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval -EINVAL The budget is not below the acknowledgement timeout
+ */
+int coap_server_set_sep_resp_budget(coap_server_t *server, unsigned budget);
+
+/**
+ *  @brief Get the statistics recorded for a resource
+ *
+ *  A URI path is recorded once it has been answered with a
+ *  success response. When all the resource structures are in
+ *  use, a URI path that has been requested more than once is
+ *  not replaced while a URI path that has been requested only
+ *  once can be replaced instead.
+ *
+ *  @param[in] server Pointer to a server structure
+ *  @param[in] index Index of the resource, from 0 to COAP_SERVER_NUM_RES - 1
+ *
+ *  @returns Pointer to a resource structure
+ *  @retval NULL No resource is recorded at the index
+ */
+const coap_server_res_t *coap_server_get_res(coap_server_t *server, unsigned index);
+
+/**
+ *  @brief Configure admission control
+ *
+ *  Requests are answered with a 5.03 (Service Unavailable) response
+ *  carrying a Max-Age option, without calling the handle call-back
+ *  function, when the client address has exceeded its rate or when
+ *  the server spends more than the busy watermark of its time
+ *  processing messages. Acknowledgements, resets and pings are
+ *  always admitted.
+ *
+ *  With DTLS, a client address that exceeds its rate cannot
+ *  start a new handshake and its datagrams are dropped. The
+ *  handshake itself does not use up any tokens.
+ *
+ *  @param[in,out] server Pointer to a server structure
+ *  @param[in] rate Sustained requests per second admitted from each client address, 0 for no limit
+ *  @param[in] burst Maximum burst of requests admitted from each client address
+ *  @param[in] busy_watermark Percentage of time spent processing above which requests are shed, 0 for none
+ *  @param[in] max_age Max-Age value (sec) telling clients when to retry
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval -EINVAL Invalid argument
+ */
+int coap_server_set_admission(coap_server_t *server, unsigned rate, unsigned burst, unsigned busy_watermark, unsigned max_age);
+
 /**
  *  @brief Run the server
  *
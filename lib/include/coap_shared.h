@@ -0,0 +1,234 @@
+/*
+ * Copyright (c) 2015 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ *  @file coap_shared.h
+ *
+ *  @brief Include file for the FreeCoAP shared client library
+ *
+ *  A shared client can be used concurrently by any number of
+ *  application threads. Each thread submits an exchange and
+ *  then waits for, or polls, its own completion. A single
+ *  internal I/O thread sends all requests over one socket,
+ *  retransmits confirmable requests and matches responses
+ *  to the exchanges that are in flight.
+ *
+ *  Submission uses a lock-free multiple-producer single-consumer
+ *  queue and completion is signalled through a futex in each
+ *  exchange so neither path takes a lock.
+ */
+
+#ifndef COAP_SHARED_H
+#define COAP_SHARED_H
+
+#include <stdatomic.h>
+#include <time.h>
+#include <pthread.h>
+#include "coap_msg.h"
+#include "coap_ipv.h"
+
+#define COAP_SHARED_TOKEN_LEN   4                                               /**< Length of the token used for an exchange */
+#define COAP_SHARED_HASH_SIZE   256                                             /**< Number of hash buckets used to find an exchange from its message ID or token */
+
+#define coap_shared_req_get_resp(sreq)  ((sreq)->resp)                          /**< Get the response message from an exchange */
+#define coap_shared_get_num_exchanges(shared)  ((shared)->num_exchanges)        /**< Get the number of exchanges completed by the I/O thread */
+
+/**
+ *  @brief Shared client exchange states
+ */
+typedef enum
+{
+    COAP_SHARED_REQ_IDLE = 0,                                                   /**< The exchange has not been submitted */
+    COAP_SHARED_REQ_PENDING = 1,                                                /**< The exchange has been submitted and has not completed */
+    COAP_SHARED_REQ_DONE = 2                                                    /**< The exchange has completed */
+}
+coap_shared_req_state_t;
+
+/**
+ *  @brief Shared client exchange structure
+ *
+ *  An exchange is owned by the application thread that submits
+ *  it. The I/O thread owns it from submission until completion.
+ */
+typedef struct coap_shared_req
+{
+    _Atomic(struct coap_shared_req *) next;                                     /**< Next exchange in the submission queue */
+    coap_msg_t *resp;                                                           /**< Response message */
+    coap_ipv_sockaddr_in_t server_sin;                                          /**< Socket structure for the server */
+    socklen_t server_sin_len;                                                   /**< Socket structure length for the server */
+    char buf[COAP_MSG_MAX_BUF_LEN];                                             /**< Formatted request */
+    size_t len;                                                                 /**< Length of the formatted request */
+    unsigned type;                                                              /**< Type of the request */
+    unsigned msg_id;                                                            /**< Message ID of the request */
+    char token[COAP_SHARED_TOKEN_LEN];                                          /**< Token of the request */
+    atomic_int state;                                                           /**< Exchange state, also used as the futex word */
+    int result;                                                                 /**< Result of the exchange */
+    int acked;                                                                  /**< Indicates whether or not a confirmable request has been acknowledged */
+    unsigned num_retrans;                                                       /**< Current number of retransmissions */
+    struct timespec timeout;                                                    /**< Current retransmission timeout */
+    struct timespec expire;                                                     /**< Time at which the current timeout expires */
+    struct coap_shared_req *id_next;                                            /**< Next exchange in the same message ID hash bucket */
+    struct coap_shared_req *token_next;                                         /**< Next exchange in the same token hash bucket */
+    struct coap_shared_req *prev;                                               /**< Previous exchange in the in-flight list */
+    struct coap_shared_req *flight_next;                                        /**< Next exchange in the in-flight list */
+}
+coap_shared_req_t;
+
+/**
+ *  @brief Shared client structure
+ */
+typedef struct
+{
+    int sd;                                                                     /**< Socket descriptor shared by all exchanges */
+    int event_fd;                                                               /**< Event descriptor used to wake the I/O thread */
+    pthread_t thread;                                                           /**< I/O thread */
+    atomic_int stop;                                                            /**< Indicates whether or not the I/O thread should exit */
+    atomic_uint msg_id;                                                         /**< Message ID of the most recent request */
+    _Atomic(coap_shared_req_t *) head;                                          /**< Most recently submitted exchange in the submission queue */
+    coap_shared_req_t *tail;                                                    /**< Oldest exchange in the submission queue, owned by the I/O thread */
+    coap_shared_req_t stub;                                                     /**< Placeholder that keeps the submission queue non-empty */
+    coap_shared_req_t *id_hash[COAP_SHARED_HASH_SIZE];                          /**< In-flight exchanges hashed by message ID */
+    coap_shared_req_t *token_hash[COAP_SHARED_HASH_SIZE];                       /**< In-flight exchanges hashed by token */
+    coap_shared_req_t *flight;                                                  /**< List of in-flight exchanges */
+    unsigned ack_timeout_sec;                                                   /**< Minimum delay to wait before retransmitting a confirmable message */
+    unsigned max_retransmit;                                                    /**< Maximum number of times a confirmable message can be retransmitted */
+    unsigned resp_timeout_sec;                                                  /**< Maximum amount of time to wait for a response */
+    unsigned long num_exchanges;                                                /**< Number of exchanges completed by the I/O thread */
+}
+coap_shared_t;
+
+/**
+ *  @brief Initialise a shared client structure
+ *
+ *  Open a socket and start the I/O thread.
+ *
+ *  @param[out] shared Pointer to a shared client structure
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+int coap_shared_create(coap_shared_t *shared);
+
+/**
+ *  @brief Deinitialise a shared client structure
+ *
+ *  Stop the I/O thread and close the socket. Exchanges
+ *  that have not completed fail with -ECANCELED. No
+ *  thread may submit an exchange once this has started.
+ *
+ *  @param[in,out] shared Pointer to a shared client structure
+ */
+void coap_shared_destroy(coap_shared_t *shared);
+
+/**
+ *  @brief Set the timeouts used by subsequently submitted exchanges
+ *
+ *  This must be called before any exchange is submitted.
+ *
+ *  @param[in,out] shared Pointer to a shared client structure
+ *  @param[in] ack_timeout_sec Minimum delay to wait before retransmitting a confirmable message
+ *  @param[in] max_retransmit Maximum number of times a confirmable message can be retransmitted
+ *  @param[in] resp_timeout_sec Maximum amount of time to wait for a response
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+int coap_shared_set_timeouts(coap_shared_t *shared, unsigned ack_timeout_sec, unsigned max_retransmit, unsigned resp_timeout_sec);
+
+/**
+ *  @brief Submit an exchange
+ *
+ *  Resolve the host and port, assign a message ID and token
+ *  to the request, format it and queue it for the I/O thread.
+ *  This can be called from any thread. The request can be
+ *  reused as soon as this returns. The response message and
+ *  the exchange structure must not be touched until the
+ *  exchange has completed.
+ *
+ *  @param[in,out] shared Pointer to a shared client structure
+ *  @param[out] sreq Pointer to an exchange structure
+ *  @param[in] host Pointer to a string containing the host address of the server
+ *  @param[in] port Port number of the server as a string
+ *  @param[in,out] req Pointer to the request message
+ *  @param[out] resp Pointer to the response message
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+int coap_shared_submit(coap_shared_t *shared,
+                       coap_shared_req_t *sreq,
+                       const char *host,
+                       const char *port,
+                       coap_msg_t *req,
+                       coap_msg_t *resp);
+
+/**
+ *  @brief Check whether or not an exchange has completed
+ *
+ *  @param[in] sreq Pointer to an exchange structure
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval -EINPROGRESS The exchange has not completed
+ *  @retval <0 Error
+ */
+int coap_shared_poll(coap_shared_req_t *sreq);
+
+/**
+ *  @brief Wait for an exchange to complete
+ *
+ *  @param[in] sreq Pointer to an exchange structure
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+int coap_shared_wait(coap_shared_req_t *sreq);
+
+/**
+ *  @brief Submit an exchange and wait for it to complete
+ *
+ *  @param[in,out] shared Pointer to a shared client structure
+ *  @param[in] host Pointer to a string containing the host address of the server
+ *  @param[in] port Port number of the server as a string
+ *  @param[in,out] req Pointer to the request message
+ *  @param[out] resp Pointer to the response message
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+int coap_shared_exchange(coap_shared_t *shared,
+                         const char *host,
+                         const char *port,
+                         coap_msg_t *req,
+                         coap_msg_t *resp);
+
+#endif
@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2015 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ *  @file coap_sim.h
+ *
+ *  @brief Include file for the FreeCoAP simulation library
+ *
+ *  Runs clients and servers in one process on a virtual clock.
+ *  When the client and server libraries are built with COAP_SIM
+ *  defined, their sockets, timers and clocks are replaced by the
+ *  functions in this file (see coap_sim_wrap.h). Datagrams are
+ *  passed in memory with a configurable loss rate and delay.
+ *
+ *  Simulated threads are coroutines with their own stacks that
+ *  all run on the thread that calls coap_sim_init, driven by a
+ *  single event loop on the virtual clock. A simulated thread
+ *  runs until it blocks in select, sleeps or returns. When no
+ *  thread can run, the virtual clock jumps to the next timer
+ *  expiry or datagram delivery. For a given seed and thread
+ *  creation order, a simulation is reproducible.
+ *
+ *  A simulated thread costs a stack of which only the touched
+ *  pages are committed, so the number of devices is bounded by
+ *  memory rather than by the system's thread limit (100000
+ *  devices take about 600 MB).
+ *
+ *  Only the thread that calls coap_sim_init and the simulated
+ *  threads may call into the simulation. A simulated thread
+ *  must not block outside the simulation, e.g. on a mutex held
+ *  by another simulated thread. DTLS is not supported.
+ */
+
+#ifndef COAP_SIM_H
+#define COAP_SIM_H
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+
+#define COAP_SIM_FD_BASE        0x40000000                                      /**< Value of the first simulated file descriptor */
+#define COAP_SIM_FD_SET_MAX     64                                              /**< Maximum number of file descriptors in a simulated file descriptor set */
+
+/**
+ *  @brief Simulated file descriptor set structure
+ *
+ *  Replaces fd_set so that file descriptors are not limited to
+ *  FD_SETSIZE.
+ */
+typedef struct
+{
+    int fd[COAP_SIM_FD_SET_MAX];                                                /**< Array of file descriptors */
+    unsigned num;                                                               /**< Number of file descriptors in the set */
+}
+coap_sim_fd_set_t;
+
+/**
+ *  @brief Simulation statistics structure
+ */
+typedef struct
+{
+    uint64_t num_events;                                                        /**< Number of events processed */
+    uint64_t num_switches;                                                      /**< Number of times control passed between threads */
+    uint64_t num_sent;                                                          /**< Number of datagrams sent */
+    uint64_t num_lost;                                                          /**< Number of datagrams lost on the link */
+    uint64_t num_delivered;                                                     /**< Number of datagrams delivered to a socket */
+    uint64_t num_unreachable;                                                   /**< Number of datagrams for which no socket was found */
+    uint64_t num_overflow;                                                      /**< Number of datagrams dropped because the receive queue was full */
+}
+coap_sim_stats_t;
+
+/**
+ *  @brief Initialise the simulation
+ *
+ *  The calling thread becomes the first simulated thread.
+ *
+ *  @param[in] seed Seed for the random number generators
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+int coap_sim_init(unsigned seed);
+
+/**
+ *  @brief Set the link model applied to every datagram
+ *
+ *  @param[in] loss Probability that a datagram is lost
+ *  @param[in] delay_us Mean one-way delay (usec)
+ *  @param[in] jitter_us The delay is uniformly distributed in [delay - jitter, delay + jitter] (usec)
+ */
+void coap_sim_set_link(double loss, unsigned delay_us, unsigned jitter_us);
+
+/**
+ *  @brief Start a simulated thread
+ *
+ *  The thread first runs when the calling thread blocks.
+ *  Its stack is freed when the thread function returns.
+ *
+ *  @param[in] func Thread function
+ *  @param[in] data Argument to the thread function
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+int coap_sim_thread_create(void *(*func)(void *), void *data);
+
+/**
+ *  @brief Block the calling thread for a period of virtual time
+ *
+ *  @param[in] ms Period (msec)
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval -EDEADLK Every thread is blocked with nothing left to wake them
+ */
+int coap_sim_sleep(unsigned ms);
+
+/**
+ *  @brief Get the virtual time
+ *
+ *  @returns Time (nsec) measured against the simulated CLOCK_MONOTONIC
+ */
+uint64_t coap_sim_get_time(void);
+
+/**
+ *  @brief Get a random number from the simulation
+ *
+ *  @returns Random number in [0, RAND_MAX]
+ */
+int coap_sim_rand(void);
+
+/**
+ *  @brief Get the simulation statistics
+ *
+ *  @param[out] stats Pointer to a simulation statistics structure
+ */
+void coap_sim_get_stats(coap_sim_stats_t *stats);
+
+/* replacements for the system calls used by the client and server libraries */
+int coap_sim_socket(int domain, int type, int protocol);
+int coap_sim_bind(int sd, const struct sockaddr *addr, socklen_t addr_len);
+int coap_sim_connect(int sd, const struct sockaddr *addr, socklen_t addr_len);
+int coap_sim_setsockopt(int sd, int level, int name, const void *val, socklen_t len);
+int coap_sim_fcntl(int fd, int cmd, ...);
+int coap_sim_close(int fd);
+ssize_t coap_sim_send(int sd, const void *buf, size_t len, int flags);
+ssize_t coap_sim_sendto(int sd, const void *buf, size_t len, int flags, const struct sockaddr *addr, socklen_t addr_len);
+ssize_t coap_sim_recv(int sd, void *buf, size_t len, int flags);
+ssize_t coap_sim_recvfrom(int sd, void *buf, size_t len, int flags, struct sockaddr *addr, socklen_t *addr_len);
+int coap_sim_timerfd_create(int clock_id, int flags);
+int coap_sim_timerfd_settime(int fd, int flags, const struct itimerspec *new_value, struct itimerspec *old_value);
+int coap_sim_select(int nfds, coap_sim_fd_set_t *read_fds, coap_sim_fd_set_t *write_fds, coap_sim_fd_set_t *except_fds, struct timeval *timeout);
+void coap_sim_fd_zero(coap_sim_fd_set_t *set);
+void coap_sim_fd_set(int fd, coap_sim_fd_set_t *set);
+int coap_sim_fd_isset(int fd, const coap_sim_fd_set_t *set);
+int coap_sim_clock_gettime(clockid_t clock_id, struct timespec *ts);
+time_t coap_sim_time(time_t *t);
+void coap_sim_srand(unsigned seed);
+
+#endif
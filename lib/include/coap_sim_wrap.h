@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2015 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ *  @file coap_sim_wrap.h
+ *
+ *  @brief Replace system calls with their simulated versions
+ *
+ *  Included by the client and server libraries after all other
+ *  include files when COAP_SIM is defined.
+ */
+
+#ifndef COAP_SIM_WRAP_H
+#define COAP_SIM_WRAP_H
+
+#ifdef COAP_DTLS_EN
+#error "DTLS is not supported in the simulation"
+#endif
+
+#include <sys/select.h>
+#include "coap_sim.h"
+
+#undef FD_ZERO
+#undef FD_SET
+#undef FD_ISSET
+
+#define fd_set                          coap_sim_fd_set_t
+#define FD_ZERO(set)                    coap_sim_fd_zero(set)
+#define FD_SET(fd, set)                 coap_sim_fd_set(fd, set)
+#define FD_ISSET(fd, set)               coap_sim_fd_isset(fd, set)
+#define socket(d, t, p)                 coap_sim_socket(d, t, p)
+#define bind(s, a, l)                   coap_sim_bind(s, a, l)
+#define connect(s, a, l)                coap_sim_connect(s, a, l)
+#define setsockopt(s, l, n, v, vl)      coap_sim_setsockopt(s, l, n, v, vl)
+#define fcntl(fd, ...)                  coap_sim_fcntl(fd, __VA_ARGS__)
+#define close(fd)                       coap_sim_close(fd)
+#define send(s, b, l, f)                coap_sim_send(s, b, l, f)
+#define sendto(s, b, l, f, a, al)       coap_sim_sendto(s, b, l, f, a, al)
+#define recv(s, b, l, f)                coap_sim_recv(s, b, l, f)
+#define recvfrom(s, b, l, f, a, al)     coap_sim_recvfrom(s, b, l, f, a, al)
+#define timerfd_create(c, f)            coap_sim_timerfd_create(c, f)
+#define timerfd_settime(fd, f, n, o)    coap_sim_timerfd_settime(fd, f, n, o)
+#define select(n, r, w, e, t)           coap_sim_select(n, r, w, e, t)
+#define clock_gettime(c, ts)            coap_sim_clock_gettime(c, ts)
+#define time(t)                         coap_sim_time(t)
+#define srand(s)                        coap_sim_srand(s)
+#define rand()                          coap_sim_rand()
+
+#endif
@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2015 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ *  @file coap_trace.h
+ *
+ *  @brief Include file for the FreeCoAP static tracepoints
+ *
+ *  When COAP_TRACE is defined, USDT probes from sys/sdt.h are
+ *  placed at key events in the client and server libraries and
+ *  in the HTTP/CoAP proxy, under the provider name freecoap.
+ *  A probe that is not attached is a single nop, and its
+ *  arguments are values that are already at hand. When
+ *  COAP_TRACE is not defined the probes compile to nothing.
+ *
+ *  The peer of a server probe is the client address string and
+ *  port number. The peer of a client probe is the server host
+ *  and port strings. A token is passed as a pointer and a length.
+ *  A message ID in a datagram probe is read from the datagram.
+ *
+ *  Probe                Arguments
+ *  server_recv          addr, port, msg_id, buf, len
+ *  server_send          addr, port, msg_id, buf, len
+ *  server_parse         addr, port, msg_id, type, code, token, token_len
+ *  server_handle_entry  addr, port, msg_id, token, token_len
+ *  server_handle_exit   addr, port, msg_id, ret, resp_code
+ *  server_retransmit    addr, port, msg_id, num_retrans
+ *  server_trans_create  addr, port, index
+ *  server_trans_evict   addr, port, index
+ *  server_dtls_start    addr, port
+ *  server_dtls_end      addr, port, ret
+ *  client_recv          host, port, msg_id, buf, len
+ *  client_send          host, port, msg_id, buf, len
+ *  client_parse         host, port, msg_id, type, code, token, token_len
+ *  client_retransmit    host, port, msg_id, num_retrans
+ *  client_dtls_start    host, port
+ *  client_dtls_end      host, port, ret
+ *  proxy_http_request   con_index, addr, method, uri
+ *  proxy_exchange_start con_index, addr, host, port
+ *  proxy_exchange_end   con_index, msg_id, token, token_len, ret, resp_code
+ *
+ *  For example, to print the time taken by the request handler:
+ *
+ *  bpftrace -e 'usdt:./test_coap_server:freecoap:server_handle_entry { @s[tid] = nsecs; }
+ *               usdt:./test_coap_server:freecoap:server_handle_exit /@s[tid]/ {
+ *                   printf("%s:%d %d %d usec\n", str(arg0), arg1, arg2, (nsecs - @s[tid]) / 1000); delete(@s[tid]); }'
+ *
+ *  or with perf:
+ *
+ *  perf buildid-cache --add ./test_coap_server
+ *  perf probe -x ./test_coap_server sdt_freecoap:server_handle_entry
+ *  perf record -e sdt_freecoap:server_handle_entry -p `pidof test_coap_server`
+ */
+
+#ifndef COAP_TRACE_H
+#define COAP_TRACE_H
+
+#ifdef COAP_TRACE
+
+#include <sys/sdt.h>
+
+#define coap_trace_buf_msg_id(buf)  ((((unsigned char *)(buf))[2] << 8) | ((unsigned char *)(buf))[3])  /**< Read the message ID from a datagram of at least 4 bytes */
+
+#define coap_trace2(name, a, b)                       DTRACE_PROBE2(freecoap, name, a, b)
+#define coap_trace3(name, a, b, c)                    DTRACE_PROBE3(freecoap, name, a, b, c)
+#define coap_trace4(name, a, b, c, d)                 DTRACE_PROBE4(freecoap, name, a, b, c, d)
+#define coap_trace5(name, a, b, c, d, e)              DTRACE_PROBE5(freecoap, name, a, b, c, d, e)
+#define coap_trace6(name, a, b, c, d, e, f)           DTRACE_PROBE6(freecoap, name, a, b, c, d, e, f)
+#define coap_trace7(name, a, b, c, d, e, f, g)        DTRACE_PROBE7(freecoap, name, a, b, c, d, e, f, g)
+
+#else  /* !COAP_TRACE */
+
+#define coap_trace2(name, a, b)
+#define coap_trace3(name, a, b, c)
+#define coap_trace4(name, a, b, c, d)
+#define coap_trace5(name, a, b, c, d, e)
+#define coap_trace6(name, a, b, c, d, e, f)
+#define coap_trace7(name, a, b, c, d, e, f, g)
+
+#endif  /* COAP_TRACE */
+
+#endif
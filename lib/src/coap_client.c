@@ -42,12 +42,19 @@
 #include <sys/socket.h>
 #include <sys/timerfd.h>
 #include <sys/select.h>
+#include <sys/stat.h>
 #include <linux/types.h>
+#include <pthread.h>
 #ifdef COAP_DTLS_EN
 #include <gnutls/x509.h>
+#include <gnutls/crypto.h>
 #endif
 #include "coap_client.h"
 #include "coap_log.h"
+#include "coap_trace.h"
+#ifdef COAP_SIM
+#include "coap_sim_wrap.h"
+#endif
 
 #define COAP_CLIENT_ACK_TIMEOUT_SEC   2                                         /**< Minimum delay to wait before retransmitting a confirmable message */
 #define COAP_CLIENT_MAX_RETRANSMIT    4                                         /**< Maximum number of times a confirmable message can be retransmitted */
@@ -60,10 +67,21 @@
 #define COAP_CLIENT_DTLS_TOTAL_TIMEOUT    5000                                  /**< Total timeout (msec) for the DTLS handshake */
 #define COAP_CLIENT_DTLS_PRIORITIES       "PERFORMANCE:-VERS-TLS-ALL:+VERS-DTLS1.0:%SERVER_PRECEDENCE"
                                                                                 /**< DTLS priorities */
+#define COAP_CLIENT_DTLS_PSK_PRIORITIES   "PERFORMANCE:-VERS-TLS-ALL:+VERS-DTLS1.2:-KX-ALL:+PSK:+ECDHE-PSK:%SERVER_PRECEDENCE"
+                                                                                /**< DTLS priorities for pre-shared keys */
+#define COAP_CLIENT_DTLS_RPK_PRIORITIES   "PERFORMANCE:-VERS-TLS-ALL:+VERS-DTLS1.2:-CTYPE-ALL:+CTYPE-SRV-RAWPK:+CTYPE-CLI-RAWPK:%SERVER_PRECEDENCE"
+                                                                                /**< DTLS priorities for raw public keys */
 #endif
 
 static int rand_init = 0;                                                       /**< Indicates whether or not the random number generator has been initialised */
 
+#ifdef COAP_DTLS_EN
+static coap_client_verified_t coap_client_verified[COAP_CLIENT_NUM_VERIFIED] = {{{0}}};
+                                                                                /**< Array of verified certificate structures shared by all clients */
+static unsigned coap_client_verified_index = 0;                                 /**< Index of the next verified certificate structure to replace */
+static pthread_mutex_t coap_client_verified_lock = PTHREAD_MUTEX_INITIALIZER;   /**< Lock for the verified certificate structures */
+#endif
+
 #ifdef COAP_DTLS_EN
 
 /****************************************************************************************************
@@ -248,28 +266,209 @@ static int coap_client_dtls_handshake(coap_client_t *client)
     return -ETIMEDOUT;
 }
 
+/**
+ *  @brief Add the identity of a file to a stamp
+ *
+ *  The stamp changes if the file is replaced or modified.
+ *
+ *  @param[in] file_name String containing the file name, NULL or empty if none
+ *  @param[in,out] stamp Pointer to the stamp
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+static int coap_client_file_stamp(const char *file_name, unsigned long long *stamp)
+{
+    struct stat st = {0};
+    int ret = 0;
+
+    if ((file_name == NULL) || (file_name[0] == '\0'))
+    {
+        return 0;
+    }
+    ret = stat(file_name, &st);
+    if (ret < 0)
+    {
+        return -errno;
+    }
+    *stamp = (*stamp * 31 + st.st_ino) * 31 + st.st_size;
+    *stamp = (*stamp * 31 + st.st_mtim.tv_sec) * 31 + st.st_mtim.tv_nsec;
+    return 0;
+}
+
+/**
+ *  @brief Compute the verification cache key for a server certificate
+ *
+ *  @param[in] cert Pointer to the end-entity certificate (DER)
+ *  @param[in] common_name String containing the common name of the server
+ *  @param[in] trust_file_name String containing the DTLS trust file name
+ *  @param[in] crl_file_name String containing the DTLS certificate revocation list file name
+ *  @param[out] key Buffer to receive the key
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval -1 Error
+ */
+static int coap_client_verified_key(const gnutls_datum_t *cert,
+                                    const char *common_name,
+                                    const char *trust_file_name,
+                                    const char *crl_file_name,
+                                    unsigned char *key)
+{
+    const char *str[3] = {common_name, trust_file_name, crl_file_name};
+    gnutls_hash_hd_t hash = {0};
+    unsigned i = 0;
+    int ret = 0;
+
+    ret = gnutls_hash_init(&hash, GNUTLS_DIG_SHA256);
+    if (ret != GNUTLS_E_SUCCESS)
+    {
+        return -1;
+    }
+    gnutls_hash(hash, cert->data, cert->size);
+    for (i = 0; i < 3; i++)
+    {
+        /* include the terminating null character to separate the strings */
+        if (str[i] != NULL)
+        {
+            gnutls_hash(hash, str[i], strlen(str[i]) + 1);
+        }
+        else
+        {
+            gnutls_hash(hash, "", 1);
+        }
+    }
+    gnutls_hash_deinit(hash, key);
+    return 0;
+}
+
+/**
+ *  @brief Search the verification cache for a server certificate
+ *
+ *  @param[in] key Verification cache key for the server certificate
+ *  @param[in] file_stamp Current stamp of the trust and certificate revocation list files
+ *
+ *  @returns Search result
+ *  @retval 1 The certificate was verified recently
+ *  @retval 0 The certificate must be verified
+ */
+static int coap_client_verified_find(const unsigned char *key, unsigned long long file_stamp)
+{
+    time_t current_time = 0;
+    unsigned i = 0;
+    int found = 0;
+
+    current_time = time(NULL);
+    pthread_mutex_lock(&coap_client_verified_lock);
+    for (i = 0; i < COAP_CLIENT_NUM_VERIFIED; i++)
+    {
+        if ((coap_client_verified[i].expire > current_time)
+         && (coap_client_verified[i].file_stamp == file_stamp)
+         && (memcmp(coap_client_verified[i].key, key, COAP_CLIENT_VERIFIED_LEN) == 0))
+        {
+            found = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&coap_client_verified_lock);
+    return found;
+}
+
+/**
+ *  @brief Add a server certificate to the verification cache
+ *
+ *  The oldest entry is replaced when the cache is full.
+ *
+ *  @param[in] key Verification cache key for the server certificate
+ *  @param[in] file_stamp Current stamp of the trust and certificate revocation list files
+ *  @param[in] expiration_time Expiration time of the server certificate
+ */
+static void coap_client_verified_add(const unsigned char *key, unsigned long long file_stamp, time_t expiration_time)
+{
+    coap_client_verified_t *verified = NULL;
+    time_t expire = 0;
+
+    expire = time(NULL) + COAP_CLIENT_VERIFIED_TTL;
+    if (expiration_time < expire)
+    {
+        expire = expiration_time;
+    }
+    pthread_mutex_lock(&coap_client_verified_lock);
+    verified = &coap_client_verified[coap_client_verified_index];
+    memcpy(verified->key, key, COAP_CLIENT_VERIFIED_LEN);
+    verified->file_stamp = file_stamp;
+    verified->expire = expire;
+    coap_client_verified_index = (coap_client_verified_index + 1) % COAP_CLIENT_NUM_VERIFIED;
+    pthread_mutex_unlock(&coap_client_verified_lock);
+}
+
 /**
  *  @brief Verify the server's certificate
  *
+ *  A server certificate that was verified recently with the
+ *  same common name, trust file and certificate revocation
+ *  list file is accepted from the verification cache without
+ *  parsing the certificate chain again. The cache entry is
+ *  ignored if either file has changed since. The DTLS
+ *  handshake has already proved that the server holds the
+ *  private key.
+ *
  *  @param[in] client Pointer to a client structure
  *  @param[in] common_name String containing the common name for the server
+ *  @param[in] trust_file_name String containing the DTLS trust file name
+ *  @param[in] crl_file_name String containing the DTLS certificate revocation list file name
  *
  *  @returns Operation success
  *  @retval 0 Success
  *  @retval <0 Error
  */
-static int coap_client_dtls_verify_peer_cert(coap_client_t *client, const char *common_name)
+static int coap_client_dtls_verify_peer_cert(coap_client_t *client,
+                                             const char *common_name,
+                                             const char *trust_file_name,
+                                             const char *crl_file_name)
 {
     gnutls_certificate_type_t cert_type = 0;
     const gnutls_datum_t *cert_list = NULL;
     gnutls_x509_crt_t cert = {0};
+    unsigned long long file_stamp = 0;
+    unsigned char key[COAP_CLIENT_VERIFIED_LEN] = {0};
     unsigned cert_list_size = 0;
     unsigned status = 0;
     time_t expiration_time = 0;
     time_t activation_time = 0;
     time_t current_time = 0;
+    int cache = 0;
     int ret = 0;
 
+    cert_type = gnutls_certificate_type_get(client->session);
+    if (cert_type != GNUTLS_CRT_X509)
+    {
+        coap_log_error("The peer certificate is not an X509 certificate");
+        return -1;
+    }
+    cert_list = gnutls_certificate_get_peers(client->session, &cert_list_size);
+    if ((cert_list == NULL) || (cert_list_size == 0))
+    {
+        coap_log_error("No peer certificate found");
+        return -1;
+    }
+    /* the cache is not used if a file cannot be examined */
+    ret = coap_client_file_stamp(trust_file_name, &file_stamp);
+    if (ret == 0)
+    {
+        ret = coap_client_file_stamp(crl_file_name, &file_stamp);
+    }
+    if (ret == 0)
+    {
+        ret = coap_client_verified_key(&cert_list[0], common_name, trust_file_name, crl_file_name, key);
+    }
+    cache = (ret == 0);
+    if ((cache) && (coap_client_verified_find(key, file_stamp)))
+    {
+        coap_log_info("Peer certificate found in the verification cache");
+        return 0;
+    }
     ret = gnutls_certificate_verify_peers2(client->session, &status);
     if (ret != GNUTLS_E_SUCCESS)
     {
@@ -296,25 +495,12 @@ static int coap_client_dtls_verify_peer_cert(coap_client_t *client, const char *
         coap_log_error("The peer certificate has been revoked");
         return -1;
     }
-    cert_type = gnutls_certificate_type_get(client->session);
-    if (cert_type != GNUTLS_CRT_X509)
-    {
-        coap_log_error("The peer certificate is not an X509 certificate");
-        return -1;
-    }
     ret = gnutls_x509_crt_init(&cert);
     if (ret != GNUTLS_E_SUCCESS)
     {
         coap_log_error("Unable to initialise gnutls_x509_crt_t object");
         return -1;
     }
-    cert_list = gnutls_certificate_get_peers(client->session, &cert_list_size);
-    if (cert_list == NULL)
-    {
-        coap_log_error("No peer certificate found");
-        gnutls_x509_crt_deinit(cert);
-        return -1;
-    }
     /* We only check the first (leaf) certificate in the chain */
     ret = gnutls_x509_crt_import(cert, &cert_list[0], GNUTLS_X509_FMT_DER);
     if (ret != GNUTLS_E_SUCCESS)
@@ -348,101 +534,185 @@ static int coap_client_dtls_verify_peer_cert(coap_client_t *client, const char *
             return -1;
         }
     }
+    if (cache)
+    {
+        coap_client_verified_add(key, file_stamp, expiration_time);
+    }
     coap_log_info("Peer certificate validated");
     gnutls_x509_crt_deinit(cert);
     return 0;
 }
 
 /**
- *  @brief Initialise the DTLS members of a client structure
+ *  @brief Verify the server's raw public key
  *
- *  @param[out] client Pointer to a client structure
- *  @param[in] key_file_name String containing the DTLS key file name
- *  @param[in] cert_file_name String containing the DTLS certificate file name
- *  @param[in] trust_file_name String containing the DTLS trust file name
- *  @param[in] crls_file_name String containing the DTLS certificate revocation list file name
- *  @param[in] common_name String containing the common name of the server
+ *  @param[in] client Pointer to a client structure
  *
- *  @returns Operation status
+ *  @returns Operation success
  *  @retval 0 Success
- *  @retval -1 Error
+ *  @retval <0 Error
  */
-static int coap_client_dtls_create(coap_client_t *client,
-                                   const char *key_file_name,
-                                   const char *cert_file_name,
-                                   const char *trust_file_name,
-                                   const char *crl_file_name,
-                                   const char *common_name)
+static int coap_client_dtls_verify_peer_rpk(coap_client_t *client)
 {
-    int ret = 0;
+    const gnutls_datum_t *cert_list = NULL;
+    unsigned cert_list_size = 0;
+    unsigned i = 0;
 
-    ret = gnutls_global_init();
-    if (ret != GNUTLS_E_SUCCESS)
+    if (gnutls_certificate_type_get2(client->session, GNUTLS_CTYPE_PEERS) != GNUTLS_CRT_RAWPK)
     {
-        coap_log_error("Failed to initialise DTLS library");
+        coap_log_error("The peer certificate is not a raw public key");
         return -1;
     }
-    ret = gnutls_certificate_allocate_credentials(&client->cred);
-    if (ret != GNUTLS_E_SUCCESS)
+    cert_list = gnutls_certificate_get_peers(client->session, &cert_list_size);
+    if ((cert_list == NULL) || (cert_list_size == 0))
     {
-        gnutls_global_deinit();
-        coap_log_error("Failed to allocate DTLS credentials");
+        coap_log_error("No peer public key found");
         return -1;
     }
-    if ((trust_file_name != NULL) && (strlen(trust_file_name) != 0))
+    for (i = 0; i < client->num_rpk_trust; i++)
     {
-        ret = gnutls_certificate_set_x509_trust_file(client->cred, trust_file_name, GNUTLS_X509_FMT_PEM);
-        if (ret == 0)
+        if ((cert_list[0].size == client->rpk_trust[i].size)
+         && (memcmp(cert_list[0].data, client->rpk_trust[i].data, cert_list[0].size) == 0))
         {
-            gnutls_certificate_free_credentials(client->cred);
-            gnutls_global_deinit();
-            coap_log_error("Failed to assign X.509 trust file to DTLS credentials");
-            return -1;
+            coap_log_info("Peer public key validated");
+            return 0;
         }
     }
-    if ((crl_file_name != NULL) && (strlen(crl_file_name) != 0))
+    coap_log_error("The peer public key is not trusted");
+    return -1;
+}
+
+/**
+ *  @brief Free the trusted raw public keys in a client structure
+ *
+ *  @param[in,out] client Pointer to a client structure
+ */
+static void coap_client_dtls_free_rpk_trust(coap_client_t *client)
+{
+    unsigned i = 0;
+
+    for (i = 0; i < client->num_rpk_trust; i++)
     {
-        ret = gnutls_certificate_set_x509_crl_file(client->cred, crl_file_name, GNUTLS_X509_FMT_PEM);
-        if (ret < 0)
+        gnutls_free(client->rpk_trust[i].data);
+    }
+    memset(client->rpk_trust, 0, sizeof(client->rpk_trust));
+    client->num_rpk_trust = 0;
+}
+
+/**
+ *  @brief Load trusted raw public keys into a client structure
+ *
+ *  The file contains one or more PEM encoded public keys.
+ *
+ *  @param[in,out] client Pointer to a client structure
+ *  @param[in] trust_file_name String containing the trust file name
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval -1 Error
+ */
+static int coap_client_dtls_load_rpk_trust(coap_client_t *client, const char *trust_file_name)
+{
+    const char begin[] = "-----BEGIN PUBLIC KEY-----";
+    const char end[] = "-----END PUBLIC KEY-----";
+    gnutls_datum_t file = {0};
+    gnutls_datum_t pem = {0};
+    char *start = NULL;
+    char *stop = NULL;
+    int ret = 0;
+
+    ret = gnutls_load_file(trust_file_name, &file);
+    if (ret != GNUTLS_E_SUCCESS)
+    {
+        return -1;
+    }
+    /* the loaded data is null terminated */
+    start = (char *)file.data;
+    while ((start = strstr(start, begin)) != NULL)
+    {
+        stop = strstr(start, end);
+        if ((stop == NULL) || (client->num_rpk_trust >= COAP_CLIENT_RPK_MAX_TRUST))
         {
-            gnutls_certificate_free_credentials(client->cred);
-            gnutls_global_deinit();
-            coap_log_error("Failed to assign X.509 certificate revocation list to DTLS credentials");
-            return -1;
+            break;
+        }
+        stop += sizeof(end) - 1;
+        pem.data = (unsigned char *)start;
+        pem.size = stop - start;
+        ret = gnutls_pem_base64_decode2("PUBLIC KEY", &pem, &client->rpk_trust[client->num_rpk_trust]);
+        if (ret != GNUTLS_E_SUCCESS)
+        {
+            break;
         }
+        client->num_rpk_trust++;
+        start = stop;
     }
-    ret = gnutls_certificate_set_x509_key_file(client->cred, cert_file_name, key_file_name, GNUTLS_X509_FMT_PEM);
-    if (ret != GNUTLS_E_SUCCESS)
+    gnutls_free(file.data);
+    if ((ret != GNUTLS_E_SUCCESS) || (client->num_rpk_trust == 0))
     {
-        gnutls_certificate_free_credentials(client->cred);
-        gnutls_global_deinit();
-        coap_log_error("Failed to assign X.509 certificate file and key file to DTLS credentials");
+        coap_client_dtls_free_rpk_trust(client);
         return -1;
     }
-    ret = gnutls_priority_init(&client->priority, COAP_CLIENT_DTLS_PRIORITIES, NULL);
-    if (ret != GNUTLS_E_SUCCESS)
+    return 0;
+}
+
+/**
+ *  @brief Free the credentials in a client structure
+ *
+ *  @param[in,out] client Pointer to a client structure
+ */
+static void coap_client_dtls_free_cred(coap_client_t *client)
+{
+    if (client->psk_cred != NULL)
+    {
+        gnutls_psk_free_client_credentials(client->psk_cred);
+        client->psk_cred = NULL;
+    }
+    if (client->cred != NULL)
     {
         gnutls_certificate_free_credentials(client->cred);
-        gnutls_global_deinit();
+        client->cred = NULL;
+    }
+    coap_client_dtls_free_rpk_trust(client);
+}
+
+/**
+ *  @brief Start a DTLS session with the server
+ *
+ *  The credentials in the client structure must already be set.
+ *
+ *  @param[in,out] client Pointer to a client structure
+ *  @param[in] flags Additional flags for the DTLS session
+ *  @param[in] priorities String containing the DTLS priorities
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+static int coap_client_dtls_start(coap_client_t *client, unsigned flags, const char *priorities)
+{
+    int ret = 0;
+
+    ret = gnutls_priority_init(&client->priority, priorities, NULL);
+    if (ret != GNUTLS_E_SUCCESS)
+    {
         coap_log_error("Failed to initialise priorities for DTLS session");
         return -1;
     }
-    ret = gnutls_init(&client->session, GNUTLS_CLIENT | GNUTLS_DATAGRAM | GNUTLS_NONBLOCK);
+    ret = gnutls_init(&client->session, GNUTLS_CLIENT | GNUTLS_DATAGRAM | GNUTLS_NONBLOCK | flags);
     if (ret != GNUTLS_E_SUCCESS)
     {
         gnutls_priority_deinit(client->priority);
-        gnutls_certificate_free_credentials(client->cred);
-        gnutls_global_deinit();
         coap_log_error("Failed to initialise DTLS session");
         return -1;
     }
-    ret = gnutls_credentials_set(client->session, GNUTLS_CRD_CERTIFICATE, client->cred);
+    if (client->psk_cred != NULL)
+        ret = gnutls_credentials_set(client->session, GNUTLS_CRD_PSK, client->psk_cred);
+    else
+        ret = gnutls_credentials_set(client->session, GNUTLS_CRD_CERTIFICATE, client->cred);
     if (ret != GNUTLS_E_SUCCESS)
     {
         gnutls_deinit(client->session);
         gnutls_priority_deinit(client->priority);
-        gnutls_certificate_free_credentials(client->cred);
-        gnutls_global_deinit();
         coap_log_error("Failed to assign credentials to DTLS session");
         return -1;
     }
@@ -451,8 +721,6 @@ static int coap_client_dtls_create(coap_client_t *client,
     {
         gnutls_deinit(client->session);
         gnutls_priority_deinit(client->priority);
-        gnutls_certificate_free_credentials(client->cred);
-        gnutls_global_deinit();
         coap_log_error("Failed to assign priorities to DTLS session");
         return -1;
     }
@@ -462,62 +730,264 @@ static int coap_client_dtls_create(coap_client_t *client,
     gnutls_transport_set_push_function(client->session, coap_client_dtls_push_func);
     gnutls_dtls_set_mtu(client->session, COAP_CLIENT_DTLS_MTU);
     gnutls_dtls_set_timeouts(client->session, COAP_CLIENT_DTLS_RETRANS_TIMEOUT, COAP_CLIENT_DTLS_TOTAL_TIMEOUT);
+    coap_trace2(client_dtls_start, client->server_host, client->server_port);
     ret = coap_client_dtls_handshake(client);
+    coap_trace3(client_dtls_end, client->server_host, client->server_port, ret);
     if (ret < 0)
     {
         gnutls_deinit(client->session);
         gnutls_priority_deinit(client->priority);
-        gnutls_certificate_free_credentials(client->cred);
-        gnutls_global_deinit();
         coap_log_warn("Failed to complete DTLS handshake");
         return ret;
     }
-    ret = coap_client_dtls_verify_peer_cert(client, common_name);
-    if (ret < 0)
-    {
-        gnutls_deinit(client->session);
-        gnutls_priority_deinit(client->priority);
-        gnutls_certificate_free_credentials(client->cred);
-        gnutls_global_deinit();
-        return ret;
-    }
     return 0;
 }
 
 /**
- *  @brief Deinitialise a client structure
+ *  @brief Stop the DTLS session with the server
  *
  *  @param[in,out] client Pointer to a client structure
  */
-static void coap_client_dtls_destroy(coap_client_t *client)
+static void coap_client_dtls_stop(coap_client_t *client)
 {
-    gnutls_bye(client->session, GNUTLS_SHUT_WR);
     gnutls_deinit(client->session);
     gnutls_priority_deinit(client->priority);
-    gnutls_certificate_free_credentials(client->cred);
-    gnutls_global_deinit();
 }
 
-#endif  /* COAP_DTLS_EN */
-
-/****************************************************************************************************
- *                                           coap_client                                            *
- ****************************************************************************************************/
-
-#ifdef COAP_DTLS_EN
-int coap_client_create(coap_client_t *client,
-                       const char *host,
-                       const char *port,
-                       const char *key_file_name,
-                       const char *cert_file_name,
-                       const char *trust_file_name,
-                       const char *crl_file_name,
-                       const char *common_name)
-#else
-int coap_client_create(coap_client_t *client,
-                       const char *host,
-                       const char *port)
-#endif
+/**
+ *  @brief Initialise the DTLS members of a client structure
+ *
+ *  @param[out] client Pointer to a client structure
+ *  @param[in] key_file_name String containing the DTLS key file name
+ *  @param[in] cert_file_name String containing the DTLS certificate file name
+ *  @param[in] trust_file_name String containing the DTLS trust file name
+ *  @param[in] crls_file_name String containing the DTLS certificate revocation list file name
+ *  @param[in] common_name String containing the common name of the server
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval -1 Error
+ */
+static int coap_client_dtls_create(coap_client_t *client,
+                                   const char *key_file_name,
+                                   const char *cert_file_name,
+                                   const char *trust_file_name,
+                                   const char *crl_file_name,
+                                   const char *common_name)
+{
+    int ret = 0;
+
+    ret = gnutls_global_init();
+    if (ret != GNUTLS_E_SUCCESS)
+    {
+        coap_log_error("Failed to initialise DTLS library");
+        return -1;
+    }
+    ret = gnutls_certificate_allocate_credentials(&client->cred);
+    if (ret != GNUTLS_E_SUCCESS)
+    {
+        gnutls_global_deinit();
+        coap_log_error("Failed to allocate DTLS credentials");
+        return -1;
+    }
+    if ((trust_file_name != NULL) && (strlen(trust_file_name) != 0))
+    {
+        ret = gnutls_certificate_set_x509_trust_file(client->cred, trust_file_name, GNUTLS_X509_FMT_PEM);
+        if (ret == 0)
+        {
+            coap_client_dtls_free_cred(client);
+            gnutls_global_deinit();
+            coap_log_error("Failed to assign X.509 trust file to DTLS credentials");
+            return -1;
+        }
+    }
+    if ((crl_file_name != NULL) && (strlen(crl_file_name) != 0))
+    {
+        ret = gnutls_certificate_set_x509_crl_file(client->cred, crl_file_name, GNUTLS_X509_FMT_PEM);
+        if (ret < 0)
+        {
+            coap_client_dtls_free_cred(client);
+            gnutls_global_deinit();
+            coap_log_error("Failed to assign X.509 certificate revocation list to DTLS credentials");
+            return -1;
+        }
+    }
+    ret = gnutls_certificate_set_x509_key_file(client->cred, cert_file_name, key_file_name, GNUTLS_X509_FMT_PEM);
+    if (ret != GNUTLS_E_SUCCESS)
+    {
+        coap_client_dtls_free_cred(client);
+        gnutls_global_deinit();
+        coap_log_error("Failed to assign X.509 certificate file and key file to DTLS credentials");
+        return -1;
+    }
+    ret = coap_client_dtls_start(client, 0, COAP_CLIENT_DTLS_PRIORITIES);
+    if (ret < 0)
+    {
+        coap_client_dtls_free_cred(client);
+        gnutls_global_deinit();
+        return ret;
+    }
+    ret = coap_client_dtls_verify_peer_cert(client, common_name, trust_file_name, crl_file_name);
+    if (ret < 0)
+    {
+        coap_client_dtls_stop(client);
+        coap_client_dtls_free_cred(client);
+        gnutls_global_deinit();
+        return ret;
+    }
+    return 0;
+}
+
+/**
+ *  @brief Initialise the DTLS members of a client structure for a pre-shared key
+ *
+ *  @param[out] client Pointer to a client structure
+ *  @param[in] identity String containing the PSK identity
+ *  @param[in] key Pointer to the pre-shared key
+ *  @param[in] key_len Length of the pre-shared key
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval -1 Error
+ */
+static int coap_client_dtls_create_psk(coap_client_t *client,
+                                       const char *identity,
+                                       const unsigned char *key,
+                                       size_t key_len)
+{
+    gnutls_datum_t datum = {0};
+    int ret = 0;
+
+    ret = gnutls_global_init();
+    if (ret != GNUTLS_E_SUCCESS)
+    {
+        coap_log_error("Failed to initialise DTLS library");
+        return -1;
+    }
+    ret = gnutls_psk_allocate_client_credentials(&client->psk_cred);
+    if (ret != GNUTLS_E_SUCCESS)
+    {
+        gnutls_global_deinit();
+        coap_log_error("Failed to allocate DTLS credentials");
+        return -1;
+    }
+    datum.data = (unsigned char *)key;
+    datum.size = key_len;
+    ret = gnutls_psk_set_client_credentials(client->psk_cred, identity, &datum, GNUTLS_PSK_KEY_RAW);
+    if (ret != GNUTLS_E_SUCCESS)
+    {
+        coap_client_dtls_free_cred(client);
+        gnutls_global_deinit();
+        coap_log_error("Failed to assign pre-shared key to DTLS credentials");
+        return -1;
+    }
+    ret = coap_client_dtls_start(client, 0, COAP_CLIENT_DTLS_PSK_PRIORITIES);
+    if (ret < 0)
+    {
+        coap_client_dtls_free_cred(client);
+        gnutls_global_deinit();
+        return ret;
+    }
+    return 0;
+}
+
+/**
+ *  @brief Initialise the DTLS members of a client structure for raw public keys
+ *
+ *  @param[out] client Pointer to a client structure
+ *  @param[in] key_file_name String containing the DTLS private key file name
+ *  @param[in] pub_key_file_name String containing the DTLS public key file name
+ *  @param[in] trust_file_name String containing the name of a file of trusted server public keys
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval -1 Error
+ */
+static int coap_client_dtls_create_rpk(coap_client_t *client,
+                                       const char *key_file_name,
+                                       const char *pub_key_file_name,
+                                       const char *trust_file_name)
+{
+    int ret = 0;
+
+    ret = gnutls_global_init();
+    if (ret != GNUTLS_E_SUCCESS)
+    {
+        coap_log_error("Failed to initialise DTLS library");
+        return -1;
+    }
+    ret = gnutls_certificate_allocate_credentials(&client->cred);
+    if (ret != GNUTLS_E_SUCCESS)
+    {
+        gnutls_global_deinit();
+        coap_log_error("Failed to allocate DTLS credentials");
+        return -1;
+    }
+    ret = coap_client_dtls_load_rpk_trust(client, trust_file_name);
+    if (ret < 0)
+    {
+        coap_client_dtls_free_cred(client);
+        gnutls_global_deinit();
+        coap_log_error("Failed to load trusted raw public keys");
+        return -1;
+    }
+    ret = gnutls_certificate_set_rawpk_key_file(client->cred, pub_key_file_name, key_file_name, GNUTLS_X509_FMT_PEM, NULL, 0, NULL, 0, 0, 0);
+    if (ret != GNUTLS_E_SUCCESS)
+    {
+        coap_client_dtls_free_cred(client);
+        gnutls_global_deinit();
+        coap_log_error("Failed to assign raw public key file and key file to DTLS credentials");
+        return -1;
+    }
+    ret = coap_client_dtls_start(client, GNUTLS_ENABLE_RAWPK, COAP_CLIENT_DTLS_RPK_PRIORITIES);
+    if (ret < 0)
+    {
+        coap_client_dtls_free_cred(client);
+        gnutls_global_deinit();
+        return ret;
+    }
+    ret = coap_client_dtls_verify_peer_rpk(client);
+    if (ret < 0)
+    {
+        coap_client_dtls_stop(client);
+        coap_client_dtls_free_cred(client);
+        gnutls_global_deinit();
+        return ret;
+    }
+    return 0;
+}
+
+/**
+ *  @brief Deinitialise a client structure
+ *
+ *  @param[in,out] client Pointer to a client structure
+ */
+static void coap_client_dtls_destroy(coap_client_t *client)
+{
+    gnutls_bye(client->session, GNUTLS_SHUT_WR);
+    coap_client_dtls_stop(client);
+    coap_client_dtls_free_cred(client);
+    gnutls_global_deinit();
+}
+
+#endif  /* COAP_DTLS_EN */
+
+/****************************************************************************************************
+ *                                           coap_client                                            *
+ ****************************************************************************************************/
+
+/**
+ *  @brief Open the socket of a client structure
+ *
+ *  @param[out] client Pointer to a client structure
+ *  @param[in] host Pointer to a string containing the host address of the server
+ *  @param[in] port Port number of the server
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+static int coap_client_open(coap_client_t *client, const char *host, const char *port)
 {
     struct addrinfo hints = {0};
     struct addrinfo *list = NULL;
@@ -587,6 +1057,10 @@ int coap_client_create(coap_client_t *client,
     }
     strncpy(client->server_host, host, sizeof(client->server_host) - 1);
     strncpy(client->server_port, port, sizeof(client->server_port) - 1);
+    client->ack_timeout_sec = COAP_CLIENT_ACK_TIMEOUT_SEC;
+    client->max_retransmit = COAP_CLIENT_MAX_RETRANSMIT;
+    client->resp_timeout_sec = COAP_CLIENT_RESP_TIMEOUT_SEC;
+    client->cancel_fd = -1;
     client->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
     if (client->timer_fd < 0)
     {
@@ -594,70 +1068,255 @@ int coap_client_create(coap_client_t *client,
         memset(client, 0, sizeof(coap_client_t));
         return -errno;
     }
-#ifdef COAP_DTLS_EN
-    ret = coap_client_dtls_create(client, key_file_name, cert_file_name, trust_file_name, crl_file_name, common_name);
-    if (ret < 0)
-    {
-        close(client->timer_fd);
-        close(client->sd);
-        memset(client, 0, sizeof(coap_client_t));
-        return ret;
-    }
-#endif
-    coap_log_notice("Connected to host %s and port %s", client->server_host, client->server_port);
     return 0;
 }
 
-void coap_client_destroy(coap_client_t *client)
+/**
+ *  @brief Close the socket of a client structure
+ *
+ *  @param[in,out] client Pointer to a client structure
+ */
+static void coap_client_close(coap_client_t *client)
 {
-#ifdef COAP_DTLS_EN
-    coap_client_dtls_destroy(client);
-#endif
     close(client->timer_fd);
     close(client->sd);
     memset(client, 0, sizeof(coap_client_t));
 }
 
-/**
- *  @brief Initialise the acknowledgement timer in a client structure
- *
- *  The timer is initialised to a random duration between:
- *
- *  ACK_TIMEOUT and (ACK_TIMEOUT * ACK_RANDOM_FACTOR)
- *  where:
- *  ACK_TIMEOUT = 2
- *  ACK_RANDOM_FACTOR = 1.5
- *
- *  @param[out] client Pointer to a client structure
- */
-static void coap_client_init_ack_timeout(coap_client_t *client)
+#ifdef COAP_DTLS_EN
+int coap_client_create(coap_client_t *client,
+                       const char *host,
+                       const char *port,
+                       const char *key_file_name,
+                       const char *cert_file_name,
+                       const char *trust_file_name,
+                       const char *crl_file_name,
+                       const char *common_name)
 {
-    if (!rand_init)
+    int ret = 0;
+
+    ret = coap_client_open(client, host, port);
+    if (ret < 0)
     {
-        srand(time(NULL));
-        rand_init = 1;
+        return ret;
     }
-    client->timeout.tv_sec = COAP_CLIENT_ACK_TIMEOUT_SEC;
-    client->timeout.tv_nsec = (rand() % 1000) * 1000000;
-    coap_log_debug("Acknowledgement timeout initialised to: %lu sec, %lu nsec", client->timeout.tv_sec, client->timeout.tv_nsec);
+    ret = coap_client_dtls_create(client, key_file_name, cert_file_name, trust_file_name, crl_file_name, common_name);
+    if (ret < 0)
+    {
+        coap_client_close(client);
+        return ret;
+    }
+    coap_log_notice("Connected to host %s and port %s", client->server_host, client->server_port);
+    return 0;
 }
 
-/**
- *  @brief Initialise the response timer in a client structure
- *
- *  The timer is initialised to a constant value.
- *
- *  @param[out] client Pointer to a client structure
- */
-static void coap_client_init_resp_timeout(coap_client_t *client)
+int coap_client_create_psk(coap_client_t *client,
+                           const char *host,
+                           const char *port,
+                           const char *identity,
+                           const unsigned char *key,
+                           size_t key_len)
 {
-    client->timeout.tv_sec = COAP_CLIENT_RESP_TIMEOUT_SEC;
-    client->timeout.tv_nsec = 0;
-    coap_log_debug("Response timeout initialised to: %lu sec, %lu nsec", client->timeout.tv_sec, client->timeout.tv_nsec);
-}
+    int ret = 0;
 
-/**
- *  @brief Double the value of the timer in a client structure
+    if ((identity == NULL) || (key == NULL) || (key_len == 0))
+    {
+        return -EINVAL;
+    }
+    ret = coap_client_open(client, host, port);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    ret = coap_client_dtls_create_psk(client, identity, key, key_len);
+    if (ret < 0)
+    {
+        coap_client_close(client);
+        return ret;
+    }
+    coap_log_notice("Connected to host %s and port %s", client->server_host, client->server_port);
+    return 0;
+}
+
+int coap_client_create_rpk(coap_client_t *client,
+                           const char *host,
+                           const char *port,
+                           const char *key_file_name,
+                           const char *pub_key_file_name,
+                           const char *trust_file_name)
+{
+    int ret = 0;
+
+    if ((key_file_name == NULL) || (pub_key_file_name == NULL) || (trust_file_name == NULL))
+    {
+        return -EINVAL;
+    }
+    ret = coap_client_open(client, host, port);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    ret = coap_client_dtls_create_rpk(client, key_file_name, pub_key_file_name, trust_file_name);
+    if (ret < 0)
+    {
+        coap_client_close(client);
+        return ret;
+    }
+    coap_log_notice("Connected to host %s and port %s", client->server_host, client->server_port);
+    return 0;
+}
+#else
+int coap_client_create(coap_client_t *client,
+                       const char *host,
+                       const char *port)
+{
+    int ret = 0;
+
+    ret = coap_client_open(client, host, port);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    coap_log_notice("Connected to host %s and port %s", client->server_host, client->server_port);
+    return 0;
+}
+#endif
+
+/**
+ *  @brief Free the subscriptions in a client structure
+ *
+ *  @param[in,out] client Pointer to a client structure
+ */
+static void coap_client_obs_destroy(coap_client_t *client)
+{
+    unsigned i = 0;
+
+    for (i = 0; i < client->num_obs; i++)
+    {
+        free(client->obs_heap[i]->buf);
+        free(client->obs_heap[i]);
+    }
+    free(client->obs_heap);
+    free(client->obs_hash);
+    free(client->obs_id_hash);
+    client->obs_heap = NULL;
+    client->obs_hash = NULL;
+    client->obs_id_hash = NULL;
+    client->num_obs = 0;
+    client->max_obs = 0;
+}
+
+void coap_client_destroy(coap_client_t *client)
+{
+    coap_client_obs_destroy(client);
+#ifdef COAP_DTLS_EN
+    coap_client_dtls_destroy(client);
+#endif
+    coap_client_close(client);
+}
+
+int coap_client_set_timeouts(coap_client_t *client, unsigned ack_timeout_sec, unsigned max_retransmit, unsigned resp_timeout_sec)
+{
+    if ((ack_timeout_sec == 0) || (resp_timeout_sec == 0))
+    {
+        return -EINVAL;
+    }
+    client->ack_timeout_sec = ack_timeout_sec;
+    client->max_retransmit = max_retransmit;
+    client->resp_timeout_sec = resp_timeout_sec;
+    return 0;
+}
+
+void coap_client_set_deadline(coap_client_t *client, const struct timespec *deadline)
+{
+    if (deadline == NULL)
+    {
+        client->deadline.tv_sec = 0;
+        client->deadline.tv_nsec = 0;
+        return;
+    }
+    client->deadline = *deadline;
+}
+
+void coap_client_set_cancel_fd(coap_client_t *client, int fd)
+{
+    client->cancel_fd = fd;
+}
+
+/**
+ *  @brief Calculate the time remaining until the deadline in a client structure
+ *
+ *  @param[in] client Pointer to a client structure
+ *  @param[out] tv Pointer to a timeval structure to receive the remaining time
+ *  @param[out] tvp Pointer set to tv or to NULL if there is no deadline
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval -ETIMEDOUT The deadline has passed
+ */
+static int coap_client_get_remaining(coap_client_t *client, struct timeval *tv, struct timeval **tvp)
+{
+    struct timespec now = {0};
+    long long nsec = 0;
+
+    *tvp = NULL;
+    if ((client->deadline.tv_sec == 0) && (client->deadline.tv_nsec == 0))
+    {
+        return 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    nsec = (long long)(client->deadline.tv_sec - now.tv_sec) * 1000000000LL
+         + (client->deadline.tv_nsec - now.tv_nsec);
+    if (nsec <= 0)
+    {
+        return -ETIMEDOUT;
+    }
+    tv->tv_sec = nsec / 1000000000LL;
+    tv->tv_usec = (nsec % 1000000000LL) / 1000;
+    *tvp = tv;
+    return 0;
+}
+
+/**
+ *  @brief Initialise the acknowledgement timer in a client structure
+ *
+ *  The timer is initialised to a random duration between:
+ *
+ *  ACK_TIMEOUT and (ACK_TIMEOUT * ACK_RANDOM_FACTOR)
+ *  where:
+ *  ACK_TIMEOUT = client->ack_timeout_sec (default 2)
+ *  ACK_RANDOM_FACTOR = 1.5
+ *
+ *  @param[out] client Pointer to a client structure
+ */
+static void coap_client_init_ack_timeout(coap_client_t *client)
+{
+    if (!rand_init)
+    {
+        srand(time(NULL));
+        rand_init = 1;
+    }
+    client->timeout.tv_sec = client->ack_timeout_sec;
+    client->timeout.tv_nsec = (rand() % 1000) * 1000000;
+    coap_log_debug("Acknowledgement timeout initialised to: %lu sec, %lu nsec", client->timeout.tv_sec, client->timeout.tv_nsec);
+}
+
+/**
+ *  @brief Initialise the response timer in a client structure
+ *
+ *  The timer is initialised to a constant value.
+ *
+ *  @param[out] client Pointer to a client structure
+ */
+static void coap_client_init_resp_timeout(coap_client_t *client)
+{
+    client->timeout.tv_sec = client->resp_timeout_sec;
+    client->timeout.tv_nsec = 0;
+    coap_log_debug("Response timeout initialised to: %lu sec, %lu nsec", client->timeout.tv_sec, client->timeout.tv_nsec);
+}
+
+/**
+ *  @brief Double the value of the timer in a client structure
  *
  *  @param[in,out] client Pointer to a client structure
  */
@@ -725,7 +1384,7 @@ static int coap_client_update_ack_timer(coap_client_t *client)
 {
     int ret = 0;
 
-    if (client->num_retrans >= COAP_CLIENT_MAX_RETRANSMIT)
+    if (client->num_retrans >= client->max_retransmit)
     {
         return -ETIMEDOUT;
     }
@@ -755,28 +1414,23 @@ static int coap_client_start_resp_timer(coap_client_t *client)
 }
 
 /**
- *  @brief Send a message to the server
+ *  @brief Send a formatted message to the server
  *
  *  @param[in,out] client Pointer to a client structure
- *  @param[in] msg Pointer to a message structure
+ *  @param[in] buf Buffer containing the formatted message
+ *  @param[in] len Length of the formatted message
  *
  *  @returns Number of bytes sent or error code
  *  @retval >0 Number of bytes sent
  *  @retval <0 Error
  */
-static ssize_t coap_client_send(coap_client_t *client, coap_msg_t *msg)
+static ssize_t coap_client_send_buf(coap_client_t *client, const char *buf, size_t len)
 {
     ssize_t num = 0;
-    char buf[COAP_MSG_MAX_BUF_LEN] = {0};
 
-    num = coap_msg_format(msg, buf, sizeof(buf));
-    if (num < 0)
-    {
-        return num;
-    }
 #ifdef COAP_DTLS_EN
     errno = 0;
-    num = gnutls_record_send(client->session, buf, num);
+    num = gnutls_record_send(client->session, buf, len);
     if (errno != 0)
     {
         return -errno;
@@ -796,16 +1450,40 @@ static ssize_t coap_client_send(coap_client_t *client, coap_msg_t *msg)
         return -1;
     }
 #else
-    num = send(client->sd, buf, num, 0);
+    num = send(client->sd, buf, len, 0);
     if (num < 0)
     {
         return -errno;
     }
 #endif
+    coap_trace5(client_send, client->server_host, client->server_port, coap_trace_buf_msg_id(buf), buf, len);
     coap_log_debug("Sent to host %s and port %s", client->server_host, client->server_port);
     return num;
 }
 
+/**
+ *  @brief Send a message to the server
+ *
+ *  @param[in,out] client Pointer to a client structure
+ *  @param[in] msg Pointer to a message structure
+ *
+ *  @returns Number of bytes sent or error code
+ *  @retval >0 Number of bytes sent
+ *  @retval <0 Error
+ */
+static ssize_t coap_client_send(coap_client_t *client, coap_msg_t *msg)
+{
+    ssize_t num = 0;
+    char buf[COAP_MSG_MAX_BUF_LEN] = {0};
+
+    num = coap_msg_format(msg, buf, sizeof(buf));
+    if (num < 0)
+    {
+        return num;
+    }
+    return coap_client_send_buf(client, buf, num);
+}
+
 /**
  *  @brief Handle a format error in a received message
  *
@@ -890,6 +1568,7 @@ static ssize_t coap_client_recv(coap_client_t *client, coap_msg_t *msg)
         return -errno;
     }
 #endif
+    coap_trace5(client_recv, client->server_host, client->server_port, num >= 4 ? coap_trace_buf_msg_id(buf) : 0, buf, num);
     ret = coap_msg_parse(msg, buf, num);
     if (ret < 0)
     {
@@ -899,159 +1578,625 @@ static ssize_t coap_client_recv(coap_client_t *client, coap_msg_t *msg)
         }
         return ret;
     }
+    coap_trace7(client_parse, client->server_host, client->server_port,
+                coap_msg_get_msg_id(msg), coap_msg_get_type(msg),
+                (coap_msg_get_code_class(msg) << 5) | coap_msg_get_code_detail(msg),
+                coap_msg_get_token(msg), coap_msg_get_token_len(msg));
     coap_log_debug("Received from host %s and port %s", client->server_host, client->server_port);
     return num;
 }
 
 /**
- *  @brief Reject a received confirmable message
+ *  @brief Reject a received confirmable message
+ *
+ *  Send a reset message to the server.
+ *
+ *  @param[in,out] client Pointer to a client structure
+ *  @param[in] msg Pointer to a message structure
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+static int coap_client_reject_con(coap_client_t *client, coap_msg_t *msg)
+{
+    coap_msg_t rej = {0};
+    int num = 0;
+    int ret = 0;
+
+    coap_log_info("Rejecting confirmable message from host %s and port %s", client->server_host, client->server_port);
+    coap_msg_create(&rej);
+    ret = coap_msg_set_type(&rej, COAP_MSG_RST);
+    if (ret < 0)
+    {
+        coap_msg_destroy(&rej);
+        return ret;
+    }
+    ret = coap_msg_set_msg_id(&rej, coap_msg_get_msg_id(msg));
+    if (ret < 0)
+    {
+        coap_msg_destroy(&rej);
+        return ret;
+    }
+    num = coap_client_send(client, &rej);
+    coap_msg_destroy(&rej);
+    if (num < 0)
+    {
+        return num;
+    }
+    return 0;
+}
+
+/**
+ *  @brief Reject a received non-confirmable message
+ *
+ *  @param[in] client Pointer to a client structure
+ *  @param[in] msg Pointer to a message structure
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ */
+static int coap_client_reject_non(coap_client_t *client, coap_msg_t *msg)
+{
+    coap_log_info("Rejecting non-confirmable message from host %s and port %s", client->server_host, client->server_port);
+    return 0;
+}
+
+/**
+ *  @brief Reject a received acknowledgement message
+ *
+ *  @param[in] client Pointer to a client structure
+ *  @param[in] msg Pointer to a message structure
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ */
+static int coap_client_reject_ack(coap_client_t *client, coap_msg_t *msg)
+{
+    coap_log_info("Rejecting acknowledgement message from host %s and port %s", client->server_host, client->server_port);
+    return 0;
+}
+
+/**
+ *  @brief Reject a received reset message
+ *
+ *  @param[in] client Pointer to a client structure
+ *  @param[in] msg Pointer to a message structure
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ */
+static int coap_client_reject_reset(coap_client_t *client, coap_msg_t *msg)
+{
+    coap_log_info("Rejecting reset message from host %s and port %s", client->server_host, client->server_port);
+    return 0;
+}
+
+/**
+ *  @brief Reject a received message
+ *
+ *  @param[in,out] client Pointer to a client structure
+ *  @param[in] msg Pointer to a message structure
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+static int coap_client_reject(coap_client_t *client, coap_msg_t *msg)
+{
+    if (coap_msg_get_type(msg) == COAP_MSG_CON)
+    {
+        return coap_client_reject_con(client, msg);
+    }
+    else if (coap_msg_get_type(msg) == COAP_MSG_NON)
+    {
+        return coap_client_reject_non(client, msg);
+    }
+    else if (coap_msg_get_type(msg) == COAP_MSG_ACK)
+    {
+        return coap_client_reject_ack(client, msg);
+    }
+    else if (coap_msg_get_type(msg) == COAP_MSG_RST)
+    {
+        return coap_client_reject_reset(client, msg);
+    }
+    return 0;  /* should never arrive here */
+}
+
+/**
+ *  @brief Send an acknowledgement message to the server
+ *
+ *  @param[in,out] client Pointer to a client structure
+ *  @param[in] msg Pointer to a message structure
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+static int coap_client_send_ack(coap_client_t *client, coap_msg_t *msg)
+{
+    coap_msg_t ack = {0};
+    int num = 0;
+    int ret = 0;
+
+    coap_log_info("Acknowledging confirmable message from host %s and port %s", client->server_host, client->server_port);
+    coap_msg_create(&ack);
+    ret = coap_msg_set_type(&ack, COAP_MSG_ACK);
+    if (ret < 0)
+    {
+        coap_msg_destroy(&ack);
+        return ret;
+    }
+    ret = coap_msg_set_msg_id(&ack, coap_msg_get_msg_id(msg));
+    if (ret < 0)
+    {
+        coap_msg_destroy(&ack);
+        return ret;
+    }
+    num = coap_client_send(client, &ack);
+    coap_msg_destroy(&ack);
+    if (num < 0)
+    {
+        return num;
+    }
+    return 0;
+}
+
+/**
+ *  @brief Handle an acknowledgement timeout
+ *
+ *  Update the acknowledgement timer in the client structure
+ *  and if the maximum number of retransmits has not been
+ *  reached then retransmit the last request to the server.
+ *
+ *  @param[in,out] client Pointer to a client structure
+ *  @param[in] msg Pointer to a message structure
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+static int coap_client_handle_ack_timeout(coap_client_t *client, coap_msg_t *msg)
+{
+    ssize_t num = 0;
+    int ret = 0;
+
+    coap_log_debug("Transaction expired for host %s and port %s", client->server_host, client->server_port);
+    ret = coap_client_update_ack_timer(client);
+    if (ret == 0)
+    {
+        coap_log_debug("Retransmitting to host %s and port %s", client->server_host, client->server_port);
+        coap_trace4(client_retransmit, client->server_host, client->server_port, coap_msg_get_msg_id(msg), client->num_retrans);
+        num = coap_client_send(client, msg);
+        if (num < 0)
+        {
+            return num;
+        }
+    }
+    else if (ret == -ETIMEDOUT)
+    {
+        coap_log_debug("Stopped retransmitting to host %s and port %s", client->server_host, client->server_port);
+        coap_log_info("No acknowledgement received from host %s and port %s", client->server_host, client->server_port);
+    }
+    return ret;
+}
+
+/**
+ *  @brief Wait for a message to arrive or the acknowledgement timer to expire
+ *
+ *  @param[in,out] client Pointer to a client structure
+ *  @param[in] msg Pointer to a message structure
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+static int coap_client_listen_ack(coap_client_t *client, coap_msg_t *msg)
+{
+    struct timeval *tvp = NULL;
+    struct timeval tv = {0};
+    fd_set read_fds = {{0}};
+    int max_fd = 0;
+    int ret = 0;
+
+    while (1)
+    {
+        ret = coap_client_get_remaining(client, &tv, &tvp);
+        if (ret < 0)
+        {
+            coap_log_warn("Deadline passed waiting for acknowledgement from host %s and port %s", client->server_host, client->server_port);
+            return ret;
+        }
+        FD_ZERO(&read_fds);
+        FD_SET(client->sd, &read_fds);
+        FD_SET(client->timer_fd, &read_fds);
+        max_fd = client->sd;
+        if (client->timer_fd > max_fd)
+        {
+            max_fd = client->timer_fd;
+        }
+        if (client->cancel_fd >= 0)
+        {
+            FD_SET(client->cancel_fd, &read_fds);
+            if (client->cancel_fd > max_fd)
+            {
+                max_fd = client->cancel_fd;
+            }
+        }
+        ret = select(max_fd + 1, &read_fds, NULL, NULL, tvp);
+        if (ret < 0)
+        {
+            return -errno;
+        }
+        if (ret == 0)
+        {
+            /* the deadline has passed, checked at the top of the loop */
+            continue;
+        }
+        if ((client->cancel_fd >= 0) && (FD_ISSET(client->cancel_fd, &read_fds)))
+        {
+            coap_log_info("Cancelled exchange with host %s and port %s", client->server_host, client->server_port);
+            return -ECANCELED;
+        }
+        if (FD_ISSET(client->sd, &read_fds))
+        {
+            return 0;
+        }
+        if (FD_ISSET(client->timer_fd, &read_fds))
+        {
+            ret = coap_client_handle_ack_timeout(client, msg);
+            if (ret < 0)
+            {
+                return ret;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ *  @brief Wait for a message to arrive or the response timer to expire
+ *
+ *  @param[in] client Pointer to a client structure
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+static int coap_client_listen_resp(coap_client_t *client)
+{
+    struct timeval *tvp = NULL;
+    struct timeval tv = {0};
+    fd_set read_fds = {{0}};
+    int max_fd = 0;
+    int ret = 0;
+
+    while (1)
+    {
+        ret = coap_client_get_remaining(client, &tv, &tvp);
+        if (ret < 0)
+        {
+            coap_log_warn("Deadline passed waiting for response from host %s and port %s", client->server_host, client->server_port);
+            return ret;
+        }
+        FD_ZERO(&read_fds);
+        FD_SET(client->sd, &read_fds);
+        FD_SET(client->timer_fd, &read_fds);
+        max_fd = client->sd;
+        if (client->timer_fd > max_fd)
+        {
+            max_fd = client->timer_fd;
+        }
+        if (client->cancel_fd >= 0)
+        {
+            FD_SET(client->cancel_fd, &read_fds);
+            if (client->cancel_fd > max_fd)
+            {
+                max_fd = client->cancel_fd;
+            }
+        }
+        ret = select(max_fd + 1, &read_fds, NULL, NULL, tvp);
+        if (ret < 0)
+        {
+            return -errno;
+        }
+        if (ret == 0)
+        {
+            /* the deadline has passed, checked at the top of the loop */
+            continue;
+        }
+        if ((client->cancel_fd >= 0) && (FD_ISSET(client->cancel_fd, &read_fds)))
+        {
+            coap_log_info("Cancelled exchange with host %s and port %s", client->server_host, client->server_port);
+            return -ECANCELED;
+        }
+        if (FD_ISSET(client->sd, &read_fds))
+        {
+            break;
+        }
+        if (FD_ISSET(client->timer_fd, &read_fds))
+        {
+            return -ETIMEDOUT;
+        }
+    }
+    return 0;
+}
+
+/**
+ *  @brief Compare the token values in a request message and a response message
+ *
+ *  @param[in] req Pointer to the request message
+ *  @param[in] resp Pointer to the response message
+ *
+ *  @returns Comparison value
+ *  @retval 0 the tokens are not equal
+ *  @retval 1 the tokens are equal
+ */
+static int coap_client_match_token(coap_msg_t *req, coap_msg_t *resp)
+{
+    return ((coap_msg_get_token_len(resp) == coap_msg_get_token_len(req))
+         && (memcmp(coap_msg_get_token(resp), coap_msg_get_token(req), coap_msg_get_token_len(req)) == 0));
+}
+
+/**
+ *  @brief Check that all of the options in a message are acceptable
+ *
+ *  For a proxy, options are acceptable if they are safe to forward or recognized or both.
+ *  For a server, options are acceptable if they are elective or recognized or both.
+ *
+ *  @param[in] msg Pointer to message structure
+ *
+ *  @returns Operation status or bad option number
+ *  @retval 0 Success
+ *  @retval >0 Bad option number
+ */
+static unsigned coap_client_check_options(coap_msg_t *msg)
+{
+#ifdef COAP_PROXY
+    return coap_msg_check_unsafe_ops(msg);
+#else  /* !COAP_PROXY */
+    return coap_msg_check_critical_ops(msg);
+#endif  /* COAP_PROXY */
+}
+
+/**
+ *  @brief Compare two times
  *
- *  Send a reset message to the server.
+ *  @param[in] a Pointer to the first time
+ *  @param[in] b Pointer to the second time
  *
- *  @param[in,out] client Pointer to a client structure
- *  @param[in] msg Pointer to a message structure
+ *  @returns Comparison value
+ *  @retval 1 a is earlier than b
+ *  @retval 0 a is not earlier than b
+ */
+static int coap_client_time_before(const struct timespec *a, const struct timespec *b)
+{
+    return ((a->tv_sec < b->tv_sec)
+         || ((a->tv_sec == b->tv_sec) && (a->tv_nsec < b->tv_nsec)));
+}
+
+/**
+ *  @brief Get the hash bucket for a subscription token
  *
- *  @returns Operation status
- *  @retval 0 Success
- *  @retval <0 Error
+ *  @param[in] token Pointer to the token
+ *
+ *  @returns Hash bucket index
  */
-static int coap_client_reject_con(coap_client_t *client, coap_msg_t *msg)
+static unsigned coap_client_obs_hash(const char *token)
 {
-    coap_msg_t rej = {0};
-    int num = 0;
-    int ret = 0;
+    unsigned hash = 2166136261u;
+    unsigned i = 0;
 
-    coap_log_info("Rejecting confirmable message from host %s and port %s", client->server_host, client->server_port);
-    coap_msg_create(&rej);
-    ret = coap_msg_set_type(&rej, COAP_MSG_RST);
-    if (ret < 0)
+    for (i = 0; i < COAP_CLIENT_OBS_TOKEN_LEN; i++)
     {
-        coap_msg_destroy(&rej);
-        return ret;
+        hash = (hash ^ (unsigned char)token[i]) * 16777619u;
     }
-    ret = coap_msg_set_msg_id(&rej, coap_msg_get_msg_id(msg));
-    if (ret < 0)
+    return hash % COAP_CLIENT_OBS_HASH_SIZE;
+}
+
+/**
+ *  @brief Find a subscription from its token
+ *
+ *  @param[in] client Pointer to a client structure
+ *  @param[in] token Pointer to the token
+ *  @param[in] token_len Length of the token
+ *
+ *  @returns Pointer to the subscription structure or NULL
+ */
+static coap_client_obs_t *coap_client_obs_find(coap_client_t *client, const char *token, unsigned token_len)
+{
+    coap_client_obs_t *obs = NULL;
+
+    if ((client->obs_hash == NULL) || (token_len != COAP_CLIENT_OBS_TOKEN_LEN))
     {
-        coap_msg_destroy(&rej);
-        return ret;
+        return NULL;
     }
-    num = coap_client_send(client, &rej);
-    coap_msg_destroy(&rej);
-    if (num < 0)
+    obs = client->obs_hash[coap_client_obs_hash(token)];
+    while (obs != NULL)
     {
-        return num;
+        if (memcmp(obs->token, token, COAP_CLIENT_OBS_TOKEN_LEN) == 0)
+        {
+            return obs;
+        }
+        obs = obs->next;
     }
-    return 0;
+    return NULL;
 }
 
 /**
- *  @brief Reject a received non-confirmable message
- *
- *  @param[in] client Pointer to a client structure
- *  @param[in] msg Pointer to a message structure
+ *  @brief Remove a subscription from the message ID hash table
  *
- *  @returns Operation status
- *  @retval 0 Success
+ *  @param[in,out] client Pointer to a client structure
+ *  @param[in] obs Pointer to a subscription structure
  */
-static int coap_client_reject_non(coap_client_t *client, coap_msg_t *msg)
+static void coap_client_obs_id_unlink(coap_client_t *client, coap_client_obs_t *obs)
 {
-    coap_log_info("Rejecting non-confirmable message from host %s and port %s", client->server_host, client->server_port);
-    return 0;
+    coap_client_obs_t **prev = NULL;
+
+    prev = &client->obs_id_hash[obs->msg_id % COAP_CLIENT_OBS_HASH_SIZE];
+    while (*prev != NULL)
+    {
+        if (*prev == obs)
+        {
+            *prev = obs->id_next;
+            break;
+        }
+        prev = &(*prev)->id_next;
+    }
+    obs->id_next = NULL;
 }
 
 /**
- *  @brief Reject a received acknowledgement message
+ *  @brief Find a subscription from the message ID of its last registration request
  *
  *  @param[in] client Pointer to a client structure
- *  @param[in] msg Pointer to a message structure
+ *  @param[in] msg_id Message ID
  *
- *  @returns Operation status
- *  @retval 0 Success
+ *  @returns Pointer to the subscription structure or NULL
  */
-static int coap_client_reject_ack(coap_client_t *client, coap_msg_t *msg)
+static coap_client_obs_t *coap_client_obs_find_id(coap_client_t *client, unsigned msg_id)
 {
-    coap_log_info("Rejecting acknowledgement message from host %s and port %s", client->server_host, client->server_port);
-    return 0;
+    coap_client_obs_t *obs = NULL;
+
+    obs = client->obs_id_hash[msg_id % COAP_CLIENT_OBS_HASH_SIZE];
+    while (obs != NULL)
+    {
+        if (obs->msg_id == msg_id)
+        {
+            return obs;
+        }
+        obs = obs->id_next;
+    }
+    return NULL;
 }
 
 /**
- *  @brief Reject a received reset message
- *
- *  @param[in] client Pointer to a client structure
- *  @param[in] msg Pointer to a message structure
+ *  @brief Swap two entries in the renewal heap
  *
- *  @returns Operation status
- *  @retval 0 Success
+ *  @param[in,out] client Pointer to a client structure
+ *  @param[in] i Index of the first entry
+ *  @param[in] j Index of the second entry
  */
-static int coap_client_reject_reset(coap_client_t *client, coap_msg_t *msg)
+static void coap_client_obs_heap_swap(coap_client_t *client, unsigned i, unsigned j)
 {
-    coap_log_info("Rejecting reset message from host %s and port %s", client->server_host, client->server_port);
-    return 0;
+    coap_client_obs_t *obs = NULL;
+
+    obs = client->obs_heap[i];
+    client->obs_heap[i] = client->obs_heap[j];
+    client->obs_heap[j] = obs;
+    client->obs_heap[i]->heap_index = i;
+    client->obs_heap[j]->heap_index = j;
 }
 
 /**
- *  @brief Reject a received message
+ *  @brief Restore the order of the renewal heap after a renewal time has changed
  *
  *  @param[in,out] client Pointer to a client structure
- *  @param[in] msg Pointer to a message structure
- *
- *  @returns Operation status
- *  @retval 0 Success
- *  @retval <0 Error
+ *  @param[in] i Index of the entry whose renewal time has changed
  */
-static int coap_client_reject(coap_client_t *client, coap_msg_t *msg)
+static void coap_client_obs_heap_fix(coap_client_t *client, unsigned i)
 {
-    if (coap_msg_get_type(msg) == COAP_MSG_CON)
+    unsigned child = 0;
+
+    while ((i > 0)
+        && (coap_client_time_before(&client->obs_heap[i]->renew, &client->obs_heap[(i - 1) / 2]->renew)))
     {
-        return coap_client_reject_con(client, msg);
+        coap_client_obs_heap_swap(client, i, (i - 1) / 2);
+        i = (i - 1) / 2;
     }
-    else if (coap_msg_get_type(msg) == COAP_MSG_NON)
+    while (1)
     {
-        return coap_client_reject_non(client, msg);
+        child = 2 * i + 1;
+        if (child >= client->num_obs)
+        {
+            break;
+        }
+        if ((child + 1 < client->num_obs)
+         && (coap_client_time_before(&client->obs_heap[child + 1]->renew, &client->obs_heap[child]->renew)))
+        {
+            child++;
+        }
+        if (!coap_client_time_before(&client->obs_heap[child]->renew, &client->obs_heap[i]->renew))
+        {
+            break;
+        }
+        coap_client_obs_heap_swap(client, i, child);
+        i = child;
     }
-    else if (coap_msg_get_type(msg) == COAP_MSG_ACK)
+}
+
+/**
+ *  @brief Remove a subscription from a client structure and free it
+ *
+ *  @param[in,out] client Pointer to a client structure
+ *  @param[in] obs Pointer to a subscription structure
+ */
+static void coap_client_obs_free(coap_client_t *client, coap_client_obs_t *obs)
+{
+    coap_client_obs_t **prev = NULL;
+    unsigned i = 0;
+
+    prev = &client->obs_hash[coap_client_obs_hash(obs->token)];
+    while (*prev != NULL)
     {
-        return coap_client_reject_ack(client, msg);
+        if (*prev == obs)
+        {
+            *prev = obs->next;
+            break;
+        }
+        prev = &(*prev)->next;
     }
-    else if (coap_msg_get_type(msg) == COAP_MSG_RST)
+    coap_client_obs_id_unlink(client, obs);
+    i = obs->heap_index;
+    client->num_obs--;
+    if (i != client->num_obs)
     {
-        return coap_client_reject_reset(client, msg);
+        coap_client_obs_heap_swap(client, i, client->num_obs);
+        coap_client_obs_heap_fix(client, i);
     }
-    return 0;  /* should never arrive here */
+    free(obs->buf);
+    free(obs);
 }
 
 /**
- *  @brief Send an acknowledgement message to the server
+ *  @brief Send the registration request of a subscription
+ *
+ *  The request is sent with a new message ID and the same
+ *  token. If it is not answered it is sent again after the
+ *  acknowledgement timeout, doubling the timeout each time.
  *
  *  @param[in,out] client Pointer to a client structure
- *  @param[in] msg Pointer to a message structure
+ *  @param[in,out] obs Pointer to a subscription structure
  *
  *  @returns Operation status
  *  @retval 0 Success
  *  @retval <0 Error
  */
-static int coap_client_send_ack(coap_client_t *client, coap_msg_t *msg)
+static int coap_client_obs_send(coap_client_t *client, coap_client_obs_t *obs)
 {
-    coap_msg_t ack = {0};
-    int num = 0;
-    int ret = 0;
+    unsigned char msg_id_buf[2] = {0};
+    unsigned shift = 0;
+    ssize_t num = 0;
 
-    coap_log_info("Acknowledging confirmable message from host %s and port %s", client->server_host, client->server_port);
-    coap_msg_create(&ack);
-    ret = coap_msg_set_type(&ack, COAP_MSG_ACK);
-    if (ret < 0)
-    {
-        coap_msg_destroy(&ack);
-        return ret;
-    }
-    ret = coap_msg_set_msg_id(&ack, coap_msg_get_msg_id(msg));
-    if (ret < 0)
-    {
-        coap_msg_destroy(&ack);
-        return ret;
-    }
-    num = coap_client_send(client, &ack);
-    coap_msg_destroy(&ack);
+    /* the message ID is at a fixed offset in the header */
+    coap_client_obs_id_unlink(client, obs);
+    coap_msg_gen_rand_str((char *)msg_id_buf, sizeof(msg_id_buf));
+    obs->msg_id = (((unsigned)msg_id_buf[1]) << 8) | (unsigned)msg_id_buf[0];
+    obs->buf[2] = (char)(obs->msg_id >> 8);
+    obs->buf[3] = (char)(obs->msg_id & 0xff);
+    obs->id_next = client->obs_id_hash[obs->msg_id % COAP_CLIENT_OBS_HASH_SIZE];
+    client->obs_id_hash[obs->msg_id % COAP_CLIENT_OBS_HASH_SIZE] = obs;
+    shift = obs->num_retries;
+    if (shift > client->max_retransmit)
+    {
+        shift = client->max_retransmit;
+    }
+    obs->num_retries++;
+    clock_gettime(CLOCK_MONOTONIC, &obs->renew);
+    obs->renew.tv_sec += client->ack_timeout_sec << shift;
+    coap_client_obs_heap_fix(client, obs->heap_index);
+    coap_log_info("Sending observe registration to host %s and port %s", client->server_host, client->server_port);
+    num = coap_client_send_buf(client, obs->buf, obs->len);
     if (num < 0)
     {
         return num;
@@ -1060,167 +2205,204 @@ static int coap_client_send_ack(coap_client_t *client, coap_msg_t *msg)
 }
 
 /**
- *  @brief Handle an acknowledgement timeout
+ *  @brief Get the value of an unsigned integer option
  *
- *  Update the acknowledgement timer in the client structure
- *  and if the maximum number of retransmits has not been
- *  reached then retransmit the last request to the server.
- *
- *  @param[in,out] client Pointer to a client structure
  *  @param[in] msg Pointer to a message structure
+ *  @param[in] num Option number
+ *  @param[out] val Pointer to receive the option value
  *
- *  @returns Operation status
- *  @retval 0 Success
- *  @retval <0 Error
+ *  @returns Search result
+ *  @retval 1 The option was found
+ *  @retval 0 The option was not found
  */
-static int coap_client_handle_ack_timeout(coap_client_t *client, coap_msg_t *msg)
+static int coap_client_get_uint_op(coap_msg_t *msg, unsigned num, unsigned *val)
 {
-    ssize_t num = 0;
-    int ret = 0;
+    coap_msg_op_t *op = NULL;
+    unsigned i = 0;
 
-    coap_log_debug("Transaction expired for host %s and port %s", client->server_host, client->server_port);
-    ret = coap_client_update_ack_timer(client);
-    if (ret == 0)
+    op = coap_msg_get_first_op(msg);
+    while (op != NULL)
     {
-        coap_log_debug("Retransmitting to host %s and port %s", client->server_host, client->server_port);
-        num = coap_client_send(client, msg);
-        if (num < 0)
+        if (coap_msg_op_get_num(op) == num)
         {
-            return num;
+            *val = 0;
+            for (i = 0; (i < coap_msg_op_get_len(op)) && (i < sizeof(unsigned)); i++)
+            {
+                *val = (*val << 8) | (unsigned char)coap_msg_op_get_val(op)[i];
+            }
+            return 1;
         }
+        op = coap_msg_op_get_next(op);
     }
-    else if (ret == -ETIMEDOUT)
+    return 0;
+}
+
+/**
+ *  @brief Check if a notification is newer than the last one delivered
+ *
+ *  Implements the ordering rule in RFC 7641 section 3.4:
+ *  the sequence number must advance modulo 2^24, or more
+ *  than 128 seconds must have passed.
+ *
+ *  @param[in] obs Pointer to a subscription structure
+ *  @param[in] seq Observe sequence number of the notification
+ *  @param[in] now Pointer to the time the notification was received
+ *
+ *  @returns Comparison value
+ *  @retval 1 The notification is fresh
+ *  @retval 0 The notification is older than the last one delivered
+ */
+static int coap_client_obs_is_fresh(coap_client_obs_t *obs, unsigned seq, const struct timespec *now)
+{
+    if (!obs->have_seq)
     {
-        coap_log_debug("Stopped retransmitting to host %s and port %s", client->server_host, client->server_port);
-        coap_log_info("No acknowledgement received from host %s and port %s", client->server_host, client->server_port);
+        return 1;
     }
-    return ret;
+    if (((obs->seq < seq) && (seq - obs->seq < (1u << 23)))
+     || ((obs->seq > seq) && (obs->seq - seq > (1u << 23))))
+    {
+        return 1;
+    }
+    return (now->tv_sec > obs->seq_time.tv_sec + COAP_CLIENT_OBS_REORDER_SEC);
 }
 
 /**
- *  @brief Wait for a message to arrive or the acknowledgement timer to expire
+ *  @brief Handle a message that may belong to a subscription
  *
  *  @param[in,out] client Pointer to a client structure
  *  @param[in] msg Pointer to a message structure
  *
  *  @returns Operation status
- *  @retval 0 Success
+ *  @retval 1 The message was handled
+ *  @retval 0 The message does not belong to a subscription
  *  @retval <0 Error
  */
-static int coap_client_listen_ack(coap_client_t *client, coap_msg_t *msg)
+static int coap_client_obs_recv(coap_client_t *client, coap_msg_t *msg)
 {
-    fd_set read_fds = {{0}};
-    int max_fd = 0;
+    struct timespec now = {0};
+    coap_client_obs_t *obs = NULL;
+    unsigned max_age = COAP_CLIENT_OBS_MAX_AGE_SEC;
+    unsigned op_num = 0;
+    unsigned seq = 0;
+    int has_seq = 0;
     int ret = 0;
 
-    while (1)
+    if (client->num_obs == 0)
     {
-        FD_ZERO(&read_fds);
-        FD_SET(client->sd, &read_fds);
-        FD_SET(client->timer_fd, &read_fds);
-        max_fd = client->sd;
-        if (client->timer_fd > max_fd)
-        {
-            max_fd = client->timer_fd;
-        }
-        ret = select(max_fd + 1, &read_fds, NULL, NULL, NULL);
-        if (ret < 0)
-        {
-            return -errno;
-        }
-        if (FD_ISSET(client->sd, &read_fds))
+        return 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if ((coap_msg_get_type(msg) == COAP_MSG_ACK) && (coap_msg_is_empty(msg)))
+    {
+        /* the registration was accepted, wait for the separate response */
+        obs = coap_client_obs_find_id(client, coap_msg_get_msg_id(msg));
+        if (obs == NULL)
         {
             return 0;
         }
-        if (FD_ISSET(client->timer_fd, &read_fds))
+        obs->renew.tv_sec = now.tv_sec + client->resp_timeout_sec;
+        obs->renew.tv_nsec = now.tv_nsec;
+        coap_client_obs_heap_fix(client, obs->heap_index);
+        return 1;
+    }
+    if (coap_msg_get_type(msg) == COAP_MSG_RST)
+    {
+        /* the server rejected the registration, RFC 7641 section 3.6 */
+        obs = coap_client_obs_find_id(client, coap_msg_get_msg_id(msg));
+        if (obs == NULL)
         {
-            ret = coap_client_handle_ack_timeout(client, msg);
-            if (ret < 0)
-            {
-                return ret;
-            }
+            return 0;
         }
+        coap_log_info("Registration rejected by host %s and port %s", client->server_host, client->server_port);
+        (*obs->notify)(obs, msg);
+        coap_client_obs_free(client, obs);
+        return 1;
     }
-    return 0;
-}
-
-/**
- *  @brief Wait for a message to arrive or the response timer to expire
- *
- *  @param[in] client Pointer to a client structure
- *
- *  @returns Operation status
- *  @retval 0 Success
- *  @retval <0 Error
- */
-static int coap_client_listen_resp(coap_client_t *client)
-{
-    fd_set read_fds = {{0}};
-    int max_fd = 0;
-    int ret = 0;
-
-    while (1)
+    has_seq = coap_client_get_uint_op(msg, COAP_MSG_OBSERVE, &seq);
+    obs = coap_client_obs_find(client, coap_msg_get_token(msg), coap_msg_get_token_len(msg));
+    if (obs == NULL)
     {
-        FD_ZERO(&read_fds);
-        FD_SET(client->sd, &read_fds);
-        FD_SET(client->timer_fd, &read_fds);
-        max_fd = client->sd;
-        if (client->timer_fd > max_fd)
+        if (has_seq)
         {
-            max_fd = client->timer_fd;
+            /* a notification for a cancelled subscription, a reset ends it on the server */
+            coap_log_info("Rejecting notification for an unknown subscription from host %s and port %s", client->server_host, client->server_port);
+            ret = coap_client_reject_con(client, msg);
+            return (ret < 0) ? ret : 1;
         }
-        ret = select(max_fd + 1, &read_fds, NULL, NULL, NULL);
+        return 0;
+    }
+    op_num = coap_client_check_options(msg);
+    if (op_num != 0)
+    {
+        coap_log_info("Found bad option number %u in message from host %s and port %s", op_num, client->server_host, client->server_port);
+        ret = coap_client_reject_con(client, msg);
+        return (ret < 0) ? ret : 1;
+    }
+    if (coap_msg_get_type(msg) == COAP_MSG_CON)
+    {
+        ret = coap_client_send_ack(client, msg);
         if (ret < 0)
         {
-            return -errno;
+            return ret;
         }
-        if (FD_ISSET(client->sd, &read_fds))
+    }
+    /* a response without an Observe option or with an error code ends the subscription */
+    if ((has_seq) && (coap_msg_get_code_class(msg) == COAP_MSG_SUCCESS))
+    {
+        if (!coap_client_obs_is_fresh(obs, seq, &now))
         {
-            break;
+            coap_log_debug("Discarding reordered notification from host %s and port %s", client->server_host, client->server_port);
+            return 1;
         }
-        if (FD_ISSET(client->timer_fd, &read_fds))
+        obs->have_seq = 1;
+        obs->seq = seq;
+        obs->seq_time = now;
+        coap_client_get_uint_op(msg, COAP_MSG_MAX_AGE, &max_age);
+        obs->num_retries = 0;
+        obs->renew.tv_sec = now.tv_sec + max_age + COAP_CLIENT_OBS_MARGIN_SEC;
+        obs->renew.tv_nsec = now.tv_nsec;
+        coap_client_obs_heap_fix(client, obs->heap_index);
+        coap_log_info("Received notification from host %s and port %s", client->server_host, client->server_port);
+        ret = (*obs->notify)(obs, msg);
+        if (ret != 0)
         {
-            return -ETIMEDOUT;
+            coap_client_obs_free(client, obs);
         }
+        return 1;
     }
-    return 0;
-}
-
-/**
- *  @brief Compare the token values in a request message and a response message
- *
- *  @param[in] req Pointer to the request message
- *  @param[in] resp Pointer to the response message
- *
- *  @returns Comparison value
- *  @retval 0 the tokens are not equal
- *  @retval 1 the tokens are equal
- */
-static int coap_client_match_token(coap_msg_t *req, coap_msg_t *resp)
-{
-    return ((coap_msg_get_token_len(resp) == coap_msg_get_token_len(req))
-         && (memcmp(coap_msg_get_token(resp), coap_msg_get_token(req), coap_msg_get_token_len(req)) == 0));
+    coap_log_info("Subscription ended by host %s and port %s", client->server_host, client->server_port);
+    (*obs->notify)(obs, msg);
+    coap_client_obs_free(client, obs);
+    return 1;
 }
 
 /**
- *  @brief Check that all of the options in a message are acceptable
+ *  @brief Handle a message that does not belong to the current exchange
  *
- *  For a proxy, options are acceptable if they are safe to forward or recognized or both.
- *  For a server, options are acceptable if they are elective or recognized or both.
+ *  Notifications are delivered to their subscriptions.
+ *  Other messages are rejected.
  *
- *  @param[in] msg Pointer to message structure
+ *  @param[in,out] client Pointer to a client structure
+ *  @param[in] msg Pointer to a message structure
  *
- *  @returns Operation status or bad option number
+ *  @returns Operation status
  *  @retval 0 Success
- *  @retval >0 Bad option number
+ *  @retval <0 Error
  */
-static unsigned coap_client_check_options(coap_msg_t *msg)
+static int coap_client_handle_other(coap_client_t *client, coap_msg_t *msg)
 {
-#ifdef COAP_PROXY
-    return coap_msg_check_unsafe_ops(msg);
-#else  /* !COAP_PROXY */
-    return coap_msg_check_critical_ops(msg);
-#endif  /* COAP_PROXY */
+    int ret = 0;
+
+    ret = coap_client_obs_recv(client, msg);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    if (ret == 0)
+    {
+        return coap_client_reject(client, msg);
+    }
+    return 0;
 }
 
 /**
@@ -1353,8 +2535,8 @@ static int coap_client_exchange_sep(coap_client_t *client, coap_msg_t *req, coap
         }
         /* message deduplication */
         /* we might have received a duplicate message that was already received from the same server */
-        /* reject the message and continue listening */
-        ret = coap_client_reject(client, resp);
+        /* deliver notifications, reject other messages and continue listening */
+        ret = coap_client_handle_other(client, resp);
         if (ret < 0 )
         {
             return ret;
@@ -1435,8 +2617,8 @@ static int coap_client_exchange_con(coap_client_t *client, coap_msg_t *req, coap
         }
         /* message deduplication */
         /* we might have received a duplicate message that was already received from the same server */
-        /* reject the message and continue listening */
-        ret = coap_client_reject(client, resp);
+        /* deliver notifications, reject other messages and continue listening */
+        ret = coap_client_handle_other(client, resp);
         if (ret < 0 )
         {
             return ret;
@@ -1493,8 +2675,8 @@ static int coap_client_exchange_non(coap_client_t *client, coap_msg_t *req, coap
         }
         /* message deduplication */
         /* we might have received a duplicate message that was already received from the same server */
-        /* reject the message and continue listening */
-        ret = coap_client_reject(client, resp);
+        /* deliver notifications, reject other messages and continue listening */
+        ret = coap_client_handle_other(client, resp);
         if (ret < 0 )
         {
             return ret;
@@ -1506,6 +2688,8 @@ static int coap_client_exchange_non(coap_client_t *client, coap_msg_t *req, coap
 int coap_client_exchange(coap_client_t *client, coap_msg_t *req, coap_msg_t *resp)
 {
     unsigned char msg_id_buf[2] = {0};
+    struct timeval *tvp = NULL;
+    struct timeval tv = {0};
     unsigned msg_id = 0;
     ssize_t num = 0;
     char token[4] = {0};
@@ -1519,6 +2703,13 @@ int coap_client_exchange(coap_client_t *client, coap_msg_t *req, coap_msg_t *res
         return -EINVAL;
     }
 
+    /* do not send a request that cannot complete before the deadline */
+    ret = coap_client_get_remaining(client, &tv, &tvp);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
     /* generate the message ID */
     coap_msg_gen_rand_str((char *)msg_id_buf, sizeof(msg_id_buf));
     msg_id = (((unsigned)msg_id_buf[1]) << 8) | (unsigned)msg_id_buf[0];
@@ -1561,3 +2752,321 @@ int coap_client_exchange(coap_client_t *client, coap_msg_t *req, coap_msg_t *res
     }
     return -EINVAL;
 }
+
+int coap_client_ping(coap_client_t *client)
+{
+    unsigned char msg_id_buf[2] = {0};
+    coap_msg_t resp = {0};
+    coap_msg_t req = {0};
+    unsigned msg_id = 0;
+    ssize_t num = 0;
+    int ret = 0;
+
+    coap_msg_create(&req);
+    ret = coap_msg_set_type(&req, COAP_MSG_CON);
+    if (ret < 0)
+    {
+        coap_msg_destroy(&req);
+        return ret;
+    }
+    coap_msg_gen_rand_str((char *)msg_id_buf, sizeof(msg_id_buf));
+    msg_id = (((unsigned)msg_id_buf[1]) << 8) | (unsigned)msg_id_buf[0];
+    ret = coap_msg_set_msg_id(&req, msg_id);
+    if (ret < 0)
+    {
+        coap_msg_destroy(&req);
+        return ret;
+    }
+    coap_log_info("Sending ping to host %s and port %s", client->server_host, client->server_port);
+    num = coap_client_send(client, &req);
+    if (num < 0)
+    {
+        coap_msg_destroy(&req);
+        return num;
+    }
+    coap_client_start_ack_timer(client);
+    coap_msg_create(&resp);
+    while (1)
+    {
+        ret = coap_client_listen_ack(client, &req);
+        if (ret < 0)
+        {
+            break;
+        }
+        num = coap_client_recv(client, &resp);
+        if (num < 0)
+        {
+            ret = num;
+            break;
+        }
+        if ((coap_msg_get_msg_id(&resp) == msg_id)
+         && ((coap_msg_get_type(&resp) == COAP_MSG_RST)
+          || (coap_msg_get_type(&resp) == COAP_MSG_ACK)))
+        {
+            coap_log_info("Received ping response from host %s and port %s", client->server_host, client->server_port);
+            ret = 0;
+            break;
+        }
+        /* a late message from an earlier exchange or a notification */
+        ret = coap_client_handle_other(client, &resp);
+        if (ret < 0)
+        {
+            break;
+        }
+        coap_msg_reset(&resp);
+    }
+    coap_msg_destroy(&resp);
+    coap_msg_destroy(&req);
+    return ret;
+}
+
+int coap_client_observe(coap_client_t *client,
+                        coap_msg_t *req,
+                        int (* notify)(coap_client_obs_t *, coap_msg_t *),
+                        void *data,
+                        coap_client_obs_t **obs)
+{
+    coap_client_obs_t **heap = NULL;
+    coap_client_obs_t *new_obs = NULL;
+    unsigned max_obs = 0;
+    unsigned seq = 0;
+    ssize_t num = 0;
+    char buf[COAP_MSG_MAX_BUF_LEN] = {0};
+    int ret = 0;
+
+    if ((notify == NULL)
+     || ((coap_msg_get_type(req) != COAP_MSG_CON) && (coap_msg_get_type(req) != COAP_MSG_NON))
+     || (coap_msg_get_code_class(req) != COAP_MSG_REQ)
+     || (coap_msg_get_code_detail(req) != COAP_MSG_GET))
+    {
+        return -EINVAL;
+    }
+    if (client->obs_hash == NULL)
+    {
+        client->obs_hash = (coap_client_obs_t **)calloc(COAP_CLIENT_OBS_HASH_SIZE, sizeof(coap_client_obs_t *));
+        if (client->obs_hash == NULL)
+        {
+            return -ENOMEM;
+        }
+    }
+    if (client->obs_id_hash == NULL)
+    {
+        client->obs_id_hash = (coap_client_obs_t **)calloc(COAP_CLIENT_OBS_HASH_SIZE, sizeof(coap_client_obs_t *));
+        if (client->obs_id_hash == NULL)
+        {
+            return -ENOMEM;
+        }
+    }
+    if (client->num_obs == client->max_obs)
+    {
+        max_obs = (client->max_obs == 0) ? 16 : 2 * client->max_obs;
+        heap = (coap_client_obs_t **)realloc(client->obs_heap, max_obs * sizeof(coap_client_obs_t *));
+        if (heap == NULL)
+        {
+            return -ENOMEM;
+        }
+        client->obs_heap = heap;
+        client->max_obs = max_obs;
+    }
+    new_obs = (coap_client_obs_t *)calloc(1, sizeof(coap_client_obs_t));
+    if (new_obs == NULL)
+    {
+        return -ENOMEM;
+    }
+    /* generate a token that is not used by another subscription */
+    do
+    {
+        coap_msg_gen_rand_str(new_obs->token, sizeof(new_obs->token));
+    }
+    while (coap_client_obs_find(client, new_obs->token, sizeof(new_obs->token)) != NULL);
+    ret = coap_msg_set_token(req, new_obs->token, sizeof(new_obs->token));
+    if (ret < 0)
+    {
+        free(new_obs);
+        return ret;
+    }
+    if (!coap_client_get_uint_op(req, COAP_MSG_OBSERVE, &seq))
+    {
+        /* register: Observe option with the value 0 */
+        ret = coap_msg_add_op(req, COAP_MSG_OBSERVE, 0, "");
+        if (ret < 0)
+        {
+            free(new_obs);
+            return ret;
+        }
+    }
+    num = coap_msg_format(req, buf, sizeof(buf));
+    if (num < 0)
+    {
+        free(new_obs);
+        return num;
+    }
+    new_obs->buf = (char *)malloc(num);
+    if (new_obs->buf == NULL)
+    {
+        free(new_obs);
+        return -ENOMEM;
+    }
+    memcpy(new_obs->buf, buf, num);
+    new_obs->len = num;
+    new_obs->notify = notify;
+    new_obs->data = data;
+    new_obs->heap_index = client->num_obs;
+    client->obs_heap[client->num_obs++] = new_obs;
+    new_obs->next = client->obs_hash[coap_client_obs_hash(new_obs->token)];
+    client->obs_hash[coap_client_obs_hash(new_obs->token)] = new_obs;
+    ret = coap_client_obs_send(client, new_obs);
+    if (ret < 0)
+    {
+        coap_client_obs_free(client, new_obs);
+        return ret;
+    }
+    coap_msg_set_msg_id(req, new_obs->msg_id);
+    if (obs != NULL)
+    {
+        *obs = new_obs;
+    }
+    return 0;
+}
+
+void coap_client_cancel_observe(coap_client_t *client, coap_client_obs_t *obs)
+{
+    coap_log_info("Cancelling subscription with host %s and port %s", client->server_host, client->server_port);
+    coap_client_obs_free(client, obs);
+}
+
+/**
+ *  @brief Start the timer in a client structure for the next renewal
+ *
+ *  @param[in,out] client Pointer to a client structure
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+static int coap_client_obs_start_timer(coap_client_t *client)
+{
+    struct itimerspec its = {{0}};
+    int ret = 0;
+
+    its.it_value = client->obs_heap[0]->renew;
+    if ((its.it_value.tv_sec == 0) && (its.it_value.tv_nsec == 0))
+    {
+        its.it_value.tv_nsec = 1;  /* a zero value would disarm the timer */
+    }
+    ret = timerfd_settime(client->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+    if (ret < 0)
+    {
+        return -errno;
+    }
+    return 0;
+}
+
+/**
+ *  @brief Re-send the registrations that are due
+ *
+ *  @param[in,out] client Pointer to a client structure
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+static int coap_client_obs_renew(coap_client_t *client)
+{
+    struct timespec now = {0};
+    int ret = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    while ((client->num_obs > 0)
+        && (!coap_client_time_before(&now, &client->obs_heap[0]->renew)))
+    {
+        /* sending moves the subscription down the heap */
+        ret = coap_client_obs_send(client, client->obs_heap[0]);
+        if (ret < 0)
+        {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+int coap_client_run(coap_client_t *client)
+{
+    struct timeval *tvp = NULL;
+    struct timeval tv = {0};
+    coap_msg_t msg = {0};
+    fd_set read_fds = {{0}};
+    ssize_t num = 0;
+    int max_fd = 0;
+    int ret = 0;
+
+    while (client->num_obs > 0)
+    {
+        ret = coap_client_get_remaining(client, &tv, &tvp);
+        if (ret < 0)
+        {
+            return ret;
+        }
+        ret = coap_client_obs_start_timer(client);
+        if (ret < 0)
+        {
+            return ret;
+        }
+        FD_ZERO(&read_fds);
+        FD_SET(client->sd, &read_fds);
+        FD_SET(client->timer_fd, &read_fds);
+        max_fd = client->sd;
+        if (client->timer_fd > max_fd)
+        {
+            max_fd = client->timer_fd;
+        }
+        if (client->cancel_fd >= 0)
+        {
+            FD_SET(client->cancel_fd, &read_fds);
+            if (client->cancel_fd > max_fd)
+            {
+                max_fd = client->cancel_fd;
+            }
+        }
+        ret = select(max_fd + 1, &read_fds, NULL, NULL, tvp);
+        if (ret < 0)
+        {
+            return -errno;
+        }
+        if ((client->cancel_fd >= 0) && (FD_ISSET(client->cancel_fd, &read_fds)))
+        {
+            return -ECANCELED;
+        }
+        if (FD_ISSET(client->sd, &read_fds))
+        {
+            coap_msg_create(&msg);
+            num = coap_client_recv(client, &msg);
+            if (num > 0)
+            {
+                ret = coap_client_handle_other(client, &msg);
+            }
+            else if ((num == -EAGAIN) || (num == -EBADMSG))
+            {
+                ret = 0;
+            }
+            else
+            {
+                ret = num;
+            }
+            coap_msg_destroy(&msg);
+            if (ret < 0)
+            {
+                return ret;
+            }
+        }
+        if (FD_ISSET(client->timer_fd, &read_fds))
+        {
+            ret = coap_client_obs_renew(client);
+            if (ret < 0)
+            {
+                return ret;
+            }
+        }
+    }
+    return 0;
+}
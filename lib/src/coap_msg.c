@@ -38,6 +38,9 @@
 #include <errno.h>
 #include <arpa/inet.h>
 #include "coap_msg.h"
+#ifdef COAP_SIM
+#include "coap_sim_wrap.h"
+#endif
 
 #define coap_msg_op_list_get_first(list)       ((list)->first)                  /**< Get the first option from an option linked-list */
 #define coap_msg_op_list_get_last(list)        ((list)->last)                   /**< Get the last option in an option linked-list */
@@ -68,6 +71,7 @@ int coap_msg_op_num_is_recognized(unsigned num)
     case COAP_MSG_URI_HOST:
     case COAP_MSG_ETAG:
     case COAP_MSG_IF_NONE_MATCH:
+    case COAP_MSG_OBSERVE:
     case COAP_MSG_URI_PORT:
     case COAP_MSG_LOCATION_PATH:
     case COAP_MSG_URI_PATH:
@@ -188,6 +192,7 @@ static int coap_msg_op_list_add_last(coap_msg_op_list_t *list, unsigned num, uns
         list->last->next = op;
         list->last = op;
     }
+    list->num++;
     return 0;
 }
 
@@ -215,6 +220,7 @@ static int coap_msg_op_list_add(coap_msg_op_list_t *list, unsigned num, unsigned
     {
         return -ENOMEM;
     }
+    list->num++;
     if (list->first == NULL)
     {
         /* empty list */
@@ -222,6 +228,13 @@ static int coap_msg_op_list_add(coap_msg_op_list_t *list, unsigned num, unsigned
         list->last = op;
         return 0;
     }
+    if (op->num >= list->last->num)
+    {
+        /* end of the list */
+        list->last->next = op;
+        list->last = op;
+        return 0;
+    }
     if (op->num < list->first->num)
     {
         /* start of the list */
@@ -241,10 +254,7 @@ static int coap_msg_op_list_add(coap_msg_op_list_t *list, unsigned num, unsigned
         }
         prev = prev->next;
     }
-    /* end of the list */
-    list->last->next = op;
-    list->last = op;
-    return 0;
+    return 0;  /* should never arrive here */
 }
 
 void coap_msg_create(coap_msg_t *msg)
@@ -506,6 +516,10 @@ static ssize_t coap_msg_parse_op(coap_msg_t *msg, char *buf, size_t len)
     {
         return -EBADMSG;
     }
+    if (msg->op_list.num >= COAP_MSG_MAX_OPS)
+    {
+        return -EBADMSG;
+    }
     prev = coap_msg_op_list_get_last(&msg->op_list);
     if (prev == NULL)
     {
@@ -542,7 +556,7 @@ static ssize_t coap_msg_parse_ops(coap_msg_t *msg, char *buf, size_t len)
 
     while (1)
     {
-        if (((p[0] & 0xff) == 0xff) || (len == 0))
+        if ((len == 0) || ((p[0] & 0xff) == 0xff))
         {
             break;
         }
@@ -687,6 +701,10 @@ int coap_msg_set_token(coap_msg_t *msg, char *buf, size_t len)
 
 int coap_msg_add_op(coap_msg_t *msg, unsigned num, unsigned len, const char *val)
 {
+    if (msg->op_list.num >= COAP_MSG_MAX_OPS)
+    {
+        return -EINVAL;
+    }
     return coap_msg_op_list_add(&msg->op_list, num, len, val);
 }
 
@@ -0,0 +1,316 @@
+/*
+ * Copyright (c) 2015 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ *  @file coap_pub.c
+ *
+ *  @brief Source file for the FreeCoAP non-confirmable publisher library
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "coap_pub.h"
+#include "coap_log.h"
+
+static int rand_init = 0;                                                       /**< Indicates whether or not the random number generator has been initialised */
+
+/**
+ *  @brief Get the current time
+ *
+ *  @returns Monotonic time in nsec
+ */
+static uint64_t coap_pub_now_ns(void)
+{
+    struct timespec ts = {0};
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+int coap_pub_create(coap_pub_t *pub, unsigned batch, unsigned flush_usec)
+{
+    if ((batch == 0) || (batch > COAP_PUB_MAX_BATCH))
+    {
+        return -EINVAL;
+    }
+    memset(pub, 0, sizeof(coap_pub_t));
+    if (!rand_init)
+    {
+        srand(time(NULL));
+        rand_init = 1;
+    }
+    pub->sd = socket(COAP_IPV_AF_INET, SOCK_DGRAM, 0);
+    if (pub->sd < 0)
+    {
+        memset(pub, 0, sizeof(coap_pub_t));
+        return -errno;
+    }
+    pub->batch = batch;
+    pub->flush_ns = (uint64_t)flush_usec * 1000;
+    pub->msg_id = (unsigned)rand() & 0xffff;
+    return 0;
+}
+
+void coap_pub_destroy(coap_pub_t *pub)
+{
+    close(pub->sd);
+    memset(pub, 0, sizeof(coap_pub_t));
+}
+
+int coap_pub_add_dest(coap_pub_t *pub, const char *host, const char *port)
+{
+    coap_pub_dest_t *dest = NULL;
+    struct addrinfo hints = {0};
+    struct addrinfo *list = NULL;
+    struct addrinfo *node = NULL;
+    int ret = 0;
+
+    if (pub->num_dest >= COAP_PUB_MAX_DEST)
+    {
+        return -ENOSPC;
+    }
+    dest = &pub->dest[pub->num_dest];
+    hints.ai_family = COAP_IPV_AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    ret = getaddrinfo(host, port, &hints, &list);
+    if (ret < 0)
+    {
+        return -EBUSY;
+    }
+    for (node = list; node != NULL; node = node->ai_next)
+    {
+        if ((node->ai_family == COAP_IPV_AF_INET)
+         && (node->ai_socktype == SOCK_DGRAM)
+         && (node->ai_addrlen <= sizeof(dest->sin)))
+        {
+            memcpy(&dest->sin, node->ai_addr, node->ai_addrlen);
+            dest->sin_len = node->ai_addrlen;
+            break;
+        }
+    }
+    freeaddrinfo(list);
+    if (node == NULL)
+    {
+        return -EBUSY;
+    }
+    dest->probing_rate = COAP_PUB_PROBING_RATE;
+    dest->next_ns = 0;
+    return pub->num_dest++;
+}
+
+int coap_pub_set_probing_rate(coap_pub_t *pub, unsigned dest, unsigned probing_rate)
+{
+    if ((dest >= pub->num_dest) || (probing_rate == 0))
+    {
+        return -EINVAL;
+    }
+    pub->dest[dest].probing_rate = probing_rate;
+    return 0;
+}
+
+/**
+ *  @brief Check whether or not pacing allows a message to be sent and charge for it
+ *
+ *  The destination is paced with a virtual schedule: each message
+ *  moves the earliest time of the next message on by its length
+ *  divided by the PROBING_RATE. A message may be sent up to one
+ *  flush interval ahead of its schedule so that a batch can carry
+ *  several messages to the same destination.
+ *
+ *  @param[in,out] pub Pointer to a publisher structure
+ *  @param[in,out] dest Pointer to a destination structure
+ *  @param[in] len Length of the message
+ *  @param[in] now_ns Current time (nsec)
+ *
+ *  @returns Pacing decision
+ *  @retval 1 The message may be sent
+ *  @retval 0 The message must wait
+ */
+static int coap_pub_pace(coap_pub_t *pub, coap_pub_dest_t *dest, size_t len, uint64_t now_ns)
+{
+    if (dest->next_ns > now_ns + pub->flush_ns)
+    {
+        return 0;
+    }
+    if (dest->next_ns < now_ns)
+    {
+        dest->next_ns = now_ns;
+    }
+    dest->next_ns += ((uint64_t)len * 1000000000) / dest->probing_rate;
+    return 1;
+}
+
+int coap_pub_flush(coap_pub_t *pub)
+{
+    struct mmsghdr hdr[COAP_PUB_MAX_BATCH];
+    struct iovec iov[COAP_PUB_MAX_BATCH];
+    unsigned char sent[COAP_PUB_MAX_BATCH] = {0};
+    coap_pub_slot_t *slot = NULL;
+    coap_pub_dest_t *dest = NULL;
+    uint64_t now_ns = 0;
+    unsigned num_kept = 0;
+    unsigned num = 0;
+    unsigned off = 0;
+    unsigned i = 0;
+    int ret = 0;
+
+    if (pub->num_queued == 0)
+    {
+        return 0;
+    }
+    now_ns = coap_pub_now_ns();
+    for (i = 0; i < pub->num_queued; i++)
+    {
+        slot = &pub->slot[i];
+        dest = &pub->dest[slot->dest];
+        if (coap_pub_pace(pub, dest, slot->len, now_ns))
+        {
+            sent[i] = 1;
+            iov[num].iov_base = slot->buf;
+            iov[num].iov_len = slot->len;
+            memset(&hdr[num], 0, sizeof(hdr[num]));
+            hdr[num].msg_hdr.msg_name = &dest->sin;
+            hdr[num].msg_hdr.msg_namelen = dest->sin_len;
+            hdr[num].msg_hdr.msg_iov = &iov[num];
+            hdr[num].msg_hdr.msg_iovlen = 1;
+            num++;
+        }
+    }
+    while (off < num)
+    {
+        ret = sendmmsg(pub->sd, &hdr[off], num - off, 0);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            ret = -errno;
+            coap_log_warn("Failed to send %u non-confirmable messages: %s", num - off, strerror(errno));
+            break;
+        }
+        off += ret;
+    }
+    pub->num_sent += off;
+
+    /* keep the messages that pacing held back, in order */
+    if (num < pub->num_queued)
+    {
+        for (i = 0; i < pub->num_queued; i++)
+        {
+            if (sent[i])
+            {
+                /* sent, or dropped after a send error */
+                continue;
+            }
+            if (num_kept != i)
+            {
+                memcpy(&pub->slot[num_kept], &pub->slot[i], sizeof(coap_pub_slot_t));
+            }
+            num_kept++;
+        }
+    }
+    pub->num_queued = num_kept;
+    pub->first_ns = now_ns;
+    if (ret < 0)
+    {
+        return ret;
+    }
+    return off;
+}
+
+int coap_pub_poll(coap_pub_t *pub)
+{
+    if ((pub->num_queued == 0)
+     || (coap_pub_now_ns() - pub->first_ns < pub->flush_ns))
+    {
+        return 0;
+    }
+    return coap_pub_flush(pub);
+}
+
+int coap_pub_publish(coap_pub_t *pub, unsigned dest, coap_msg_t *msg)
+{
+    coap_pub_slot_t *slot = NULL;
+    uint64_t now_ns = 0;
+    ssize_t num = 0;
+    int ret = 0;
+
+    if ((dest >= pub->num_dest) || (coap_msg_get_type(msg) != COAP_MSG_NON))
+    {
+        return -EINVAL;
+    }
+    if (pub->num_queued >= pub->batch)
+    {
+        ret = coap_pub_flush(pub);
+        if (ret < 0)
+        {
+            return ret;
+        }
+        if (pub->num_queued >= pub->batch)
+        {
+            return -ENOBUFS;
+        }
+    }
+    pub->msg_id = (pub->msg_id + 1) & 0xffff;
+    ret = coap_msg_set_msg_id(msg, pub->msg_id);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    slot = &pub->slot[pub->num_queued];
+    num = coap_msg_format(msg, slot->buf, sizeof(slot->buf));
+    if (num < 0)
+    {
+        return num;
+    }
+    slot->len = num;
+    slot->dest = dest;
+    now_ns = coap_pub_now_ns();
+    if (pub->num_queued == 0)
+    {
+        pub->first_ns = now_ns;
+    }
+    pub->num_queued++;
+    if ((pub->num_queued >= pub->batch)
+     || (now_ns - pub->first_ns >= pub->flush_ns))
+    {
+        ret = coap_pub_flush(pub);
+        if (ret < 0)
+        {
+            return ret;
+        }
+    }
+    return 0;
+}
@@ -35,6 +35,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
+#include <limits.h>
 #include <time.h>
 #include <errno.h>
 #include <unistd.h>
@@ -47,12 +48,21 @@
 #include <linux/types.h>
 #ifdef COAP_DTLS_EN
 #include <gnutls/x509.h>
+#include <gnutls/crypto.h>
 #endif
 #include "coap_server.h"
 #include "coap_log.h"
+#include "coap_trace.h"
+#ifdef COAP_SIM
+#include "coap_sim_wrap.h"
+#endif
 
 #define COAP_SERVER_ACK_TIMEOUT_SEC       2                                     /**< Minimum delay to wait before retransmitting a confirmable message */
 #define COAP_SERVER_MAX_RETRANSMIT        4                                     /**< Maximum number of times a confirmable message can be retransmitted */
+#define COAP_SERVER_BUSY_WINDOW_NS        100000000                             /**< Length (nsec) of the window over which the time spent processing is measured */
+#define COAP_SERVER_MAX_RATE              1000000                               /**< Maximum rate and burst accepted for admission control */
+#define COAP_SERVER_SLOT_ACTIVE           1                                     /**< Bit set in the search key of an active transaction */
+#define COAP_SERVER_RES_MAX_HITS          8                                     /**< Maximum number of recent requests counted for a resource */
 
 #ifdef COAP_DTLS_EN
 
@@ -60,8 +70,13 @@
 #define COAP_SERVER_DTLS_RETRANS_TIMEOUT  100                                   /**< Retransmission timeout (msec) for the DTLS handshake */
 #define COAP_SERVER_DTLS_TOTAL_TIMEOUT    5000                                  /**< Total timeout (msec) for the DTLS handshake */
 #define COAP_SERVER_DTLS_NUM_DH_BITS      1024                                  /**< DTLS Diffie-Hellman key size */
+#define COAP_SERVER_DTLS_HANDSHAKE        22                                    /**< DTLS record content type of a handshake message */
 #define COAP_SERVER_DTLS_PRIORITIES       "PERFORMANCE:-VERS-TLS-ALL:+VERS-DTLS1.0:%SERVER_PRECEDENCE"
                                                                                 /**< DTLS priorities */
+#define COAP_SERVER_DTLS_PSK_PRIORITIES   "PERFORMANCE:-VERS-TLS-ALL:+VERS-DTLS1.2:-KX-ALL:+PSK:+ECDHE-PSK:%SERVER_PRECEDENCE"
+                                                                                /**< DTLS priorities for pre-shared keys */
+#define COAP_SERVER_DTLS_RPK_PRIORITIES   "PERFORMANCE:-VERS-TLS-ALL:+VERS-DTLS1.2:-CTYPE-ALL:+CTYPE-SRV-RAWPK:+CTYPE-CLI-RAWPK:%SERVER_PRECEDENCE"
+                                                                                /**< DTLS priorities for raw public keys */
 #endif
 
 static int rand_init = 0;                                                       /**< Indicates if the random number generator has been initialised */
@@ -422,9 +437,72 @@ static int coap_server_trans_dtls_handshake(coap_server_trans_t *trans)
 
 #ifdef COAP_CLIENT_AUTH
 
+/**
+ *  @brief Search the verification cache for a client certificate
+ *
+ *  The trust list and the certificate revocation list are
+ *  loaded once when the server is created and the cache
+ *  lives as long as the server structure, so an entry never
+ *  outlives the lists it was verified against. Changes to
+ *  the files take effect when the server is created again.
+ *
+ *  @param[in] server Pointer to a server structure
+ *  @param[in] fingerprint Fingerprint of the client certificate
+ *
+ *  @returns Search result
+ *  @retval 1 The certificate was verified recently
+ *  @retval 0 The certificate must be verified
+ */
+static int coap_server_verified_find(coap_server_t *server, const unsigned char *fingerprint)
+{
+    time_t current_time = 0;
+    unsigned i = 0;
+
+    current_time = time(NULL);
+    for (i = 0; i < COAP_SERVER_NUM_VERIFIED; i++)
+    {
+        if ((server->verified[i].expire > current_time)
+         && (memcmp(server->verified[i].fingerprint, fingerprint, COAP_SERVER_FINGERPRINT_LEN) == 0))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ *  @brief Add a client certificate to the verification cache
+ *
+ *  The oldest entry is replaced when the cache is full.
+ *
+ *  @param[in,out] server Pointer to a server structure
+ *  @param[in] fingerprint Fingerprint of the client certificate
+ *  @param[in] expiration_time Expiration time of the client certificate
+ */
+static void coap_server_verified_add(coap_server_t *server, const unsigned char *fingerprint, time_t expiration_time)
+{
+    coap_server_verified_t *verified = NULL;
+    time_t expire = 0;
+
+    expire = time(NULL) + COAP_SERVER_VERIFIED_TTL;
+    if (expiration_time < expire)
+    {
+        expire = expiration_time;
+    }
+    verified = &server->verified[server->verified_index];
+    memcpy(verified->fingerprint, fingerprint, COAP_SERVER_FINGERPRINT_LEN);
+    verified->expire = expire;
+    server->verified_index = (server->verified_index + 1) % COAP_SERVER_NUM_VERIFIED;
+}
+
 /**
  *  @brief Verify the clients's certificate
  *
+ *  A client certificate that was verified recently is
+ *  accepted from the verification cache without parsing
+ *  the certificate chain again. The DTLS handshake has
+ *  already proved that the client holds the private key.
+ *
  *  @param[in,out] trans Pointer to a transaction structure
  *
  *  @returns Operation success
@@ -436,13 +514,44 @@ static int coap_server_trans_dtls_verify_peer_cert(coap_server_trans_t *trans)
     gnutls_certificate_type_t cert_type = 0;
     const gnutls_datum_t *cert_list = NULL;
     gnutls_x509_crt_t cert = {0};
+    coap_server_t *server = NULL;
+    unsigned char fingerprint[COAP_SERVER_FINGERPRINT_LEN] = {0};
     unsigned cert_list_size = 0;
     unsigned status = 0;
     time_t expiration_time = 0;
     time_t activation_time = 0;
     time_t current_time = 0;
+    int cache = 0;
     int ret = 0;
 
+    server = trans->server;
+    cert_type = gnutls_certificate_type_get(trans->session);
+    if (cert_type != GNUTLS_CRT_X509)
+    {
+        coap_log_error("The peer certificate is not an X509 certificate");
+        return -1;
+    }
+    cert_list = gnutls_certificate_get_peers(trans->session, &cert_list_size);
+    if ((cert_list == NULL) || (cert_list_size == 0))
+    {
+        coap_log_error("No peer certificate found");
+        return -1;
+    }
+    ret = gnutls_hash_fast(GNUTLS_DIG_SHA256, cert_list[0].data, cert_list[0].size, fingerprint);
+    if (ret == GNUTLS_E_SUCCESS)
+    {
+        cache = coap_server_verified_find(server, fingerprint);
+        if (cache == 1)
+        {
+            server->num_verify_hit++;
+            coap_log_info("Peer certificate found in the verification cache");
+            return 0;
+        }
+    }
+    else
+    {
+        cache = -1;
+    }
     ret = gnutls_certificate_verify_peers2(trans->session, &status);
     if (ret != GNUTLS_E_SUCCESS)
     {
@@ -469,25 +578,12 @@ static int coap_server_trans_dtls_verify_peer_cert(coap_server_trans_t *trans)
         coap_log_error("The peer certificate has been revoked");
         return -1;
     }
-    cert_type = gnutls_certificate_type_get(trans->session);
-    if (cert_type != GNUTLS_CRT_X509)
-    {
-        coap_log_error("The peer certificate is not an X509 certificate");
-        return -1;
-    }
     ret = gnutls_x509_crt_init(&cert);
     if (ret != GNUTLS_E_SUCCESS)
     {
         coap_log_error("Unable to initialise gnutls_x509_crt_t object");
         return -1;
     }
-    cert_list = gnutls_certificate_get_peers(trans->session, &cert_list_size);
-    if (cert_list == NULL)
-    {
-        coap_log_error("No peer certificate found");
-        gnutls_x509_crt_deinit(cert);
-        return -1;
-    }
     /* We only check the first (leaf) certificate in the chain */
     ret = gnutls_x509_crt_import(cert, &cert_list[0], GNUTLS_X509_FMT_DER);
     if (ret != GNUTLS_E_SUCCESS)
@@ -511,6 +607,10 @@ static int coap_server_trans_dtls_verify_peer_cert(coap_server_trans_t *trans)
         gnutls_x509_crt_deinit(cert);
         return -1;
     }
+    if (cache == 0)
+    {
+        coap_server_verified_add(server, fingerprint, expiration_time);
+    }
     coap_log_info("Peer certificate validated");
     gnutls_x509_crt_deinit(cert);
     return 0;
@@ -518,6 +618,84 @@ static int coap_server_trans_dtls_verify_peer_cert(coap_server_trans_t *trans)
 
 #endif  /* COAP_CLIENT_AUTH */
 
+/**
+ *  @brief Verify the client's raw public key
+ *
+ *  @param[in,out] trans Pointer to a transaction structure
+ *
+ *  @returns Operation success
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+static int coap_server_trans_dtls_verify_peer_rpk(coap_server_trans_t *trans)
+{
+    const gnutls_datum_t *cert_list = NULL;
+    coap_server_t *server = NULL;
+    unsigned cert_list_size = 0;
+    unsigned i = 0;
+
+    server = trans->server;
+    if (gnutls_certificate_type_get2(trans->session, GNUTLS_CTYPE_PEERS) != GNUTLS_CRT_RAWPK)
+    {
+        coap_log_error("The peer certificate is not a raw public key");
+        return -1;
+    }
+    cert_list = gnutls_certificate_get_peers(trans->session, &cert_list_size);
+    if ((cert_list == NULL) || (cert_list_size == 0))
+    {
+        coap_log_error("No peer public key found");
+        return -1;
+    }
+    for (i = 0; i < server->num_rpk_trust; i++)
+    {
+        if ((cert_list[0].size == server->rpk_trust[i].size)
+         && (memcmp(cert_list[0].data, server->rpk_trust[i].data, cert_list[0].size) == 0))
+        {
+            coap_log_info("Peer public key validated");
+            return 0;
+        }
+    }
+    coap_log_error("The peer public key is not trusted");
+    return -1;
+}
+
+/**
+ *  @brief Find the pre-shared key for a PSK identity
+ *
+ *  Called by GnuTLS during the handshake.
+ *
+ *  @param[in] session DTLS session
+ *  @param[in] identity String containing the PSK identity sent by the client
+ *  @param[out] key Pointer to a datum structure to receive the key
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval -1 Unknown identity
+ */
+static int coap_server_trans_dtls_psk_func(gnutls_session_t session, const char *identity, gnutls_datum_t *key)
+{
+    coap_server_trans_t *trans = NULL;
+    unsigned char buf[COAP_SERVER_PSK_MAX_LEN] = {0};
+    int len = 0;
+
+    trans = (coap_server_trans_t *)gnutls_transport_get_ptr(session);
+    len = (*trans->server->psk_lookup)(identity, buf, sizeof(buf));
+    if ((len <= 0) || (len > sizeof(buf)))
+    {
+        coap_log_warn("Unknown PSK identity '%s'", identity);
+        return -1;
+    }
+    key->data = gnutls_malloc(len);
+    if (key->data == NULL)
+    {
+        return -1;
+    }
+    memcpy(key->data, buf, len);
+    key->size = len;
+    memset(buf, 0, sizeof(buf));
+    return 0;
+}
+
 /**
  *  @brief Initialise the DTLS members of a transaction structure
  *
@@ -532,16 +710,25 @@ static int coap_server_trans_dtls_verify_peer_cert(coap_server_trans_t *trans)
 static int coap_server_trans_dtls_create(coap_server_trans_t *trans)
 {
     coap_server_t *server = NULL;
+    unsigned flags = 0;
     int ret = 0;
 
     server = trans->server;
-    ret = gnutls_init(&trans->session, GNUTLS_SERVER | GNUTLS_DATAGRAM | GNUTLS_NONBLOCK);
+    flags = GNUTLS_SERVER | GNUTLS_DATAGRAM | GNUTLS_NONBLOCK;
+    if (server->dtls_type == COAP_SERVER_DTLS_RPK)
+    {
+        flags |= GNUTLS_ENABLE_RAWPK;
+    }
+    ret = gnutls_init(&trans->session, flags);
     if (ret != GNUTLS_E_SUCCESS)
     {
         coap_log_error("Failed to initialise DTLS session");
         return -1;
     }
-    ret = gnutls_credentials_set(trans->session, GNUTLS_CRD_CERTIFICATE, server->cred);
+    if (server->dtls_type == COAP_SERVER_DTLS_PSK)
+        ret = gnutls_credentials_set(trans->session, GNUTLS_CRD_PSK, server->psk_cred);
+    else
+        ret = gnutls_credentials_set(trans->session, GNUTLS_CRD_CERTIFICATE, server->cred);
     if (ret != GNUTLS_E_SUCCESS)
     {
         gnutls_deinit(trans->session);
@@ -561,22 +748,45 @@ static int coap_server_trans_dtls_create(coap_server_trans_t *trans)
     gnutls_transport_set_push_function(trans->session, coap_server_trans_dtls_push_func);
     gnutls_dtls_set_mtu(trans->session, COAP_SERVER_DTLS_MTU);
     gnutls_dtls_set_timeouts(trans->session, COAP_SERVER_DTLS_RETRANS_TIMEOUT, COAP_SERVER_DTLS_TOTAL_TIMEOUT);
+    if (server->dtls_type == COAP_SERVER_DTLS_RPK)
+    {
+        gnutls_certificate_server_set_request(trans->session, GNUTLS_CERT_REQUIRE);
+    }
 #ifdef COAP_CLIENT_AUTH
-    gnutls_certificate_server_set_request(trans->session, GNUTLS_CERT_REQUIRE);
+    else if (server->dtls_type == COAP_SERVER_DTLS_X509)
+    {
+        gnutls_certificate_server_set_request(trans->session, GNUTLS_CERT_REQUIRE);
+    }
 #endif
+    coap_trace2(server_dtls_start, trans->client_addr, ntohs(trans->client_sin.COAP_IPV_SIN_PORT));
     ret = coap_server_trans_dtls_handshake(trans);
+    coap_trace3(server_dtls_end, trans->client_addr, ntohs(trans->client_sin.COAP_IPV_SIN_PORT), ret);
     if (ret < 0)
     {
+        /* e.g. a stray record from a closed session or a datagram */
+        /* from another client, only this client is affected */
         gnutls_deinit(trans->session);
-        coap_log_warn("Failed to complete DTLS handshake");
-        return ret;
+        coap_log_warn("Failed to complete DTLS handshake: %s", ret == -1 ? "DTLS error" : strerror(-ret));
+        return -1;
+    }
+    if (server->dtls_type == COAP_SERVER_DTLS_RPK)
+    {
+        ret = coap_server_trans_dtls_verify_peer_rpk(trans);
+        if (ret < 0)
+        {
+            gnutls_deinit(trans->session);
+            return ret;
+        }
     }
 #ifdef COAP_CLIENT_AUTH
-    ret = coap_server_trans_dtls_verify_peer_cert(trans);
-    if (ret < 0)
+    else if (server->dtls_type == COAP_SERVER_DTLS_X509)
     {
-        gnutls_deinit(trans->session);
-        return ret;
+        ret = coap_server_trans_dtls_verify_peer_cert(trans);
+        if (ret < 0)
+        {
+            gnutls_deinit(trans->session);
+            return ret;
+        }
     }
 #endif
     return 0;
@@ -599,6 +809,55 @@ static void coap_server_trans_dtls_destroy(coap_server_trans_t *trans)
  *                                        coap_server_trans                                         *
  ****************************************************************************************************/
 
+/**
+ *  @brief Hash a socket structure
+ *
+ *  @param[in] buf Pointer to the socket structure
+ *  @param[in] len Length of the socket structure
+ *
+ *  @returns FNV-1a hash of the socket structure
+ */
+static uint32_t coap_server_hash(const void *buf, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+    uint32_t hash = 2166136261u;
+    size_t i = 0;
+
+    for (i = 0; i < len; i++)
+    {
+        hash = (hash ^ p[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ *  @brief Get the search key for a client
+ *
+ *  The active bit is set in the key so that an empty
+ *  slot structure never matches a client.
+ *
+ *  @param[in] client_sin Pointer to a socket structure
+ *  @param[in] client_sin_len Length of the socket structure
+ *
+ *  @returns Search key
+ */
+static uint32_t coap_server_key(coap_ipv_sockaddr_in_t *client_sin, socklen_t client_sin_len)
+{
+    return coap_server_hash(client_sin, client_sin_len) | COAP_SERVER_SLOT_ACTIVE;
+}
+
+/**
+ *  @brief Get the slot structure for a transaction structure
+ *
+ *  @param[in] trans Pointer to a transaction structure
+ *
+ *  @returns Pointer to the slot structure at the same index as the transaction structure
+ */
+static coap_server_slot_t *coap_server_trans_slot(coap_server_trans_t *trans)
+{
+    return &trans->server->slot[trans - trans->server->trans];
+}
+
 /**
  *  @brief Deinitialise a transaction structure
  *
@@ -613,17 +872,18 @@ static void coap_server_trans_destroy(coap_server_trans_t *trans)
     coap_msg_destroy(&trans->resp);
     coap_msg_destroy(&trans->req);
     close(trans->timer_fd);
+    memset(coap_server_trans_slot(trans), 0, sizeof(coap_server_slot_t));
     memset(trans, 0, sizeof(coap_server_trans_t));
 }
 
 /**
  *  @brief Mark the last time the transaction structure was used
  *
- *  @param[out] trans Pointer to a transaction structure
+ *  @param[in] trans Pointer to a transaction structure
  */
 static void coap_server_trans_touch(coap_server_trans_t *trans)
 {
-    trans->last_use = time(NULL);
+    coap_server_trans_slot(trans)->last_use = time(NULL);
 }
 
 /**
@@ -676,6 +936,7 @@ static void coap_server_trans_clear_req(coap_server_trans_t *trans)
 static void coap_server_trans_clear_resp(coap_server_trans_t *trans)
 {
     coap_msg_destroy(&trans->resp);
+    trans->resp_len = 0;
 }
 
 /**
@@ -707,9 +968,27 @@ static int coap_server_trans_set_req(coap_server_trans_t *trans, coap_msg_t *msg
 static int coap_server_trans_set_resp(coap_server_trans_t *trans, coap_msg_t *msg)
 {
     coap_msg_reset(&trans->resp);
+    trans->resp_len = 0;
     return coap_msg_copy(&trans->resp, msg);
 }
 
+/**
+ *  @brief Set the response sent from a response template in a transaction structure
+ *
+ *  The formatted response is kept so that it can be sent again if the
+ *  request is duplicated. The response message in the transaction structure
+ *  only holds its header fields.
+ *
+ *  @param[in,out] trans Pointer to a transaction structure
+ *  @param[in] buf Buffer containing the formatted response
+ *  @param[in] len Length of the formatted response
+ */
+static void coap_server_trans_set_resp_buf(coap_server_trans_t *trans, const char *buf, size_t len)
+{
+    memcpy(trans->resp_buf, buf, len);
+    trans->resp_len = len;
+}
+
 /**
  *  @brief Initialise the acknowledgement timer in a transaction structure
  *
@@ -855,31 +1134,26 @@ static int coap_server_trans_update_ack_timer(coap_server_trans_t *trans)
 }
 
 /**
- *  @brief Send a message to the client
+ *  @brief Send an encoded message to the client
  *
  *  @param[in,out] trans Pointer to a transaction structure
- *  @param[in] msg Pointer to a message structure
+ *  @param[in] buf Buffer containing the message
+ *  @param[in] len Length of the buffer
  *
  *  @returns Number of bytes sent or error code
  *  @retval >0 Number of bytes sent
  *  @retval <0 Error
  */
-static ssize_t coap_server_trans_send(coap_server_trans_t *trans, coap_msg_t *msg)
+static ssize_t coap_server_trans_send_buf(coap_server_trans_t *trans, const char *buf, size_t len)
 {
 #ifndef COAP_DTLS_EN
     coap_server_t *server = NULL;
 #endif
     ssize_t num = 0;
-    char buf[COAP_MSG_MAX_BUF_LEN] = {0};
 
-    num = coap_msg_format(msg, buf, sizeof(buf));
-    if (num < 0)
-    {
-        return num;
-    }
 #ifdef COAP_DTLS_EN
     errno = 0;
-    num = gnutls_record_send(trans->session, buf, num);
+    num = gnutls_record_send(trans->session, buf, len);
     if (errno != 0)
     {
         return -errno;
@@ -900,17 +1174,41 @@ static ssize_t coap_server_trans_send(coap_server_trans_t *trans, coap_msg_t *ms
     }
 #else
     server = trans->server;
-    num = sendto(server->sd, buf, num, 0, (struct sockaddr *)&trans->client_sin, trans->client_sin_len);
+    num = sendto(server->sd, buf, len, 0, (struct sockaddr *)&trans->client_sin, trans->client_sin_len);
     if (num < 0)
     {
         return -errno;
     }
 #endif
+    coap_trace5(server_send, trans->client_addr, ntohs(trans->client_sin.COAP_IPV_SIN_PORT), coap_trace_buf_msg_id(buf), buf, len);
     coap_server_trans_touch(trans);
     coap_log_debug("Sent to address %s and port %u", trans->client_addr, ntohs(trans->client_sin.COAP_IPV_SIN_PORT));
     return num;
 }
 
+/**
+ *  @brief Send a message to the client
+ *
+ *  @param[in,out] trans Pointer to a transaction structure
+ *  @param[in] msg Pointer to a message structure
+ *
+ *  @returns Number of bytes sent or error code
+ *  @retval >0 Number of bytes sent
+ *  @retval <0 Error
+ */
+static ssize_t coap_server_trans_send(coap_server_trans_t *trans, coap_msg_t *msg)
+{
+    ssize_t num = 0;
+    char buf[COAP_MSG_MAX_BUF_LEN] = {0};
+
+    num = coap_msg_format(msg, buf, sizeof(buf));
+    if (num < 0)
+    {
+        return num;
+    }
+    return coap_server_trans_send_buf(trans, buf, num);
+}
+
 /**
  *  @brief Handle a format error in a received message
  *
@@ -1013,6 +1311,7 @@ static ssize_t coap_server_trans_recv(coap_server_trans_t *trans, coap_msg_t *ms
         return -errno;
     }
 #endif
+    coap_trace5(server_recv, trans->client_addr, ntohs(trans->client_sin.COAP_IPV_SIN_PORT), num >= 4 ? coap_trace_buf_msg_id(buf) : 0, buf, num);
     ret = coap_msg_parse(msg, buf, num);
     if (ret < 0)
     {
@@ -1022,6 +1321,10 @@ static ssize_t coap_server_trans_recv(coap_server_trans_t *trans, coap_msg_t *ms
         }
         return ret;
     }
+    coap_trace7(server_parse, trans->client_addr, ntohs(trans->client_sin.COAP_IPV_SIN_PORT),
+                coap_msg_get_msg_id(msg), coap_msg_get_type(msg),
+                (coap_msg_get_code_class(msg) << 5) | coap_msg_get_code_detail(msg),
+                coap_msg_get_token(msg), coap_msg_get_token_len(msg));
     coap_server_trans_touch(trans);
     coap_log_debug("Received from address %s and port %u", trans->client_addr, ntohs(trans->client_sin.COAP_IPV_SIN_PORT));
     return num;
@@ -1251,6 +1554,50 @@ static int coap_server_trans_send_ack(coap_server_trans_t *trans, coap_msg_t *ms
     return 0;
 }
 
+/**
+ *  @brief Answer a duplicate confirmable request
+ *
+ *  A piggy-backed response is sent again as it was recorded,
+ *  it may have been lost and the client would otherwise wait
+ *  for a separate response that never comes. Otherwise the
+ *  request is acknowledged again and a separate response is
+ *  left to its own retransmission.
+ *
+ *  @param[in,out] trans Pointer to a transaction structure
+ *  @param[in] msg Pointer to the duplicate request message
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+static int coap_server_trans_send_dup(coap_server_trans_t *trans, coap_msg_t *msg)
+{
+    ssize_t num = 0;
+
+    if ((!coap_server_trans_match_resp(trans, msg))
+     || (coap_msg_get_type(&trans->resp) != COAP_MSG_ACK))
+    {
+        return coap_server_trans_send_ack(trans, msg);
+    }
+    if (trans->resp_len > 0)
+    {
+        num = coap_server_trans_send_buf(trans, trans->resp_buf, trans->resp_len);
+    }
+    else if (!coap_msg_is_empty(&trans->resp))
+    {
+        num = coap_server_trans_send(trans, &trans->resp);
+    }
+    else
+    {
+        return coap_server_trans_send_ack(trans, msg);
+    }
+    if (num < 0)
+    {
+        return num;
+    }
+    return 0;
+}
+
 /**
  *  @brief Handle an acknowledgement timeout
  *
@@ -1274,6 +1621,7 @@ static int coap_server_trans_handle_ack_timeout(coap_server_trans_t *trans)
     if (ret == 0)
     {
         coap_log_debug("Retransmitting to address %s and port %u", trans->client_addr, ntohs(trans->client_sin.COAP_IPV_SIN_PORT));
+        coap_trace4(server_retransmit, trans->client_addr, ntohs(trans->client_sin.COAP_IPV_SIN_PORT), coap_msg_get_msg_id(&trans->resp), trans->num_retrans);
         num = coap_server_trans_send(trans, &trans->resp);
         if (num < 0)
         {
@@ -1304,14 +1652,15 @@ static int coap_server_trans_handle_ack_timeout(coap_server_trans_t *trans)
  */
 static int coap_server_trans_create(coap_server_trans_t *trans, coap_server_t *server, coap_ipv_sockaddr_in_t *client_sin, socklen_t client_sin_len)
 {
+    coap_server_slot_t *slot = NULL;
     const char *p = NULL;
 #ifdef COAP_DTLS_EN
     int ret = 0;
 #endif
 
     memset(trans, 0, sizeof(coap_server_trans_t));
-    trans->active = 1;
-    coap_server_trans_touch(trans);
+    trans->server = server;
+    slot = coap_server_trans_slot(trans);
     trans->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
     if (trans->timer_fd < 0)
     {
@@ -1329,7 +1678,8 @@ static int coap_server_trans_create(coap_server_trans_t *trans, coap_server_t *s
     }
     coap_msg_create(&trans->req);
     coap_msg_create(&trans->resp);
-    trans->server = server;
+    slot->key = coap_server_key(client_sin, client_sin_len);
+    coap_server_trans_touch(trans);
 #ifdef COAP_DTLS_EN
     ret = coap_server_trans_dtls_create(trans);
     if (ret < 0)
@@ -1337,10 +1687,12 @@ static int coap_server_trans_create(coap_server_trans_t *trans, coap_server_t *s
         coap_msg_destroy(&trans->resp);
         coap_msg_destroy(&trans->req);
         close(trans->timer_fd);
+        memset(slot, 0, sizeof(coap_server_slot_t));
         memset(trans, 0, sizeof(coap_server_trans_t));
         return ret;
     }
 #endif
+    coap_trace3(server_trans_create, trans->client_addr, ntohs(trans->client_sin.COAP_IPV_SIN_PORT), (int)(trans - server->trans));
     coap_log_debug("Created transaction for address %s and port %u", trans->client_addr, ntohs(trans->client_sin.COAP_IPV_SIN_PORT));
     return 0;
 }
@@ -1446,39 +1798,227 @@ static int coap_server_dtls_create(coap_server_t *server,
 }
 
 /**
- *  @brief Deinitialise the DTLS members of a server structure
+ *  @brief Initialise the DTLS members of a server structure for pre-shared keys
  *
- *  @param[in,out] trans Pointer to a server structure
+ *  @param[out] server Pointer to a server structure
+ *  @param[in] psk_lookup Call-back function to find the pre-shared key for an identity
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval -1 Error
  */
-static void coap_server_dtls_destroy(coap_server_t *server)
+static int coap_server_dtls_create_psk(coap_server_t *server, int (* psk_lookup)(const char *, unsigned char *, size_t))
 {
-    gnutls_priority_deinit(server->priority);
-    gnutls_certificate_free_credentials(server->cred);
-    gnutls_dh_params_deinit(server->dh_params);
-    gnutls_global_deinit();
-}
-
-#endif  /* COAP_DTLS_EN */
+    int ret = 0;
 
-/****************************************************************************************************
+    ret = gnutls_global_init();
+    if (ret != GNUTLS_E_SUCCESS)
+    {
+        coap_log_error("Failed to initialise DTLS library");
+        return -1;
+    }
+    ret = gnutls_psk_allocate_server_credentials(&server->psk_cred);
+    if (ret != GNUTLS_E_SUCCESS)
+    {
+        gnutls_global_deinit();
+        coap_log_error("Failed to allocate DTLS credentials");
+        return -1;
+    }
+    gnutls_psk_set_server_credentials_function(server->psk_cred, coap_server_trans_dtls_psk_func);
+    ret = gnutls_priority_init(&server->priority, COAP_SERVER_DTLS_PSK_PRIORITIES, NULL);
+    if (ret != GNUTLS_E_SUCCESS)
+    {
+        gnutls_psk_free_server_credentials(server->psk_cred);
+        gnutls_global_deinit();
+        coap_log_error("Failed to initialise priorities for DTLS session");
+        return -1;
+    }
+    server->psk_lookup = psk_lookup;
+    server->dtls_type = COAP_SERVER_DTLS_PSK;
+    return 0;
+}
+
+/**
+ *  @brief Free the trusted raw public keys in a server structure
+ *
+ *  @param[in,out] server Pointer to a server structure
+ */
+static void coap_server_dtls_free_rpk_trust(coap_server_t *server)
+{
+    unsigned i = 0;
+
+    for (i = 0; i < server->num_rpk_trust; i++)
+    {
+        gnutls_free(server->rpk_trust[i].data);
+    }
+    memset(server->rpk_trust, 0, sizeof(server->rpk_trust));
+    server->num_rpk_trust = 0;
+}
+
+/**
+ *  @brief Load trusted raw public keys into a server structure
+ *
+ *  The file contains one or more PEM encoded public keys.
+ *
+ *  @param[in,out] server Pointer to a server structure
+ *  @param[in] trust_file_name String containing the trust file name
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval -1 Error
+ */
+static int coap_server_dtls_load_rpk_trust(coap_server_t *server, const char *trust_file_name)
+{
+    const char begin[] = "-----BEGIN PUBLIC KEY-----";
+    const char end[] = "-----END PUBLIC KEY-----";
+    gnutls_datum_t file = {0};
+    gnutls_datum_t pem = {0};
+    char *start = NULL;
+    char *stop = NULL;
+    int ret = 0;
+
+    ret = gnutls_load_file(trust_file_name, &file);
+    if (ret != GNUTLS_E_SUCCESS)
+    {
+        return -1;
+    }
+    /* the loaded data is null terminated */
+    start = (char *)file.data;
+    while ((start = strstr(start, begin)) != NULL)
+    {
+        stop = strstr(start, end);
+        if ((stop == NULL) || (server->num_rpk_trust >= COAP_SERVER_RPK_MAX_TRUST))
+        {
+            break;
+        }
+        stop += sizeof(end) - 1;
+        pem.data = (unsigned char *)start;
+        pem.size = stop - start;
+        ret = gnutls_pem_base64_decode2("PUBLIC KEY", &pem, &server->rpk_trust[server->num_rpk_trust]);
+        if (ret != GNUTLS_E_SUCCESS)
+        {
+            break;
+        }
+        server->num_rpk_trust++;
+        start = stop;
+    }
+    gnutls_free(file.data);
+    if ((ret != GNUTLS_E_SUCCESS) || (server->num_rpk_trust == 0))
+    {
+        coap_server_dtls_free_rpk_trust(server);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ *  @brief Initialise the DTLS members of a server structure for raw public keys
+ *
+ *  @param[out] server Pointer to a server structure
+ *  @param[in] key_file_name String containing the DTLS private key file name
+ *  @param[in] pub_key_file_name String containing the DTLS public key file name
+ *  @param[in] trust_file_name String containing the name of a file of trusted client public keys
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval -1 Error
+ */
+static int coap_server_dtls_create_rpk(coap_server_t *server,
+                                       const char *key_file_name,
+                                       const char *pub_key_file_name,
+                                       const char *trust_file_name)
+{
+    int ret = 0;
+
+    ret = gnutls_global_init();
+    if (ret != GNUTLS_E_SUCCESS)
+    {
+        coap_log_error("Failed to initialise DTLS library");
+        return -1;
+    }
+    ret = gnutls_certificate_allocate_credentials(&server->cred);
+    if (ret != GNUTLS_E_SUCCESS)
+    {
+        gnutls_global_deinit();
+        coap_log_error("Failed to allocate DTLS credentials");
+        return -1;
+    }
+    ret = coap_server_dtls_load_rpk_trust(server, trust_file_name);
+    if (ret < 0)
+    {
+        gnutls_certificate_free_credentials(server->cred);
+        gnutls_global_deinit();
+        coap_log_error("Failed to load trusted raw public keys");
+        return -1;
+    }
+    ret = gnutls_certificate_set_rawpk_key_file(server->cred, pub_key_file_name, key_file_name, GNUTLS_X509_FMT_PEM, NULL, 0, NULL, 0, 0, 0);
+    if (ret != GNUTLS_E_SUCCESS)
+    {
+        coap_server_dtls_free_rpk_trust(server);
+        gnutls_certificate_free_credentials(server->cred);
+        gnutls_global_deinit();
+        coap_log_error("Failed to assign raw public key file and key file to DTLS credentials");
+        return -1;
+    }
+    ret = gnutls_priority_init(&server->priority, COAP_SERVER_DTLS_RPK_PRIORITIES, NULL);
+    if (ret != GNUTLS_E_SUCCESS)
+    {
+        coap_server_dtls_free_rpk_trust(server);
+        gnutls_certificate_free_credentials(server->cred);
+        gnutls_global_deinit();
+        coap_log_error("Failed to initialise priorities for DTLS session");
+        return -1;
+    }
+    server->dtls_type = COAP_SERVER_DTLS_RPK;
+    return 0;
+}
+
+/**
+ *  @brief Deinitialise the DTLS members of a server structure
+ *
+ *  @param[in,out] trans Pointer to a server structure
+ */
+static void coap_server_dtls_destroy(coap_server_t *server)
+{
+    gnutls_priority_deinit(server->priority);
+    if (server->dtls_type == COAP_SERVER_DTLS_PSK)
+    {
+        gnutls_psk_free_server_credentials(server->psk_cred);
+    }
+    else
+    {
+        gnutls_certificate_free_credentials(server->cred);
+    }
+    if (server->dtls_type == COAP_SERVER_DTLS_X509)
+    {
+        gnutls_dh_params_deinit(server->dh_params);
+    }
+    coap_server_dtls_free_rpk_trust(server);
+    gnutls_global_deinit();
+}
+
+#endif  /* COAP_DTLS_EN */
+
+/****************************************************************************************************
  *                                           coap_server                                            *
  ****************************************************************************************************/
 
-#ifdef COAP_DTLS_EN
-int coap_server_create(coap_server_t *server,
-                       int (* handle)(coap_server_t *, coap_msg_t *, coap_msg_t *),
-                       const char *host,
-                       const char *port,
-                       const char *key_file_name,
-                       const char *cert_file_name,
-                       const char *trust_file_name,
-                       const char *crl_file_name)
-#else
-int coap_server_create(coap_server_t *server,
-                       int (* handle)(coap_server_t *, coap_msg_t *, coap_msg_t *),
-                       const char *host,
-                       const char *port)
-#endif
+/**
+ *  @brief Open the socket of a server structure
+ *
+ *  @param[out] server Pointer to a server structure
+ *  @param[in] handle Call-back function to handle client requests
+ *  @param[in] host Pointer to a string containing the host address of the server
+ *  @param[in] port Port number of the server
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+static int coap_server_open(coap_server_t *server,
+                            int (* handle)(coap_server_t *, coap_msg_t *, coap_msg_t *),
+                            const char *host,
+                            const char *port)
 {
     unsigned char msg_id[2] = {0};
     struct addrinfo hints = {0};
@@ -1558,19 +2098,120 @@ int coap_server_create(coap_server_t *server,
     server->msg_id = (((unsigned)msg_id[1]) << 8) | (unsigned)msg_id[0];
     coap_server_path_list_create(&server->sep_list);
     server->handle = handle;
+    return 0;
+}
+
+/**
+ *  @brief Close the socket of a server structure
+ *
+ *  @param[in,out] server Pointer to a server structure
+ */
+static void coap_server_close(coap_server_t *server)
+{
+    coap_server_path_list_destroy(&server->sep_list);
+    close(server->sd);
+    memset(server, 0, sizeof(coap_server_t));
+}
+
 #ifdef COAP_DTLS_EN
+int coap_server_create(coap_server_t *server,
+                       int (* handle)(coap_server_t *, coap_msg_t *, coap_msg_t *),
+                       const char *host,
+                       const char *port,
+                       const char *key_file_name,
+                       const char *cert_file_name,
+                       const char *trust_file_name,
+                       const char *crl_file_name)
+{
+    int ret = 0;
+
+    ret = coap_server_open(server, handle, host, port);
+    if (ret < 0)
+    {
+        return ret;
+    }
     ret = coap_server_dtls_create(server, key_file_name, cert_file_name, trust_file_name, crl_file_name);
     if (ret < 0)
     {
-        coap_server_path_list_destroy(&server->sep_list);
-        close(server->sd);
-        memset(server, 0, sizeof(coap_server_t));
+        coap_server_close(server);
+        return ret;
+    }
+    coap_log_notice("Listening on address %s and port %s", host, port);
+    return 0;
+}
+
+int coap_server_create_psk(coap_server_t *server,
+                           int (* handle)(coap_server_t *, coap_msg_t *, coap_msg_t *),
+                           const char *host,
+                           const char *port,
+                           int (* psk_lookup)(const char *, unsigned char *, size_t))
+{
+    int ret = 0;
+
+    if (psk_lookup == NULL)
+    {
+        return -EINVAL;
+    }
+    ret = coap_server_open(server, handle, host, port);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    ret = coap_server_dtls_create_psk(server, psk_lookup);
+    if (ret < 0)
+    {
+        coap_server_close(server);
+        return ret;
+    }
+    coap_log_notice("Listening on address %s and port %s", host, port);
+    return 0;
+}
+
+int coap_server_create_rpk(coap_server_t *server,
+                           int (* handle)(coap_server_t *, coap_msg_t *, coap_msg_t *),
+                           const char *host,
+                           const char *port,
+                           const char *key_file_name,
+                           const char *pub_key_file_name,
+                           const char *trust_file_name)
+{
+    int ret = 0;
+
+    if ((key_file_name == NULL) || (pub_key_file_name == NULL) || (trust_file_name == NULL))
+    {
+        return -EINVAL;
+    }
+    ret = coap_server_open(server, handle, host, port);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    ret = coap_server_dtls_create_rpk(server, key_file_name, pub_key_file_name, trust_file_name);
+    if (ret < 0)
+    {
+        coap_server_close(server);
+        return ret;
+    }
+    coap_log_notice("Listening on address %s and port %s", host, port);
+    return 0;
+}
+#else
+int coap_server_create(coap_server_t *server,
+                       int (* handle)(coap_server_t *, coap_msg_t *, coap_msg_t *),
+                       const char *host,
+                       const char *port)
+{
+    int ret = 0;
+
+    ret = coap_server_open(server, handle, host, port);
+    if (ret < 0)
+    {
         return ret;
     }
-#endif
     coap_log_notice("Listening on address %s and port %s", host, port);
     return 0;
 }
+#endif
 
 void coap_server_destroy(coap_server_t *server)
 {
@@ -1580,7 +2221,7 @@ void coap_server_destroy(coap_server_t *server)
     for (i = 0; i < COAP_SERVER_NUM_TRANS; i++)
     {
         trans = &server->trans[i];
-        if (trans->active)
+        if (server->slot[i].key != 0)
         {
             coap_server_trans_destroy(trans);
         }
@@ -1588,9 +2229,7 @@ void coap_server_destroy(coap_server_t *server)
 #ifdef COAP_DTLS_EN
     coap_server_dtls_destroy(server);
 #endif
-    coap_server_path_list_destroy(&server->sep_list);
-    close(server->sd);
-    memset(server, 0, sizeof(coap_server_t));
+    coap_server_close(server);
 }
 
 unsigned coap_server_get_next_msg_id(coap_server_t *server)
@@ -1640,13 +2279,18 @@ static unsigned coap_server_check_options(coap_msg_t *msg)
 static coap_server_trans_t *coap_server_find_trans(coap_server_t *server, coap_ipv_sockaddr_in_t *client_sin, socklen_t client_sin_len)
 {
     coap_server_trans_t *trans = NULL;
+    uint32_t key = 0;
     unsigned i = 0;
 
+    key = coap_server_key(client_sin, client_sin_len);
     for (i = 0; i < COAP_SERVER_NUM_TRANS; i++)
     {
+        if (server->slot[i].key != key)
+        {
+            continue;
+        }
         trans = &server->trans[i];
-        if ((trans->active)
-         && (trans->client_sin_len == client_sin_len)
+        if ((trans->client_sin_len == client_sin_len)
          && (memcmp(&trans->client_sin, client_sin, client_sin_len) == 0))
         {
             coap_log_debug("Found existing transaction at index %u", i);
@@ -1666,147 +2310,945 @@ static coap_server_trans_t *coap_server_find_trans(coap_server_t *server, coap_i
  */
 static coap_server_trans_t *coap_server_find_empty_trans(coap_server_t *server)
 {
-    coap_server_trans_t *trans = NULL;
     unsigned i = 0;
 
     for (i = 0; i < COAP_SERVER_NUM_TRANS; i++)
     {
-        trans = &server->trans[i];
-        if (!trans->active)
+        if (server->slot[i].key == 0)
         {
             coap_log_debug("Found empty transaction at index %u", i);
-            return trans;
+            return &server->trans[i];
         }
     }
-    return NULL;
+    return NULL;
+}
+
+/**
+ *  @brief Search for the oldest transaction structure in a server structure
+ *
+ *  Search for the transaction structure in a server structure that was
+ *  used least recently.
+ *
+ *  @param[in] server Pointer to a server structure
+ *
+ *  @returns Pointer to a transaction structure
+ */
+static coap_server_trans_t *coap_server_find_oldest_trans(coap_server_t *server)
+{
+    coap_server_slot_t *slot = NULL;
+    unsigned i = 0;
+    unsigned j = 0;
+    uint32_t min_last_use = 0;
+
+    for (i = 0; i < COAP_SERVER_NUM_TRANS; i++)
+    {
+        slot = &server->slot[i];
+        if (slot->key != 0)
+        {
+            if ((min_last_use == 0) || (slot->last_use < min_last_use))
+            {
+                min_last_use = slot->last_use;
+                j = i;
+            }
+        }
+    }
+    coap_log_debug("Found oldest transaction at index %u", j);
+    return &server->trans[j];
+}
+
+/**
+ *  @brief Get the number of nanoseconds elapsed between two times
+ *
+ *  @param[in] start Pointer to the earlier time
+ *  @param[in] end Pointer to the later time
+ *
+ *  @returns Number of nanoseconds elapsed
+ */
+static uint64_t coap_server_elapsed_ns(struct timespec *start, struct timespec *end)
+{
+    int64_t ns = 0;
+
+    ns = ((int64_t)end->tv_sec - (int64_t)start->tv_sec) * 1000000000LL
+       + ((int64_t)end->tv_nsec - (int64_t)start->tv_nsec);
+    return ns > 0 ? (uint64_t)ns : 0;
+}
+
+/**
+ *  @brief Account for time spent waiting or processing
+ *
+ *  Maintain a moving average of the percentage of time
+ *  spent processing messages, updated at the end of each
+ *  measurement window.
+ *
+ *  @param[in,out] server Pointer to a server structure
+ *  @param[in] ns Number of nanoseconds
+ *  @param[in] busy Flag to indicate if the time was spent processing
+ */
+static void coap_server_account(coap_server_t *server, uint64_t ns, int busy)
+{
+    unsigned pct = 0;
+
+    server->window_ns += ns;
+    if (busy)
+    {
+        server->busy_ns += ns;
+    }
+    if (server->window_ns >= COAP_SERVER_BUSY_WINDOW_NS)
+    {
+        pct = (unsigned)((server->busy_ns * 100) / server->window_ns);
+        server->busy_pct = (server->busy_pct * 3 + pct) / 4;
+        server->busy_ns = 0;
+        server->window_ns = 0;
+    }
+}
+
+/**
+ *  @brief Add the tokens earned since the last fill to a token bucket
+ *
+ *  @param[in] server Pointer to a server structure
+ *  @param[in,out] bucket Pointer to a token bucket structure
+ *  @param[in] now Pointer to the current time
+ */
+static void coap_server_fill_bucket(coap_server_t *server, coap_server_bucket_t *bucket, struct timespec *now)
+{
+    uint64_t tokens = 0;
+    uint64_t ms = 0;
+
+    ms = coap_server_elapsed_ns(&bucket->last_fill, now) / 1000000;
+    if (ms > 0)
+    {
+        tokens = bucket->tokens + ms * server->rate;
+        bucket->tokens = tokens < server->burst * 1000 ? (unsigned)tokens : server->burst * 1000;
+        bucket->last_fill = *now;
+    }
+}
+
+/**
+ *  @brief Find the token bucket for a client address
+ *
+ *  A client address may be held in one of a small set of
+ *  token buckets selected by a hash of the address. If the
+ *  address is not found, an unused bucket in the set is
+ *  given to the address with a full burst of tokens or,
+ *  if the set is in use, the bucket with the most tokens,
+ *  or the least recently filled of those with the most
+ *  tokens, is given to the address along with its tokens. A client
+ *  that has used up its tokens cannot get a full burst back
+ *  by having its bucket evicted by colliding addresses:
+ *  the bucket is only evicted when no other bucket in the
+ *  set has more tokens, and buckets refill at the same rate.
+ *
+ *  @param[in,out] server Pointer to a server structure
+ *  @param[in] addr Pointer to the client address
+ *  @param[in] now Pointer to the current time
+ *
+ *  @returns Pointer to a token bucket structure
+ */
+static coap_server_bucket_t *coap_server_find_bucket(coap_server_t *server, coap_ipv_in_addr_t *addr, struct timespec *now)
+{
+    coap_server_bucket_t *bucket = NULL;
+    coap_server_bucket_t *victim = NULL;
+    uint32_t hash = 0;
+    unsigned i = 0;
+
+    hash = coap_server_hash(addr, sizeof(coap_ipv_in_addr_t));
+    bucket = &server->bucket[(hash % (COAP_SERVER_NUM_BUCKETS / COAP_SERVER_BUCKET_WAYS)) * COAP_SERVER_BUCKET_WAYS];
+    for (i = 0; i < COAP_SERVER_BUCKET_WAYS; i++)
+    {
+        if (!bucket[i].active)
+        {
+            if ((victim == NULL) || (victim->active))
+            {
+                victim = &bucket[i];
+            }
+            continue;
+        }
+        coap_server_fill_bucket(server, &bucket[i], now);
+        if (memcmp(&bucket[i].addr, addr, sizeof(coap_ipv_in_addr_t)) == 0)
+        {
+            return &bucket[i];
+        }
+        if ((victim == NULL)
+         || ((victim->active) && (bucket[i].tokens > victim->tokens))
+         || ((victim->active) && (bucket[i].tokens == victim->tokens) && (coap_server_elapsed_ns(&bucket[i].last_fill, &victim->last_fill) > 0)))
+        {
+            victim = &bucket[i];
+        }
+    }
+    if (!victim->active)
+    {
+        victim->active = 1;
+        victim->tokens = server->burst * 1000;
+    }
+    victim->addr = *addr;
+    victim->last_fill = *now;
+    return victim;
+}
+
+/**
+ *  @brief Decide whether to admit a request from a client
+ *
+ *  A request is only admitted if the client has at least one
+ *  token. The cost of a request is normally one token but can
+ *  be zero for a datagram that is not a request in its own
+ *  right, e.g. the first record of a DTLS handshake.
+ *
+ *  @param[in,out] server Pointer to a server structure
+ *  @param[in] client_sin Pointer to a socket structure
+ *  @param[in] cost Number of tokens taken in thousandths of a request
+ *
+ *  @returns Admission decision
+ *  @retval 1 Admit the request
+ *  @retval 0 Shed the request
+ */
+static int coap_server_admit(coap_server_t *server, coap_ipv_sockaddr_in_t *client_sin, unsigned cost)
+{
+    coap_server_bucket_t *bucket = NULL;
+    struct timespec now = {0};
+
+    if ((server->busy_watermark != 0) && (server->busy_pct >= server->busy_watermark))
+    {
+        server->num_shed_busy++;
+        return 0;
+    }
+    if (server->rate == 0)
+    {
+        return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    bucket = coap_server_find_bucket(server, &client_sin->COAP_IPV_SIN_ADDR, &now);
+    if (bucket->tokens < 1000)
+    {
+        server->num_shed_rate++;
+        return 0;
+    }
+    bucket->tokens -= cost;
+    return 1;
+}
+
+/**
+ *  @brief Encode a 5.03 (Service Unavailable) response
+ *
+ *  The response is assembled directly from the header fields
+ *  of the request and the pre-encoded Max-Age option so that
+ *  shedding a request costs as little as possible.
+ *
+ *  @param[in,out] server Pointer to a server structure
+ *  @param[out] buf Buffer to hold the response
+ *  @param[in] len Length of the buffer
+ *  @param[in] type Type of the request
+ *  @param[in] msg_id Message ID of the request
+ *  @param[in] token Token of the request
+ *  @param[in] token_len Token length of the request
+ *
+ *  @returns Length of the response
+ */
+static size_t coap_server_encode_unavail(coap_server_t *server, char *buf, size_t len, unsigned type, unsigned msg_id, const char *token, unsigned token_len)
+{
+    size_t num = 0;
+
+    if (type == COAP_MSG_CON)
+    {
+        /* piggy-backed response */
+        type = COAP_MSG_ACK;
+    }
+    else
+    {
+        type = COAP_MSG_NON;
+        msg_id = coap_server_get_next_msg_id(server);
+    }
+    num = 4 + token_len + server->max_age_opt_len;
+    if (num > len)
+    {
+        return 0;
+    }
+    buf[0] = (char)((COAP_MSG_VER << 6) | (type << 4) | token_len);
+    buf[1] = (char)((COAP_MSG_SERVER_ERR << 5) | COAP_MSG_SERV_UNAVAIL);
+    buf[2] = (char)((msg_id >> 8) & 0xff);
+    buf[3] = (char)(msg_id & 0xff);
+    memcpy(&buf[4], token, token_len);
+    memcpy(&buf[4 + token_len], server->max_age_opt, server->max_age_opt_len);
+    return num;
+}
+
+/**
+ *  @brief Shed an incoming datagram before a transaction is found or created
+ *
+ *  Look at the header of the next datagram without reading it.
+ *  Without DTLS, a request that is not admitted is read and
+ *  answered with a 5.03 response. With DTLS, the datagram is
+ *  encrypted or is part of a handshake, so a datagram from a
+ *  new client that is not admitted is read and dropped.
+ *
+ *  @param[in,out] server Pointer to a server structure
+ *  @param[in] client_sin Pointer to a socket structure
+ *  @param[in] client_sin_len Length of the socket structure
+ *
+ *  @returns Shedding decision or error code
+ *  @retval 1 The datagram was shed
+ *  @retval 0 The datagram was not shed
+ *  @retval <0 Error
+ */
+static int coap_server_shed(coap_server_t *server, coap_ipv_sockaddr_in_t *client_sin, socklen_t client_sin_len)
+{
+#ifndef COAP_DTLS_EN
+    unsigned token_len = 0;
+    unsigned type = 0;
+    size_t len = 0;
+    char resp[COAP_MSG_MAX_BUF_LEN] = {0};
+#endif
+    ssize_t num = 0;
+    char buf[COAP_MSG_MAX_BUF_LEN] = {0};
+
+    if ((server->rate == 0) && (server->busy_watermark == 0))
+    {
+        return 0;
+    }
+#ifdef COAP_DTLS_EN
+    if (coap_server_find_trans(server, client_sin, client_sin_len) != NULL)
+    {
+        /* checked after decryption */
+        return 0;
+    }
+    num = recvfrom(server->sd, buf, sizeof(buf), MSG_PEEK, NULL, NULL);
+    if (num < 0)
+    {
+        return -errno;
+    }
+    /* a handshake record costs nothing as the requests */
+    /* that follow the handshake are charged */
+    if (coap_server_admit(server, client_sin, (num > 0) && (buf[0] == COAP_SERVER_DTLS_HANDSHAKE) ? 0 : 1000))
+    {
+        return 0;
+    }
+    num = recvfrom(server->sd, buf, sizeof(buf), 0, NULL, NULL);
+    if (num < 0)
+    {
+        return -errno;
+    }
+    coap_log_info("Dropped datagram from new client, server overloaded");
+    return 1;
+#else
+    num = recvfrom(server->sd, buf, sizeof(buf), MSG_PEEK, NULL, NULL);
+    if (num < 0)
+    {
+        return -errno;
+    }
+    /* only non-empty confirmable and non-confirmable requests are shed */
+    if (num < 4)
+    {
+        return 0;
+    }
+    type = ((unsigned char)buf[0] >> 4) & 0x03;
+    token_len = (unsigned char)buf[0] & 0x0f;
+    if ((((unsigned char)buf[0] >> 6) != COAP_MSG_VER)
+     || ((type != COAP_MSG_CON) && (type != COAP_MSG_NON))
+     || (token_len > COAP_MSG_MAX_TOKEN_LEN)
+     || (num < 4 + token_len)
+     || (buf[1] == 0)
+     || (((unsigned char)buf[1] >> 5) != COAP_MSG_REQ))
+    {
+        return 0;
+    }
+    if (coap_server_admit(server, client_sin, 1000))
+    {
+        return 0;
+    }
+    num = recvfrom(server->sd, buf, num, 0, NULL, NULL);
+    if (num < 0)
+    {
+        return -errno;
+    }
+    len = coap_server_encode_unavail(server, resp, sizeof(resp), type,
+                                     (((unsigned char)buf[2]) << 8) | (unsigned char)buf[3],
+                                     &buf[4], token_len);
+    num = sendto(server->sd, resp, len, 0, (struct sockaddr *)client_sin, client_sin_len);
+    if (num < 0)
+    {
+        return -errno;
+    }
+    coap_log_info("Responded with service unavailable, server overloaded");
+    return 1;
+#endif
+}
+
+/**
+ *  @brief Wait for a message to arrive or an acknowledgement
+ *         timer in any of the active transactions to expire
+ *
+ *  @param[in,out] server Pointer to a server structure
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+static int coap_server_listen(coap_server_t *server)
+{
+    coap_server_trans_t *trans = NULL;
+    unsigned i = 0;
+    fd_set read_fds = {{0}};
+    int max_fd = 0;
+    int ret = 0;
+
+    while (1)
+    {
+        FD_ZERO(&read_fds);
+        FD_SET(server->sd, &read_fds);
+        max_fd = server->sd;
+        for (i = 0; i < COAP_SERVER_NUM_TRANS; i++)
+        {
+            trans = &server->trans[i];
+            if (server->slot[i].key != 0)
+            {
+                FD_SET(trans->timer_fd, &read_fds);
+                if (trans->timer_fd > max_fd)
+                {
+                    max_fd = trans->timer_fd;
+                }
+            }
+        }
+        ret = select(max_fd + 1, &read_fds, NULL, NULL, NULL);
+        if (ret < 0)
+        {
+            return -errno;
+        }
+        if (FD_ISSET(server->sd, &read_fds))
+        {
+            return 0;
+        }
+        for (i = 0; i < COAP_SERVER_NUM_TRANS; i++)
+        {
+            trans = &server->trans[i];
+            if ((server->slot[i].key != 0) && (FD_ISSET(trans->timer_fd, &read_fds)))
+            {
+                ret = coap_server_trans_handle_ack_timeout(trans);
+                if (ret < 0)
+                {
+                    return ret;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ *  @brief Find the first option with a given number in a message
+ *
+ *  @param[in] msg Pointer to a message structure
+ *  @param[in] num Option number
+ *
+ *  @returns Pointer to an option structure
+ *  @retval NULL The option was not found
+ */
+static coap_msg_op_t *coap_server_find_op(coap_msg_t *msg, unsigned num)
+{
+    coap_msg_op_t *op = NULL;
+
+    op = coap_msg_get_first_op(msg);
+    while (op != NULL)
+    {
+        if (coap_msg_op_get_num(op) == num)
+        {
+            return op;
+        }
+        op = coap_msg_op_get_next(op);
+    }
+    return NULL;
+}
+
+/**
+ *  @brief Accept an incoming connection
+ *
+ *  @param[in] server Pointer to a server structure
+ *  @param[out] client_sin Pointer to a socket structure
+ *  @param[out] client_sin_len Length of the socket structure
+ *
+ *  Get the address and port number of the client.
+ *  Do not read the received data.
+ *
+ *  @returns Number of bytes received or error code
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+static int coap_server_accept(coap_server_t *server, coap_ipv_sockaddr_in_t *client_sin, socklen_t *client_sin_len)
+{
+    ssize_t num = 0;
+    char buf[COAP_MSG_MAX_BUF_LEN] = {0};
+
+    *client_sin_len = sizeof(coap_ipv_sockaddr_in_t);
+    num = recvfrom(server->sd, buf, sizeof(buf), MSG_PEEK, (struct sockaddr *)client_sin, client_sin_len);
+    if (num < 0)
+    {
+        return -errno;
+    }
+    return 0;
+}
+
+int coap_server_add_sep_resp_uri_path(coap_server_t *server, const char *str)
+{
+    return coap_server_path_list_add(&server->sep_list, str);
+}
+
+int coap_server_tmpl_create(coap_server_tmpl_t *tmpl, coap_msg_t *msg)
+{
+    coap_msg_op_t *op = NULL;
+    unsigned token_len = 0;
+    ssize_t num = 0;
+    char buf[COAP_MSG_MAX_BUF_LEN] = {0};
+
+    if (coap_msg_get_code_class(msg) == COAP_MSG_REQ)
+    {
+        return -EINVAL;
+    }
+    num = coap_msg_format(msg, buf, sizeof(buf));
+    if (num < 0)
+    {
+        return num;
+    }
+    token_len = coap_msg_get_token_len(msg);
+    memset(tmpl, 0, sizeof(coap_server_tmpl_t));
+    tmpl->code = (unsigned char)buf[1];
+    tmpl->len = num - 4 - token_len;
+    memcpy(tmpl->buf, &buf[4 + token_len], tmpl->len);
+    op = coap_server_find_op(msg, COAP_MSG_ETAG);
+    if ((op != NULL) && (coap_msg_op_get_len(op) <= COAP_SERVER_ETAG_MAX_LEN))
+    {
+        tmpl->etag_len = coap_msg_op_get_len(op);
+        memcpy(tmpl->etag, coap_msg_op_get_val(op), tmpl->etag_len);
+    }
+    return 0;
+}
+
+void coap_server_set_resp_tmpl(coap_server_t *server, const coap_server_tmpl_t *tmpl)
+{
+    server->resp_tmpl = tmpl;
+}
+
+int coap_server_set_sep_resp_budget(coap_server_t *server, unsigned budget)
+{
+    if (budget >= COAP_SERVER_ACK_TIMEOUT_SEC * 1000)
+    {
+        return -EINVAL;
+    }
+    server->sep_budget = budget;
+    return 0;
+}
+
+const coap_server_res_t *coap_server_get_res(coap_server_t *server, unsigned index)
+{
+    if ((index >= COAP_SERVER_NUM_RES) || (!server->res[index].active))
+    {
+        return NULL;
+    }
+    return &server->res[index];
+}
+
+int coap_server_set_admission(coap_server_t *server, unsigned rate, unsigned burst, unsigned busy_watermark, unsigned max_age)
+{
+    unsigned len = 0;
+    unsigned i = 0;
+
+    if ((rate > COAP_SERVER_MAX_RATE) || (burst > COAP_SERVER_MAX_RATE) || (busy_watermark > 100))
+    {
+        return -EINVAL;
+    }
+    server->rate = rate;
+    server->burst = burst != 0 ? burst : rate;
+    server->busy_watermark = busy_watermark;
+    memset(server->bucket, 0, sizeof(server->bucket));
+
+    /* pre-encode the Max-Age option using the minimum number of value bytes */
+    for (len = 0; (len < 4) && ((max_age >> (8 * len)) != 0); len++)
+        ;
+    server->max_age_opt[0] = (char)((13 << 4) | len);
+    server->max_age_opt[1] = (char)(COAP_MSG_MAX_AGE - 13);
+    for (i = 0; i < len; i++)
+    {
+        server->max_age_opt[2 + i] = (char)((max_age >> (8 * (len - 1 - i))) & 0xff);
+    }
+    server->max_age_opt_len = 2 + len;
+    return 0;
+}
+
+/**
+ *  @brief Encode a response from a response template
+ *
+ *  Only the header and token are written, the options
+ *  and payload are copied from the template as they are.
+ *
+ *  @param[in] tmpl Pointer to a response template structure
+ *  @param[in] msg Pointer to a message structure holding the type, message ID and token
+ *  @param[out] buf Buffer to hold the response
+ *  @param[in] len Length of the buffer
+ *
+ *  @returns Length of the response or error code
+ *  @retval >0 Length of the response
+ *  @retval <0 Error
+ */
+static ssize_t coap_server_tmpl_format(const coap_server_tmpl_t *tmpl, coap_msg_t *msg, char *buf, size_t len)
+{
+    unsigned token_len = 0;
+    unsigned msg_id = 0;
+    size_t num = 0;
+
+    token_len = coap_msg_get_token_len(msg);
+    msg_id = coap_msg_get_msg_id(msg);
+    num = 4 + token_len + tmpl->len;
+    if (num > len)
+    {
+        return -ENOSPC;
+    }
+    buf[0] = (char)((COAP_MSG_VER << 6) | (coap_msg_get_type(msg) << 4) | token_len);
+    buf[1] = (char)tmpl->code;
+    buf[2] = (char)((msg_id >> 8) & 0xff);
+    buf[3] = (char)(msg_id & 0xff);
+    memcpy(&buf[4], coap_msg_get_token(msg), token_len);
+    memcpy(&buf[4 + token_len], tmpl->buf, tmpl->len);
+    return num;
+}
+
+/**
+ *  @brief Expand a response template into a message
+ *
+ *  Used when the response must be kept for retransmission.
+ *
+ *  @param[in] tmpl Pointer to a response template structure
+ *  @param[out] msg Pointer to a message structure
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+static int coap_server_tmpl_parse(const coap_server_tmpl_t *tmpl, coap_msg_t *msg)
+{
+    coap_msg_t hdr = {0};
+    ssize_t num = 0;
+    char buf[COAP_MSG_MAX_BUF_LEN] = {0};
+
+    coap_msg_create(&hdr);
+    num = coap_server_tmpl_format(tmpl, &hdr, buf, sizeof(buf));
+    coap_msg_destroy(&hdr);
+    if (num < 0)
+    {
+        return num;
+    }
+    coap_msg_reset(msg);
+    num = coap_msg_parse(msg, buf, num);
+    if (num < 0)
+    {
+        return num;
+    }
+    return 0;
+}
+
+/**
+ *  @brief Reconstruct the URI path from a request
+ *
+ *  @param[in] msg Pointer to a message structure
+ *  @param[out] buf Buffer to hold the URI path
+ *  @param[in] buf_len Length of the buffer
+ */
+static void coap_server_get_uri_path(coap_msg_t *msg, char *buf, size_t buf_len)
+{
+    coap_msg_op_t *op = NULL;
+    size_t val_len = 0;
+    size_t add = 0;
+    size_t len = 0;
+    char val_buf[COAP_MSG_OP_URI_PATH_MAX_LEN] = {0};
+    char *val = NULL;
+    char *p = NULL;
+
+    memset(buf, 0, buf_len);
+    p = buf;
+    len = buf_len - 1;
+    op = coap_msg_get_first_op(msg);
+    while (op != NULL)
+    {
+        if (coap_msg_op_get_num(op) == COAP_MSG_OP_URI_PATH_NUM)
+        {
+            strncpy(p, "/", len);
+            add = (1 < len) ? 1 : len;
+            p += add;
+            len -= add;
+
+            val = coap_msg_op_get_val(op);
+            val_len = coap_msg_op_get_len(op);
+            if (val_len > sizeof(val_buf) - 1)
+                val_len = sizeof(val_buf) - 1;
+            memcpy(val_buf, val, val_len);
+            val_buf[val_len] = '\0';
+            strncpy(p, val_buf, len);
+            add = (val_len < len) ? val_len : len;
+            p += add;
+            len -= add;
+        }
+        op = coap_msg_op_get_next(op);
+    }
+    if (p == buf)
+    {
+        buf[0] = '/';
+    }
+}
+
+/**
+ *  @brief Find the resource structure for a URI path
+ *
+ *  @param[in,out] server Pointer to a server structure
+ *  @param[in] path String representation of a URI path
+ *
+ *  @returns Pointer to a resource structure
+ *  @retval NULL The URI path was not found
+ */
+static coap_server_res_t *coap_server_find_res(coap_server_t *server, const char *path)
+{
+    coap_server_res_t *res = NULL;
+    unsigned i = 0;
+
+    server->res_seq++;
+    for (i = 0; i < COAP_SERVER_NUM_RES; i++)
+    {
+        res = &server->res[i];
+        if ((res->active) && (strcmp(res->path, path) == 0))
+        {
+            res->last_use = server->res_seq;
+            if (res->hits < COAP_SERVER_RES_MAX_HITS)
+            {
+                res->hits++;
+            }
+            return res;
+        }
+    }
+    return NULL;
+}
+
+/**
+ *  @brief Add a resource structure for a URI path
+ *
+ *  An unused resource structure is given to the URI path or,
+ *  if they are all in use, the least recently used resource
+ *  structure that has been requested only once. If every
+ *  resource structure has been requested more than once, the
+ *  least recently used one ages by a request and the URI path
+ *  is not added unless the addition is forced, e.g. to hold
+ *  an entity-tag supplied by the application. This stops a
+ *  stream of one-off URI paths from flushing the resources
+ *  that are in regular use. A resource structure holding an
+ *  entity-tag supplied by the application is never replaced.
+ *
+ *  @param[in,out] server Pointer to a server structure
+ *  @param[in] path String representation of a URI path
+ *  @param[in] force Replace the least recently used resource structure if necessary
+ *
+ *  @returns Pointer to a resource structure
+ *  @retval NULL The URI path was not added
+ */
+static coap_server_res_t *coap_server_add_res(coap_server_t *server, const char *path, int force)
+{
+    coap_server_res_t *oldest = NULL;
+    coap_server_res_t *victim = NULL;
+    coap_server_res_t *res = NULL;
+    unsigned i = 0;
+
+    for (i = 0; i < COAP_SERVER_NUM_RES; i++)
+    {
+        res = &server->res[i];
+        if (!res->active)
+        {
+            victim = res;
+            break;
+        }
+        if (res->etag_len > 0)
+        {
+            continue;
+        }
+        if ((oldest == NULL) || (res->last_use < oldest->last_use))
+        {
+            oldest = res;
+        }
+        if ((res->hits <= 1)
+         && ((victim == NULL) || (res->last_use < victim->last_use)))
+        {
+            victim = res;
+        }
+    }
+    if ((victim == NULL) && (force))
+    {
+        victim = oldest;
+    }
+    if ((victim == NULL) && (oldest != NULL))
+    {
+        oldest->hits--;
+    }
+    if (victim == NULL)
+    {
+        return NULL;
+    }
+    memset(victim, 0, sizeof(coap_server_res_t));
+    victim->active = 1;
+    victim->last_use = server->res_seq;
+    victim->hits = 1;
+    strncpy(victim->path, path, sizeof(victim->path) - 1);
+    return victim;
+}
+
+/**
+ *  @brief Record the handler latency for a resource
+ *
+ *  @param[in,out] res Pointer to a resource structure
+ *  @param[in] start Pointer to the time the handle call-back function was called
+ *  @param[in] end Pointer to the time the handle call-back function returned
+ */
+static void coap_server_res_update(coap_server_res_t *res, struct timespec *start, struct timespec *end)
+{
+    uint64_t usec = 0;
+
+    usec = coap_server_elapsed_ns(start, end) / 1000;
+    if (usec > UINT_MAX)
+    {
+        usec = UINT_MAX;
+    }
+    if (res->avg_latency == 0)
+    {
+        res->avg_latency = (unsigned)usec;
+    }
+    else
+    {
+        res->avg_latency = (unsigned)(((uint64_t)res->avg_latency * 7 + usec) / 8);
+    }
 }
 
 /**
- *  @brief Search for the oldest transaction structure in a server structure
- *
- *  Search for the transaction structure in a server structure that was
- *  used least recently.
+ *  @brief Compare an option value with the entity-tag of a resource
  *
- *  @param[in] server Pointer to a server structure
+ *  @param[in] res Pointer to a resource structure
+ *  @param[in] op Pointer to an option structure
  *
- *  @returns Pointer to a transaction structure
+ *  @returns Comparison value
+ *  @retval 0 The option value does not match the entity-tag
+ *  @retval 1 The option value matches the entity-tag
  */
-static coap_server_trans_t *coap_server_find_oldest_trans(coap_server_t *server)
+static int coap_server_res_match_etag(coap_server_res_t *res, coap_msg_op_t *op)
 {
-    coap_server_trans_t *oldest = NULL;
-    coap_server_trans_t *trans = NULL;
-    unsigned i = 0;
-    unsigned j = 0;
-    time_t min_last_use = 0;
+    return ((coap_msg_op_get_len(op) == res->etag_len)
+         && (memcmp(coap_msg_op_get_val(op), res->etag, res->etag_len) == 0));
+}
 
-    for (i = 0; i < COAP_SERVER_NUM_TRANS; i++)
-    {
-        trans = &server->trans[i];
-        if (trans->active)
-        {
-            if ((min_last_use == 0) || (trans->last_use < min_last_use))
-            {
-                oldest = trans;
-                min_last_use = trans->last_use;
-                j = i;
-            }
-        }
-    }
-    coap_log_debug("Found oldest transaction at index %u", j);
-    return oldest != NULL ? oldest : &server->trans[0];
+/**
+ *  @brief Check whether a request selects a variant of a resource
+ *
+ *  Entity-tags are recorded per URI path so a request
+ *  carrying a Uri-Query or Accept option may select a
+ *  representation with a different entity-tag.
+ *
+ *  @param[in] req Pointer to the request message
+ *
+ *  @returns Comparison value
+ *  @retval 0 The request selects the representation of the URI path
+ *  @retval 1 The request selects a variant of the representation
+ */
+static int coap_server_is_variant(coap_msg_t *req)
+{
+    return ((coap_server_find_op(req, COAP_MSG_URI_QUERY) != NULL)
+         || (coap_server_find_op(req, COAP_MSG_ACCEPT) != NULL));
 }
 
 /**
- *  @brief Wait for a message to arrive or an acknowledgement
- *         timer in any of the active transactions to expire
+ *  @brief Answer a conditional request from the entity-tag of a resource
  *
- *  @param[in,out] server Pointer to a server structure
+ *  Nothing is decided unless conditional responses are
+ *  enabled and the application has supplied the entity-tag
+ *  of the resource, the handle call-back function deals
+ *  with the request instead.
+ *
+ *  @param[in] server Pointer to a server structure
+ *  @param[in,out] res Pointer to a resource structure or NULL
+ *  @param[in] req Pointer to the request message
+ *  @param[out] resp Pointer to the response message
  *
  *  @returns Operation status
- *  @retval 0 Success
+ *  @retval 1 The response has been generated
+ *  @retval 0 The handle call-back function must generate the response
  *  @retval <0 Error
  */
-static int coap_server_listen(coap_server_t *server)
+static int coap_server_check_cond(coap_server_t *server, coap_server_res_t *res, coap_msg_t *req, coap_msg_t *resp)
 {
-    coap_server_trans_t *trans = NULL;
-    unsigned i = 0;
-    fd_set read_fds = {{0}};
-    int max_fd = 0;
+    coap_msg_op_t *op = NULL;
+    int found = 0;
+    int match = 0;
     int ret = 0;
 
-    while (1)
+    if ((!server->cond_resp) || (res == NULL) || (res->etag_len == 0) || (coap_server_is_variant(req)))
     {
-        FD_ZERO(&read_fds);
-        FD_SET(server->sd, &read_fds);
-        max_fd = server->sd;
-        for (i = 0; i < COAP_SERVER_NUM_TRANS; i++)
+        return 0;
+    }
+    /* an empty If-Match value matches any existing representation */
+    op = coap_msg_get_first_op(req);
+    while (op != NULL)
+    {
+        if (coap_msg_op_get_num(op) == COAP_MSG_IF_MATCH)
         {
-            trans = &server->trans[i];
-            if (trans->active)
+            found = 1;
+            if ((coap_msg_op_get_len(op) == 0) || (coap_server_res_match_etag(res, op)))
             {
-                FD_SET(trans->timer_fd, &read_fds);
-                if (trans->timer_fd > max_fd)
-                {
-                    max_fd = trans->timer_fd;
-                }
+                match = 1;
             }
         }
-        ret = select(max_fd + 1, &read_fds, NULL, NULL, NULL);
-        if (ret < 0)
-        {
-            return -errno;
-        }
-        if (FD_ISSET(server->sd, &read_fds))
-        {
-            return 0;
-        }
-        for (i = 0; i < COAP_SERVER_NUM_TRANS; i++)
+        op = coap_msg_op_get_next(op);
+    }
+    if (((found) && (!match))
+     || (coap_server_find_op(req, COAP_MSG_IF_NONE_MATCH) != NULL))
+    {
+        return coap_msg_set_code(resp, COAP_MSG_CLIENT_ERR, COAP_MSG_PRECOND_FAILED) < 0 ? -EINVAL : 1;
+    }
+    if (coap_msg_get_code_detail(req) != COAP_MSG_GET)
+    {
+        return 0;
+    }
+    op = coap_msg_get_first_op(req);
+    while (op != NULL)
+    {
+        if ((coap_msg_op_get_num(op) == COAP_MSG_ETAG) && (coap_server_res_match_etag(res, op)))
         {
-            trans = &server->trans[i];
-            if ((trans->active) && (FD_ISSET(trans->timer_fd, &read_fds)))
+            ret = coap_msg_set_code(resp, COAP_MSG_SUCCESS, COAP_MSG_VALID);
+            if (ret < 0)
             {
-                ret = coap_server_trans_handle_ack_timeout(trans);
-                if (ret < 0)
-                {
-                    return ret;
-                }
+                return ret;
+            }
+            ret = coap_msg_add_op(resp, COAP_MSG_ETAG, res->etag_len, res->etag);
+            if (ret < 0)
+            {
+                return ret;
             }
+            res->num_valid++;
+            return 1;
         }
+        op = coap_msg_op_get_next(op);
     }
     return 0;
 }
 
 /**
- *  @brief Accept an incoming connection
- *
- *  @param[in] server Pointer to a server structure
- *  @param[out] client_sin Pointer to a socket structure
- *  @param[out] client_sin_len Length of the socket structure
+ *  @brief Record the entity-tag declared by a response template
  *
- *  Get the address and port number of the client.
- *  Do not read the received data.
+ *  A successful response template without an ETag option
+ *  withdraws the entity-tag. Responses generated by the
+ *  handle call-back function are not inspected, the
+ *  application supplies their entity-tags through
+ *  coap_server_set_etag.
  *
- *  @returns Number of bytes received or error code
- *  @retval 0 Success
- *  @retval <0 Error
+ *  @param[in,out] res Pointer to a resource structure
+ *  @param[in] req Pointer to the request message
+ *  @param[in] tmpl Pointer to the response template or NULL
  */
-static int coap_server_accept(coap_server_t *server, coap_ipv_sockaddr_in_t *client_sin, socklen_t *client_sin_len)
+static void coap_server_res_learn_etag(coap_server_res_t *res, coap_msg_t *req, const coap_server_tmpl_t *tmpl)
 {
-    ssize_t num = 0;
-    char buf[COAP_MSG_MAX_BUF_LEN] = {0};
-
-    *client_sin_len = sizeof(coap_ipv_sockaddr_in_t);
-    num = recvfrom(server->sd, buf, sizeof(buf), MSG_PEEK, (struct sockaddr *)client_sin, client_sin_len);
-    if (num < 0)
+    if ((tmpl == NULL) || ((tmpl->code >> 5) != COAP_MSG_SUCCESS) || (coap_server_is_variant(req)))
     {
-        return -errno;
+        return;
     }
-    return 0;
-}
-
-int coap_server_add_sep_resp_uri_path(coap_server_t *server, const char *str)
-{
-    return coap_server_path_list_add(&server->sep_list, str);
+    memcpy(res->etag, tmpl->etag, tmpl->etag_len);
+    res->etag_len = tmpl->etag_len;
 }
 
 /**
@@ -1817,57 +3259,63 @@ int coap_server_add_sep_resp_uri_path(coap_server_t *server, const char *str)
  *  response or a piggy-backed response by searching for the URI
  *  path taken from the request message structure in a user supplied
  *  URI path list. The idea being that some resources will consistently
- *  require time to retrieve and others will not.
+ *  require time to retrieve and others will not. When a handler
+ *  latency budget is set, a resource whose handler has been slower
+ *  than the budget also gets a separate response.
  *
  *  @param[in] server Pointer to a server structure
- *  @param[in] msg Pointer to a message structure
+ *  @param[in] path String representation of the URI path
+ *  @param[in] res Pointer to a resource structure or NULL
  *
  *  @returns Response type
  *  @retval COAP_SERVER_PIGGYBACKED Piggy-backed response
  *  @retval COAP_SERVER_SEPARATE Separate response
  */ 
-static int coap_server_get_resp_type(coap_server_t *server, coap_msg_t *msg)
+static int coap_server_get_resp_type(coap_server_t *server, const char *path, coap_server_res_t *res)
 {
-    coap_msg_op_t *op = NULL;
-    size_t val_len = 0;
-    size_t add = 0;
-    size_t len = 0;
-    char val_buf[COAP_MSG_OP_URI_PATH_MAX_LEN] = {0};
-    char buf[COAP_MSG_OP_URI_PATH_MAX_LEN] = {0};
-    char *val = NULL;
-    char *p = NULL;
     int match = 0;
 
-    p = buf;
-    len = sizeof(buf) - 1;
-    op = coap_msg_get_first_op(msg);
-    while (op != NULL)
+    match = coap_server_path_list_match(&server->sep_list, path);
+    if (match)
     {
-        if (coap_msg_op_get_num(op) == COAP_MSG_OP_URI_PATH_NUM)
-        {
-            strncpy(p, "/", len);
-            add = (1 < len) ? 1 : len;
-            p += add;
-            len -= add;
+        return COAP_SERVER_SEPARATE;
+    }
+    if ((server->sep_budget != 0) && (res != NULL) && (res->avg_latency > server->sep_budget * 1000))
+    {
+        return COAP_SERVER_SEPARATE;
+    }
+    return COAP_SERVER_PIGGYBACKED;
+}
 
-            val = coap_msg_op_get_val(op);
-            val_len = coap_msg_op_get_len(op);
-            if (val_len > sizeof(val_buf) - 1)
-                val_len = sizeof(val_buf) - 1;
-            memcpy(val_buf, val, val_len);
-            strncpy(p, val_buf, len);
-            add = (val_len < len) ? val_len : len;
-            p += add;
-            len -= add;
-        }
-        op = coap_msg_op_get_next(op);
+int coap_server_set_etag(coap_server_t *server, const char *path, const char *etag, unsigned len)
+{
+    coap_server_res_t *res = NULL;
+
+    if ((path == NULL) || (len > COAP_SERVER_ETAG_MAX_LEN) || ((len > 0) && (etag == NULL)))
+    {
+        return -EINVAL;
     }
-    if (p == buf)
+    res = coap_server_find_res(server, path);
+    if ((res == NULL) && (len == 0))
     {
-        buf[0] = '/';
+        return 0;
+    }
+    if (res == NULL)
+    {
+        res = coap_server_add_res(server, path, 1);
+        if (res == NULL)
+        {
+            return -ENOSPC;
+        }
     }
-    match = coap_server_path_list_match(&server->sep_list, buf);
-    return match ? COAP_SERVER_SEPARATE : COAP_SERVER_PIGGYBACKED;
+    memcpy(res->etag, etag, len);
+    res->etag_len = len;
+    return 0;
+}
+
+void coap_server_set_cond_resp(coap_server_t *server, int enable)
+{
+    server->cond_resp = enable;
 }
 
 /**
@@ -1883,13 +3331,22 @@ static int coap_server_exchange(coap_server_t *server)
 {
     coap_ipv_sockaddr_in_t client_sin = {0};
     coap_server_trans_t *trans = NULL;
+    coap_server_res_t *res = NULL;
+    struct timespec start = {0};
+    struct timespec end = {0};
     coap_msg_t recv_msg = {0};
     coap_msg_t send_msg = {0};
     socklen_t client_sin_len = 0;
     unsigned op_num = 0;
     unsigned msg_id = 0;
+    unsigned code_class = 0;
     ssize_t num = 0;
+    const coap_server_tmpl_t *tmpl = NULL;
+    size_t len = 0;
+    char buf[COAP_MSG_MAX_BUF_LEN] = {0};
+    char path[COAP_MSG_OP_URI_PATH_MAX_LEN] = {0};
     int resp_type = 0;
+    int cond = 0;
     int ret = 0;
 
     /* accept incoming connection */
@@ -1899,6 +3356,17 @@ static int coap_server_exchange(coap_server_t *server)
         return ret;
     }
 
+    /* shed the request if the client or the server is overloaded */
+    ret = coap_server_shed(server, &client_sin, client_sin_len);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    if (ret > 0)
+    {
+        return 0;
+    }
+
     /* find or create transaction */
     trans = coap_server_find_trans(server, &client_sin, client_sin_len);
     if (trans == NULL)
@@ -1907,6 +3375,7 @@ static int coap_server_exchange(coap_server_t *server)
         if (trans == NULL)
         {
             trans = coap_server_find_oldest_trans(server);
+            coap_trace3(server_trans_evict, trans->client_addr, ntohs(trans->client_sin.COAP_IPV_SIN_PORT), (int)(trans - server->trans));
             coap_server_trans_destroy(trans);
         }
         ret = coap_server_trans_create(trans, server, &client_sin, client_sin_len);
@@ -1938,10 +3407,9 @@ static int coap_server_exchange(coap_server_t *server)
         if (coap_msg_get_type(&recv_msg) == COAP_MSG_CON)
         {
             /* message deduplication */
-            /* acknowledge the (confirmable) request again */
-            /* do not send the response again */
+            /* send the piggy-backed response or the acknowledgement again */
             coap_log_info("Received duplicate confirmable request from address %s and port %u", trans->client_addr, ntohs(trans->client_sin.COAP_IPV_SIN_PORT));
-            ret = coap_server_trans_send_ack(trans, &recv_msg);
+            ret = coap_server_trans_send_dup(trans, &recv_msg);
             coap_msg_destroy(&recv_msg);
             if (ret < 0)
             {
@@ -1994,10 +3462,34 @@ static int coap_server_exchange(coap_server_t *server)
         }
     }
 
-    /* check for a valid request */
+    /* answer an empty confirmable message (CoAP ping) with a reset message */
+    if ((coap_msg_get_type(&recv_msg) == COAP_MSG_CON)
+     && (coap_msg_is_empty(&recv_msg)))
+    {
+        coap_log_info("Received ping from address %s and port %u", trans->client_addr, ntohs(trans->client_sin.COAP_IPV_SIN_PORT));
+        ret = coap_server_trans_reject_con(trans, &recv_msg);
+        coap_msg_destroy(&recv_msg);
+        if (ret < 0)
+        {
+            coap_server_trans_destroy(trans);
+            return ret;
+        }
+        return 0;
+    }
+
+    /* an acknowledgement or reset message that matches nothing */
+    /* is silently ignored, it may simply have been delayed past */
+    /* the next request from the same client */
     if ((coap_msg_get_type(&recv_msg) == COAP_MSG_ACK)
-     || (coap_msg_get_type(&recv_msg) == COAP_MSG_RST)
-     || (coap_msg_get_code_class(&recv_msg) != COAP_MSG_REQ))
+     || (coap_msg_get_type(&recv_msg) == COAP_MSG_RST))
+    {
+        coap_server_trans_reject(trans, &recv_msg);
+        coap_msg_destroy(&recv_msg);
+        return 0;
+    }
+
+    /* check for a valid request */
+    if (coap_msg_get_code_class(&recv_msg) != COAP_MSG_REQ)
     {
         coap_server_trans_reject(trans, &recv_msg);
         coap_msg_destroy(&recv_msg);
@@ -2005,6 +3497,28 @@ static int coap_server_exchange(coap_server_t *server)
         return -EBADMSG;
     }
 
+#ifdef COAP_DTLS_EN
+    /* shed the request if the client or the server is overloaded */
+    if (((server->rate != 0) || (server->busy_watermark != 0))
+     && (!coap_server_admit(server, &client_sin, 1000)))
+    {
+        coap_log_info("Responding with service unavailable to address %s and port %u", trans->client_addr, ntohs(trans->client_sin.COAP_IPV_SIN_PORT));
+        len = coap_server_encode_unavail(server, buf, sizeof(buf),
+                                         coap_msg_get_type(&recv_msg),
+                                         coap_msg_get_msg_id(&recv_msg),
+                                         coap_msg_get_token(&recv_msg),
+                                         coap_msg_get_token_len(&recv_msg));
+        coap_msg_destroy(&recv_msg);
+        num = coap_server_trans_send_buf(trans, buf, len);
+        if (num < 0)
+        {
+            coap_server_trans_destroy(trans);
+            return num;
+        }
+        return 0;
+    }
+#endif
+
     if (coap_msg_get_type(&recv_msg) == COAP_MSG_CON)
     {
         coap_log_info("Received confirmable request from address %s and port %u", trans->client_addr, ntohs(trans->client_sin.COAP_IPV_SIN_PORT));
@@ -2028,18 +3542,30 @@ static int coap_server_exchange(coap_server_t *server)
     coap_server_trans_clear_req(trans);
     coap_server_trans_clear_resp(trans);
 
+    /* answer conditional requests from the current entity-tag */
+    coap_server_get_uri_path(&recv_msg, path, sizeof(path));
+    res = coap_server_find_res(server, path);
+    coap_msg_create(&send_msg);
+    cond = coap_server_check_cond(server, res, &recv_msg, &send_msg);
+    if (cond < 0)
+    {
+        coap_msg_destroy(&send_msg);
+        coap_server_trans_destroy(trans);
+        coap_msg_destroy(&recv_msg);
+        return cond;
+    }
+
     /* determine response type */
     if (coap_msg_get_type(&recv_msg) == COAP_MSG_CON)
     {
-        resp_type = coap_server_get_resp_type(server, &recv_msg);
+        if (cond)
+            resp_type = COAP_SERVER_PIGGYBACKED;
+        else
+            resp_type = coap_server_get_resp_type(server, path, res);
         if (resp_type == COAP_SERVER_SEPARATE)
-        {
             coap_log_info("Request URI path requires a separate response to address %s and port %u", trans->client_addr, ntohs(trans->client_sin.COAP_IPV_SIN_PORT));
-        }
         else
-        {
             coap_log_info("Request URI path requires a piggy-backed response to address %s and port %u", trans->client_addr, ntohs(trans->client_sin.COAP_IPV_SIN_PORT));
-        }
     }
 
     /* send an acknowledgement if necessary */
@@ -2049,6 +3575,7 @@ static int coap_server_exchange(coap_server_t *server)
         ret = coap_server_trans_send_ack(trans, &recv_msg);
         if (ret < 0)
         {
+            coap_msg_destroy(&send_msg);
             coap_server_trans_destroy(trans);
             coap_msg_destroy(&recv_msg);
             return ret;
@@ -2057,14 +3584,59 @@ static int coap_server_exchange(coap_server_t *server)
 
     /* generate response */
     coap_log_info("Responding to address %s and port %u", trans->client_addr, ntohs(trans->client_sin.COAP_IPV_SIN_PORT));
-    coap_msg_create(&send_msg);
-    ret = (*server->handle)(server, &recv_msg, &send_msg);
-    if (ret < 0)
+    if (!cond)
+    {
+        server->resp_tmpl = NULL;
+        coap_trace5(server_handle_entry, trans->client_addr, ntohs(trans->client_sin.COAP_IPV_SIN_PORT),
+                    coap_msg_get_msg_id(&recv_msg), coap_msg_get_token(&recv_msg), coap_msg_get_token_len(&recv_msg));
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        ret = (*server->handle)(server, &recv_msg, &send_msg);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        coap_trace5(server_handle_exit, trans->client_addr, ntohs(trans->client_sin.COAP_IPV_SIN_PORT),
+                    coap_msg_get_msg_id(&recv_msg), ret,
+                    (coap_msg_get_code_class(&send_msg) << 5) | coap_msg_get_code_detail(&send_msg));
+        tmpl = server->resp_tmpl;
+        server->resp_tmpl = NULL;
+        if (ret < 0)
+        {
+            coap_msg_destroy(&send_msg);
+            coap_server_trans_destroy(trans);
+            coap_msg_destroy(&recv_msg);
+            return ret;
+        }
+        /* only URI paths that exist are recorded */
+        code_class = tmpl != NULL ? (unsigned)(tmpl->code >> 5) : coap_msg_get_code_class(&send_msg);
+        if ((res == NULL) && (code_class == COAP_MSG_SUCCESS))
+        {
+            res = coap_server_add_res(server, path, 0);
+        }
+        if (res != NULL)
+        {
+            coap_server_res_update(res, &start, &end);
+            coap_server_res_learn_etag(res, &recv_msg, tmpl);
+        }
+    }
+    if ((res != NULL) && (coap_msg_get_type(&recv_msg) == COAP_MSG_CON))
     {
-        coap_msg_destroy(&send_msg);
-        coap_server_trans_destroy(trans);
-        coap_msg_destroy(&recv_msg);
-        return ret;
+        if (resp_type == COAP_SERVER_SEPARATE)
+            res->num_separate++;
+        else
+            res->num_piggybacked++;
+    }
+    if ((tmpl != NULL)
+     && (coap_msg_get_type(&recv_msg) == COAP_MSG_CON)
+     && (resp_type == COAP_SERVER_SEPARATE))
+    {
+        /* a separate response is kept for retransmission */
+        ret = coap_server_tmpl_parse(tmpl, &send_msg);
+        if (ret < 0)
+        {
+            coap_msg_destroy(&send_msg);
+            coap_server_trans_destroy(trans);
+            coap_msg_destroy(&recv_msg);
+            return ret;
+        }
+        tmpl = NULL;
     }
     if ((coap_msg_get_type(&recv_msg) == COAP_MSG_CON)
      && (resp_type == COAP_SERVER_PIGGYBACKED))
@@ -2117,7 +3689,20 @@ static int coap_server_exchange(coap_server_t *server)
     }
 
     /* send response */
-    num = coap_server_trans_send(trans, &send_msg);
+    if (tmpl != NULL)
+    {
+        /* the formatted response is recorded in the transaction structure */
+        num = coap_server_tmpl_format(tmpl, &send_msg, buf, sizeof(buf));
+        if (num > 0)
+        {
+            len = num;
+            num = coap_server_trans_send_buf(trans, buf, len);
+        }
+    }
+    else
+    {
+        num = coap_server_trans_send(trans, &send_msg);
+    }
     if (num < 0)
     {
         coap_msg_destroy(&send_msg);
@@ -2145,6 +3730,10 @@ static int coap_server_exchange(coap_server_t *server)
         coap_msg_destroy(&recv_msg);
         return ret;
     }
+    if (tmpl != NULL)
+    {
+        coap_server_trans_set_resp_buf(trans, buf, len);
+    }
 
     /* start the acknowledgement timer if an acknowledgement is expected */
     if (coap_msg_get_type(&send_msg) == COAP_MSG_CON)
@@ -2167,8 +3756,12 @@ static int coap_server_exchange(coap_server_t *server)
 
 int coap_server_run(coap_server_t *server)
 {
+    struct timespec start = {0};
+    struct timespec ready = {0};
+    struct timespec end = {0};
     int ret = 0;
- 
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
     while (1)
     {
         ret = coap_server_listen(server);
@@ -2176,7 +3769,12 @@ int coap_server_run(coap_server_t *server)
         {
             return ret;
         }
+        clock_gettime(CLOCK_MONOTONIC, &ready);
+        coap_server_account(server, coap_server_elapsed_ns(&start, &ready), 0);
         ret = coap_server_exchange(server);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        coap_server_account(server, coap_server_elapsed_ns(&ready, &end), 1);
+        start = end;
         if (ret < 0)
         {
             if ((ret == -ETIMEDOUT) || (ret == -ECONNRESET))
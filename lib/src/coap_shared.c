@@ -0,0 +1,929 @@
+/*
+ * Copyright (c) 2015 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ *  @file coap_shared.c
+ *
+ *  @brief Source file for the FreeCoAP shared client library
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "coap_shared.h"
+#include "coap_log.h"
+
+#define COAP_SHARED_ACK_TIMEOUT_SEC   2                                         /**< Minimum delay to wait before retransmitting a confirmable message */
+#define COAP_SHARED_MAX_RETRANSMIT    4                                         /**< Maximum number of times a confirmable message can be retransmitted */
+#define COAP_SHARED_RESP_TIMEOUT_SEC  30                                        /**< Maximum amount of time to wait for a response */
+
+static int rand_init = 0;                                                       /**< Indicates whether or not the random number generator has been initialised */
+
+/****************************************************************************************************
+ *                                          coap_shared_queue                                       *
+ ****************************************************************************************************/
+
+/**
+ *  @brief Add an exchange to the submission queue
+ *
+ *  This can be called from any number of threads at once.
+ *  The exchange is published by a single atomic exchange
+ *  on the head of the queue.
+ *
+ *  @param[in,out] shared Pointer to a shared client structure
+ *  @param[in] sreq Pointer to an exchange structure
+ */
+static void coap_shared_queue_push(coap_shared_t *shared, coap_shared_req_t *sreq)
+{
+    coap_shared_req_t *prev = NULL;
+
+    atomic_store_explicit(&sreq->next, NULL, memory_order_relaxed);
+    prev = atomic_exchange_explicit(&shared->head, sreq, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, sreq, memory_order_release);
+}
+
+/**
+ *  @brief Remove the oldest exchange from the submission queue
+ *
+ *  This must only be called from the I/O thread. It can
+ *  return NULL while a producer is part way through adding
+ *  an exchange. That producer signals the event descriptor
+ *  afterwards so the exchange is picked up on the next pass.
+ *
+ *  @param[in,out] shared Pointer to a shared client structure
+ *
+ *  @returns Pointer to an exchange structure or NULL
+ */
+static coap_shared_req_t *coap_shared_queue_pop(coap_shared_t *shared)
+{
+    coap_shared_req_t *tail = shared->tail;
+    coap_shared_req_t *next = NULL;
+    coap_shared_req_t *head = NULL;
+
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (tail == &shared->stub)
+    {
+        if (next == NULL)
+        {
+            return NULL;
+        }
+        shared->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    }
+    if (next != NULL)
+    {
+        shared->tail = next;
+        return tail;
+    }
+    head = atomic_load_explicit(&shared->head, memory_order_acquire);
+    if (tail != head)
+    {
+        return NULL;
+    }
+    coap_shared_queue_push(shared, &shared->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next != NULL)
+    {
+        shared->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+/****************************************************************************************************
+ *                                          coap_shared_req                                         *
+ ****************************************************************************************************/
+
+/**
+ *  @brief Complete an exchange and wake the thread waiting for it
+ *
+ *  The exchange must not be touched after its state has been
+ *  set as the waiting thread is then free to reuse it.
+ *
+ *  @param[in,out] shared Pointer to a shared client structure
+ *  @param[in,out] sreq Pointer to an exchange structure
+ *  @param[in] result Result of the exchange
+ */
+static void coap_shared_req_complete(coap_shared_t *shared, coap_shared_req_t *sreq, int result)
+{
+    sreq->result = result;
+    shared->num_exchanges++;
+    atomic_store_explicit(&sreq->state, COAP_SHARED_REQ_DONE, memory_order_release);
+    syscall(SYS_futex, &sreq->state, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+/**
+ *  @brief Calculate a hash bucket index from a token
+ *
+ *  @param[in] token Pointer to the token
+ *
+ *  @returns Hash bucket index
+ */
+static unsigned coap_shared_token_hash(const char *token)
+{
+    unsigned hash = 2166136261u;
+    unsigned i = 0;
+
+    for (i = 0; i < COAP_SHARED_TOKEN_LEN; i++)
+    {
+        hash = (hash ^ (unsigned char)token[i]) * 16777619u;
+    }
+    return hash % COAP_SHARED_HASH_SIZE;
+}
+
+/**
+ *  @brief Check whether or not a socket address belongs to the server of an exchange
+ *
+ *  @param[in] sreq Pointer to an exchange structure
+ *  @param[in] sin Pointer to a socket structure
+ *
+ *  @returns Comparison value
+ *  @retval 1 The addresses match
+ *  @retval 0 The addresses do not match
+ */
+static int coap_shared_req_match_addr(coap_shared_req_t *sreq, coap_ipv_sockaddr_in_t *sin)
+{
+    return ((sreq->server_sin.COAP_IPV_SIN_PORT == sin->COAP_IPV_SIN_PORT)
+         && (memcmp(&sreq->server_sin.COAP_IPV_SIN_ADDR, &sin->COAP_IPV_SIN_ADDR, sizeof(coap_ipv_in_addr_t)) == 0));
+}
+
+/**
+ *  @brief Find an in-flight exchange from its message ID
+ *
+ *  @param[in] shared Pointer to a shared client structure
+ *  @param[in] msg_id Message ID
+ *  @param[in] sin Pointer to the socket structure of the server
+ *
+ *  @returns Pointer to an exchange structure or NULL
+ */
+static coap_shared_req_t *coap_shared_find_msg_id(coap_shared_t *shared, unsigned msg_id, coap_ipv_sockaddr_in_t *sin)
+{
+    coap_shared_req_t *sreq = NULL;
+
+    sreq = shared->id_hash[msg_id % COAP_SHARED_HASH_SIZE];
+    while (sreq != NULL)
+    {
+        if ((sreq->msg_id == msg_id) && coap_shared_req_match_addr(sreq, sin))
+        {
+            return sreq;
+        }
+        sreq = sreq->id_next;
+    }
+    return NULL;
+}
+
+/**
+ *  @brief Find an in-flight exchange from its token
+ *
+ *  @param[in] shared Pointer to a shared client structure
+ *  @param[in] msg Pointer to a message structure
+ *  @param[in] sin Pointer to the socket structure of the server
+ *
+ *  @returns Pointer to an exchange structure or NULL
+ */
+static coap_shared_req_t *coap_shared_find_token(coap_shared_t *shared, coap_msg_t *msg, coap_ipv_sockaddr_in_t *sin)
+{
+    coap_shared_req_t *sreq = NULL;
+
+    if (coap_msg_get_token_len(msg) != COAP_SHARED_TOKEN_LEN)
+    {
+        return NULL;
+    }
+    sreq = shared->token_hash[coap_shared_token_hash(coap_msg_get_token(msg))];
+    while (sreq != NULL)
+    {
+        if ((memcmp(sreq->token, coap_msg_get_token(msg), COAP_SHARED_TOKEN_LEN) == 0)
+         && coap_shared_req_match_addr(sreq, sin))
+        {
+            return sreq;
+        }
+        sreq = sreq->token_next;
+    }
+    return NULL;
+}
+
+/**
+ *  @brief Add an exchange to the in-flight list and hash tables
+ *
+ *  @param[in,out] shared Pointer to a shared client structure
+ *  @param[in,out] sreq Pointer to an exchange structure
+ */
+static void coap_shared_add(coap_shared_t *shared, coap_shared_req_t *sreq)
+{
+    unsigned i = 0;
+
+    i = sreq->msg_id % COAP_SHARED_HASH_SIZE;
+    sreq->id_next = shared->id_hash[i];
+    shared->id_hash[i] = sreq;
+    i = coap_shared_token_hash(sreq->token);
+    sreq->token_next = shared->token_hash[i];
+    shared->token_hash[i] = sreq;
+    sreq->prev = NULL;
+    sreq->flight_next = shared->flight;
+    if (shared->flight != NULL)
+    {
+        shared->flight->prev = sreq;
+    }
+    shared->flight = sreq;
+}
+
+/**
+ *  @brief Remove an exchange from the in-flight list and hash tables
+ *
+ *  @param[in,out] shared Pointer to a shared client structure
+ *  @param[in,out] sreq Pointer to an exchange structure
+ */
+static void coap_shared_remove(coap_shared_t *shared, coap_shared_req_t *sreq)
+{
+    coap_shared_req_t **link = NULL;
+
+    link = &shared->id_hash[sreq->msg_id % COAP_SHARED_HASH_SIZE];
+    while (*link != sreq)
+    {
+        link = &(*link)->id_next;
+    }
+    *link = sreq->id_next;
+    link = &shared->token_hash[coap_shared_token_hash(sreq->token)];
+    while (*link != sreq)
+    {
+        link = &(*link)->token_next;
+    }
+    *link = sreq->token_next;
+    if (sreq->prev != NULL)
+    {
+        sreq->prev->flight_next = sreq->flight_next;
+    }
+    else
+    {
+        shared->flight = sreq->flight_next;
+    }
+    if (sreq->flight_next != NULL)
+    {
+        sreq->flight_next->prev = sreq->prev;
+    }
+}
+
+/**
+ *  @brief Remove an in-flight exchange and complete it
+ *
+ *  @param[in,out] shared Pointer to a shared client structure
+ *  @param[in,out] sreq Pointer to an exchange structure
+ *  @param[in] result Result of the exchange
+ */
+static void coap_shared_finish(coap_shared_t *shared, coap_shared_req_t *sreq, int result)
+{
+    coap_shared_remove(shared, sreq);
+    coap_shared_req_complete(shared, sreq, result);
+}
+
+/****************************************************************************************************
+ *                                            coap_shared                                           *
+ ****************************************************************************************************/
+
+/**
+ *  @brief Set an expiry time relative to the current time
+ *
+ *  @param[out] expire Pointer to the expiry time
+ *  @param[in] now Pointer to the current time
+ *  @param[in] timeout Pointer to the timeout
+ */
+static void coap_shared_set_expire(struct timespec *expire, const struct timespec *now, const struct timespec *timeout)
+{
+    expire->tv_sec = now->tv_sec + timeout->tv_sec;
+    expire->tv_nsec = now->tv_nsec + timeout->tv_nsec;
+    if (expire->tv_nsec >= 1000000000)
+    {
+        expire->tv_sec++;
+        expire->tv_nsec -= 1000000000;
+    }
+}
+
+/**
+ *  @brief Compare two times
+ *
+ *  @param[in] a Pointer to the first time
+ *  @param[in] b Pointer to the second time
+ *
+ *  @returns Comparison value
+ *  @retval 1 a is earlier than b
+ *  @retval 0 a is not earlier than b
+ */
+static int coap_shared_time_before(const struct timespec *a, const struct timespec *b)
+{
+    return ((a->tv_sec < b->tv_sec)
+         || ((a->tv_sec == b->tv_sec) && (a->tv_nsec < b->tv_nsec)));
+}
+
+/**
+ *  @brief Start waiting for the response to an exchange
+ *
+ *  @param[in] shared Pointer to a shared client structure
+ *  @param[in,out] sreq Pointer to an exchange structure
+ *  @param[in] now Pointer to the current time
+ */
+static void coap_shared_start_resp_timer(coap_shared_t *shared, coap_shared_req_t *sreq, const struct timespec *now)
+{
+    sreq->timeout.tv_sec = shared->resp_timeout_sec;
+    sreq->timeout.tv_nsec = 0;
+    coap_shared_set_expire(&sreq->expire, now, &sreq->timeout);
+}
+
+/**
+ *  @brief Send a buffer to a server
+ *
+ *  @param[in] shared Pointer to a shared client structure
+ *  @param[in] buf Pointer to a buffer
+ *  @param[in] len Length of the buffer
+ *  @param[in] sin Pointer to the socket structure of the server
+ *  @param[in] sin_len Length of the socket structure
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+static int coap_shared_send_buf(coap_shared_t *shared, const char *buf, size_t len, coap_ipv_sockaddr_in_t *sin, socklen_t sin_len)
+{
+    ssize_t num = 0;
+
+    num = sendto(shared->sd, buf, len, 0, (struct sockaddr *)sin, sin_len);
+    if (num < 0)
+    {
+        return -errno;
+    }
+    if ((size_t)num != len)
+    {
+        return -EIO;
+    }
+    return 0;
+}
+
+/**
+ *  @brief Send an empty acknowledgement or reset message to a server
+ *
+ *  @param[in] shared Pointer to a shared client structure
+ *  @param[in] type Message type
+ *  @param[in] msg_id Message ID
+ *  @param[in] sin Pointer to the socket structure of the server
+ *  @param[in] sin_len Length of the socket structure
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+static int coap_shared_send_empty(coap_shared_t *shared, unsigned type, unsigned msg_id, coap_ipv_sockaddr_in_t *sin, socklen_t sin_len)
+{
+    char buf[4] = {0};
+
+    buf[0] = (char)((COAP_MSG_VER << 6) | ((type & 0x03) << 4));
+    buf[2] = (char)((msg_id >> 8) & 0xff);
+    buf[3] = (char)(msg_id & 0xff);
+    return coap_shared_send_buf(shared, buf, sizeof(buf), sin, sin_len);
+}
+
+/**
+ *  @brief Send a newly submitted exchange and start its timer
+ *
+ *  @param[in,out] shared Pointer to a shared client structure
+ *  @param[in,out] sreq Pointer to an exchange structure
+ */
+static void coap_shared_start(coap_shared_t *shared, coap_shared_req_t *sreq)
+{
+    struct timespec now = {0};
+    int ret = 0;
+
+    ret = coap_shared_send_buf(shared, sreq->buf, sreq->len, &sreq->server_sin, sreq->server_sin_len);
+    if (ret < 0)
+    {
+        coap_shared_req_complete(shared, sreq, ret);
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (sreq->type == COAP_MSG_CON)
+    {
+        sreq->timeout.tv_sec = shared->ack_timeout_sec;
+        sreq->timeout.tv_nsec = (rand() % 1000) * 1000000;
+        coap_shared_set_expire(&sreq->expire, &now, &sreq->timeout);
+    }
+    else
+    {
+        coap_shared_start_resp_timer(shared, sreq, &now);
+    }
+    coap_shared_add(shared, sreq);
+}
+
+/**
+ *  @brief Deliver a response to an exchange
+ *
+ *  The parsed message is moved into the response message
+ *  of the exchange and the exchange is completed.
+ *
+ *  @param[in,out] shared Pointer to a shared client structure
+ *  @param[in,out] sreq Pointer to an exchange structure
+ *  @param[in,out] msg Pointer to the received message
+ */
+static void coap_shared_deliver(coap_shared_t *shared, coap_shared_req_t *sreq, coap_msg_t *msg)
+{
+    unsigned op_num = 0;
+
+    op_num = coap_msg_check_critical_ops(msg);
+    if (op_num != 0)
+    {
+        coap_log_info("Found bad option number %u in response to shared client", op_num);
+        if (coap_msg_get_type(msg) == COAP_MSG_CON)
+        {
+            coap_shared_send_empty(shared, COAP_MSG_RST, coap_msg_get_msg_id(msg), &sreq->server_sin, sreq->server_sin_len);
+        }
+        coap_shared_finish(shared, sreq, -EBADMSG);
+        return;
+    }
+    if (coap_msg_get_type(msg) == COAP_MSG_CON)
+    {
+        coap_shared_send_empty(shared, COAP_MSG_ACK, coap_msg_get_msg_id(msg), &sreq->server_sin, sreq->server_sin_len);
+    }
+    coap_msg_destroy(sreq->resp);
+    *sreq->resp = *msg;
+    coap_msg_create(msg);
+    coap_shared_finish(shared, sreq, 0);
+}
+
+/**
+ *  @brief Handle a received message
+ *
+ *  Match an acknowledgement or reset message to an in-flight
+ *  exchange by message ID and a confirmable or non-confirmable
+ *  message by token, as coap_client_exchange does for a single
+ *  exchange. A confirmable or non-confirmable message from a
+ *  server carries a message ID chosen by the server, which may
+ *  equal the message ID of an unrelated exchange.
+ *
+ *  @param[in,out] shared Pointer to a shared client structure
+ *  @param[in,out] msg Pointer to the received message
+ *  @param[in] sin Pointer to the socket structure of the sender
+ *  @param[in] sin_len Length of the socket structure
+ */
+static void coap_shared_handle_msg(coap_shared_t *shared, coap_msg_t *msg, coap_ipv_sockaddr_in_t *sin, socklen_t sin_len)
+{
+    coap_shared_req_t *sreq = NULL;
+    struct timespec now = {0};
+
+    if ((coap_msg_get_type(msg) == COAP_MSG_ACK)
+     || (coap_msg_get_type(msg) == COAP_MSG_RST))
+    {
+        sreq = coap_shared_find_msg_id(shared, coap_msg_get_msg_id(msg), sin);
+    }
+    if (sreq != NULL)
+    {
+        if (coap_msg_get_type(msg) == COAP_MSG_ACK)
+        {
+            if (coap_msg_is_empty(msg))
+            {
+                /* received ack message, wait for separate response message */
+                if (!sreq->acked)
+                {
+                    sreq->acked = 1;
+                    clock_gettime(CLOCK_MONOTONIC, &now);
+                    coap_shared_start_resp_timer(shared, sreq, &now);
+                }
+                return;
+            }
+            if (coap_shared_find_token(shared, msg, sin) == sreq)
+            {
+                coap_shared_deliver(shared, sreq, msg);
+                return;
+            }
+        }
+        else
+        {
+            coap_shared_finish(shared, sreq, -ECONNRESET);
+            return;
+        }
+        coap_shared_finish(shared, sreq, -EBADMSG);
+        return;
+    }
+    sreq = coap_shared_find_token(shared, msg, sin);
+    if (sreq != NULL)
+    {
+        if ((coap_msg_get_type(msg) == COAP_MSG_CON)
+         || (coap_msg_get_type(msg) == COAP_MSG_NON))
+        {
+            coap_shared_deliver(shared, sreq, msg);
+            return;
+        }
+        coap_shared_finish(shared, sreq, -EBADMSG);
+        return;
+    }
+    /* message deduplication */
+    /* we might have received a duplicate message for an exchange that has completed */
+    if (coap_msg_get_type(msg) == COAP_MSG_CON)
+    {
+        coap_log_info("Rejecting confirmable message to shared client");
+        coap_shared_send_empty(shared, COAP_MSG_RST, coap_msg_get_msg_id(msg), sin, sin_len);
+    }
+}
+
+/**
+ *  @brief Receive and handle all pending messages
+ *
+ *  @param[in,out] shared Pointer to a shared client structure
+ */
+static void coap_shared_recv(coap_shared_t *shared)
+{
+    coap_ipv_sockaddr_in_t sin = {0};
+    socklen_t sin_len = 0;
+    coap_msg_t msg = {0};
+    unsigned msg_id = 0;
+    unsigned type = 0;
+    ssize_t num = 0;
+    ssize_t ret = 0;
+    char buf[COAP_MSG_MAX_BUF_LEN] = {0};
+
+    coap_msg_create(&msg);
+    while (1)
+    {
+        sin_len = sizeof(sin);
+        num = recvfrom(shared->sd, buf, sizeof(buf), 0, (struct sockaddr *)&sin, &sin_len);
+        if (num < 0)
+        {
+            break;
+        }
+        coap_msg_reset(&msg);
+        ret = coap_msg_parse(&msg, buf, num);
+        if (ret < 0)
+        {
+            if ((ret == -EBADMSG)
+             && (coap_msg_parse_type_msg_id(buf, num, &type, &msg_id) == 0)
+             && (type == COAP_MSG_CON))
+            {
+                coap_shared_send_empty(shared, COAP_MSG_RST, msg_id, &sin, sin_len);
+            }
+            continue;
+        }
+        coap_shared_handle_msg(shared, &msg, &sin, sin_len);
+    }
+    coap_msg_destroy(&msg);
+}
+
+/**
+ *  @brief Retransmit or fail exchanges whose timers have expired
+ *
+ *  @param[in,out] shared Pointer to a shared client structure
+ *  @param[out] tv Pointer to the time until the next timer expires
+ *  @param[out] tvp Set to tv if an exchange is in flight or NULL otherwise
+ */
+static void coap_shared_handle_timers(coap_shared_t *shared, struct timeval *tv, struct timeval **tvp)
+{
+    struct timespec earliest = {0};
+    struct timespec now = {0};
+    coap_shared_req_t *sreq = NULL;
+    coap_shared_req_t *next = NULL;
+    unsigned msec = 0;
+    int ret = 0;
+
+    *tvp = NULL;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    sreq = shared->flight;
+    while (sreq != NULL)
+    {
+        next = sreq->flight_next;
+        if (!coap_shared_time_before(&now, &sreq->expire))
+        {
+            if ((sreq->type != COAP_MSG_CON) || (sreq->acked) || (sreq->num_retrans >= shared->max_retransmit))
+            {
+                coap_shared_finish(shared, sreq, -ETIMEDOUT);
+                sreq = next;
+                continue;
+            }
+            ret = coap_shared_send_buf(shared, sreq->buf, sreq->len, &sreq->server_sin, sreq->server_sin_len);
+            if (ret < 0)
+            {
+                coap_shared_finish(shared, sreq, ret);
+                sreq = next;
+                continue;
+            }
+            sreq->num_retrans++;
+            msec = 2 * ((sreq->timeout.tv_sec * 1000) + (sreq->timeout.tv_nsec / 1000000));
+            sreq->timeout.tv_sec = msec / 1000;
+            sreq->timeout.tv_nsec = (msec % 1000) * 1000000;
+            coap_shared_set_expire(&sreq->expire, &now, &sreq->timeout);
+        }
+        if ((*tvp == NULL) || coap_shared_time_before(&sreq->expire, &earliest))
+        {
+            earliest = sreq->expire;
+            *tvp = tv;
+        }
+        sreq = next;
+    }
+    if (*tvp != NULL)
+    {
+        tv->tv_sec = earliest.tv_sec - now.tv_sec;
+        tv->tv_usec = (earliest.tv_nsec - now.tv_nsec) / 1000;
+        if (tv->tv_usec < 0)
+        {
+            tv->tv_sec--;
+            tv->tv_usec += 1000000;
+        }
+    }
+}
+
+/**
+ *  @brief I/O thread
+ *
+ *  Multiplex all in-flight exchanges over the shared socket.
+ *
+ *  @param[in,out] data Pointer to a shared client structure
+ *
+ *  @returns NULL
+ */
+static void *coap_shared_thread_func(void *data)
+{
+    coap_shared_t *shared = (coap_shared_t *)data;
+    coap_shared_req_t *sreq = NULL;
+    struct timeval *tvp = NULL;
+    struct timeval tv = {0};
+    uint64_t val = 0;
+    fd_set read_fds = {{0}};
+    int max_fd = 0;
+    int ret = 0;
+
+    max_fd = shared->sd > shared->event_fd ? shared->sd : shared->event_fd;
+    while (!atomic_load(&shared->stop))
+    {
+        coap_shared_handle_timers(shared, &tv, &tvp);
+        FD_ZERO(&read_fds);
+        FD_SET(shared->sd, &read_fds);
+        FD_SET(shared->event_fd, &read_fds);
+        ret = select(max_fd + 1, &read_fds, NULL, NULL, tvp);
+        if (ret < 0)
+        {
+            if (errno != EINTR)
+            {
+                coap_log_error("Shared client failed to wait for events: %s", strerror(errno));
+                break;
+            }
+            continue;
+        }
+        if (FD_ISSET(shared->event_fd, &read_fds))
+        {
+            read(shared->event_fd, &val, sizeof(val));
+            while ((sreq = coap_shared_queue_pop(shared)) != NULL)
+            {
+                coap_shared_start(shared, sreq);
+            }
+        }
+        if (FD_ISSET(shared->sd, &read_fds))
+        {
+            coap_shared_recv(shared);
+        }
+    }
+    while (shared->flight != NULL)
+    {
+        coap_shared_finish(shared, shared->flight, -ECANCELED);
+    }
+    while ((sreq = coap_shared_queue_pop(shared)) != NULL)
+    {
+        coap_shared_req_complete(shared, sreq, -ECANCELED);
+    }
+    return NULL;
+}
+
+int coap_shared_create(coap_shared_t *shared)
+{
+    int flags = 0;
+    int ret = 0;
+
+    memset(shared, 0, sizeof(coap_shared_t));
+    if (!rand_init)
+    {
+        srand(time(NULL));
+        rand_init = 1;
+    }
+    shared->sd = socket(COAP_IPV_AF_INET, SOCK_DGRAM, 0);
+    if (shared->sd < 0)
+    {
+        memset(shared, 0, sizeof(coap_shared_t));
+        return -errno;
+    }
+    flags = fcntl(shared->sd, F_GETFL, 0);
+    if ((flags < 0) || (fcntl(shared->sd, F_SETFL, flags | O_NONBLOCK) < 0))
+    {
+        ret = -errno;
+        close(shared->sd);
+        memset(shared, 0, sizeof(coap_shared_t));
+        return ret;
+    }
+    shared->event_fd = eventfd(0, EFD_NONBLOCK);
+    if (shared->event_fd < 0)
+    {
+        ret = -errno;
+        close(shared->sd);
+        memset(shared, 0, sizeof(coap_shared_t));
+        return ret;
+    }
+    shared->ack_timeout_sec = COAP_SHARED_ACK_TIMEOUT_SEC;
+    shared->max_retransmit = COAP_SHARED_MAX_RETRANSMIT;
+    shared->resp_timeout_sec = COAP_SHARED_RESP_TIMEOUT_SEC;
+    atomic_init(&shared->stop, 0);
+    atomic_init(&shared->msg_id, (unsigned)rand());
+    atomic_init(&shared->stub.next, NULL);
+    atomic_init(&shared->head, &shared->stub);
+    shared->tail = &shared->stub;
+    ret = pthread_create(&shared->thread, NULL, coap_shared_thread_func, shared);
+    if (ret != 0)
+    {
+        close(shared->event_fd);
+        close(shared->sd);
+        memset(shared, 0, sizeof(coap_shared_t));
+        return -ret;
+    }
+    return 0;
+}
+
+void coap_shared_destroy(coap_shared_t *shared)
+{
+    uint64_t val = 1;
+
+    atomic_store(&shared->stop, 1);
+    write(shared->event_fd, &val, sizeof(val));
+    pthread_join(shared->thread, NULL);
+    close(shared->event_fd);
+    close(shared->sd);
+    memset(shared, 0, sizeof(coap_shared_t));
+}
+
+int coap_shared_set_timeouts(coap_shared_t *shared, unsigned ack_timeout_sec, unsigned max_retransmit, unsigned resp_timeout_sec)
+{
+    if ((ack_timeout_sec == 0) || (resp_timeout_sec == 0))
+    {
+        return -EINVAL;
+    }
+    shared->ack_timeout_sec = ack_timeout_sec;
+    shared->max_retransmit = max_retransmit;
+    shared->resp_timeout_sec = resp_timeout_sec;
+    return 0;
+}
+
+/**
+ *  @brief Resolve the address of a server
+ *
+ *  @param[out] sreq Pointer to an exchange structure
+ *  @param[in] host Pointer to a string containing the host address of the server
+ *  @param[in] port Port number of the server as a string
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+static int coap_shared_resolve(coap_shared_req_t *sreq, const char *host, const char *port)
+{
+    struct addrinfo hints = {0};
+    struct addrinfo *list = NULL;
+    struct addrinfo *node = NULL;
+    int ret = 0;
+
+    hints.ai_family = COAP_IPV_AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    ret = getaddrinfo(host, port, &hints, &list);
+    if (ret < 0)
+    {
+        return -EBUSY;
+    }
+    for (node = list; node != NULL; node = node->ai_next)
+    {
+        if ((node->ai_family == COAP_IPV_AF_INET)
+         && (node->ai_socktype == SOCK_DGRAM)
+         && (node->ai_addrlen <= sizeof(sreq->server_sin)))
+        {
+            memcpy(&sreq->server_sin, node->ai_addr, node->ai_addrlen);
+            sreq->server_sin_len = node->ai_addrlen;
+            break;
+        }
+    }
+    freeaddrinfo(list);
+    if (node == NULL)
+    {
+        return -EBUSY;
+    }
+    return 0;
+}
+
+int coap_shared_submit(coap_shared_t *shared,
+                       coap_shared_req_t *sreq,
+                       const char *host,
+                       const char *port,
+                       coap_msg_t *req,
+                       coap_msg_t *resp)
+{
+    uint64_t val = 1;
+    ssize_t num = 0;
+    int ret = 0;
+
+    /* check for a valid request */
+    if ((coap_msg_get_type(req) == COAP_MSG_ACK)
+     || (coap_msg_get_type(req) == COAP_MSG_RST)
+     || (coap_msg_get_code_class(req) != COAP_MSG_REQ))
+    {
+        return -EINVAL;
+    }
+    memset(sreq, 0, sizeof(coap_shared_req_t));
+    ret = coap_shared_resolve(sreq, host, port);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    /* the message ID only has to be unique among the exchanges in flight */
+    sreq->msg_id = (atomic_fetch_add_explicit(&shared->msg_id, 1, memory_order_relaxed) + 1) & 0xffff;
+    ret = coap_msg_set_msg_id(req, sreq->msg_id);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    coap_msg_gen_rand_str(sreq->token, sizeof(sreq->token));
+    ret = coap_msg_set_token(req, sreq->token, sizeof(sreq->token));
+    if (ret < 0)
+    {
+        return ret;
+    }
+    num = coap_msg_format(req, sreq->buf, sizeof(sreq->buf));
+    if (num < 0)
+    {
+        return num;
+    }
+    sreq->len = num;
+    sreq->type = coap_msg_get_type(req);
+    sreq->resp = resp;
+    atomic_init(&sreq->state, COAP_SHARED_REQ_PENDING);
+    coap_shared_queue_push(shared, sreq);
+    write(shared->event_fd, &val, sizeof(val));
+    return 0;
+}
+
+int coap_shared_poll(coap_shared_req_t *sreq)
+{
+    if (atomic_load_explicit(&sreq->state, memory_order_acquire) != COAP_SHARED_REQ_DONE)
+    {
+        return -EINPROGRESS;
+    }
+    return sreq->result;
+}
+
+int coap_shared_wait(coap_shared_req_t *sreq)
+{
+    while (atomic_load_explicit(&sreq->state, memory_order_acquire) == COAP_SHARED_REQ_PENDING)
+    {
+        syscall(SYS_futex, &sreq->state, FUTEX_WAIT_PRIVATE, COAP_SHARED_REQ_PENDING, NULL, NULL, 0);
+    }
+    return sreq->result;
+}
+
+int coap_shared_exchange(coap_shared_t *shared,
+                         const char *host,
+                         const char *port,
+                         coap_msg_t *req,
+                         coap_msg_t *resp)
+{
+    coap_shared_req_t sreq;
+    int ret = 0;
+
+    ret = coap_shared_submit(shared, &sreq, host, port, req, resp);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    return coap_shared_wait(&sreq);
+}
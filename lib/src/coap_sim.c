@@ -0,0 +1,1393 @@
+/*
+ * Copyright (c) 2015 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ *  @file coap_sim.c
+ *
+ *  @brief Source file for the FreeCoAP simulation library
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include "coap_sim.h"
+#include "coap_log.h"
+
+#define COAP_SIM_START_NS       1000000000000ull                                /**< Initial value (nsec) of the simulated CLOCK_MONOTONIC */
+#define COAP_SIM_EPOCH          1500000000                                      /**< Value (sec) of the simulated CLOCK_REALTIME when the simulation starts */
+#define COAP_SIM_STACK_SIZE     (256 * 1024)                                    /**< Stack size of a simulated thread */
+#define COAP_SIM_RCVBUF_MAX     256                                             /**< Maximum number of datagrams waiting on a socket */
+#define COAP_SIM_NUM_BUCKETS    65536                                           /**< Number of buckets in the socket hash table */
+#define COAP_SIM_EPHEMERAL      16384                                           /**< Number of ephemeral ports per simulated host address */
+
+/**
+ *  @brief Event type enumeration
+ */
+typedef enum
+{
+    COAP_SIM_EV_DELIVER = 0,                                                    /**< A datagram arrives */
+    COAP_SIM_EV_TIMER,                                                          /**< A timer expires */
+    COAP_SIM_EV_WAKE                                                            /**< A thread's select or sleep times out */
+}
+coap_sim_ev_type_t;
+
+/**
+ *  @brief File descriptor type enumeration
+ */
+typedef enum
+{
+    COAP_SIM_FD_SOCK = 0,                                                       /**< Datagram socket */
+    COAP_SIM_FD_TIMER                                                           /**< Timer */
+}
+coap_sim_fd_type_t;
+
+/**
+ *  @brief Simulated thread structure
+ */
+typedef struct coap_sim_thread
+{
+    ucontext_t ctx;                                                             /**< Saved context of the thread */
+    void *stack;                                                                /**< Stack of the thread, NULL for the thread that called coap_sim_init */
+    unsigned gen;                                                               /**< Incremented each time the thread is woken, stale wake-ups carry an old value */
+    int sleeping;                                                               /**< Indicates whether or not the thread is blocked in coap_sim_sleep */
+    void *(*func)(void *);                                                      /**< Thread function */
+    void *data;                                                                 /**< Argument to the thread function */
+    struct coap_sim_thread *next;                                               /**< Next thread in the run queue */
+}
+coap_sim_thread_t;
+
+/**
+ *  @brief Datagram structure
+ */
+typedef struct coap_sim_dgram
+{
+    struct coap_sim_dgram *next;                                                /**< Next datagram in the receive queue */
+    struct sockaddr_storage src;                                                /**< Source address */
+    socklen_t src_len;                                                          /**< Length of the source address */
+    struct sockaddr_storage dst;                                                /**< Destination address */
+    socklen_t dst_len;                                                          /**< Length of the destination address */
+    size_t len;                                                                 /**< Length of the data */
+    char buf[];                                                                 /**< Data */
+}
+coap_sim_dgram_t;
+
+/**
+ *  @brief Simulated file descriptor structure
+ */
+typedef struct coap_sim_fd
+{
+    coap_sim_fd_type_t type;                                                    /**< File descriptor type */
+    coap_sim_thread_t *waiter;                                                  /**< Thread blocked in select on this file descriptor */
+    unsigned waiter_gen;                                                        /**< Value of the waiter's gen when it blocked */
+    int family;                                                                 /**< Socket address family */
+    int bound;                                                                  /**< Indicates whether or not the socket has a local address */
+    int connected;                                                              /**< Indicates whether or not the socket has a peer address */
+    struct sockaddr_storage local;                                              /**< Local address */
+    socklen_t local_len;                                                        /**< Length of the local address */
+    struct sockaddr_storage peer;                                               /**< Peer address */
+    socklen_t peer_len;                                                         /**< Length of the peer address */
+    coap_sim_dgram_t *head;                                                     /**< First datagram in the receive queue */
+    coap_sim_dgram_t *tail;                                                     /**< Last datagram in the receive queue */
+    unsigned num_dgrams;                                                        /**< Number of datagrams in the receive queue */
+    struct coap_sim_fd *hash_next;                                              /**< Next socket in the same hash bucket */
+    uint64_t timer_gen;                                                         /**< Identifies the current arming of the timer */
+    int expired;                                                                /**< Indicates whether or not the timer has expired since it was armed */
+}
+coap_sim_fd_t;
+
+/**
+ *  @brief Event structure
+ */
+typedef struct
+{
+    uint64_t time;                                                              /**< Time (nsec) at which the event happens */
+    uint64_t seq;                                                               /**< Sequence number that orders events with the same time */
+    coap_sim_ev_type_t type;                                                    /**< Event type */
+    void *ptr;                                                                  /**< Datagram or thread */
+    int fd;                                                                     /**< Timer file descriptor */
+    uint64_t gen;                                                               /**< Timer or thread generation when the event was scheduled */
+}
+coap_sim_ev_t;
+
+/**
+ *  @brief Simulation structure
+ */
+typedef struct
+{
+    uint64_t now;                                                               /**< Virtual time (nsec) */
+    uint64_t seq;                                                               /**< Next event sequence number */
+    uint64_t rand;                                                              /**< State of the link random number generator */
+    unsigned lib_rand;                                                          /**< State of the random number generator used by the libraries */
+    double loss;                                                                /**< Probability that a datagram is lost */
+    uint64_t delay_ns;                                                          /**< Mean one-way delay (nsec) */
+    uint64_t jitter_ns;                                                         /**< Spread of the one-way delay (nsec) */
+    coap_sim_thread_t *current;                                                 /**< The thread that is allowed to run */
+    coap_sim_thread_t *main;                                                    /**< The thread that called coap_sim_init */
+    coap_sim_thread_t *exited;                                                  /**< Thread that has returned, its stack is freed by the next thread to run */
+    coap_sim_thread_t *run_head;                                                /**< First thread in the run queue */
+    coap_sim_thread_t *run_tail;                                                /**< Last thread in the run queue */
+    int deadlock;                                                               /**< Indicates that every thread blocked with nothing left to wake them */
+    coap_sim_ev_t *heap;                                                        /**< Binary min-heap of events */
+    size_t num_ev;                                                              /**< Number of events in the heap */
+    size_t max_ev;                                                              /**< Capacity of the heap */
+    coap_sim_fd_t **fds;                                                        /**< Table of file descriptors indexed by fd - COAP_SIM_FD_BASE */
+    int *free_fds;                                                              /**< Stack of unused indexes into the file descriptor table */
+    size_t num_fds;                                                             /**< Number of entries in the file descriptor table */
+    size_t num_free_fds;                                                        /**< Number of unused indexes */
+    size_t max_fds;                                                             /**< Capacity of the file descriptor table */
+    coap_sim_fd_t *buckets[COAP_SIM_NUM_BUCKETS];                               /**< Hash table of bound sockets */
+    unsigned num_ephemeral;                                                     /**< Number of ephemeral addresses handed out */
+    coap_sim_stats_t stats;                                                     /**< Statistics */
+}
+coap_sim_t;
+
+static coap_sim_t sim = {0};                                                    /**< The simulation */
+
+/**
+ *  @brief Generate a random number for the link model
+ *
+ *  @returns Random number in [0, 1)
+ */
+static double coap_sim_link_rand(void)
+{
+    /* xorshift64* */
+    sim.rand ^= sim.rand >> 12;
+    sim.rand ^= sim.rand << 25;
+    sim.rand ^= sim.rand >> 27;
+    return (sim.rand * 2685821657736338717ull >> 11) / 9007199254740992.0;
+}
+
+/**
+ *  @brief Compare two events
+ *
+ *  @param[in] a Pointer to the first event
+ *  @param[in] b Pointer to the second event
+ *
+ *  @returns Comparison result
+ *  @retval 1 The first event happens before the second
+ *  @retval 0 Otherwise
+ */
+static int coap_sim_ev_before(const coap_sim_ev_t *a, const coap_sim_ev_t *b)
+{
+    return (a->time < b->time) || ((a->time == b->time) && (a->seq < b->seq));
+}
+
+/**
+ *  @brief Add an event to the heap
+ *
+ *  @param[in] ev Pointer to the event, the sequence number is filled in
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval -ENOMEM Out of memory
+ */
+static int coap_sim_ev_push(coap_sim_ev_t *ev)
+{
+    coap_sim_ev_t *heap = NULL;
+    coap_sim_ev_t tmp = {0};
+    size_t max = 0;
+    size_t i = 0;
+
+    if (sim.num_ev == sim.max_ev)
+    {
+        max = sim.max_ev == 0 ? 1024 : 2 * sim.max_ev;
+        heap = realloc(sim.heap, max * sizeof(coap_sim_ev_t));
+        if (heap == NULL)
+        {
+            return -ENOMEM;
+        }
+        sim.heap = heap;
+        sim.max_ev = max;
+    }
+    ev->seq = sim.seq++;
+    i = sim.num_ev++;
+    sim.heap[i] = *ev;
+    while ((i > 0) && (coap_sim_ev_before(&sim.heap[i], &sim.heap[(i - 1) / 2])))
+    {
+        tmp = sim.heap[i];
+        sim.heap[i] = sim.heap[(i - 1) / 2];
+        sim.heap[(i - 1) / 2] = tmp;
+        i = (i - 1) / 2;
+    }
+    return 0;
+}
+
+/**
+ *  @brief Remove the earliest event from the heap
+ *
+ *  @param[out] ev Pointer to an event structure
+ */
+static void coap_sim_ev_pop(coap_sim_ev_t *ev)
+{
+    coap_sim_ev_t tmp = {0};
+    size_t least = 0;
+    size_t i = 0;
+
+    *ev = sim.heap[0];
+    sim.heap[0] = sim.heap[--sim.num_ev];
+    while (1)
+    {
+        least = i;
+        if ((2 * i + 1 < sim.num_ev) && (coap_sim_ev_before(&sim.heap[2 * i + 1], &sim.heap[least])))
+        {
+            least = 2 * i + 1;
+        }
+        if ((2 * i + 2 < sim.num_ev) && (coap_sim_ev_before(&sim.heap[2 * i + 2], &sim.heap[least])))
+        {
+            least = 2 * i + 2;
+        }
+        if (least == i)
+        {
+            break;
+        }
+        tmp = sim.heap[i];
+        sim.heap[i] = sim.heap[least];
+        sim.heap[least] = tmp;
+        i = least;
+    }
+}
+
+/**
+ *  @brief Look up a simulated file descriptor
+ *
+ *  @param[in] fd File descriptor
+ *
+ *  @returns Pointer to the simulated file descriptor or NULL
+ */
+static coap_sim_fd_t *coap_sim_fd_get(int fd)
+{
+    size_t i = 0;
+
+    if (fd < COAP_SIM_FD_BASE)
+    {
+        return NULL;
+    }
+    i = fd - COAP_SIM_FD_BASE;
+    if (i >= sim.num_fds)
+    {
+        return NULL;
+    }
+    return sim.fds[i];
+}
+
+/**
+ *  @brief Allocate a simulated file descriptor
+ *
+ *  @param[in] type File descriptor type
+ *
+ *  @returns File descriptor or error code
+ *  @retval >=COAP_SIM_FD_BASE File descriptor
+ *  @retval -ENOMEM Out of memory
+ */
+static int coap_sim_fd_new(coap_sim_fd_type_t type)
+{
+    coap_sim_fd_t **fds = NULL;
+    coap_sim_fd_t *f = NULL;
+    int *free_fds = NULL;
+    size_t max = 0;
+    size_t i = 0;
+
+    f = calloc(1, sizeof(coap_sim_fd_t));
+    if (f == NULL)
+    {
+        return -ENOMEM;
+    }
+    f->type = type;
+    if (sim.num_free_fds > 0)
+    {
+        i = sim.free_fds[--sim.num_free_fds];
+    }
+    else
+    {
+        if (sim.num_fds == sim.max_fds)
+        {
+            max = sim.max_fds == 0 ? 1024 : 2 * sim.max_fds;
+            fds = realloc(sim.fds, max * sizeof(coap_sim_fd_t *));
+            if (fds == NULL)
+            {
+                free(f);
+                return -ENOMEM;
+            }
+            sim.fds = fds;
+            free_fds = realloc(sim.free_fds, max * sizeof(int));
+            if (free_fds == NULL)
+            {
+                free(f);
+                return -ENOMEM;
+            }
+            sim.free_fds = free_fds;
+            sim.max_fds = max;
+        }
+        i = sim.num_fds++;
+    }
+    sim.fds[i] = f;
+    return COAP_SIM_FD_BASE + (int)i;
+}
+
+/**
+ *  @brief Get the address bytes and port number of a socket address
+ *
+ *  @param[in] addr Pointer to a socket address
+ *  @param[out] port Port number in network byte order
+ *  @param[out] len Number of address bytes
+ *
+ *  @returns Pointer to the address bytes
+ */
+static const unsigned char *coap_sim_addr(const struct sockaddr_storage *addr, unsigned *port, size_t *len)
+{
+    const struct sockaddr_in6 *sin6 = NULL;
+    const struct sockaddr_in *sin = NULL;
+
+    if (addr->ss_family == AF_INET6)
+    {
+        sin6 = (const struct sockaddr_in6 *)addr;
+        *port = sin6->sin6_port;
+        *len = sizeof(sin6->sin6_addr);
+        return (const unsigned char *)&sin6->sin6_addr;
+    }
+    sin = (const struct sockaddr_in *)addr;
+    *port = sin->sin_port;
+    *len = sizeof(sin->sin_addr);
+    return (const unsigned char *)&sin->sin_addr;
+}
+
+/**
+ *  @brief Compare two socket addresses
+ *
+ *  @param[in] a Pointer to the first socket address
+ *  @param[in] b Pointer to the second socket address
+ *  @param[in] any Indicates that an unspecified address in the first socket address matches any address
+ *
+ *  @returns Comparison result
+ *  @retval 1 The addresses match
+ *  @retval 0 Otherwise
+ */
+static int coap_sim_addr_match(const struct sockaddr_storage *a, const struct sockaddr_storage *b, int any)
+{
+    static const unsigned char zero[16] = {0};
+    const unsigned char *a_addr = NULL;
+    const unsigned char *b_addr = NULL;
+    unsigned a_port = 0;
+    unsigned b_port = 0;
+    size_t a_len = 0;
+    size_t b_len = 0;
+
+    if (a->ss_family != b->ss_family)
+    {
+        return 0;
+    }
+    a_addr = coap_sim_addr(a, &a_port, &a_len);
+    b_addr = coap_sim_addr(b, &b_port, &b_len);
+    if (a_port != b_port)
+    {
+        return 0;
+    }
+    if ((any) && (memcmp(a_addr, zero, a_len) == 0))
+    {
+        return 1;
+    }
+    return memcmp(a_addr, b_addr, a_len) == 0;
+}
+
+/**
+ *  @brief Hash the port number of a socket address
+ *
+ *  Sockets bound to an unspecified address must be found
+ *  from any destination address, so only the port number
+ *  and the low bytes of the address are hashed.
+ *
+ *  @param[in] addr Pointer to a socket address
+ *
+ *  @returns Bucket index
+ */
+static unsigned coap_sim_hash(const struct sockaddr_storage *addr)
+{
+    const unsigned char *bytes = NULL;
+    unsigned port = 0;
+    size_t len = 0;
+
+    bytes = coap_sim_addr(addr, &port, &len);
+    return (port ^ ((unsigned)bytes[len - 1] << 8) ^ ((unsigned)bytes[len - 2] << 16) ^ ((unsigned)bytes[len - 3] << 4)) % COAP_SIM_NUM_BUCKETS;
+}
+
+/**
+ *  @brief Find the socket bound to an address
+ *
+ *  @param[in] addr Pointer to a socket address
+ *
+ *  @returns Pointer to the simulated file descriptor or NULL
+ */
+static coap_sim_fd_t *coap_sim_lookup(const struct sockaddr_storage *addr)
+{
+    struct sockaddr_storage any = {0};
+    struct sockaddr_in6 *sin6 = NULL;
+    struct sockaddr_in *sin = NULL;
+    coap_sim_fd_t *f = NULL;
+
+    for (f = sim.buckets[coap_sim_hash(addr)]; f != NULL; f = f->hash_next)
+    {
+        if (coap_sim_addr_match(&f->local, addr, 0))
+        {
+            return f;
+        }
+    }
+    /* look for a socket bound to the unspecified address */
+    any.ss_family = addr->ss_family;
+    if (addr->ss_family == AF_INET6)
+    {
+        sin6 = (struct sockaddr_in6 *)&any;
+        sin6->sin6_port = ((const struct sockaddr_in6 *)addr)->sin6_port;
+    }
+    else
+    {
+        sin = (struct sockaddr_in *)&any;
+        sin->sin_port = ((const struct sockaddr_in *)addr)->sin_port;
+    }
+    for (f = sim.buckets[coap_sim_hash(&any)]; f != NULL; f = f->hash_next)
+    {
+        if (coap_sim_addr_match(&f->local, &any, 0))
+        {
+            return f;
+        }
+    }
+    return NULL;
+}
+
+/**
+ *  @brief Bind a socket to an address and add it to the hash table
+ *
+ *  @param[in,out] f Pointer to a simulated file descriptor
+ *  @param[in] addr Pointer to a socket address
+ *  @param[in] addr_len Length of the socket address
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval -EADDRINUSE The address is already in use
+ */
+static int coap_sim_do_bind(coap_sim_fd_t *f, const struct sockaddr *addr, socklen_t addr_len)
+{
+    coap_sim_fd_t *g = NULL;
+    unsigned i = 0;
+
+    memset(&f->local, 0, sizeof(f->local));
+    memcpy(&f->local, addr, addr_len);
+    f->local_len = addr_len;
+    i = coap_sim_hash(&f->local);
+    for (g = sim.buckets[i]; g != NULL; g = g->hash_next)
+    {
+        if (coap_sim_addr_match(&g->local, &f->local, 0))
+        {
+            return -EADDRINUSE;
+        }
+    }
+    f->hash_next = sim.buckets[i];
+    sim.buckets[i] = f;
+    f->bound = 1;
+    return 0;
+}
+
+/**
+ *  @brief Bind a socket to a new simulated host address and ephemeral port
+ *
+ *  Every socket that is not bound explicitly gets its own
+ *  address so that the number of sockets is not limited by
+ *  the number of port numbers.
+ *
+ *  @param[in,out] f Pointer to a simulated file descriptor
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+static int coap_sim_autobind(coap_sim_fd_t *f)
+{
+    struct sockaddr_storage addr = {0};
+    struct sockaddr_in6 *sin6 = NULL;
+    struct sockaddr_in *sin = NULL;
+    unsigned host = 0;
+    unsigned port = 0;
+
+    host = sim.num_ephemeral / COAP_SIM_EPHEMERAL + 1;
+    port = 49152 + sim.num_ephemeral % COAP_SIM_EPHEMERAL;
+    sim.num_ephemeral++;
+    if (f->family == AF_INET6)
+    {
+        /* fd00::/8 */
+        sin6 = (struct sockaddr_in6 *)&addr;
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_addr.s6_addr[0] = 0xfd;
+        sin6->sin6_addr.s6_addr[13] = (host >> 16) & 0xff;
+        sin6->sin6_addr.s6_addr[14] = (host >> 8) & 0xff;
+        sin6->sin6_addr.s6_addr[15] = host & 0xff;
+        sin6->sin6_port = htons(port);
+        return coap_sim_do_bind(f, (struct sockaddr *)sin6, sizeof(*sin6));
+    }
+    /* 10.0.0.0/8 */
+    sin = (struct sockaddr_in *)&addr;
+    sin->sin_family = AF_INET;
+    sin->sin_addr.s_addr = htonl(0x0a000000 | (host & 0xffffff));
+    sin->sin_port = htons(port);
+    return coap_sim_do_bind(f, (struct sockaddr *)sin, sizeof(*sin));
+}
+
+/**
+ *  @brief Replace an unspecified source address with the loopback address
+ *
+ *  Every simulated host is reached through the loopback interface
+ *  so a socket bound to an unspecified address sends from there.
+ *
+ *  @param[in,out] addr Pointer to a socket address
+ */
+static void coap_sim_set_src(struct sockaddr_storage *addr)
+{
+    static const unsigned char zero[16] = {0};
+    struct sockaddr_in6 *sin6 = NULL;
+    struct sockaddr_in *sin = NULL;
+
+    if (addr->ss_family == AF_INET6)
+    {
+        sin6 = (struct sockaddr_in6 *)addr;
+        if (memcmp(&sin6->sin6_addr, zero, sizeof(sin6->sin6_addr)) == 0)
+        {
+            sin6->sin6_addr = in6addr_loopback;
+        }
+        return;
+    }
+    sin = (struct sockaddr_in *)addr;
+    if (sin->sin_addr.s_addr == htonl(INADDR_ANY))
+    {
+        sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    }
+}
+
+/**
+ *  @brief Add a thread to the run queue
+ *
+ *  The thread's generation is incremented so that
+ *  any other pending wake-up for it is ignored.
+ *
+ *  @param[in,out] t Pointer to a simulated thread structure
+ */
+static void coap_sim_make_runnable(coap_sim_thread_t *t)
+{
+    t->gen++;
+    t->next = NULL;
+    if (sim.run_tail != NULL)
+    {
+        sim.run_tail->next = t;
+    }
+    else
+    {
+        sim.run_head = t;
+    }
+    sim.run_tail = t;
+}
+
+/**
+ *  @brief Wake the thread waiting on a file descriptor
+ *
+ *  @param[in,out] f Pointer to a simulated file descriptor
+ */
+static void coap_sim_notify(coap_sim_fd_t *f)
+{
+    if ((f->waiter != NULL) && (f->waiter->gen == f->waiter_gen))
+    {
+        coap_sim_make_runnable(f->waiter);
+    }
+    f->waiter = NULL;
+}
+
+/**
+ *  @brief Deliver a datagram to the socket bound to its destination address
+ *
+ *  @param[in] dgram Pointer to a datagram structure
+ */
+static void coap_sim_deliver(coap_sim_dgram_t *dgram)
+{
+    coap_sim_fd_t *f = NULL;
+
+    f = coap_sim_lookup(&dgram->dst);
+    if ((f == NULL)
+     || ((f->connected) && (!coap_sim_addr_match(&f->peer, &dgram->src, 0))))
+    {
+        sim.stats.num_unreachable++;
+        free(dgram);
+        return;
+    }
+    if (f->num_dgrams >= COAP_SIM_RCVBUF_MAX)
+    {
+        sim.stats.num_overflow++;
+        free(dgram);
+        return;
+    }
+    dgram->next = NULL;
+    if (f->tail != NULL)
+    {
+        f->tail->next = dgram;
+    }
+    else
+    {
+        f->head = dgram;
+    }
+    f->tail = dgram;
+    f->num_dgrams++;
+    sim.stats.num_delivered++;
+    coap_sim_notify(f);
+}
+
+/**
+ *  @brief Process an event
+ *
+ *  @param[in] ev Pointer to the event
+ */
+static void coap_sim_process(coap_sim_ev_t *ev)
+{
+    coap_sim_thread_t *t = NULL;
+    coap_sim_fd_t *f = NULL;
+
+    sim.now = ev->time;
+    sim.stats.num_events++;
+    switch (ev->type)
+    {
+    case COAP_SIM_EV_DELIVER:
+        coap_sim_deliver((coap_sim_dgram_t *)ev->ptr);
+        break;
+    case COAP_SIM_EV_TIMER:
+        f = coap_sim_fd_get(ev->fd);
+        if ((f != NULL) && (f->type == COAP_SIM_FD_TIMER) && (f->timer_gen == ev->gen))
+        {
+            f->expired = 1;
+            coap_sim_notify(f);
+        }
+        break;
+    case COAP_SIM_EV_WAKE:
+        t = (coap_sim_thread_t *)ev->ptr;
+        if (t->gen == ev->gen)
+        {
+            coap_sim_make_runnable(t);
+        }
+        break;
+    }
+}
+
+/**
+ *  @brief Choose the next thread to run
+ *
+ *  Events are processed in time order until a thread
+ *  becomes runnable.
+ *
+ *  @returns Pointer to a simulated thread structure or NULL
+ */
+static coap_sim_thread_t *coap_sim_next(void)
+{
+    coap_sim_thread_t *t = NULL;
+    coap_sim_ev_t ev = {0};
+
+    while ((sim.run_head == NULL) && (sim.num_ev > 0))
+    {
+        coap_sim_ev_pop(&ev);
+        coap_sim_process(&ev);
+    }
+    if ((sim.run_head == NULL) && (sim.main != NULL) && (sim.main->sleeping))
+    {
+        /* nothing can happen any more so let the main thread find out */
+        sim.deadlock = 1;
+        coap_sim_make_runnable(sim.main);
+    }
+    t = sim.run_head;
+    if (t != NULL)
+    {
+        sim.run_head = t->next;
+        if (sim.run_head == NULL)
+        {
+            sim.run_tail = NULL;
+        }
+        t->next = NULL;
+    }
+    return t;
+}
+
+/**
+ *  @brief Free the stack of a thread that has returned
+ *
+ *  A thread cannot free the stack it is running on so the
+ *  next thread to run does it.
+ */
+static void coap_sim_reap(void)
+{
+    if (sim.exited != NULL)
+    {
+        munmap(sim.exited->stack, COAP_SIM_STACK_SIZE);
+        sim.exited->stack = NULL;
+        sim.exited = NULL;
+    }
+}
+
+/**
+ *  @brief Block the calling thread and run others until it is woken
+ *
+ *  @param[in,out] self Pointer to the calling thread's structure
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval -EDEADLK No thread can ever run again
+ */
+static int coap_sim_block(coap_sim_thread_t *self)
+{
+    coap_sim_thread_t *next = NULL;
+
+    next = coap_sim_next();
+    if (next == NULL)
+    {
+        coap_log_error("Simulation deadlock at %llu nsec", (unsigned long long)sim.now);
+        return -EDEADLK;
+    }
+    if (next != self)
+    {
+        sim.current = next;
+        sim.stats.num_switches++;
+        swapcontext(&self->ctx, &next->ctx);
+        coap_sim_reap();
+    }
+    if (sim.deadlock)
+    {
+        sim.deadlock = 0;
+        return -EDEADLK;
+    }
+    return 0;
+}
+
+/**
+ *  @brief Entry point of simulated threads
+ *
+ *  Runs the thread function on the thread's own stack
+ *  and passes control to the next thread when it returns.
+ */
+static void coap_sim_thread_func(void)
+{
+    coap_sim_thread_t *self = sim.current;
+    coap_sim_thread_t *next = NULL;
+
+    coap_sim_reap();
+
+    (*self->func)(self->data);
+
+    /* pending wake-ups may still refer to this structure so it is not freed */
+    self->gen++;
+    next = coap_sim_next();
+    if (next == NULL)
+    {
+        /* nothing can happen any more so let the main thread find out */
+        coap_log_error("Simulation deadlock at %llu nsec", (unsigned long long)sim.now);
+        sim.deadlock = 1;
+        next = sim.main;
+    }
+    sim.current = next;
+    sim.stats.num_switches++;
+    sim.exited = self;
+    setcontext(&next->ctx);
+}
+
+int coap_sim_init(unsigned seed)
+{
+    coap_sim_thread_t *self = NULL;
+
+    self = calloc(1, sizeof(coap_sim_thread_t));
+    if (self == NULL)
+    {
+        return -ENOMEM;
+    }
+    sim.now = COAP_SIM_START_NS;
+    sim.rand = ((uint64_t)seed << 32) | 0x9e3779b9u;
+    sim.lib_rand = seed;
+    sim.main = self;
+    sim.current = self;
+    return 0;
+}
+
+void coap_sim_set_link(double loss, unsigned delay_us, unsigned jitter_us)
+{
+    sim.loss = loss;
+    sim.delay_ns = (uint64_t)delay_us * 1000;
+    sim.jitter_ns = (uint64_t)(jitter_us < delay_us ? jitter_us : delay_us) * 1000;
+}
+
+int coap_sim_thread_create(void *(*func)(void *), void *data)
+{
+    coap_sim_thread_t *t = NULL;
+
+    t = calloc(1, sizeof(coap_sim_thread_t));
+    if (t == NULL)
+    {
+        return -ENOMEM;
+    }
+    /* the pages of the stack are only committed when they are touched */
+    t->stack = mmap(NULL, COAP_SIM_STACK_SIZE, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    if (t->stack == MAP_FAILED)
+    {
+        free(t);
+        return -ENOMEM;
+    }
+    getcontext(&t->ctx);
+    t->ctx.uc_stack.ss_sp = t->stack;
+    t->ctx.uc_stack.ss_size = COAP_SIM_STACK_SIZE;
+    t->ctx.uc_link = NULL;
+    makecontext(&t->ctx, coap_sim_thread_func, 0);
+    t->func = func;
+    t->data = data;
+    coap_sim_make_runnable(t);
+    return 0;
+}
+
+int coap_sim_sleep(unsigned ms)
+{
+    coap_sim_thread_t *self = sim.current;
+    coap_sim_ev_t ev = {0};
+    int ret = 0;
+
+    ev.time = sim.now + (uint64_t)ms * 1000000;
+    ev.type = COAP_SIM_EV_WAKE;
+    ev.ptr = self;
+    ev.gen = self->gen;
+    ret = coap_sim_ev_push(&ev);
+    if (ret == 0)
+    {
+        self->sleeping = 1;
+        ret = coap_sim_block(self);
+        self->sleeping = 0;
+    }
+    return ret;
+}
+
+uint64_t coap_sim_get_time(void)
+{
+    uint64_t now = 0;
+
+    now = sim.now;
+    return now;
+}
+
+int coap_sim_rand(void)
+{
+    int ret = 0;
+
+    ret = rand_r(&sim.lib_rand);
+    return ret;
+}
+
+void coap_sim_srand(unsigned seed)
+{
+    /* the seed given to coap_sim_init is kept so that runs are reproducible */
+}
+
+void coap_sim_get_stats(coap_sim_stats_t *stats)
+{
+    *stats = sim.stats;
+}
+
+int coap_sim_socket(int domain, int type, int protocol)
+{
+    coap_sim_fd_t *f = NULL;
+    int fd = 0;
+
+    if (((domain != AF_INET) && (domain != AF_INET6)) || ((type & 0xff) != SOCK_DGRAM))
+    {
+        errno = EAFNOSUPPORT;
+        return -1;
+    }
+    fd = coap_sim_fd_new(COAP_SIM_FD_SOCK);
+    if (fd >= 0)
+    {
+        f = coap_sim_fd_get(fd);
+        f->family = domain;
+    }
+    if (fd < 0)
+    {
+        errno = -fd;
+        return -1;
+    }
+    return fd;
+}
+
+int coap_sim_bind(int sd, const struct sockaddr *addr, socklen_t addr_len)
+{
+    coap_sim_fd_t *f = NULL;
+    int ret = 0;
+
+    f = coap_sim_fd_get(sd);
+    if ((f == NULL) || (f->type != COAP_SIM_FD_SOCK))
+    {
+        ret = -ENOTSOCK;
+    }
+    else if ((f->bound) || (addr->sa_family != f->family) || (addr_len > sizeof(f->local)))
+    {
+        ret = -EINVAL;
+    }
+    else
+    {
+        ret = coap_sim_do_bind(f, addr, addr_len);
+    }
+    if (ret < 0)
+    {
+        errno = -ret;
+        return -1;
+    }
+    return 0;
+}
+
+int coap_sim_connect(int sd, const struct sockaddr *addr, socklen_t addr_len)
+{
+    coap_sim_fd_t *f = NULL;
+    int ret = 0;
+
+    f = coap_sim_fd_get(sd);
+    if ((f == NULL) || (f->type != COAP_SIM_FD_SOCK))
+    {
+        ret = -ENOTSOCK;
+    }
+    else if ((addr->sa_family != f->family) || (addr_len > sizeof(f->peer)))
+    {
+        ret = -EINVAL;
+    }
+    else if (!f->bound)
+    {
+        ret = coap_sim_autobind(f);
+    }
+    if (ret == 0)
+    {
+        memset(&f->peer, 0, sizeof(f->peer));
+        memcpy(&f->peer, addr, addr_len);
+        f->peer_len = addr_len;
+        f->connected = 1;
+    }
+    if (ret < 0)
+    {
+        errno = -ret;
+        return -1;
+    }
+    return 0;
+}
+
+int coap_sim_setsockopt(int sd, int level, int name, const void *val, socklen_t len)
+{
+    if (sd < COAP_SIM_FD_BASE)
+    {
+        return setsockopt(sd, level, name, val, len);
+    }
+    return 0;
+}
+
+int coap_sim_fcntl(int fd, int cmd, ...)
+{
+    va_list ap;
+    long arg = 0;
+
+    va_start(ap, cmd);
+    arg = va_arg(ap, long);
+    va_end(ap);
+    if (fd < COAP_SIM_FD_BASE)
+    {
+        return fcntl(fd, cmd, arg);
+    }
+    /* simulated file descriptors never block */
+    if (cmd == F_GETFL)
+    {
+        return O_RDWR | O_NONBLOCK;
+    }
+    return 0;
+}
+
+int coap_sim_close(int fd)
+{
+    coap_sim_dgram_t *dgram = NULL;
+    coap_sim_fd_t **pp = NULL;
+    coap_sim_fd_t *f = NULL;
+
+    if (fd < COAP_SIM_FD_BASE)
+    {
+        return close(fd);
+    }
+    f = coap_sim_fd_get(fd);
+    if (f == NULL)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    if (f->bound)
+    {
+        for (pp = &sim.buckets[coap_sim_hash(&f->local)]; *pp != NULL; pp = &(*pp)->hash_next)
+        {
+            if (*pp == f)
+            {
+                *pp = f->hash_next;
+                break;
+            }
+        }
+    }
+    while (f->head != NULL)
+    {
+        dgram = f->head;
+        f->head = dgram->next;
+        free(dgram);
+    }
+    free(f);
+    sim.fds[fd - COAP_SIM_FD_BASE] = NULL;
+    sim.free_fds[sim.num_free_fds++] = fd - COAP_SIM_FD_BASE;
+    return 0;
+}
+
+ssize_t coap_sim_sendto(int sd, const void *buf, size_t len, int flags, const struct sockaddr *addr, socklen_t addr_len)
+{
+    coap_sim_dgram_t *dgram = NULL;
+    coap_sim_fd_t *f = NULL;
+    coap_sim_ev_t ev = {0};
+    int ret = 0;
+
+    f = coap_sim_fd_get(sd);
+    if ((f == NULL) || (f->type != COAP_SIM_FD_SOCK))
+    {
+        ret = -ENOTSOCK;
+        goto out;
+    }
+    if (addr == NULL)
+    {
+        if (!f->connected)
+        {
+            ret = -EDESTADDRREQ;
+            goto out;
+        }
+        addr = (const struct sockaddr *)&f->peer;
+        addr_len = f->peer_len;
+    }
+    if ((addr->sa_family != f->family) || (addr_len > sizeof(struct sockaddr_storage)))
+    {
+        ret = -EINVAL;
+        goto out;
+    }
+    if (!f->bound)
+    {
+        ret = coap_sim_autobind(f);
+        if (ret < 0)
+        {
+            goto out;
+        }
+    }
+    sim.stats.num_sent++;
+    if (coap_sim_link_rand() < sim.loss)
+    {
+        sim.stats.num_lost++;
+        goto out;
+    }
+    dgram = calloc(1, sizeof(coap_sim_dgram_t) + len);
+    if (dgram == NULL)
+    {
+        ret = -ENOMEM;
+        goto out;
+    }
+    memcpy(&dgram->src, &f->local, f->local_len);
+    dgram->src_len = f->local_len;
+    coap_sim_set_src(&dgram->src);
+    memcpy(&dgram->dst, addr, addr_len);
+    dgram->dst_len = addr_len;
+    dgram->len = len;
+    memcpy(dgram->buf, buf, len);
+    ev.time = sim.now + sim.delay_ns - sim.jitter_ns;
+    if (sim.jitter_ns != 0)
+    {
+        ev.time += (uint64_t)(coap_sim_link_rand() * 2.0 * sim.jitter_ns);
+    }
+    ev.type = COAP_SIM_EV_DELIVER;
+    ev.ptr = dgram;
+    ret = coap_sim_ev_push(&ev);
+    if (ret < 0)
+    {
+        free(dgram);
+    }
+out:
+    if (ret < 0)
+    {
+        errno = -ret;
+        return -1;
+    }
+    return len;
+}
+
+ssize_t coap_sim_send(int sd, const void *buf, size_t len, int flags)
+{
+    return coap_sim_sendto(sd, buf, len, flags, NULL, 0);
+}
+
+ssize_t coap_sim_recvfrom(int sd, void *buf, size_t len, int flags, struct sockaddr *addr, socklen_t *addr_len)
+{
+    coap_sim_dgram_t *dgram = NULL;
+    coap_sim_fd_t *f = NULL;
+    ssize_t num = 0;
+
+    f = coap_sim_fd_get(sd);
+    if ((f == NULL) || (f->type != COAP_SIM_FD_SOCK))
+    {
+        errno = ENOTSOCK;
+        return -1;
+    }
+    dgram = f->head;
+    if (dgram == NULL)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    num = dgram->len < len ? dgram->len : len;
+    memcpy(buf, dgram->buf, num);
+    if ((addr != NULL) && (addr_len != NULL))
+    {
+        memcpy(addr, &dgram->src, *addr_len < dgram->src_len ? *addr_len : dgram->src_len);
+        *addr_len = dgram->src_len;
+    }
+    if (!(flags & MSG_PEEK))
+    {
+        f->head = dgram->next;
+        if (f->head == NULL)
+        {
+            f->tail = NULL;
+        }
+        f->num_dgrams--;
+        free(dgram);
+    }
+    return num;
+}
+
+ssize_t coap_sim_recv(int sd, void *buf, size_t len, int flags)
+{
+    return coap_sim_recvfrom(sd, buf, len, flags, NULL, NULL);
+}
+
+int coap_sim_timerfd_create(int clock_id, int flags)
+{
+    int fd = 0;
+
+    fd = coap_sim_fd_new(COAP_SIM_FD_TIMER);
+    if (fd < 0)
+    {
+        errno = -fd;
+        return -1;
+    }
+    return fd;
+}
+
+int coap_sim_timerfd_settime(int fd, int flags, const struct itimerspec *new_value, struct itimerspec *old_value)
+{
+    coap_sim_fd_t *f = NULL;
+    coap_sim_ev_t ev = {0};
+    uint64_t value = 0;
+    int ret = 0;
+
+    f = coap_sim_fd_get(fd);
+    if ((f == NULL) || (f->type != COAP_SIM_FD_TIMER))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (old_value != NULL)
+    {
+        memset(old_value, 0, sizeof(*old_value));
+    }
+    /* disarm, any pending expiry event now carries a stale generation */
+    f->timer_gen = sim.seq;
+    f->expired = 0;
+    value = (uint64_t)new_value->it_value.tv_sec * 1000000000ull + new_value->it_value.tv_nsec;
+    if (value != 0)
+    {
+        ev.time = (flags & TFD_TIMER_ABSTIME) ? value : sim.now + value;
+        ev.type = COAP_SIM_EV_TIMER;
+        ev.fd = fd;
+        ev.gen = f->timer_gen;
+        ret = coap_sim_ev_push(&ev);
+    }
+    if (ret < 0)
+    {
+        errno = -ret;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ *  @brief Check which file descriptors in a set are readable
+ *
+ *  @param[in] read_fds Pointer to the set to be checked
+ *  @param[out] ready Pointer to a set to receive the readable file descriptors
+ *
+ *  @returns Number of readable file descriptors
+ */
+static int coap_sim_ready(const coap_sim_fd_set_t *read_fds, coap_sim_fd_set_t *ready)
+{
+    coap_sim_fd_t *f = NULL;
+    unsigned i = 0;
+
+    ready->num = 0;
+    for (i = 0; i < read_fds->num; i++)
+    {
+        f = coap_sim_fd_get(read_fds->fd[i]);
+        if (f == NULL)
+        {
+            continue;
+        }
+        if (((f->type == COAP_SIM_FD_SOCK) && (f->head != NULL))
+         || ((f->type == COAP_SIM_FD_TIMER) && (f->expired)))
+        {
+            ready->fd[ready->num++] = read_fds->fd[i];
+        }
+    }
+    return ready->num;
+}
+
+int coap_sim_select(int nfds, coap_sim_fd_set_t *read_fds, coap_sim_fd_set_t *write_fds, coap_sim_fd_set_t *except_fds, struct timeval *timeout)
+{
+    coap_sim_thread_t *self = sim.current;
+    coap_sim_fd_set_t ready = {{0}};
+    coap_sim_fd_t *f = NULL;
+    coap_sim_ev_t ev = {0};
+    unsigned i = 0;
+    int ret = 0;
+
+    /* only read sets are supported */
+    if (write_fds != NULL)
+    {
+        write_fds->num = 0;
+    }
+    if (except_fds != NULL)
+    {
+        except_fds->num = 0;
+    }
+    if (read_fds == NULL)
+    {
+        read_fds = &ready;
+    }
+    ret = coap_sim_ready(read_fds, &ready);
+    if ((ret == 0)
+     && ((timeout == NULL) || (timeout->tv_sec != 0) || (timeout->tv_usec != 0)))
+    {
+        for (i = 0; i < read_fds->num; i++)
+        {
+            f = coap_sim_fd_get(read_fds->fd[i]);
+            if (f != NULL)
+            {
+                f->waiter = self;
+                f->waiter_gen = self->gen;
+            }
+        }
+        if (timeout != NULL)
+        {
+            ev.time = sim.now + (uint64_t)timeout->tv_sec * 1000000000ull + (uint64_t)timeout->tv_usec * 1000;
+            ev.type = COAP_SIM_EV_WAKE;
+            ev.ptr = self;
+            ev.gen = self->gen;
+            ret = coap_sim_ev_push(&ev);
+        }
+        if (ret == 0)
+        {
+            ret = coap_sim_block(self);
+        }
+        if (ret < 0)
+        {
+            self->gen++;
+            errno = -ret;
+            return -1;
+        }
+        ret = coap_sim_ready(read_fds, &ready);
+    }
+    *read_fds = ready;
+    return ret;
+}
+
+void coap_sim_fd_zero(coap_sim_fd_set_t *set)
+{
+    set->num = 0;
+}
+
+void coap_sim_fd_set(int fd, coap_sim_fd_set_t *set)
+{
+    unsigned i = 0;
+
+    for (i = 0; i < set->num; i++)
+    {
+        if (set->fd[i] == fd)
+        {
+            return;
+        }
+    }
+    if (set->num < COAP_SIM_FD_SET_MAX)
+    {
+        set->fd[set->num++] = fd;
+    }
+}
+
+int coap_sim_fd_isset(int fd, const coap_sim_fd_set_t *set)
+{
+    unsigned i = 0;
+
+    for (i = 0; i < set->num; i++)
+    {
+        if (set->fd[i] == fd)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int coap_sim_clock_gettime(clockid_t clock_id, struct timespec *ts)
+{
+    uint64_t now = 0;
+
+    now = coap_sim_get_time();
+    if ((clock_id == CLOCK_REALTIME) || (clock_id == CLOCK_REALTIME_COARSE))
+    {
+        now += (uint64_t)COAP_SIM_EPOCH * 1000000000ull - COAP_SIM_START_NS;
+    }
+    ts->tv_sec = now / 1000000000ull;
+    ts->tv_nsec = now % 1000000000ull;
+    return 0;
+}
+
+time_t coap_sim_time(time_t *t)
+{
+    time_t now = 0;
+
+    now = COAP_SIM_EPOCH + (coap_sim_get_time() - COAP_SIM_START_NS) / 1000000000ull;
+    if (t != NULL)
+    {
+        *t = now;
+    }
+    return now;
+}
@@ -34,9 +34,18 @@
 #ifndef CONFIG_H
 #define CONFIG_H
 
+#define CONFIG_MAX_SECTIONS  256   /* maximum number of sections */
+#define CONFIG_MAX_ENTRIES   4096  /* maximum number of entries in all sections */
+#define CONFIG_NUM_BUCKETS   1024  /* number of buckets in the entry hash table */
+
 #define config_get_first_entry(config)  ((config)->first)
 #define config_get_last_entry(config)   ((config)->last)
 
+#define config_get_first_section(config)         ((config)->first)
+#define config_section_get_name(section)         ((section)->name)
+#define config_section_get_first_entry(section)  ((section)->first)
+#define config_section_get_next(section)         ((section)->next)
+
 #define config_entry_get_name(entry)   ((entry)->name)
 #define config_entry_get_value(entry)  ((entry)->value)
 #define config_entry_get_next(entry)   ((entry)->next)
@@ -48,7 +57,8 @@ typedef enum
     CONFIG_EINVAL = -1,    /* invalid argument */
     CONFIG_ENOMEM = -2,    /* no (dynamic) memory */
     CONFIG_ELEXICAL = -3,  /* lexical error */
-    CONFIG_ESYNTAX = -4    /* syntax error */
+    CONFIG_ESYNTAX = -4,   /* syntax error */
+    CONFIG_ELIMIT = -5     /* too many sections or entries */
 }
 config_error_t;
 
@@ -57,6 +67,8 @@ typedef struct config_entry_t
     char *name;
     char *value;
     struct config_entry_t *next;
+    struct config_entry_t *hash_next;       /* next entry in the same hash bucket */
+    struct config_section_t *section;       /* section that holds the entry */
 }
 config_entry_t;
 
@@ -73,6 +85,9 @@ typedef struct
 {
     config_section_t *first;
     config_section_t *last;
+    config_entry_t *bucket[CONFIG_NUM_BUCKETS];
+    unsigned num_sections;
+    unsigned num_entries;
 }
 config_t;
 
@@ -34,6 +34,9 @@
 #ifndef DATA_BUF_H
 #define DATA_BUF_H
 
+#include <stddef.h>
+#include "lock.h"
+
 /*   0                      count     size
  *   |                        |         |
  *   +------------------------+---------+
@@ -62,10 +65,25 @@ typedef struct
 }
 data_buf_t;
 
+/* buffers of one size kept for reuse by data_buf_pool_get */
+typedef struct
+{
+    size_t size;      /* size of each pooled buffer */
+    unsigned max;     /* max number of pooled buffers */
+    unsigned num;     /* number of pooled buffers */
+    char **data;      /* array of pooled buffers */
+    lock_t lock;
+}
+data_buf_pool_t;
+
 int data_buf_create(data_buf_t *buf, size_t size, size_t max_size);
 void data_buf_destroy(data_buf_t *buf);
 int data_buf_expand(data_buf_t *buf);
 size_t data_buf_add(data_buf_t *buf, size_t num);
 size_t data_buf_consume(data_buf_t *buf, size_t num);
+int data_buf_pool_create(data_buf_pool_t *pool, size_t size, unsigned max);
+void data_buf_pool_destroy(data_buf_pool_t *pool);
+int data_buf_pool_get(data_buf_pool_t *pool, data_buf_t *buf, size_t max_size);
+void data_buf_pool_put(data_buf_pool_t *pool, data_buf_t *buf);
 
 #endif
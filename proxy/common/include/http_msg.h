@@ -38,6 +38,8 @@
 #include <sys/types.h>
 
 #define HTTP_MSG_NUM_START  3                                                   /**< Number of fields in the start line */
+#define HTTP_MSG_MAX_HEADERS  100                                               /**< Maximum number of headers and trailers in a message */
+#define HTTP_MSG_MAX_CHUNKS   1024                                              /**< Maximum number of chunks in a message body */
 
 #define http_msg_header_get_name(header)   ((header)->name)                     /**< Get the name of a message header */
 #define http_msg_header_get_value(header)  ((header)->value)                    /**< Get the value of a message header */
@@ -66,6 +68,7 @@ typedef struct
 {
     http_msg_header_t *first;                                                   /**< First message header */
     http_msg_header_t *last;                                                    /**< Last message header */
+    unsigned num;                                                               /**< Number of message headers */
 }
 http_msg_list_t;
 
@@ -81,6 +84,40 @@ typedef struct
 }
 http_msg_t;
 
+/**
+ *  @brief Message scanner state enumeration
+ */
+typedef enum
+{
+    HTTP_MSG_SCAN_START = 0,                                                    /**< Reading the start line */
+    HTTP_MSG_SCAN_HEADERS,                                                      /**< Reading the headers */
+    HTTP_MSG_SCAN_BODY,                                                         /**< Reading a body with a Content-Length header */
+    HTTP_MSG_SCAN_CHUNK_SIZE,                                                   /**< Reading a chunk-size line */
+    HTTP_MSG_SCAN_CHUNK_DATA,                                                   /**< Reading chunk data and the line break that follows it */
+    HTTP_MSG_SCAN_TRAILERS,                                                     /**< Reading the trailers */
+    HTTP_MSG_SCAN_DONE                                                          /**< The message is complete */
+}
+http_msg_scan_state_t;
+
+/**
+ *  @brief Message scanner structure
+ *
+ *  Finds the end of a message that arrives in pieces without
+ *  looking at any byte more than once.
+ */
+typedef struct
+{
+    http_msg_scan_state_t state;                                                /**< Current state */
+    size_t line;                                                                /**< Offset of the start of the current line */
+    size_t pos;                                                                 /**< Offset up to which the buffer has been searched */
+    size_t remain;                                                              /**< Number of body or chunk bytes still to come */
+    size_t content_len;                                                         /**< Value of the Content-Length header */
+    unsigned num_headers;                                                       /**< Number of headers and trailers seen */
+    unsigned num_chunks;                                                        /**< Number of chunks seen */
+    int chunked;                                                                /**< Indicates whether or not the body is chunked */
+}
+http_msg_scan_t;
+
 /**
  *  @brief Convert an error code to a string representation
  *
@@ -114,6 +151,10 @@ void http_msg_reset(http_msg_t *msg);
 /**
  *  @brief Parse a message
  *
+ *  The time taken is linear in the length of the message.
+ *  A message may have at most HTTP_MSG_MAX_HEADERS headers
+ *  and trailers and at most HTTP_MSG_MAX_CHUNKS chunks.
+ *
  *  @param[out] msg Pointer to a message structure
  *  @param[in] buf Pointer to a buffer containing the message
  *  @param[in] len Length of the buffer containing the message
@@ -124,6 +165,33 @@ void http_msg_reset(http_msg_t *msg);
  */
 ssize_t http_msg_parse(http_msg_t *msg, const char *buf, size_t len);
 
+/**
+ *  @brief Initialise a message scanner structure
+ *
+ *  @param[out] scan Pointer to a message scanner structure
+ */
+void http_msg_scan_create(http_msg_scan_t *scan);
+
+/**
+ *  @brief Find the end of a message
+ *
+ *  The buffer must hold the same data as on the previous call
+ *  for this scanner, followed by any data that has arrived
+ *  since. Only the new data is examined, so a message that
+ *  arrives in many pieces is scanned in linear time. Once the
+ *  end is found, the message can be parsed with http_msg_parse.
+ *
+ *  @param[in,out] scan Pointer to a message scanner structure
+ *  @param[in] buf Pointer to a buffer containing the message
+ *  @param[in] len Length of the buffer containing the message
+ *
+ *  @returns Length of the message or error code
+ *  @retval >0 Length of the message
+ *  @retval -EAGAIN The message is incomplete
+ *  @retval -EBADMSG The message is badly formatted or exceeds a limit
+ */
+ssize_t http_msg_scan(http_msg_scan_t *scan, const char *buf, size_t len);
+
 /**
  *  @brief Set the start line in a message
  *
@@ -29,20 +29,140 @@
  *  @file lock.h
  *
  *  @brief Include file for the FreeCoAP lock module
+ *
+ *  lock_t is an error checking mutex. lock_rw_t is a reader-writer
+ *  lock, lock_spin_t is a mutex that spins for an adaptive number
+ *  of attempts before blocking and lock_shard_t is an array of
+ *  lock_t selected by a key.
+ *
+ *  When LOCK_PROF is defined, every lock counts its acquisitions
+ *  and contended acquisitions and keeps histograms of the time
+ *  spent waiting for and holding it. Locks created with the same
+ *  name share one record, lock_prof_log writes all of the records
+ *  to the log. The name given to lock_create and friends is the
+ *  text of the argument, e.g. "&stats.lock".
  */
 
 #ifndef LOCK_H
 #define LOCK_H
 
+#include <errno.h>
 #include <pthread.h>
+#ifdef LOCK_PROF
+#include <stdint.h>
+#include <time.h>
+#endif
+
+#define LOCK_SPIN_MAX            100                                            /* maximum number of attempts to get a spin lock before blocking */
+#define LOCK_NUM_SHARDS          16                                             /* number of locks in a sharded lock */
+#define LOCK_CACHE_LINE_LEN      64
+#define LOCK_PROF_NUM_BUCKETS    16                                             /* bucket 0 is below 1 usec, bucket i is [2^(i-1), 2^i) usec, the last bucket is open */
+
+#define lock_create(lock)        lock_create_named(lock, #lock)
+#define lock_rw_create(lock)     lock_rw_create_named(lock, #lock)
+#define lock_spin_create(lock)   lock_spin_create_named(lock, #lock)
+#define lock_shard_create(lock)  lock_shard_create_named(lock, #lock)
+
+#if defined(__x86_64__) || defined(__i386__)
+#define lock_cpu_relax()         __builtin_ia32_pause()
+#elif defined(__aarch64__) || (defined(__arm__) && defined(__ARM_ARCH_7A__))
+#define lock_cpu_relax()         __asm__ __volatile__("yield" ::: "memory")
+#else
+#define lock_cpu_relax()         __asm__ __volatile__("" ::: "memory")
+#endif
+
+#ifdef LOCK_PROF
+
+typedef struct lock_prof
+{
+    const char *name;
+    unsigned long num_get;                                                      /* acquisitions */
+    unsigned long num_contended;                                                /* acquisitions that had to wait */
+    uint64_t wait_ns;                                                           /* total time spent waiting */
+    uint64_t hold_ns;                                                           /* total time held */
+    unsigned long wait_hist[LOCK_PROF_NUM_BUCKETS];
+    unsigned long hold_hist[LOCK_PROF_NUM_BUCKETS];
+    struct lock_prof *next;
+}
+lock_prof_t;
+
+lock_prof_t *lock_prof_get(const char *name);
+void lock_prof_log(void);
+
+static inline uint64_t lock_prof_now(void)
+{
+    struct timespec ts = {0};
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline unsigned lock_prof_bucket(uint64_t ns)
+{
+    uint64_t us = ns / 1000;
+    unsigned i = 0;
+
+    if (us == 0)
+    {
+        return 0;
+    }
+    i = 64 - __builtin_clzll(us);
+    return i < LOCK_PROF_NUM_BUCKETS ? i : LOCK_PROF_NUM_BUCKETS - 1;
+}
+
+/* records are shared by every lock with the same name so they are updated atomically */
+static inline void lock_prof_add_get(lock_prof_t *prof, int contended, uint64_t wait_ns)
+{
+    if (prof == NULL)
+    {
+        return;
+    }
+    __atomic_fetch_add(&prof->num_get, 1, __ATOMIC_RELAXED);
+    if (contended)
+    {
+        __atomic_fetch_add(&prof->num_contended, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&prof->wait_ns, wait_ns, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&prof->wait_hist[lock_prof_bucket(wait_ns)], 1, __ATOMIC_RELAXED);
+}
 
-typedef pthread_mutex_t lock_t;
+static inline void lock_prof_add_hold(lock_prof_t *prof, uint64_t hold_ns)
+{
+    if (prof == NULL)
+    {
+        return;
+    }
+    __atomic_fetch_add(&prof->hold_ns, hold_ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&prof->hold_hist[lock_prof_bucket(hold_ns)], 1, __ATOMIC_RELAXED);
+}
+
+#else  /* !LOCK_PROF */
+
+#define lock_prof_log()
+
+#endif  /* LOCK_PROF */
+
+/* lock_t */
+
+typedef struct
+{
+    pthread_mutex_t mutex;
+#ifdef LOCK_PROF
+    lock_prof_t *prof;
+    uint64_t get_ns;                                                            /* time at which the lock was acquired */
+#endif
+}
+lock_t;
 
-static inline int lock_create(lock_t *lock)
+static inline int lock_create_named(lock_t *lock, const char *name)
 {
     pthread_mutexattr_t attr;
     int ret = 0;
 
+#ifdef LOCK_PROF
+    lock->prof = lock_prof_get(name);
+    lock->get_ns = 0;
+#endif
     ret = pthread_mutexattr_init(&attr);
     if (ret != 0)
     {
@@ -54,7 +174,7 @@ static inline int lock_create(lock_t *lock)
         pthread_mutexattr_destroy(&attr);
         return -1;
     }
-    ret = pthread_mutex_init(lock, &attr);
+    ret = pthread_mutex_init(&lock->mutex, &attr);
     if (ret != 0)
     {
         pthread_mutexattr_destroy(&attr);
@@ -70,26 +190,232 @@ static inline int lock_create(lock_t *lock)
 
 static inline void lock_destroy(lock_t *lock)
 {
-    pthread_mutex_destroy(lock);
+    pthread_mutex_destroy(&lock->mutex);
 }
 
 static inline int lock_get(lock_t *lock)
 {
     int ret = 0;
+#ifdef LOCK_PROF
+    uint64_t start = 0;
+    int contended = 0;
 
-    ret = pthread_mutex_lock(lock);
+    ret = pthread_mutex_trylock(&lock->mutex);
+    if (ret == EBUSY)
+    {
+        contended = 1;
+        start = lock_prof_now();
+        ret = pthread_mutex_lock(&lock->mutex);
+    }
     if (ret != 0)
     {
         return -1;
     }
+    lock->get_ns = lock_prof_now();
+    lock_prof_add_get(lock->prof, contended, contended ? lock->get_ns - start : 0);
+#else
+    ret = pthread_mutex_lock(&lock->mutex);
+    if (ret != 0)
+    {
+        return -1;
+    }
+#endif
     return 0;
 }
 
 static inline int lock_put(lock_t *lock)
+{
+    int ret = 0;
+#ifdef LOCK_PROF
+    uint64_t hold_ns = lock_prof_now() - lock->get_ns;
+#endif
+
+    ret = pthread_mutex_unlock(&lock->mutex);
+    if (ret != 0)
+    {
+        return -1;
+    }
+#ifdef LOCK_PROF
+    lock_prof_add_hold(lock->prof, hold_ns);
+#endif
+    return 0;
+}
+
+/* the time spent waiting on the condition is not counted as holding the lock */
+static inline int lock_cond_wait(pthread_cond_t *cond, lock_t *lock)
+{
+    int ret = 0;
+
+#ifdef LOCK_PROF
+    lock_prof_add_hold(lock->prof, lock_prof_now() - lock->get_ns);
+#endif
+    ret = pthread_cond_wait(cond, &lock->mutex);
+#ifdef LOCK_PROF
+    lock->get_ns = lock_prof_now();
+#endif
+    return ret;
+}
+
+static inline int lock_cond_timedwait(pthread_cond_t *cond, lock_t *lock, const struct timespec *abstime)
+{
+    int ret = 0;
+
+#ifdef LOCK_PROF
+    lock_prof_add_hold(lock->prof, lock_prof_now() - lock->get_ns);
+#endif
+    ret = pthread_cond_timedwait(cond, &lock->mutex, abstime);
+#ifdef LOCK_PROF
+    lock->get_ns = lock_prof_now();
+#endif
+    return ret;
+}
+
+/* lock_rw_t */
+
+typedef struct
+{
+    pthread_rwlock_t rwlock;
+#ifdef LOCK_PROF
+    lock_prof_t *prof;
+    uint64_t get_ns;                                                            /* time at which the writer acquired the lock */
+    int writer;                                                                 /* only the hold time of writers is recorded */
+#endif
+}
+lock_rw_t;
+
+static inline int lock_rw_create_named(lock_rw_t *lock, const char *name)
+{
+    int ret = 0;
+
+#ifdef LOCK_PROF
+    lock->prof = lock_prof_get(name);
+    lock->get_ns = 0;
+    lock->writer = 0;
+#endif
+    ret = pthread_rwlock_init(&lock->rwlock, NULL);
+    if (ret != 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+static inline void lock_rw_destroy(lock_rw_t *lock)
+{
+    pthread_rwlock_destroy(&lock->rwlock);
+}
+
+static inline int lock_rw_get_read(lock_rw_t *lock)
+{
+    int ret = 0;
+#ifdef LOCK_PROF
+    uint64_t start = 0;
+    int contended = 0;
+
+    ret = pthread_rwlock_tryrdlock(&lock->rwlock);
+    if (ret == EBUSY)
+    {
+        contended = 1;
+        start = lock_prof_now();
+        ret = pthread_rwlock_rdlock(&lock->rwlock);
+    }
+    if (ret != 0)
+    {
+        return -1;
+    }
+    lock_prof_add_get(lock->prof, contended, contended ? lock_prof_now() - start : 0);
+#else
+    ret = pthread_rwlock_rdlock(&lock->rwlock);
+    if (ret != 0)
+    {
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+static inline int lock_rw_get_write(lock_rw_t *lock)
+{
+    int ret = 0;
+#ifdef LOCK_PROF
+    uint64_t start = 0;
+    int contended = 0;
+
+    ret = pthread_rwlock_trywrlock(&lock->rwlock);
+    if (ret == EBUSY)
+    {
+        contended = 1;
+        start = lock_prof_now();
+        ret = pthread_rwlock_wrlock(&lock->rwlock);
+    }
+    if (ret != 0)
+    {
+        return -1;
+    }
+    lock->get_ns = lock_prof_now();
+    lock->writer = 1;
+    lock_prof_add_get(lock->prof, contended, contended ? lock->get_ns - start : 0);
+#else
+    ret = pthread_rwlock_wrlock(&lock->rwlock);
+    if (ret != 0)
+    {
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+static inline int lock_rw_put(lock_rw_t *lock)
+{
+    int ret = 0;
+#ifdef LOCK_PROF
+    uint64_t hold_ns = 0;
+    int writer = lock->writer;
+
+    if (writer)
+    {
+        hold_ns = lock_prof_now() - lock->get_ns;
+        lock->writer = 0;
+    }
+#endif
+
+    ret = pthread_rwlock_unlock(&lock->rwlock);
+    if (ret != 0)
+    {
+        return -1;
+    }
+#ifdef LOCK_PROF
+    if (writer)
+    {
+        lock_prof_add_hold(lock->prof, hold_ns);
+    }
+#endif
+    return 0;
+}
+
+/* lock_spin_t */
+
+typedef struct
+{
+    pthread_mutex_t mutex;
+    int spin;                                                                   /* moving average of the number of attempts that succeeded */
+#ifdef LOCK_PROF
+    lock_prof_t *prof;
+    uint64_t get_ns;                                                            /* time at which the lock was acquired */
+#endif
+}
+lock_spin_t;
+
+static inline int lock_spin_create_named(lock_spin_t *lock, const char *name)
 {
     int ret = 0;
 
-    ret = pthread_mutex_unlock(lock);
+#ifdef LOCK_PROF
+    lock->prof = lock_prof_get(name);
+    lock->get_ns = 0;
+#endif
+    lock->spin = 0;
+    ret = pthread_mutex_init(&lock->mutex, NULL);
     if (ret != 0)
     {
         return -1;
@@ -97,4 +423,129 @@ static inline int lock_put(lock_t *lock)
     return 0;
 }
 
+static inline void lock_spin_destroy(lock_spin_t *lock)
+{
+    pthread_mutex_destroy(&lock->mutex);
+}
+
+/* spin for up to twice the recent average number of attempts, like PTHREAD_MUTEX_ADAPTIVE_NP */
+static inline int lock_spin_get(lock_spin_t *lock)
+{
+    int max_spin = 0;
+    int ret = 0;
+    int i = 0;
+#ifdef LOCK_PROF
+    uint64_t start = 0;
+#endif
+
+    ret = pthread_mutex_trylock(&lock->mutex);
+    if (ret == EBUSY)
+    {
+#ifdef LOCK_PROF
+        start = lock_prof_now();
+#endif
+        max_spin = 2 * lock->spin + 10;
+        if (max_spin > LOCK_SPIN_MAX)
+        {
+            max_spin = LOCK_SPIN_MAX;
+        }
+        for (i = 1; i < max_spin; i++)
+        {
+            lock_cpu_relax();
+            ret = pthread_mutex_trylock(&lock->mutex);
+            if (ret != EBUSY)
+            {
+                break;
+            }
+        }
+        if (ret == EBUSY)
+        {
+            ret = pthread_mutex_lock(&lock->mutex);
+        }
+        if (ret == 0)
+        {
+            lock->spin += (i - lock->spin) / 8;
+        }
+    }
+    if (ret != 0)
+    {
+        return -1;
+    }
+#ifdef LOCK_PROF
+    lock->get_ns = lock_prof_now();
+    lock_prof_add_get(lock->prof, start != 0, start != 0 ? lock->get_ns - start : 0);
+#endif
+    return 0;
+}
+
+static inline int lock_spin_put(lock_spin_t *lock)
+{
+    int ret = 0;
+#ifdef LOCK_PROF
+    uint64_t hold_ns = lock_prof_now() - lock->get_ns;
+#endif
+
+    ret = pthread_mutex_unlock(&lock->mutex);
+    if (ret != 0)
+    {
+        return -1;
+    }
+#ifdef LOCK_PROF
+    lock_prof_add_hold(lock->prof, hold_ns);
+#endif
+    return 0;
+}
+
+/* lock_shard_t */
+
+typedef struct
+{
+    lock_t lock;
+}
+__attribute__((aligned(LOCK_CACHE_LINE_LEN))) lock_shard_entry_t;           /* one lock per cache line */
+
+typedef struct
+{
+    lock_shard_entry_t shard[LOCK_NUM_SHARDS];
+}
+lock_shard_t;
+
+static inline int lock_shard_create_named(lock_shard_t *lock, const char *name)
+{
+    unsigned i = 0;
+    int ret = 0;
+
+    for (i = 0; i < LOCK_NUM_SHARDS; i++)
+    {
+        ret = lock_create_named(&lock->shard[i].lock, name);
+        if (ret != 0)
+        {
+            while (i > 0)
+            {
+                lock_destroy(&lock->shard[--i].lock);
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static inline void lock_shard_destroy(lock_shard_t *lock)
+{
+    unsigned i = 0;
+
+    for (i = 0; i < LOCK_NUM_SHARDS; i++)
+    {
+        lock_destroy(&lock->shard[i].lock);
+    }
+}
+
+/* the same key always selects the same lock, which is then used with lock_get and lock_put */
+static inline lock_t *lock_shard_select(lock_shard_t *lock, unsigned long key)
+{
+    unsigned long long hash = (unsigned long long)key * 0x9e3779b97f4a7c15ull;
+
+    return &lock->shard[(hash >> 32) % LOCK_NUM_SHARDS].lock;
+}
+
 #endif
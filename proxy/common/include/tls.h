@@ -35,6 +35,7 @@
 #define TLS_H
 
 #include <stddef.h>         /* size_t */
+#include <time.h>           /* time_t */
 #include <gnutls/gnutls.h>
 #include "sock.h"           /* error codes */
 #include "lock.h"           /* lock_t */
@@ -47,9 +48,22 @@
 #define TLS_SERVER_MAX_SESSION_DATA_SIZE  2048
 #define TLS_SERVER_CACHE_SIZE               50
 #define TLS_SERVER_NUM_DH_BITS            1024
+#define TLS_SERVER_SNI_HASH_SIZE            64
+#define TLS_SERVER_MAX_NAME_LEN            256
+
+#define TLS_VERIFY_CACHE_SIZE               64
+#define TLS_VERIFY_CACHE_TTL               600  /* seconds */
+#define TLS_VERIFY_KEY_SIZE                 32  /* SHA-256 */
+
+#define TLS_SERVER_MAX_EARLY_DATA_SIZE   16384  /* TLS 1.3 0-RTT data accepted from a resuming client */
+#define TLS_REPLAY_CACHE_SIZE             1024  /* client hellos with early data remembered at once */
+#define TLS_REPLAY_WINDOW                10000  /* milliseconds, early data in an older client hello is rejected */
+#define TLS_REPLAY_KEY_SIZE                 32  /* SHA-256 */
 
 #define tls_client_get_cred(client)  ((client)->cred)
 #define tls_server_get_cred(server)  ((server)->cred)
+#define tls_server_get_ticket_key(server)  ((server)->ticket_key)
+#define tls_server_get_anti_replay(server)  ((server)->anti_replay)
 
 typedef struct
 {
@@ -67,6 +81,24 @@ typedef struct
 }
 tls_client_cache_t;
 
+/* peer certificates that passed verification, keyed on a hash
+ * of the end-entity certificate and the verification parameters
+ */
+typedef struct
+{
+    unsigned char key[TLS_VERIFY_KEY_SIZE];
+    time_t expire;
+}
+tls_verify_cache_element_t;
+
+typedef struct
+{
+    tls_verify_cache_element_t *element;
+    size_t size;
+    unsigned index;
+}
+tls_verify_cache_t;
+
 typedef struct
 {
     gnutls_certificate_credentials_t cred;
@@ -74,6 +106,7 @@ typedef struct
     gnutls_dh_params_t dh_params;
 #endif
     tls_client_cache_t cache;
+    tls_verify_cache_t verify_cache;
     lock_t lock;
 }
 tls_client_t;
@@ -95,11 +128,47 @@ typedef struct
 }
 tls_server_cache_t;
 
+/* client hellos that carried early data within the replay window,
+ * early data is rejected if a client hello is seen twice or if the
+ * cache is full of entries that have not yet left the window
+ */
+typedef struct
+{
+    unsigned char key[TLS_REPLAY_KEY_SIZE];
+    time_t expire;
+}
+tls_replay_cache_element_t;
+
+typedef struct
+{
+    tls_replay_cache_element_t *element;
+    size_t size;
+    unsigned index;  /* oldest entry */
+}
+tls_replay_cache_t;
+
+/* credentials selected by the server name indication (SNI) sent by the client */
+typedef struct tls_server_sni
+{
+    char *name;
+    gnutls_certificate_credentials_t cred;
+    struct tls_server_sni *next;
+}
+tls_server_sni_t;
+
+/* the SNI table is populated before the listeners are started
+ * and is read-only afterwards so lookups do not take the lock
+ */
 typedef struct
 {
     gnutls_certificate_credentials_t cred;
     gnutls_dh_params_t dh_params;
     tls_server_cache_t cache;
+    tls_verify_cache_t verify_cache;
+    tls_server_sni_t *sni[TLS_SERVER_SNI_HASH_SIZE];
+    gnutls_datum_t ticket_key;  /* session ticket encryption key */
+    gnutls_anti_replay_t anti_replay;
+    tls_replay_cache_t replay_cache;
     lock_t lock;
 }
 tls_server_t;
@@ -112,11 +181,20 @@ int tls_client_create(tls_client_t *client, const char *trust_file_name, const c
 void tls_client_destroy(tls_client_t *client);
 int tls_client_set(tls_client_t *client, char *addr, gnutls_datum_t data);
 gnutls_datum_t tls_client_get(tls_client_t *client, char *addr);
+int tls_client_verify_get(tls_client_t *client, const unsigned char *key);
+int tls_client_verify_set(tls_client_t *client, const unsigned char *key, time_t expire);
 
 int tls_server_create(tls_server_t *server, const char *trust_file_name, const char *cert_file_name, const char *key_file_name);
 void tls_server_destroy(tls_server_t *server);
+int tls_server_replay_add(void *buf, time_t expire, const gnutls_datum_t *key, const gnutls_datum_t *data);
 int tls_server_set(void *buf, gnutls_datum_t key, gnutls_datum_t data);
 gnutls_datum_t tls_server_get(void *buf, gnutls_datum_t key);
 int tls_server_delete(void *buf, gnutls_datum_t key);
+int tls_server_verify_get(tls_server_t *server, const unsigned char *key);
+int tls_server_verify_set(tls_server_t *server, const unsigned char *key, time_t expire);
+int tls_server_add_sni(tls_server_t *server, const char *name, const char *trust_file_name, const char *cert_file_name, const char *key_file_name);
+gnutls_certificate_credentials_t tls_server_get_sni_cred(tls_server_t *server, const char *name);
+int tls_server_select_cred(gnutls_session_t session);
+int tls_server_set_ticket_key(tls_server_t *server, const void *buf, size_t len);
 
 #endif
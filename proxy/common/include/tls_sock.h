@@ -49,6 +49,7 @@
 #define tls_sock_get_timeout(s)                      ((s)->timeout)
 #define tls_sock_get_session(s)                      ((s)->session)
 #define tls_sock_is_resumed(s)                       (gnutls_session_is_resumed((s)->session))
+#define tls_sock_get_pending(s)                      ((s)->early_data ? 1 : gnutls_record_check_pending((s)->session))  /* bytes already decrypted but not yet read */
 
 #define tls_ssoct_get_sd(ss)                         ((ss)->sd)
 #define tls_ssock_get_sin(ss)                        ((ss)->sin)
@@ -56,6 +57,7 @@
 #define tls_ssock_get_port(ss)                       (ntohs((ss)->sin.SOCK_SIN_PORT))
 #define tls_ssock_get_addr_string(ss, out, out_len)  (tls_sock_get_addr_string_(out, out_len, (ss)->sin.SOCK_SIN_ADDR))
 #define tls_ssock_get_timeout(ss)                    ((ss)->timeout)
+#define tls_ssock_set_cancel_fd(ss, fd)              ((ss)->cancel_fd = (fd))
 
 typedef enum {TLS_SOCK_CLIENT = 0, TLS_SOCK_SERVER} tls_sock_type_t;
 
@@ -72,6 +74,8 @@ typedef struct
     int timeout;
     sock_sockaddr_in_t sin;  /* remote address and port */
     gnutls_session_t session;
+    int early_data;          /* TLS 1.3 early data was accepted and is not yet exhausted */
+    int early;               /* the most recent data read came from TLS 1.3 early data */
 }
 tls_sock_t;
 
@@ -80,6 +84,7 @@ typedef struct
     tls_server_t *server;
     int sd;
     int timeout;
+    int cancel_fd;           /* accept returns SOCK_INTR when readable, -1 for none */
     sock_sockaddr_in_t sin;  /* local address and port */
 }
 tls_ssock_t;
@@ -89,13 +94,21 @@ int tls_sock_open(tls_sock_t *s, tls_client_t *client, const char *host, const c
 void tls_sock_close(tls_sock_t *s);
 int tls_sock_rehandshake(tls_sock_t *s);
 void tls_sock_get_addr_string_(char *out, size_t out_len, sock_in_addr_t sin_addr);
+int tls_sock_is_early(tls_sock_t *s);
 ssize_t tls_sock_read(tls_sock_t *s, void *buf, size_t len);
 ssize_t tls_sock_read_full(tls_sock_t *s, void *buf, size_t len);
 ssize_t tls_sock_write(tls_sock_t *s, void *buf, size_t len);
 ssize_t tls_sock_write_full(tls_sock_t *s, void *buf, size_t len);
 
 int tls_ssock_open(tls_ssock_t *ss, tls_server_t *server, const char *port, int timeout, int backlog);
+int tls_ssock_open_from_sd(tls_ssock_t *ss, tls_server_t *server, int sd, int timeout);
 void tls_ssock_close(tls_ssock_t *ss);
 int tls_ssock_accept(tls_ssock_t *ss, tls_sock_t *s);
 
+/* accept in two steps so that the handshake can run on another thread,
+ * the socket is closed if the handshake fails
+ */
+int tls_ssock_accept_tcp(tls_ssock_t *ss, tls_sock_t *s);
+int tls_sock_accept_handshake(tls_sock_t *s);
+
 #endif
@@ -42,5 +42,6 @@
 size_t util_strncpy(char *dst, const char *src, size_t n);
 size_t util_strncat(char *dst, const char *src, size_t dst_str_len, size_t dst_len);
 long util_load_txt_file(const char *file_name, char **buf);
+unsigned util_hash_str(const char *str, size_t len);
 
 #endif
@@ -106,9 +106,9 @@ static const char *config_str[CONFIG_NUM_STR + 1] =
     "ok",
     "invalid argument",
     "out of memory",
-    "input/output error",
     "lexical error",
     "syntax error",
+    "too many sections or entries",
     "unknown"
 };
 
@@ -250,7 +250,7 @@ static int config_parser_str_copy(config_parser_str_t *s, const char *str)
     unsigned i = 0;
     int ret = 0;
 
-    memset(s->buf, 0, s->len + 1);
+    memset(s->buf, 0, s->idx);  /* the rest of the buffer is already zero */
     s->idx = 0;
     len = strlen(str);
     for (i = 0; i < len; i++)
@@ -801,30 +801,58 @@ static config_section_t *config_section_new(const char *section_name)
     return NULL;
 }
 
-static config_entry_t *config_section_find_entry(config_section_t *section, const char *entry_name)
+/* FNV-1a hash of the section and entry name */
+static unsigned config_hash(config_section_t *section, const char *entry_name)
 {
-    config_entry_t *entry = section->first;
+    unsigned long addr = (unsigned long)section;
+    unsigned hash = 2166136261u;
+    unsigned i = 0;
+
+    for (i = 0; i < sizeof(addr); i++)
+    {
+        hash = (hash ^ ((addr >> (8 * i)) & 0xff)) * 16777619u;
+    }
+    while (*entry_name != '\0')
+    {
+        hash = (hash ^ (unsigned char)*entry_name++) * 16777619u;
+    }
+    return hash % CONFIG_NUM_BUCKETS;
+}
+
+static config_entry_t *config_find_entry(config_t *config, config_section_t *section, const char *entry_name)
+{
+    config_entry_t *entry = config->bucket[config_hash(section, entry_name)];
 
     while (entry != NULL)
     {
-        if (strcmp(entry->name, entry_name) == 0)
+        if ((entry->section == section) && (strcmp(entry->name, entry_name) == 0))
         {
             return entry;
         }
-        entry = entry->next;
+        entry = entry->hash_next;
     }
     return NULL;
 }
 
-static int config_section_add_entry(config_section_t *section, const char *entry_name, const char *entry_value)
+static int config_add_entry(config_t *config, config_section_t *section, const char *entry_name, const char *entry_value)
 {
     config_entry_t *entry = NULL;
+    unsigned i = 0;
 
+    if (config->num_entries >= CONFIG_MAX_ENTRIES)
+    {
+        return CONFIG_ELIMIT;
+    }
     entry = config_entry_new(entry_name, entry_value);
     if (entry == NULL)
     {
         return CONFIG_ENOMEM;
     }
+    entry->section = section;
+    i = config_hash(section, entry_name);
+    entry->hash_next = config->bucket[i];
+    config->bucket[i] = entry;
+    config->num_entries++;
     if (section->first == NULL)
     {
         section->first = entry;
@@ -860,6 +888,11 @@ static config_section_t *config_find_section(config_t *config, const char *secti
 {
     config_section_t *section = config->first;
 
+    /* entries usually follow the header of the last section */
+    if ((config->last != NULL) && (strcmp(config->last->name, section_name) == 0))
+    {
+        return config->last;
+    }
     while (section != NULL)
     {
         if (strcmp(section->name, section_name) == 0)
@@ -875,11 +908,16 @@ static config_section_t *config_add_section(config_t *config, const char *sectio
 {
     config_section_t *section = NULL;
 
+    if (config->num_sections >= CONFIG_MAX_SECTIONS)
+    {
+        return NULL;
+    }
     section = config_section_new(section_name);
     if (section == NULL)
     {
         return NULL;
     }
+    config->num_sections++;
     if (config->first == NULL)
     {
         config->first = section;
@@ -901,13 +939,17 @@ int config_set(config_t *config, const char *section_name, const char *entry_nam
     section = config_find_section(config, section_name);
     if (section == NULL)
     {
+        if (config->num_sections >= CONFIG_MAX_SECTIONS)
+        {
+            return CONFIG_ELIMIT;
+        }
         section = config_add_section(config, section_name);
         if (section == NULL)
         {
             return CONFIG_ENOMEM;
         }
     }
-    entry = config_section_find_entry(section, entry_name);
+    entry = config_find_entry(config, section, entry_name);
     if (entry != NULL)
     {
         /* replace existing value */
@@ -920,7 +962,7 @@ int config_set(config_t *config, const char *section_name, const char *entry_nam
     }
     else
     {
-        ret = config_section_add_entry(section, entry_name, entry_value);
+        ret = config_add_entry(config, section, entry_name, entry_value);
         if (ret != CONFIG_OK)
         {
             return ret;
@@ -937,7 +979,7 @@ const char *config_get(config_t *config, const char *section_name, const char *e
     section = config_find_section(config, section_name);
     if (section != NULL)
     {
-        entry = config_section_find_entry(section, entry_name);
+        entry = config_find_entry(config, section, entry_name);
         if (entry != NULL)
         {
             return entry->value;
@@ -37,7 +37,7 @@
 #include "cross.h"
 #include "uri.h"
 
-#define CROSS_NUM_HTTP_RESP  5                                                  /**< Number of HTTP response codes */
+#define CROSS_NUM_HTTP_RESP  8                                                  /**< Number of HTTP response codes */
 #define CROSS_COAP_SCHEME    "coaps"                                            /**< CoAP scheme */
 #define CROSS_TMP_BUF_LEN    256                                                /**< Length of temporary buffer */
 
@@ -48,9 +48,12 @@ static const char *cross_http_resp_str[CROSS_NUM_HTTP_RESP + 1] =
 {
     "Bad Request",                                                              /**< 400 Bad Request HTTP response description */
     "Not Acceptable",                                                           /**< 406 Not Acceptable HTTP response description  */
+    "Too Early",                                                                /**< 425 Too Early HTTP response description */
     "Internal Server Error",                                                    /**< 500 Internal Server Error HTTP response description */
     "Not Implemented",                                                          /**< 501 Not Implemented HTTP response description */
     "Bad Gateway",                                                              /**< 502 Bad Gateway HTTP response description */
+    "Service Unavailable",                                                      /**< 503 Service Unavailable HTTP response description */
+    "Gateway Timeout",                                                          /**< 504 Gateway Timeout HTTP response description */
     "(Unknown)"                                                                 /**< Unknown HTTP response description */
 };
 
@@ -62,12 +65,18 @@ const char *cross_http_resp_code_to_str(unsigned code)
         return cross_http_resp_str[0];
     case 406:
         return cross_http_resp_str[1];
-    case 500:
+    case 425:
         return cross_http_resp_str[2];
-    case 501:
+    case 500:
         return cross_http_resp_str[3];
-    case 502:
+    case 501:
         return cross_http_resp_str[4];
+    case 502:
+        return cross_http_resp_str[5];
+    case 503:
+        return cross_http_resp_str[6];
+    case 504:
+        return cross_http_resp_str[7];
     }
     return cross_http_resp_str[CROSS_NUM_HTTP_RESP];
 }
@@ -102,3 +102,81 @@ size_t data_buf_consume(data_buf_t *buf, size_t num)
     buf->count -= num;
     return num;
 }
+
+int data_buf_pool_create(data_buf_pool_t *pool, size_t size, unsigned max)
+{
+    int ret = 0;
+
+    memset(pool, 0, sizeof(data_buf_pool_t));
+    pool->data = (char **)calloc(max, sizeof(char *));
+    if (pool->data == NULL)
+    {
+        return -ENOMEM;
+    }
+    ret = lock_create(&pool->lock);
+    if (ret < 0)
+    {
+        free(pool->data);
+        memset(pool, 0, sizeof(data_buf_pool_t));
+        return ret;
+    }
+    pool->size = size;
+    pool->max = max;
+    return 0;
+}
+
+void data_buf_pool_destroy(data_buf_pool_t *pool)
+{
+    unsigned i = 0;
+
+    for (i = 0; i < pool->num; i++)
+    {
+        free(pool->data[i]);
+    }
+    free(pool->data);
+    lock_destroy(&pool->lock);
+    memset(pool, 0, sizeof(data_buf_pool_t));
+}
+
+/* same as data_buf_create with the pool size but reuses a pooled buffer if there is one */
+int data_buf_pool_get(data_buf_pool_t *pool, data_buf_t *buf, size_t max_size)
+{
+    char *data = NULL;
+
+    memset(buf, 0, sizeof(data_buf_t));
+    if (pool->size > max_size)
+    {
+        return -EINVAL;
+    }
+    lock_get(&pool->lock);
+    if (pool->num > 0)
+    {
+        data = pool->data[--pool->num];
+    }
+    lock_put(&pool->lock);
+    if (data == NULL)
+    {
+        return data_buf_create(buf, pool->size, max_size);
+    }
+    memset(data, 0, pool->size + 1);
+    buf->data = data;
+    buf->size = pool->size;
+    buf->max_size = max_size;
+    return 0;
+}
+
+/* same as data_buf_destroy but keeps the buffer for reuse if it has the pool size */
+void data_buf_pool_put(data_buf_pool_t *pool, data_buf_t *buf)
+{
+    if ((buf->data != NULL) && (buf->size == pool->size))
+    {
+        lock_get(&pool->lock);
+        if (pool->num < pool->max)
+        {
+            pool->data[pool->num++] = buf->data;
+            buf->data = NULL;
+        }
+        lock_put(&pool->lock);
+    }
+    data_buf_destroy(buf);
+}
@@ -164,6 +164,7 @@ static int http_msg_list_add(http_msg_list_t *list, const char *name, const char
     else
         list->last->next = header;
     list->last = header;
+    list->num++;
     return 0;
 }
 
@@ -341,6 +342,10 @@ static ssize_t http_msg_parse_headers(http_msg_t *msg, char *str)
                 break;
             }
         }
+        if (msg->header.num >= HTTP_MSG_MAX_HEADERS)
+        {
+            return -EBADMSG;
+        }
         value = strchr(name, ':');
         if (value == NULL)
         {
@@ -359,6 +364,10 @@ static ssize_t http_msg_parse_headers(http_msg_t *msg, char *str)
 /**
  *  @brief Parse the body in a message
  *
+ *  A chunked body is copied in a single pass into a buffer
+ *  that is as long as the rest of the message, which is an
+ *  upper bound on the total length of the chunks.
+ *
  *  @param[in,out] msg Pointer to a message structure
  *  @param[in] str String representation of the message body
  *
@@ -369,19 +378,17 @@ static ssize_t http_msg_parse_headers(http_msg_t *msg, char *str)
 static ssize_t http_msg_parse_body(http_msg_t *msg, char *str)
 {
     http_msg_header_t *header = NULL;
+    unsigned long chunk_len = 0;
+    unsigned num_chunks = 0;
     ssize_t num = 0;
     size_t content_len = 0;
     size_t str_len = 0;
+    size_t avail = 0;
     char *chunk_size = NULL;
-    char *chunk_data = NULL;
-    char *param = NULL;
+    char *chunk_end = NULL;
     char *next = NULL;
     char *dest = NULL;
-    int total_len = 0;
-    int chunk_len = 0;
     int chunked = 0;
-    int ret = 0;
-    int i = 0;
 
     str_len = strlen(str);
 
@@ -405,82 +412,57 @@ static ssize_t http_msg_parse_body(http_msg_t *msg, char *str)
         /* 2: "06\r\nchunk1\r\n06\r\nchunk2\r\n0\r\nname: value\r\n\r\n" */
         /* 3: "06\r\nchunk1\r\n06; param=value\r\nchunk2\r\n0\r\n\r\n"   */
 
-        /* make 2 passes */
-        /* the first pass determines the total size of all chunks */
-        /* the second pass copies data */
-        for (i = 0; i < 2; i++)
+        msg->body = malloc(str_len + 1);
+        if (msg->body == NULL)
         {
-            next = str;
-            while (1)
+            return -ENOMEM;
+        }
+        dest = msg->body;
+        next = str;
+        while (1)
+        {
+            chunk_size = next;
+
+            /* find the end of the chunk-size field */
+            next = strstr(next, "\r\n");
+            if (next == NULL)
             {
-                chunk_size = next;
-
-                /* find the end of the chunk-size field */
-                next = strstr(next, "\r\n");
-                if (next == NULL)
-                {
-                    return -EAGAIN;
-                }
-                next += 2;
-
-                /* ignore unrecognised parameters in the chunk-size field */
-                param = strchr(chunk_size, ';');
-                if ((param != NULL) && (param < next))
-                {
-                    *param = ' ';
-                }
-
-                /* parse chunk length */
-                ret = sscanf(chunk_size, "%x", &chunk_len);
-                if (ret != 1)
-                {
-                    return -EBADMSG;
-                }
-                if (chunk_len == 0)
-                {
-                    break;
-                }
-                if (i == 0)
-                {
-                    total_len += chunk_len;
-                }
-
-                chunk_data = next;
-                next += chunk_len;
-
-                /* parse the end of chunk-data */
-                if (next + 2 > str + str_len)
-                {
-                    return -EAGAIN;
-                }
-                if ((*next != '\r')
-                 || (*(next + 1) != '\n'))
-                {
-                    return -EBADMSG;
-                }
-                next += 2;
-
-                /* copy data on the second pass */
-                if (i == 1)
-                {
-                    memcpy(dest, chunk_data, chunk_len);
-                    dest += chunk_len;
-                }
+                return -EAGAIN;
             }
+            next += 2;
 
-            /* allocate memory after the first pass */
-            if (i == 0)
+            /* parse chunk length, unrecognised parameters in the chunk-size field are ignored */
+            chunk_len = strtoul(chunk_size, &chunk_end, 16);
+            if ((chunk_end == chunk_size) || (chunk_end > next - 2))
             {
-                msg->body = malloc(total_len + 1);
-                if (msg->body == NULL)
-                {
-                    return -ENOMEM;
-                }
-                msg->body[total_len] = '\0';
-                msg->body_len = total_len;
-                dest = msg->body;
+                return -EBADMSG;
+            }
+            if (chunk_len == 0)
+            {
+                break;
             }
+            if (++num_chunks > HTTP_MSG_MAX_CHUNKS)
+            {
+                return -EBADMSG;
+            }
+
+            /* parse the end of chunk-data */
+            avail = (str + str_len) - next;
+            if ((chunk_len > avail) || (avail - chunk_len < 2))
+            {
+                return -EAGAIN;
+            }
+            if ((next[chunk_len] != '\r')
+             || (next[chunk_len + 1] != '\n'))
+            {
+                return -EBADMSG;
+            }
+            memcpy(dest, next, chunk_len);
+            dest += chunk_len;
+            next += chunk_len + 2;
         }
+        *dest = '\0';
+        msg->body_len = dest - msg->body;
 
         /* 1: "\r\n"                */
         /* 2: "name: value\r\n\r\n" */
@@ -572,6 +554,249 @@ ssize_t http_msg_parse(http_msg_t *msg, const char *buf, size_t len)
     return num;
 }
 
+void http_msg_scan_create(http_msg_scan_t *scan)
+{
+    memset(scan, 0, sizeof(http_msg_scan_t));
+}
+
+/**
+ *  @brief Compare a message field with a string ignoring case and surrounding whitespace
+ *
+ *  @param[in] field Pointer to the message field
+ *  @param[in] len Length of the message field
+ *  @param[in] str String to compare with
+ *
+ *  @returns Comparison result
+ *  @retval 1 The message field matches the string
+ *  @retval 0 Otherwise
+ */
+static int http_msg_scan_match(const char *field, size_t len, const char *str)
+{
+    size_t str_len = 0;
+
+    while ((len > 0) && (isspace(field[0])))
+    {
+        field++;
+        len--;
+    }
+    while ((len > 0) && (isspace(field[len - 1])))
+    {
+        len--;
+    }
+    str_len = strlen(str);
+    return (len == str_len) && (strncasecmp(field, str, len) == 0);
+}
+
+/**
+ *  @brief Scan a header or trailer line
+ *
+ *  @param[in,out] scan Pointer to a message scanner structure
+ *  @param[in] line Pointer to the line without the line break
+ *  @param[in] len Length of the line
+ *
+ *  @returns Error code
+ *  @retval 0 Success
+ *  @retval -EBADMSG Too many headers or no ':' character
+ */
+static int http_msg_scan_header(http_msg_scan_t *scan, const char *line, size_t len)
+{
+    const char *value = NULL;
+    char num[21] = {0};
+    size_t name_len = 0;
+    size_t value_len = 0;
+
+    if ((line[0] == ' ') || (line[0] == '\t'))
+    {
+        /* continuation of the previous header */
+        return 0;
+    }
+    if (++scan->num_headers > HTTP_MSG_MAX_HEADERS)
+    {
+        return -EBADMSG;
+    }
+    value = memchr(line, ':', len);
+    if (value == NULL)
+    {
+        return -EBADMSG;
+    }
+    name_len = value - line;
+    value++;
+    value_len = (line + len) - value;
+    if (scan->state != HTTP_MSG_SCAN_HEADERS)
+    {
+        return 0;
+    }
+    if ((http_msg_scan_match(line, name_len, "Transfer-Encoding"))
+     && (http_msg_scan_match(value, value_len, "chunked")))
+    {
+        scan->chunked = 1;
+    }
+    else if (http_msg_scan_match(line, name_len, "Content-Length"))
+    {
+        if (value_len >= sizeof(num))
+        {
+            value_len = sizeof(num) - 1;
+        }
+        memcpy(num, value, value_len);
+        scan->content_len = atoi(num);
+    }
+    return 0;
+}
+
+/**
+ *  @brief Scan a chunk-size line
+ *
+ *  @param[in,out] scan Pointer to a message scanner structure
+ *  @param[in] line Pointer to the line without the line break
+ *  @param[in] len Length of the line
+ *
+ *  @returns Error code
+ *  @retval 0 Success
+ *  @retval -EBADMSG Badly formatted chunk size or too many chunks
+ */
+static int http_msg_scan_chunk_size(http_msg_scan_t *scan, const char *line, size_t len)
+{
+    size_t chunk_len = 0;
+    size_t i = 0;
+    int digits = 0;
+    int c = 0;
+
+    while ((i < len) && ((line[i] == ' ') || (line[i] == '\t')))
+    {
+        i++;
+    }
+    if ((i + 2 < len) && (line[i] == '0') && (tolower(line[i + 1]) == 'x') && (isxdigit(line[i + 2])))
+    {
+        i += 2;
+    }
+    while ((i < len) && (isxdigit(line[i])))
+    {
+        c = tolower(line[i]);
+        if (chunk_len > (((size_t)-1) >> 8))
+        {
+            return -EBADMSG;
+        }
+        chunk_len = 16 * chunk_len + (isdigit(c) ? c - '0' : c - 'a' + 10);
+        digits = 1;
+        i++;
+    }
+    if (!digits)
+    {
+        return -EBADMSG;
+    }
+    if (chunk_len == 0)
+    {
+        scan->state = HTTP_MSG_SCAN_TRAILERS;
+        return 0;
+    }
+    if (++scan->num_chunks > HTTP_MSG_MAX_CHUNKS)
+    {
+        return -EBADMSG;
+    }
+    scan->remain = chunk_len + 2;  /* chunk-data followed by "\r\n" */
+    scan->state = HTTP_MSG_SCAN_CHUNK_DATA;
+    return 0;
+}
+
+ssize_t http_msg_scan(http_msg_scan_t *scan, const char *buf, size_t len)
+{
+    const char *p = NULL;
+    size_t line_len = 0;
+    int ret = 0;
+
+    while (1)
+    {
+        if (scan->state == HTTP_MSG_SCAN_DONE)
+        {
+            return scan->line;
+        }
+        if ((scan->state == HTTP_MSG_SCAN_BODY) || (scan->state == HTTP_MSG_SCAN_CHUNK_DATA))
+        {
+            if (len - scan->line < scan->remain)
+            {
+                return -EAGAIN;
+            }
+            scan->line += scan->remain;
+            scan->pos = scan->line;
+            if (scan->state == HTTP_MSG_SCAN_BODY)
+            {
+                scan->state = HTTP_MSG_SCAN_DONE;
+            }
+            else if ((buf[scan->line - 2] != '\r') || (buf[scan->line - 1] != '\n'))
+            {
+                return -EBADMSG;
+            }
+            else
+            {
+                scan->state = HTTP_MSG_SCAN_CHUNK_SIZE;
+            }
+            continue;
+        }
+
+        /* find the next "\r\n" without searching the same bytes twice */
+        p = memchr(buf + scan->pos, '\n', len - scan->pos);
+        if (p == NULL)
+        {
+            scan->pos = len;
+            return -EAGAIN;
+        }
+        scan->pos = (p - buf) + 1;
+        if ((p == buf + scan->line) || (p[-1] != '\r'))
+        {
+            continue;
+        }
+        line_len = (p - 1) - (buf + scan->line);
+        p = buf + scan->line;
+        scan->line = scan->pos;
+
+        switch (scan->state)
+        {
+        case HTTP_MSG_SCAN_START:
+            scan->state = HTTP_MSG_SCAN_HEADERS;
+            break;
+        case HTTP_MSG_SCAN_HEADERS:
+            if (line_len > 0)
+            {
+                ret = http_msg_scan_header(scan, p, line_len);
+            }
+            else if (scan->chunked)
+            {
+                scan->state = HTTP_MSG_SCAN_CHUNK_SIZE;
+            }
+            else if (scan->content_len > 0)
+            {
+                scan->remain = scan->content_len;
+                scan->state = HTTP_MSG_SCAN_BODY;
+            }
+            else
+            {
+                scan->state = HTTP_MSG_SCAN_DONE;
+            }
+            break;
+        case HTTP_MSG_SCAN_CHUNK_SIZE:
+            ret = http_msg_scan_chunk_size(scan, p, line_len);
+            break;
+        case HTTP_MSG_SCAN_TRAILERS:
+            if (line_len > 0)
+            {
+                ret = http_msg_scan_header(scan, p, line_len);
+            }
+            else
+            {
+                scan->state = HTTP_MSG_SCAN_DONE;
+            }
+            break;
+        default:
+            break;
+        }
+        if (ret < 0)
+        {
+            return ret;
+        }
+    }
+    return -EAGAIN;  /* should never arrive here */
+}
+
 int http_msg_set_start(http_msg_t *msg, const char *start1, const char *start2, const char *start3)
 {
     msg->start[0] = strdup(start1);
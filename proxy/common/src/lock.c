@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2014 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ *  @file lock.c
+ *
+ *  @brief Source file for the FreeCoAP lock module
+ *
+ *  Holds the contention profiling records, which are only
+ *  kept when LOCK_PROF is defined.
+ */
+
+#ifdef LOCK_PROF
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lock.h"
+#include "coap_log.h"
+
+#define LOCK_PROF_LINE_LEN  256
+
+static lock_prof_t *lock_prof_list = NULL;                                      /* records are never freed */
+static pthread_mutex_t lock_prof_mutex = PTHREAD_MUTEX_INITIALIZER;             /* protects lock_prof_list */
+
+/*  return: { record, success
+ *          { NULL, out of memory
+ */
+lock_prof_t *lock_prof_get(const char *name)
+{
+    lock_prof_t *prof = NULL;
+
+    pthread_mutex_lock(&lock_prof_mutex);
+    prof = lock_prof_list;
+    while (prof != NULL)
+    {
+        if (strcmp(prof->name, name) == 0)
+        {
+            pthread_mutex_unlock(&lock_prof_mutex);
+            return prof;
+        }
+        prof = prof->next;
+    }
+    prof = calloc(1, sizeof(lock_prof_t));
+    if (prof != NULL)
+    {
+        prof->name = name;
+        prof->next = lock_prof_list;
+        lock_prof_list = prof;
+    }
+    pthread_mutex_unlock(&lock_prof_mutex);
+    return prof;
+}
+
+static void lock_prof_format_hist(char *buf, size_t len, const unsigned long *hist)
+{
+    size_t n = 0;
+    unsigned i = 0;
+
+    buf[0] = '\0';
+    for (i = 0; (i < LOCK_PROF_NUM_BUCKETS) && (n < len); i++)
+    {
+        if (hist[i] == 0)
+        {
+            continue;
+        }
+        if (i == 0)
+        {
+            n += snprintf(buf + n, len - n, " <1:%lu", hist[i]);
+        }
+        else
+        {
+            n += snprintf(buf + n, len - n, " %lu:%lu", 1ul << (i - 1), hist[i]);
+        }
+    }
+}
+
+void lock_prof_log(void)
+{
+    lock_prof_t *prof = NULL;
+    unsigned long num_get = 0;
+    unsigned long num_contended = 0;
+    char hist[LOCK_PROF_LINE_LEN] = {0};
+
+    pthread_mutex_lock(&lock_prof_mutex);
+    prof = lock_prof_list;
+    while (prof != NULL)
+    {
+        num_get = __atomic_load_n(&prof->num_get, __ATOMIC_RELAXED);
+        num_contended = __atomic_load_n(&prof->num_contended, __ATOMIC_RELAXED);
+        coap_log_info("Lock %s: %lu acquired, %lu contended (%lu%%), %llu usec waiting, %llu usec held",
+                      prof->name, num_get, num_contended,
+                      num_get != 0 ? (num_contended * 100) / num_get : 0,
+                      (unsigned long long)(__atomic_load_n(&prof->wait_ns, __ATOMIC_RELAXED) / 1000),
+                      (unsigned long long)(__atomic_load_n(&prof->hold_ns, __ATOMIC_RELAXED) / 1000));
+        lock_prof_format_hist(hist, sizeof(hist), prof->wait_hist);
+        coap_log_info("Lock %s: wait (usec:count)%s", prof->name, hist);
+        lock_prof_format_hist(hist, sizeof(hist), prof->hold_hist);
+        coap_log_info("Lock %s: hold (usec:count)%s", prof->name, hist);
+        prof = prof->next;
+    }
+    pthread_mutex_unlock(&lock_prof_mutex);
+}
+
+#endif  /* LOCK_PROF */
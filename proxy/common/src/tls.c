@@ -33,6 +33,8 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <gnutls/crypto.h>
 #include "tls.h"
 #include "util.h"
 
@@ -79,6 +81,58 @@ gnutls_priority_t tls_get_priority_cache(void)
     return _tls_priority_cache;
 }
 
+static int tls_verify_cache_create(tls_verify_cache_t *cache, size_t size)
+{
+    memset(cache, 0, sizeof(tls_verify_cache_t));
+    if (size == 0)
+    {
+        return SOCK_ARG_ERROR;
+    }
+    cache->element = (tls_verify_cache_element_t *)calloc(size, sizeof(tls_verify_cache_element_t));
+    if (cache->element == NULL)
+    {
+        return SOCK_MEM_ALLOC_ERROR;
+    }
+    cache->size = size;
+    cache->index = 0;
+    return SOCK_OK;
+}
+
+static void tls_verify_cache_destroy(tls_verify_cache_t *cache)
+{
+    free(cache->element);
+    memset(cache, 0, sizeof(tls_verify_cache_t));
+}
+
+/* the trust files are read once when the credentials are created
+ * and the cache lives as long as the credentials, so an entry never
+ * outlives the trust list it was verified against
+ */
+static int tls_verify_cache_get(tls_verify_cache_t *cache, const unsigned char *key)
+{
+    time_t now = 0;
+    unsigned i = 0;
+
+    now = time(NULL);
+    for (i = 0; i < cache->size; i++)
+    {
+        if ((cache->element[i].expire > now)
+         && (memcmp(key, cache->element[i].key, TLS_VERIFY_KEY_SIZE) == 0))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void tls_verify_cache_set(tls_verify_cache_t *cache, const unsigned char *key, time_t expire)
+{
+    memcpy(cache->element[cache->index].key, key, TLS_VERIFY_KEY_SIZE);
+    cache->element[cache->index].expire = expire;
+    cache->index++;
+    cache->index %= cache->size;
+}
+
 static int tls_client_cache_create(tls_client_cache_t *cache, size_t size)
 {
     memset(cache, 0, sizeof(tls_client_cache_t));
@@ -217,9 +271,25 @@ int tls_client_create(tls_client_t *client, const char *trust_file_name, const c
         return ret;
     }
 
+    ret = tls_verify_cache_create(&client->verify_cache, TLS_VERIFY_CACHE_SIZE);
+    if (ret != SOCK_OK)
+    {
+        tls_client_cache_destroy(&client->cache);
+#ifdef TLS_CLIENT_AUTH
+        if (client->dh_params != NULL)
+        {
+            gnutls_dh_params_deinit(client->dh_params);
+        }
+#endif
+        gnutls_certificate_free_credentials(client->cred);
+        memset(client, 0, sizeof(tls_client_t));
+        return ret;
+    }
+
     ret = lock_create(&client->lock);
     if (ret < 0)
     {
+        tls_verify_cache_destroy(&client->verify_cache);
         tls_client_cache_destroy(&client->cache);
 #ifdef TLS_CLIENT_AUTH
         if (client->dh_params != NULL)
@@ -238,6 +308,7 @@ int tls_client_create(tls_client_t *client, const char *trust_file_name, const c
 void tls_client_destroy(tls_client_t *client)
 {
     lock_destroy(&client->lock);
+    tls_verify_cache_destroy(&client->verify_cache);
     tls_client_cache_destroy(&client->cache);
 #ifdef TLS_CLIENT_AUTH
     if (client->dh_params != NULL)
@@ -287,6 +358,99 @@ gnutls_datum_t tls_client_get(tls_client_t *client, char *addr)
     return res;
 }
 
+/* returns 1 if the peer certificate identified by key
+ * was verified recently
+ */
+int tls_client_verify_get(tls_client_t *client, const unsigned char *key)
+{
+    int found = 0;
+    int ret = 0;
+
+    ret = lock_get(&client->lock);
+    if (ret < 0)
+    {
+        return 0;
+    }
+    found = tls_verify_cache_get(&client->verify_cache, key);
+    ret = lock_put(&client->lock);
+    if (ret < 0)
+    {
+        return 0;
+    }
+    return found;
+}
+
+int tls_client_verify_set(tls_client_t *client, const unsigned char *key, time_t expire)
+{
+    int ret = 0;
+
+    ret = lock_get(&client->lock);
+    if (ret < 0)
+    {
+        return SOCK_LOCK_ERROR;
+    }
+    tls_verify_cache_set(&client->verify_cache, key, expire);
+    ret = lock_put(&client->lock);
+    if (ret < 0)
+    {
+        return SOCK_LOCK_ERROR;
+    }
+    return SOCK_OK;
+}
+
+static int tls_replay_cache_create(tls_replay_cache_t *cache, size_t size)
+{
+    memset(cache, 0, sizeof(tls_replay_cache_t));
+    if (size == 0)
+    {
+        return SOCK_ARG_ERROR;
+    }
+    cache->element = (tls_replay_cache_element_t *)calloc(size, sizeof(tls_replay_cache_element_t));
+    if (cache->element == NULL)
+    {
+        return SOCK_MEM_ALLOC_ERROR;
+    }
+    cache->size = size;
+    cache->index = 0;
+    return SOCK_OK;
+}
+
+static void tls_replay_cache_destroy(tls_replay_cache_t *cache)
+{
+    free(cache->element);
+    memset(cache, 0, sizeof(tls_replay_cache_t));
+}
+
+/* entries are added in order of expiry so the oldest entry is overwritten
+ *
+ *  return: { 0, the key was added
+ *          { 1, the key is already in the cache or the cache is full
+ */
+static int tls_replay_cache_add(tls_replay_cache_t *cache, const unsigned char *key, time_t expire)
+{
+    time_t now = 0;
+    unsigned i = 0;
+
+    now = time(NULL);
+    for (i = 0; i < cache->size; i++)
+    {
+        if ((cache->element[i].expire > now)
+         && (memcmp(key, cache->element[i].key, TLS_REPLAY_KEY_SIZE) == 0))
+        {
+            return 1;
+        }
+    }
+    if (cache->element[cache->index].expire > now)
+    {
+        return 1;
+    }
+    memcpy(cache->element[cache->index].key, key, TLS_REPLAY_KEY_SIZE);
+    cache->element[cache->index].expire = expire;
+    cache->index++;
+    cache->index %= cache->size;
+    return 0;
+}
+
 static int tls_server_cache_create(tls_server_cache_t *cache, size_t size)
 {
     memset(cache, 0, sizeof(tls_server_cache_t));
@@ -370,6 +534,17 @@ static int tls_server_cache_delete(tls_server_cache_t *cache, gnutls_datum_t key
     return SOCK_ARG_ERROR;
 }
 
+static void tls_server_ticket_key_destroy(tls_server_t *server)
+{
+    if (server->ticket_key.data != NULL)
+    {
+        memset(server->ticket_key.data, 0, server->ticket_key.size);
+        gnutls_free(server->ticket_key.data);
+        server->ticket_key.data = NULL;
+        server->ticket_key.size = 0;
+    }
+}
+
 int tls_server_create(tls_server_t *server, const char *trust_file_name, const char *cert_file_name, const char *key_file_name)
 {
     int ret = 0;
@@ -443,9 +618,20 @@ int tls_server_create(tls_server_t *server, const char *trust_file_name, const c
         return ret;
     }
 
+    ret = tls_verify_cache_create(&server->verify_cache, TLS_VERIFY_CACHE_SIZE);
+    if (ret != SOCK_OK)
+    {
+        tls_server_cache_destroy(&server->cache);
+        gnutls_dh_params_deinit(server->dh_params);
+        gnutls_certificate_free_credentials(server->cred);
+        memset(server, 0, sizeof(tls_server_t));
+        return ret;
+    }
+
     ret = lock_create(&server->lock);
     if (ret < 0)
     {
+        tls_verify_cache_destroy(&server->verify_cache);
         tls_server_cache_destroy(&server->cache);
         gnutls_dh_params_deinit(server->dh_params);
         gnutls_certificate_free_credentials(server->cred);
@@ -453,18 +639,113 @@ int tls_server_create(tls_server_t *server, const char *trust_file_name, const c
         return SOCK_LOCK_ERROR;
     }
 
+    ret = gnutls_session_ticket_key_generate(&server->ticket_key);
+    if (ret != GNUTLS_E_SUCCESS)
+    {
+        lock_destroy(&server->lock);
+        tls_verify_cache_destroy(&server->verify_cache);
+        tls_server_cache_destroy(&server->cache);
+        gnutls_dh_params_deinit(server->dh_params);
+        gnutls_certificate_free_credentials(server->cred);
+        memset(server, 0, sizeof(tls_server_t));
+        return SOCK_TLS_INIT_ERROR;
+    }
+
+    ret = tls_replay_cache_create(&server->replay_cache, TLS_REPLAY_CACHE_SIZE);
+    if (ret != SOCK_OK)
+    {
+        tls_server_ticket_key_destroy(server);
+        lock_destroy(&server->lock);
+        tls_verify_cache_destroy(&server->verify_cache);
+        tls_server_cache_destroy(&server->cache);
+        gnutls_dh_params_deinit(server->dh_params);
+        gnutls_certificate_free_credentials(server->cred);
+        memset(server, 0, sizeof(tls_server_t));
+        return ret;
+    }
+
+    /* early data is only accepted from a client hello seen once within the window */
+    ret = gnutls_anti_replay_init(&server->anti_replay);
+    if (ret != GNUTLS_E_SUCCESS)
+    {
+        tls_replay_cache_destroy(&server->replay_cache);
+        tls_server_ticket_key_destroy(server);
+        lock_destroy(&server->lock);
+        tls_verify_cache_destroy(&server->verify_cache);
+        tls_server_cache_destroy(&server->cache);
+        gnutls_dh_params_deinit(server->dh_params);
+        gnutls_certificate_free_credentials(server->cred);
+        memset(server, 0, sizeof(tls_server_t));
+        return SOCK_TLS_INIT_ERROR;
+    }
+    gnutls_anti_replay_set_window(server->anti_replay, TLS_REPLAY_WINDOW);
+    gnutls_anti_replay_set_add_function(server->anti_replay, tls_server_replay_add);
+    gnutls_anti_replay_set_ptr(server->anti_replay, server);
+
     return SOCK_OK;
 }
 
+static void tls_server_sni_delete(tls_server_sni_t *sni)
+{
+    gnutls_certificate_free_credentials(sni->cred);
+    free(sni->name);
+    free(sni);
+}
+
+static void tls_server_sni_destroy(tls_server_t *server)
+{
+    tls_server_sni_t *prev = NULL;
+    tls_server_sni_t *sni = NULL;
+    unsigned i = 0;
+
+    for (i = 0; i < TLS_SERVER_SNI_HASH_SIZE; i++)
+    {
+        sni = server->sni[i];
+        while (sni != NULL)
+        {
+            prev = sni;
+            sni = sni->next;
+            tls_server_sni_delete(prev);
+        }
+        server->sni[i] = NULL;
+    }
+}
+
 void tls_server_destroy(tls_server_t *server)
 {
+    gnutls_anti_replay_deinit(server->anti_replay);
+    tls_replay_cache_destroy(&server->replay_cache);
+    tls_server_ticket_key_destroy(server);
+    tls_server_sni_destroy(server);
     lock_destroy(&server->lock);
     gnutls_dh_params_deinit(server->dh_params);
     gnutls_certificate_free_credentials(server->cred);
+    tls_verify_cache_destroy(&server->verify_cache);
     tls_server_cache_destroy(&server->cache);
     memset(server, 0, sizeof(tls_server_t));
 }
 
+int tls_server_replay_add(void *buf, time_t expire, const gnutls_datum_t *key, const gnutls_datum_t *data)
+{
+    tls_server_t *server = (tls_server_t *)buf;
+    unsigned char hash[TLS_REPLAY_KEY_SIZE] = {0};
+    int ret = 0;
+
+    ret = gnutls_hash_fast(GNUTLS_DIG_SHA256, key->data, key->size, hash);
+    if (ret != GNUTLS_E_SUCCESS)
+    {
+        return GNUTLS_E_DB_ERROR;
+    }
+    lock_get(&server->lock);
+    ret = tls_replay_cache_add(&server->replay_cache, hash, expire);
+    lock_put(&server->lock);
+    if (ret != 0)
+    {
+        return GNUTLS_E_DB_ENTRY_EXISTS;
+    }
+    return 0;
+}
+
 int tls_server_set(void *buf, gnutls_datum_t key, gnutls_datum_t data)
 {
     int status = 0;
@@ -524,3 +805,179 @@ int tls_server_delete(void *buf, gnutls_datum_t key)
     }
     return status;
 }
+
+/* returns 1 if the peer certificate identified by key
+ * was verified recently
+ */
+int tls_server_verify_get(tls_server_t *server, const unsigned char *key)
+{
+    int found = 0;
+    int ret = 0;
+
+    ret = lock_get(&server->lock);
+    if (ret < 0)
+    {
+        return 0;
+    }
+    found = tls_verify_cache_get(&server->verify_cache, key);
+    ret = lock_put(&server->lock);
+    if (ret < 0)
+    {
+        return 0;
+    }
+    return found;
+}
+
+int tls_server_verify_set(tls_server_t *server, const unsigned char *key, time_t expire)
+{
+    int ret = 0;
+
+    ret = lock_get(&server->lock);
+    if (ret < 0)
+    {
+        return SOCK_LOCK_ERROR;
+    }
+    tls_verify_cache_set(&server->verify_cache, key, expire);
+    ret = lock_put(&server->lock);
+    if (ret < 0)
+    {
+        return SOCK_LOCK_ERROR;
+    }
+    return SOCK_OK;
+}
+
+int tls_server_add_sni(tls_server_t *server, const char *name, const char *trust_file_name, const char *cert_file_name, const char *key_file_name)
+{
+    tls_server_sni_t *sni = NULL;
+    unsigned i = 0;
+    int ret = 0;
+
+    if ((name == NULL) || (strlen(name) == 0) || (strlen(name) >= TLS_SERVER_MAX_NAME_LEN))
+    {
+        return SOCK_ARG_ERROR;
+    }
+    if (tls_server_get_sni_cred(server, name) != NULL)
+    {
+        return SOCK_ARG_ERROR;
+    }
+
+    sni = (tls_server_sni_t *)calloc(1, sizeof(tls_server_sni_t));
+    if (sni == NULL)
+    {
+        return SOCK_MEM_ALLOC_ERROR;
+    }
+    sni->name = strdup(name);
+    if (sni->name == NULL)
+    {
+        free(sni);
+        return SOCK_MEM_ALLOC_ERROR;
+    }
+
+    ret = gnutls_certificate_allocate_credentials(&sni->cred);
+    if (ret != GNUTLS_E_SUCCESS)
+    {
+        free(sni->name);
+        free(sni);
+        return SOCK_TLS_INIT_ERROR;
+    }
+
+#ifdef TLS_CLIENT_AUTH
+    if (trust_file_name != NULL)
+    {
+        ret = gnutls_certificate_set_x509_trust_file(sni->cred, trust_file_name, GNUTLS_X509_FMT_PEM);
+        if (ret < 0)
+        {
+            tls_server_sni_delete(sni);
+            return SOCK_TLS_TRUST_ERROR;
+        }
+    }
+#endif
+
+    ret = gnutls_certificate_set_x509_key_file(sni->cred, cert_file_name, key_file_name, GNUTLS_X509_FMT_PEM);
+    if (ret != GNUTLS_E_SUCCESS)
+    {
+        tls_server_sni_delete(sni);
+        return SOCK_TLS_CRED_ERROR;
+    }
+
+    /* the Diffie-Hellman parameters are shared with the default credentials */
+    gnutls_certificate_set_dh_params(sni->cred, server->dh_params);
+
+    i = util_hash_str(name, TLS_SERVER_MAX_NAME_LEN) % TLS_SERVER_SNI_HASH_SIZE;
+    sni->next = server->sni[i];
+    server->sni[i] = sni;
+    return SOCK_OK;
+}
+
+gnutls_certificate_credentials_t tls_server_get_sni_cred(tls_server_t *server, const char *name)
+{
+    tls_server_sni_t *sni = NULL;
+    unsigned i = 0;
+
+    i = util_hash_str(name, TLS_SERVER_MAX_NAME_LEN) % TLS_SERVER_SNI_HASH_SIZE;
+    sni = server->sni[i];
+    while (sni != NULL)
+    {
+        if (strcasecmp(sni->name, name) == 0)
+        {
+            return sni->cred;
+        }
+        sni = sni->next;
+    }
+    return NULL;
+}
+
+/* post client hello call-back function
+ * switches to the credentials registered for the
+ * server name sent by the client, if any
+ */
+int tls_server_select_cred(gnutls_session_t session)
+{
+    gnutls_certificate_credentials_t cred = NULL;
+    tls_server_t *server = NULL;
+    unsigned type = 0;
+    size_t len = 0;
+    char name[TLS_SERVER_MAX_NAME_LEN] = {0};
+    int ret = 0;
+
+    server = (tls_server_t *)gnutls_session_get_ptr(session);
+    if (server == NULL)
+    {
+        return 0;
+    }
+    len = sizeof(name) - 1;
+    ret = gnutls_server_name_get(session, name, &len, &type, 0);
+    if ((ret != GNUTLS_E_SUCCESS) || (type != GNUTLS_NAME_DNS))
+    {
+        return 0;  /* no server name, use the default credentials */
+    }
+    cred = tls_server_get_sni_cred(server, name);
+    if (cred == NULL)
+    {
+        return 0;  /* unknown server name, use the default credentials */
+    }
+    return gnutls_credentials_set(session, GNUTLS_CRD_CERTIFICATE, cred);
+}
+
+/* replace the session ticket key, e.g. with the key of a previous
+ * process so that its session tickets remain valid
+ */
+int tls_server_set_ticket_key(tls_server_t *server, const void *buf, size_t len)
+{
+    gnutls_datum_t key = {0};
+
+    if ((buf == NULL) || (len != server->ticket_key.size))
+    {
+        return SOCK_ARG_ERROR;
+    }
+    key.data = gnutls_malloc(len);
+    if (key.data == NULL)
+    {
+        return SOCK_MEM_ALLOC_ERROR;
+    }
+    memcpy(key.data, buf, len);
+    key.size = len;
+    tls_server_ticket_key_destroy(server);
+    server->ticket_key = key;
+    return SOCK_OK;
+}
@@ -38,11 +38,13 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <gnutls/x509.h>
+#include <gnutls/crypto.h>
 #include "tls_sock.h"
 #include "coap_log.h"
 
 static int tls_sock_open_(tls_sock_t *s, const char *common_name, int timeout);
 static int tls_sock_handshake(tls_sock_t *s);
+static int tls_sock_verify_key(tls_sock_t *s, const gnutls_datum_t *cert, const char *common_name, unsigned char *key);
 static int tls_sock_verify_peer_cert(tls_sock_t *s, const char *common_name);
 
 static int set_non_blocking(int sd)
@@ -148,6 +150,7 @@ int tls_sock_open_(tls_sock_t *s, const char *common_name, int timeout)
 {
     gnutls_datum_t data = {0};
     char addr[SOCK_INET_ADDRSTRLEN] = {0};
+    unsigned flags = s->type;
     int ret = 0;
 
     /* initialise timeout value */
@@ -161,8 +164,15 @@ int tls_sock_open_(tls_sock_t *s, const char *common_name, int timeout)
         return SOCK_TLS_CONFIG_ERROR;
     }
 
-    /* initialise tls session */
-    ret = gnutls_init(&s->session, s->type);
+    /* initialise tls session, a server accepts TLS 1.3 early data
+     * from resuming clients and can answer it before the client
+     * finished message arrives
+     */
+    if (s->type == TLS_SOCK_SERVER)
+    {
+        flags = GNUTLS_SERVER | GNUTLS_ENABLE_EARLY_DATA | GNUTLS_ENABLE_EARLY_START;
+    }
+    ret = gnutls_init(&s->session, flags);
     if (ret != GNUTLS_E_SUCCESS)
     {
         close(s->sd);
@@ -209,11 +219,28 @@ int tls_sock_open_(tls_sock_t *s, const char *common_name, int timeout)
             return SOCK_TLS_CONFIG_ERROR;
         }
 
+        /* session tickets allow resumption without the server cache */
+        ret = gnutls_session_ticket_enable_server(s->session, &tls_server_get_ticket_key(s->u.server));
+        if (ret != GNUTLS_E_SUCCESS)
+        {
+            gnutls_deinit(s->session);
+            close(s->sd);
+            return SOCK_TLS_CONFIG_ERROR;
+        }
+
+        /* session tickets allow resuming clients to send early data */
+        gnutls_record_set_max_early_data_size(s->session, TLS_SERVER_MAX_EARLY_DATA_SIZE);
+        gnutls_anti_replay_enable(s->session, tls_server_get_anti_replay(s->u.server));
+
         gnutls_db_set_ptr(s->session, s->u.server);
         gnutls_db_set_store_function(s->session, tls_server_set);
         gnutls_db_set_retrieve_function(s->session, tls_server_get);
         gnutls_db_set_remove_function(s->session, tls_server_delete);
 
+        /* select the credentials from the server name indication */
+        gnutls_session_set_ptr(s->session, s->u.server);
+        gnutls_handshake_set_post_client_hello_function(s->session, tls_server_select_cred);
+
 #ifdef TLS_CLIENT_AUTH
         /* request client authentication */
         gnutls_certificate_server_set_request(s->session, GNUTLS_CERT_REQUIRE);
@@ -230,6 +257,10 @@ int tls_sock_open_(tls_sock_t *s, const char *common_name, int timeout)
         close(s->sd);
         return ret;
     }
+    if (s->type == TLS_SOCK_SERVER)
+    {
+        s->early_data = ((gnutls_session_get_flags(s->session) & GNUTLS_SFLAGS_EARLY_DATA) != 0);
+    }
 
     if (s->type == TLS_SOCK_CLIENT)
     {
@@ -306,18 +337,85 @@ int tls_sock_handshake(tls_sock_t *s)
     }
 }
 
+/* the verification cache key covers the end-entity certificate,
+ * the expected common name and the credentials used to verify it
+ */
+int tls_sock_verify_key(tls_sock_t *s, const gnutls_datum_t *cert, const char *common_name, unsigned char *key)
+{
+    gnutls_certificate_credentials_t cred = NULL;
+    gnutls_hash_hd_t hash = {0};
+    int ret = 0;
+
+    ret = gnutls_credentials_get(s->session, GNUTLS_CRD_CERTIFICATE, (void **)&cred);
+    if (ret != GNUTLS_E_SUCCESS)
+    {
+        return SOCK_PEER_CERT_VERIFY_ERROR;
+    }
+    ret = gnutls_hash_init(&hash, GNUTLS_DIG_SHA256);
+    if (ret != GNUTLS_E_SUCCESS)
+    {
+        return SOCK_PEER_CERT_VERIFY_ERROR;
+    }
+    gnutls_hash(hash, cert->data, cert->size);
+    if (common_name != NULL)
+    {
+        gnutls_hash(hash, common_name, strlen(common_name));
+    }
+    gnutls_hash(hash, "", 1);
+    gnutls_hash(hash, &cred, sizeof(cred));
+    gnutls_hash_deinit(hash, key);
+    return SOCK_OK;
+}
+
+/* a peer certificate that was verified recently is accepted
+ * from the verification cache without parsing it again,
+ * the handshake has already proved that the peer holds the key
+ */
 int tls_sock_verify_peer_cert(tls_sock_t *s, const char *common_name)
 {
     gnutls_certificate_type_t cert_type = 0;
     const gnutls_datum_t *cert_list = NULL;
     gnutls_x509_crt_t cert = {0};
+    unsigned char key[TLS_VERIFY_KEY_SIZE] = {0};
     unsigned cert_list_size = 0;
     unsigned status = 0;
     time_t expiration_time = 0;
     time_t activation_time = 0;
     time_t current_time = 0;
+    time_t expire = 0;
+    int cache = 0;
     int ret = 0;
 
+    cert_type = gnutls_certificate_type_get(s->session);
+    if (cert_type != GNUTLS_CRT_X509)
+    {
+        coap_log_error("The peer certificate is not an X509 certificate");
+        return SOCK_PEER_CERT_VERIFY_ERROR;
+    }
+    cert_list = gnutls_certificate_get_peers(s->session, &cert_list_size);
+    if ((cert_list == NULL) || (cert_list_size == 0))
+    {
+        coap_log_error("No peer certificate found");
+        return SOCK_PEER_CERT_VERIFY_ERROR;
+    }
+    ret = tls_sock_verify_key(s, &cert_list[0], common_name, key);
+    if (ret == SOCK_OK)
+    {
+        cache = 1;
+        if (s->type == TLS_SOCK_CLIENT)
+        {
+            ret = tls_client_verify_get(s->u.client, key);
+        }
+        else
+        {
+            ret = tls_server_verify_get(s->u.server, key);
+        }
+        if (ret == 1)
+        {
+            coap_log_info("Peer certificate found in the verification cache");
+            return SOCK_OK;
+        }
+    }
     ret = gnutls_certificate_verify_peers2(s->session, &status);
     if (ret != GNUTLS_E_SUCCESS)
     {
@@ -344,25 +442,12 @@ int tls_sock_verify_peer_cert(tls_sock_t *s, const char *common_name)
         coap_log_error("The peer certificate has been revoked");
         return SOCK_PEER_CERT_VERIFY_ERROR;
     }
-    cert_type = gnutls_certificate_type_get(s->session);
-    if (cert_type != GNUTLS_CRT_X509)
-    {
-        coap_log_error("The peer certificate is not an X509 certificate");
-        return SOCK_PEER_CERT_VERIFY_ERROR;
-    }
     ret = gnutls_x509_crt_init(&cert);
     if (ret != GNUTLS_E_SUCCESS)
     {
         coap_log_error("Unable to initialise gnutls_x509_crt_t object");
         return SOCK_PEER_CERT_VERIFY_ERROR;
     }
-    cert_list = gnutls_certificate_get_peers(s->session, &cert_list_size);
-    if (cert_list == NULL)
-    {
-        coap_log_error("No peer certificate found");
-        gnutls_x509_crt_deinit(cert);
-        return SOCK_PEER_CERT_VERIFY_ERROR;
-    }
     /* We only check the first (leaf) certificate in the chain */
     ret = gnutls_x509_crt_import(cert, &cert_list[0], GNUTLS_X509_FMT_DER);
     if (ret != GNUTLS_E_SUCCESS)
@@ -396,6 +481,23 @@ int tls_sock_verify_peer_cert(tls_sock_t *s, const char *common_name)
             return SOCK_PEER_CERT_VERIFY_ERROR;
         }
     }
+    if (cache)
+    {
+        /* remember the result until the certificate expires, at most for the TTL */
+        expire = current_time + TLS_VERIFY_CACHE_TTL;
+        if (expiration_time < expire)
+        {
+            expire = expiration_time;
+        }
+        if (s->type == TLS_SOCK_CLIENT)
+        {
+            tls_client_verify_set(s->u.client, key, expire);
+        }
+        else
+        {
+            tls_server_verify_set(s->u.server, key, expire);
+        }
+    }
     coap_log_info("Peer certificate validated");
     gnutls_x509_crt_deinit(cert);
     return SOCK_OK;
@@ -501,6 +603,14 @@ void tls_sock_get_addr_string_(char *out, size_t out_len, sock_in_addr_t sin_add
     inet_ntop(SOCK_AF_INET, &sin_addr, out, out_len);
 }
 
+/* data read from early data could be a replay, data
+ * read after the handshake cannot
+ */
+int tls_sock_is_early(tls_sock_t *s)
+{
+    return s->early;
+}
+
 /*  return { > 0, number of bytes read
  *         {   0, connection closed
  *         { < 0, error
@@ -516,9 +626,21 @@ ssize_t tls_sock_read(tls_sock_t *s, void *buf, size_t len)
     tv.tv_usec = 0;
     while (1)
     {
+        if (s->early_data)
+        {
+            /* early data comes before any other application data */
+            num = gnutls_record_recv_early_data(s->session, buf, len);
+            if (num > 0)
+            {
+                s->early = 1;
+                return num;
+            }
+            s->early_data = 0;
+        }
         num = gnutls_record_recv(s->session, buf, len);
         if (num > 0)  /* data was read successfully */
         {
+            s->early = 0;
             return num;
         }
         if (num == 0)  /* EOF */
@@ -675,6 +797,7 @@ int tls_ssock_open(tls_ssock_t *ss, tls_server_t *server, const char *port, int
     }
 
     ss->server = server;
+    ss->cancel_fd = -1;
 
     /* open a socket */
     ss->sd = socket(SOCK_PF_INET, SOCK_STREAM, 0);
@@ -728,17 +851,64 @@ int tls_ssock_open(tls_ssock_t *ss, tls_server_t *server, const char *port, int
     return SOCK_OK;
 }
 
+/* adopt a listening socket inherited from another process */
+int tls_ssock_open_from_sd(tls_ssock_t *ss, tls_server_t *server, int sd, int timeout)
+{
+    socklen_t len = 0;
+    int opt_val = 0;
+    int ret = 0;
+
+    memset(ss, 0, sizeof(tls_ssock_t));
+
+    if ((sd < 0) || (timeout < 0))
+    {
+        return SOCK_ARG_ERROR;
+    }
+
+    ss->server = server;
+    ss->cancel_fd = -1;
+    ss->sd = sd;
+
+    /* check that the socket is listening */
+    len = (socklen_t)sizeof(opt_val);
+    ret = getsockopt(ss->sd, SOL_SOCKET, SO_ACCEPTCONN, &opt_val, &len);
+    if ((ret < 0) || (opt_val == 0))
+    {
+        return SOCK_LISTEN_ERROR;
+    }
+
+    len = (socklen_t)sizeof(ss->sin);
+    ret = getsockname(ss->sd, (struct sockaddr *)&ss->sin, &len);
+    if ((ret < 0) || (ss->sin.SOCK_SIN_FAMILY != SOCK_AF_INET))
+    {
+        return SOCK_ADDR_ERROR;
+    }
+
+    /* initialise timeout value */
+    ss->timeout = timeout;
+
+    /* set non-blocking status */
+    ret = set_non_blocking(ss->sd);
+    if (ret < 0)
+    {
+        return SOCK_CONFIG_ERROR;
+    }
+
+    return SOCK_OK;
+}
+
 void tls_ssock_close(tls_ssock_t *ss)
 {
     close(ss->sd);
     memset(ss, 0, sizeof(tls_ssock_t));
 }
 
-int tls_ssock_accept(tls_ssock_t *ss, tls_sock_t *s)
+int tls_ssock_accept_tcp(tls_ssock_t *ss, tls_sock_t *s)
 {
     struct timeval tv = {0};
     socklen_t addrlen = 0;
     fd_set readfds = {{0}};
+    int max_fd = 0;
     int ret = 0;
 
     memset(s, 0, sizeof(tls_sock_t));
@@ -766,7 +936,16 @@ int tls_ssock_accept(tls_ssock_t *ss, tls_sock_t *s)
         }
         FD_ZERO(&readfds);
         FD_SET(ss->sd, &readfds);
-        ret = select(ss->sd + 1, &readfds, NULL, NULL, &tv);
+        max_fd = ss->sd;
+        if (ss->cancel_fd >= 0)
+        {
+            FD_SET(ss->cancel_fd, &readfds);
+            if (ss->cancel_fd > max_fd)
+            {
+                max_fd = ss->cancel_fd;
+            }
+        }
+        ret = select(max_fd + 1, &readfds, NULL, NULL, &tv);
         if (ret == 0)
         {
             return SOCK_TIMEOUT;
@@ -779,9 +958,31 @@ int tls_ssock_accept(tls_ssock_t *ss, tls_sock_t *s)
             }
             return SOCK_ACCEPT_ERROR;
         }
+        if ((ss->cancel_fd >= 0) && (FD_ISSET(ss->cancel_fd, &readfds)))
+        {
+            return SOCK_INTR;
+        }
     }
 
     s->type = TLS_SOCK_SERVER;
     s->u.server = ss->server;
-    return tls_sock_open_(s, NULL, ss->timeout);
+    s->timeout = ss->timeout;
+    return SOCK_OK;
+}
+
+int tls_sock_accept_handshake(tls_sock_t *s)
+{
+    return tls_sock_open_(s, NULL, s->timeout);
+}
+
+int tls_ssock_accept(tls_ssock_t *ss, tls_sock_t *s)
+{
+    int ret = 0;
+
+    ret = tls_ssock_accept_tcp(ss, s);
+    if (ret != SOCK_OK)
+    {
+        return ret;
+    }
+    return tls_sock_accept_handshake(s);
 }
@@ -33,6 +33,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <ctype.h>
 #include "util.h"
 
 /*  always writes a terminating null character if dst_len > 0
@@ -149,3 +150,20 @@ long util_load_txt_file(const char *file_name, char **buf)
     }
     return num;
 }
+
+/*  case-insensitive FNV-1a hash of the first len chars of str
+ *  (or up to the terminating null character if that comes first)
+ *  suitable for host names and other DNS labels
+ */
+unsigned util_hash_str(const char *str, size_t len)
+{
+    unsigned hash = 2166136261u;
+    size_t i = 0;
+
+    for (i = 0; (i < len) && (str[i] != '\0'); i++)
+    {
+        hash ^= (unsigned char)tolower((unsigned char)str[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
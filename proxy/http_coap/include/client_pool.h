@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2015 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ *  @file client_pool.h
+ *
+ *  @brief Include file for the FreeCoAP HTTP/CoAP proxy client pool module
+ */
+
+#ifndef CLIENT_POOL_H
+#define CLIENT_POOL_H
+
+#include <time.h>
+#include "coap_client.h"
+#include "param.h"
+
+#define CLIENT_POOL_SIZE        256                                             /* max number of idle CoAP clients */
+#define CLIENT_POOL_HASH_SIZE    64                                             /* number of buckets, keyed on the CoAP server address and port */
+#define CLIENT_POOL_TTL          30                                             /* sec an idle CoAP client is kept */
+#define CLIENT_POOL_MAX_SWEEP     8                                             /* max number of expired clients removed by one call */
+
+typedef struct client_pool_element
+{
+    coap_client_t *client;                                                      /* NULL if the element is empty */
+    param_route_t *route;                                                       /* credentials the client was created with */
+    time_t expire;                                                              /* monotonic time (sec) at which the client is destroyed */
+    struct client_pool_element *next;                                           /* next element in the bucket or in the free list */
+    struct client_pool_element *older;                                          /* element that expires before this one */
+    struct client_pool_element *newer;                                          /* element that expires after this one */
+}
+client_pool_element_t;
+
+int client_pool_init(void);
+void client_pool_deinit(void);
+coap_client_t *client_pool_get(param_route_t *route, const char *addr, const char *port);
+void client_pool_put(param_route_t *route, coap_client_t *client);
+
+#endif
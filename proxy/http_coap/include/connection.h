@@ -34,13 +34,15 @@
 #ifndef CONNECTION_H
 #define CONNECTION_H
 
+#include <time.h>
 #include <netinet/in.h>
 #include "coap_client.h"
 #include "tls_sock.h"
 #include "data_buf.h"
 #include "param.h"
+#include "upstream.h"
 
-typedef struct
+typedef struct connection
 {
     unsigned listener_index;
     unsigned con_index;
@@ -50,14 +52,30 @@ typedef struct
     data_buf_t recv_buf;
     data_buf_t send_buf;
     param_t *param;
+    param_route_t *route;
     int coap_client_active;
     char *coap_client_host;
     char *coap_client_port;
-    coap_client_t coap_client;
+    coap_client_t *coap_client;                                                 /* taken from and returned to the client pool */
+    int hedge_client_active;
+    char *hedge_client_host;
+    char *hedge_client_port;
+    coap_client_t *hedge_client;
+    upstream_t *upstream;
+    int member_client_active[PARAM_MAX_UPSTREAM_MEMBERS];
+    coap_client_t *member_client[PARAM_MAX_UPSTREAM_MEMBERS];
+    unsigned num_parks;                                                         /* number of times the connection has been parked while idle */
+    time_t park_expire;                                                         /* monotonic time (sec) at which a parked connection is closed */
+    int park_status;                                                            /* non-zero if the park thread closed the connection */
+    struct connection *park_prev;
+    struct connection *park_next;
 }
 connection_t;
 
 int connection_init(void);
+int connection_get_drain_fd(void);
+unsigned connection_get_num_active(void);
+void connection_drain(void);
 void *connection_thread_func(void *data);
 connection_t *connection_new(tls_sock_t *sock, unsigned listener_index, unsigned con_index, param_t *param);
 void connection_delete(connection_t *con);
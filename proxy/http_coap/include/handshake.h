@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2015 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ *  @file handshake.h
+ *
+ *  @brief Include file for the FreeCoAP HTTP/CoAP proxy handshake module
+ */
+
+#ifndef HANDSHAKE_H
+#define HANDSHAKE_H
+
+#include "tls_sock.h"
+#include "param.h"
+
+#define HANDSHAKE_MAX_WORKERS  16
+
+/* an accepted connection waiting for its TLS handshake */
+typedef struct handshake_job
+{
+    tls_sock_t *sock;
+    unsigned listener_index;
+    unsigned con_index;
+    param_t *param;
+    struct handshake_job *next;
+}
+handshake_job_t;
+
+int handshake_init(param_t *param);
+void handshake_deinit(void);
+int handshake_wait(unsigned ms);
+int handshake_submit(tls_sock_t *sock, unsigned listener_index, unsigned con_index, param_t *param);
+
+#endif
@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2015 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ *  @file hedge.h
+ *
+ *  @brief Include file for the FreeCoAP HTTP/CoAP proxy hedge module
+ */
+
+#ifndef HEDGE_H
+#define HEDGE_H
+
+#include "lock.h"
+#include "param.h"
+
+#define HEDGE_MIN_DELAY_US  1000
+#define HEDGE_MAX_DELAY_US  (PARAM_MAX_HEDGE_DELAY * 1000)
+
+/* running state of a route with hedged requests */
+typedef struct hedge
+{
+    param_route_t *route;
+    unsigned est_us;                                                            /* running estimate of the 95th percentile exchange duration (usec) */
+    lock_t lock;                                                                /* protects est_us */
+    struct hedge *next;
+}
+hedge_t;
+
+int hedge_init(param_t *param);
+void hedge_deinit(void);
+hedge_t *hedge_find(param_route_t *route);
+unsigned hedge_get_delay(hedge_t *hedge);
+void hedge_update(hedge_t *hedge, unsigned elapsed_us);
+
+#endif
@@ -39,16 +39,19 @@
 #include "thread.h"
 #include "param.h"
 
+#define listener_get_sd(listener)  ((listener)->ssock.sd)
+
 typedef struct
 {
     unsigned index;
+    const char *port;
     param_t *param;
     thread_ctx_t ctx;
     tls_ssock_t ssock;
 }
 listener_t;
 
-listener_t *listener_new(unsigned index, tls_server_t *server, param_t *param, int timeout, int backlog);
+listener_t *listener_new(unsigned index, tls_server_t *server, param_t *param, const char *port, int sd, int timeout, int backlog);
 void listener_delete(listener_t *listener);
 int listener_run(listener_t *listener);
 
@@ -41,18 +41,124 @@
 #define PARAM_DEF_HTTP_SERVER_TRUST_FILE_NAME         "http_server_trust.pem"   /**< TLS trust file name */
 #define PARAM_DEF_HTTP_SERVER_CERT_FILE_NAME          "http_server_cert.pem"    /**< TLS certificate file name*/
 #define PARAM_DEF_HTTP_SERVER_KEY_FILE_NAME           "http_server_privkey.pem" /**< TLS key file name */
+#define PARAM_DEF_HTTP_SERVER_HANDSHAKE_WORKERS       2                         /**< Number of threads that perform TLS handshakes */
+#define PARAM_DEF_HTTP_SERVER_HANDSHAKE_QUEUE         64                        /**< Maximum number of accepted connections waiting for a TLS handshake */
 #define PARAM_DEF_COAP_CLIENT_TRUST_FILE_NAME         "coap_client_trust.pem"   /**< DTLS trust file name */
 #define PARAM_DEF_COAP_CLIENT_CERT_FILE_NAME          "coap_client_cert.pem"    /**< DTLS certificate file name */
 #define PARAM_DEF_COAP_CLIENT_KEY_FILE_NAME           "coap_client_privkey.pem" /**< DTLS key file name */
+#define PARAM_DEF_COAP_CLIENT_ACK_TIMEOUT             2                         /**< CoAP acknowledgement timeout (sec) */
+#define PARAM_DEF_COAP_CLIENT_MAX_RETRANSMIT          4                         /**< CoAP maximum number of retransmissions */
+#define PARAM_DEF_COAP_CLIENT_RESP_TIMEOUT            30                        /**< CoAP response timeout (sec) */
+#define PARAM_DEF_COAP_CLIENT_DEADLINE                0                         /**< Deadline for a CoAP exchange (msec), 0 for none */
+#define PARAM_DEF_COAP_CLIENT_HEDGE_DELAY             100                       /**< Initial delay before a hedged request is sent (msec) */
+#define PARAM_DEF_COAP_CLIENT_MAX_CONCURRENT          0                         /**< Maximum number of exchanges in progress with a CoAP server, 0 for no limit */
+#define PARAM_DEF_COAP_CLIENT_MAX_QUEUED              64                        /**< Maximum number of requests waiting for a CoAP server */
+#define PARAM_DEF_COAP_CLIENT_QUEUE_TIMEOUT           1000                      /**< Maximum time a request waits for a CoAP server (msec) */
+#define PARAM_DEF_DRAIN_TIMEOUT                       30                        /**< Maximum time to finish exchanges when stopping (sec) */
+#define PARAM_DEF_DNS_TTL                             60                        /**< Lifetime of a resolved host name (sec) */
+#define PARAM_DEF_DNS_NEG_TTL                         5                         /**< Lifetime of a failed host name resolution (sec) */
+#define PARAM_DEF_DNS_TIMEOUT                         1000                      /**< Maximum wait for an uncached host name (msec) */
+
+#define PARAM_MAX_MSEC                                86400000                  /**< Maximum value of a time given in msec (one day) */
+#define PARAM_MAX_HEDGE_DELAY                         60000                     /**< Maximum initial delay before a hedged request is sent (msec) */
+
+#define PARAM_MAX_PORTS                               16                        /**< Maximum number of listening ports */
+#define PARAM_ROUTE_HASH_SIZE                         64                        /**< Number of buckets in the route hash table */
+#define PARAM_VHOST_SECTION_PREFIX                    "vhost_"                  /**< Prefix for virtual host section names */
+#define PARAM_UPSTREAM_SECTION_PREFIX                 "upstream_"               /**< Prefix for upstream group section names */
+#define PARAM_MAX_UPSTREAM_MEMBERS                    8                         /**< Maximum number of CoAP servers in an upstream group */
+#define PARAM_DEF_UPSTREAM_POLICY                     "least_outstanding"       /**< Upstream load balancing policy */
+#define PARAM_DEF_UPSTREAM_MAX_FAILS                  1                         /**< Consecutive failures before a member is ejected */
+#define PARAM_DEF_UPSTREAM_EJECT_TIME                 30                        /**< Duration of an ejection (sec) */
+#define PARAM_DEF_UPSTREAM_PING_INTERVAL              10                        /**< Interval between CoAP pings to each member (sec), 0 for none */
+#define PARAM_ROUTE_SECTION_PREFIX                    "route_"                  /**< Prefix for upstream route section names */
+#define PARAM_CLIENT_SECTION_PREFIX                   "client_"                 /**< Prefix for HTTP client section names */
+#define PARAM_DEF_CLIENT_WEIGHT                       1                         /**< Share of a busy CoAP server given to an HTTP client without a client section */
 
 #define param_get_port(param)                         ((param)->port)
 #define param_get_max_log_level(param)                ((param)->max_log_level)
 #define param_get_http_server_key_file_name(param)    ((param)->http_server_key_file_name)
 #define param_get_http_server_cert_file_name(param)   ((param)->http_server_cert_file_name)
 #define param_get_http_server_trust_file_name(param)  ((param)->http_server_trust_file_name)
+#define param_get_http_server_handshake_workers(param)  ((param)->http_server_handshake_workers)
+#define param_get_http_server_handshake_queue(param)  ((param)->http_server_handshake_queue)
 #define param_get_coap_client_key_file_name(param)    ((param)->coap_client_key_file_name)
 #define param_get_coap_client_cert_file_name(param)   ((param)->coap_client_cert_file_name)
 #define param_get_coap_client_trust_file_name(param)  ((param)->coap_client_trust_file_name)
+#define param_get_num_ports(param)                    ((param)->num_ports)
+#define param_get_port_n(param, n)                    ((param)->ports[n])
+#define param_get_first_vhost(param)                  ((param)->vhost)
+#define param_get_default_route(param)                (&(param)->def_route)
+#define param_get_first_upstream(param)               ((param)->upstream)
+#define param_get_drain_timeout(param)                ((param)->drain_timeout)
+#define param_get_dns_ttl(param)                      ((param)->dns_ttl)
+#define param_get_dns_neg_ttl(param)                  ((param)->dns_neg_ttl)
+#define param_get_dns_timeout(param)                  ((param)->dns_timeout)
+#define param_get_first_client(param)                 ((param)->client)
+
+/* virtual host selected by the server name indication (SNI) from the HTTP client */
+typedef struct param_vhost
+{
+    char *server_name;
+    char *cert_file_name;
+    char *key_file_name;
+    struct param_vhost *next;
+}
+param_vhost_t;
+
+/* settings used to connect to a CoAP server */
+typedef struct param_route
+{
+    char *host;                                                                 /* CoAP server host name or first label of the host name */
+    char *coap_client_key_file_name;
+    char *coap_client_cert_file_name;
+    char *coap_client_trust_file_name;
+    unsigned coap_client_ack_timeout;
+    unsigned coap_client_max_retransmit;
+    unsigned coap_client_resp_timeout;
+    unsigned coap_client_deadline;                                              /* maximum duration of an exchange (msec), 0 for none */
+    char *coap_client_hedge_host;                                               /* alternate CoAP server for hedged requests, NULL for none */
+    char *coap_client_hedge_port;                                               /* port of the alternate CoAP server, NULL for the request port */
+    unsigned coap_client_hedge_delay;                                           /* initial delay before a hedged request is sent (msec) */
+    unsigned coap_client_max_concurrent;                                        /* maximum number of exchanges in progress, 0 for no limit */
+    unsigned coap_client_max_queued;                                            /* maximum number of requests waiting when the limit is reached */
+    unsigned coap_client_queue_timeout;                                         /* maximum time a request waits (msec) */
+    struct param_route *next;                                                   /* next route in the same hash bucket */
+}
+param_route_t;
+
+typedef enum
+{
+    PARAM_UPSTREAM_LEAST_OUTSTANDING = 0,                                       /* fewest requests in progress */
+    PARAM_UPSTREAM_EWMA                                                         /* lowest moving average latency weighted by requests in progress */
+}
+param_upstream_policy_t;
+
+/* group of replicated CoAP servers addressed by a logical host name */
+typedef struct param_upstream
+{
+    char *name;                                                                 /* logical host name used in request URIs */
+    param_upstream_policy_t policy;
+    char *member_host[PARAM_MAX_UPSTREAM_MEMBERS];
+    char *member_port[PARAM_MAX_UPSTREAM_MEMBERS];
+    unsigned num_members;
+    unsigned max_fails;
+    unsigned eject_time;                                                        /* sec */
+    unsigned ping_interval;                                                     /* sec, 0 for none */
+    struct param_upstream *next;
+}
+param_upstream_t;
+
+/* share of a busy CoAP server given to an HTTP client identified
+ * by its API key or, if it does not send one, by its address
+ */
+typedef struct param_client
+{
+    char *name;                                                                 /* API key or address */
+    unsigned weight;
+    struct param_client *next;
+}
+param_client_t;
 
 typedef struct
 {
@@ -61,13 +167,28 @@ typedef struct
     char *http_server_key_file_name;
     char *http_server_cert_file_name;
     char *http_server_trust_file_name;
+    unsigned http_server_handshake_workers;
+    unsigned http_server_handshake_queue;
     char *coap_client_key_file_name;
     char *coap_client_cert_file_name;
     char *coap_client_trust_file_name;
+    char *ports[PARAM_MAX_PORTS];
+    unsigned num_ports;
+    param_vhost_t *vhost;
+    param_route_t def_route;
+    param_route_t *route[PARAM_ROUTE_HASH_SIZE];
+    param_upstream_t *upstream;
+    param_client_t *client;
+    unsigned drain_timeout;                                                     /* sec */
+    unsigned dns_ttl;                                                           /* sec */
+    unsigned dns_neg_ttl;                                                       /* sec */
+    unsigned dns_timeout;                                                       /* msec */
 }
 param_t;
 
 int param_create(param_t *param, const char *file_name);
 void param_destroy(param_t *param);
+param_route_t *param_get_route(param_t *param, const char *host);
+unsigned param_get_client_weight(param_t *param, const char *name);
 
 #endif
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2015 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ *  @file scheduler.h
+ *
+ *  @brief Include file for the FreeCoAP HTTP/CoAP proxy scheduler module
+ */
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <time.h>
+#include <pthread.h>
+#include "param.h"
+
+#define SCHEDULER_MAX_SERVERS   64                                              /* number of CoAP servers with their own queue */
+#define SCHEDULER_HOST_BUF_LEN  256
+#define SCHEDULER_PORT_BUF_LEN  8
+#define SCHEDULER_FLOW_BUF_LEN  64
+
+/* requests from one HTTP client (API key or address) */
+typedef struct scheduler_flow
+{
+    char name[SCHEDULER_FLOW_BUF_LEN];
+    unsigned long long finish;                                                  /* virtual finish time of the latest request */
+    unsigned num_queued;
+    struct scheduler_flow *next;
+}
+scheduler_flow_t;
+
+/* a request waiting for a CoAP server */
+typedef struct scheduler_waiter
+{
+    unsigned long long start;                                                   /* virtual start time */
+    unsigned long long finish;                                                  /* virtual finish time */
+    pthread_cond_t cond;                                                        /* signalled when the request may proceed */
+    int granted;
+    scheduler_flow_t *flow;
+    struct scheduler_waiter *next;
+}
+scheduler_waiter_t;
+
+typedef struct
+{
+    char host[SCHEDULER_HOST_BUF_LEN];                                          /* empty if the entry is unused */
+    char port[SCHEDULER_PORT_BUF_LEN];
+    unsigned max_active;
+    unsigned num_active;                                                        /* exchanges in progress */
+    unsigned num_queued;
+    unsigned long long vtime;                                                   /* virtual start time of the latest request to proceed */
+    scheduler_waiter_t *queue;                                                  /* in order of virtual finish time */
+    scheduler_flow_t *flow;
+    time_t last_used;                                                           /* monotonic time (sec) */
+}
+scheduler_server_t;
+
+int scheduler_init(void);
+void scheduler_deinit(void);
+int scheduler_acquire(param_route_t *route, const char *host, const char *port, const char *flow, unsigned weight, const struct timespec *deadline, scheduler_server_t **server);
+void scheduler_release(scheduler_server_t *server);
+
+#endif
@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2015 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ *  @file upstream.h
+ *
+ *  @brief Include file for the FreeCoAP HTTP/CoAP proxy upstream module
+ */
+
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+#include <time.h>
+#include "coap_client.h"
+#include "thread.h"
+#include "lock.h"
+#include "param.h"
+
+#define upstream_get_name(upstream)             ((upstream)->param->name)
+#define upstream_get_num_members(upstream)      ((upstream)->param->num_members)
+#define upstream_get_member_host(upstream, i)   ((upstream)->param->member_host[i])
+#define upstream_get_member_port(upstream, i)   ((upstream)->param->member_port[i])
+
+typedef struct
+{
+    unsigned outstanding;                                                       /* requests in progress */
+    unsigned ewma_us;                                                           /* moving average of the exchange duration (usec) */
+    unsigned fails;                                                             /* consecutive failures */
+    time_t eject_until;                                                         /* monotonic time (sec) at which an ejection ends, 0 if not ejected */
+    time_t next_ping;                                                           /* monotonic time (sec) of the next CoAP ping */
+    int probe_client_active;
+    coap_client_t probe_client;                                                 /* used only by the probe thread */
+}
+upstream_member_t;
+
+typedef struct upstream
+{
+    param_upstream_t *param;
+    param_route_t *route;                                                       /* credentials and transmission parameters */
+    upstream_member_t member[PARAM_MAX_UPSTREAM_MEMBERS];
+    unsigned next_index;                                                        /* rotates the start of the search between equal members */
+    lock_t lock;                                                                /* protects the member state shared with connection threads */
+    struct upstream *next;
+}
+upstream_t;
+
+int upstream_init(param_t *param);
+void upstream_deinit(void);
+upstream_t *upstream_find(const char *name);
+int upstream_select(upstream_t *upstream);
+void upstream_release(upstream_t *upstream, unsigned index, int result, unsigned elapsed_us);
+
+#endif
@@ -0,0 +1,268 @@
+/*
+ * Copyright (c) 2015 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ *  @file client_pool.c
+ *
+ *  @brief Source file for the FreeCoAP HTTP/CoAP proxy client pool module
+ *
+ *  Idle connections return their CoAP client here so that
+ *  the DTLS session to a CoAP server outlives the connection
+ *  that set it up and can be picked up by any other connection
+ *  with the same route to the same server.
+ *
+ *  Idle clients are kept in buckets keyed on the server address
+ *  and port and on a list in order of expiry, so taking and
+ *  returning a client does not scan the pool. Clients are
+ *  destroyed after the lock is released because closing a DTLS
+ *  session sends an alert to the server.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "client_pool.h"
+#include "lock.h"
+#include "util.h"
+#include "coap_log.h"
+
+static client_pool_element_t *pool = NULL;
+static client_pool_element_t *pool_bucket[CLIENT_POOL_HASH_SIZE] = {NULL};
+static client_pool_element_t *pool_free = NULL;
+static client_pool_element_t *pool_oldest = NULL;                               /* every client has the same TTL so the */
+static client_pool_element_t *pool_newest = NULL;                               /* order of insertion is the order of expiry */
+static lock_t pool_lock;
+
+static time_t client_pool_now(void)
+{
+    struct timespec ts = {0};
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static unsigned client_pool_hash(const char *addr, const char *port)
+{
+    unsigned hash = 0;
+
+    hash = util_hash_str(addr, COAP_CLIENT_HOST_BUF_LEN);
+    hash = hash * 31 + util_hash_str(port, COAP_CLIENT_PORT_BUF_LEN);
+    return hash % CLIENT_POOL_HASH_SIZE;
+}
+
+static void client_pool_destroy_client(coap_client_t *client)
+{
+    coap_client_destroy(client);
+    free(client);
+}
+
+/* unlink an element from its bucket and the age list,
+ * return it to the free list and return its client
+ */
+static coap_client_t *client_pool_remove(client_pool_element_t *element)
+{
+    client_pool_element_t **prev = NULL;
+    coap_client_t *client = NULL;
+
+    client = element->client;
+    prev = &pool_bucket[client_pool_hash(client->server_host, client->server_port)];
+    while (*prev != element)
+    {
+        prev = &(*prev)->next;
+    }
+    *prev = element->next;
+    if (element->older != NULL)
+    {
+        element->older->newer = element->newer;
+    }
+    else
+    {
+        pool_oldest = element->newer;
+    }
+    if (element->newer != NULL)
+    {
+        element->newer->older = element->older;
+    }
+    else
+    {
+        pool_newest = element->older;
+    }
+    memset(element, 0, sizeof(client_pool_element_t));
+    element->next = pool_free;
+    pool_free = element;
+    return client;
+}
+
+/* remove up to CLIENT_POOL_MAX_SWEEP expired clients
+ * and return them in dead so that they can be destroyed
+ * after the lock is released
+ */
+static unsigned client_pool_sweep(time_t now, coap_client_t **dead)
+{
+    unsigned num = 0;
+
+    while ((pool_oldest != NULL)
+        && (pool_oldest->expire <= now)
+        && (num < CLIENT_POOL_MAX_SWEEP))
+    {
+        dead[num++] = client_pool_remove(pool_oldest);
+    }
+    return num;
+}
+
+int client_pool_init(void)
+{
+    unsigned i = 0;
+    int ret = 0;
+
+    pool = (client_pool_element_t *)calloc(CLIENT_POOL_SIZE, sizeof(client_pool_element_t));
+    if (pool == NULL)
+    {
+        return -ENOMEM;
+    }
+    ret = lock_create(&pool_lock);
+    if (ret < 0)
+    {
+        free(pool);
+        pool = NULL;
+        return ret;
+    }
+    memset(pool_bucket, 0, sizeof(pool_bucket));
+    pool_free = NULL;
+    for (i = 0; i < CLIENT_POOL_SIZE; i++)
+    {
+        pool[i].next = pool_free;
+        pool_free = &pool[i];
+    }
+    pool_oldest = NULL;
+    pool_newest = NULL;
+    return 0;
+}
+
+void client_pool_deinit(void)
+{
+    unsigned i = 0;
+
+    if (pool == NULL)
+    {
+        return;
+    }
+    for (i = 0; i < CLIENT_POOL_SIZE; i++)
+    {
+        if (pool[i].client != NULL)
+        {
+            client_pool_destroy_client(pool[i].client);
+        }
+    }
+    lock_destroy(&pool_lock);
+    free(pool);
+    pool = NULL;
+    memset(pool_bucket, 0, sizeof(pool_bucket));
+    pool_free = NULL;
+    pool_oldest = NULL;
+    pool_newest = NULL;
+}
+
+/* take an idle CoAP client connected to addr and port with the
+ * credentials of route, NULL if there is none
+ */
+coap_client_t *client_pool_get(param_route_t *route, const char *addr, const char *port)
+{
+    client_pool_element_t *element = NULL;
+    coap_client_t *dead[CLIENT_POOL_MAX_SWEEP] = {NULL};
+    coap_client_t *client = NULL;
+    time_t now = 0;
+    unsigned num = 0;
+    unsigned i = 0;
+
+    now = client_pool_now();
+    lock_get(&pool_lock);
+    num = client_pool_sweep(now, dead);
+    element = pool_bucket[client_pool_hash(addr, port)];
+    while (element != NULL)
+    {
+        /* the newest client is at the head of the bucket */
+        if ((element->route == route)
+         && (element->expire > now)
+         && (strcmp(element->client->server_host, addr) == 0)
+         && (strcmp(element->client->server_port, port) == 0))
+        {
+            client = client_pool_remove(element);
+            break;
+        }
+        element = element->next;
+    }
+    lock_put(&pool_lock);
+    for (i = 0; i < num; i++)
+    {
+        client_pool_destroy_client(dead[i]);
+    }
+    return client;
+}
+
+/* keep an idle CoAP client, replacing the oldest one if the pool is full */
+void client_pool_put(param_route_t *route, coap_client_t *client)
+{
+    client_pool_element_t *element = NULL;
+    coap_client_t *dead[CLIENT_POOL_MAX_SWEEP + 1] = {NULL};
+    unsigned bucket = 0;
+    time_t now = 0;
+    unsigned num = 0;
+    unsigned i = 0;
+
+    now = client_pool_now();
+    bucket = client_pool_hash(client->server_host, client->server_port);
+    lock_get(&pool_lock);
+    num = client_pool_sweep(now, dead);
+    if (pool_free == NULL)
+    {
+        dead[num++] = client_pool_remove(pool_oldest);
+    }
+    element = pool_free;
+    pool_free = element->next;
+    element->client = client;
+    element->route = route;
+    element->expire = now + CLIENT_POOL_TTL;
+    element->next = pool_bucket[bucket];
+    pool_bucket[bucket] = element;
+    element->older = pool_newest;
+    element->newer = NULL;
+    if (pool_newest != NULL)
+    {
+        pool_newest->newer = element;
+    }
+    else
+    {
+        pool_oldest = element;
+    }
+    pool_newest = element;
+    lock_put(&pool_lock);
+    for (i = 0; i < num; i++)
+    {
+        client_pool_destroy_client(dead[i]);
+    }
+}
@@ -37,27 +37,64 @@
 #include <signal.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdint.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <strings.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
 #include "connection.h"
+#include "client_pool.h"
+#include "scheduler.h"
+#include "resolver.h"
+#include "hedge.h"
 #include "http_msg.h"
 #include "uri.h"
 #include "cross.h"
 #include "thread.h"
 #include "lock.h"
 #include "coap_log.h"
+#include "coap_trace.h"
 
 #define CONNECTION_MSG_BODY_BUF_SIZE   1024
 #define CONNECTION_DATA_BUF_SIZE       4096
 #define CONNECTION_DATA_BUF_MAX_SIZE   (8 * CONNECTION_DATA_BUF_SIZE)
 #define CONNECTION_DATA_BUF_MIN_SPACE  128
 #define CONNECTION_INT_BUF_LEN         16
+#define CONNECTION_DEADLINE_HEADER     "X-Request-Timeout"                     /* deadline requested by the HTTP client (msec) */
+#define CONNECTION_API_KEY_HEADER      "X-API-Key"                             /* identifies the HTTP client to the scheduler */
+#define CONNECTION_RETRY_AFTER         "1"                                     /* sec, sent when a CoAP server is too busy */
+#define CONNECTION_HEDGE_MAX_IDLE      8                                       /* max number of idle hedge workers kept for reuse */
+#define CONNECTION_BUF_POOL_SIZE       1024                                    /* max number of idle data buffers kept for reuse */
+#define CONNECTION_PARK_DELAY_MS       100                                     /* an idle connection is parked after this time */
+#define CONNECTION_PARK_MAX_EVENTS     64
+#define CONNECTION_BATCH_PATH          "/batch"                                /* request-target of a multi-get batch request */
+#define CONNECTION_BATCH_BOUNDARY      "freecoap-batch"
+#define CONNECTION_BATCH_MAX_TARGETS   64
+#define CONNECTION_BATCH_MAX_WORKERS   8                                       /* max number of concurrent CoAP exchanges per batch request */
+#define CONNECTION_BATCH_PART_BUF_LEN  1024
 
 typedef enum
 {
     CON_RET_TIMEDOUT = 1,
     CON_RET_CLOSED = 2,
+    CON_RET_DRAINED = 3
 }
 con_ret_t;
 
+static lock_t active_lock;                                                      /* protects num_active */
+static unsigned num_active = 0;                                                 /* number of connections with HTTP clients */
+static int drain_fd = -1;                                                       /* readable once the proxy starts draining */
+static int draining = 0;
+static data_buf_pool_t buf_pool;                                                /* data buffers released by parked connections */
+static lock_t park_lock;                                                        /* protects the parked list and num_parked */
+static connection_t *park_head = NULL;                                          /* parked connections in order of expiry */
+static connection_t *park_tail = NULL;
+static unsigned num_parked = 0;
+static int park_fd = -1;                                                        /* epoll descriptor watching parked connections */
+static thread_ctx_t park_ctx;                                                   /* resumed connection threads are detached */
+
 #ifdef CONNECTION_STATS
 
 #define STATS_BUF_LEN  256
@@ -68,6 +105,8 @@ typedef struct
     unsigned fail_con;
     unsigned ok_trans;
     unsigned fail_trans;
+    unsigned early_trans;                                                       /* requests served from TLS 1.3 early data */
+    unsigned too_early_trans;                                                   /* requests in early data refused with 425 (Too Early) */
     lock_t lock;
 }
 connection_stats_t;
@@ -80,6 +119,8 @@ connection_stats_t stats = {0};
 #define stats_fail_con()    {stats_lock(); stats.fail_con++;    stats_unlock();}
 #define stats_ok_trans()    {stats_lock(); stats.ok_trans++;    stats_unlock();}
 #define stats_fail_trans()  {stats_lock(); stats.fail_trans++;  stats_unlock();}
+#define stats_early_trans()      {stats_lock(); stats.early_trans++;      stats_unlock();}
+#define stats_too_early_trans()  {stats_lock(); stats.too_early_trans++;  stats_unlock();}
 
 static int stats_init(void)
 {
@@ -95,6 +136,11 @@ static void stats_log(void)
     coap_log_info("Failed connections:  %u", stats.fail_con);
     coap_log_info("OK transactions:     %u", stats.ok_trans);
     coap_log_info("Failed transactions: %u", stats.fail_trans);
+    coap_log_info("Early transactions:  %u", stats.early_trans);
+    coap_log_info("Too early:           %u", stats.too_early_trans);
+    lock_get(&park_lock);
+    coap_log_info("Parked connections:  %u", num_parked);
+    lock_put(&park_lock);
     fflush(stdout);
 
     stats_unlock();
@@ -106,6 +152,8 @@ static void stats_log(void)
 #define stats_fail_con()
 #define stats_ok_trans()
 #define stats_fail_trans()
+#define stats_early_trans()
+#define stats_too_early_trans()
 #define stats_log()
 
 static int stats_init(void)
@@ -115,30 +163,134 @@ static int stats_init(void)
 
 #endif  /* CONNECTION_STATS */
 
+static int connection_park_init(void);
+static int connection_hedge_init(void);
+
 int connection_init(void)
 {
+    int ret = 0;
+
+    ret = lock_create(&active_lock);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    drain_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (drain_fd < 0)
+    {
+        lock_destroy(&active_lock);
+        return -errno;
+    }
+    ret = data_buf_pool_create(&buf_pool, CONNECTION_DATA_BUF_SIZE, CONNECTION_BUF_POOL_SIZE);
+    if (ret < 0)
+    {
+        close(drain_fd);
+        lock_destroy(&active_lock);
+        return ret;
+    }
+    ret = connection_park_init();
+    if (ret < 0)
+    {
+        data_buf_pool_destroy(&buf_pool);
+        close(drain_fd);
+        lock_destroy(&active_lock);
+        return ret;
+    }
+    ret = connection_hedge_init();
+    if (ret < 0)
+    {
+        data_buf_pool_destroy(&buf_pool);
+        close(drain_fd);
+        lock_destroy(&active_lock);
+        return ret;
+    }
     return stats_init();
 }
 
+int connection_get_drain_fd(void)
+{
+    return drain_fd;
+}
+
+unsigned connection_get_num_active(void)
+{
+    unsigned num = 0;
+
+    lock_get(&active_lock);
+    num = num_active;
+    lock_put(&active_lock);
+    return num;
+}
+
+/*  return: { 0, success
+ *          {<0, error
+ */
+static int connection_client_new(coap_client_t **client, param_route_t *route, const char *addr, const char *port)
+{
+    int ret = 0;
+
+    *client = (coap_client_t *)malloc(sizeof(coap_client_t));
+    if (*client == NULL)
+    {
+        return -ENOMEM;
+    }
+    ret = coap_client_create(*client,
+                             addr,
+                             port,
+                             route->coap_client_key_file_name,
+                             route->coap_client_cert_file_name,
+                             route->coap_client_trust_file_name,
+                             NULL,
+                             NULL);
+    if (ret < 0)
+    {
+        free(*client);
+        *client = NULL;
+        return ret;
+    }
+    return 0;
+}
+
+static void connection_client_free(coap_client_t **client)
+{
+    if (*client != NULL)
+    {
+        coap_client_destroy(*client);
+        free(*client);
+        *client = NULL;
+    }
+}
+
 /*  return: { 0, success
  *          {<0, error
  */
 static int connection_coap_client_create(connection_t *con, uri_t *uri)
 {
+    char addr[COAP_CLIENT_HOST_BUF_LEN] = {0};
+    param_route_t *route = NULL;
     int ret = 0;
 
-    coap_log_info("[%u] <%u> %s Connecting to CoAP server host %s and port %s",
+    route = param_get_route(con->param, uri_get_host(uri));
+
+    ret = resolver_lookup(uri_get_host(uri), addr, sizeof(addr));
+    if (ret < 0)
+    {
+        coap_log_error("[%u] <%u> %s Failed to resolve CoAP server host %s: %s",
+                       con->listener_index, con->con_index, con->addr,
+                       uri_get_host(uri), strerror(-ret));
+        return ret;
+    }
+
+    coap_log_info("[%u] <%u> %s Connecting to CoAP server host %s (%s) and port %s",
                   con->listener_index, con->con_index, con->addr,
-                  uri_get_host(uri), uri_get_port(uri));
+                  uri_get_host(uri), addr, uri_get_port(uri));
 
-    ret = coap_client_create(&con->coap_client,
-                            uri_get_host(uri),
-                            uri_get_port(uri),
-                            param_get_coap_client_key_file_name(con->param),
-                            param_get_coap_client_cert_file_name(con->param),
-                            param_get_coap_client_trust_file_name(con->param),
-                            NULL,
-                            NULL);
+    /* pick up the DTLS session of an idle connection if there is one */
+    con->coap_client = client_pool_get(route, addr, uri_get_port(uri));
+    if (con->coap_client == NULL)
+    {
+        ret = connection_client_new(&con->coap_client, route, addr, uri_get_port(uri));
+    }
     if (ret < 0)
     {
         coap_log_error("[%u] <%u> %s Failed to connect to CoAP server host %s and port %s: %s",
@@ -147,10 +299,23 @@ static int connection_coap_client_create(connection_t *con, uri_t *uri)
                        strerror(-ret));
         return ret;
     }
+    con->route = route;
+    ret = coap_client_set_timeouts(con->coap_client,
+                                   route->coap_client_ack_timeout,
+                                   route->coap_client_max_retransmit,
+                                   route->coap_client_resp_timeout);
+    if (ret < 0)
+    {
+        connection_client_free(&con->coap_client);
+        coap_log_error("[%u] <%u> %s Invalid timeouts for CoAP server host %s: %s",
+                       con->listener_index, con->con_index, con->addr,
+                       uri_get_host(uri), strerror(-ret));
+        return ret;
+    }
     con->coap_client_host = strdup(uri->host);
     if (con->coap_client_host == NULL)
     {
-        coap_client_destroy(&con->coap_client);
+        connection_client_free(&con->coap_client);
         coap_log_error("[%u] <%u> %s Out-of-memory",
                        con->listener_index, con->con_index, con->addr);
         return -ENOMEM;
@@ -160,7 +325,7 @@ static int connection_coap_client_create(connection_t *con, uri_t *uri)
     {
         free(con->coap_client_host);
         con->coap_client_host = NULL;
-        coap_client_destroy(&con->coap_client);
+        connection_client_free(&con->coap_client);
         coap_log_error("[%u] <%u> %s Out-of-memory",
                        con->listener_index, con->con_index, con->addr);
         return -ENOMEM;
@@ -179,174 +344,1507 @@ static void connection_coap_client_destroy(connection_t *con)
     con->coap_client_port = NULL;
     free(con->coap_client_host);
     con->coap_client_host = NULL;
-    coap_client_destroy(&con->coap_client);
+    connection_client_free(&con->coap_client);
 }
 
-/*  return: { CON_RET_CLOSED,   socket closed remotely
- *          { CON_RET_TIMEDOUT, timeout
- *          { 0,                success
- *          {<0,                error
+/* keep the CoAP client, and its DTLS session, for use by another connection */
+static void connection_coap_client_release(connection_t *con)
+{
+    coap_log_debug("[%u] <%u> %s Releasing connection to CoAP server host %s and port %s",
+                   con->listener_index, con->con_index, con->addr,
+                   con->coap_client_host, con->coap_client_port);
+    con->coap_client_active = 0;
+    free(con->coap_client_port);
+    con->coap_client_port = NULL;
+    free(con->coap_client_host);
+    con->coap_client_host = NULL;
+    client_pool_put(con->route, con->coap_client);
+    con->coap_client = NULL;
+}
+
+static void connection_hedge_client_destroy(connection_t *con)
+{
+    coap_log_info("[%u] <%u> %s Disconnecting from alternate CoAP server host %s and port %s",
+                  con->listener_index, con->con_index, con->addr,
+                  con->hedge_client_host, con->hedge_client_port);
+    con->hedge_client_active = 0;
+    free(con->hedge_client_port);
+    con->hedge_client_port = NULL;
+    free(con->hedge_client_host);
+    con->hedge_client_host = NULL;
+    connection_client_free(&con->hedge_client);
+}
+
+/*  return: { 0, success
+ *          {<0, error
  */
-static int connection_recv(connection_t *con, http_msg_t *msg)
+static int connection_hedge_client_create(connection_t *con)
 {
-    struct timeval tv = {0};
-    ssize_t num = 0;
-    fd_set readfds = {{0}};
+    char addr[COAP_CLIENT_HOST_BUF_LEN] = {0};
+    param_route_t *route = con->route;
+    const char *host = NULL;
+    const char *port = NULL;
     int ret = 0;
-    int sd = 0;
 
-    tv.tv_sec = tls_sock_get_timeout(con->sock);
-    tv.tv_usec = 0;
-    sd = tls_sock_get_sd(con->sock);
-    while (1)
+    host = route->coap_client_hedge_host;
+    port = route->coap_client_hedge_port;
+    if (port == NULL)
     {
-        FD_ZERO(&readfds);
-        FD_SET(sd, &readfds);
-        errno = 0;
-        ret = select(sd + 1, &readfds, NULL, NULL, &tv);
-        if (ret == 0)
-        {
-            coap_log_info("[%u] <%u> %s Timed out waiting to read from socket connected to HTTP client",
-                          con->listener_index, con->con_index, con->addr);
-            return CON_RET_TIMEDOUT;
-        }
-        else if (ret == -1)
-        {
-            coap_log_error("[%u] <%u> %s Call to select returned: -1, errno: %d (%s)",
-                           con->listener_index, con->con_index, con->addr, errno, strerror(errno));
-            return -errno;
-        }
-        num = tls_sock_read(con->sock, data_buf_get_next(&con->recv_buf), data_buf_get_space(&con->recv_buf));
-        if (num < 0)
-        {
-            coap_log_error("[%u] <%u> %s Failed to read from socket connected to HTTP client: %s",
-                           con->listener_index, con->con_index, con->addr, sock_strerror(num));
-            return -1;
-        }
-        if (num == 0)
-        {
-            coap_log_info("[%u] <%u> %s Socket connection to HTTP client closed remotely",
-                          con->listener_index, con->con_index, con->addr);
-            return CON_RET_CLOSED;
-        }
-        data_buf_add(&con->recv_buf, num);
-        num = http_msg_parse(msg, data_buf_get_data(&con->recv_buf), data_buf_get_count(&con->recv_buf));
-        if (num > 0)
+        port = con->coap_client_port;
+    }
+    if (con->hedge_client_active)
+    {
+        if ((strcasecmp(host, con->hedge_client_host) == 0)
+         && (strcmp(port, con->hedge_client_port) == 0))
         {
-            data_buf_consume(&con->recv_buf, num);
-            coap_log_debug("[%u] <%u> %s Received from HTTP client: %s %s %s",
-                           con->listener_index, con->con_index, con->addr,
-                           http_msg_get_start(msg, 0),
-                           http_msg_get_start(msg, 1),
-                           http_msg_get_start(msg, 2));
-            return 0;  /* success */
+            return 0;
         }
-        else if (num == -EAGAIN)
+        connection_hedge_client_destroy(con);
+    }
+
+    ret = resolver_lookup(host, addr, sizeof(addr));
+    if (ret < 0)
+    {
+        coap_log_error("[%u] <%u> %s Failed to resolve alternate CoAP server host %s: %s",
+                       con->listener_index, con->con_index, con->addr,
+                       host, strerror(-ret));
+        return ret;
+    }
+
+    coap_log_info("[%u] <%u> %s Connecting to alternate CoAP server host %s (%s) and port %s",
+                  con->listener_index, con->con_index, con->addr, host, addr, port);
+
+    ret = connection_client_new(&con->hedge_client, route, addr, port);
+    if (ret < 0)
+    {
+        coap_log_error("[%u] <%u> %s Failed to connect to alternate CoAP server host %s and port %s: %s",
+                       con->listener_index, con->con_index, con->addr,
+                       host, port, strerror(-ret));
+        return ret;
+    }
+    ret = coap_client_set_timeouts(con->hedge_client,
+                                   route->coap_client_ack_timeout,
+                                   route->coap_client_max_retransmit,
+                                   route->coap_client_resp_timeout);
+    if (ret < 0)
+    {
+        connection_client_free(&con->hedge_client);
+        return ret;
+    }
+    con->hedge_client_host = strdup(host);
+    con->hedge_client_port = strdup(port);
+    if ((con->hedge_client_host == NULL) || (con->hedge_client_port == NULL))
+    {
+        free(con->hedge_client_port);
+        con->hedge_client_port = NULL;
+        free(con->hedge_client_host);
+        con->hedge_client_host = NULL;
+        connection_client_free(&con->hedge_client);
+        coap_log_error("[%u] <%u> %s Out-of-memory",
+                       con->listener_index, con->con_index, con->addr);
+        return -ENOMEM;
+    }
+    con->hedge_client_active = 1;
+    return 0;
+}
+
+/* deadline in msec requested by the HTTP client, 0 for none */
+static unsigned connection_get_req_deadline(http_msg_t *req_msg)
+{
+    http_msg_header_t *header = NULL;
+    unsigned long msec = 0;
+    char *end = NULL;
+
+    header = http_msg_get_first_header(req_msg);
+    while (header != NULL)
+    {
+        if (strcasecmp(http_msg_header_get_name(header), CONNECTION_DEADLINE_HEADER) == 0)
         {
-            coap_log_debug("[%u] <%u> %s Received incomplete request message from HTTP client",
-                           con->listener_index, con->con_index, con->addr);
-            if (data_buf_get_space(&con->recv_buf) < CONNECTION_DATA_BUF_MIN_SPACE)
+            msec = strtoul(http_msg_header_get_value(header), &end, 10);
+            if ((end == http_msg_header_get_value(header)) || (*end != '\0') || (msec > UINT32_MAX))
             {
-                coap_log_debug("[%u] <%u> %s Increasing size of receive buffer",
-                               con->listener_index, con->con_index, con->addr);
-                ret = data_buf_expand(&con->recv_buf);
-                if (ret == -EINVAL)
-                {
-                    coap_log_error("[%u] <%u> %s Request message from HTTP client too long",
-                                   con->listener_index, con->con_index, con->addr);
-                    return ret;
-                }
-                else if (ret == -ENOMEM)
-                {
-                    coap_log_error("[%u] <%u> %s Out of memory",
-                                   con->listener_index, con->con_index, con->addr);
-                    return ret;
-                }
+                return 0;
             }
+            return msec;
         }
-        else
-        {
-            coap_log_error("[%u] <%u> %s Failed to parse request message from HTTP client: %s",
-                           con->listener_index, con->con_index, con->addr, http_msg_strerror(ret));
-            return num;
-        }
+        header = http_msg_header_get_next(header);
     }
     return 0;
 }
 
-/*  return: { CON_RET_CLOSED, socket closed remotely
- *          { 0,              success
- *          {<0,              error
+/* the earlier of the route deadline and the deadline requested by the
+ * HTTP client, measured from start or from now if start is NULL
  */
-static int connection_send(connection_t *con, http_msg_t *msg)
+static void connection_get_deadline(connection_t *con, param_route_t *route, http_msg_t *req_msg, const struct timespec *start, struct timespec *deadline)
 {
-    ssize_t num = 0;
-    size_t len = 0;
-    int ret = 0;
+    unsigned req_msec = 0;
+    unsigned msec = 0;
 
-    while (1)
+    deadline->tv_sec = 0;
+    deadline->tv_nsec = 0;
+    msec = route->coap_client_deadline;
+    req_msec = connection_get_req_deadline(req_msg);
+    if ((req_msec != 0) && ((msec == 0) || (req_msec < msec)))
     {
-        len = http_msg_generate(msg, data_buf_get_data(&con->send_buf), data_buf_get_space(&con->send_buf));
-        if (len <= data_buf_get_space(&con->send_buf))
+        msec = req_msec;
+    }
+    if (msec != 0)
+    {
+        if (start != NULL)
         {
-            break;
+            *deadline = *start;
         }
-        coap_log_debug("[%u] <%u> %s Increasing size of send buffer",
-                       con->listener_index, con->con_index, con->addr);
-        ret = data_buf_expand(&con->send_buf);
-        if (ret == -EINVAL)
+        else
         {
-            coap_log_error("[%u] <%u> %s Response message to HTTP client too long",
-                           con->listener_index, con->con_index, con->addr);
-            return ret;
+            clock_gettime(CLOCK_MONOTONIC, deadline);
         }
-        else if (ret == -ENOMEM)
+        deadline->tv_sec += msec / 1000;
+        deadline->tv_nsec += (msec % 1000) * 1000000;
+        if (deadline->tv_nsec >= 1000000000)
         {
-            coap_log_error("[%u] <%u> %s Out of memory",
-                           con->listener_index, con->con_index, con->addr);
-            return ret;
+            deadline->tv_sec++;
+            deadline->tv_nsec -= 1000000000;
         }
+        coap_log_debug("[%u] <%u> %s CoAP exchange deadline: %u msec",
+                       con->listener_index, con->con_index, con->addr, msec);
     }
-    num = tls_sock_write_full(con->sock, data_buf_get_data(&con->send_buf), len);
-    if (num < 0)
+}
+
+typedef struct connection_hedge
+{
+    connection_t *con;
+    coap_msg_t req;
+    coap_msg_t resp;
+    struct timespec deadline;
+    struct timespec send_time;                                                  /* monotonic time at which the hedged request is sent */
+    unsigned delay;                                                             /* msec */
+    int cancel_fd;                                                              /* cancels the hedged request */
+    int primary_fd;                                                             /* cancels the primary request */
+    int ret;
+    int done;                                                                   /* set by the hedge worker when it has finished */
+    pthread_cond_t done_cond;                                                   /* signalled when done is set */
+    struct connection_hedge *next;
+}
+connection_hedge_t;
+
+/* hedged requests are sent by workers that wait for the next
+ * request when they finish, a worker is only started when
+ * none is idle
+ */
+static lock_t hedge_lock;                                                       /* protects the hedge queue and the worker counts */
+static pthread_cond_t hedge_cond;                                               /* signalled when a hedged request is queued */
+static connection_hedge_t *hedge_head = NULL;                                   /* hedged requests waiting for a worker */
+static connection_hedge_t *hedge_tail = NULL;
+static unsigned hedge_num_queued = 0;
+static unsigned hedge_num_idle = 0;                                             /* workers waiting for a hedged request */
+static thread_ctx_t hedge_ctx;                                                  /* hedge workers are detached */
+
+static void connection_signal(int fd)
+{
+    uint64_t val = 1;
+    ssize_t num = 0;
+
+    num = write(fd, &val, sizeof(val));
+    if (num != sizeof(val))
     {
-        coap_log_error("[%u] <%u> %s Failed to write to socket conected to HTTP client: %s",
-                       con->listener_index, con->con_index, con->addr, sock_strerror(num));
-        return -1;
+        coap_log_warn("Failed to signal event: %s", strerror(errno));
     }
-    if (num == 0)
+}
+
+/* idle connections close immediately, others close after the current exchange */
+void connection_drain(void)
+{
+    draining = 1;
+    connection_signal(drain_fd);
+}
+
+static int connection_hedge_init(void)
+{
+    int ret = 0;
+
+    ret = lock_create(&hedge_lock);
+    if (ret < 0)
     {
-        coap_log_error("[%u] <%u> %s Socket connection to HTTP client closed remotely",
-                       con->listener_index, con->con_index, con->addr);
-        return CON_RET_CLOSED;
+        return ret;
+    }
+    pthread_cond_init(&hedge_cond, NULL);
+    ret = thread_detached_ctx_create(&hedge_ctx);
+    if (ret < 0)
+    {
+        pthread_cond_destroy(&hedge_cond);
+        lock_destroy(&hedge_lock);
+        return ret;
     }
-    coap_log_debug("[%u] <%u> %s Sent to HTTP client: %s %s %s",
-                   con->listener_index, con->con_index, con->addr,
-                   http_msg_get_start(msg, 0),
-                   http_msg_get_start(msg, 1),
-                   http_msg_get_start(msg, 2));
     return 0;
 }
 
-/*  return: { 0, success
+/* wait until the hedged request is due
+ *
+ *  return: { 0, the hedged request is due
+ *          { 1, the primary request completed first
  *          {<0, error
  */
-static int connection_gen_error_resp(connection_t *con, http_msg_t *msg, unsigned code)
+static int connection_hedge_wait(connection_hedge_t *hedge)
 {
-    const char *str = NULL;
-    char int_buf[CONNECTION_INT_BUF_LEN] = {0};
+    struct pollfd pfd = {0};
+    struct timespec now = {0};
+    long msec = 0;
     int ret = 0;
 
-    snprintf(int_buf, sizeof(int_buf), "%u", code);
-    str = cross_http_resp_code_to_str(code);
-    ret = http_msg_set_start(msg, "HTTP/1.1", int_buf, str);
-    if (ret < 0)
+    pfd.fd = hedge->cancel_fd;
+    pfd.events = POLLIN;
+    while (1)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        msec = (hedge->send_time.tv_sec - now.tv_sec) * 1000
+             + (hedge->send_time.tv_nsec - now.tv_nsec + 999999) / 1000000;
+        if (msec < 0)
+        {
+            msec = 0;
+        }
+        ret = poll(&pfd, 1, msec);
+        if ((ret < 0) && (errno == EINTR))
+        {
+            continue;
+        }
+        if (ret < 0)
+        {
+            return -errno;
+        }
+        return (ret > 0) ? 1 : 0;
+    }
+}
+
+static void connection_hedge_run(connection_hedge_t *hedge)
+{
+    connection_t *con = hedge->con;
+    int ret = 0;
+
+    ret = connection_hedge_wait(hedge);
+    if (ret != 0)
+    {
+        hedge->ret = (ret > 0) ? -ECANCELED : ret;
+        return;
+    }
+    ret = connection_hedge_client_create(con);
+    if (ret < 0)
+    {
+        hedge->ret = ret;
+        return;
+    }
+    coap_log_info("[%u] <%u> %s Sending hedged request to CoAP server host %s and port %s after %u msec",
+                  con->listener_index, con->con_index, con->addr,
+                  con->hedge_client_host, con->hedge_client_port, hedge->delay);
+    coap_client_set_deadline(con->hedge_client, &hedge->deadline);
+    coap_client_set_cancel_fd(con->hedge_client, hedge->cancel_fd);
+    hedge->ret = coap_client_exchange(con->hedge_client, &hedge->req, &hedge->resp);
+    coap_client_set_cancel_fd(con->hedge_client, -1);
+    if (hedge->ret == 0)
+    {
+        connection_signal(hedge->primary_fd);
+    }
+}
+
+static void *connection_hedge_thread_func(void *data)
+{
+    connection_hedge_t *hedge = NULL;
+
+    thread_block_signals();
+    while (1)
+    {
+        lock_get(&hedge_lock);
+        hedge_num_idle++;
+        while (hedge_head == NULL)
+        {
+            lock_cond_wait(&hedge_cond, &hedge_lock);
+        }
+        hedge = hedge_head;
+        hedge_head = hedge->next;
+        if (hedge_head == NULL)
+        {
+            hedge_tail = NULL;
+        }
+        hedge_num_queued--;
+        hedge_num_idle--;
+        lock_put(&hedge_lock);
+
+        connection_hedge_run(hedge);
+
+        /* the hedge belongs to the connection thread once done is set */
+        lock_get(&hedge_lock);
+        hedge->done = 1;
+        pthread_cond_signal(&hedge->done_cond);
+        if (hedge_num_idle >= CONNECTION_HEDGE_MAX_IDLE)
+        {
+            lock_put(&hedge_lock);
+            break;
+        }
+        lock_put(&hedge_lock);
+    }
+    return NULL;
+}
+
+/* queue a hedged request for a worker, starting a worker if none is idle
+ *
+ *  return: { 0, success
+ *          {<0, error
+ */
+static int connection_hedge_submit(connection_hedge_t *hedge)
+{
+    thread_t thread = {0};
+    int ret = 0;
+
+    lock_get(&hedge_lock);
+    if (hedge_num_queued >= hedge_num_idle)
+    {
+        ret = thread_init(&thread, &hedge_ctx, connection_hedge_thread_func, NULL);
+        if (ret < 0)
+        {
+            lock_put(&hedge_lock);
+            return ret;
+        }
+    }
+    hedge->next = NULL;
+    if (hedge_tail != NULL)
+    {
+        hedge_tail->next = hedge;
+    }
+    else
+    {
+        hedge_head = hedge;
+    }
+    hedge_tail = hedge;
+    hedge_num_queued++;
+    pthread_cond_signal(&hedge_cond);
+    lock_put(&hedge_lock);
+    return 0;
+}
+
+static void connection_hedge_join(connection_hedge_t *hedge)
+{
+    lock_get(&hedge_lock);
+    while (!hedge->done)
+    {
+        lock_cond_wait(&hedge->done_cond, &hedge_lock);
+    }
+    lock_put(&hedge_lock);
+}
+
+static void connection_hedge_destroy(connection_hedge_t *hedge)
+{
+    if (hedge->primary_fd >= 0)
+    {
+        close(hedge->primary_fd);
+    }
+    if (hedge->cancel_fd >= 0)
+    {
+        close(hedge->cancel_fd);
+    }
+    coap_msg_destroy(&hedge->resp);
+    coap_msg_destroy(&hedge->req);
+    pthread_cond_destroy(&hedge->done_cond);
+}
+
+/*  return: { 0, success
+ *          {<0, error
+ */
+static int connection_hedge_create(connection_hedge_t *hedge, connection_t *con, coap_msg_t *req, const struct timespec *deadline, unsigned delay)
+{
+    int ret = 0;
+
+    hedge->con = con;
+    hedge->deadline = *deadline;
+    hedge->delay = delay;
+    clock_gettime(CLOCK_MONOTONIC, &hedge->send_time);
+    hedge->send_time.tv_sec += hedge->delay / 1000;
+    hedge->send_time.tv_nsec += (hedge->delay % 1000) * 1000000;
+    if (hedge->send_time.tv_nsec >= 1000000000)
+    {
+        hedge->send_time.tv_sec++;
+        hedge->send_time.tv_nsec -= 1000000000;
+    }
+    hedge->cancel_fd = -1;
+    hedge->primary_fd = -1;
+    pthread_cond_init(&hedge->done_cond, NULL);
+    coap_msg_create(&hedge->req);
+    coap_msg_create(&hedge->resp);
+    ret = coap_msg_copy(&hedge->req, req);
+    if (ret < 0)
+    {
+        connection_hedge_destroy(hedge);
+        return ret;
+    }
+    hedge->cancel_fd = eventfd(0, EFD_NONBLOCK);
+    if (hedge->cancel_fd < 0)
+    {
+        ret = -errno;
+        connection_hedge_destroy(hedge);
+        return ret;
+    }
+    hedge->primary_fd = eventfd(0, EFD_NONBLOCK);
+    if (hedge->primary_fd < 0)
+    {
+        ret = -errno;
+        connection_hedge_destroy(hedge);
+        return ret;
+    }
+    return 0;
+}
+
+/* send the request to the CoAP server and, if no response
+ * arrives within the hedge delay, send a duplicate request
+ * with a new token to the alternate CoAP server and use
+ * whichever response arrives first
+ *
+ *  return: { 0, success
+ *          {<0, error
+ */
+static int connection_exchange_hedged(connection_t *con, coap_msg_t *req, coap_msg_t *resp, const struct timespec *deadline)
+{
+    connection_hedge_t hedge = {0};
+    struct timespec start = {0};
+    struct timespec end = {0};
+    hedge_t *route_hedge = NULL;
+    unsigned elapsed_us = 0;
+    int ret = 0;
+
+    route_hedge = hedge_find(con->route);
+    if (route_hedge == NULL)
+    {
+        return coap_client_exchange(con->coap_client, req, resp);
+    }
+    ret = connection_hedge_create(&hedge, con, req, deadline, hedge_get_delay(route_hedge));
+    if (ret < 0)
+    {
+        return ret;
+    }
+    ret = connection_hedge_submit(&hedge);
+    if (ret < 0)
+    {
+        coap_log_warn("[%u] <%u> %s Unable to create hedge thread",
+                      con->listener_index, con->con_index, con->addr);
+        connection_hedge_destroy(&hedge);
+        return coap_client_exchange(con->coap_client, req, resp);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    coap_client_set_cancel_fd(con->coap_client, hedge.primary_fd);
+    ret = coap_client_exchange(con->coap_client, req, resp);
+    coap_client_set_cancel_fd(con->coap_client, -1);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if ((ret == 0) || (ret == -ETIMEDOUT))
+    {
+        /* the hedged request cannot improve on a response or beat the deadline */
+        connection_signal(hedge.cancel_fd);
+    }
+    connection_hedge_join(&hedge);
+
+    if ((ret == 0) || (ret == -ECANCELED))
+    {
+        /* a cancelled request took longer than the hedged request */
+        elapsed_us = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+        hedge_update(route_hedge, elapsed_us);
+    }
+    if ((ret < 0) && (hedge.ret == 0))
+    {
+        coap_log_info("[%u] <%u> %s Using response to hedged request from CoAP server host %s and port %s",
+                      con->listener_index, con->con_index, con->addr,
+                      con->hedge_client_host, con->hedge_client_port);
+        coap_msg_reset(resp);
+        ret = coap_msg_copy(resp, &hedge.resp);
+    }
+    connection_hedge_destroy(&hedge);
+    return ret;
+}
+
+/*  return: { CON_RET_CLOSED,   socket closed remotely
+ *          { CON_RET_TIMEDOUT, timeout
+ *          { CON_RET_DRAINED,  proxy draining while idle
+ *          { 0,                success
+ *          {<0,                error
+ */
+static int connection_recv(connection_t *con, http_msg_t *msg)
+{
+    http_msg_scan_t scan = {0};
+    struct timeval tv = {0};
+    ssize_t num = 0;
+    fd_set readfds = {{0}};
+    int max_fd = 0;
+    int ret = 0;
+    int sd = 0;
+
+    tv.tv_sec = tls_sock_get_timeout(con->sock);
+    tv.tv_usec = 0;
+    sd = tls_sock_get_sd(con->sock);
+    http_msg_scan_create(&scan);
+    while (1)
+    {
+        /* data already held by the TLS session is read without waiting */
+        if (tls_sock_get_pending(con->sock) == 0)
+        {
+            FD_ZERO(&readfds);
+            FD_SET(sd, &readfds);
+            max_fd = sd;
+            /* a partially received request is completed while draining */
+            if (data_buf_get_count(&con->recv_buf) == 0)
+            {
+                FD_SET(drain_fd, &readfds);
+                if (drain_fd > max_fd)
+                {
+                    max_fd = drain_fd;
+                }
+            }
+            errno = 0;
+            ret = select(max_fd + 1, &readfds, NULL, NULL, &tv);
+            if (ret == 0)
+            {
+                coap_log_info("[%u] <%u> %s Timed out waiting to read from socket connected to HTTP client",
+                              con->listener_index, con->con_index, con->addr);
+                return CON_RET_TIMEDOUT;
+            }
+            else if (ret == -1)
+            {
+                coap_log_error("[%u] <%u> %s Call to select returned: -1, errno: %d (%s)",
+                               con->listener_index, con->con_index, con->addr, errno, strerror(errno));
+                return -errno;
+            }
+            if ((FD_ISSET(drain_fd, &readfds)) && (!FD_ISSET(sd, &readfds)))
+            {
+                coap_log_info("[%u] <%u> %s Closing idle connection to HTTP client for drain",
+                              con->listener_index, con->con_index, con->addr);
+                return CON_RET_DRAINED;
+            }
+        }
+        num = tls_sock_read(con->sock, data_buf_get_next(&con->recv_buf), data_buf_get_space(&con->recv_buf));
+        if (num < 0)
+        {
+            coap_log_error("[%u] <%u> %s Failed to read from socket connected to HTTP client: %s",
+                           con->listener_index, con->con_index, con->addr, sock_strerror(num));
+            return -1;
+        }
+        if (num == 0)
+        {
+            coap_log_info("[%u] <%u> %s Socket connection to HTTP client closed remotely",
+                          con->listener_index, con->con_index, con->addr);
+            return CON_RET_CLOSED;
+        }
+        data_buf_add(&con->recv_buf, num);
+        /* only the new data is scanned and the request is parsed once it is complete */
+        num = http_msg_scan(&scan, data_buf_get_data(&con->recv_buf), data_buf_get_count(&con->recv_buf));
+        if (num > 0)
+        {
+            num = http_msg_parse(msg, data_buf_get_data(&con->recv_buf), data_buf_get_count(&con->recv_buf));
+        }
+        if (num > 0)
+        {
+            data_buf_consume(&con->recv_buf, num);
+            coap_log_debug("[%u] <%u> %s Received from HTTP client: %s %s %s",
+                           con->listener_index, con->con_index, con->addr,
+                           http_msg_get_start(msg, 0),
+                           http_msg_get_start(msg, 1),
+                           http_msg_get_start(msg, 2));
+            return 0;  /* success */
+        }
+        else if (num == -EAGAIN)
+        {
+            coap_log_debug("[%u] <%u> %s Received incomplete request message from HTTP client",
+                           con->listener_index, con->con_index, con->addr);
+            if (data_buf_get_space(&con->recv_buf) < CONNECTION_DATA_BUF_MIN_SPACE)
+            {
+                coap_log_debug("[%u] <%u> %s Increasing size of receive buffer",
+                               con->listener_index, con->con_index, con->addr);
+                ret = data_buf_expand(&con->recv_buf);
+                if (ret == -EINVAL)
+                {
+                    coap_log_error("[%u] <%u> %s Request message from HTTP client too long",
+                                   con->listener_index, con->con_index, con->addr);
+                    return ret;
+                }
+                else if (ret == -ENOMEM)
+                {
+                    coap_log_error("[%u] <%u> %s Out of memory",
+                                   con->listener_index, con->con_index, con->addr);
+                    return ret;
+                }
+            }
+        }
+        else
+        {
+            coap_log_error("[%u] <%u> %s Failed to parse request message from HTTP client: %s",
+                           con->listener_index, con->con_index, con->addr, http_msg_strerror(num));
+            return num;
+        }
+    }
+    return 0;
+}
+
+/*  return: { CON_RET_CLOSED, socket closed remotely
+ *          { 0,              success
+ *          {<0,              error
+ */
+static int connection_send(connection_t *con, http_msg_t *msg)
+{
+    ssize_t num = 0;
+    size_t len = 0;
+    int ret = 0;
+
+    while (1)
+    {
+        len = http_msg_generate(msg, data_buf_get_data(&con->send_buf), data_buf_get_space(&con->send_buf));
+        if (len <= data_buf_get_space(&con->send_buf))
+        {
+            break;
+        }
+        coap_log_debug("[%u] <%u> %s Increasing size of send buffer",
+                       con->listener_index, con->con_index, con->addr);
+        ret = data_buf_expand(&con->send_buf);
+        if (ret == -EINVAL)
+        {
+            coap_log_error("[%u] <%u> %s Response message to HTTP client too long",
+                           con->listener_index, con->con_index, con->addr);
+            return ret;
+        }
+        else if (ret == -ENOMEM)
+        {
+            coap_log_error("[%u] <%u> %s Out of memory",
+                           con->listener_index, con->con_index, con->addr);
+            return ret;
+        }
+    }
+    num = tls_sock_write_full(con->sock, data_buf_get_data(&con->send_buf), len);
+    if (num < 0)
+    {
+        coap_log_error("[%u] <%u> %s Failed to write to socket conected to HTTP client: %s",
+                       con->listener_index, con->con_index, con->addr, sock_strerror(num));
+        return -1;
+    }
+    if (num == 0)
+    {
+        coap_log_error("[%u] <%u> %s Socket connection to HTTP client closed remotely",
+                       con->listener_index, con->con_index, con->addr);
+        return CON_RET_CLOSED;
+    }
+    coap_log_debug("[%u] <%u> %s Sent to HTTP client: %s %s %s",
+                   con->listener_index, con->con_index, con->addr,
+                   http_msg_get_start(msg, 0),
+                   http_msg_get_start(msg, 1),
+                   http_msg_get_start(msg, 2));
+    return 0;
+}
+
+/*  return: { 0, success
+ *          {<0, error
+ */
+static int connection_gen_error_resp(connection_t *con, http_msg_t *msg, unsigned code)
+{
+    const char *str = NULL;
+    char int_buf[CONNECTION_INT_BUF_LEN] = {0};
+    int ret = 0;
+
+    snprintf(int_buf, sizeof(int_buf), "%u", code);
+    str = cross_http_resp_code_to_str(code);
+    ret = http_msg_set_start(msg, "HTTP/1.1", int_buf, str);
+    if (ret < 0)
+    {
+        coap_log_error("[%u] <%u> %s Failed to set start line in response message to HTTP client: %s",
+                       con->listener_index, con->con_index, con->addr, http_msg_strerror(ret));
+        return ret;
+    }
+    return 0;
+}
+
+/* HTTP clients share a busy CoAP server according to
+ * their API key or, if they do not send one, their address
+ */
+static const char *connection_get_flow(connection_t *con, http_msg_t *req_msg)
+{
+    http_msg_header_t *header = NULL;
+
+    header = http_msg_get_first_header(req_msg);
+    while (header != NULL)
+    {
+        if (strcasecmp(http_msg_header_get_name(header), CONNECTION_API_KEY_HEADER) == 0)
+        {
+            return http_msg_header_get_value(header);
+        }
+        header = http_msg_header_get_next(header);
+    }
+    return con->addr;
+}
+
+/* wait for the scheduler to let an exchange with the CoAP server start
+ *
+ *  return: { 0, success
+ *          {<0, error
+ */
+static int connection_scheduler_acquire(connection_t *con, http_msg_t *req_msg, param_route_t *route, const char *host, const char *port, const struct timespec *deadline, scheduler_server_t **server)
+{
+    const char *flow = NULL;
+
+    flow = connection_get_flow(con, req_msg);
+    return scheduler_acquire(route, host, port, flow, param_get_client_weight(con->param, flow), deadline, server);
+}
+
+/* response for a request that the scheduler did not let through
+ *
+ *  return: { 0, success
+ *          {<0, error
+ */
+static int connection_gen_scheduler_error_resp(connection_t *con, http_msg_t *msg, int result)
+{
+    int ret = 0;
+
+    coap_log_warn("[%u] <%u> %s CoAP server too busy: %s",
+                  con->listener_index, con->con_index, con->addr, strerror(-result));
+    if (result == -ETIMEDOUT)
+    {
+        return connection_gen_error_resp(con, msg, 504);
+    }
+    ret = connection_gen_error_resp(con, msg, 503);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    return http_msg_set_header(msg, "Retry-After", CONNECTION_RETRY_AFTER);
+}
+
+static void connection_member_clients_destroy(connection_t *con)
+{
+    unsigned i = 0;
+
+    for (i = 0; i < PARAM_MAX_UPSTREAM_MEMBERS; i++)
+    {
+        if (con->member_client_active[i])
+        {
+            coap_log_info("[%u] <%u> %s Disconnecting from CoAP server host %s and port %s in upstream %s",
+                          con->listener_index, con->con_index, con->addr,
+                          upstream_get_member_host(con->upstream, i),
+                          upstream_get_member_port(con->upstream, i),
+                          upstream_get_name(con->upstream));
+            connection_client_free(&con->member_client[i]);
+            con->member_client_active[i] = 0;
+        }
+    }
+    con->upstream = NULL;
+}
+
+/*  return: { 0, success
+ *          {<0, error
+ */
+static int connection_member_client_create(connection_t *con, unsigned index)
+{
+    char addr[COAP_CLIENT_HOST_BUF_LEN] = {0};
+    upstream_t *upstream = con->upstream;
+    param_route_t *route = upstream->route;
+    int ret = 0;
+
+    ret = resolver_lookup(upstream_get_member_host(upstream, index), addr, sizeof(addr));
+    if (ret < 0)
+    {
+        coap_log_error("[%u] <%u> %s Failed to resolve CoAP server host %s in upstream %s: %s",
+                       con->listener_index, con->con_index, con->addr,
+                       upstream_get_member_host(upstream, index),
+                       upstream_get_name(upstream),
+                       strerror(-ret));
+        return ret;
+    }
+
+    coap_log_info("[%u] <%u> %s Connecting to CoAP server host %s (%s) and port %s in upstream %s",
+                  con->listener_index, con->con_index, con->addr,
+                  upstream_get_member_host(upstream, index), addr,
+                  upstream_get_member_port(upstream, index),
+                  upstream_get_name(upstream));
+
+    ret = connection_client_new(&con->member_client[index], route, addr,
+                                upstream_get_member_port(upstream, index));
+    if (ret < 0)
+    {
+        coap_log_error("[%u] <%u> %s Failed to connect to CoAP server host %s and port %s in upstream %s: %s",
+                       con->listener_index, con->con_index, con->addr,
+                       upstream_get_member_host(upstream, index),
+                       upstream_get_member_port(upstream, index),
+                       upstream_get_name(upstream),
+                       strerror(-ret));
+        return ret;
+    }
+    ret = coap_client_set_timeouts(con->member_client[index],
+                                   route->coap_client_ack_timeout,
+                                   route->coap_client_max_retransmit,
+                                   route->coap_client_resp_timeout);
+    if (ret < 0)
+    {
+        connection_client_free(&con->member_client[index]);
+        return ret;
+    }
+    con->member_client_active[index] = 1;
+    return 0;
+}
+
+/* send the request to the least loaded healthy member of an
+ * upstream group, keeping a DTLS session to each member used
+ *
+ *  return: { 0, success
+ *          {<0, error
+ */
+static int connection_exchange_upstream(connection_t *con, upstream_t *upstream, const struct timespec *deadline, coap_msg_t *req, coap_msg_t *resp)
+{
+    struct timespec start = {0};
+    struct timespec end = {0};
+    unsigned elapsed_us = 0;
+    unsigned i = 0;
+    int index = 0;
+    int ret = 0;
+
+    if (con->upstream != upstream)
+    {
+        if (con->upstream != NULL)
+        {
+            connection_member_clients_destroy(con);
+        }
+        con->upstream = upstream;
+    }
+    /* nothing has been sent if the connection to a member fails so try another member */
+    for (i = 0; i < upstream_get_num_members(upstream); i++)
+    {
+        index = upstream_select(upstream);
+        if (con->member_client_active[index])
+        {
+            /* a failure to connect to a previous member does not apply */
+            ret = 0;
+            break;
+        }
+        ret = connection_member_client_create(con, index);
+        if (ret == 0)
+        {
+            break;
+        }
+        upstream_release(upstream, index, ret, 0);
+    }
+    if (ret < 0)
+    {
+        return ret;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    coap_log_debug("[%u] <%u> %s Using CoAP server host %s and port %s in upstream %s",
+                   con->listener_index, con->con_index, con->addr,
+                   upstream_get_member_host(upstream, index),
+                   upstream_get_member_port(upstream, index),
+                   upstream_get_name(upstream));
+    coap_client_set_deadline(con->member_client[index], deadline);
+    ret = coap_client_exchange(con->member_client[index], req, resp);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed_us = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+    upstream_release(upstream, index, ret, elapsed_us);
+    if ((ret == -ETIMEDOUT) || (ret == -ECONNRESET) || (ret == -1))
+    {
+        /* start with a fresh DTLS session next time */
+        connection_client_free(&con->member_client[index]);
+        con->member_client_active[index] = 0;
+    }
+    return ret;
+}
+
+/* reuse the CoAP client if the request is for the same CoAP server
+ *
+ *  return: { 0, success
+ *          {<0, error
+ */
+static int connection_coap_client_select(connection_t *con, uri_t *uri)
+{
+    if (!con->coap_client_active)
+    {
+        /* first exchange with a CoAP server */
+        return connection_coap_client_create(con, uri);
+    }
+    if ((strcasecmp(uri_get_host(uri), con->coap_client_host) != 0)
+     || (strcmp(uri_get_port(uri), con->coap_client_port) != 0))
+    {
+        /* subsequent exchange with a different CoAP server */
+        connection_coap_client_release(con);
+        return connection_coap_client_create(con, uri);
+    }
+    /* subsequent exchange with the same CoAP server */
+    coap_log_debug("[%u] <%u> %s Maintaining connection to CoAP server host %s and port %s",
+                   con->listener_index, con->con_index, con->addr,
+                   con->coap_client_host, con->coap_client_port);
+    return 0;
+}
+
+/* a multi-get batch request carries one coap:// or coaps:// URI per
+ * line in its body, every target is fetched with a GET request and
+ * the responses are streamed back in a chunked multipart/mixed body,
+ * one message/http part per target in order of completion
+ *
+ * targets are grouped by authority, the groups are fetched in parallel
+ * and the targets in a group one after the other over one CoAP client
+ * (RFC 7252 section 4.7, NSTART is 1)
+ */
+typedef struct
+{
+    connection_t *con;
+    http_msg_t *req_msg;
+    char **target;                                                              /* URIs in the order in which they are fetched */
+    unsigned num_targets;
+    unsigned *group;                                                            /* index of the first target in each group */
+    unsigned num_groups;
+    unsigned next;                                                              /* index of the next group to fetch */
+    struct timespec start;                                                      /* shared deadlines are measured from here */
+    int failed;                                                                 /* set if writing to the HTTP client failed */
+    lock_t lock;                                                                /* protects next, failed and writes to the HTTP client */
+}
+connection_batch_t;
+
+/* a worker keeps one CoAP client and fetches groups until there are none left */
+typedef struct
+{
+    connection_batch_t *batch;
+    coap_client_t *client;
+    param_route_t *route;
+}
+connection_batch_worker_t;
+
+/* a safe request has no effect if it is replayed */
+static int connection_is_safe(http_msg_t *req_msg)
+{
+    return (strcmp(http_msg_get_start(req_msg, 0), "GET") == 0);
+}
+
+static int connection_is_batch(http_msg_t *req_msg)
+{
+    return (strcmp(http_msg_get_start(req_msg, 0), "POST") == 0)
+        && (strcmp(http_msg_get_start(req_msg, 1), CONNECTION_BATCH_PATH) == 0);
+}
+
+/* length of the scheme and authority at the start of a URI */
+static size_t connection_batch_authority_len(const char *target)
+{
+    size_t len = 0;
+
+    len = strcspn(target, ":") + 3;
+    return len + strcspn(target + len, "/?#");
+}
+
+/* order targets by authority so that each group is contiguous */
+static int connection_batch_target_cmp(const void *a, const void *b)
+{
+    const char *x = *(const char **)a;
+    const char *y = *(const char **)b;
+    size_t x_len = 0;
+    size_t y_len = 0;
+    int ret = 0;
+
+    x_len = connection_batch_authority_len(x);
+    y_len = connection_batch_authority_len(y);
+    ret = strncasecmp(x, y, (x_len < y_len) ? x_len : y_len);
+    if (ret != 0)
+    {
+        return ret;
+    }
+    return (int)x_len - (int)y_len;
+}
+
+static void connection_batch_destroy(connection_batch_t *batch)
+{
+    unsigned i = 0;
+
+    for (i = 0; i < batch->num_targets; i++)
+    {
+        free(batch->target[i]);
+    }
+    free(batch->target);
+    free(batch->group);
+    lock_destroy(&batch->lock);
+    memset(batch, 0, sizeof(connection_batch_t));
+}
+
+/*  return: { 0, success
+ *          {<0, error
+ */
+static int connection_batch_create(connection_batch_t *batch, connection_t *con, http_msg_t *req_msg)
+{
+    const char *body = NULL;
+    size_t body_len = 0;
+    size_t len = 0;
+    size_t i = 0;
+    int ret = 0;
+
+    memset(batch, 0, sizeof(connection_batch_t));
+    batch->con = con;
+    batch->req_msg = req_msg;
+    batch->target = (char **)calloc(CONNECTION_BATCH_MAX_TARGETS, sizeof(char *));
+    batch->group = (unsigned *)calloc(CONNECTION_BATCH_MAX_TARGETS + 1, sizeof(unsigned));
+    if ((batch->target == NULL) || (batch->group == NULL))
+    {
+        free(batch->group);
+        free(batch->target);
+        memset(batch, 0, sizeof(connection_batch_t));
+        return -ENOMEM;
+    }
+    ret = lock_create(&batch->lock);
+    if (ret < 0)
+    {
+        free(batch->group);
+        free(batch->target);
+        memset(batch, 0, sizeof(connection_batch_t));
+        return ret;
+    }
+    body = http_msg_get_body(req_msg);
+    body_len = http_msg_get_body_len(req_msg);
+    while (i < body_len)
+    {
+        len = 0;
+        while ((i + len < body_len) && (body[i + len] != '\r') && (body[i + len] != '\n'))
+        {
+            len++;
+        }
+        if (len > 0)
+        {
+            if (batch->num_targets == CONNECTION_BATCH_MAX_TARGETS)
+            {
+                connection_batch_destroy(batch);
+                return -E2BIG;
+            }
+            if ((strncmp(body + i, "coap://", 7) != 0) && (strncmp(body + i, "coaps://", 8) != 0))
+            {
+                connection_batch_destroy(batch);
+                return -EINVAL;
+            }
+            batch->target[batch->num_targets] = strndup(body + i, len);
+            if (batch->target[batch->num_targets] == NULL)
+            {
+                connection_batch_destroy(batch);
+                return -ENOMEM;
+            }
+            batch->num_targets++;
+        }
+        i += len + 1;
+    }
+    if (batch->num_targets == 0)
+    {
+        connection_batch_destroy(batch);
+        return -EINVAL;
+    }
+    qsort(batch->target, batch->num_targets, sizeof(char *), connection_batch_target_cmp);
+    for (i = 0; i < batch->num_targets; i++)
+    {
+        if ((i == 0) || (connection_batch_target_cmp(&batch->target[i - 1], &batch->target[i]) != 0))
+        {
+            batch->group[batch->num_groups++] = i;
+        }
+    }
+    batch->group[batch->num_groups] = batch->num_targets;
+    clock_gettime(CLOCK_MONOTONIC, &batch->start);
+    return 0;
+}
+
+/* write a chunk of the response body to the HTTP client
+ *
+ *  return: { 0, success
+ *          {<0, error
+ */
+static int connection_batch_write(connection_batch_t *batch, const char *data, size_t data_len)
+{
+    connection_t *con = batch->con;
+    ssize_t num = 0;
+    size_t len = 0;
+    char *buf = NULL;
+
+    len = snprintf(NULL, 0, "%zx\r\n", data_len) + data_len + 2;
+    buf = (char *)malloc(len + 1);
+    if (buf == NULL)
+    {
+        return -ENOMEM;
+    }
+    http_msg_generate_chunk(buf, len + 1, data, data_len);
+    lock_get(&batch->lock);
+    if (!batch->failed)
+    {
+        num = tls_sock_write_full(con->sock, buf, len);
+        if (num <= 0)
+        {
+            coap_log_error("[%u] <%u> %s Failed to write to socket conected to HTTP client: %s",
+                           con->listener_index, con->con_index, con->addr, sock_strerror(num));
+            batch->failed = 1;
+        }
+    }
+    num = batch->failed ? -1 : 0;
+    lock_put(&batch->lock);
+    free(buf);
+    return num;
+}
+
+/* write the response to one target as a message/http part
+ *
+ *  return: { 0, success
+ *          {<0, error
+ */
+static int connection_batch_write_part(connection_batch_t *batch, const char *target, http_msg_t *part_msg)
+{
+    size_t size = CONNECTION_BATCH_PART_BUF_LEN;
+    size_t head_len = 0;
+    size_t len = 0;
+    char *buf = NULL;
+    int ret = 0;
+
+    head_len = snprintf(NULL, 0, "--%s\r\nContent-Type: message/http\r\nContent-Location: %s\r\n\r\n",
+                        CONNECTION_BATCH_BOUNDARY, target);
+    while (1)
+    {
+        buf = (char *)malloc(head_len + size + 2);
+        if (buf == NULL)
+        {
+            return -ENOMEM;
+        }
+        len = http_msg_generate(part_msg, buf + head_len, size);
+        if (len < size)
+        {
+            break;
+        }
+        free(buf);
+        size = len + 1;
+    }
+    snprintf(buf, head_len + 1, "--%s\r\nContent-Type: message/http\r\nContent-Location: %s\r\n\r\n",
+             CONNECTION_BATCH_BOUNDARY, target);
+    /* snprintf overwrote the first byte of the message with its null terminator */
+    http_msg_generate(part_msg, buf + head_len, size);
+    memcpy(buf + head_len + len, "\r\n", 2);
+    ret = connection_batch_write(batch, buf, head_len + len + 2);
+    free(buf);
+    return ret;
+}
+
+/* make sure the worker holds a CoAP client for addr and port
+ *
+ *  return: { 0, success
+ *          {<0, error
+ */
+static int connection_batch_worker_client(connection_batch_worker_t *worker, param_route_t *route, const char *addr, const char *port)
+{
+    int ret = 0;
+
+    if (worker->client != NULL)
+    {
+        if ((worker->route == route)
+         && (strcmp(worker->client->server_host, addr) == 0)
+         && (strcmp(worker->client->server_port, port) == 0))
+        {
+            return 0;
+        }
+        client_pool_put(worker->route, worker->client);
+        worker->client = NULL;
+    }
+    worker->route = route;
+    worker->client = client_pool_get(route, addr, port);
+    if (worker->client != NULL)
+    {
+        return 0;
+    }
+    ret = connection_client_new(&worker->client, route, addr, port);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    ret = coap_client_set_timeouts(worker->client,
+                                   route->coap_client_ack_timeout,
+                                   route->coap_client_max_retransmit,
+                                   route->coap_client_resp_timeout);
+    if (ret < 0)
+    {
+        connection_client_free(&worker->client);
+        return ret;
+    }
+    return 0;
+}
+
+/* fetch one target, the response, or an error status, is left in part_msg
+ *
+ *  return: { 0, success
+ *          {<0, error
+ */
+static int connection_batch_fetch(connection_batch_worker_t *worker, const char *target, http_msg_t *part_msg)
+{
+    connection_batch_t *batch = worker->batch;
+    connection_t *con = batch->con;
+    char addr[COAP_CLIENT_HOST_BUF_LEN] = {0};
+    scheduler_server_t *scheduler_server = NULL;
+    struct timespec deadline = {0};
+    struct timespec start = {0};
+    struct timespec end = {0};
+    param_route_t *route = NULL;
+    upstream_t *upstream = NULL;
+    coap_msg_t coap_resp_msg = {0};
+    coap_msg_t coap_req_msg = {0};
+    const char *host = NULL;
+    const char *port = NULL;
+    unsigned elapsed_us = 0;
+    unsigned code = 0;
+    uri_t uri = {0};
+    int index = 0;
+    int ret = 0;
+
+    coap_msg_create(&coap_req_msg);
+    coap_msg_set_type(&coap_req_msg, CROSS_COAP_REQ_TYPE);
+    coap_msg_set_code(&coap_req_msg, COAP_MSG_REQ, COAP_MSG_GET);
+    ret = cross_uri_http_to_coap(&coap_req_msg, target);
+    if (ret == 0)
+    {
+        uri_create(&uri);
+        ret = uri_parse(&uri, target);
+        if (ret < 0)
+        {
+            uri_destroy(&uri);
+        }
+    }
+    if (ret < 0)
+    {
+        coap_msg_destroy(&coap_req_msg);
+        return connection_gen_error_resp(con, part_msg, 400);
+    }
+    host = uri_get_host(&uri);
+    port = uri_get_port(&uri);
+    upstream = upstream_find(host);
+    route = (upstream != NULL) ? upstream->route : param_get_route(con->param, host);
+    connection_get_deadline(con, route, batch->req_msg, &batch->start, &deadline);
+    ret = connection_scheduler_acquire(con, batch->req_msg, route, host, port, &deadline, &scheduler_server);
+    if (ret < 0)
+    {
+        uri_destroy(&uri);
+        coap_msg_destroy(&coap_req_msg);
+        return connection_gen_scheduler_error_resp(con, part_msg, ret);
+    }
+    if (upstream != NULL)
+    {
+        index = upstream_select(upstream);
+        host = upstream_get_member_host(upstream, index);
+        port = upstream_get_member_port(upstream, index);
+    }
+    ret = resolver_lookup(host, addr, sizeof(addr));
+    if (ret == 0)
+    {
+        ret = connection_batch_worker_client(worker, route, addr, port);
+    }
+    uri_destroy(&uri);
+    if (ret < 0)
+    {
+        coap_log_error("[%u] <%u> %s Failed to connect to CoAP server for %s: %s",
+                       con->listener_index, con->con_index, con->addr, target, strerror(-ret));
+        if (upstream != NULL)
+        {
+            upstream_release(upstream, index, ret, 0);
+        }
+        scheduler_release(scheduler_server);
+        coap_msg_destroy(&coap_req_msg);
+        return connection_gen_error_resp(con, part_msg, (ret == -ETIMEDOUT) ? 504 : 502);
+    }
+    coap_client_set_deadline(worker->client, &deadline);
+    coap_msg_create(&coap_resp_msg);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ret = coap_client_exchange(worker->client, &coap_req_msg, &coap_resp_msg);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    scheduler_release(scheduler_server);
+    coap_msg_destroy(&coap_req_msg);
+    if (upstream != NULL)
+    {
+        elapsed_us = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+        upstream_release(upstream, index, ret, elapsed_us);
+    }
+    if ((ret == -ETIMEDOUT) || (ret == -ECONNRESET) || (ret == -1))
+    {
+        /* start with a fresh DTLS session next time */
+        connection_client_free(&worker->client);
+    }
+    if (ret < 0)
+    {
+        coap_log_error("[%u] <%u> %s CoAP client exchange for %s failed: %s",
+                       con->listener_index, con->con_index, con->addr, target, strerror(-ret));
+        coap_msg_destroy(&coap_resp_msg);
+        switch (ret)
+        {
+        case -ETIMEDOUT:
+            return connection_gen_error_resp(con, part_msg, 504);
+        case -EBADMSG:
+            return connection_gen_error_resp(con, part_msg, 502);
+        default:
+            return connection_gen_error_resp(con, part_msg, 501);
+        }
+    }
+    ret = cross_resp_coap_to_http(part_msg, &coap_resp_msg, &code);
+    coap_msg_destroy(&coap_resp_msg);
+    if (ret < 0)
+    {
+        http_msg_reset(part_msg);
+        return connection_gen_error_resp(con, part_msg, code);
+    }
+    return 0;
+}
+
+static void *connection_batch_worker_func(void *data)
+{
+    connection_batch_worker_t *worker = (connection_batch_worker_t *)data;
+    connection_batch_t *batch = worker->batch;
+    http_msg_t part_msg = {{0}};
+    unsigned group = 0;
+    unsigned i = 0;
+    int ret = 0;
+
+    thread_block_signals();
+    while (1)
+    {
+        lock_get(&batch->lock);
+        group = batch->num_groups;
+        if ((!batch->failed) && (batch->next < batch->num_groups))
+        {
+            group = batch->next++;
+        }
+        lock_put(&batch->lock);
+        if (group == batch->num_groups)
+        {
+            break;
+        }
+        for (i = batch->group[group]; i < batch->group[group + 1]; i++)
+        {
+            http_msg_create(&part_msg);
+            ret = connection_batch_fetch(worker, batch->target[i], &part_msg);
+            if (ret == 0)
+            {
+                ret = connection_batch_write_part(batch, batch->target[i], &part_msg);
+            }
+            http_msg_destroy(&part_msg);
+            if (ret < 0)
+            {
+                break;
+            }
+        }
+    }
+    if (worker->client != NULL)
+    {
+        /* keep the DTLS session warm for the next request */
+        client_pool_put(worker->route, worker->client);
+        worker->client = NULL;
+    }
+    return NULL;
+}
+
+/* fetch the targets of a batch request in parallel and stream
+ * the responses back to the HTTP client as they arrive
+ *
+ *  return: { CON_RET_CLOSED, socket closed remotely
+ *          { 0,              success
+ *          {<0,              error
+ */
+static int connection_exchange_batch(connection_t *con, http_msg_t *req_msg, http_msg_t *resp_msg)
+{
+    connection_batch_worker_t worker[CONNECTION_BATCH_MAX_WORKERS] = {{0}};
+    thread_t thread[CONNECTION_BATCH_MAX_WORKERS] = {{0}};
+    connection_batch_t batch = {0};
+    thread_ctx_t ctx = {0};
+    unsigned num_workers = 0;
+    unsigned i = 0;
+    char end[sizeof(CONNECTION_BATCH_BOUNDARY) + 8] = {0};
+    char last[8] = {0};
+    ssize_t num = 0;
+    size_t len = 0;
+    int ctx_created = 0;
+    int ret = 0;
+
+    ret = connection_batch_create(&batch, con, req_msg);
+    if (ret < 0)
+    {
+        coap_log_error("[%u] <%u> %s Invalid batch request from HTTP client: %s",
+                       con->listener_index, con->con_index, con->addr, strerror(-ret));
+        ret = connection_gen_error_resp(con, resp_msg, (ret == -E2BIG) ? 413 : 400);
+        if (ret < 0)
+        {
+            return ret;
+        }
+        return connection_send(con, resp_msg);
+    }
+    coap_log_info("[%u] <%u> %s Fetching %u targets from %u CoAP servers for batch request",
+                  con->listener_index, con->con_index, con->addr, batch.num_targets, batch.num_groups);
+
+    ret = http_msg_set_start(resp_msg, "HTTP/1.1", "200", "OK");
+    if (ret == 0)
+    {
+        ret = http_msg_set_header(resp_msg, "Content-Type", "multipart/mixed; boundary="CONNECTION_BATCH_BOUNDARY);
+    }
+    if (ret == 0)
+    {
+        ret = http_msg_set_header(resp_msg, "Transfer-Encoding", "chunked");
+    }
+    if ((ret == 0) && (draining))
+    {
+        ret = http_msg_set_header(resp_msg, "Connection", "close");
+    }
+    if (ret < 0)
+    {
+        connection_batch_destroy(&batch);
+        return ret;
+    }
+    ret = connection_send(con, resp_msg);
+    if (ret != 0)
+    {
+        connection_batch_destroy(&batch);
+        return ret;
+    }
+
+    num_workers = batch.num_groups;
+    if (num_workers > CONNECTION_BATCH_MAX_WORKERS)
+    {
+        num_workers = CONNECTION_BATCH_MAX_WORKERS;
+    }
+    for (i = 0; i < num_workers; i++)
+    {
+        worker[i].batch = &batch;
+    }
+    /* the connection thread is the first worker */
+    ret = thread_joinable_ctx_create(&ctx);
+    if (ret < 0)
+    {
+        num_workers = 1;
+    }
+    else
+    {
+        ctx_created = 1;
+    }
+    for (i = 1; i < num_workers; i++)
+    {
+        ret = thread_init(&thread[i], &ctx, connection_batch_worker_func, &worker[i]);
+        if (ret < 0)
+        {
+            coap_log_warn("[%u] <%u> %s Unable to create batch worker thread",
+                          con->listener_index, con->con_index, con->addr);
+            break;
+        }
+    }
+    num_workers = i;
+    connection_batch_worker_func(&worker[0]);
+    for (i = 1; i < num_workers; i++)
+    {
+        thread_join(&thread[i], NULL);
+    }
+    if (ctx_created)
+    {
+        thread_ctx_destroy(&ctx);
+    }
+
+    ret = batch.failed ? -1 : 0;
+    if (ret == 0)
     {
-        coap_log_error("[%u] <%u> %s Failed to set start line in response message to HTTP client: %s",
-                       con->listener_index, con->con_index, con->addr, http_msg_strerror(ret));
-        return ret;
+        snprintf(end, sizeof(end), "--%s--\r\n", CONNECTION_BATCH_BOUNDARY);
+        ret = connection_batch_write(&batch, end, strlen(end));
     }
-    return 0;
+    if (ret == 0)
+    {
+        len = http_msg_generate_last_chunk(last, sizeof(last));
+        len += http_msg_generate_blank_line(last + len, sizeof(last) - len);
+        num = tls_sock_write_full(con->sock, last, len);
+        if (num <= 0)
+        {
+            ret = -1;
+        }
+    }
+    connection_batch_destroy(&batch);
+    return ret;
 }
 
 /*  return: { 0, success
@@ -354,12 +1852,19 @@ static int connection_gen_error_resp(connection_t *con, http_msg_t *msg, unsigne
  */
 static int connection_process_full(connection_t *con, http_msg_t *req_msg, http_msg_t *resp_msg)
 {
+    scheduler_server_t *scheduler_server = NULL;
+    struct timespec deadline = {0};
+    struct timespec start = {0};
+    param_route_t *route = NULL;
+    upstream_t *upstream = NULL;
     coap_msg_t coap_resp_msg = {0};
     coap_msg_t coap_req_msg = {0};
     unsigned code = 0;
     uri_t uri = {0};
     int ret = 0;
 
+    /* time spent waiting for the CoAP server counts towards the deadline */
+    clock_gettime(CLOCK_MONOTONIC, &start);
     coap_msg_create(&coap_req_msg);
     ret = cross_req_http_to_coap(&coap_req_msg, req_msg, &code);
     if (ret < 0)
@@ -379,40 +1884,60 @@ static int connection_process_full(connection_t *con, http_msg_t *req_msg, http_
         coap_msg_destroy(&coap_req_msg);
         return ret;
     }
-    if (!con->coap_client_active)
+    upstream = upstream_find(uri_get_host(&uri));
+    route = (upstream != NULL) ? upstream->route : param_get_route(con->param, uri_get_host(&uri));
+    connection_get_deadline(con, route, req_msg, &start, &deadline);
+    ret = connection_scheduler_acquire(con, req_msg, route, uri_get_host(&uri), uri_get_port(&uri), &deadline, &scheduler_server);
+    if (ret < 0)
     {
-        /* first exchange with a CoAP server */
-        ret = connection_coap_client_create(con, &uri);
-        if (ret < 0)
+        uri_destroy(&uri);
+        coap_msg_destroy(&coap_req_msg);
+        return connection_gen_scheduler_error_resp(con, resp_msg, ret);
+    }
+    coap_trace4(proxy_exchange_start, con->con_index, con->addr, uri_get_host(&uri), uri_get_port(&uri));
+    if (upstream != NULL)
+    {
+        uri_destroy(&uri);
+        coap_msg_create(&coap_resp_msg);
+        ret = connection_exchange_upstream(con, upstream, &deadline, &coap_req_msg, &coap_resp_msg);
+    }
+    else
+    {
+        ret = connection_coap_client_select(con, &uri);
+        uri_destroy(&uri);
+        if ((ret == -EHOSTUNREACH) || (ret == -ETIMEDOUT))
         {
-            uri_destroy(&uri);
+            /* the host name could not be resolved */
+            scheduler_release(scheduler_server);
             coap_msg_destroy(&coap_req_msg);
-            return ret;
+            return connection_gen_error_resp(con, resp_msg, (ret == -ETIMEDOUT) ? 504 : 502);
         }
-    }
-    else if ((strcasecmp(uri_get_host(&uri), con->coap_client_host) != 0)
-          || (strcmp(uri_get_port(&uri), con->coap_client_port) != 0))
-    {
-        /* subsequent exchange with a different CoAP server */
-        connection_coap_client_destroy(con);
-        ret = connection_coap_client_create(con, &uri);
         if (ret < 0)
         {
-            uri_destroy(&uri);
+            scheduler_release(scheduler_server);
             coap_msg_destroy(&coap_req_msg);
             return ret;
         }
+        coap_client_set_deadline(con->coap_client, &deadline);
+        coap_msg_create(&coap_resp_msg);
+        if (con->route->coap_client_hedge_host != NULL)
+        {
+            ret = connection_exchange_hedged(con, &coap_req_msg, &coap_resp_msg, &deadline);
+        }
+        else
+        {
+            ret = coap_client_exchange(con->coap_client, &coap_req_msg, &coap_resp_msg);
+        }
+        if ((ret == -ETIMEDOUT) || (ret == -ECONNRESET) || (ret == -1))
+        {
+            /* start with a fresh DTLS session next time and keep this one out of the client pool */
+            connection_coap_client_destroy(con);
+        }
     }
-    else
-    {
-        /* subsequent exchange with the same CoAP server */
-        coap_log_debug("[%u] <%u> %s Maintaining connection to CoAP server host %s and port %s",
-                       con->listener_index, con->con_index, con->addr,
-                       con->coap_client_host, con->coap_client_port);
-    }
-    uri_destroy(&uri);
-    coap_msg_create(&coap_resp_msg);
-    ret = coap_client_exchange(&con->coap_client, &coap_req_msg, &coap_resp_msg);
+    scheduler_release(scheduler_server);
+    coap_trace6(proxy_exchange_end, con->con_index, coap_msg_get_msg_id(&coap_req_msg),
+                coap_msg_get_token(&coap_req_msg), coap_msg_get_token_len(&coap_req_msg), ret,
+                (ret < 0) ? 0 : (coap_msg_get_code_class(&coap_resp_msg) << 5) | coap_msg_get_code_detail(&coap_resp_msg));
     coap_msg_destroy(&coap_req_msg);
     if (ret < 0)
     {
@@ -469,14 +1994,50 @@ static int __connection_exchange(connection_t *con, http_msg_t *req_msg, http_ms
     {
         return ret;  /* timeout or error */
     }
+    coap_trace4(proxy_http_request, con->con_index, con->addr, http_msg_get_start(req_msg, 0), http_msg_get_start(req_msg, 1));
 
-    /* process request and generate response */
-    ret = connection_process_full(con, req_msg, resp_msg);
+    if ((tls_sock_is_early(con->sock)) && (!connection_is_safe(req_msg)))
+    {
+        /* a request in early data could be replayed so only a GET
+         * request is served from it and the client repeats any other
+         * request after the handshake (RFC 8470)
+         */
+        coap_log_info("[%u] <%u> %s Refusing %s request in early data from HTTP client",
+                      con->listener_index, con->con_index, con->addr, http_msg_get_start(req_msg, 0));
+        stats_too_early_trans();
+        ret = connection_gen_error_resp(con, resp_msg, 425);
+    }
+    else if (connection_is_batch(req_msg))
+    {
+        /* the response is streamed as it is generated */
+        return connection_exchange_batch(con, req_msg, resp_msg);
+    }
+    else
+    {
+        if (tls_sock_is_early(con->sock))
+        {
+            coap_log_debug("[%u] <%u> %s Serving request in early data from HTTP client",
+                           con->listener_index, con->con_index, con->addr);
+            stats_early_trans();
+        }
+        /* process request and generate response */
+        ret = connection_process_full(con, req_msg, resp_msg);
+    }
     if (ret < 0)
     {
         return ret;
     }
 
+    if (draining)
+    {
+        /* the connection is closed after this response */
+        ret = http_msg_set_header(resp_msg, "Connection", "close");
+        if (ret < 0)
+        {
+            return ret;
+        }
+    }
+
     /* send response */
     ret = connection_send(con, resp_msg);
     if (ret != 0)  /* this must be if (ret != 0) and not if (ret < 0) */
@@ -516,6 +2077,11 @@ static int connection_exchange(connection_t *con)
         coap_log_notice("[%u] <%u> %s Transaction with HTTP client closed remotely",
                         con->listener_index, con->con_index, con->addr);
     }
+    else if (status == CON_RET_DRAINED)
+    {
+        coap_log_notice("[%u] <%u> %s Transaction with HTTP client not started as the proxy is draining",
+                        con->listener_index, con->con_index, con->addr);
+    }
     else if (status == 0)
     {
         coap_log_notice("[%u] <%u> %s Transaction with HTTP client successful",
@@ -537,18 +2103,9 @@ static int connection_exchange(connection_t *con)
     return status;
 }
 
-void *connection_thread_func(void *data)
+/* log the outcome of a connection and delete it */
+static void connection_finish(connection_t *con, int status)
 {
-    connection_t *con = (connection_t *)data;
-    int status = 0;
-
-    thread_block_signals();
-    coap_log_notice("[%u] <%u> %s Connection with HTTP client started",
-                    con->listener_index, con->con_index, con->addr);
-    while (status == 0)
-    {
-        status = connection_exchange(con);
-    }
     if (status < 0)
     {
         coap_log_notice("[%u] <%u> %s Connection with HTTP client failed",
@@ -563,6 +2120,354 @@ void *connection_thread_func(void *data)
     }
     connection_delete(con);
     stats_log();
+}
+
+/*  return: { 0, success
+ *          {<0, error
+ */
+static int connection_get_bufs(connection_t *con)
+{
+    int ret = 0;
+
+    ret = data_buf_pool_get(&buf_pool, &con->recv_buf, CONNECTION_DATA_BUF_MAX_SIZE);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    ret = data_buf_pool_get(&buf_pool, &con->send_buf, CONNECTION_DATA_BUF_MAX_SIZE);
+    if (ret < 0)
+    {
+        data_buf_pool_put(&buf_pool, &con->recv_buf);
+        return ret;
+    }
+    return 0;
+}
+
+/* must be called with park_lock held */
+static void connection_park_unlink(connection_t *con)
+{
+    if (con->park_prev != NULL)
+    {
+        con->park_prev->park_next = con->park_next;
+    }
+    else
+    {
+        park_head = con->park_next;
+    }
+    if (con->park_next != NULL)
+    {
+        con->park_next->park_prev = con->park_prev;
+    }
+    else
+    {
+        park_tail = con->park_prev;
+    }
+    con->park_prev = NULL;
+    con->park_next = NULL;
+    num_parked--;
+}
+
+/* start a new thread to serve a parked connection that has become
+ * readable, or to close it if status is non-zero
+ */
+static void connection_resume(connection_t *con, int status)
+{
+    thread_t thread = {0};
+    int ret = 0;
+
+    con->park_status = status;
+    ret = thread_init(&thread, &park_ctx, connection_thread_func, con);
+    if (ret < 0)
+    {
+        coap_log_error("[%u] <%u> %s Unable to create thread to resume connection with HTTP client",
+                       con->listener_index, con->con_index, con->addr);
+        connection_finish(con, -1);
+    }
+}
+
+/* close parked connections that have reached their
+ * timeout, or all parked connections when draining
+ */
+static void connection_park_close(int all)
+{
+    connection_t *closed = NULL;
+    connection_t *next = NULL;
+    connection_t *con = NULL;
+    struct timespec now = {0};
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    lock_get(&park_lock);
+    con = park_head;
+    while (con != NULL)
+    {
+        next = con->park_next;
+        if ((all) || (con->park_expire <= now.tv_sec))
+        {
+            connection_park_unlink(con);
+            con->park_next = closed;
+            closed = con;
+        }
+        con = next;
+    }
+    lock_put(&park_lock);
+    /* closing a TLS session blocks so each connection is closed in its own thread */
+    while (closed != NULL)
+    {
+        con = closed;
+        closed = con->park_next;
+        con->park_next = NULL;
+        if (!all)
+        {
+            epoll_ctl(park_fd, EPOLL_CTL_DEL, tls_sock_get_sd(con->sock), NULL);
+        }
+        connection_resume(con, all ? CON_RET_DRAINED : CON_RET_TIMEDOUT);
+    }
+}
+
+/* wait for parked connections to become readable or time out */
+static void *connection_park_thread_func(void *data)
+{
+    struct epoll_event ev[CONNECTION_PARK_MAX_EVENTS] = {{0}};
+    connection_t *con = NULL;
+    int drained = 0;
+    int num = 0;
+    int fd = 0;
+    int i = 0;
+
+    thread_block_signals();
+    while (!drained)
+    {
+        errno = 0;
+        num = epoll_wait(park_fd, ev, CONNECTION_PARK_MAX_EVENTS, 1000);
+        if ((num < 0) && (errno != EINTR))
+        {
+            coap_log_error("Call to epoll_wait returned: -1, errno: %d (%s)",
+                           errno, strerror(errno));
+        }
+        for (i = 0; i < num; i++)
+        {
+            con = (connection_t *)ev[i].data.ptr;
+            if (con == NULL)
+            {
+                drained = 1;
+                continue;
+            }
+            lock_get(&park_lock);
+            connection_park_unlink(con);
+            lock_put(&park_lock);
+            epoll_ctl(park_fd, EPOLL_CTL_DEL, tls_sock_get_sd(con->sock), NULL);
+            connection_resume(con, 0);
+        }
+        if (!drained)
+        {
+            connection_park_close(0);
+        }
+    }
+    /* nothing can be parked after this */
+    lock_get(&park_lock);
+    fd = park_fd;
+    park_fd = -1;
+    lock_put(&park_lock);
+    close(fd);
+    connection_park_close(1);
+    return NULL;
+}
+
+/*  return: { 0, success
+ *          {<0, error
+ */
+static int connection_park_init(void)
+{
+    struct epoll_event ev = {0};
+    thread_t thread = {0};
+    int ret = 0;
+
+    ret = lock_create(&park_lock);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    park_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (park_fd < 0)
+    {
+        ret = -errno;
+        lock_destroy(&park_lock);
+        return ret;
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    ret = epoll_ctl(park_fd, EPOLL_CTL_ADD, drain_fd, &ev);
+    if (ret < 0)
+    {
+        ret = -errno;
+        close(park_fd);
+        park_fd = -1;
+        lock_destroy(&park_lock);
+        return ret;
+    }
+    ret = thread_detached_ctx_create(&park_ctx);
+    if (ret < 0)
+    {
+        close(park_fd);
+        park_fd = -1;
+        lock_destroy(&park_lock);
+        return ret;
+    }
+    ret = thread_init(&thread, &park_ctx, connection_park_thread_func, NULL);
+    if (ret < 0)
+    {
+        coap_log_error("Unable to create park thread");
+        thread_ctx_destroy(&park_ctx);
+        close(park_fd);
+        park_fd = -1;
+        lock_destroy(&park_lock);
+        return ret;
+    }
+    return 0;
+}
+
+/* release everything but the TLS session and socket of an idle
+ * connection and hand it over to the park thread, the CoAP client
+ * goes to the client pool and the data buffers to the buffer pool
+ *
+ *  return: { 1, parked, the connection belongs to the park thread
+ *          { 0, not parked
+ *          {<0, error
+ */
+static int connection_park(connection_t *con)
+{
+    struct epoll_event ev = {0};
+    struct timespec now = {0};
+    int ret = 0;
+
+    coap_log_debug("[%u] <%u> %s Parking idle connection with HTTP client",
+                   con->listener_index, con->con_index, con->addr);
+    if (con->upstream != NULL)
+    {
+        connection_member_clients_destroy(con);
+    }
+    if (con->hedge_client_active)
+    {
+        connection_hedge_client_destroy(con);
+    }
+    if (con->coap_client_active)
+    {
+        connection_coap_client_release(con);
+    }
+    data_buf_pool_put(&buf_pool, &con->send_buf);
+    data_buf_pool_put(&buf_pool, &con->recv_buf);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    con->park_expire = now.tv_sec + tls_sock_get_timeout(con->sock);
+    con->num_parks++;
+    ev.events = EPOLLIN;
+    ev.data.ptr = con;
+
+    lock_get(&park_lock);
+    ret = -1;
+    if (park_fd >= 0)
+    {
+        con->park_prev = park_tail;
+        con->park_next = NULL;
+        if (park_tail != NULL)
+        {
+            park_tail->park_next = con;
+        }
+        else
+        {
+            park_head = con;
+        }
+        park_tail = con;
+        num_parked++;
+        /* the park thread may take the connection as soon as it is added */
+        ret = epoll_ctl(park_fd, EPOLL_CTL_ADD, tls_sock_get_sd(con->sock), &ev);
+        if (ret < 0)
+        {
+            connection_park_unlink(con);
+        }
+    }
+    lock_put(&park_lock);
+    if (ret == 0)
+    {
+        return 1;
+    }
+    /* not parked so carry on as before */
+    con->num_parks--;
+    return connection_get_bufs(con);
+}
+
+/* wait for the next request and park the connection if none arrives soon
+ *
+ *  return: { 1, parked, the connection belongs to the park thread
+ *          { 0, not parked
+ *          {<0, error
+ */
+static int connection_wait(connection_t *con)
+{
+    struct pollfd fds[2] = {{0}};
+    int ret = 0;
+
+    if ((data_buf_get_count(&con->recv_buf) != 0) || (tls_sock_get_pending(con->sock) != 0))
+    {
+        return 0;
+    }
+    fds[0].fd = tls_sock_get_sd(con->sock);
+    fds[0].events = POLLIN;
+    fds[1].fd = drain_fd;
+    fds[1].events = POLLIN;
+    ret = poll(fds, 2, CONNECTION_PARK_DELAY_MS);
+    if (ret != 0)
+    {
+        /* readable, draining and errors are all handled by connection_recv */
+        return 0;
+    }
+    return connection_park(con);
+}
+
+void *connection_thread_func(void *data)
+{
+    connection_t *con = (connection_t *)data;
+    int status = 0;
+    int ret = 0;
+
+    thread_block_signals();
+    if (con->num_parks == 0)
+    {
+        coap_log_notice("[%u] <%u> %s Connection with HTTP client started",
+                        con->listener_index, con->con_index, con->addr);
+    }
+    else if (con->park_status == CON_RET_TIMEDOUT)
+    {
+        coap_log_info("[%u] <%u> %s Timed out waiting to read from socket connected to HTTP client",
+                      con->listener_index, con->con_index, con->addr);
+        status = con->park_status;
+    }
+    else if (con->park_status == CON_RET_DRAINED)
+    {
+        coap_log_info("[%u] <%u> %s Closing idle connection to HTTP client for drain",
+                      con->listener_index, con->con_index, con->addr);
+        status = con->park_status;
+    }
+    else
+    {
+        coap_log_info("[%u] <%u> %s Connection with HTTP client resumed",
+                      con->listener_index, con->con_index, con->addr);
+        status = connection_get_bufs(con);
+    }
+    while ((status == 0) && (!draining))
+    {
+        ret = connection_wait(con);
+        if (ret == 1)
+        {
+            return NULL;  /* parked */
+        }
+        if (ret < 0)
+        {
+            status = ret;
+            break;
+        }
+        status = connection_exchange(con);
+    }
+    connection_finish(con, status);
     return NULL;
 }
 
@@ -581,7 +2486,7 @@ connection_t *connection_new(tls_sock_t *sock, unsigned listener_index, unsigned
     con->con_index = con_index;
     tls_sock_get_addr_string(sock, con->addr, sizeof(con->addr));
     con->sock = sock;
-    ret = data_buf_create(&con->recv_buf, CONNECTION_DATA_BUF_SIZE, CONNECTION_DATA_BUF_MAX_SIZE);
+    ret = data_buf_pool_get(&buf_pool, &con->recv_buf, CONNECTION_DATA_BUF_MAX_SIZE);
     if (ret == -EINVAL)
     {
         coap_log_error("[%u] <%u> Attempt to create data buffer with invalid size",
@@ -596,12 +2501,12 @@ connection_t *connection_new(tls_sock_t *sock, unsigned listener_index, unsigned
         free(con);
         return NULL;
     }
-    ret = data_buf_create(&con->send_buf, CONNECTION_DATA_BUF_SIZE, CONNECTION_DATA_BUF_MAX_SIZE);
+    ret = data_buf_pool_get(&buf_pool, &con->send_buf, CONNECTION_DATA_BUF_MAX_SIZE);
     if (ret == -EINVAL)
     {
         coap_log_error("[%u] <%u> Attempt to create data buffer with invalid size",
                        listener_index, con_index);
-        data_buf_destroy(&con->recv_buf);
+        data_buf_pool_put(&buf_pool, &con->recv_buf);
         free(con);
         return NULL;
     }
@@ -609,23 +2514,37 @@ connection_t *connection_new(tls_sock_t *sock, unsigned listener_index, unsigned
     {
         coap_log_error("[%u] <%u> Out of memory",
                        listener_index, con_index);
-        data_buf_destroy(&con->recv_buf);
+        data_buf_pool_put(&buf_pool, &con->recv_buf);
         free(con);
         return NULL;
     }
     con->param = param;
+    lock_get(&active_lock);
+    num_active++;
+    lock_put(&active_lock);
     return con;
 }
 
 void connection_delete(connection_t *con)
 {
+    if (con->upstream != NULL)
+    {
+        connection_member_clients_destroy(con);
+    }
+    if (con->hedge_client_active)
+    {
+        connection_hedge_client_destroy(con);
+    }
     if (con->coap_client_active)
     {
-        connection_coap_client_destroy(con);
+        connection_coap_client_release(con);
     }
-    data_buf_destroy(&con->send_buf);
-    data_buf_destroy(&con->recv_buf);
+    data_buf_pool_put(&buf_pool, &con->send_buf);
+    data_buf_pool_put(&buf_pool, &con->recv_buf);
     tls_sock_close(con->sock);
     free(con->sock);
     free(con);
+    lock_get(&active_lock);
+    num_active--;
+    lock_put(&active_lock);
 }
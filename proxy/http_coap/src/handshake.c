@@ -0,0 +1,409 @@
+/*
+ * Copyright (c) 2015 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ *  @file handshake.c
+ *
+ *  @brief Source file for the FreeCoAP HTTP/CoAP proxy handshake module
+ *
+ *  The listeners only accept connections. The public key operations
+ *  of each TLS handshake are done by a fixed number of worker threads
+ *  that run at a lower priority than the threads serving established
+ *  connections, so a burst of new connections cannot starve them.
+ *  When the queue of accepted connections is full the listeners stop
+ *  accepting and further connections wait in the listen backlog.
+ *  Threads inherit the nice value of the thread that creates them so
+ *  the workers post established connections to a dispatch thread at
+ *  normal priority that starts a thread for each of them.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include "handshake.h"
+#include "connection.h"
+#include "thread.h"
+#include "lock.h"
+#include "sock.h"
+#include "coap_log.h"
+
+#define HANDSHAKE_NICE  10                                                      /* nice value of the worker threads */
+
+static handshake_job_t *handshake_head = NULL;
+static handshake_job_t *handshake_tail = NULL;
+static handshake_job_t *handshake_done_head = NULL;                             /* established connections */
+static handshake_job_t *handshake_done_tail = NULL;
+static unsigned handshake_num_queued = 0;
+static unsigned handshake_max_queued = 0;
+static unsigned handshake_num_workers = 0;
+static int handshake_stop = 0;
+static int handshake_dispatch_stop = 0;                                         /* set once the workers have stopped */
+static lock_t handshake_lock;                                                   /* protects the queues */
+static pthread_cond_t handshake_job_cond;                                       /* signalled when a job is queued */
+static pthread_cond_t handshake_space_cond;                                     /* signalled when a job leaves the queue */
+static pthread_cond_t handshake_done_cond;                                      /* signalled when a handshake completes */
+static thread_ctx_t handshake_worker_ctx;
+static thread_ctx_t handshake_con_ctx;                                          /* for connection threads */
+static thread_t handshake_worker[HANDSHAKE_MAX_WORKERS];
+static thread_t handshake_dispatcher;
+
+/*  return: { 0, success
+ *          {<0, error
+ */
+static int handshake_job_run(handshake_job_t *job)
+{
+    int ret = 0;
+
+    ret = tls_sock_accept_handshake(job->sock);
+    if (ret != SOCK_OK)
+    {
+        if ((ret != SOCK_TIMEOUT) && (ret != SOCK_INTR))
+        {
+            coap_log_error("TLS socket error: %s", sock_strerror(ret));
+        }
+        free(job->sock);
+        return -1;
+    }
+    return 0;
+}
+
+static void handshake_job_dispatch(handshake_job_t *job)
+{
+    connection_t *con = NULL;
+    thread_t thread = {0};
+    int ret = 0;
+
+    con = connection_new(job->sock, job->listener_index, job->con_index, job->param);
+    if (con == NULL)
+    {
+        coap_log_error("Unable to create connection data");
+        tls_sock_close(job->sock);
+        free(job->sock);
+        return;
+    }
+    ret = thread_init(&thread, &handshake_con_ctx, connection_thread_func, con);
+    if (ret < 0)
+    {
+        coap_log_error("Unable to create connection thread");
+        connection_delete(con);
+    }
+}
+
+/* start a thread for each established connection */
+static void *handshake_dispatch_thread_func(void *data)
+{
+    handshake_job_t *job = NULL;
+
+    thread_block_signals();
+    while (1)
+    {
+        lock_get(&handshake_lock);
+        while ((handshake_done_head == NULL) && (!handshake_dispatch_stop))
+        {
+            lock_cond_wait(&handshake_done_cond, &handshake_lock);
+        }
+        if (handshake_done_head == NULL)
+        {
+            lock_put(&handshake_lock);
+            break;
+        }
+        job = handshake_done_head;
+        handshake_done_head = job->next;
+        if (handshake_done_head == NULL)
+        {
+            handshake_done_tail = NULL;
+        }
+        lock_put(&handshake_lock);
+
+        handshake_job_dispatch(job);
+        free(job);
+    }
+    return NULL;
+}
+
+static void *handshake_thread_func(void *data)
+{
+    handshake_job_t *job = NULL;
+    int ret = 0;
+
+    thread_block_signals();
+    /* the nice value of a thread can be set on its own under linux */
+    setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), HANDSHAKE_NICE);
+    while (1)
+    {
+        lock_get(&handshake_lock);
+        while ((handshake_head == NULL) && (!handshake_stop))
+        {
+            lock_cond_wait(&handshake_job_cond, &handshake_lock);
+        }
+        if (handshake_stop)
+        {
+            lock_put(&handshake_lock);
+            break;
+        }
+        job = handshake_head;
+        handshake_head = job->next;
+        if (handshake_head == NULL)
+        {
+            handshake_tail = NULL;
+        }
+        handshake_num_queued--;
+        pthread_cond_signal(&handshake_space_cond);
+        lock_put(&handshake_lock);
+
+        ret = handshake_job_run(job);
+        if (ret < 0)
+        {
+            free(job);
+            continue;
+        }
+        lock_get(&handshake_lock);
+        job->next = NULL;
+        if (handshake_done_tail != NULL)
+        {
+            handshake_done_tail->next = job;
+        }
+        else
+        {
+            handshake_done_head = job;
+        }
+        handshake_done_tail = job;
+        pthread_cond_signal(&handshake_done_cond);
+        lock_put(&handshake_lock);
+    }
+    return NULL;
+}
+
+/*  return: { 0, success
+ *          {<0, error
+ */
+int handshake_init(param_t *param)
+{
+    pthread_condattr_t attr;
+    unsigned i = 0;
+    int ret = 0;
+
+    handshake_num_workers = param_get_http_server_handshake_workers(param);
+    if (handshake_num_workers == 0)
+    {
+        handshake_num_workers = 1;
+    }
+    if (handshake_num_workers > HANDSHAKE_MAX_WORKERS)
+    {
+        handshake_num_workers = HANDSHAKE_MAX_WORKERS;
+    }
+    handshake_max_queued = param_get_http_server_handshake_queue(param);
+    if (handshake_max_queued == 0)
+    {
+        handshake_max_queued = 1;
+    }
+    handshake_stop = 0;
+    handshake_dispatch_stop = 0;
+
+    ret = lock_create(&handshake_lock);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    pthread_cond_init(&handshake_job_cond, NULL);
+    pthread_cond_init(&handshake_done_cond, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&handshake_space_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    ret = thread_detached_ctx_create(&handshake_con_ctx);
+    if (ret < 0)
+    {
+        pthread_cond_destroy(&handshake_done_cond);
+        pthread_cond_destroy(&handshake_space_cond);
+        pthread_cond_destroy(&handshake_job_cond);
+        lock_destroy(&handshake_lock);
+        return ret;
+    }
+    ret = thread_joinable_ctx_create(&handshake_worker_ctx);
+    if (ret < 0)
+    {
+        thread_ctx_destroy(&handshake_con_ctx);
+        pthread_cond_destroy(&handshake_done_cond);
+        pthread_cond_destroy(&handshake_space_cond);
+        pthread_cond_destroy(&handshake_job_cond);
+        lock_destroy(&handshake_lock);
+        return ret;
+    }
+    ret = thread_init(&handshake_dispatcher, &handshake_worker_ctx, handshake_dispatch_thread_func, NULL);
+    if (ret < 0)
+    {
+        coap_log_error("Unable to create handshake dispatch thread");
+        thread_ctx_destroy(&handshake_worker_ctx);
+        thread_ctx_destroy(&handshake_con_ctx);
+        pthread_cond_destroy(&handshake_done_cond);
+        pthread_cond_destroy(&handshake_space_cond);
+        pthread_cond_destroy(&handshake_job_cond);
+        lock_destroy(&handshake_lock);
+        return ret;
+    }
+    for (i = 0; i < handshake_num_workers; i++)
+    {
+        ret = thread_init(&handshake_worker[i], &handshake_worker_ctx, handshake_thread_func, NULL);
+        if (ret < 0)
+        {
+            coap_log_error("Unable to create handshake thread");
+            handshake_num_workers = i;
+            handshake_deinit();
+            return ret;
+        }
+    }
+    coap_log_info("Started %u handshake threads", handshake_num_workers);
+    return 0;
+}
+
+void handshake_deinit(void)
+{
+    handshake_job_t *job = NULL;
+    unsigned i = 0;
+
+    lock_get(&handshake_lock);
+    handshake_stop = 1;
+    pthread_cond_broadcast(&handshake_job_cond);
+    pthread_cond_broadcast(&handshake_space_cond);
+    lock_put(&handshake_lock);
+    for (i = 0; i < handshake_num_workers; i++)
+    {
+        thread_join(&handshake_worker[i], NULL);
+    }
+    /* the dispatch thread starts any connection that is still waiting */
+    lock_get(&handshake_lock);
+    handshake_dispatch_stop = 1;
+    pthread_cond_signal(&handshake_done_cond);
+    lock_put(&handshake_lock);
+    thread_join(&handshake_dispatcher, NULL);
+    /* connections that never got a handshake */
+    while (handshake_head != NULL)
+    {
+        job = handshake_head;
+        handshake_head = job->next;
+        close(tls_sock_get_sd(job->sock));
+        free(job->sock);
+        free(job);
+    }
+    handshake_tail = NULL;
+    handshake_num_queued = 0;
+    thread_ctx_destroy(&handshake_worker_ctx);
+    thread_ctx_destroy(&handshake_con_ctx);
+    pthread_cond_destroy(&handshake_done_cond);
+    pthread_cond_destroy(&handshake_space_cond);
+    pthread_cond_destroy(&handshake_job_cond);
+    lock_destroy(&handshake_lock);
+}
+
+/* wait for room in the queue before accepting another connection
+ *
+ *  return: { 0, there is room in the queue
+ *          {<0, timeout or stopping
+ */
+int handshake_wait(unsigned ms)
+{
+    struct timespec limit = {0};
+    int ret = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &limit);
+    limit.tv_sec += ms / 1000;
+    limit.tv_nsec += (ms % 1000) * 1000000;
+    if (limit.tv_nsec >= 1000000000)
+    {
+        limit.tv_sec++;
+        limit.tv_nsec -= 1000000000;
+    }
+    lock_get(&handshake_lock);
+    while ((handshake_num_queued >= handshake_max_queued) && (!handshake_stop))
+    {
+        ret = lock_cond_timedwait(&handshake_space_cond, &handshake_lock, &limit);
+        if (ret == ETIMEDOUT)
+        {
+            break;
+        }
+    }
+    ret = 0;
+    if (handshake_stop)
+    {
+        ret = -ECANCELED;
+    }
+    else if (handshake_num_queued >= handshake_max_queued)
+    {
+        ret = -EAGAIN;
+    }
+    lock_put(&handshake_lock);
+    return ret;
+}
+
+/* queue an accepted connection for a handshake, the
+ * job owns the socket whether or not this succeeds
+ *
+ *  return: { 0, success
+ *          {<0, error
+ */
+int handshake_submit(tls_sock_t *sock, unsigned listener_index, unsigned con_index, param_t *param)
+{
+    handshake_job_t *job = NULL;
+
+    job = (handshake_job_t *)calloc(1, sizeof(handshake_job_t));
+    if (job == NULL)
+    {
+        close(tls_sock_get_sd(sock));
+        free(sock);
+        return -ENOMEM;
+    }
+    job->sock = sock;
+    job->listener_index = listener_index;
+    job->con_index = con_index;
+    job->param = param;
+    lock_get(&handshake_lock);
+    if (handshake_stop)
+    {
+        lock_put(&handshake_lock);
+        close(tls_sock_get_sd(sock));
+        free(sock);
+        free(job);
+        return -ECANCELED;
+    }
+    if (handshake_tail != NULL)
+    {
+        handshake_tail->next = job;
+    }
+    else
+    {
+        handshake_head = job;
+    }
+    handshake_tail = job;
+    handshake_num_queued++;
+    pthread_cond_signal(&handshake_job_cond);
+    lock_put(&handshake_lock);
+    return 0;
+}
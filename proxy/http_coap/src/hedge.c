@@ -0,0 +1,170 @@
+/*
+ * Copyright (c) 2015 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ *  @file hedge.c
+ *
+ *  @brief Source file for the FreeCoAP HTTP/CoAP proxy hedge module
+ *
+ *  The delay before a hedged request is sent follows an estimate
+ *  of the 95th percentile exchange duration for the route, so
+ *  that about 5% of the requests are hedged.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include "hedge.h"
+#include "coap_log.h"
+
+static hedge_t *hedge_list = NULL;
+
+static int hedge_add(param_route_t *route)
+{
+    hedge_t *hedge = NULL;
+    int ret = 0;
+
+    hedge = (hedge_t *)calloc(1, sizeof(hedge_t));
+    if (hedge == NULL)
+    {
+        coap_log_error("Out of memory");
+        return -ENOMEM;
+    }
+    ret = lock_create(&hedge->lock);
+    if (ret < 0)
+    {
+        coap_log_error("Unable to create lock");
+        free(hedge);
+        return -1;
+    }
+    hedge->route = route;
+    hedge->est_us = route->coap_client_hedge_delay * 1000;
+    hedge->next = hedge_list;
+    hedge_list = hedge;
+    return 0;
+}
+
+/* routes without an alternate CoAP server are not hedged */
+int hedge_init(param_t *param)
+{
+    param_route_t *route = NULL;
+    unsigned i = 0;
+    int ret = 0;
+
+    route = param_get_default_route(param);
+    if (route->coap_client_hedge_host != NULL)
+    {
+        ret = hedge_add(route);
+        if (ret < 0)
+        {
+            return ret;
+        }
+    }
+    for (i = 0; i < PARAM_ROUTE_HASH_SIZE; i++)
+    {
+        for (route = param->route[i]; route != NULL; route = route->next)
+        {
+            if (route->coap_client_hedge_host == NULL)
+            {
+                continue;
+            }
+            ret = hedge_add(route);
+            if (ret < 0)
+            {
+                hedge_deinit();
+                return ret;
+            }
+        }
+    }
+    return 0;
+}
+
+void hedge_deinit(void)
+{
+    hedge_t *hedge = NULL;
+
+    while (hedge_list != NULL)
+    {
+        hedge = hedge_list;
+        hedge_list = hedge->next;
+        lock_destroy(&hedge->lock);
+        free(hedge);
+    }
+}
+
+hedge_t *hedge_find(param_route_t *route)
+{
+    hedge_t *hedge = NULL;
+
+    for (hedge = hedge_list; hedge != NULL; hedge = hedge->next)
+    {
+        if (hedge->route == route)
+        {
+            return hedge;
+        }
+    }
+    return NULL;
+}
+
+/* current estimate of the 95th percentile exchange duration (msec) */
+unsigned hedge_get_delay(hedge_t *hedge)
+{
+    unsigned est_us = 0;
+
+    lock_get(&hedge->lock);
+    est_us = hedge->est_us;
+    lock_put(&hedge->lock);
+    return (est_us + 999) / 1000;
+}
+
+/* stochastic quantile estimate: the estimate rises 19 times
+ * faster than it falls so that it settles where 5% of the
+ * exchanges take longer
+ */
+void hedge_update(hedge_t *hedge, unsigned elapsed_us)
+{
+    unsigned step = 0;
+
+    lock_get(&hedge->lock);
+    step = hedge->est_us / 512 + 1;
+    if (elapsed_us > hedge->est_us)
+    {
+        hedge->est_us += 19 * step;
+        if (hedge->est_us > HEDGE_MAX_DELAY_US)
+        {
+            hedge->est_us = HEDGE_MAX_DELAY_US;
+        }
+    }
+    else
+    {
+        hedge->est_us -= step;
+        if (hedge->est_us < HEDGE_MIN_DELAY_US)
+        {
+            hedge->est_us = HEDGE_MIN_DELAY_US;
+        }
+    }
+    lock_put(&hedge->lock);
+}
@@ -34,26 +34,34 @@
 #include <stdlib.h>
 #include "listener.h"
 #include "connection.h"
+#include "handshake.h"
 #include "sock.h"
 #include "coap_log.h"
 
+#define LISTENER_WAIT_MS  1000                                                  /* maximum wait for room in the handshake queue */
+
 extern int go;
 
 static void *listener_thread_func(void *data)
 {
     listener_t *listener = (listener_t *)data;
-    connection_t *con = NULL;
     tls_sock_t *sock = NULL;
     unsigned con_index = 0;
-    thread_t thread = {0};
     int ret = 0;
 
     thread_block_signals();
 
-    coap_log_notice("[%u] Listening on port %s", listener->index, param_get_port(listener->param));
+    coap_log_notice("[%u] Listening on port %s", listener->index, listener->port);
 
     while (go)
     {
+        /* leave new connections in the listen backlog while the handshake threads are busy */
+        ret = handshake_wait(LISTENER_WAIT_MS);
+        if (ret < 0)
+        {
+            continue;
+        }
+
         sock = (tls_sock_t *)malloc(sizeof(tls_sock_t));
         if (sock == NULL)
         {
@@ -61,41 +69,31 @@ static void *listener_thread_func(void *data)
             break;
         }
 
-        ret = tls_ssock_accept(&listener->ssock, sock);
+        ret = tls_ssock_accept_tcp(&listener->ssock, sock);
         if (ret != SOCK_OK)
         {
             free(sock);
-            if (ret != SOCK_TIMEOUT)
+            if ((ret != SOCK_TIMEOUT) && (ret != SOCK_INTR))
             {
                 coap_log_error("TLS socket error: %s", sock_strerror(ret));
             }
             continue;
         }
 
-        con = connection_new(sock, listener->index, con_index++, listener->param);
-        if (con == NULL)
-        {
-            coap_log_error("Unable to create connection data");
-            tls_sock_close(sock);
-            free(sock);
-            break;
-        }
-
-        ret = thread_init(&thread, &listener->ctx, connection_thread_func, con);
+        ret = handshake_submit(sock, listener->index, con_index++, listener->param);
         if (ret < 0)
         {
-            coap_log_error("Unable to create connection thread");
-            connection_delete(con);
-            break;
+            coap_log_error("Unable to queue connection for handshake");
         }
     }
-    coap_log_notice("[%u] Stopped listening on port %s", listener->index, param_get_port(listener->param));
+    coap_log_notice("[%u] Stopped listening on port %s", listener->index, listener->port);
     listener_delete(listener);
     return NULL;
 }
 
 
-listener_t *listener_new(unsigned index, tls_server_t *server, param_t *param, int timeout, int backlog)
+/* sd is a listening socket inherited from a previous process or -1 */
+listener_t *listener_new(unsigned index, tls_server_t *server, param_t *param, const char *port, int sd, int timeout, int backlog)
 {
     listener_t *listener = NULL;
     int ret = 0;
@@ -108,6 +106,7 @@ listener_t *listener_new(unsigned index, tls_server_t *server, param_t *param, i
     }
 
     listener->index = index;
+    listener->port = port;
     listener->param = param;
 
     ret = thread_detached_ctx_create(&listener->ctx);
@@ -118,7 +117,14 @@ listener_t *listener_new(unsigned index, tls_server_t *server, param_t *param, i
         return NULL;
     }
 
-    ret = tls_ssock_open(&listener->ssock, server, param_get_port(param), timeout, backlog);
+    if (sd >= 0)
+    {
+        ret = tls_ssock_open_from_sd(&listener->ssock, server, sd, timeout);
+    }
+    else
+    {
+        ret = tls_ssock_open(&listener->ssock, server, port, timeout, backlog);
+    }
     if (ret != SOCK_OK)
     {
         coap_log_error(sock_strerror(ret));
@@ -126,6 +132,8 @@ listener_t *listener_new(unsigned index, tls_server_t *server, param_t *param, i
         free(listener);
         return NULL;
     }
+    /* stop accepting as soon as the proxy starts draining */
+    tls_ssock_set_cancel_fd(&listener->ssock, connection_get_drain_fd());
 
     return listener;
 }
@@ -33,11 +33,15 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <errno.h>
 #include "param.h"
 #include "config.h"
 #include "util.h"
 
 #define PARAM_BUF_SIZE  1024
+#define PARAM_PORT_SEP  ", \t"
+#define PARAM_MAX_UINT  0xffff
 
 #define param_report_start(file_name)                   {coap_log_notice("reading config file: '%s'", file_name);}
 #define param_report_file_error(file_name)              {coap_log_error("unable to load config file: '%s'", file_name);}
@@ -45,6 +49,8 @@
 #define param_report_parse_error(file_name, line, col)  {coap_log_error("parse error in config file: '%s', line: %d, col: %d", file_name, line, col);}
 #define param_report_success(key, val)                  {coap_log_notice("config parameter: '%s'='%s'", key, val);}
 #define param_report_unknown(key, val)                  {coap_log_error("config parameter: '%s' defined with unsupported value: '%s'", key, val);}
+#define param_report_missing(section, key)              {coap_log_error("config section: '%s' requires parameter: '%s'", section, key);}
+#define param_report_duplicate(section, key, val)       {coap_log_error("config section: '%s' duplicates parameter: '%s'='%s'", section, key, val);}
 #define param_report_fail(file_name)                    {coap_log_error("failed to read config file: '%s'", file_name);}
 #define param_report_end(file_name)                     {coap_log_notice("finished reading config file: '%s'", file_name);}
 
@@ -67,6 +73,31 @@ static int param_parse_key_val(config_t *config, const char *section, const char
     return 0;
 }
 
+/* an optional parameter without a default value is left as NULL */
+static int param_parse_opt_key_val(config_t *config, const char *section, const char *key, const char *def_val, char **val)
+{
+    const char *str = NULL;
+
+    str = config_get(config, section, key);
+    if (str == NULL)
+    {
+        str = def_val;
+    }
+    if (str == NULL)
+    {
+        *val = NULL;
+        return 0;
+    }
+    *val = strdup(str);
+    if (*val == NULL)
+    {
+        param_report_mem_error();
+        return -1;
+    }
+    param_report_success(key, *val);
+    return 0;
+}
+
 static int param_parse_log_level(param_t *param, config_t *config)
 {
     const char *key = NULL;
@@ -107,8 +138,512 @@ static int param_parse_log_level(param_t *param, config_t *config)
     return 0;
 }
 
+static int param_parse_uint_max(config_t *config, const char *section, const char *key, unsigned def_val, unsigned max_val, unsigned *val)
+{
+    const char *str = NULL;
+    unsigned long num = 0;
+    char *end = NULL;
+
+    str = config_get(config, section, key);
+    if (str == NULL)
+    {
+        *val = def_val;
+        coap_log_notice("config parameter: '%s'='%u'", key, def_val);
+        return 0;
+    }
+    errno = 0;
+    num = strtoul(str, &end, 10);
+    if ((errno != 0) || (end == str) || (*end != '\0') || (num > max_val))
+    {
+        param_report_unknown(key, str);
+        return -1;
+    }
+    *val = (unsigned)num;
+    param_report_success(key, str);
+    return 0;
+}
+
+static int param_parse_uint(config_t *config, const char *section, const char *key, unsigned def_val, unsigned *val)
+{
+    return param_parse_uint_max(config, section, key, def_val, PARAM_MAX_UINT, val);
+}
+
+static int param_parse_ports(param_t *param)
+{
+    char *save = NULL;
+    char *buf = NULL;
+    char *tok = NULL;
+
+    buf = strdup(param->port);
+    if (buf == NULL)
+    {
+        param_report_mem_error();
+        return -1;
+    }
+    tok = strtok_r(buf, PARAM_PORT_SEP, &save);
+    while (tok != NULL)
+    {
+        if (param->num_ports >= PARAM_MAX_PORTS)
+        {
+            param_report_unknown("port", param->port);
+            free(buf);
+            return -1;
+        }
+        param->ports[param->num_ports] = strdup(tok);
+        if (param->ports[param->num_ports] == NULL)
+        {
+            param_report_mem_error();
+            free(buf);
+            return -1;
+        }
+        param->num_ports++;
+        tok = strtok_r(NULL, PARAM_PORT_SEP, &save);
+    }
+    free(buf);
+    if (param->num_ports == 0)
+    {
+        param_report_unknown("port", param->port);
+        return -1;
+    }
+    return 0;
+}
+
+static void param_route_destroy(param_route_t *route)
+{
+    free(route->coap_client_hedge_port);
+    free(route->coap_client_hedge_host);
+    free(route->coap_client_trust_file_name);
+    free(route->coap_client_cert_file_name);
+    free(route->coap_client_key_file_name);
+    free(route->host);
+    memset(route, 0, sizeof(param_route_t));
+}
+
+static void param_route_delete(param_route_t *route)
+{
+    param_route_destroy(route);
+    free(route);
+}
+
+/* missing values are taken from the default route */
+static int param_route_parse(param_route_t *route, param_route_t *def, config_t *config, const char *section)
+{
+    int ret = 0;
+
+    ret = param_parse_key_val(config, section, "key_file", def->coap_client_key_file_name, &route->coap_client_key_file_name);
+    if (ret != 0)
+    {
+        return ret;
+    }
+    ret = param_parse_key_val(config, section, "cert_file", def->coap_client_cert_file_name, &route->coap_client_cert_file_name);
+    if (ret != 0)
+    {
+        return ret;
+    }
+    ret = param_parse_key_val(config, section, "trust_file", def->coap_client_trust_file_name, &route->coap_client_trust_file_name);
+    if (ret != 0)
+    {
+        return ret;
+    }
+    ret = param_parse_uint(config, section, "ack_timeout", def->coap_client_ack_timeout, &route->coap_client_ack_timeout);
+    if (ret != 0)
+    {
+        return ret;
+    }
+    if (route->coap_client_ack_timeout == 0)
+    {
+        param_report_unknown("ack_timeout", "0");
+        return -1;
+    }
+    ret = param_parse_uint(config, section, "max_retransmit", def->coap_client_max_retransmit, &route->coap_client_max_retransmit);
+    if (ret != 0)
+    {
+        return ret;
+    }
+    ret = param_parse_uint(config, section, "resp_timeout", def->coap_client_resp_timeout, &route->coap_client_resp_timeout);
+    if (ret != 0)
+    {
+        return ret;
+    }
+    if (route->coap_client_resp_timeout == 0)
+    {
+        param_report_unknown("resp_timeout", "0");
+        return -1;
+    }
+    ret = param_parse_uint_max(config, section, "deadline", def->coap_client_deadline, PARAM_MAX_MSEC, &route->coap_client_deadline);
+    if (ret != 0)
+    {
+        return ret;
+    }
+    ret = param_parse_opt_key_val(config, section, "hedge_host", def->coap_client_hedge_host, &route->coap_client_hedge_host);
+    if (ret != 0)
+    {
+        return ret;
+    }
+    ret = param_parse_opt_key_val(config, section, "hedge_port", def->coap_client_hedge_port, &route->coap_client_hedge_port);
+    if (ret != 0)
+    {
+        return ret;
+    }
+    ret = param_parse_uint_max(config, section, "hedge_delay", def->coap_client_hedge_delay, PARAM_MAX_HEDGE_DELAY, &route->coap_client_hedge_delay);
+    if (ret != 0)
+    {
+        return ret;
+    }
+    if (route->coap_client_hedge_delay == 0)
+    {
+        param_report_unknown("hedge_delay", "0");
+        return -1;
+    }
+    ret = param_parse_uint(config, section, "max_concurrent", def->coap_client_max_concurrent, &route->coap_client_max_concurrent);
+    if (ret != 0)
+    {
+        return ret;
+    }
+    ret = param_parse_uint(config, section, "max_queued", def->coap_client_max_queued, &route->coap_client_max_queued);
+    if (ret != 0)
+    {
+        return ret;
+    }
+    ret = param_parse_uint_max(config, section, "queue_timeout", def->coap_client_queue_timeout, PARAM_MAX_MSEC, &route->coap_client_queue_timeout);
+    if (ret != 0)
+    {
+        return ret;
+    }
+    return 0;
+}
+
+static param_route_t *param_find_route(param_t *param, const char *host, size_t len)
+{
+    param_route_t *route = NULL;
+    unsigned i = 0;
+
+    i = util_hash_str(host, len) % PARAM_ROUTE_HASH_SIZE;
+    route = param->route[i];
+    while (route != NULL)
+    {
+        if ((strlen(route->host) == len) && (strncasecmp(route->host, host, len) == 0))
+        {
+            return route;
+        }
+        route = route->next;
+    }
+    return NULL;
+}
+
+static int param_parse_route(param_t *param, config_t *config, const char *section)
+{
+    param_route_t *route = NULL;
+    const char *host = NULL;
+    unsigned i = 0;
+    int ret = 0;
+
+    host = config_get(config, section, "host");
+    if (host == NULL)
+    {
+        param_report_missing(section, "host");
+        return -1;
+    }
+    if (param_find_route(param, host, strlen(host)) != NULL)
+    {
+        param_report_duplicate(section, "host", host);
+        return -1;
+    }
+    route = (param_route_t *)calloc(1, sizeof(param_route_t));
+    if (route == NULL)
+    {
+        param_report_mem_error();
+        return -1;
+    }
+    ret = param_parse_key_val(config, section, "host", host, &route->host);
+    if (ret != 0)
+    {
+        param_route_delete(route);
+        return ret;
+    }
+    ret = param_route_parse(route, &param->def_route, config, section);
+    if (ret != 0)
+    {
+        param_route_delete(route);
+        return ret;
+    }
+    i = util_hash_str(route->host, strlen(route->host)) % PARAM_ROUTE_HASH_SIZE;
+    route->next = param->route[i];
+    param->route[i] = route;
+    return 0;
+}
+
+static int param_parse_vhost(param_t *param, config_t *config, const char *section)
+{
+    param_vhost_t *vhost = NULL;
+    const char *server_name = NULL;
+    int ret = 0;
+
+    server_name = config_get(config, section, "server_name");
+    if (server_name == NULL)
+    {
+        param_report_missing(section, "server_name");
+        return -1;
+    }
+    vhost = (param_vhost_t *)calloc(1, sizeof(param_vhost_t));
+    if (vhost == NULL)
+    {
+        param_report_mem_error();
+        return -1;
+    }
+    /* link the virtual host first so that param_destroy can free it on error */
+    vhost->next = param->vhost;
+    param->vhost = vhost;
+    ret = param_parse_key_val(config, section, "server_name", server_name, &vhost->server_name);
+    if (ret != 0)
+    {
+        return ret;
+    }
+    ret = param_parse_key_val(config, section, "cert_file", param->http_server_cert_file_name, &vhost->cert_file_name);
+    if (ret != 0)
+    {
+        return ret;
+    }
+    ret = param_parse_key_val(config, section, "key_file", param->http_server_key_file_name, &vhost->key_file_name);
+    if (ret != 0)
+    {
+        return ret;
+    }
+    return 0;
+}
+
+static void param_upstream_delete(param_upstream_t *upstream)
+{
+    unsigned i = 0;
+
+    for (i = 0; i < upstream->num_members; i++)
+    {
+        free(upstream->member_port[i]);
+        free(upstream->member_host[i]);
+    }
+    free(upstream->name);
+    free(upstream);
+}
+
+/* split "host:port" or "[host]:port" */
+static int param_parse_member(param_upstream_t *upstream, char *str)
+{
+    char *host = str;
+    char *port = NULL;
+    char *p = NULL;
+
+    if (str[0] == '[')
+    {
+        host = str + 1;
+        p = strchr(host, ']');
+        if ((p == NULL) || (p[1] != ':'))
+        {
+            return -1;
+        }
+        *p = '\0';
+        port = p + 2;
+    }
+    else
+    {
+        p = strrchr(str, ':');
+        if (p == NULL)
+        {
+            return -1;
+        }
+        *p = '\0';
+        port = p + 1;
+    }
+    if ((*host == '\0') || (*port == '\0'))
+    {
+        return -1;
+    }
+    if (upstream->num_members >= PARAM_MAX_UPSTREAM_MEMBERS)
+    {
+        return -1;
+    }
+    upstream->member_host[upstream->num_members] = strdup(host);
+    upstream->member_port[upstream->num_members] = strdup(port);
+    upstream->num_members++;
+    if ((upstream->member_host[upstream->num_members - 1] == NULL)
+     || (upstream->member_port[upstream->num_members - 1] == NULL))
+    {
+        param_report_mem_error();
+        return -1;
+    }
+    return 0;
+}
+
+static int param_parse_upstream(param_t *param, config_t *config, const char *section)
+{
+    param_upstream_t *upstream = NULL;
+    const char *members = NULL;
+    const char *policy = NULL;
+    char *save = NULL;
+    char *buf = NULL;
+    char *tok = NULL;
+    int ret = 0;
+
+    members = config_get(config, section, "members");
+    if (members == NULL)
+    {
+        param_report_missing(section, "members");
+        return -1;
+    }
+    upstream = (param_upstream_t *)calloc(1, sizeof(param_upstream_t));
+    if (upstream == NULL)
+    {
+        param_report_mem_error();
+        return -1;
+    }
+    /* link the upstream group first so that param_destroy can free it on error */
+    upstream->next = param->upstream;
+    param->upstream = upstream;
+    upstream->name = strdup(section + strlen(PARAM_UPSTREAM_SECTION_PREFIX));
+    buf = strdup(members);
+    if ((upstream->name == NULL) || (buf == NULL))
+    {
+        free(buf);
+        param_report_mem_error();
+        return -1;
+    }
+    tok = strtok_r(buf, PARAM_PORT_SEP, &save);
+    while (tok != NULL)
+    {
+        ret = param_parse_member(upstream, tok);
+        if (ret != 0)
+        {
+            param_report_unknown("members", members);
+            free(buf);
+            return -1;
+        }
+        tok = strtok_r(NULL, PARAM_PORT_SEP, &save);
+    }
+    free(buf);
+    if (upstream->num_members == 0)
+    {
+        param_report_unknown("members", members);
+        return -1;
+    }
+    param_report_success("members", members);
+    policy = config_get(config, section, "policy");
+    if (policy == NULL)
+    {
+        policy = PARAM_DEF_UPSTREAM_POLICY;
+    }
+    if (strcmp(policy, "least_outstanding") == 0)
+    {
+        upstream->policy = PARAM_UPSTREAM_LEAST_OUTSTANDING;
+    }
+    else if (strcmp(policy, "ewma") == 0)
+    {
+        upstream->policy = PARAM_UPSTREAM_EWMA;
+    }
+    else
+    {
+        param_report_unknown("policy", policy);
+        return -1;
+    }
+    param_report_success("policy", policy);
+    ret = param_parse_uint(config, section, "max_fails", PARAM_DEF_UPSTREAM_MAX_FAILS, &upstream->max_fails);
+    if (ret != 0)
+    {
+        return ret;
+    }
+    if (upstream->max_fails == 0)
+    {
+        param_report_unknown("max_fails", "0");
+        return -1;
+    }
+    ret = param_parse_uint(config, section, "eject_time", PARAM_DEF_UPSTREAM_EJECT_TIME, &upstream->eject_time);
+    if (ret != 0)
+    {
+        return ret;
+    }
+    ret = param_parse_uint(config, section, "ping_interval", PARAM_DEF_UPSTREAM_PING_INTERVAL, &upstream->ping_interval);
+    if (ret != 0)
+    {
+        return ret;
+    }
+    return 0;
+}
+
+static int param_parse_client(param_t *param, config_t *config, const char *section)
+{
+    param_client_t *client = NULL;
+    const char *name = NULL;
+    int ret = 0;
+
+    name = config_get(config, section, "name");
+    if (name == NULL)
+    {
+        param_report_missing(section, "name");
+        return -1;
+    }
+    client = (param_client_t *)calloc(1, sizeof(param_client_t));
+    if (client == NULL)
+    {
+        param_report_mem_error();
+        return -1;
+    }
+    /* link the client first so that param_destroy can free it on error */
+    client->next = param->client;
+    param->client = client;
+    ret = param_parse_key_val(config, section, "name", name, &client->name);
+    if (ret != 0)
+    {
+        return ret;
+    }
+    ret = param_parse_uint(config, section, "weight", PARAM_DEF_CLIENT_WEIGHT, &client->weight);
+    if (ret != 0)
+    {
+        return ret;
+    }
+    if (client->weight == 0)
+    {
+        param_report_unknown("weight", "0");
+        return -1;
+    }
+    return 0;
+}
+
+static int param_parse_sections(param_t *param, config_t *config)
+{
+    config_section_t *section = NULL;
+    const char *name = NULL;
+    int ret = 0;
+
+    section = config_get_first_section(config);
+    while (section != NULL)
+    {
+        name = config_section_get_name(section);
+        if (strncmp(name, PARAM_VHOST_SECTION_PREFIX, strlen(PARAM_VHOST_SECTION_PREFIX)) == 0)
+        {
+            ret = param_parse_vhost(param, config, name);
+        }
+        else if (strncmp(name, PARAM_ROUTE_SECTION_PREFIX, strlen(PARAM_ROUTE_SECTION_PREFIX)) == 0)
+        {
+            ret = param_parse_route(param, config, name);
+        }
+        else if (strncmp(name, PARAM_UPSTREAM_SECTION_PREFIX, strlen(PARAM_UPSTREAM_SECTION_PREFIX)) == 0)
+        {
+            ret = param_parse_upstream(param, config, name);
+        }
+        else if (strncmp(name, PARAM_CLIENT_SECTION_PREFIX, strlen(PARAM_CLIENT_SECTION_PREFIX)) == 0)
+        {
+            ret = param_parse_client(param, config, name);
+        }
+        if (ret != 0)
+        {
+            return ret;
+        }
+        section = config_section_get_next(section);
+    }
+    return 0;
+}
+
 static int param_parse(param_t *param, const char *file_name, config_t *config, const char *buf)
 {
+    param_route_t def = {0};
     unsigned line = 0;
     unsigned col = 0;
     int ret = 0;
@@ -130,12 +665,24 @@ static int param_parse(param_t *param, const char *file_name, config_t *config,
         return ret;
     }
 
+    ret = param_parse_ports(param);
+    if (ret != 0)
+    {
+        return ret;
+    }
+
     ret = param_parse_log_level(param, config);
     if (ret != 0)
     {
         return ret;
     }
 
+    ret = param_parse_uint(config, "", "drain_timeout", PARAM_DEF_DRAIN_TIMEOUT, &param->drain_timeout);
+    if (ret != 0)
+    {
+        return ret;
+    }
+
     ret = param_parse_key_val(config,
                               "http_server",
                               "key_file",
@@ -166,6 +713,18 @@ static int param_parse(param_t *param, const char *file_name, config_t *config,
         return ret;
     }
 
+    ret = param_parse_uint(config, "http_server", "handshake_workers", PARAM_DEF_HTTP_SERVER_HANDSHAKE_WORKERS, &param->http_server_handshake_workers);
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    ret = param_parse_uint(config, "http_server", "handshake_queue", PARAM_DEF_HTTP_SERVER_HANDSHAKE_QUEUE, &param->http_server_handshake_queue);
+    if (ret != 0)
+    {
+        return ret;
+    }
+
     ret = param_parse_key_val(config,
                               "coap_client",
                               "key_file",
@@ -196,6 +755,48 @@ static int param_parse(param_t *param, const char *file_name, config_t *config,
         return ret;
     }
 
+    /* the default route applies to CoAP servers without a route section */
+    def.coap_client_key_file_name = param->coap_client_key_file_name;
+    def.coap_client_cert_file_name = param->coap_client_cert_file_name;
+    def.coap_client_trust_file_name = param->coap_client_trust_file_name;
+    def.coap_client_ack_timeout = PARAM_DEF_COAP_CLIENT_ACK_TIMEOUT;
+    def.coap_client_max_retransmit = PARAM_DEF_COAP_CLIENT_MAX_RETRANSMIT;
+    def.coap_client_resp_timeout = PARAM_DEF_COAP_CLIENT_RESP_TIMEOUT;
+    def.coap_client_deadline = PARAM_DEF_COAP_CLIENT_DEADLINE;
+    def.coap_client_hedge_delay = PARAM_DEF_COAP_CLIENT_HEDGE_DELAY;
+    def.coap_client_max_concurrent = PARAM_DEF_COAP_CLIENT_MAX_CONCURRENT;
+    def.coap_client_max_queued = PARAM_DEF_COAP_CLIENT_MAX_QUEUED;
+    def.coap_client_queue_timeout = PARAM_DEF_COAP_CLIENT_QUEUE_TIMEOUT;
+    ret = param_route_parse(&param->def_route, &def, config, "coap_client");
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    ret = param_parse_uint(config, "dns", "ttl", PARAM_DEF_DNS_TTL, &param->dns_ttl);
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    ret = param_parse_uint(config, "dns", "neg_ttl", PARAM_DEF_DNS_NEG_TTL, &param->dns_neg_ttl);
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    ret = param_parse_uint(config, "dns", "timeout", PARAM_DEF_DNS_TIMEOUT, &param->dns_timeout);
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    ret = param_parse_sections(param, config);
+    if (ret != 0)
+    {
+        return ret;
+    }
+
     return ret;
 }
 
@@ -240,6 +841,48 @@ int param_create(param_t *param, const char *file_name)
 
 void param_destroy(param_t *param)
 {
+    param_upstream_t *upstream = NULL;
+    param_client_t *client = NULL;
+    param_vhost_t *vhost = NULL;
+    param_route_t *route = NULL;
+    unsigned i = 0;
+
+    for (i = 0; i < PARAM_ROUTE_HASH_SIZE; i++)
+    {
+        while (param->route[i] != NULL)
+        {
+            route = param->route[i];
+            param->route[i] = route->next;
+            param_route_delete(route);
+        }
+    }
+    param_route_destroy(&param->def_route);
+    while (param->upstream != NULL)
+    {
+        upstream = param->upstream;
+        param->upstream = upstream->next;
+        param_upstream_delete(upstream);
+    }
+    while (param->client != NULL)
+    {
+        client = param->client;
+        param->client = client->next;
+        free(client->name);
+        free(client);
+    }
+    while (param->vhost != NULL)
+    {
+        vhost = param->vhost;
+        param->vhost = vhost->next;
+        free(vhost->key_file_name);
+        free(vhost->cert_file_name);
+        free(vhost->server_name);
+        free(vhost);
+    }
+    for (i = 0; i < param->num_ports; i++)
+    {
+        free(param->ports[i]);
+    }
     if (param->coap_client_trust_file_name != NULL)
     {
         free(param->coap_client_trust_file_name);
@@ -270,3 +913,40 @@ void param_destroy(param_t *param)
     }
     memset(param, 0, sizeof(param_t));
 }
+
+/* match the complete host name first and then its first label */
+param_route_t *param_get_route(param_t *param, const char *host)
+{
+    param_route_t *route = NULL;
+    const char *p = NULL;
+
+    route = param_find_route(param, host, strlen(host));
+    if (route != NULL)
+    {
+        return route;
+    }
+    p = strchr(host, '.');
+    if (p != NULL)
+    {
+        route = param_find_route(param, host, p - host);
+        if (route != NULL)
+        {
+            return route;
+        }
+    }
+    return &param->def_route;
+}
+
+unsigned param_get_client_weight(param_t *param, const char *name)
+{
+    param_client_t *client = NULL;
+
+    for (client = param->client; client != NULL; client = client->next)
+    {
+        if (strcmp(client->name, name) == 0)
+        {
+            return client->weight;
+        }
+    }
+    return PARAM_DEF_CLIENT_WEIGHT;
+}
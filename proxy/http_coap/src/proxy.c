@@ -33,22 +33,54 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
 #include <signal.h>
 #include <getopt.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 #include <gnutls/gnutls.h>
 #include "listener.h"
+#include "handshake.h"
 #include "connection.h"
 #include "param.h"
+#include "upstream.h"
+#include "hedge.h"
+#include "client_pool.h"
+#include "scheduler.h"
+#include "resolver.h"
 #include "tls.h"
+#include "lock.h"
 #include "coap_log.h"
 
 #define DEF_MAX_LOG_LEVEL  COAP_LOG_DEBUG                                       /**< Default maximum log level */
 #define CONFIG_FILE_NAME   "proxy.conf"                                         /**< Configuration file name */
 #define SOCKET_TIMEOUT     120                                                  /**< Timeout for TLS/IPv6 socket operations */
 #define SOCKET_BACKLOG     10                                                   /**< Backlog queue size for the listening TLS/IPv6 socket */
+#define LISTEN_FDS_START   3                                                    /**< First listening socket passed to a new process */
+#define LISTEN_PID_ENV     "LISTEN_PID"                                         /**< Process that the listening sockets are passed to */
+#define LISTEN_FDS_ENV     "LISTEN_FDS"                                         /**< Number of listening sockets passed to a new process */
+#define TICKET_KEY_FD_ENV  "PROXY_TICKET_KEY_FD"                                /**< Pipe carrying the session ticket key to a new process */
+#define READY_FD_ENV       "PROXY_READY_FD"                                     /**< Pipe used by a new process to report that it is running */
+#define MAX_TICKET_KEY_LEN 256                                                  /**< Maximum length of a session ticket key */
+#define RESTART_TIMEOUT    60                                                   /**< Maximum wait for a new process to start (sec) */
+#define STOP_TIMEOUT       5                                                    /**< Maximum wait for a new process that failed to start to exit after SIGTERM (sec) */
+#define STOP_POLL_USEC     100000                                               /**< Interval between checks for a new process that failed to start to exit */
+#define DRAIN_POLL_USEC    100000                                               /**< Interval between checks for active connections while draining */
+
+extern char **environ;
 
 int go = 1;                                                                     /**< Global variable used to indicate to the listener module to run or stop */
+static int restart = 0;                                                         /**< Set to start a new process and drain this one */
+static int inherited_sd[PARAM_MAX_PORTS] = {0};                                 /**< Listening sockets passed from a previous process */
+static unsigned num_inherited_sd = 0;                                           /**< Number of listening sockets passed from a previous process */
+static int ticket_key_fd = -1;                                                  /**< Pipe carrying the session ticket key of a previous process */
+static int ready_fd = -1;                                                       /**< Pipe used to tell a previous process that this process is running */
 
 /**
  *  @brief Signal handler for the interrupt signal
@@ -60,6 +92,467 @@ static void signal_handler(int signo)
     go = 0;
 }
 
+/**
+ *  @brief Signal handler for the restart signal
+ *
+ *  @param[in] signo Signal number
+ */
+static void restart_handler(int signo)
+{
+    restart = 1;
+}
+
+/**
+ *  @brief Get a file descriptor from an environment variable
+ *
+ *  @param[in] name Name of the environment variable
+ *
+ *  @returns File descriptor or -1
+ */
+static int get_env_fd(const char *name)
+{
+    const char *str = NULL;
+    char *end = NULL;
+    long val = 0;
+
+    str = getenv(name);
+    if (str == NULL)
+    {
+        return -1;
+    }
+    val = strtol(str, &end, 10);
+    if ((end == str) || (*end != '\0') || (val < LISTEN_FDS_START))
+    {
+        return -1;
+    }
+    return (int)val;
+}
+
+/**
+ *  @brief Collect the file descriptors passed from a previous process
+ *
+ *  The listening sockets are passed in the style of systemd socket
+ *  activation, i.e. LISTEN_FDS sockets starting at descriptor 3 when
+ *  LISTEN_PID is the current process.
+ */
+static void get_inherited_fds(void)
+{
+    const char *str = NULL;
+    unsigned num = 0;
+    unsigned i = 0;
+
+    str = getenv(LISTEN_PID_ENV);
+    if ((str != NULL) && (strtol(str, NULL, 10) == (long)getpid()))
+    {
+        str = getenv(LISTEN_FDS_ENV);
+        if (str != NULL)
+        {
+            num = strtoul(str, NULL, 10);
+        }
+        if (num > PARAM_MAX_PORTS)
+        {
+            num = PARAM_MAX_PORTS;
+        }
+        for (i = 0; i < num; i++)
+        {
+            inherited_sd[i] = LISTEN_FDS_START + i;
+        }
+        num_inherited_sd = num;
+        ticket_key_fd = get_env_fd(TICKET_KEY_FD_ENV);
+        ready_fd = get_env_fd(READY_FD_ENV);
+    }
+    unsetenv(LISTEN_PID_ENV);
+    unsetenv(LISTEN_FDS_ENV);
+    unsetenv(TICKET_KEY_FD_ENV);
+    unsetenv(READY_FD_ENV);
+}
+
+/**
+ *  @brief Take the inherited listening socket bound to a port
+ *
+ *  @param[in] port Port number
+ *
+ *  @returns Socket descriptor or -1 if none was inherited
+ */
+static int take_inherited_sd(const char *port)
+{
+    struct sockaddr_storage addr = {0};
+    in_port_t num = 0;
+    socklen_t len = 0;
+    unsigned i = 0;
+    int sd = 0;
+
+    for (i = 0; i < num_inherited_sd; i++)
+    {
+        if (inherited_sd[i] < 0)
+        {
+            continue;
+        }
+        len = (socklen_t)sizeof(addr);
+        if (getsockname(inherited_sd[i], (struct sockaddr *)&addr, &len) < 0)
+        {
+            continue;
+        }
+        if (addr.ss_family == AF_INET6)
+        {
+            num = ntohs(((struct sockaddr_in6 *)&addr)->sin6_port);
+        }
+        else
+        {
+            num = ntohs(((struct sockaddr_in *)&addr)->sin_port);
+        }
+        if (num == (in_port_t)atoi(port))
+        {
+            sd = inherited_sd[i];
+            inherited_sd[i] = -1;
+            coap_log_info("Using listening socket for port %s from previous process", port);
+            return sd;
+        }
+    }
+    return -1;
+}
+
+/**
+ *  @brief Close the inherited listening sockets that are no longer configured
+ */
+static void close_inherited_sds(void)
+{
+    unsigned i = 0;
+
+    for (i = 0; i < num_inherited_sd; i++)
+    {
+        if (inherited_sd[i] >= 0)
+        {
+            close(inherited_sd[i]);
+            inherited_sd[i] = -1;
+        }
+    }
+}
+
+/**
+ *  @brief Use the session ticket key of a previous process
+ *
+ *  Session tickets issued by the previous process remain valid
+ *  so that HTTP clients can resume their TLS sessions.
+ *
+ *  @param[in,out] server Pointer to a TLS server structure
+ */
+static void inherit_ticket_key(tls_server_t *server)
+{
+    unsigned char buf[MAX_TICKET_KEY_LEN] = {0};
+    ssize_t num = 0;
+    int ret = 0;
+
+    if (ticket_key_fd < 0)
+    {
+        return;
+    }
+    num = read(ticket_key_fd, buf, sizeof(buf));
+    close(ticket_key_fd);
+    ticket_key_fd = -1;
+    if (num > 0)
+    {
+        ret = tls_server_set_ticket_key(server, buf, num);
+    }
+    memset(buf, 0, sizeof(buf));
+    if ((num <= 0) || (ret != SOCK_OK))
+    {
+        coap_log_warn("Unable to use the session ticket key of the previous process");
+        return;
+    }
+    coap_log_info("Using the session ticket key of the previous process");
+}
+
+/**
+ *  @brief Tell a previous process that this process is running
+ */
+static void notify_ready(void)
+{
+    char c = 1;
+
+    if (ready_fd < 0)
+    {
+        return;
+    }
+    if (write(ready_fd, &c, sizeof(c)) != sizeof(c))
+    {
+        coap_log_warn("Unable to notify the previous process: %s", strerror(errno));
+    }
+    close(ready_fd);
+    ready_fd = -1;
+}
+
+/**
+ *  @brief Check if an environment entry has a given name
+ *
+ *  @param[in] entry Environment entry
+ *  @param[in] name Name
+ *
+ *  @returns Result
+ *  @retval 1 Match
+ *  @retval 0 No match
+ */
+static int env_is(const char *entry, const char *name)
+{
+    size_t len = strlen(name);
+
+    return ((strncmp(entry, name, len) == 0) && (entry[len] == '='));
+}
+
+/**
+ *  @brief Replace the child process with a new proxy process
+ *
+ *  Only async-signal-safe functions are called as the parent is multithreaded.
+ *
+ *  @param[in] argv Command line arguments
+ *  @param[in] envp Environment of the new process
+ *  @param[out] pid_entry Buffer that receives the LISTEN_PID environment entry
+ *  @param[in,out] fd Descriptors to pass, in order
+ *  @param[in] num_fd Number of descriptors to pass
+ *  @param[in] max_fd Limit on descriptor numbers
+ */
+static void exec_new_process(char **argv, char **envp, char *pid_entry, int *fd, unsigned num_fd, long max_fd)
+{
+    char digits[16] = {0};
+    unsigned num = 0;
+    unsigned i = 0;
+    pid_t pid = 0;
+    long j = 0;
+
+    /* move the descriptors out of the way before placing them in order */
+    for (i = 0; i < num_fd; i++)
+    {
+        fd[i] = fcntl(fd[i], F_DUPFD, LISTEN_FDS_START + num_fd);
+        if (fd[i] < 0)
+        {
+            _exit(EXIT_FAILURE);
+        }
+    }
+    for (i = 0; i < num_fd; i++)
+    {
+        if (dup2(fd[i], LISTEN_FDS_START + i) < 0)
+        {
+            _exit(EXIT_FAILURE);
+        }
+    }
+    /* connections and CoAP client sockets stay with this process */
+    for (j = LISTEN_FDS_START + num_fd; j < max_fd; j++)
+    {
+        close(j);
+    }
+    pid = getpid();
+    do
+    {
+        digits[num++] = '0' + (pid % 10);
+        pid /= 10;
+    }
+    while (pid > 0);
+    pid_entry += sizeof(LISTEN_PID_ENV);  /* skip the name and '=' */
+    while (num > 0)
+    {
+        *pid_entry++ = digits[--num];
+    }
+    *pid_entry = '\0';
+    execve("/proc/self/exe", argv, envp);
+    _exit(EXIT_FAILURE);
+}
+
+/**
+ *  @brief Stop a new process that failed to start
+ *
+ *  The new process may still be running and accepting
+ *  connections on the inherited listening sockets so it
+ *  is stopped, and killed if it does not exit in time,
+ *  before this process continues on its own.
+ *
+ *  @param[in] pid Process ID of the new process
+ */
+static void stop_new_process(pid_t pid)
+{
+    unsigned i = 0;
+    pid_t ret = 0;
+
+    kill(pid, SIGTERM);
+    for (i = 0; i < STOP_TIMEOUT * (1000000 / STOP_POLL_USEC); i++)
+    {
+        ret = waitpid(pid, NULL, WNOHANG);
+        if ((ret == pid) || ((ret < 0) && (errno != EINTR)))
+        {
+            return;
+        }
+        usleep(STOP_POLL_USEC);
+    }
+    coap_log_warn("Killing new process %d", (int)pid);
+    kill(pid, SIGKILL);
+    do
+    {
+        ret = waitpid(pid, NULL, 0);
+    }
+    while ((ret < 0) && (errno == EINTR));
+}
+
+/**
+ *  @brief Start a new proxy process that takes over the listening sockets
+ *
+ *  The new process inherits the listening sockets and the session
+ *  ticket key and reports when its listeners are running.
+ *
+ *  @param[in] argv Command line arguments
+ *  @param[in] listener Array of pointers to listeners
+ *  @param[in] num_listeners Number of listeners
+ *  @param[in] server Pointer to the TLS server structure
+ *
+ *  @returns Operation status
+ *  @retval 0 Success, this process should drain
+ *  @retval <0 Error, this process should continue
+ */
+static int start_new_process(char **argv, listener_t **listener, unsigned num_listeners, tls_server_t *server)
+{
+    gnutls_datum_t key = tls_server_get_ticket_key(server);
+    struct pollfd pfd = {0};
+    char pid_entry[sizeof(LISTEN_PID_ENV) + 16] = LISTEN_PID_ENV "=";
+    char fds_entry[sizeof(LISTEN_FDS_ENV) + 16] = {0};
+    char key_entry[sizeof(TICKET_KEY_FD_ENV) + 16] = {0};
+    char ready_entry[sizeof(READY_FD_ENV) + 16] = {0};
+    char **envp = NULL;
+    ssize_t num = 0;
+    unsigned num_env = 0;
+    unsigned i = 0;
+    unsigned j = 0;
+    pid_t pid = 0;
+    long max_fd = 0;
+    int fd[PARAM_MAX_PORTS + 2] = {0};
+    int key_pipe[2] = {0};
+    int ready_pipe[2] = {0};
+    char c = 0;
+    int ret = 0;
+
+    for (num_env = 0; environ[num_env] != NULL; num_env++)
+        ;
+    envp = (char **)calloc(num_env + 5, sizeof(char *));
+    if (envp == NULL)
+    {
+        coap_log_error("Out of memory");
+        return -ENOMEM;
+    }
+    for (i = 0; i < num_env; i++)
+    {
+        if ((!env_is(environ[i], LISTEN_PID_ENV))
+         && (!env_is(environ[i], LISTEN_FDS_ENV))
+         && (!env_is(environ[i], TICKET_KEY_FD_ENV))
+         && (!env_is(environ[i], READY_FD_ENV)))
+        {
+            envp[j++] = environ[i];
+        }
+    }
+    snprintf(fds_entry, sizeof(fds_entry), "%s=%u", LISTEN_FDS_ENV, num_listeners);
+    snprintf(key_entry, sizeof(key_entry), "%s=%u", TICKET_KEY_FD_ENV, LISTEN_FDS_START + num_listeners);
+    snprintf(ready_entry, sizeof(ready_entry), "%s=%u", READY_FD_ENV, LISTEN_FDS_START + num_listeners + 1);
+    envp[j++] = pid_entry;
+    envp[j++] = fds_entry;
+    envp[j++] = key_entry;
+    envp[j++] = ready_entry;
+
+    ret = pipe(key_pipe);
+    if (ret < 0)
+    {
+        ret = -errno;
+        free(envp);
+        return ret;
+    }
+    ret = pipe(ready_pipe);
+    if (ret < 0)
+    {
+        ret = -errno;
+        close(key_pipe[0]);
+        close(key_pipe[1]);
+        free(envp);
+        return ret;
+    }
+    /* the key is small enough to fit in the pipe without a reader */
+    num = write(key_pipe[1], key.data, key.size);
+    close(key_pipe[1]);
+    if (num != (ssize_t)key.size)
+    {
+        coap_log_warn("Unable to pass the session ticket key to the new process");
+    }
+    for (i = 0; i < num_listeners; i++)
+    {
+        fd[i] = listener_get_sd(listener[i]);
+    }
+    fd[num_listeners] = key_pipe[0];
+    fd[num_listeners + 1] = ready_pipe[1];
+    max_fd = sysconf(_SC_OPEN_MAX);
+    if (max_fd < 0)
+    {
+        max_fd = 1024;
+    }
+
+    pid = fork();
+    if (pid == 0)
+    {
+        exec_new_process(argv, envp, pid_entry, fd, num_listeners + 2, max_fd);
+    }
+    ret = -errno;
+    close(key_pipe[0]);
+    close(ready_pipe[1]);
+    free(envp);
+    if (pid < 0)
+    {
+        coap_log_error("Unable to start new process: %s", strerror(-ret));
+        close(ready_pipe[0]);
+        return ret;
+    }
+    coap_log_notice("Started new process %d", (int)pid);
+
+    /* keep accepting connections until the new process is running */
+    pfd.fd = ready_pipe[0];
+    pfd.events = POLLIN;
+    do
+    {
+        ret = poll(&pfd, 1, RESTART_TIMEOUT * 1000);
+    }
+    while ((ret < 0) && (errno == EINTR) && (go));
+    num = 0;
+    if (ret > 0)
+    {
+        num = read(ready_pipe[0], &c, sizeof(c));
+    }
+    close(ready_pipe[0]);
+    if (num != sizeof(c))
+    {
+        coap_log_error("New process %d failed to start", (int)pid);
+        stop_new_process(pid);
+        return -ECHILD;
+    }
+    coap_log_notice("New process %d is running", (int)pid);
+    return 0;
+}
+
+/**
+ *  @brief Let the connections with HTTP clients finish their current exchanges
+ *
+ *  @param[in] timeout Maximum time to wait (sec)
+ */
+static void drain(unsigned timeout)
+{
+    unsigned num = 0;
+    unsigned i = 0;
+
+    coap_log_notice("Draining connections");
+    connection_drain();
+    num = connection_get_num_active();
+    for (i = 0; (i < timeout * (1000000 / DRAIN_POLL_USEC)) && (num > 0); i++)
+    {
+        usleep(DRAIN_POLL_USEC);
+        num = connection_get_num_active();
+    }
+    if (num > 0)
+    {
+        coap_log_warn("Stopping with %u connections to HTTP clients still active", num);
+    }
+}
+
 /**
  *  @brief Helper function to list command line options
  */
@@ -91,13 +584,16 @@ int main(int argc, char **argv)
         {0, 0, 0, 0}
     };
     struct sigaction sah = {{0}};
+    struct sigaction sar = {{0}};
     struct sigaction sai = {{0}};
     const char *config_file_name = CONFIG_FILE_NAME;
     const char *short_opts = ":hc:";
     const char *gnutls_ver = NULL;
     tls_server_t server = {0};
-    listener_t *listener = NULL;
+    listener_t *listener[PARAM_MAX_PORTS] = {NULL};
+    param_vhost_t *vhost = NULL;
     unsigned listener_index = 0;
+    unsigned num_listeners = 0;
     param_t param = {0};
     int long_index = 0;
     int ret = 0;
@@ -106,16 +602,20 @@ int main(int argc, char **argv)
     /* initialise signal handler */
     sah.sa_handler = signal_handler;
     sah.sa_flags = 0;
+    sar.sa_handler = restart_handler;
+    sar.sa_flags = 0;
     sai.sa_handler = SIG_IGN;
     sai.sa_flags = 0;
     if ((sigemptyset(&sai.sa_mask) == -1)
      || (sigfillset(&sah.sa_mask)  == -1)    /* block all signals while handling this one */
+     || (sigfillset(&sar.sa_mask)  == -1)
      || (sigaction(SIGHUP,  &sah, NULL) == -1)
      || (sigaction(SIGINT,  &sah, NULL) == -1)
      || (sigaction(SIGQUIT, &sah, NULL) == -1)
      || (sigaction(SIGABRT, &sah, NULL) == -1)
      || (sigaction(SIGPIPE, &sai, NULL) == -1)
      || (sigaction(SIGTERM, &sah, NULL) == -1)
+     || (sigaction(SIGUSR2, &sar, NULL) == -1)    /* start a new process and drain this one */
         )
     {
         fprintf(stderr, "Error: unable to set singal handler\n");
@@ -174,6 +674,8 @@ int main(int argc, char **argv)
 
     coap_log_set_level(param_get_max_log_level(&param));
 
+    get_inherited_fds();
+
     gnutls_ver = gnutls_check_version(NULL);
     if (gnutls_ver == NULL)
     {
@@ -204,6 +706,28 @@ int main(int argc, char **argv)
         return EXIT_FAILURE;
     }
 
+    /* virtual hosts share the trust file of the default HTTP server */
+    vhost = param_get_first_vhost(&param);
+    while (vhost != NULL)
+    {
+        ret = tls_server_add_sni(&server,
+                                 vhost->server_name,
+                                 param_get_http_server_trust_file_name(&param),
+                                 vhost->cert_file_name,
+                                 vhost->key_file_name);
+        if (ret != SOCK_OK)
+        {
+            coap_log_error("Unable to add virtual host '%s'", vhost->server_name);
+            tls_server_destroy(&server);
+            tls_deinit();
+            param_destroy(&param);
+            return EXIT_FAILURE;
+        }
+        vhost = vhost->next;
+    }
+
+    inherit_ticket_key(&server);
+
     ret = connection_init();
     if (ret < 0)
     {
@@ -214,44 +738,177 @@ int main(int argc, char **argv)
         return EXIT_FAILURE;
     }
 
-    listener = listener_new(listener_index,
-                            &server,
-                            &param,
-                            SOCKET_TIMEOUT,
-                            SOCKET_BACKLOG);
-    if (listener == NULL)
+    ret = resolver_init(&param);
+    if (ret < 0)
+    {
+        coap_log_error("Unable to initialise resolver module");
+        tls_server_destroy(&server);
+        tls_deinit();
+        param_destroy(&param);
+        return EXIT_FAILURE;
+    }
+
+    ret = upstream_init(&param);
+    if (ret < 0)
+    {
+        coap_log_error("Unable to initialise upstream module");
+        resolver_deinit();
+        tls_server_destroy(&server);
+        tls_deinit();
+        param_destroy(&param);
+        return EXIT_FAILURE;
+    }
+
+    ret = hedge_init(&param);
+    if (ret < 0)
+    {
+        coap_log_error("Unable to initialise hedge module");
+        upstream_deinit();
+        resolver_deinit();
+        tls_server_destroy(&server);
+        tls_deinit();
+        param_destroy(&param);
+        return EXIT_FAILURE;
+    }
+
+    ret = client_pool_init();
+    if (ret < 0)
     {
+        coap_log_error("Unable to initialise client pool module");
+        hedge_deinit();
+        upstream_deinit();
+        resolver_deinit();
         tls_server_destroy(&server);
         tls_deinit();
         param_destroy(&param);
         return EXIT_FAILURE;
     }
 
-    ret = listener_run(listener);
+    ret = scheduler_init();
     if (ret < 0)
     {
-        listener_delete(listener);
+        coap_log_error("Unable to initialise scheduler module");
+        client_pool_deinit();
+        hedge_deinit();
+        upstream_deinit();
+        resolver_deinit();
         tls_server_destroy(&server);
         tls_deinit();
         param_destroy(&param);
         return EXIT_FAILURE;
     }
 
-    /* the listener runs in its own thread,
-     * waits for a signal and cleans up after itself
-     * i.e. calls listener_delete()
+    ret = handshake_init(&param);
+    if (ret < 0)
+    {
+        coap_log_error("Unable to initialise handshake module");
+        scheduler_deinit();
+        client_pool_deinit();
+        hedge_deinit();
+        upstream_deinit();
+        resolver_deinit();
+        tls_server_destroy(&server);
+        tls_deinit();
+        param_destroy(&param);
+        return EXIT_FAILURE;
+    }
+
+    /* open every port before any listener starts accepting connections */
+    num_listeners = param_get_num_ports(&param);
+    for (listener_index = 0; listener_index < num_listeners; listener_index++)
+    {
+        listener[listener_index] = listener_new(listener_index,
+                                                &server,
+                                                &param,
+                                                param_get_port_n(&param, listener_index),
+                                                take_inherited_sd(param_get_port_n(&param, listener_index)),
+                                                SOCKET_TIMEOUT,
+                                                SOCKET_BACKLOG);
+        if (listener[listener_index] == NULL)
+        {
+            while (listener_index > 0)
+            {
+                listener_delete(listener[--listener_index]);
+            }
+            go = 0;
+            close_inherited_sds();
+            handshake_deinit();
+            scheduler_deinit();
+            client_pool_deinit();
+            hedge_deinit();
+            upstream_deinit();
+            resolver_deinit();
+            tls_server_destroy(&server);
+            tls_deinit();
+            param_destroy(&param);
+            return EXIT_FAILURE;
+        }
+    }
+    close_inherited_sds();
+
+    for (listener_index = 0; listener_index < num_listeners; listener_index++)
+    {
+        ret = listener_run(listener[listener_index]);
+        if (ret < 0)
+        {
+            break;
+        }
+    }
+    if (ret < 0)
+    {
+        /* stop the listeners that are already running */
+        go = 0;
+        while (listener_index < num_listeners)
+        {
+            listener_delete(listener[listener_index++]);
+        }
+        sleep(2);
+        handshake_deinit();
+        scheduler_deinit();
+        client_pool_deinit();
+        hedge_deinit();
+        upstream_deinit();
+        resolver_deinit();
+        tls_server_destroy(&server);
+        tls_deinit();
+        param_destroy(&param);
+        return EXIT_FAILURE;
+    }
+
+    /* the listeners run in their own threads,
+     * wait for a signal and clean up after themselves
+     * i.e. call listener_delete()
      */
 
     coap_log_notice("Proxy running");
+    notify_ready();
 
     while (go)
     {
         sleep(3600);
+        if ((restart) && (go))
+        {
+            restart = 0;
+            ret = start_new_process(argv, listener, num_listeners, &server);
+            if (ret == 0)
+            {
+                go = 0;
+            }
+        }
     }
+    drain(param_get_drain_timeout(&param));
     sleep(2);
 
     coap_log_notice("Proxy stopped");
+    lock_prof_log();
+
+    handshake_deinit();
+    scheduler_deinit();
 
+    client_pool_deinit();
+    hedge_deinit();
+    upstream_deinit();
+    resolver_deinit();
     tls_server_destroy(&server);
     tls_deinit();
     param_destroy(&param);
@@ -0,0 +1,436 @@
+/*
+ * Copyright (c) 2015 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ *  @file resolver.c
+ *
+ *  @brief Source file for the FreeCoAP HTTP/CoAP proxy resolver module
+ *
+ *  Host names are resolved by a small pool of resolver threads and
+ *  cached so that connection threads never call getaddrinfo. Expired
+ *  entries are refreshed in the background while the previous address
+ *  is still used, failed resolutions are cached for a shorter time and
+ *  a connection thread waits a bounded time for a host name it has not
+ *  seen before.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "resolver.h"
+#include "thread.h"
+#include "lock.h"
+#include "coap_ipv.h"
+#include "coap_log.h"
+
+#define RESOLVER_MAX_ENTRIES   64                                               /* number of cached host names */
+#define RESOLVER_NUM_THREADS   2                                                /* number of concurrent resolutions */
+#define RESOLVER_HOST_BUF_LEN  256
+#define RESOLVER_ADDR_BUF_LEN  INET6_ADDRSTRLEN
+
+typedef enum
+{
+    RESOLVER_EMPTY = 0,                                                         /* unused entry */
+    RESOLVER_PENDING,                                                           /* no result yet */
+    RESOLVER_FOUND,                                                             /* addr is valid */
+    RESOLVER_NOT_FOUND                                                          /* the host name does not exist */
+}
+resolver_state_t;
+
+typedef struct
+{
+    char host[RESOLVER_HOST_BUF_LEN];
+    char addr[RESOLVER_ADDR_BUF_LEN];
+    resolver_state_t state;
+    int queued;                                                                 /* waiting for a resolver thread */
+    int busy;                                                                   /* being resolved by a resolver thread */
+    time_t expires;                                                             /* monotonic time (sec) */
+    time_t last_used;                                                           /* monotonic time (sec) */
+}
+resolver_entry_t;
+
+static resolver_entry_t resolver_entry[RESOLVER_MAX_ENTRIES] = {{{0}}};
+static lock_t resolver_lock;                                                    /* protects the entries and resolver_stop */
+static pthread_cond_t resolver_work_cond;                                       /* signalled when an entry is queued */
+static pthread_cond_t resolver_done_cond;                                       /* signalled when a resolution completes */
+static thread_ctx_t resolver_ctx = {0};
+static thread_t resolver_thread[RESOLVER_NUM_THREADS] = {{0}};
+static unsigned resolver_num_threads = 0;
+static int resolver_stop = 0;
+static unsigned resolver_ttl = 0;                                               /* sec */
+static unsigned resolver_neg_ttl = 0;                                           /* sec */
+static unsigned resolver_timeout = 0;                                           /* msec */
+
+static time_t resolver_now(void)
+{
+    struct timespec ts = {0};
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/*  return: { 0,             success
+ *          { -EHOSTUNREACH, the host name does not exist
+ *          { -EAGAIN,       temporary failure
+ */
+static int resolver_resolve(const char *host, char *addr, size_t len)
+{
+    struct addrinfo hints = {0};
+    struct addrinfo *list = NULL;
+    const void *src = NULL;
+    int ret = 0;
+
+    hints.ai_family = COAP_IPV_AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    ret = getaddrinfo(host, NULL, &hints, &list);
+    if (ret != 0)
+    {
+        coap_log_warn("Failed to resolve host %s: %s", host, gai_strerror(ret));
+        if ((ret == EAI_AGAIN) || (ret == EAI_MEMORY) || (ret == EAI_SYSTEM))
+        {
+            return -EAGAIN;
+        }
+        return -EHOSTUNREACH;
+    }
+    if (list->ai_family == AF_INET6)
+    {
+        src = &((struct sockaddr_in6 *)list->ai_addr)->sin6_addr;
+    }
+    else
+    {
+        src = &((struct sockaddr_in *)list->ai_addr)->sin_addr;
+    }
+    if (inet_ntop(list->ai_family, src, addr, len) == NULL)
+    {
+        freeaddrinfo(list);
+        return -EAGAIN;
+    }
+    freeaddrinfo(list);
+    coap_log_debug("Resolved host %s to address %s", host, addr);
+    return 0;
+}
+
+/* must be called with the resolver lock held */
+static resolver_entry_t *resolver_find(const char *host)
+{
+    unsigned i = 0;
+
+    for (i = 0; i < RESOLVER_MAX_ENTRIES; i++)
+    {
+        if ((resolver_entry[i].state != RESOLVER_EMPTY)
+         && (strcasecmp(resolver_entry[i].host, host) == 0))
+        {
+            return &resolver_entry[i];
+        }
+    }
+    return NULL;
+}
+
+/* reuse an empty entry or the least recently used
+ * entry that is not waiting for a resolver thread
+ *
+ * must be called with the resolver lock held
+ */
+static resolver_entry_t *resolver_alloc(const char *host)
+{
+    resolver_entry_t *entry = NULL;
+    unsigned i = 0;
+
+    for (i = 0; i < RESOLVER_MAX_ENTRIES; i++)
+    {
+        if (resolver_entry[i].state == RESOLVER_EMPTY)
+        {
+            entry = &resolver_entry[i];
+            break;
+        }
+        if ((resolver_entry[i].state == RESOLVER_PENDING)
+         || (resolver_entry[i].queued)
+         || (resolver_entry[i].busy))
+        {
+            continue;
+        }
+        if ((entry == NULL) || (resolver_entry[i].last_used < entry->last_used))
+        {
+            entry = &resolver_entry[i];
+        }
+    }
+    if (entry == NULL)
+    {
+        return NULL;
+    }
+    memset(entry, 0, sizeof(resolver_entry_t));
+    strncpy(entry->host, host, sizeof(entry->host) - 1);
+    entry->state = RESOLVER_PENDING;
+    return entry;
+}
+
+/* must be called with the resolver lock held */
+static void resolver_queue(resolver_entry_t *entry)
+{
+    if ((!entry->queued) && (!entry->busy))
+    {
+        entry->queued = 1;
+        pthread_cond_signal(&resolver_work_cond);
+    }
+}
+
+/* must be called with the resolver lock held */
+static void resolver_complete(resolver_entry_t *entry, int result, const char *addr)
+{
+    time_t now = resolver_now();
+
+    if (result == 0)
+    {
+        strncpy(entry->addr, addr, sizeof(entry->addr) - 1);
+        entry->state = RESOLVER_FOUND;
+        entry->expires = now + resolver_ttl;
+    }
+    else if ((result == -EAGAIN) && (entry->state == RESOLVER_FOUND))
+    {
+        /* keep using the previous address while the name server is unavailable */
+        entry->expires = now + resolver_neg_ttl;
+    }
+    else
+    {
+        entry->state = RESOLVER_NOT_FOUND;
+        entry->expires = now + resolver_neg_ttl;
+    }
+}
+
+static void *resolver_thread_func(void *data)
+{
+    resolver_entry_t *entry = NULL;
+    char host[RESOLVER_HOST_BUF_LEN] = {0};
+    char addr[RESOLVER_ADDR_BUF_LEN] = {0};
+    unsigned i = 0;
+    int ret = 0;
+
+    thread_block_signals();
+    lock_get(&resolver_lock);
+    while (!resolver_stop)
+    {
+        entry = NULL;
+        for (i = 0; i < RESOLVER_MAX_ENTRIES; i++)
+        {
+            if (resolver_entry[i].queued)
+            {
+                entry = &resolver_entry[i];
+                break;
+            }
+        }
+        if (entry == NULL)
+        {
+            lock_cond_wait(&resolver_work_cond, &resolver_lock);
+            continue;
+        }
+        /* a busy entry is never reused so it can be updated after the lock is released */
+        entry->queued = 0;
+        entry->busy = 1;
+        memcpy(host, entry->host, sizeof(host));
+        lock_put(&resolver_lock);
+
+        memset(addr, 0, sizeof(addr));
+        ret = resolver_resolve(host, addr, sizeof(addr));
+
+        lock_get(&resolver_lock);
+        resolver_complete(entry, ret, addr);
+        entry->busy = 0;
+        pthread_cond_broadcast(&resolver_done_cond);
+    }
+    lock_put(&resolver_lock);
+    return NULL;
+}
+
+static int resolver_is_numeric(const char *host)
+{
+    unsigned char buf[sizeof(struct in6_addr)] = {0};
+
+    return ((inet_pton(AF_INET6, host, buf) == 1)
+         || (inet_pton(AF_INET, host, buf) == 1));
+}
+
+int resolver_init(param_t *param)
+{
+    pthread_condattr_t attr;
+    unsigned i = 0;
+    int ret = 0;
+
+    resolver_ttl = param_get_dns_ttl(param);
+    resolver_neg_ttl = param_get_dns_neg_ttl(param);
+    resolver_timeout = param_get_dns_timeout(param);
+    resolver_stop = 0;
+    memset(resolver_entry, 0, sizeof(resolver_entry));
+
+    ret = lock_create(&resolver_lock);
+    if (ret < 0)
+    {
+        coap_log_error("Unable to create lock");
+        return -1;
+    }
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&resolver_work_cond, NULL);
+    pthread_cond_init(&resolver_done_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    ret = thread_joinable_ctx_create(&resolver_ctx);
+    if (ret < 0)
+    {
+        pthread_cond_destroy(&resolver_done_cond);
+        pthread_cond_destroy(&resolver_work_cond);
+        lock_destroy(&resolver_lock);
+        return ret;
+    }
+    for (i = 0; i < RESOLVER_NUM_THREADS; i++)
+    {
+        ret = thread_init(&resolver_thread[i], &resolver_ctx, resolver_thread_func, NULL);
+        if (ret < 0)
+        {
+            coap_log_error("Unable to create resolver thread");
+            resolver_deinit();
+            return ret;
+        }
+        resolver_num_threads++;
+    }
+    return 0;
+}
+
+void resolver_deinit(void)
+{
+    unsigned i = 0;
+
+    lock_get(&resolver_lock);
+    resolver_stop = 1;
+    pthread_cond_broadcast(&resolver_work_cond);
+    lock_put(&resolver_lock);
+    /* a thread inside getaddrinfo stops when it returns */
+    for (i = 0; i < resolver_num_threads; i++)
+    {
+        thread_join(&resolver_thread[i], NULL);
+    }
+    resolver_num_threads = 0;
+    thread_ctx_destroy(&resolver_ctx);
+    pthread_cond_destroy(&resolver_done_cond);
+    pthread_cond_destroy(&resolver_work_cond);
+    lock_destroy(&resolver_lock);
+}
+
+/*  return: { 0,             success
+ *          { -EHOSTUNREACH, the host name does not exist
+ *          { -ETIMEDOUT,    the host name was not resolved in time
+ *          { -EBUSY,        too many host names are being resolved
+ *          {<0,             error
+ */
+int resolver_lookup(const char *host, char *addr, size_t len)
+{
+    resolver_entry_t *entry = NULL;
+    struct timespec deadline = {0};
+    time_t now = 0;
+    int waited = 0;
+    int ret = 0;
+
+    if (resolver_is_numeric(host))
+    {
+        if (strlen(host) >= len)
+        {
+            return -ENOSPC;
+        }
+        strcpy(addr, host);
+        return 0;
+    }
+    if (strlen(host) >= RESOLVER_HOST_BUF_LEN)
+    {
+        return -EINVAL;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += resolver_timeout / 1000;
+    deadline.tv_nsec += (resolver_timeout % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    lock_get(&resolver_lock);
+    while (1)
+    {
+        /* the entry is looked up again after each wait as it may have been reused */
+        now = resolver_now();
+        entry = resolver_find(host);
+        if (entry == NULL)
+        {
+            entry = resolver_alloc(host);
+            if (entry == NULL)
+            {
+                ret = -EBUSY;
+                break;
+            }
+            resolver_queue(entry);
+        }
+        entry->last_used = now;
+        if (entry->state == RESOLVER_FOUND)
+        {
+            if (now >= entry->expires)
+            {
+                /* refresh in the background and use the previous address meanwhile */
+                resolver_queue(entry);
+            }
+            if (strlen(entry->addr) >= len)
+            {
+                ret = -ENOSPC;
+                break;
+            }
+            strcpy(addr, entry->addr);
+            ret = 0;
+            break;
+        }
+        if (entry->state == RESOLVER_NOT_FOUND)
+        {
+            /* a completed resolution is reported even if it has already expired */
+            if ((now < entry->expires) || ((waited) && (!entry->queued) && (!entry->busy)))
+            {
+                ret = -EHOSTUNREACH;
+                break;
+            }
+            resolver_queue(entry);
+        }
+        ret = lock_cond_timedwait(&resolver_done_cond, &resolver_lock, &deadline);
+        if (ret == ETIMEDOUT)
+        {
+            coap_log_warn("Timed out waiting for resolution of host %s", host);
+            ret = -ETIMEDOUT;
+            break;
+        }
+        waited = 1;
+    }
+    lock_put(&resolver_lock);
+    return ret;
+}
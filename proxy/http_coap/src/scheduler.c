@@ -0,0 +1,369 @@
+/*
+ * Copyright (c) 2015 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ *  @file scheduler.c
+ *
+ *  @brief Source file for the FreeCoAP HTTP/CoAP proxy scheduler module
+ *
+ *  The number of exchanges in progress with a CoAP server can be
+ *  capped per route. Requests over the cap wait in a queue for that
+ *  server, ordered by start-time fair queuing across HTTP clients so
+ *  that each client gets a share of the server in proportion to its
+ *  weight however many requests it sends. A request that finds the
+ *  queue full, or waits longer than the queue timeout, fails at once
+ *  instead of adding to the load on the server.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include "scheduler.h"
+#include "lock.h"
+#include "coap_log.h"
+
+#define SCHEDULER_COST  65536                                                   /* virtual time taken by a request from a client with weight 1 */
+
+static scheduler_server_t scheduler_server[SCHEDULER_MAX_SERVERS] = {{{0}}};
+static lock_t scheduler_lock;                                                   /* protects the servers, flows and queues */
+
+static time_t scheduler_now(void)
+{
+    struct timespec ts = {0};
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static void scheduler_server_reset(scheduler_server_t *server)
+{
+    scheduler_flow_t *flow = NULL;
+
+    while (server->flow != NULL)
+    {
+        flow = server->flow;
+        server->flow = flow->next;
+        free(flow);
+    }
+    memset(server, 0, sizeof(scheduler_server_t));
+}
+
+/* reuse an empty entry or the least recently used idle entry
+ *
+ * must be called with the scheduler lock held
+ */
+static scheduler_server_t *scheduler_server_get(const char *host, const char *port)
+{
+    scheduler_server_t *server = NULL;
+    unsigned i = 0;
+
+    for (i = 0; i < SCHEDULER_MAX_SERVERS; i++)
+    {
+        if ((strcasecmp(scheduler_server[i].host, host) == 0)
+         && (strcmp(scheduler_server[i].port, port) == 0))
+        {
+            return &scheduler_server[i];
+        }
+    }
+    if ((strlen(host) >= SCHEDULER_HOST_BUF_LEN) || (strlen(port) >= SCHEDULER_PORT_BUF_LEN))
+    {
+        return NULL;
+    }
+    for (i = 0; i < SCHEDULER_MAX_SERVERS; i++)
+    {
+        if (scheduler_server[i].host[0] == '\0')
+        {
+            server = &scheduler_server[i];
+            break;
+        }
+        if ((scheduler_server[i].num_active != 0) || (scheduler_server[i].num_queued != 0))
+        {
+            continue;
+        }
+        if ((server == NULL) || (scheduler_server[i].last_used < server->last_used))
+        {
+            server = &scheduler_server[i];
+        }
+    }
+    if (server == NULL)
+    {
+        return NULL;
+    }
+    scheduler_server_reset(server);
+    strcpy(server->host, host);
+    strcpy(server->port, port);
+    return server;
+}
+
+/* flows that have caught up with the server are forgotten
+ *
+ * must be called with the scheduler lock held
+ */
+static scheduler_flow_t *scheduler_flow_get(scheduler_server_t *server, const char *name)
+{
+    scheduler_flow_t *found = NULL;
+    scheduler_flow_t *prev = NULL;
+    scheduler_flow_t *flow = NULL;
+
+    flow = server->flow;
+    while (flow != NULL)
+    {
+        if ((found == NULL) && (strncmp(flow->name, name, SCHEDULER_FLOW_BUF_LEN - 1) == 0))
+        {
+            found = flow;
+        }
+        else if ((flow->num_queued == 0) && (flow->finish <= server->vtime))
+        {
+            if (prev != NULL)
+            {
+                prev->next = flow->next;
+            }
+            else
+            {
+                server->flow = flow->next;
+            }
+            free(flow);
+            flow = (prev != NULL) ? prev->next : server->flow;
+            continue;
+        }
+        prev = flow;
+        flow = flow->next;
+    }
+    if (found != NULL)
+    {
+        return found;
+    }
+    flow = (scheduler_flow_t *)calloc(1, sizeof(scheduler_flow_t));
+    if (flow == NULL)
+    {
+        return NULL;
+    }
+    strncpy(flow->name, name, sizeof(flow->name) - 1);
+    flow->next = server->flow;
+    server->flow = flow;
+    return flow;
+}
+
+/* must be called with the scheduler lock held */
+static void scheduler_enqueue(scheduler_server_t *server, scheduler_waiter_t *waiter)
+{
+    scheduler_waiter_t **next = &server->queue;
+
+    /* requests with equal finish times proceed in order of arrival */
+    while ((*next != NULL) && ((*next)->finish <= waiter->finish))
+    {
+        next = &(*next)->next;
+    }
+    waiter->next = *next;
+    *next = waiter;
+    waiter->flow->num_queued++;
+    server->num_queued++;
+}
+
+/* must be called with the scheduler lock held */
+static void scheduler_dequeue(scheduler_server_t *server, scheduler_waiter_t *waiter)
+{
+    scheduler_waiter_t **next = &server->queue;
+
+    while (*next != NULL)
+    {
+        if (*next == waiter)
+        {
+            *next = waiter->next;
+            waiter->next = NULL;
+            waiter->flow->num_queued--;
+            server->num_queued--;
+            return;
+        }
+        next = &(*next)->next;
+    }
+}
+
+/* let waiting requests proceed while there is room
+ *
+ * must be called with the scheduler lock held
+ */
+static void scheduler_dispatch(scheduler_server_t *server)
+{
+    scheduler_waiter_t *waiter = NULL;
+
+    while ((server->queue != NULL) && (server->num_active < server->max_active))
+    {
+        waiter = server->queue;
+        scheduler_dequeue(server, waiter);
+        server->vtime = waiter->start;
+        server->num_active++;
+        waiter->granted = 1;
+        pthread_cond_signal(&waiter->cond);
+    }
+}
+
+int scheduler_init(void)
+{
+    int ret = 0;
+
+    memset(scheduler_server, 0, sizeof(scheduler_server));
+    ret = lock_create(&scheduler_lock);
+    if (ret < 0)
+    {
+        coap_log_error("Unable to create lock");
+        return -1;
+    }
+    return 0;
+}
+
+void scheduler_deinit(void)
+{
+    unsigned i = 0;
+
+    for (i = 0; i < SCHEDULER_MAX_SERVERS; i++)
+    {
+        scheduler_server_reset(&scheduler_server[i]);
+    }
+    lock_destroy(&scheduler_lock);
+}
+
+/* wait until an exchange with the CoAP server may start, server is
+ * set to NULL if the route does not limit the number of exchanges in
+ * progress, otherwise it must be passed to scheduler_release when the
+ * exchange completes
+ *
+ *  return: { 0,          success
+ *          { -EBUSY,     too many requests are waiting
+ *          { -EAGAIN,    the queue timeout expired
+ *          { -ETIMEDOUT, the deadline expired
+ *          {<0,          error
+ */
+int scheduler_acquire(param_route_t *route, const char *host, const char *port, const char *flow, unsigned weight, const struct timespec *deadline, scheduler_server_t **server)
+{
+    pthread_condattr_t attr;
+    scheduler_waiter_t waiter = {0};
+    scheduler_server_t *s = NULL;
+    struct timespec limit = {0};
+    unsigned msec = route->coap_client_queue_timeout;
+    int limit_is_deadline = 0;
+    int ret = 0;
+
+    *server = NULL;
+    if (route->coap_client_max_concurrent == 0)
+    {
+        return 0;
+    }
+    lock_get(&scheduler_lock);
+    s = scheduler_server_get(host, port);
+    if (s == NULL)
+    {
+        lock_put(&scheduler_lock);
+        coap_log_warn("Unable to schedule requests for CoAP server host %s and port %s", host, port);
+        return 0;
+    }
+    s->last_used = scheduler_now();
+    s->max_active = route->coap_client_max_concurrent;
+    if ((s->queue == NULL) && (s->num_active < s->max_active))
+    {
+        s->num_active++;
+        lock_put(&scheduler_lock);
+        *server = s;
+        return 0;
+    }
+    if (s->num_queued >= route->coap_client_max_queued)
+    {
+        lock_put(&scheduler_lock);
+        coap_log_warn("Queue for CoAP server host %s and port %s is full", host, port);
+        return -EBUSY;
+    }
+    waiter.flow = scheduler_flow_get(s, flow);
+    if (waiter.flow == NULL)
+    {
+        lock_put(&scheduler_lock);
+        return -ENOMEM;
+    }
+    waiter.start = (s->vtime > waiter.flow->finish) ? s->vtime : waiter.flow->finish;
+    waiter.finish = waiter.start + SCHEDULER_COST / ((weight != 0) ? weight : 1);
+    waiter.flow->finish = waiter.finish;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&waiter.cond, &attr);
+    pthread_condattr_destroy(&attr);
+    scheduler_enqueue(s, &waiter);
+
+    clock_gettime(CLOCK_MONOTONIC, &limit);
+    limit.tv_sec += msec / 1000;
+    limit.tv_nsec += (msec % 1000) * 1000000;
+    if (limit.tv_nsec >= 1000000000)
+    {
+        limit.tv_sec++;
+        limit.tv_nsec -= 1000000000;
+    }
+    if (((deadline->tv_sec != 0) || (deadline->tv_nsec != 0))
+     && ((deadline->tv_sec < limit.tv_sec)
+      || ((deadline->tv_sec == limit.tv_sec) && (deadline->tv_nsec < limit.tv_nsec))))
+    {
+        limit = *deadline;
+        limit_is_deadline = 1;
+    }
+    while (!waiter.granted)
+    {
+        ret = lock_cond_timedwait(&waiter.cond, &scheduler_lock, &limit);
+        if (ret == ETIMEDOUT)
+        {
+            break;
+        }
+    }
+    if (waiter.granted)
+    {
+        *server = s;
+        ret = 0;
+    }
+    else
+    {
+        scheduler_dequeue(s, &waiter);
+        if (waiter.flow->finish == waiter.finish)
+        {
+            /* the request was not served so give its share back */
+            waiter.flow->finish = waiter.start;
+        }
+        coap_log_warn("Timed out waiting for CoAP server host %s and port %s", host, port);
+        ret = limit_is_deadline ? -ETIMEDOUT : -EAGAIN;
+    }
+    lock_put(&scheduler_lock);
+    pthread_cond_destroy(&waiter.cond);
+    return ret;
+}
+
+void scheduler_release(scheduler_server_t *server)
+{
+    if (server == NULL)
+    {
+        return;
+    }
+    lock_get(&scheduler_lock);
+    server->num_active--;
+    scheduler_dispatch(server);
+    lock_put(&scheduler_lock);
+}
@@ -0,0 +1,390 @@
+/*
+ * Copyright (c) 2015 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ *  @file upstream.c
+ *
+ *  @brief Source file for the FreeCoAP HTTP/CoAP proxy upstream module
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include "upstream.h"
+#include "resolver.h"
+#include "coap_log.h"
+
+#define UPSTREAM_PROBE_PERIOD          1                                        /* sec */
+#define UPSTREAM_PROBE_ACK_TIMEOUT     1                                        /* sec */
+#define UPSTREAM_PROBE_MAX_RETRANSMIT  1
+#define UPSTREAM_EWMA_SHIFT            3                                        /* weight of a new sample is 1/8 */
+
+extern int go;
+
+static upstream_t *upstream_list = NULL;
+static thread_ctx_t probe_ctx = {0};
+static thread_t probe_thread = {0};
+static int probe_running = 0;
+
+static time_t upstream_now(void)
+{
+    struct timespec ts = {0};
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/* must be called with the upstream lock held */
+static void upstream_fail(upstream_t *upstream, unsigned index, time_t now)
+{
+    upstream_member_t *member = &upstream->member[index];
+
+    member->fails++;
+    if ((member->fails >= upstream->param->max_fails) && (member->eject_until == 0))
+    {
+        member->eject_until = now + upstream->param->eject_time;
+        coap_log_warn("Ejected CoAP server host %s and port %s from upstream %s for %u sec",
+                      upstream_get_member_host(upstream, index),
+                      upstream_get_member_port(upstream, index),
+                      upstream_get_name(upstream),
+                      upstream->param->eject_time);
+    }
+}
+
+/* must be called with the upstream lock held */
+static void upstream_succeed(upstream_t *upstream, unsigned index)
+{
+    upstream_member_t *member = &upstream->member[index];
+
+    member->fails = 0;
+    if (member->eject_until != 0)
+    {
+        member->eject_until = 0;
+        coap_log_notice("Restored CoAP server host %s and port %s to upstream %s",
+                        upstream_get_member_host(upstream, index),
+                        upstream_get_member_port(upstream, index),
+                        upstream_get_name(upstream));
+    }
+}
+
+static int upstream_is_failure(int result)
+{
+    return ((result == -ETIMEDOUT)
+         || (result == -ECONNRESET)
+         || (result == -ECONNREFUSED)
+         || (result == -EBUSY)
+         || (result == -EHOSTUNREACH)
+         || (result == -1));  /* DTLS error */
+}
+
+static int upstream_probe_client_create(upstream_t *upstream, unsigned index)
+{
+    upstream_member_t *member = &upstream->member[index];
+    param_route_t *route = upstream->route;
+    char addr[COAP_CLIENT_HOST_BUF_LEN] = {0};
+    int ret = 0;
+
+    ret = resolver_lookup(upstream_get_member_host(upstream, index), addr, sizeof(addr));
+    if (ret < 0)
+    {
+        return ret;
+    }
+    ret = coap_client_create(&member->probe_client,
+                             addr,
+                             upstream_get_member_port(upstream, index),
+                             route->coap_client_key_file_name,
+                             route->coap_client_cert_file_name,
+                             route->coap_client_trust_file_name,
+                             NULL,
+                             NULL);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    coap_client_set_timeouts(&member->probe_client,
+                             UPSTREAM_PROBE_ACK_TIMEOUT,
+                             UPSTREAM_PROBE_MAX_RETRANSMIT,
+                             UPSTREAM_PROBE_ACK_TIMEOUT);
+    member->probe_client_active = 1;
+    return 0;
+}
+
+static void upstream_probe_client_destroy(upstream_member_t *member)
+{
+    if (member->probe_client_active)
+    {
+        coap_client_destroy(&member->probe_client);
+        member->probe_client_active = 0;
+    }
+}
+
+/* the probe client keeps a warm DTLS session to each member */
+static void upstream_probe(upstream_t *upstream, unsigned index)
+{
+    upstream_member_t *member = &upstream->member[index];
+    int ret = 0;
+
+    if (!member->probe_client_active)
+    {
+        ret = upstream_probe_client_create(upstream, index);
+    }
+    if (ret == 0)
+    {
+        ret = coap_client_ping(&member->probe_client);
+    }
+    if (ret < 0)
+    {
+        coap_log_info("Ping to CoAP server host %s and port %s in upstream %s failed: %s",
+                      upstream_get_member_host(upstream, index),
+                      upstream_get_member_port(upstream, index),
+                      upstream_get_name(upstream),
+                      strerror(-ret));
+        upstream_probe_client_destroy(member);
+    }
+    lock_get(&upstream->lock);
+    if (ret < 0)
+    {
+        upstream_fail(upstream, index, upstream_now());
+    }
+    else
+    {
+        upstream_succeed(upstream, index);
+    }
+    lock_put(&upstream->lock);
+}
+
+static void *upstream_probe_thread_func(void *data)
+{
+    upstream_t *upstream = NULL;
+    time_t now = 0;
+    unsigned i = 0;
+
+    thread_block_signals();
+    while (go)
+    {
+        for (upstream = upstream_list; (upstream != NULL) && go; upstream = upstream->next)
+        {
+            if (upstream->param->ping_interval == 0)
+            {
+                continue;
+            }
+            for (i = 0; (i < upstream_get_num_members(upstream)) && go; i++)
+            {
+                now = upstream_now();
+                if (now >= upstream->member[i].next_ping)
+                {
+                    upstream->member[i].next_ping = now + upstream->param->ping_interval;
+                    upstream_probe(upstream, i);
+                }
+            }
+        }
+        sleep(UPSTREAM_PROBE_PERIOD);
+    }
+    return NULL;
+}
+
+static void upstream_delete(upstream_t *upstream)
+{
+    unsigned i = 0;
+
+    for (i = 0; i < upstream_get_num_members(upstream); i++)
+    {
+        upstream_probe_client_destroy(&upstream->member[i]);
+    }
+    lock_destroy(&upstream->lock);
+    free(upstream);
+}
+
+int upstream_init(param_t *param)
+{
+    param_upstream_t *param_upstream = NULL;
+    upstream_t *upstream = NULL;
+    int ping = 0;
+    int ret = 0;
+
+    param_upstream = param_get_first_upstream(param);
+    while (param_upstream != NULL)
+    {
+        upstream = (upstream_t *)calloc(1, sizeof(upstream_t));
+        if (upstream == NULL)
+        {
+            coap_log_error("Out of memory");
+            upstream_deinit();
+            return -ENOMEM;
+        }
+        ret = lock_create(&upstream->lock);
+        if (ret < 0)
+        {
+            coap_log_error("Unable to create lock");
+            free(upstream);
+            upstream_deinit();
+            return -1;
+        }
+        upstream->param = param_upstream;
+        upstream->route = param_get_route(param, param_upstream->name);
+        upstream->next = upstream_list;
+        upstream_list = upstream;
+        if (param_upstream->ping_interval != 0)
+        {
+            ping = 1;
+        }
+        coap_log_info("Upstream %s has %u members",
+                      param_upstream->name, param_upstream->num_members);
+        param_upstream = param_upstream->next;
+    }
+    if (ping)
+    {
+        ret = thread_joinable_ctx_create(&probe_ctx);
+        if (ret < 0)
+        {
+            upstream_deinit();
+            return ret;
+        }
+        ret = thread_init(&probe_thread, &probe_ctx, upstream_probe_thread_func, NULL);
+        if (ret < 0)
+        {
+            coap_log_error("Unable to create upstream probe thread");
+            thread_ctx_destroy(&probe_ctx);
+            upstream_deinit();
+            return ret;
+        }
+        probe_running = 1;
+    }
+    return 0;
+}
+
+void upstream_deinit(void)
+{
+    upstream_t *upstream = NULL;
+
+    if (probe_running)
+    {
+        /* the probe thread stops when go is cleared */
+        thread_join(&probe_thread, NULL);
+        thread_ctx_destroy(&probe_ctx);
+        probe_running = 0;
+    }
+    while (upstream_list != NULL)
+    {
+        upstream = upstream_list;
+        upstream_list = upstream->next;
+        upstream_delete(upstream);
+    }
+}
+
+upstream_t *upstream_find(const char *name)
+{
+    upstream_t *upstream = NULL;
+
+    for (upstream = upstream_list; upstream != NULL; upstream = upstream->next)
+    {
+        if (strcasecmp(upstream_get_name(upstream), name) == 0)
+        {
+            return upstream;
+        }
+    }
+    return NULL;
+}
+
+/* ejected members are only used if every member is ejected */
+int upstream_select(upstream_t *upstream)
+{
+    upstream_member_t *member = NULL;
+    unsigned long long cost = 0;
+    unsigned long long best_cost = 0;
+    unsigned num = upstream_get_num_members(upstream);
+    time_t now = 0;
+    int best_ejected = 0;
+    int ejected = 0;
+    int best = -1;
+    unsigned i = 0;
+    unsigned j = 0;
+
+    now = upstream_now();
+    lock_get(&upstream->lock);
+    for (j = 0; j < num; j++)
+    {
+        i = (upstream->next_index + j) % num;
+        member = &upstream->member[i];
+        if ((member->eject_until != 0) && (now >= member->eject_until))
+        {
+            /* the cool-down has ended, give the member another chance */
+            member->eject_until = 0;
+            member->fails = 0;
+        }
+        ejected = (member->eject_until != 0);
+        if (upstream->param->policy == PARAM_UPSTREAM_EWMA)
+        {
+            cost = (unsigned long long)(member->ewma_us + 1) * (member->outstanding + 1);
+        }
+        else
+        {
+            cost = member->outstanding;
+        }
+        if ((best < 0)
+         || (best_ejected && !ejected)
+         || ((best_ejected == ejected) && (cost < best_cost)))
+        {
+            best = i;
+            best_cost = cost;
+            best_ejected = ejected;
+        }
+    }
+    upstream->member[best].outstanding++;
+    upstream->next_index = (upstream->next_index + 1) % num;
+    lock_put(&upstream->lock);
+    return best;
+}
+
+void upstream_release(upstream_t *upstream, unsigned index, int result, unsigned elapsed_us)
+{
+    upstream_member_t *member = &upstream->member[index];
+    int diff = 0;
+
+    lock_get(&upstream->lock);
+    member->outstanding--;
+    if (upstream_is_failure(result))
+    {
+        upstream_fail(upstream, index, upstream_now());
+    }
+    else if (result == 0)
+    {
+        upstream_succeed(upstream, index);
+        if (member->ewma_us == 0)
+        {
+            member->ewma_us = elapsed_us;
+        }
+        else
+        {
+            diff = (int)elapsed_us - (int)member->ewma_us;
+            member->ewma_us += diff / (1 << UPSTREAM_EWMA_SHIFT);
+        }
+    }
+    lock_put(&upstream->lock);
+}
@@ -35,6 +35,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
+#include <time.h>
 #include <getopt.h>
 #ifdef COAP_DTLS_EN
 #include <gnutls/gnutls.h>
@@ -55,6 +57,8 @@
 #define CRL_FILE_NAME    ""                                                     /**< DTLS certificate revocation list file name */
 #define COMMON_NAME      "dummy/server"                                         /**< Common name of the server */
 #define SEP_URI_PATH     "separate"                                             /**< URI path option value to trigger a separate response from the server */
+#define SLOW_URI_PATH    "slow"                                                 /**< URI path option value to delay the response from the server */
+#define DEADLINE_MSEC    300                                                    /**< Deadline for an exchange with a delayed response */
 
 /**
  *  @brief Message option test data structure
@@ -554,6 +558,79 @@ test_coap_client_data_t test7_data =
     .num_msg = TEST7_NUM_MSG
 };
 
+#define TEST8_NUM_MSG      1
+#define TEST8_REQ_OP1_LEN  4
+#define TEST8_NUM_OPS      1
+
+char test8_req_op1_val[TEST8_REQ_OP1_LEN + 1] = SLOW_URI_PATH;
+
+test_coap_client_msg_op_t test8_req_ops[TEST8_NUM_OPS] =
+{
+    {
+        .num = COAP_MSG_URI_PATH,
+        .len = TEST8_REQ_OP1_LEN,
+        .val = test8_req_op1_val
+    }
+};
+
+test_coap_client_msg_t test8_req[TEST8_NUM_MSG] =
+{
+    {
+        .type = COAP_MSG_CON,
+        .code_class = COAP_MSG_REQ,
+        .code_detail = COAP_MSG_GET,
+        .ops = test8_req_ops,
+        .num_ops = TEST8_NUM_OPS,
+        .payload = "Hello Server!",
+        .payload_len = 13
+    }
+};
+
+test_coap_client_data_t test8_data =
+{
+    .desc = "test 8: send a confirmable request and expect the deadline to pass before the response",
+    .host = HOST,
+    .port = PORT,
+    .key_file_name = KEY_FILE_NAME,
+    .cert_file_name = CERT_FILE_NAME,
+    .trust_file_name = TRUST_FILE_NAME,
+    .crl_file_name = CRL_FILE_NAME,
+    .common_name = COMMON_NAME,
+    .test_req = test8_req,
+    .test_resp = NULL,
+    .num_msg = TEST8_NUM_MSG
+};
+
+test_coap_client_data_t test9_data =
+{
+    .desc = "test 9: send a confirmable request and cancel the exchange",
+    .host = HOST,
+    .port = PORT,
+    .key_file_name = KEY_FILE_NAME,
+    .cert_file_name = CERT_FILE_NAME,
+    .trust_file_name = TRUST_FILE_NAME,
+    .crl_file_name = CRL_FILE_NAME,
+    .common_name = COMMON_NAME,
+    .test_req = test1_req,
+    .test_resp = NULL,
+    .num_msg = TEST1_NUM_MSG
+};
+
+test_coap_client_data_t test10_data =
+{
+    .desc = "test 10: send a CoAP ping and expect a reset message",
+    .host = HOST,
+    .port = PORT,
+    .key_file_name = KEY_FILE_NAME,
+    .cert_file_name = CERT_FILE_NAME,
+    .trust_file_name = TRUST_FILE_NAME,
+    .crl_file_name = CRL_FILE_NAME,
+    .common_name = COMMON_NAME,
+    .test_req = NULL,
+    .test_resp = NULL,
+    .num_msg = 0
+};
+
 /**
  *  @brief Print a CoAP message
  *
@@ -834,6 +911,194 @@ static test_result_t test_exchange_func(test_data_t data)
     return result;
 }
 
+/**
+ *  @brief Create a client structure from a client test data structure
+ *
+ *  @param[out] client Pointer to a client structure
+ *  @param[in] test_data Pointer to a client test data structure
+ *
+ *  @returns Test result
+ */
+static test_result_t create_client(coap_client_t *client, test_coap_client_data_t *test_data)
+{
+    int ret = 0;
+
+#ifdef COAP_DTLS_EN
+    ret = coap_client_create(client,
+                             test_data->host,
+                             test_data->port,
+                             test_data->key_file_name,
+                             test_data->cert_file_name,
+                             test_data->trust_file_name,
+                             test_data->crl_file_name,
+                             test_data->common_name);
+#else
+    ret = coap_client_create(client,
+                             test_data->host,
+                             test_data->port);
+#endif
+    if (ret < 0)
+    {
+        coap_log_error("%s", strerror(-ret));
+        return FAIL;
+    }
+    return PASS;
+}
+
+/**
+ *  @brief Test an exchange that does not finish before the deadline
+ *
+ *  The server delays the response to a request for the
+ *  slow URI path for longer than the deadline.
+ *
+ *  @param[in] data Pointer to a client test data structure
+ *
+ *  @returns Test result
+ */
+static test_result_t test_deadline_func(test_data_t data)
+{
+    test_coap_client_data_t *test_data = (test_coap_client_data_t *)data;
+    test_result_t result = PASS;
+    struct timespec deadline = {0};
+    struct timespec now = {0};
+    coap_client_t client = {0};
+    coap_msg_t resp = {0};
+    coap_msg_t req = {0};
+    long msec = 0;
+    int ret = 0;
+
+    printf("%s\n", test_data->desc);
+
+    result = create_client(&client, test_data);
+    if (result != PASS)
+    {
+        return result;
+    }
+    coap_msg_create(&req);
+    coap_msg_create(&resp);
+    result = populate_req(&test_data->test_req[0], &req);
+    if (result == PASS)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += DEADLINE_MSEC / 1000;
+        deadline.tv_nsec += (DEADLINE_MSEC % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        coap_client_set_deadline(&client, &deadline);
+        ret = coap_client_exchange(&client, &req, &resp);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        msec = (now.tv_sec - deadline.tv_sec) * 1000 + (now.tv_nsec - deadline.tv_nsec) / 1000000;
+        coap_log_info("coap_client_exchange returned %d, %ld msec after the deadline", ret, msec);
+        /* the exchange must end at the deadline rather than wait for the response */
+        if ((ret != -ETIMEDOUT) || (msec < 0) || (msec > DEADLINE_MSEC))
+        {
+            result = FAIL;
+        }
+    }
+    coap_msg_destroy(&resp);
+    coap_msg_destroy(&req);
+    coap_client_destroy(&client);
+    return result;
+}
+
+/**
+ *  @brief Test an exchange that is cancelled through the cancellation file descriptor
+ *
+ *  @param[in] data Pointer to a client test data structure
+ *
+ *  @returns Test result
+ */
+static test_result_t test_cancel_func(test_data_t data)
+{
+    test_coap_client_data_t *test_data = (test_coap_client_data_t *)data;
+    test_result_t result = PASS;
+    coap_client_t client = {0};
+    coap_msg_t resp = {0};
+    coap_msg_t req = {0};
+    ssize_t num = 0;
+    int fd[2] = {-1, -1};
+    int ret = 0;
+
+    printf("%s\n", test_data->desc);
+
+    ret = pipe(fd);
+    if (ret < 0)
+    {
+        coap_log_error("%s", strerror(errno));
+        return FAIL;
+    }
+    result = create_client(&client, test_data);
+    if (result != PASS)
+    {
+        close(fd[0]);
+        close(fd[1]);
+        return result;
+    }
+    coap_msg_create(&req);
+    coap_msg_create(&resp);
+    result = populate_req(&test_data->test_req[0], &req);
+    if (result == PASS)
+    {
+        coap_client_set_cancel_fd(&client, fd[0]);
+        num = write(fd[1], "x", 1);
+        if (num != 1)
+        {
+            result = FAIL;
+        }
+        ret = coap_client_exchange(&client, &req, &resp);
+        coap_log_info("coap_client_exchange returned %d", ret);
+        if (ret != -ECANCELED)
+        {
+            result = FAIL;
+        }
+        /* the cancellation file descriptor is not read by the client */
+        coap_client_set_cancel_fd(&client, -1);
+    }
+    coap_msg_destroy(&resp);
+    coap_msg_destroy(&req);
+    coap_client_destroy(&client);
+    close(fd[0]);
+    close(fd[1]);
+    return result;
+}
+
+/**
+ *  @brief Test a CoAP ping
+ *
+ *  The server answers an empty confirmable message with
+ *  a reset message.
+ *
+ *  @param[in] data Pointer to a client test data structure
+ *
+ *  @returns Test result
+ */
+static test_result_t test_ping_func(test_data_t data)
+{
+    test_coap_client_data_t *test_data = (test_coap_client_data_t *)data;
+    test_result_t result = PASS;
+    coap_client_t client = {0};
+    int ret = 0;
+
+    printf("%s\n", test_data->desc);
+
+    result = create_client(&client, test_data);
+    if (result != PASS)
+    {
+        return result;
+    }
+    ret = coap_client_ping(&client);
+    if (ret < 0)
+    {
+        coap_log_error("%s", strerror(-ret));
+        result = FAIL;
+    }
+    coap_client_destroy(&client);
+    return result;
+}
+
 /**
  *  @brief Helper function to list command line options
  */
@@ -871,7 +1136,10 @@ int main(int argc, char **argv)
                       {test_exchange_func, &test4_data},
                       {test_exchange_func, &test5_data},
                       {test_exchange_func, &test6_data},
-                      {test_exchange_func, &test7_data}};
+                      {test_exchange_func, &test7_data},
+                      {test_deadline_func, &test8_data},
+                      {test_cancel_func,   &test9_data},
+                      {test_ping_func,     &test10_data}};
 
     opterr = 0;
     while ((c = getopt(argc, argv, opts)) != -1)
@@ -942,8 +1210,20 @@ int main(int argc, char **argv)
         num_tests = 1;
         num_pass = test_run(&tests[6], num_tests);
         break;
+    case 8:
+        num_tests = 1;
+        num_pass = test_run(&tests[7], num_tests);
+        break;
+    case 9:
+        num_tests = 1;
+        num_pass = test_run(&tests[8], num_tests);
+        break;
+    case 10:
+        num_tests = 1;
+        num_pass = test_run(&tests[9], num_tests);
+        break;
     default:
-        num_tests = 7;
+        num_tests = 10;
         num_pass = test_run(tests, num_tests);
     }
 
@@ -0,0 +1,377 @@
+/*
+ * Copyright (c) 2015 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ *  @file test_coap_handshake.c
+ *
+ *  @brief Source file for the FreeCoAP DTLS handshake benchmark
+ *
+ *  Measures the number of DTLS handshakes per second that a
+ *  client and server can complete with X.509 certificates,
+ *  raw public keys and pre-shared keys.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <gnutls/gnutls.h>
+#include "coap_server.h"
+#include "coap_client.h"
+#include "coap_log.h"
+
+#ifdef COAP_IP6
+#define SERVER_HOST             "::"                                            /**< Host address to listen on */
+#define CLIENT_HOST             "::1"                                           /**< Host address of the server */
+#else
+#define SERVER_HOST             "0.0.0.0"                                       /**< Host address to listen on */
+#define CLIENT_HOST             "127.0.0.1"                                     /**< Host address of the server */
+#endif
+#define X509_PORT               "12450"                                         /**< UDP port number for X.509 certificates */
+#define RPK_PORT                "12451"                                         /**< UDP port number for raw public keys */
+#define PSK_PORT                "12452"                                         /**< UDP port number for pre-shared keys */
+#define SERVER_KEY_FILE_NAME    "../../certs/server_privkey.pem"                /**< Server private key file name */
+#define SERVER_CERT_FILE_NAME   "../../certs/server_cert.pem"                   /**< Server certificate file name */
+#define SERVER_PUB_FILE_NAME    "../../certs/server_pubkey.pem"                 /**< Server public key file name */
+#define SERVER_TRUST_FILE_NAME  "../../certs/root_client_cert.pem"              /**< Server trust file name */
+#define CLIENT_KEY_FILE_NAME    "../../certs/client_privkey.pem"                /**< Client private key file name */
+#define CLIENT_CERT_FILE_NAME   "../../certs/client_cert.pem"                   /**< Client certificate file name */
+#define CLIENT_PUB_FILE_NAME    "../../certs/client_pubkey.pem"                 /**< Client public key file name */
+#define CLIENT_TRUST_FILE_NAME  "../../certs/root_server_cert.pem"              /**< Client trust file name */
+#define COMMON_NAME             "dummy/server"                                  /**< Common name of the server */
+#define PSK_IDENTITY            "device-0042"                                   /**< PSK identity used by the client */
+#define NUM_PSK                 64                                              /**< Number of PSK identities known to the server */
+#define PSK_TABLE_LEN           128                                             /**< Number of slots in the PSK hash table */
+#define PSK_LEN                 16                                              /**< Length of each pre-shared key */
+#define NUM_HANDSHAKES          200                                             /**< Number of handshakes per credential type */
+
+/**
+ *  @brief PSK hash table entry structure
+ */
+typedef struct
+{
+    char identity[32];                                                          /**< PSK identity */
+    unsigned char key[PSK_LEN];                                                 /**< Pre-shared key */
+}
+psk_entry_t;
+
+static psk_entry_t psk_table[PSK_TABLE_LEN] = {{{0}}};                          /**< Open addressing hash table of PSK identities */
+
+/**
+ *  @brief Hash a PSK identity
+ *
+ *  @param[in] identity String containing the PSK identity
+ *
+ *  @returns Hash value
+ */
+static unsigned psk_hash(const char *identity)
+{
+    unsigned hash = 2166136261u;
+
+    while (*identity != '\0')
+    {
+        hash = (hash ^ (unsigned char)*identity++) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ *  @brief Derive a pre-shared key from a PSK identity
+ *
+ *  @param[in] identity String containing the PSK identity
+ *  @param[out] key Buffer to receive the key
+ */
+static void psk_derive(const char *identity, unsigned char *key)
+{
+    unsigned hash = 0;
+    unsigned i = 0;
+
+    hash = psk_hash(identity);
+    for (i = 0; i < PSK_LEN; i++)
+    {
+        hash = hash * 1103515245u + 12345u;
+        key[i] = (unsigned char)(hash >> 16);
+    }
+}
+
+/**
+ *  @brief Add a PSK identity to the hash table
+ *
+ *  @param[in] identity String containing the PSK identity
+ */
+static void psk_add(const char *identity)
+{
+    unsigned i = 0;
+
+    i = psk_hash(identity) % PSK_TABLE_LEN;
+    while (psk_table[i].identity[0] != '\0')
+    {
+        i = (i + 1) % PSK_TABLE_LEN;
+    }
+    strncpy(psk_table[i].identity, identity, sizeof(psk_table[i].identity) - 1);
+    psk_derive(identity, psk_table[i].key);
+}
+
+/**
+ *  @brief Find the pre-shared key for a PSK identity
+ *
+ *  @param[in] identity String containing the PSK identity
+ *  @param[out] key Buffer to receive the key
+ *  @param[in] len Length of the buffer
+ *
+ *  @returns Key length or error code
+ *  @retval >0 Key length
+ *  @retval -1 Unknown identity
+ */
+static int psk_lookup(const char *identity, unsigned char *key, size_t len)
+{
+    unsigned i = 0;
+
+    if (len < PSK_LEN)
+    {
+        return -1;
+    }
+    i = psk_hash(identity) % PSK_TABLE_LEN;
+    while (psk_table[i].identity[0] != '\0')
+    {
+        if (strcmp(psk_table[i].identity, identity) == 0)
+        {
+            memcpy(key, psk_table[i].key, PSK_LEN);
+            return PSK_LEN;
+        }
+        i = (i + 1) % PSK_TABLE_LEN;
+    }
+    return -1;
+}
+
+/**
+ *  @brief Server call-back function to handle requests
+ *
+ *  @param[in,out] server Pointer to a server structure
+ *  @param[in] req Pointer to the request message
+ *  @param[out] resp Pointer to the response message
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ */
+static int server_handle(coap_server_t *server, coap_msg_t *req, coap_msg_t *resp)
+{
+    return coap_msg_set_code(resp, COAP_MSG_SUCCESS, COAP_MSG_CONTENT);
+}
+
+/**
+ *  @brief Server thread function
+ *
+ *  @param[in] data Pointer to a server structure
+ *
+ *  @returns NULL
+ */
+static void *server_thread_func(void *data)
+{
+    coap_server_run((coap_server_t *)data);
+    return NULL;
+}
+
+/**
+ *  @brief Start a server thread
+ *
+ *  @param[in] server Pointer to an initialised server structure
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+static int server_start(coap_server_t *server)
+{
+    pthread_t thread = {0};
+    int ret = 0;
+
+    ret = pthread_create(&thread, NULL, server_thread_func, server);
+    if (ret != 0)
+    {
+        return -ret;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+/**
+ *  @brief Perform a handshake with the server
+ *
+ *  @param[out] client Pointer to a client structure
+ *  @param[in] type DTLS credential type
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+static int client_create(coap_client_t *client, coap_server_dtls_type_t type)
+{
+    unsigned char key[PSK_LEN] = {0};
+
+    switch (type)
+    {
+    case COAP_SERVER_DTLS_X509:
+        return coap_client_create(client, CLIENT_HOST, X509_PORT, CLIENT_KEY_FILE_NAME, CLIENT_CERT_FILE_NAME, CLIENT_TRUST_FILE_NAME, "", COMMON_NAME);
+    case COAP_SERVER_DTLS_RPK:
+        return coap_client_create_rpk(client, CLIENT_HOST, RPK_PORT, CLIENT_KEY_FILE_NAME, CLIENT_PUB_FILE_NAME, SERVER_PUB_FILE_NAME);
+    case COAP_SERVER_DTLS_PSK:
+        psk_derive(PSK_IDENTITY, key);
+        return coap_client_create_psk(client, CLIENT_HOST, PSK_PORT, PSK_IDENTITY, key, sizeof(key));
+    }
+    return -EINVAL;
+}
+
+/**
+ *  @brief Measure the handshake rate for a credential type
+ *
+ *  @param[in] type DTLS credential type
+ *  @param[in] name String containing the name of the credential type
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+static int bench(coap_server_dtls_type_t type, const char *name)
+{
+    struct timespec start = {0};
+    struct timespec end = {0};
+    coap_client_t client = {0};
+    coap_msg_t req = {0};
+    coap_msg_t resp = {0};
+    double sec = 0.0;
+    int ret = 0;
+    int i = 0;
+
+    /* check that the credentials work end to end */
+    ret = client_create(&client, type);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    coap_msg_create(&req);
+    coap_msg_create(&resp);
+    coap_msg_set_type(&req, COAP_MSG_CON);
+    coap_msg_set_code(&req, COAP_MSG_REQ, COAP_MSG_GET);
+    ret = coap_client_exchange(&client, &req, &resp);
+    coap_msg_destroy(&resp);
+    coap_msg_destroy(&req);
+    coap_client_destroy(&client);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < NUM_HANDSHAKES; i++)
+    {
+        ret = client_create(&client, type);
+        if (ret < 0)
+        {
+            return ret;
+        }
+        coap_client_destroy(&client);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    sec = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%-28s %6d handshakes %8.3f sec %10.1f handshakes/sec\n", name, NUM_HANDSHAKES, sec, NUM_HANDSHAKES / sec);
+    return 0;
+}
+
+/**
+ *  @brief Main function for the DTLS handshake benchmark
+ *
+ *  @returns Operation status
+ *  @retval EXIT_SUCCESS Success
+ *  @retval EXIT_FAILURE Error
+ */
+int main()
+{
+    coap_server_t x509_server = {0};
+    coap_server_t rpk_server = {0};
+    coap_server_t psk_server = {0};
+    char identity[32] = {0};
+    int ret = 0;
+    int i = 0;
+
+    coap_log_set_level(COAP_LOG_ERROR);
+    printf("GnuTLS version: %s\n", gnutls_check_version(NULL));
+
+    for (i = 0; i < NUM_PSK; i++)
+    {
+        snprintf(identity, sizeof(identity), "device-%04d", i);
+        psk_add(identity);
+    }
+    ret = coap_server_create(&x509_server, server_handle, SERVER_HOST, X509_PORT, SERVER_KEY_FILE_NAME, SERVER_CERT_FILE_NAME, SERVER_TRUST_FILE_NAME, "");
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to create X.509 server\n");
+        return EXIT_FAILURE;
+    }
+    ret = coap_server_create_rpk(&rpk_server, server_handle, SERVER_HOST, RPK_PORT, SERVER_KEY_FILE_NAME, SERVER_PUB_FILE_NAME, CLIENT_PUB_FILE_NAME);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to create raw public key server\n");
+        return EXIT_FAILURE;
+    }
+    ret = coap_server_create_psk(&psk_server, server_handle, SERVER_HOST, PSK_PORT, psk_lookup);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to create pre-shared key server\n");
+        return EXIT_FAILURE;
+    }
+    if ((server_start(&x509_server) < 0)
+     || (server_start(&rpk_server) < 0)
+     || (server_start(&psk_server) < 0))
+    {
+        fprintf(stderr, "Failed to start server threads\n");
+        return EXIT_FAILURE;
+    }
+
+    /* the servers run until the process exits */
+    ret = bench(COAP_SERVER_DTLS_X509, "X.509 certificates");
+    if (ret < 0)
+    {
+        fprintf(stderr, "X.509 certificates: %s\n", ret == -1 ? "DTLS error" : strerror(-ret));
+        return EXIT_FAILURE;
+    }
+    ret = bench(COAP_SERVER_DTLS_RPK, "Raw public keys");
+    if (ret < 0)
+    {
+        fprintf(stderr, "Raw public keys: %s\n", ret == -1 ? "DTLS error" : strerror(-ret));
+        return EXIT_FAILURE;
+    }
+    ret = bench(COAP_SERVER_DTLS_PSK, "Pre-shared keys");
+    if (ret < 0)
+    {
+        fprintf(stderr, "Pre-shared keys: %s\n", ret == -1 ? "DTLS error" : strerror(-ret));
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,493 @@
+/*
+ * Copyright (c) 2015 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/**
+ *  @file impair.c
+ *
+ *  @brief Source file for the FreeCoAP network impairment relay
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "impair.h"
+
+#define IMPAIR_SEEN       0x01                                                  /**< A confirmable message with this ID has been received */
+#define IMPAIR_ALIVE      0x02                                                  /**< A copy of the confirmable message with this ID may still be answered */
+#define IMPAIR_POLL_MS    100                                                   /**< Maximum time (msec) between checks of the stop flag */
+#define IMPAIR_PI         3.14159265358979323846                                /**< Pi */
+
+/**
+ *  @brief Get the current time
+ *
+ *  @returns Monotonic time in nsec
+ */
+static uint64_t impair_now(void)
+{
+    struct timespec ts = {0};
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ *  @brief Generate a random number
+ *
+ *  @param[in,out] impair Pointer to a relay structure
+ *
+ *  @returns Random number in (0, 1)
+ */
+static double impair_rand(impair_t *impair)
+{
+    /* xorshift64* */
+    impair->rand ^= impair->rand >> 12;
+    impair->rand ^= impair->rand << 25;
+    impair->rand ^= impair->rand >> 27;
+    return ((impair->rand * 2685821657736338717ull >> 11) + 0.5) / 9007199254740992.0;
+}
+
+/**
+ *  @brief Draw a one-way delay from the delay distribution of a direction
+ *
+ *  @param[in,out] impair Pointer to a relay structure
+ *  @param[in] link Pointer to the link parameters
+ *
+ *  @returns Delay in nsec
+ */
+static uint64_t impair_delay(impair_t *impair, const impair_link_t *link)
+{
+    double u1 = 0.0;
+    double u2 = 0.0;
+    double ms = 0.0;
+
+    ms = link->delay_ms;
+    if (link->jitter_ms != 0)
+    {
+        u1 = impair_rand(impair);
+        if (link->dist == IMPAIR_DIST_NORMAL)
+        {
+            /* Box-Muller */
+            u2 = impair_rand(impair);
+            ms += link->jitter_ms * sqrt(-2.0 * log(u1)) * cos(2.0 * IMPAIR_PI * u2);
+        }
+        else
+        {
+            ms += link->jitter_ms * (2.0 * u1 - 1.0);
+        }
+    }
+    if (ms < 0.0)
+    {
+        return 0;
+    }
+    return (uint64_t)(ms * 1000000.0);
+}
+
+/**
+ *  @brief Update the retransmission statistics for a datagram
+ *
+ *  @param[in,out] impair Pointer to a relay structure
+ *  @param[in] dir Direction
+ *  @param[in] buf Buffer containing the datagram
+ *  @param[in] len Length of the datagram
+ *  @param[in] dropped Indicates whether or not the datagram is dropped
+ */
+static void impair_track(impair_t *impair, impair_dir_t dir, const char *buf, size_t len, int dropped)
+{
+    impair_stats_t *stats = &impair->stats[dir];
+    unsigned char *state = NULL;
+    unsigned type = 0;
+    unsigned id = 0;
+
+    if ((len < 4) || (((unsigned char)buf[0] >> 6) != COAP_MSG_VER))
+    {
+        return;
+    }
+    type = ((unsigned char)buf[0] >> 4) & 0x03;
+    id = ((unsigned char)buf[2] << 8) | (unsigned char)buf[3];
+    if (type == COAP_MSG_CON)
+    {
+        state = &impair->id[dir][id];
+        if (*state & IMPAIR_SEEN)
+        {
+            stats->retransmit++;
+            if (*state & IMPAIR_ALIVE)
+            {
+                stats->spurious++;
+            }
+        }
+        *state |= IMPAIR_SEEN;
+        if (!dropped)
+        {
+            *state |= IMPAIR_ALIVE;
+        }
+    }
+    else if (((type == COAP_MSG_ACK) || (type == COAP_MSG_RST)) && (dropped))
+    {
+        /* the copies of the confirmable message sent so far will not be answered */
+        impair->id[!dir][id] &= ~IMPAIR_ALIVE;
+    }
+}
+
+/**
+ *  @brief Queue a datagram for delivery
+ *
+ *  @param[in,out] impair Pointer to a relay structure
+ *  @param[in] dir Direction
+ *  @param[in] buf Buffer containing the datagram
+ *  @param[in] len Length of the datagram
+ *  @param[in] reorder Indicates whether or not the datagram skips the delay
+ */
+static void impair_queue(impair_t *impair, impair_dir_t dir, const char *buf, size_t len, int reorder)
+{
+    const impair_link_t *link = &impair->link[dir];
+    impair_pkt_t *pkt = NULL;
+    uint64_t start = 0;
+    uint64_t due = 0;
+    unsigned i = 0;
+
+    if (impair->num_free == 0)
+    {
+        impair->stats[dir].overflow++;
+        return;
+    }
+    /* serialise datagrams in the same direction at the capped rate */
+    start = impair_now();
+    if (impair->link_free[dir] > start)
+    {
+        start = impair->link_free[dir];
+    }
+    if (link->rate != 0)
+    {
+        start += (uint64_t)len * 1000000000ull / link->rate;
+    }
+    impair->link_free[dir] = start;
+    due = start;
+    if (!reorder)
+    {
+        due += impair_delay(impair, link);
+    }
+    pkt = impair->free_pkt[--impair->num_free];
+    pkt->due = due;
+    pkt->dir = dir;
+    pkt->len = len;
+    memcpy(pkt->buf, buf, len);
+    /* keep datagrams due at the same time in arrival order */
+    i = impair->num_pkts;
+    while ((i > 0) && (impair->pkt[i - 1]->due > due))
+    {
+        impair->pkt[i] = impair->pkt[i - 1];
+        i--;
+    }
+    impair->pkt[i] = pkt;
+    impair->num_pkts++;
+}
+
+/**
+ *  @brief Apply the link model to a received datagram
+ *
+ *  @param[in,out] impair Pointer to a relay structure
+ *  @param[in] dir Direction
+ *  @param[in] buf Buffer containing the datagram
+ *  @param[in] len Length of the datagram
+ */
+static void impair_recv(impair_t *impair, impair_dir_t dir, const char *buf, size_t len)
+{
+    const impair_link_t *link = &impair->link[dir];
+    impair_stats_t *stats = &impair->stats[dir];
+    int reorder = 0;
+    int dropped = 0;
+
+    stats->recv++;
+    dropped = (impair_rand(impair) < link->loss);
+    impair_track(impair, dir, buf, len, dropped);
+    if (dropped)
+    {
+        stats->drop++;
+        return;
+    }
+    reorder = (impair_rand(impair) < link->reorder);
+    if (reorder)
+    {
+        stats->reorder++;
+    }
+    impair_queue(impair, dir, buf, len, reorder);
+    if (impair_rand(impair) < link->dup)
+    {
+        stats->dup++;
+        impair_queue(impair, dir, buf, len, 0);
+    }
+}
+
+/**
+ *  @brief Deliver datagrams that are due
+ *
+ *  @param[in,out] impair Pointer to a relay structure
+ *
+ *  @returns Time (msec) until the next datagram is due
+ */
+static int impair_deliver(impair_t *impair)
+{
+    impair_pkt_t *pkt = NULL;
+    uint64_t now = 0;
+    ssize_t num = 0;
+
+    now = impair_now();
+    while ((impair->num_pkts > 0) && (impair->pkt[0]->due <= now))
+    {
+        pkt = impair->pkt[0];
+        impair->num_pkts--;
+        memmove(&impair->pkt[0], &impair->pkt[1], impair->num_pkts * sizeof(impair->pkt[0]));
+        if (pkt->dir == IMPAIR_UP)
+        {
+            num = send(impair->server_sd, pkt->buf, pkt->len, 0);
+        }
+        else if (impair->client_sin_len != 0)
+        {
+            num = sendto(impair->client_sd, pkt->buf, pkt->len, 0, (struct sockaddr *)&impair->client_sin, impair->client_sin_len);
+        }
+        else
+        {
+            num = -1;
+        }
+        if (num == (ssize_t)pkt->len)
+        {
+            impair->stats[pkt->dir].sent++;
+        }
+        impair->free_pkt[impair->num_free++] = pkt;
+    }
+    if (impair->num_pkts == 0)
+    {
+        return IMPAIR_POLL_MS;
+    }
+    if (impair->pkt[0]->due - now >= IMPAIR_POLL_MS * 1000000ull)
+    {
+        return IMPAIR_POLL_MS;
+    }
+    return (int)((impair->pkt[0]->due - now + 999999) / 1000000);
+}
+
+/**
+ *  @brief Relay thread function
+ *
+ *  @param[in] data Pointer to a relay structure
+ *
+ *  @returns NULL
+ */
+static void *impair_thread_func(void *data)
+{
+    coap_ipv_sockaddr_in_t sin = {0};
+    struct pollfd fds[2] = {{0}};
+    impair_t *impair = (impair_t *)data;
+    socklen_t sin_len = 0;
+    ssize_t num = 0;
+    char buf[COAP_MSG_MAX_BUF_LEN] = {0};
+    int timeout = IMPAIR_POLL_MS;
+
+    fds[0].fd = impair->client_sd;
+    fds[0].events = POLLIN;
+    fds[1].fd = impair->server_sd;
+    fds[1].events = POLLIN;
+    while (!impair->stop)
+    {
+        fds[0].revents = 0;
+        fds[1].revents = 0;
+        poll(fds, 2, timeout);
+        pthread_mutex_lock(&impair->lock);
+        if (fds[0].revents & POLLIN)
+        {
+            sin_len = sizeof(sin);
+            num = recvfrom(impair->client_sd, buf, sizeof(buf), 0, (struct sockaddr *)&sin, &sin_len);
+            if (num > 0)
+            {
+                memcpy(&impair->client_sin, &sin, sin_len);
+                impair->client_sin_len = sin_len;
+                impair_recv(impair, IMPAIR_UP, buf, num);
+            }
+        }
+        if (fds[1].revents & POLLIN)
+        {
+            num = recv(impair->server_sd, buf, sizeof(buf), 0);
+            if (num > 0)
+            {
+                impair_recv(impair, IMPAIR_DOWN, buf, num);
+            }
+        }
+        timeout = impair_deliver(impair);
+        pthread_mutex_unlock(&impair->lock);
+    }
+    return NULL;
+}
+
+/**
+ *  @brief Open a loopback UDP socket
+ *
+ *  @param[in] port UDP port number
+ *  @param[in] conn Connect to the port if non-zero, otherwise bind to it
+ *
+ *  @returns Socket descriptor or error code
+ *  @retval >=0 Socket descriptor
+ *  @retval <0 Error
+ */
+static int impair_open(unsigned port, int conn)
+{
+    coap_ipv_sockaddr_in_t sin = {0};
+    int ret = 0;
+    int sd = 0;
+
+    sd = socket(COAP_IPV_AF_INET, SOCK_DGRAM, 0);
+    if (sd < 0)
+    {
+        return -errno;
+    }
+#ifdef COAP_IP6
+    sin.sin6_family = AF_INET6;
+    sin.sin6_addr = in6addr_loopback;
+#else
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+#endif
+    sin.COAP_IPV_SIN_PORT = htons(port);
+    if (conn)
+    {
+        ret = connect(sd, (struct sockaddr *)&sin, sizeof(sin));
+    }
+    else
+    {
+        ret = bind(sd, (struct sockaddr *)&sin, sizeof(sin));
+    }
+    if (ret < 0)
+    {
+        ret = -errno;
+        close(sd);
+        return ret;
+    }
+    return sd;
+}
+
+int impair_create(impair_t *impair, unsigned port, unsigned server_port)
+{
+    unsigned i = 0;
+    int ret = 0;
+
+    memset(impair, 0, sizeof(impair_t));
+    for (i = 0; i < IMPAIR_MAX_PKTS; i++)
+    {
+        impair->free_pkt[i] = calloc(1, sizeof(impair_pkt_t));
+        if (impair->free_pkt[i] == NULL)
+        {
+            ret = -ENOMEM;
+            goto err;
+        }
+        impair->num_free++;
+    }
+    impair->rand = 1;
+    impair->client_sd = impair_open(port, 0);
+    if (impair->client_sd < 0)
+    {
+        ret = impair->client_sd;
+        goto err;
+    }
+    impair->server_sd = impair_open(server_port, 1);
+    if (impair->server_sd < 0)
+    {
+        ret = impair->server_sd;
+        close(impair->client_sd);
+        goto err;
+    }
+    pthread_mutex_init(&impair->lock, NULL);
+    ret = pthread_create(&impair->thread, NULL, impair_thread_func, impair);
+    if (ret != 0)
+    {
+        ret = -ret;
+        pthread_mutex_destroy(&impair->lock);
+        close(impair->server_sd);
+        close(impair->client_sd);
+        goto err;
+    }
+    return 0;
+err:
+    for (i = 0; i < impair->num_free; i++)
+    {
+        free(impair->free_pkt[i]);
+    }
+    memset(impair, 0, sizeof(impair_t));
+    return ret;
+}
+
+void impair_destroy(impair_t *impair)
+{
+    unsigned i = 0;
+
+    impair->stop = 1;
+    pthread_join(impair->thread, NULL);
+    pthread_mutex_destroy(&impair->lock);
+    close(impair->server_sd);
+    close(impair->client_sd);
+    for (i = 0; i < impair->num_pkts; i++)
+    {
+        free(impair->pkt[i]);
+    }
+    for (i = 0; i < impair->num_free; i++)
+    {
+        free(impair->free_pkt[i]);
+    }
+    memset(impair, 0, sizeof(impair_t));
+}
+
+void impair_set_link(impair_t *impair, impair_dir_t dir, const impair_link_t *link)
+{
+    pthread_mutex_lock(&impair->lock);
+    impair->link[dir] = *link;
+    pthread_mutex_unlock(&impair->lock);
+}
+
+void impair_reset(impair_t *impair, unsigned seed)
+{
+    pthread_mutex_lock(&impair->lock);
+    while (impair->num_pkts > 0)
+    {
+        impair->free_pkt[impair->num_free++] = impair->pkt[--impair->num_pkts];
+    }
+    memset(impair->stats, 0, sizeof(impair->stats));
+    memset(impair->link_free, 0, sizeof(impair->link_free));
+    memset(impair->id, 0, sizeof(impair->id));
+    impair->rand = ((uint64_t)seed << 32) | 0x9e3779b9u;
+    pthread_mutex_unlock(&impair->lock);
+}
+
+void impair_get_stats(impair_t *impair, impair_dir_t dir, impair_stats_t *stats)
+{
+    pthread_mutex_lock(&impair->lock);
+    *stats = impair->stats[dir];
+    pthread_mutex_unlock(&impair->lock);
+}
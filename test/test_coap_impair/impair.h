@@ -0,0 +1,195 @@
+/*
+ * Copyright (c) 2015 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/**
+ *  @file impair.h
+ *
+ *  @brief Include file for the FreeCoAP network impairment relay
+ *
+ *  The relay forwards UDP datagrams between a client and a
+ *  server on loopback and applies loss, delay, jitter,
+ *  duplication, reordering and a bandwidth cap independently
+ *  in each direction.
+ */
+
+#ifndef IMPAIR_H
+#define IMPAIR_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "coap_msg.h"
+#include "coap_ipv.h"
+
+#define IMPAIR_MAX_PKTS  256                                                    /**< Maximum number of datagrams held by the relay */
+#define IMPAIR_NUM_IDS   0x10000                                                /**< Number of message ID values */
+
+/**
+ *  @brief Direction enumeration
+ */
+typedef enum
+{
+    IMPAIR_UP = 0,                                                              /**< Client to server */
+    IMPAIR_DOWN = 1                                                             /**< Server to client */
+}
+impair_dir_t;
+
+/**
+ *  @brief Delay distribution enumeration
+ */
+typedef enum
+{
+    IMPAIR_DIST_UNIFORM = 0,                                                    /**< Delay uniformly distributed in [delay - jitter, delay + jitter] */
+    IMPAIR_DIST_NORMAL                                                          /**< Delay normally distributed with mean delay and standard deviation jitter */
+}
+impair_dist_t;
+
+/**
+ *  @brief Link parameters structure
+ */
+typedef struct
+{
+    double loss;                                                                /**< Probability that a datagram is dropped */
+    unsigned delay_ms;                                                          /**< Mean one-way delay (msec) */
+    unsigned jitter_ms;                                                         /**< Spread of the one-way delay (msec) */
+    impair_dist_t dist;                                                         /**< Distribution of the one-way delay */
+    double dup;                                                                 /**< Probability that a datagram is delivered twice */
+    double reorder;                                                             /**< Probability that a datagram skips the delay and overtakes datagrams in flight */
+    unsigned rate;                                                              /**< Bandwidth cap (bytes/sec), 0 for no cap */
+}
+impair_link_t;
+
+/**
+ *  @brief Link statistics structure
+ *
+ *  A retransmission is a confirmable message whose message ID
+ *  has already been seen in the same direction. It is spurious
+ *  if an earlier copy was delivered and no acknowledgement or
+ *  reset for it has been dropped since, i.e. the sender would
+ *  have been answered had it waited.
+ */
+typedef struct
+{
+    unsigned long recv;                                                         /**< Number of datagrams received */
+    unsigned long sent;                                                         /**< Number of datagrams delivered */
+    unsigned long drop;                                                         /**< Number of datagrams dropped by the loss model */
+    unsigned long overflow;                                                     /**< Number of datagrams dropped because the relay was full */
+    unsigned long dup;                                                          /**< Number of datagrams duplicated */
+    unsigned long reorder;                                                      /**< Number of datagrams reordered */
+    unsigned long retransmit;                                                   /**< Number of retransmitted confirmable messages */
+    unsigned long spurious;                                                     /**< Number of spurious retransmissions */
+}
+impair_stats_t;
+
+/**
+ *  @brief Datagram structure
+ */
+typedef struct
+{
+    uint64_t due;                                                               /**< Delivery time (nsec, CLOCK_MONOTONIC) */
+    impair_dir_t dir;                                                           /**< Direction */
+    size_t len;                                                                 /**< Length of the datagram */
+    char buf[COAP_MSG_MAX_BUF_LEN];                                             /**< Buffer containing the datagram */
+}
+impair_pkt_t;
+
+/**
+ *  @brief Relay structure
+ */
+typedef struct
+{
+    int client_sd;                                                              /**< Socket descriptor facing the client */
+    int server_sd;                                                              /**< Socket descriptor connected to the server */
+    coap_ipv_sockaddr_in_t client_sin;                                          /**< Address of the most recent client */
+    socklen_t client_sin_len;                                                   /**< Length of the address of the most recent client */
+    impair_link_t link[2];                                                      /**< Link parameters for each direction */
+    impair_stats_t stats[2];                                                    /**< Link statistics for each direction */
+    uint64_t link_free[2];                                                      /**< Time (nsec) at which each direction finishes sending queued datagrams */
+    impair_pkt_t *pkt[IMPAIR_MAX_PKTS];                                         /**< Datagrams in flight sorted by delivery time */
+    impair_pkt_t *free_pkt[IMPAIR_MAX_PKTS];                                    /**< Unused datagrams */
+    unsigned num_pkts;                                                          /**< Number of datagrams in flight */
+    unsigned num_free;                                                          /**< Number of unused datagrams */
+    unsigned char id[2][IMPAIR_NUM_IDS];                                        /**< State of each confirmable message ID sent in each direction */
+    uint64_t rand;                                                              /**< Random number generator state */
+    pthread_mutex_t lock;                                                       /**< Protects everything above from the relay thread */
+    pthread_t thread;                                                           /**< Relay thread */
+    volatile int stop;                                                          /**< Indicates whether or not the relay thread should exit */
+}
+impair_t;
+
+/**
+ *  @brief Start a relay
+ *
+ *  The relay listens on the loopback address and forwards
+ *  everything to the server port on the loopback address.
+ *  All link parameters are initially zero.
+ *
+ *  @param[out] impair Pointer to a relay structure
+ *  @param[in] port UDP port number to listen on
+ *  @param[in] server_port UDP port number of the server
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+int impair_create(impair_t *impair, unsigned port, unsigned server_port);
+
+/**
+ *  @brief Stop a relay
+ *
+ *  @param[in,out] impair Pointer to a relay structure
+ */
+void impair_destroy(impair_t *impair);
+
+/**
+ *  @brief Set the link parameters for one direction
+ *
+ *  @param[in,out] impair Pointer to a relay structure
+ *  @param[in] dir Direction
+ *  @param[in] link Pointer to a link parameters structure
+ */
+void impair_set_link(impair_t *impair, impair_dir_t dir, const impair_link_t *link);
+
+/**
+ *  @brief Discard datagrams in flight and clear the statistics
+ *
+ *  @param[in,out] impair Pointer to a relay structure
+ *  @param[in] seed Seed for the random number generator
+ */
+void impair_reset(impair_t *impair, unsigned seed);
+
+/**
+ *  @brief Get the statistics for one direction
+ *
+ *  @param[in,out] impair Pointer to a relay structure
+ *  @param[in] dir Direction
+ *  @param[out] stats Pointer to a link statistics structure
+ */
+void impair_get_stats(impair_t *impair, impair_dir_t dir, impair_stats_t *stats);
+
+#endif
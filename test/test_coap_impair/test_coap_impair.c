@@ -0,0 +1,407 @@
+/*
+ * Copyright (c) 2015 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/**
+ *  @file test_coap_impair.c
+ *
+ *  @brief Source file for the FreeCoAP retransmission benchmark
+ *
+ *  Runs a client and a server on loopback with an impairment
+ *  relay between them and reports goodput, completion time and
+ *  retransmissions for a matrix of link profiles with piggy-backed
+ *  and separate responses.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include "coap_server.h"
+#include "coap_client.h"
+#include "coap_log.h"
+#include "impair.h"
+
+#ifdef COAP_IP6
+#define SERVER_HOST             "::"                                            /**< Host address to listen on */
+#define CLIENT_HOST             "::1"                                           /**< Host address of the relay */
+#else
+#define SERVER_HOST             "0.0.0.0"                                       /**< Host address to listen on */
+#define CLIENT_HOST             "127.0.0.1"                                     /**< Host address of the relay */
+#endif
+#define SERVER_PORT             12463                                           /**< UDP port number of the server */
+#define SERVER_PORT_STR         "12463"                                         /**< UDP port number of the server as a string */
+#define RELAY_PORT              12464                                           /**< UDP port number of the relay */
+#define RELAY_PORT_STR          "12464"                                         /**< UDP port number of the relay as a string */
+#define SEP_URI_PATH            "/separate"                                     /**< URI path that requires a separate response */
+#define SEP_URI_PATH_OP         "separate"                                      /**< URI path option value that requires a separate response */
+#define PIGGY_URI_PATH_OP       "resource"                                      /**< URI path option value that is answered with a piggy-backed response */
+#define PAYLOAD_LEN             256                                             /**< Length of the response payload */
+#define DEF_NUM_EXCHANGES       20                                              /**< Default number of exchanges per scenario */
+#define DEF_ACK_TIMEOUT_SEC     1                                               /**< Default client ACK_TIMEOUT (sec) */
+#define DEF_MAX_RETRANSMIT      4                                               /**< Default client MAX_RETRANSMIT */
+#define RESP_TIMEOUT_SEC        30                                              /**< Client response timeout (sec) */
+
+/**
+ *  @brief Link profile structure
+ */
+typedef struct
+{
+    const char *desc;                                                           /**< Profile description */
+    impair_link_t link;                                                         /**< Link parameters applied in both directions */
+}
+profile_t;
+
+static const profile_t profiles[] =                                             /**< Link profiles */
+{
+    {"loopback",            {0.00,   0,   0, IMPAIR_DIST_UNIFORM, 0.00, 0.00,    0}},
+    {"loss 5%",             {0.05,   0,   0, IMPAIR_DIST_UNIFORM, 0.00, 0.00,    0}},
+    {"loss 20%",            {0.20,   0,   0, IMPAIR_DIST_UNIFORM, 0.00, 0.00,    0}},
+    {"delay 100+-20 ms",    {0.00, 100,  20, IMPAIR_DIST_UNIFORM, 0.00, 0.00,    0}},
+    {"delay 500~250 ms",    {0.00, 500, 250, IMPAIR_DIST_NORMAL,  0.00, 0.00,    0}},
+    {"dup 10% reorder 10%", {0.00,  50,  10, IMPAIR_DIST_UNIFORM, 0.10, 0.10,    0}},
+    {"rate 2400 B/s",       {0.00,   0,   0, IMPAIR_DIST_UNIFORM, 0.00, 0.00, 2400}},
+    {"radio",               {0.10, 250, 100, IMPAIR_DIST_NORMAL,  0.01, 0.02, 2400}}
+};
+
+#define NUM_PROFILES (sizeof(profiles) / sizeof(profiles[0]))                   /**< Number of link profiles */
+
+static char payload[PAYLOAD_LEN] = {0};                                         /**< Response payload */
+static unsigned num_exchanges = DEF_NUM_EXCHANGES;                              /**< Number of exchanges per scenario */
+static unsigned ack_timeout_sec = DEF_ACK_TIMEOUT_SEC;                          /**< Client ACK_TIMEOUT (sec) */
+static unsigned max_retransmit = DEF_MAX_RETRANSMIT;                            /**< Client MAX_RETRANSMIT */
+static unsigned seed = 1;                                                       /**< Seed for the relay random number generator */
+
+/**
+ *  @brief Get the current time
+ *
+ *  @returns Monotonic time in sec
+ */
+static double now_sec(void)
+{
+    struct timespec ts = {0};
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ *  @brief Compare two completion times
+ *
+ *  @param[in] a Pointer to the first completion time
+ *  @param[in] b Pointer to the second completion time
+ *
+ *  @returns Comparison result for qsort
+ */
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ *  @brief Server call-back function to handle requests
+ *
+ *  @param[in,out] server Pointer to a server structure
+ *  @param[in] req Pointer to the request message
+ *  @param[out] resp Pointer to the response message
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+static int server_handle(coap_server_t *server, coap_msg_t *req, coap_msg_t *resp)
+{
+    int ret = 0;
+
+    ret = coap_msg_set_code(resp, COAP_MSG_SUCCESS, COAP_MSG_CONTENT);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    return coap_msg_set_payload(resp, payload, sizeof(payload));
+}
+
+/**
+ *  @brief Server thread function
+ *
+ *  @param[in] data Pointer to a server structure
+ *
+ *  @returns NULL
+ */
+static void *server_thread_func(void *data)
+{
+    coap_server_run((coap_server_t *)data);
+    return NULL;
+}
+
+/**
+ *  @brief Run one scenario and print the results
+ *
+ *  @param[in,out] impair Pointer to a relay structure
+ *  @param[in] profile Pointer to a link profile
+ *  @param[in] path String containing the URI path of the requests
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+static int bench(impair_t *impair, const profile_t *profile, const char *path)
+{
+    impair_stats_t up = {0};
+    impair_stats_t down = {0};
+    coap_client_t client = {0};
+    coap_msg_t req = {0};
+    coap_msg_t resp = {0};
+    unsigned num_ok = 0;
+    unsigned i = 0;
+    double *times = NULL;
+    double start = 0.0;
+    double sec = 0.0;
+    double t = 0.0;
+    int ret = 0;
+
+    times = calloc(num_exchanges, sizeof(double));
+    if (times == NULL)
+    {
+        return -ENOMEM;
+    }
+    impair_set_link(impair, IMPAIR_UP, &profile->link);
+    impair_set_link(impair, IMPAIR_DOWN, &profile->link);
+    impair_reset(impair, seed);
+    ret = coap_client_create(&client, CLIENT_HOST, RELAY_PORT_STR);
+    if (ret < 0)
+    {
+        free(times);
+        return ret;
+    }
+    ret = coap_client_set_timeouts(&client, ack_timeout_sec, max_retransmit, RESP_TIMEOUT_SEC);
+    if (ret < 0)
+    {
+        coap_client_destroy(&client);
+        free(times);
+        return ret;
+    }
+    start = now_sec();
+    for (i = 0; i < num_exchanges; i++)
+    {
+        coap_msg_create(&req);
+        coap_msg_create(&resp);
+        coap_msg_set_type(&req, COAP_MSG_CON);
+        coap_msg_set_code(&req, COAP_MSG_REQ, COAP_MSG_GET);
+        coap_msg_add_op(&req, COAP_MSG_URI_PATH, strlen(path), path);
+        t = now_sec();
+        ret = coap_client_exchange(&client, &req, &resp);
+        t = now_sec() - t;
+        if ((ret == 0)
+         && (coap_msg_get_code_class(&resp) == COAP_MSG_SUCCESS)
+         && (coap_msg_get_payload_len(&resp) == PAYLOAD_LEN))
+        {
+            times[num_ok++] = t;
+        }
+        coap_msg_destroy(&resp);
+        coap_msg_destroy(&req);
+    }
+    sec = now_sec() - start;
+    coap_client_destroy(&client);
+    impair_get_stats(impair, IMPAIR_UP, &up);
+    impair_get_stats(impair, IMPAIR_DOWN, &down);
+
+    qsort(times, num_ok, sizeof(double), cmp_double);
+    printf("%-20s %-6s %3u/%-3u %9.1f", profile->desc, strcmp(path, SEP_URI_PATH_OP) == 0 ? "sep" : "piggy",
+           num_ok, num_exchanges, num_ok * PAYLOAD_LEN / sec);
+    if (num_ok > 0)
+    {
+        printf(" %8.0f %8.0f %8.0f", times[(num_ok - 1) / 2] * 1000.0,
+               times[(num_ok * 95 + 99) / 100 - 1] * 1000.0, times[num_ok - 1] * 1000.0);
+    }
+    else
+    {
+        printf(" %8s %8s %8s", "-", "-", "-");
+    }
+    printf(" %5lu %5lu %5.0f%% %5lu %5lu\n", up.retransmit, up.spurious,
+           up.retransmit != 0 ? 100.0 * up.spurious / up.retransmit : 0.0,
+           down.retransmit, down.spurious);
+    fflush(stdout);
+    free(times);
+    return 0;
+}
+
+/**
+ *  @brief Helper function to list command line options
+ */
+static void usage(void)
+{
+    coap_log_error("Usage: test_coap_impair <options> profile-num");
+    coap_log_error("Options:");
+    coap_log_error("    -n num - number of exchanges per scenario (default %d)", DEF_NUM_EXCHANGES);
+    coap_log_error("    -a sec - client ACK_TIMEOUT (default %d)", DEF_ACK_TIMEOUT_SEC);
+    coap_log_error("    -r num - client MAX_RETRANSMIT (default %d)", DEF_MAX_RETRANSMIT);
+    coap_log_error("    -s seed - seed for the impairment relay (default 1)");
+    coap_log_error("    -l log-level - set the log level (0 to 4)");
+}
+
+/**
+ *  @brief Main function for the retransmission benchmark
+ *
+ *  @param[in] argc Number of command line arguments
+ *  @param[in] argv Array of pointers to command line arguments
+ *
+ *  @returns Operation status
+ *  @retval EXIT_SUCCESS Success
+ *  @retval EXIT_FAILURE Error
+ */
+int main(int argc, char **argv)
+{
+    const char *opts = ":hn:a:r:s:l:";
+    coap_server_t server = {0};
+    pthread_t thread = {0};
+    impair_t *impair = NULL;
+    unsigned first = 0;
+    unsigned last = NUM_PROFILES;
+    unsigned i = 0;
+    int log_level = COAP_LOG_ERROR;
+    int ret = 0;
+    int c = 0;
+
+    opterr = 0;
+    while ((c = getopt(argc, argv, opts)) != -1)
+    {
+        switch (c)
+        {
+        case 'h':
+            usage();
+            return EXIT_SUCCESS;
+        case 'n':
+            num_exchanges = atoi(optarg);
+            break;
+        case 'a':
+            ack_timeout_sec = atoi(optarg);
+            break;
+        case 'r':
+            max_retransmit = atoi(optarg);
+            break;
+        case 's':
+            seed = atoi(optarg);
+            break;
+        case 'l':
+            log_level = atoi(optarg);
+            break;
+        case ':':
+            coap_log_error("Option '%c' requires an argument", optopt);
+            return EXIT_FAILURE;
+        case '?':
+            coap_log_error("Unknown option '%c'", optopt);
+            return EXIT_FAILURE;
+        default:
+            usage();
+        }
+    }
+    /* if there is an argument after the options then interpret it as a profile number */
+    if (optind < argc)
+    {
+        i = atoi(argv[optind]);
+        if ((i < 1) || (i > NUM_PROFILES))
+        {
+            coap_log_error("Profile number must be between 1 and %u", (unsigned)NUM_PROFILES);
+            return EXIT_FAILURE;
+        }
+        first = i - 1;
+        last = i;
+    }
+    if ((num_exchanges == 0) || (ack_timeout_sec == 0))
+    {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    coap_log_set_level(log_level);
+    memset(payload, 'x', sizeof(payload));
+
+    ret = coap_server_create(&server, server_handle, SERVER_HOST, SERVER_PORT_STR);
+    if (ret < 0)
+    {
+        coap_log_error("Failed to create server: %s", strerror(-ret));
+        return EXIT_FAILURE;
+    }
+    ret = coap_server_add_sep_resp_uri_path(&server, SEP_URI_PATH);
+    if (ret < 0)
+    {
+        coap_log_error("Failed to add separate response URI path: %s", strerror(-ret));
+        coap_server_destroy(&server);
+        return EXIT_FAILURE;
+    }
+    ret = pthread_create(&thread, NULL, server_thread_func, &server);
+    if (ret != 0)
+    {
+        coap_log_error("Failed to start server thread: %s", strerror(ret));
+        coap_server_destroy(&server);
+        return EXIT_FAILURE;
+    }
+    pthread_detach(thread);
+    impair = malloc(sizeof(impair_t));
+    if (impair == NULL)
+    {
+        coap_log_error("Failed to allocate relay");
+        return EXIT_FAILURE;
+    }
+    ret = impair_create(impair, RELAY_PORT, SERVER_PORT);
+    if (ret < 0)
+    {
+        coap_log_error("Failed to create relay: %s", strerror(-ret));
+        free(impair);
+        return EXIT_FAILURE;
+    }
+
+    /* the server runs until the process exits */
+    printf("ACK_TIMEOUT: %u sec, MAX_RETRANSMIT: %u, exchanges per scenario: %u, payload: %d bytes\n\n",
+           ack_timeout_sec, max_retransmit, num_exchanges, PAYLOAD_LEN);
+    printf("%-20s %-6s %7s %9s %8s %8s %8s %5s %5s %6s %5s %5s\n",
+           "profile", "resp", "ok", "goodput", "p50", "p95", "max", "c-rtx", "c-sp", "c-sp%", "s-rtx", "s-sp");
+    printf("%-20s %-6s %7s %9s %8s %8s %8s\n", "", "", "", "(B/s)", "(ms)", "(ms)", "(ms)");
+    for (i = first; i < last; i++)
+    {
+        ret = bench(impair, &profiles[i], PIGGY_URI_PATH_OP);
+        if (ret == 0)
+        {
+            ret = bench(impair, &profiles[i], SEP_URI_PATH_OP);
+        }
+        if (ret < 0)
+        {
+            coap_log_error("%s: %s", profiles[i].desc, strerror(-ret));
+            break;
+        }
+    }
+    impair_destroy(impair);
+    free(impair);
+    return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,1023 @@
+/*
+ * Copyright (c) 2015 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ *  @file test_coap_observe.c
+ *
+ *  @brief Source file for the FreeCoAP observe client unit tests
+ *
+ *  Includes the client source file so that the static functions
+ *  can be called directly. The client is built without DTLS and
+ *  talks to a scripted server socket on loopback. Each test sends
+ *  the server's datagrams, has the client handle exactly that
+ *  number of datagrams and reads the client's replies. Timers
+ *  never fire on their own: a test makes a subscription due and
+ *  renews it, and checks renewal times against the clock readings
+ *  taken around the step that set them, so the results do not
+ *  depend on how fast the test runs.
+ */
+
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "coap_client.c"
+#include "test.h"
+
+#define DIM(x) (sizeof(x) / sizeof(x[0]))                                       /**< Calculate the size of an array */
+
+#define HOST              "127.0.0.1"                                           /**< Host address of the scripted server */
+#define PORT              "12460"                                               /**< UDP port number of the scripted server */
+#define URI_PATH          "obs"                                                 /**< URI path of the registrations */
+#define ACK_TIMEOUT_SEC   30                                                    /**< Acknowledgement timeout of the client */
+#define MAX_RETRANSMIT    2                                                     /**< Maximum number of retransmissions of the client */
+#define RESP_TIMEOUT_SEC  90                                                    /**< Response timeout of the client */
+#define WAIT_MS           5000                                                  /**< Maximum time to wait for a datagram that has been sent, only reached when a test fails */
+#define NUM_OBS           64                                                    /**< Number of subscriptions in the message ID test */
+#define MAX_NOTIFY        16                                                    /**< Maximum number of notifications recorded */
+#define NONE              -1                                                    /**< Option value that leaves the option out */
+
+/**
+ *  @brief Observe test data structure
+ */
+typedef struct
+{
+    const char *desc;                                                           /**< Test description */
+}
+test_coap_observe_data_t;
+
+test_coap_observe_data_t test1_data =
+{
+    .desc = "test 1: deliver only notifications that are fresh according to RFC 7641 section 3.4",
+};
+
+test_coap_observe_data_t test2_data =
+{
+    .desc = "test 2: a notification is fresh after 128 seconds whatever its sequence number",
+};
+
+test_coap_observe_data_t test3_data =
+{
+    .desc = "test 3: acknowledge confirmable notifications and reset unknown ones",
+};
+
+test_coap_observe_data_t test4_data =
+{
+    .desc = "test 4: match empty acknowledgements to registrations by message ID",
+};
+
+test_coap_observe_data_t test5_data =
+{
+    .desc = "test 5: register again when Max-Age passes without a notification",
+};
+
+test_coap_observe_data_t test6_data =
+{
+    .desc = "test 6: end a subscription on an error response or a response without Observe",
+};
+
+test_coap_observe_data_t test7_data =
+{
+    .desc = "test 7: end a subscription when the server resets the registration",
+};
+
+/**
+ *  @brief Registration structure
+ */
+typedef struct
+{
+    char token[COAP_CLIENT_OBS_TOKEN_LEN];                                      /**< Token of the registration */
+    unsigned msg_id;                                                            /**< Message ID of the registration */
+}
+reg_t;
+
+static coap_client_t client = {0};                                              /**< Client structure shared by the tests */
+static int server_sd = -1;                                                      /**< Scripted server socket */
+static struct sockaddr_in client_sin = {0};                                     /**< Address of the client */
+static unsigned server_msg_id = 0x2000;                                         /**< Message ID of the next notification */
+static int seq[MAX_NOTIFY] = {0};                                               /**< Observe values of the notifications delivered, NONE if absent */
+static int code[MAX_NOTIFY] = {0};                                              /**< Codes of the notifications delivered as class * 100 + detail */
+static unsigned num_notify = 0;                                                 /**< Number of notifications delivered */
+
+/**
+ *  @brief Call-back function to handle notifications
+ *
+ *  @param[in] obs Pointer to a subscription structure
+ *  @param[in] msg Pointer to the notification
+ *
+ *  @returns Non-zero to end the subscription
+ */
+static int notify(coap_client_obs_t *obs, coap_msg_t *msg)
+{
+    unsigned val = 0;
+
+    if (num_notify < MAX_NOTIFY)
+    {
+        seq[num_notify] = coap_client_get_uint_op(msg, COAP_MSG_OBSERVE, &val) ? (int)val : NONE;
+        code[num_notify] = coap_msg_get_code_class(msg) * 100 + coap_msg_get_code_detail(msg);
+    }
+    num_notify++;
+    return coap_client_obs_get_data(obs) != NULL;
+}
+
+/**
+ *  @brief Create the scripted server socket and the client
+ *
+ *  @returns Test result
+ */
+static test_result_t setup(void)
+{
+    struct sockaddr_in sin = {0};
+    int ret = 0;
+
+    num_notify = 0;
+    server_sd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (server_sd < 0)
+    {
+        return FAIL;
+    }
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(atoi(PORT));
+    inet_pton(AF_INET, HOST, &sin.sin_addr);
+    ret = bind(server_sd, (struct sockaddr *)&sin, sizeof(sin));
+    if (ret < 0)
+    {
+        close(server_sd);
+        return FAIL;
+    }
+    ret = coap_client_create(&client, HOST, PORT);
+    if (ret < 0)
+    {
+        coap_log_error("%s", strerror(-ret));
+        close(server_sd);
+        return FAIL;
+    }
+    coap_client_set_timeouts(&client, ACK_TIMEOUT_SEC, MAX_RETRANSMIT, RESP_TIMEOUT_SEC);
+    return PASS;
+}
+
+/**
+ *  @brief Destroy the client and the scripted server socket
+ */
+static void teardown(void)
+{
+    coap_client_destroy(&client);
+    close(server_sd);
+    server_sd = -1;
+}
+
+/**
+ *  @brief Receive a datagram from the client
+ *
+ *  @param[out] msg Pointer to a message structure to hold the datagram
+ *  @param[in] timeout_ms Maximum time to wait
+ *
+ *  @returns Operation status
+ *  @retval 1 A message was received
+ *  @retval 0 Nothing was received
+ *  @retval -1 Error
+ */
+static int server_recv(coap_msg_t *msg, int timeout_ms)
+{
+    struct pollfd pfd = {0};
+    socklen_t sin_len = sizeof(client_sin);
+    ssize_t num = 0;
+    char buf[COAP_MSG_MAX_BUF_LEN] = {0};
+
+    pfd.fd = server_sd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, timeout_ms) <= 0)
+    {
+        return 0;
+    }
+    num = recvfrom(server_sd, buf, sizeof(buf), 0, (struct sockaddr *)&client_sin, &sin_len);
+    if (num <= 0)
+    {
+        return -1;
+    }
+    coap_msg_reset(msg);
+    return coap_msg_parse(msg, buf, num) < 0 ? -1 : 1;
+}
+
+/**
+ *  @brief Receive a registration from the client
+ *
+ *  @param[out] reg Pointer to a registration structure
+ *  @param[in] timeout_ms Maximum time to wait
+ *
+ *  @returns Test result
+ */
+static test_result_t server_recv_reg(reg_t *reg, int timeout_ms)
+{
+    coap_msg_t msg = {0};
+    unsigned val = 0;
+    int ret = 0;
+
+    coap_msg_create(&msg);
+    ret = server_recv(&msg, timeout_ms);
+    if ((ret != 1)
+     || (coap_msg_get_type(&msg) != COAP_MSG_CON)
+     || (coap_msg_get_code_detail(&msg) != COAP_MSG_GET)
+     || (coap_msg_get_token_len(&msg) != COAP_CLIENT_OBS_TOKEN_LEN)
+     || (!coap_client_get_uint_op(&msg, COAP_MSG_OBSERVE, &val))
+     || (val != 0))
+    {
+        coap_msg_destroy(&msg);
+        return FAIL;
+    }
+    memcpy(reg->token, coap_msg_get_token(&msg), COAP_CLIENT_OBS_TOKEN_LEN);
+    reg->msg_id = coap_msg_get_msg_id(&msg);
+    coap_msg_destroy(&msg);
+    return PASS;
+}
+
+/**
+ *  @brief Check the type and message ID of the next datagram from the client
+ *
+ *  @param[in] type Expected type
+ *  @param[in] msg_id Expected message ID
+ *
+ *  @returns Test result
+ */
+static test_result_t server_expect(coap_msg_type_t type, unsigned msg_id)
+{
+    coap_msg_t msg = {0};
+    int ret = 0;
+
+    coap_msg_create(&msg);
+    ret = server_recv(&msg, WAIT_MS);
+    if ((ret != 1)
+     || (coap_msg_get_type(&msg) != type)
+     || (coap_msg_get_msg_id(&msg) != msg_id)
+     || (!coap_msg_is_empty(&msg)))
+    {
+        coap_msg_destroy(&msg);
+        return FAIL;
+    }
+    coap_msg_destroy(&msg);
+    return PASS;
+}
+
+/**
+ *  @brief Check that the client has sent nothing
+ *
+ *  Datagrams sent on loopback are queued on the receiving
+ *  socket before sendto returns so there is no need to wait.
+ *
+ *  @returns Test result
+ */
+static test_result_t server_expect_none(void)
+{
+    coap_msg_t msg = {0};
+    int ret = 0;
+
+    coap_msg_create(&msg);
+    ret = server_recv(&msg, 0);
+    coap_msg_destroy(&msg);
+    return ret == 0 ? PASS : FAIL;
+}
+
+/**
+ *  @brief Add an unsigned integer option to a message
+ *
+ *  @param[in,out] msg Pointer to a message structure
+ *  @param[in] num Option number
+ *  @param[in] val Option value, NONE to leave the option out
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+static int add_uint_op(coap_msg_t *msg, unsigned num, int val)
+{
+    char buf[4] = {0};
+    unsigned len = 0;
+    unsigned i = 0;
+
+    if (val == NONE)
+    {
+        return 0;
+    }
+    for (len = 0; (len < sizeof(buf)) && (((unsigned)val >> (8 * len)) != 0); len++)
+        ;
+    for (i = 0; i < len; i++)
+    {
+        buf[i] = (char)(((unsigned)val >> (8 * (len - 1 - i))) & 0xff);
+    }
+    return coap_msg_add_op(msg, num, len, buf);
+}
+
+/**
+ *  @brief Send a response or notification to the client
+ *
+ *  @param[in] type Message type
+ *  @param[in] msg_id Message ID
+ *  @param[in] token Pointer to the token
+ *  @param[in] code_class Code class
+ *  @param[in] code_detail Code detail
+ *  @param[in] obs_val Value of the Observe option, NONE for none
+ *  @param[in] max_age Value of the Max-Age option, NONE for none
+ *
+ *  @returns Test result
+ */
+static test_result_t server_send(coap_msg_type_t type, unsigned msg_id, char *token,
+                                 unsigned code_class, unsigned code_detail, int obs_val, int max_age)
+{
+    coap_msg_t msg = {0};
+    ssize_t num = 0;
+    char buf[COAP_MSG_MAX_BUF_LEN] = {0};
+    int ret = 0;
+
+    coap_msg_create(&msg);
+    ret = coap_msg_set_type(&msg, type);
+    if (ret == 0)
+        ret = coap_msg_set_code(&msg, code_class, code_detail);
+    if (ret == 0)
+        ret = coap_msg_set_msg_id(&msg, msg_id);
+    if ((ret == 0) && (token != NULL))
+        ret = coap_msg_set_token(&msg, token, COAP_CLIENT_OBS_TOKEN_LEN);
+    if (ret == 0)
+        ret = add_uint_op(&msg, COAP_MSG_OBSERVE, obs_val);
+    if (ret == 0)
+        ret = add_uint_op(&msg, COAP_MSG_MAX_AGE, max_age);
+    if (ret < 0)
+    {
+        coap_msg_destroy(&msg);
+        return FAIL;
+    }
+    num = coap_msg_format(&msg, buf, sizeof(buf));
+    coap_msg_destroy(&msg);
+    if (num < 0)
+    {
+        return FAIL;
+    }
+    num = sendto(server_sd, buf, num, 0, (struct sockaddr *)&client_sin, sizeof(client_sin));
+    return num > 0 ? PASS : FAIL;
+}
+
+/**
+ *  @brief Send a notification to the client
+ *
+ *  @param[in] type Message type
+ *  @param[in] token Pointer to the token
+ *  @param[in] obs_val Value of the Observe option
+ *
+ *  @returns Test result
+ */
+static test_result_t server_notify(coap_msg_type_t type, char *token, int obs_val)
+{
+    return server_send(type, server_msg_id++, token, COAP_MSG_SUCCESS, COAP_MSG_CONTENT, obs_val, NONE);
+}
+
+/**
+ *  @brief Have the client handle the datagrams sent to it
+ *
+ *  Each datagram is handled as coap_client_run handles it.
+ *
+ *  @param[in] num Number of datagrams sent to the client
+ *
+ *  @returns Test result
+ */
+static test_result_t deliver(unsigned num)
+{
+    struct pollfd pfd = {0};
+    coap_msg_t msg = {0};
+    ssize_t ret = 0;
+    unsigned i = 0;
+
+    pfd.fd = client.sd;
+    pfd.events = POLLIN;
+    for (i = 0; i < num; i++)
+    {
+        if (poll(&pfd, 1, WAIT_MS) <= 0)
+        {
+            return FAIL;
+        }
+        coap_msg_create(&msg);
+        ret = coap_client_recv(&client, &msg);
+        if (ret > 0)
+        {
+            ret = coap_client_handle_other(&client, &msg);
+        }
+        coap_msg_destroy(&msg);
+        if (ret < 0)
+        {
+            return FAIL;
+        }
+    }
+    return PASS;
+}
+
+/**
+ *  @brief Make a subscription due for renewal
+ *
+ *  @param[in,out] obs Pointer to a subscription structure
+ */
+static void make_due(coap_client_obs_t *obs)
+{
+    obs->renew.tv_sec = 0;
+    obs->renew.tv_nsec = 0;
+    coap_client_obs_heap_fix(&client, obs->heap_index);
+}
+
+/**
+ *  @brief Check the renewal time of a subscription
+ *
+ *  @param[in] obs Pointer to a subscription structure
+ *  @param[in] lo Pointer to the time read before the step that set the renewal time
+ *  @param[in] hi Pointer to the time read after that step
+ *  @param[in] sec Time (sec) from the step to the renewal
+ *
+ *  @returns Comparison value
+ *  @retval 1 The renewal time is sec after a time between lo and hi
+ *  @retval 0 Otherwise
+ */
+static int renew_in(coap_client_obs_t *obs, const struct timespec *lo, const struct timespec *hi, unsigned sec)
+{
+    struct timespec first = *lo;
+    struct timespec last = *hi;
+
+    first.tv_sec += sec;
+    last.tv_sec += sec;
+    return ((!coap_client_time_before(&obs->renew, &first))
+         && (!coap_client_time_before(&last, &obs->renew)));
+}
+
+/**
+ *  @brief Register with the scripted server
+ *
+ *  @param[out] obs Pointer to receive the subscription
+ *  @param[out] reg Pointer to a registration structure
+ *  @param[in] data Non-NULL to end the subscription on the first notification
+ *
+ *  @returns Test result
+ */
+static test_result_t observe(coap_client_obs_t **obs, reg_t *reg, void *data)
+{
+    coap_msg_t req = {0};
+    int ret = 0;
+
+    coap_msg_create(&req);
+    ret = coap_msg_set_type(&req, COAP_MSG_CON);
+    if (ret == 0)
+        ret = coap_msg_set_code(&req, COAP_MSG_REQ, COAP_MSG_GET);
+    if (ret == 0)
+        ret = add_uint_op(&req, COAP_MSG_OBSERVE, 0);
+    if (ret == 0)
+        ret = coap_msg_add_op(&req, COAP_MSG_URI_PATH, strlen(URI_PATH), URI_PATH);
+    if (ret == 0)
+        ret = coap_client_observe(&client, &req, notify, data, obs);
+    coap_msg_destroy(&req);
+    if (ret < 0)
+    {
+        return FAIL;
+    }
+    return server_recv_reg(reg, WAIT_MS);
+}
+
+/**
+ *  @brief Test the ordering of notifications
+ *
+ *  @param[in] data Pointer to a test data structure
+ *
+ *  @returns Test result
+ */
+static test_result_t test_fresh_func(test_data_t data)
+{
+    test_coap_observe_data_t *test_data = (test_coap_observe_data_t *)data;
+    coap_client_obs_t *obs = NULL;
+    test_result_t result = PASS;
+    int exp[] = {5, 7, 8, 0x7fff00, 0xfffe00, 1, 2};
+    unsigned i = 0;
+    reg_t reg = {{0}};
+
+    printf("%s\n", test_data->desc);
+
+    if (setup() != PASS)
+    {
+        return FAIL;
+    }
+    if (observe(&obs, &reg, NULL) != PASS)
+    {
+        teardown();
+        return FAIL;
+    }
+    /* the piggy-backed response is the first notification */
+    if ((server_send(COAP_MSG_ACK, reg.msg_id, reg.token, COAP_MSG_SUCCESS, COAP_MSG_CONTENT, 5, NONE) != PASS)
+     || (server_notify(COAP_MSG_NON, reg.token, 7) != PASS)
+     || (server_notify(COAP_MSG_NON, reg.token, 6) != PASS)
+     || (server_notify(COAP_MSG_NON, reg.token, 7) != PASS)
+     || (server_notify(COAP_MSG_NON, reg.token, 8) != PASS)
+     /* sequence numbers wrap around at 2^24 */
+     || (server_notify(COAP_MSG_NON, reg.token, 0x7fff00) != PASS)
+     || (server_notify(COAP_MSG_NON, reg.token, 0xfffe00) != PASS)
+     || (server_notify(COAP_MSG_NON, reg.token, 1) != PASS)
+     || (server_notify(COAP_MSG_NON, reg.token, 0xfffffe) != PASS)
+     || (server_notify(COAP_MSG_NON, reg.token, 2) != PASS)
+     /* a jump of more than 2^23 is taken as reordering */
+     || (server_notify(COAP_MSG_NON, reg.token, 2 + (1 << 23) + 1) != PASS)
+     || (deliver(11) != PASS))
+    {
+        result = FAIL;
+    }
+    if (num_notify != DIM(exp))
+    {
+        result = FAIL;
+    }
+    for (i = 0; (i < DIM(exp)) && (i < num_notify); i++)
+    {
+        if ((seq[i] != exp[i]) || (code[i] != 205))
+        {
+            result = FAIL;
+        }
+    }
+    if ((coap_client_get_num_obs(&client) != 1) || (server_expect_none() != PASS))
+    {
+        result = FAIL;
+    }
+    teardown();
+    return result;
+}
+
+/**
+ *  @brief Test the 128 second rule for the ordering of notifications
+ *
+ *  @param[in] data Pointer to a test data structure
+ *
+ *  @returns Test result
+ */
+static test_result_t test_reorder_time_func(test_data_t data)
+{
+    test_coap_observe_data_t *test_data = (test_coap_observe_data_t *)data;
+    coap_client_obs_t obs = {{0}};
+    struct timespec now = {0};
+    test_result_t result = PASS;
+
+    printf("%s\n", test_data->desc);
+
+    if (!coap_client_obs_is_fresh(&obs, 3, &now))
+    {
+        result = FAIL;
+    }
+    obs.have_seq = 1;
+    obs.seq = 10;
+    obs.seq_time.tv_sec = 1000;
+    now.tv_sec = 1000 + COAP_CLIENT_OBS_REORDER_SEC;
+    if ((coap_client_obs_is_fresh(&obs, 9, &now))
+     || (coap_client_obs_is_fresh(&obs, 10, &now))
+     || (!coap_client_obs_is_fresh(&obs, 11, &now)))
+    {
+        result = FAIL;
+    }
+    now.tv_sec++;
+    if ((!coap_client_obs_is_fresh(&obs, 9, &now))
+     || (!coap_client_obs_is_fresh(&obs, 10, &now)))
+    {
+        result = FAIL;
+    }
+    return result;
+}
+
+/**
+ *  @brief Test the replies to confirmable notifications
+ *
+ *  @param[in] data Pointer to a test data structure
+ *
+ *  @returns Test result
+ */
+static test_result_t test_con_func(test_data_t data)
+{
+    test_coap_observe_data_t *test_data = (test_coap_observe_data_t *)data;
+    coap_client_obs_t *obs2 = NULL;
+    coap_client_obs_t *obs = NULL;
+    test_result_t result = PASS;
+    char token[COAP_CLIENT_OBS_TOKEN_LEN] = {0};
+    unsigned id = 0;
+    reg_t reg2 = {{0}};
+    reg_t reg = {{0}};
+
+    printf("%s\n", test_data->desc);
+
+    if (setup() != PASS)
+    {
+        return FAIL;
+    }
+    if (observe(&obs, &reg, NULL) != PASS)
+    {
+        teardown();
+        return FAIL;
+    }
+    /* the registration is acknowledged and answered separately */
+    if ((server_send(COAP_MSG_ACK, reg.msg_id, NULL, 0, 0, NONE, NONE) != PASS)
+     || (server_notify(COAP_MSG_CON, reg.token, 1) != PASS)
+     || (deliver(2) != PASS)
+     || (server_expect(COAP_MSG_ACK, server_msg_id - 1) != PASS)
+     || (num_notify != 1))
+    {
+        result = FAIL;
+    }
+    id = server_msg_id;
+    if ((server_notify(COAP_MSG_CON, reg.token, 2) != PASS)
+     || (deliver(1) != PASS)
+     || (server_expect(COAP_MSG_ACK, id) != PASS)
+     || (num_notify != 2))
+    {
+        result = FAIL;
+    }
+    /* a notification for an unknown subscription is reset */
+    memcpy(token, reg.token, sizeof(token));
+    token[0] ^= 0x5a;
+    id = server_msg_id;
+    if ((server_notify(COAP_MSG_CON, token, 3) != PASS)
+     || (deliver(1) != PASS)
+     || (server_expect(COAP_MSG_RST, id) != PASS)
+     || (num_notify != 2))
+    {
+        result = FAIL;
+    }
+    /* and so is one for a cancelled subscription */
+    if (observe(&obs2, &reg2, NULL) != PASS)
+    {
+        result = FAIL;
+    }
+    coap_client_cancel_observe(&client, obs);
+    id = server_msg_id;
+    if ((server_notify(COAP_MSG_CON, reg.token, 4) != PASS)
+     || (deliver(1) != PASS)
+     || (server_expect(COAP_MSG_RST, id) != PASS)
+     || (num_notify != 2)
+     || (coap_client_get_num_obs(&client) != 1))
+    {
+        result = FAIL;
+    }
+    teardown();
+    return result;
+}
+
+/**
+ *  @brief Test the handling of empty acknowledgements of registrations
+ *
+ *  @param[in] data Pointer to a test data structure
+ *
+ *  @returns Test result
+ */
+static test_result_t test_ack_func(test_data_t data)
+{
+    test_coap_observe_data_t *test_data = (test_coap_observe_data_t *)data;
+    coap_client_obs_t *obs[NUM_OBS] = {NULL};
+    struct timespec renew[NUM_OBS] = {{0}};
+    struct timespec before = {0};
+    struct timespec after = {0};
+    test_result_t result = PASS;
+    unsigned i = 0;
+    reg_t reg[NUM_OBS] = {{{0}}};
+    reg_t retry = {{0}};
+
+    printf("%s\n", test_data->desc);
+
+    if (setup() != PASS)
+    {
+        return FAIL;
+    }
+    for (i = 0; i < NUM_OBS; i++)
+    {
+        if (observe(&obs[i], &reg[i], NULL) != PASS)
+        {
+            teardown();
+            return FAIL;
+        }
+        renew[i] = obs[i]->renew;
+    }
+    /* an acknowledgement that matches no registration changes nothing */
+    if ((server_send(COAP_MSG_ACK, reg[0].msg_id ^ 0x8000, NULL, 0, 0, NONE, NONE) != PASS)
+     || (deliver(1) != PASS))
+    {
+        result = FAIL;
+    }
+    for (i = 0; i < NUM_OBS; i++)
+    {
+        if (memcmp(&obs[i]->renew, &renew[i], sizeof(renew[i])) != 0)
+        {
+            result = FAIL;
+        }
+    }
+    /* acknowledge every other registration */
+    for (i = 0; i < NUM_OBS; i += 2)
+    {
+        if (server_send(COAP_MSG_ACK, reg[i].msg_id, NULL, 0, 0, NONE, NONE) != PASS)
+        {
+            result = FAIL;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &before);
+    if (deliver(NUM_OBS / 2) != PASS)
+    {
+        result = FAIL;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &after);
+    for (i = 0; i < NUM_OBS; i++)
+    {
+        if (((i % 2 == 0) && (!renew_in(obs[i], &before, &after, RESP_TIMEOUT_SEC)))
+         || ((i % 2 == 1) && (memcmp(&obs[i]->renew, &renew[i], sizeof(renew[i])) != 0)))
+        {
+            result = FAIL;
+        }
+    }
+    /* the registrations that were not acknowledged are sent again */
+    /* with a new message ID and the acknowledgement of the old one */
+    /* no longer matches */
+    for (i = 1; i < NUM_OBS; i += 2)
+    {
+        make_due(obs[i]);
+    }
+    if (coap_client_obs_renew(&client) < 0)
+    {
+        result = FAIL;
+    }
+    for (i = 1; i < NUM_OBS; i += 2)
+    {
+        if ((server_recv_reg(&retry, WAIT_MS) != PASS)
+         || (coap_client_obs_find(&client, retry.token, sizeof(retry.token)) == NULL)
+         || (coap_client_obs_find(&client, retry.token, sizeof(retry.token))->msg_id != retry.msg_id))
+        {
+            result = FAIL;
+        }
+    }
+    renew[1] = obs[1]->renew;
+    if ((server_expect_none() != PASS)
+     || (obs[1]->msg_id == reg[1].msg_id)
+     || (server_send(COAP_MSG_ACK, reg[1].msg_id, NULL, 0, 0, NONE, NONE) != PASS)
+     || (server_send(COAP_MSG_ACK, obs[3]->msg_id, NULL, 0, 0, NONE, NONE) != PASS))
+    {
+        result = FAIL;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &before);
+    if (deliver(2) != PASS)
+    {
+        result = FAIL;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &after);
+    if ((memcmp(&obs[1]->renew, &renew[1], sizeof(renew[1])) != 0)
+     || (!renew_in(obs[3], &before, &after, RESP_TIMEOUT_SEC)))
+    {
+        result = FAIL;
+    }
+    /* a subscription that ends leaves the message ID index */
+    for (i = 0; i < NUM_OBS; i += 2)
+    {
+        coap_client_cancel_observe(&client, obs[i]);
+    }
+    for (i = 0; i < COAP_CLIENT_OBS_HASH_SIZE; i++)
+    {
+        for (obs[0] = client.obs_id_hash[i]; obs[0] != NULL; obs[0] = obs[0]->id_next)
+        {
+            if ((obs[0]->heap_index >= coap_client_get_num_obs(&client))
+             || (client.obs_heap[obs[0]->heap_index] != obs[0]))
+            {
+                result = FAIL;
+            }
+        }
+    }
+    teardown();
+    return result;
+}
+
+/**
+ *  @brief Test registering again after Max-Age
+ *
+ *  @param[in] data Pointer to a test data structure
+ *
+ *  @returns Test result
+ */
+static test_result_t test_max_age_func(test_data_t data)
+{
+    test_coap_observe_data_t *test_data = (test_coap_observe_data_t *)data;
+    coap_client_obs_t *obs = NULL;
+    struct timespec before = {0};
+    struct timespec after = {0};
+    test_result_t result = PASS;
+    reg_t again = {{0}};
+    reg_t reg = {{0}};
+
+    printf("%s\n", test_data->desc);
+
+    if (setup() != PASS)
+    {
+        return FAIL;
+    }
+    if (observe(&obs, &reg, NULL) != PASS)
+    {
+        teardown();
+        return FAIL;
+    }
+    if (server_send(COAP_MSG_ACK, reg.msg_id, reg.token, COAP_MSG_SUCCESS, COAP_MSG_CONTENT, 1, 0) != PASS)
+    {
+        result = FAIL;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &before);
+    if (deliver(1) != PASS)
+    {
+        result = FAIL;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &after);
+    /* the registration is renewed when Max-Age and the margin pass */
+    if ((num_notify != 1)
+     || (!renew_in(obs, &before, &after, COAP_CLIENT_OBS_MARGIN_SEC))
+     || (server_expect_none() != PASS))
+    {
+        result = FAIL;
+    }
+    /* nothing arrives within Max-Age and the margin */
+    make_due(obs);
+    if ((coap_client_obs_renew(&client) < 0)
+     || (server_recv_reg(&again, WAIT_MS) != PASS)
+     || (memcmp(again.token, reg.token, sizeof(reg.token)) != 0)
+     || (again.msg_id == reg.msg_id)
+     || (obs->num_retries != 1))
+    {
+        result = FAIL;
+    }
+    /* the server answers the registration and notifications continue */
+    if ((server_send(COAP_MSG_ACK, again.msg_id, again.token, COAP_MSG_SUCCESS, COAP_MSG_CONTENT, 2, NONE) != PASS)
+     || (server_notify(COAP_MSG_NON, reg.token, 3) != PASS)
+     || (deliver(2) != PASS)
+     || (num_notify != 3)
+     || (seq[2] != 3)
+     || (obs->num_retries != 0))
+    {
+        result = FAIL;
+    }
+    teardown();
+    return result;
+}
+
+/**
+ *  @brief Test the end of subscriptions
+ *
+ *  @param[in] data Pointer to a test data structure
+ *
+ *  @returns Test result
+ */
+static test_result_t test_end_func(test_data_t data)
+{
+    test_coap_observe_data_t *test_data = (test_coap_observe_data_t *)data;
+    coap_client_obs_t *obs[3] = {NULL};
+    test_result_t result = PASS;
+    reg_t reg[3] = {{{0}}};
+    int stop = 1;
+
+    printf("%s\n", test_data->desc);
+
+    if (setup() != PASS)
+    {
+        return FAIL;
+    }
+    if ((observe(&obs[0], &reg[0], NULL) != PASS)
+     || (observe(&obs[1], &reg[1], NULL) != PASS)
+     || (observe(&obs[2], &reg[2], &stop) != PASS))
+    {
+        teardown();
+        return FAIL;
+    }
+    /* the resource is not found */
+    if ((server_send(COAP_MSG_ACK, reg[0].msg_id, reg[0].token, COAP_MSG_CLIENT_ERR, COAP_MSG_NOT_FOUND, NONE, NONE) != PASS)
+     || (deliver(1) != PASS)
+     || (num_notify != 1)
+     || (code[0] != 404)
+     || (coap_client_get_num_obs(&client) != 2))
+    {
+        result = FAIL;
+    }
+    /* the server does not accept the registration */
+    if ((server_send(COAP_MSG_ACK, reg[1].msg_id, reg[1].token, COAP_MSG_SUCCESS, COAP_MSG_CONTENT, NONE, NONE) != PASS)
+     || (deliver(1) != PASS)
+     || (num_notify != 2)
+     || (code[1] != 205)
+     || (seq[1] != NONE)
+     || (coap_client_get_num_obs(&client) != 1))
+    {
+        result = FAIL;
+    }
+    /* the notify call-back function ends the last subscription */
+    /* and coap_client_run has nothing left to wait for */
+    if ((server_send(COAP_MSG_ACK, reg[2].msg_id, reg[2].token, COAP_MSG_SUCCESS, COAP_MSG_CONTENT, 1, NONE) != PASS)
+     || (deliver(1) != PASS)
+     || (num_notify != 3)
+     || (coap_client_get_num_obs(&client) != 0)
+     || (coap_client_run(&client) != 0))
+    {
+        result = FAIL;
+    }
+    teardown();
+    return result;
+}
+
+/**
+ *  @brief Test the end of a subscription by a reset message
+ *
+ *  @param[in] data Pointer to a test data structure
+ *
+ *  @returns Test result
+ */
+static test_result_t test_reset_func(test_data_t data)
+{
+    test_coap_observe_data_t *test_data = (test_coap_observe_data_t *)data;
+    coap_client_obs_t *obs[2] = {NULL};
+    test_result_t result = PASS;
+    reg_t again = {{0}};
+    reg_t reg[2] = {{{0}}};
+
+    printf("%s\n", test_data->desc);
+
+    if (setup() != PASS)
+    {
+        return FAIL;
+    }
+    if ((observe(&obs[0], &reg[0], NULL) != PASS)
+     || (observe(&obs[1], &reg[1], NULL) != PASS))
+    {
+        teardown();
+        return FAIL;
+    }
+    /* a reset that matches no registration changes nothing */
+    if ((server_send(COAP_MSG_RST, reg[0].msg_id ^ 0x8000, NULL, 0, 0, NONE, NONE) != PASS)
+     || (deliver(1) != PASS)
+     || (num_notify != 0)
+     || (coap_client_get_num_obs(&client) != 2))
+    {
+        result = FAIL;
+    }
+    /* the reset is passed to the notify call-back function */
+    if ((server_send(COAP_MSG_RST, reg[0].msg_id, NULL, 0, 0, NONE, NONE) != PASS)
+     || (deliver(1) != PASS)
+     || (num_notify != 1)
+     || (code[0] != 0)
+     || (seq[0] != NONE)
+     || (coap_client_get_num_obs(&client) != 1)
+     || (coap_client_obs_find(&client, reg[0].token, sizeof(reg[0].token)) != NULL))
+    {
+        result = FAIL;
+    }
+    /* only the other subscription registers again */
+    make_due(obs[1]);
+    if ((coap_client_obs_renew(&client) < 0)
+     || (server_recv_reg(&again, WAIT_MS) != PASS)
+     || (memcmp(again.token, reg[1].token, sizeof(reg[1].token)) != 0)
+     || (server_expect_none() != PASS))
+    {
+        result = FAIL;
+    }
+    teardown();
+    return result;
+}
+
+/**
+ *  @brief Main function for the FreeCoAP observe client unit tests
+ *
+ *  @returns Operation status
+ *  @retval EXIT_SUCCESS Success
+ *  @retval EXIT_FAILURE Error
+ */
+int main(void)
+{
+    test_t tests[] = {{test_fresh_func,        &test1_data},
+                      {test_reorder_time_func, &test2_data},
+                      {test_con_func,          &test3_data},
+                      {test_ack_func,          &test4_data},
+                      {test_max_age_func,      &test5_data},
+                      {test_end_func,          &test6_data},
+                      {test_reset_func,        &test7_data}};
+    unsigned num_tests = DIM(tests);
+    unsigned num_pass = 0;
+
+    coap_log_set_level(COAP_LOG_ERROR);
+
+    num_pass = test_run(tests, num_tests);
+
+    return num_pass == num_tests ? EXIT_SUCCESS : EXIT_FAILURE;
+}
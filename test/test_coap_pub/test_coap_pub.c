@@ -0,0 +1,355 @@
+/*
+ * Copyright (c) 2015 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ *  @file test_coap_pub.c
+ *
+ *  @brief Source file for the FreeCoAP non-confirmable publisher test application
+ *
+ *  Measures the rate at which one thread can publish small
+ *  non-confirmable messages over loopback and checks that
+ *  a destination is paced to its PROBING_RATE.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "coap_pub.h"
+#include "coap_log.h"
+
+#ifdef COAP_IP6
+#define SERVER_HOST             "::1"                                           /**< Host address of the receiver */
+#else
+#define SERVER_HOST             "127.0.0.1"                                     /**< Host address of the receiver */
+#endif
+#define SERVER_PORT             12462                                           /**< UDP port number of the receiver */
+#define SERVER_PORT_STR         "12462"                                         /**< UDP port number of the receiver as a string */
+#define NUM_MSGS                1000000                                         /**< Number of messages published in the throughput test */
+#define BATCH                   32                                              /**< Number of messages that triggers a flush */
+#define FLUSH_USEC              1000                                            /**< Age (usec) of the oldest message that triggers a flush */
+#define PACED_RATE              20000                                           /**< PROBING_RATE (bytes/sec) in the pacing test */
+#define PACED_MSEC              500                                             /**< Duration (msec) of the pacing test */
+
+static volatile int recv_stop = 0;                                              /**< Indicates whether or not the receiver thread should exit */
+static unsigned long recv_count = 0;                                            /**< Number of messages received */
+
+/**
+ *  @brief Get the current time
+ *
+ *  @returns Monotonic time in sec
+ */
+static double now_sec(void)
+{
+    struct timespec ts = {0};
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ *  @brief Receiver thread function
+ *
+ *  Count the datagrams that arrive on the receiver socket.
+ *
+ *  @param[in] data Pointer to the socket descriptor
+ *
+ *  @returns NULL
+ */
+static void *recv_thread_func(void *data)
+{
+    struct mmsghdr hdr[64];
+    struct iovec iov[64];
+    struct timespec timeout = {0, 10000000};
+    char buf[64][COAP_MSG_MAX_BUF_LEN];
+    int sd = *(int *)data;
+    int ret = 0;
+    int i = 0;
+
+    while (!recv_stop)
+    {
+        for (i = 0; i < 64; i++)
+        {
+            iov[i].iov_base = buf[i];
+            iov[i].iov_len = sizeof(buf[i]);
+            memset(&hdr[i], 0, sizeof(hdr[i]));
+            hdr[i].msg_hdr.msg_iov = &iov[i];
+            hdr[i].msg_hdr.msg_iovlen = 1;
+        }
+        ret = recvmmsg(sd, hdr, 64, MSG_WAITFORONE, &timeout);
+        if (ret > 0)
+        {
+            recv_count += ret;
+        }
+    }
+    return NULL;
+}
+
+/**
+ *  @brief Open the receiver socket
+ *
+ *  @returns Socket descriptor or error code
+ *  @retval >=0 Socket descriptor
+ *  @retval <0 Error
+ */
+static int recv_open(void)
+{
+    coap_ipv_sockaddr_in_t sin = {0};
+    struct timeval tv = {0, 10000};
+    int size = 8 * 1024 * 1024;
+    int sd = 0;
+
+    sd = socket(COAP_IPV_AF_INET, SOCK_DGRAM, 0);
+    if (sd < 0)
+    {
+        return -errno;
+    }
+    setsockopt(sd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+#ifdef COAP_IP6
+    sin.sin6_family = AF_INET6;
+    sin.sin6_addr = in6addr_loopback;
+#else
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+#endif
+    sin.COAP_IPV_SIN_PORT = htons(SERVER_PORT);
+    if (bind(sd, (struct sockaddr *)&sin, sizeof(sin)) < 0)
+    {
+        close(sd);
+        return -errno;
+    }
+    return sd;
+}
+
+/**
+ *  @brief Create a telemetry message
+ *
+ *  @param[out] msg Pointer to a message structure
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+static int msg_init(coap_msg_t *msg)
+{
+    int ret = 0;
+
+    coap_msg_create(msg);
+    ret = coap_msg_set_type(msg, COAP_MSG_NON);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    ret = coap_msg_set_code(msg, COAP_MSG_REQ, COAP_MSG_POST);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    ret = coap_msg_add_op(msg, COAP_MSG_URI_PATH, 4, "telm");
+    if (ret < 0)
+    {
+        return ret;
+    }
+    return coap_msg_set_payload(msg, "t=21.5", 6);
+}
+
+/**
+ *  @brief Measure the publishing rate with pacing effectively disabled
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+static int test_throughput(void)
+{
+    coap_pub_t *pub = NULL;
+    coap_msg_t msg = {0};
+    double start = 0.0;
+    double sec = 0.0;
+    int dest = 0;
+    int ret = 0;
+    int i = 0;
+
+    pub = calloc(1, sizeof(coap_pub_t));
+    if (pub == NULL)
+    {
+        return -ENOMEM;
+    }
+    ret = coap_pub_create(pub, BATCH, FLUSH_USEC);
+    if (ret < 0)
+    {
+        free(pub);
+        return ret;
+    }
+    dest = coap_pub_add_dest(pub, SERVER_HOST, SERVER_PORT_STR);
+    if (dest < 0)
+    {
+        coap_pub_destroy(pub);
+        free(pub);
+        return dest;
+    }
+    coap_pub_set_probing_rate(pub, dest, UINT_MAX);
+    ret = msg_init(&msg);
+    start = now_sec();
+    for (i = 0; (i < NUM_MSGS) && (ret == 0); i++)
+    {
+        ret = coap_pub_publish(pub, dest, &msg);
+    }
+    if (ret == 0)
+    {
+        ret = coap_pub_flush(pub);
+    }
+    sec = now_sec() - start;
+    coap_msg_destroy(&msg);
+    if (ret >= 0)
+    {
+        usleep(100000);
+        printf("%-20s %lu messages %8.3f sec %10.1f messages/sec (%lu received)\n",
+               "Throughput", coap_pub_get_num_sent(pub), sec, coap_pub_get_num_sent(pub) / sec, recv_count);
+        if (coap_pub_get_num_sent(pub) != NUM_MSGS)
+        {
+            ret = -EIO;
+        }
+    }
+    coap_pub_destroy(pub);
+    free(pub);
+    return ret < 0 ? ret : 0;
+}
+
+/**
+ *  @brief Check that a destination is paced to its PROBING_RATE
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+static int test_pacing(void)
+{
+    coap_pub_t *pub = NULL;
+    coap_msg_t msg = {0};
+    unsigned long max_bytes = 0;
+    unsigned long bytes = 0;
+    double start = 0.0;
+    size_t len = 0;
+    char buf[COAP_MSG_MAX_BUF_LEN] = {0};
+    int dest = 0;
+    int ret = 0;
+
+    pub = calloc(1, sizeof(coap_pub_t));
+    if (pub == NULL)
+    {
+        return -ENOMEM;
+    }
+    ret = coap_pub_create(pub, BATCH, FLUSH_USEC);
+    if (ret < 0)
+    {
+        free(pub);
+        return ret;
+    }
+    dest = coap_pub_add_dest(pub, SERVER_HOST, SERVER_PORT_STR);
+    if (dest < 0)
+    {
+        coap_pub_destroy(pub);
+        free(pub);
+        return dest;
+    }
+    coap_pub_set_probing_rate(pub, dest, PACED_RATE);
+    ret = msg_init(&msg);
+    len = coap_msg_format(&msg, buf, sizeof(buf));
+    start = now_sec();
+    while ((ret >= 0) && (now_sec() - start < PACED_MSEC / 1000.0))
+    {
+        ret = coap_pub_publish(pub, dest, &msg);
+        if (ret == -ENOBUFS)
+        {
+            ret = coap_pub_poll(pub);
+        }
+    }
+    coap_msg_destroy(&msg);
+    if (ret >= 0)
+    {
+        /* one flush interval of burst plus one message may go ahead of the schedule */
+        bytes = coap_pub_get_num_sent(pub) * len;
+        max_bytes = (PACED_RATE * PACED_MSEC) / 1000 + (PACED_RATE * FLUSH_USEC) / 1000000 + len;
+        printf("%-20s %lu bytes sent in %d msec, limit %lu bytes\n", "Pacing", bytes, PACED_MSEC, max_bytes);
+        if ((bytes > max_bytes) || (bytes < max_bytes / 2))
+        {
+            ret = -EIO;
+        }
+    }
+    coap_pub_destroy(pub);
+    free(pub);
+    return ret < 0 ? ret : 0;
+}
+
+/**
+ *  @brief Main function for the non-confirmable publisher test application
+ *
+ *  @returns Operation status
+ *  @retval EXIT_SUCCESS Success
+ *  @retval EXIT_FAILURE Error
+ */
+int main()
+{
+    pthread_t thread = {0};
+    int sd = 0;
+    int ret = 0;
+
+    coap_log_set_level(COAP_LOG_ERROR);
+    sd = recv_open();
+    if (sd < 0)
+    {
+        fprintf(stderr, "Failed to open receiver socket: %s\n", strerror(-sd));
+        return EXIT_FAILURE;
+    }
+    pthread_create(&thread, NULL, recv_thread_func, &sd);
+    ret = test_throughput();
+    if (ret < 0)
+    {
+        fprintf(stderr, "Throughput: %s\n", strerror(-ret));
+    }
+    if (ret == 0)
+    {
+        ret = test_pacing();
+        if (ret < 0)
+        {
+            fprintf(stderr, "Pacing: %s\n", strerror(-ret));
+        }
+    }
+    recv_stop = 1;
+    pthread_join(thread, NULL);
+    close(sd);
+    return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -35,6 +35,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
 #ifdef COAP_DTLS_EN
 #include <gnutls/gnutls.h>
 #endif
@@ -54,6 +55,9 @@
 #define SEP_URI_PATH         "/separate"                                        /**< URI path that requires a separate response */
 #define UNSAFE_URI_PATH      "unsafe"                                           /**< URI path that causes the server to include an unsafe option in the response */
 #define UNSAFE_URI_PATH_LEN  6                                                  /**< Length of the URI path that causes the server to include an unsafe option in the response */
+#define SLOW_URI_PATH        "slow"                                             /**< URI path that causes the server to delay the response */
+#define SLOW_URI_PATH_LEN    4                                                  /**< Length of the URI path that causes the server to delay the response */
+#define SLOW_DELAY_SEC       1                                                  /**< Delay before the response to a request for the slow URI path */
 
 /**
  *  @brief Print a CoAP message
@@ -159,6 +163,41 @@ int server_handle_unsafe(coap_msg_t *req, coap_msg_t *resp)
     return 0;
 }
 
+/**
+ *  @brief Check for the slow indication in the request
+ *
+ *  Check the URI path option in the request message for
+ *  the value that instructs the server to delay the response.
+ *  This feature is used to test the deadline in the client.
+ *
+ *  @param[in] req Pointer to the request message
+ */
+void server_handle_slow(coap_msg_t *req)
+{
+    coap_msg_op_t *op = NULL;
+    unsigned num = 0;
+    unsigned len = 0;
+    char *val = NULL;
+
+    op = coap_msg_get_first_op(req);
+    while (op != NULL)
+    {
+        num = coap_msg_op_get_num(op);
+        len = coap_msg_op_get_len(op);
+        if ((num == COAP_MSG_URI_PATH) && (len == SLOW_URI_PATH_LEN))
+        {
+            val = coap_msg_op_get_val(op);
+            if (strncmp(val, SLOW_URI_PATH, SLOW_URI_PATH_LEN) == 0)
+            {
+                coap_log_info("Delaying the response");
+                sleep(SLOW_DELAY_SEC);
+                return;
+            }
+        }
+        op = coap_msg_op_get_next(op);
+    }
+}
+
 /**
  *  @brief Callback function to handle requests and generate responses
  *
@@ -193,6 +232,7 @@ int server_handle(coap_server_t *server, coap_msg_t *req, coap_msg_t *resp)
         coap_log_error("%s", strerror(-ret));
         return ret;
     }
+    server_handle_slow(req);
     ret = coap_msg_set_payload(resp, payload, strlen(payload));
     if (ret < 0)
     {
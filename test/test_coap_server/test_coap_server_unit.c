@@ -0,0 +1,1544 @@
+/*
+ * Copyright (c) 2015 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ *  @file test_coap_server_unit.c
+ *
+ *  @brief Source file for the FreeCoAP server library unit tests
+ *
+ *  Includes the server source file so that the static functions
+ *  can be called directly. The server is built without DTLS and
+ *  each test sends datagrams from a client socket and calls
+ *  coap_server_exchange to process them one at a time.
+ */
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "coap_server.c"
+#include "test.h"
+
+#define DIM(x) (sizeof(x) / sizeof(x[0]))                                       /**< Calculate the size of an array */
+
+#define HOST              "127.0.0.1"                                           /**< Host address to listen on */
+#define PORT              "12450"                                               /**< UDP port number to listen on */
+#define RECV_TIMEOUT_MS   500                                                   /**< Maximum time to wait for a response */
+#define URI_PATH          "res"                                                 /**< URI path of the requests */
+#define SLOW_URI_PATH     "slow"                                                /**< URI path whose handler is delayed */
+#define SLOW_DELAY_MS     30                                                    /**< Delay of the handler for the slow URI path */
+#define JUNK_URI_PATH     "junk"                                                /**< Prefix of URI paths that are not found */
+#define TMPL_URI_PATH     "tmpl"                                                /**< URI path answered with a response template */
+#define TMPL_PAYLOAD      "from a template"                                     /**< Payload of the response template */
+#define TMPL_ETAG         "t1"                                                  /**< Entity-tag of the response template */
+#define ETAG_URI_PATH     "etag"                                                /**< URI path whose entity-tag is set by the application */
+#define SEP_URI_PATH      "sep"                                                 /**< URI path that requires a separate response */
+
+/**
+ *  @brief Admission control test data structure
+ */
+typedef struct
+{
+    const char *desc;                                                           /**< Test description */
+    unsigned rate;                                                              /**< Sustained requests per second */
+    unsigned burst;                                                             /**< Maximum burst of requests */
+    unsigned max_age;                                                           /**< Max-Age value of the 5.03 response */
+    coap_msg_type_t type;                                                       /**< Type of the requests */
+    const char *max_age_opt;                                                    /**< Expected encoding of the Max-Age option */
+    unsigned max_age_opt_len;                                                   /**< Length of the expected encoding of the Max-Age option */
+}
+test_coap_server_unit_data_t;
+
+test_coap_server_unit_data_t test1_data =
+{
+    .desc = "test 1: shed a confirmable request with a piggy-backed 5.03 response",
+    .rate = 1,
+    .burst = 1,
+    .max_age = 300,
+    .type = COAP_MSG_CON,
+    .max_age_opt = "\xd2\x01\x01\x2c",
+    .max_age_opt_len = 4
+};
+
+test_coap_server_unit_data_t test2_data =
+{
+    .desc = "test 2: shed a non-confirmable request with a non-confirmable 5.03 response",
+    .rate = 1,
+    .burst = 1,
+    .max_age = 5,
+    .type = COAP_MSG_NON,
+    .max_age_opt = "\xd1\x01\x05",
+    .max_age_opt_len = 3
+};
+
+test_coap_server_unit_data_t test3_data =
+{
+    .desc = "test 3: shed a request with a zero Max-Age option",
+    .rate = 1,
+    .burst = 1,
+    .max_age = 0,
+    .type = COAP_MSG_CON,
+    .max_age_opt = "\xd0\x01",
+    .max_age_opt_len = 2
+};
+
+test_coap_server_unit_data_t test4_data =
+{
+    .desc = "test 4: refill the token bucket at the configured rate",
+    .rate = 10,
+    .burst = 2,
+    .max_age = 1,
+    .type = COAP_MSG_CON,
+    .max_age_opt = NULL,
+    .max_age_opt_len = 0
+};
+
+test_coap_server_unit_data_t test5_data =
+{
+    .desc = "test 5: a client keeps its empty token bucket when colliding addresses arrive",
+    .rate = 1,
+    .burst = 4,
+    .max_age = 1,
+    .type = COAP_MSG_CON,
+    .max_age_opt = NULL,
+    .max_age_opt_len = 0
+};
+
+test_coap_server_unit_data_t test6_data =
+{
+    .desc = "test 6: a request that costs no tokens is still refused from an empty token bucket",
+    .rate = 1,
+    .burst = 1,
+    .max_age = 1,
+    .type = COAP_MSG_CON,
+    .max_age_opt = NULL,
+    .max_age_opt_len = 0
+};
+
+test_coap_server_unit_data_t test7_data =
+{
+    .desc = "test 7: validate the handler latency budget",
+};
+
+test_coap_server_unit_data_t test8_data =
+{
+    .desc = "test 8: moving average of the handler latency",
+};
+
+test_coap_server_unit_data_t test9_data =
+{
+    .desc = "test 9: switch to separate responses when the handler is slower than the budget",
+};
+
+test_coap_server_unit_data_t test10_data =
+{
+    .desc = "test 10: URI paths that are not found or requested once do not flush the resources",
+};
+
+test_coap_server_unit_data_t test11_data =
+{
+    .desc = "test 11: send a response template again for a duplicate confirmable request",
+};
+
+test_coap_server_unit_data_t test12_data =
+{
+    .desc = "test 12: answer conditional requests from the entity-tag set by the application",
+};
+
+test_coap_server_unit_data_t test13_data =
+{
+    .desc = "test 13: pass requests with a stale or withdrawn entity-tag to the handler",
+};
+
+test_coap_server_unit_data_t test14_data =
+{
+    .desc = "test 14: pass requests for a variant to the handler and take entity-tags from templates",
+};
+
+test_coap_server_unit_data_t test15_data =
+{
+    .desc = "test 15: never replace a resource holding an entity-tag",
+};
+
+test_coap_server_unit_data_t test16_data =
+{
+    .desc = "test 16: send a piggy-backed response again for a duplicate confirmable request",
+};
+
+test_coap_server_unit_data_t test17_data =
+{
+    .desc = "test 17: acknowledge a duplicate confirmable request again after a separate response",
+};
+
+test_coap_server_unit_data_t test18_data =
+{
+    .desc = "test 18: ignore a duplicate non-confirmable request",
+};
+
+test_coap_server_unit_data_t test19_data =
+{
+    .desc = "test 19: ignore acknowledgement and reset messages that match nothing",
+};
+
+static coap_server_t server = {0};                                              /**< Server structure shared by the tests */
+static coap_server_tmpl_t tmpl = {0};                                           /**< Response template for the template URI path */
+static unsigned num_handle = 0;                                                 /**< Number of calls to the handle call-back function */
+static int client_sd = -1;                                                      /**< Client socket */
+static struct sockaddr_in server_sin = {0};                                     /**< Server socket address */
+static unsigned msg_id = 0x1000;                                                /**< Message ID of the next request */
+
+/**
+ *  @brief Callback function to handle requests and generate responses
+ *
+ *  @param[in,out] server Pointer to a server structure
+ *  @param[in] req Pointer to the request message
+ *  @param[out] resp Pointer to the response message
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+static int server_handle(coap_server_t *server, coap_msg_t *req, coap_msg_t *resp)
+{
+    char path[COAP_MSG_OP_URI_PATH_MAX_LEN] = {0};
+    int ret = 0;
+
+    num_handle++;
+    coap_server_get_uri_path(req, path, sizeof(path));
+    if (strcmp(path + 1, TMPL_URI_PATH) == 0)
+    {
+        coap_server_set_resp_tmpl(server, &tmpl);
+        return 0;
+    }
+    if (strncmp(path + 1, JUNK_URI_PATH, strlen(JUNK_URI_PATH)) == 0)
+    {
+        return coap_msg_set_code(resp, COAP_MSG_CLIENT_ERR, COAP_MSG_NOT_FOUND);
+    }
+    if (strcmp(path + 1, SLOW_URI_PATH) == 0)
+    {
+        usleep(SLOW_DELAY_MS * 1000);
+    }
+    ret = coap_msg_set_code(resp, COAP_MSG_SUCCESS, COAP_MSG_CONTENT);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    return coap_msg_set_payload(resp, "ok", 2);
+}
+
+/**
+ *  @brief Create the server and the client socket
+ *
+ *  @returns Test result
+ */
+static test_result_t setup(void)
+{
+    struct timeval tv = {0};
+    coap_msg_t msg = {0};
+    int ret = 0;
+
+    coap_msg_create(&msg);
+    ret = coap_msg_set_code(&msg, COAP_MSG_SUCCESS, COAP_MSG_CONTENT);
+    if (ret == 0)
+    {
+        ret = coap_msg_add_op(&msg, COAP_MSG_ETAG, strlen(TMPL_ETAG), TMPL_ETAG);
+    }
+    if (ret == 0)
+    {
+        ret = coap_msg_set_payload(&msg, TMPL_PAYLOAD, strlen(TMPL_PAYLOAD));
+    }
+    if (ret == 0)
+    {
+        ret = coap_server_tmpl_create(&tmpl, &msg);
+    }
+    coap_msg_destroy(&msg);
+    if (ret < 0)
+    {
+        coap_log_error("%s", strerror(-ret));
+        return FAIL;
+    }
+    ret = coap_server_create(&server, server_handle, HOST, PORT);
+    if (ret < 0)
+    {
+        coap_log_error("%s", strerror(-ret));
+        return FAIL;
+    }
+    client_sd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (client_sd < 0)
+    {
+        coap_server_destroy(&server);
+        return FAIL;
+    }
+    tv.tv_sec = RECV_TIMEOUT_MS / 1000;
+    tv.tv_usec = (RECV_TIMEOUT_MS % 1000) * 1000;
+    setsockopt(client_sd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    server_sin.sin_family = AF_INET;
+    server_sin.sin_port = htons(atoi(PORT));
+    inet_pton(AF_INET, HOST, &server_sin.sin_addr);
+    return PASS;
+}
+
+/**
+ *  @brief Destroy the server and the client socket
+ */
+static void teardown(void)
+{
+    close(client_sd);
+    client_sd = -1;
+    coap_server_destroy(&server);
+}
+
+/**
+ *  @brief Encode a GET request
+ *
+ *  @param[out] buf Buffer to hold the request
+ *  @param[in] type Type of the request
+ *  @param[in] id Message ID of the request
+ *  @param[in] path URI path of the request, shorter than 13 characters
+ *
+ *  @returns Length of the request
+ */
+static size_t encode_req(char *buf, coap_msg_type_t type, unsigned id, const char *path)
+{
+    size_t len = strlen(path);
+
+    buf[0] = (char)((COAP_MSG_VER << 6) | (type << 4) | 2);
+    buf[1] = (char)((COAP_MSG_REQ << 5) | COAP_MSG_GET);
+    buf[2] = (char)((id >> 8) & 0xff);
+    buf[3] = (char)(id & 0xff);
+    buf[4] = (char)(id >> 8);                                                   /* token */
+    buf[5] = (char)id;
+    buf[6] = (char)((COAP_MSG_URI_PATH << 4) | len);
+    memcpy(&buf[7], path, len);
+    return 7 + len;
+}
+
+/**
+ *  @brief Send a datagram to the server, let the server process it and receive the reply
+ *
+ *  @param[in] req Buffer containing the datagram
+ *  @param[in] req_len Length of the datagram
+ *  @param[out] resp Buffer to hold the reply
+ *  @param[in] resp_len Length of the buffer to hold the reply
+ *
+ *  @returns Length of the reply, 0 if there was no reply, or -1 on error
+ */
+static ssize_t send_recv(const char *req, size_t req_len, char *resp, size_t resp_len)
+{
+    ssize_t num = 0;
+    int ret = 0;
+
+    num = sendto(client_sd, req, req_len, 0, (struct sockaddr *)&server_sin, sizeof(server_sin));
+    if (num != (ssize_t)req_len)
+    {
+        return -1;
+    }
+    ret = coap_server_exchange(&server);
+    if ((ret < 0) && (ret != -1))
+    {
+        coap_log_debug("coap_server_exchange returned: %s", strerror(-ret));
+    }
+    num = recv(client_sd, resp, resp_len, 0);
+    if (num < 0)
+    {
+        return ((errno == EAGAIN) || (errno == EWOULDBLOCK)) ? 0 : -1;
+    }
+    return num;
+}
+
+/**
+ *  @brief Parse a reply and return its code
+ *
+ *  @param[in] buf Buffer containing the reply
+ *  @param[in] len Length of the reply
+ *
+ *  @returns Response code as class * 100 + detail, or -1 on error
+ */
+static int parse_code(char *buf, size_t len)
+{
+    coap_msg_t msg = {0};
+    ssize_t num = 0;
+    int code = 0;
+
+    coap_msg_create(&msg);
+    num = coap_msg_parse(&msg, buf, len);
+    if (num < 0)
+    {
+        coap_msg_destroy(&msg);
+        return -1;
+    }
+    code = coap_msg_get_code_class(&msg) * 100 + coap_msg_get_code_detail(&msg);
+    coap_msg_destroy(&msg);
+    return code;
+}
+
+/**
+ *  @brief Send a GET request and return the code of the response
+ *
+ *  @param[in] type Type of the request
+ *  @param[in] path URI path of the request
+ *
+ *  @returns Response code as class * 100 + detail, 0 if there was no response, or -1 on error
+ */
+static int get(coap_msg_type_t type, const char *path)
+{
+    ssize_t num = 0;
+    char resp[COAP_MSG_MAX_BUF_LEN] = {0};
+    char req[COAP_MSG_MAX_BUF_LEN] = {0};
+    size_t len = 0;
+
+    len = encode_req(req, type, msg_id++, path);
+    num = send_recv(req, len, resp, sizeof(resp));
+    if (num <= 0)
+    {
+        return (int)num;
+    }
+    return parse_code(resp, num);
+}
+
+/**
+ *  @brief Test the encoding of the 5.03 response sent when a request is shed
+ *
+ *  @param[in] data Pointer to a test data structure
+ *
+ *  @returns Test result
+ */
+static test_result_t test_unavail_func(test_data_t data)
+{
+    test_coap_server_unit_data_t *test_data = (test_coap_server_unit_data_t *)data;
+    test_result_t result = PASS;
+    coap_msg_type_t type = 0;
+    ssize_t num = 0;
+    unsigned id = 0;
+    char resp[COAP_MSG_MAX_BUF_LEN] = {0};
+    char req[COAP_MSG_MAX_BUF_LEN] = {0};
+    size_t len = 0;
+    int ret = 0;
+
+    printf("%s\n", test_data->desc);
+
+    if (setup() != PASS)
+    {
+        return FAIL;
+    }
+    ret = coap_server_set_admission(&server, test_data->rate, test_data->burst, 0, test_data->max_age);
+    if ((ret != 0) || (get(test_data->type, URI_PATH) != 205))
+    {
+        teardown();
+        return FAIL;
+    }
+    id = msg_id++;
+    len = encode_req(req, test_data->type, id, URI_PATH);
+    num = send_recv(req, len, resp, sizeof(resp));
+    if (num != 6 + test_data->max_age_opt_len)
+    {
+        result = FAIL;
+    }
+    else
+    {
+        type = test_data->type == COAP_MSG_CON ? COAP_MSG_ACK : COAP_MSG_NON;
+        if ((resp[0] != (char)((COAP_MSG_VER << 6) | (type << 4) | 2))
+         || (resp[1] != (char)((COAP_MSG_SERVER_ERR << 5) | COAP_MSG_SERV_UNAVAIL))
+         || (memcmp(&resp[4], &req[4], 2) != 0)
+         || (memcmp(&resp[6], test_data->max_age_opt, test_data->max_age_opt_len) != 0))
+        {
+            result = FAIL;
+        }
+        /* a piggy-backed response echoes the message ID of the request */
+        if ((type == COAP_MSG_ACK) && (memcmp(&resp[2], &req[2], 2) != 0))
+        {
+            result = FAIL;
+        }
+    }
+    if (server.num_shed_rate != 1)
+    {
+        result = FAIL;
+    }
+    teardown();
+    return result;
+}
+
+/**
+ *  @brief Test the rate at which tokens are added to a token bucket
+ *
+ *  @param[in] data Pointer to a test data structure
+ *
+ *  @returns Test result
+ */
+static test_result_t test_refill_func(test_data_t data)
+{
+    test_coap_server_unit_data_t *test_data = (test_coap_server_unit_data_t *)data;
+    test_result_t result = PASS;
+    int ret = 0;
+
+    printf("%s\n", test_data->desc);
+
+    if (setup() != PASS)
+    {
+        return FAIL;
+    }
+    ret = coap_server_set_admission(&server, test_data->rate, test_data->burst, 0, test_data->max_age);
+    if (ret != 0)
+    {
+        teardown();
+        return FAIL;
+    }
+    /* the burst is admitted */
+    if ((get(test_data->type, URI_PATH) != 205) || (get(test_data->type, URI_PATH) != 205) || (get(test_data->type, URI_PATH) != 503))
+    {
+        result = FAIL;
+    }
+    /* one token is added every 100 msec */
+    usleep(50 * 1000);
+    if (get(test_data->type, URI_PATH) != 503)
+    {
+        result = FAIL;
+    }
+    usleep(70 * 1000);
+    if ((get(test_data->type, URI_PATH) != 205) || (get(test_data->type, URI_PATH) != 503))
+    {
+        result = FAIL;
+    }
+    /* the bucket holds no more than the burst */
+    usleep(500 * 1000);
+    if ((get(test_data->type, URI_PATH) != 205) || (get(test_data->type, URI_PATH) != 205) || (get(test_data->type, URI_PATH) != 503))
+    {
+        result = FAIL;
+    }
+    if (server.num_shed_rate != 4)
+    {
+        result = FAIL;
+    }
+    teardown();
+    return result;
+}
+
+/**
+ *  @brief Find client addresses that map to the same set of token buckets
+ *
+ *  @param[out] sin Array of socket structures
+ *  @param[in] num Number of socket structures in the array
+ */
+static void find_colliding_addrs(struct sockaddr_in *sin, unsigned num)
+{
+    uint32_t first = 0;
+    uint32_t hash = 0;
+    unsigned sets = COAP_SERVER_NUM_BUCKETS / COAP_SERVER_BUCKET_WAYS;
+    unsigned i = 0;
+    unsigned n = 0;
+
+    for (i = 1; n < num; i++)
+    {
+        sin[n].sin_family = AF_INET;
+        sin[n].sin_addr.s_addr = htonl(0x0a000000 | i);
+        hash = coap_server_hash(&sin[n].sin_addr, sizeof(sin[n].sin_addr)) % sets;
+        if (n == 0)
+        {
+            first = hash;
+            n++;
+        }
+        else if (hash == first)
+        {
+            n++;
+        }
+    }
+}
+
+/**
+ *  @brief Look for the token bucket that holds a client address
+ *
+ *  @param[in] sin Pointer to a socket structure
+ *
+ *  @returns Pointer to a token bucket structure or NULL
+ */
+static coap_server_bucket_t *find_bucket(struct sockaddr_in *sin)
+{
+    unsigned i = 0;
+
+    for (i = 0; i < COAP_SERVER_NUM_BUCKETS; i++)
+    {
+        if ((server.bucket[i].active)
+         && (memcmp(&server.bucket[i].addr, &sin->sin_addr, sizeof(sin->sin_addr)) == 0))
+        {
+            return &server.bucket[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ *  @brief Test that evicting a token bucket does not refill it
+ *
+ *  @param[in] data Pointer to a test data structure
+ *
+ *  @returns Test result
+ */
+static test_result_t test_evict_func(test_data_t data)
+{
+    test_coap_server_unit_data_t *test_data = (test_coap_server_unit_data_t *)data;
+    test_result_t result = PASS;
+    struct sockaddr_in sin[2 * COAP_SERVER_BUCKET_WAYS] = {{0}};
+    unsigned i = 0;
+    unsigned j = 0;
+    int ret = 0;
+
+    printf("%s\n", test_data->desc);
+
+    if (setup() != PASS)
+    {
+        return FAIL;
+    }
+    ret = coap_server_set_admission(&server, test_data->rate, test_data->burst, 0, test_data->max_age);
+    if (ret != 0)
+    {
+        teardown();
+        return FAIL;
+    }
+    find_colliding_addrs(sin, DIM(sin));
+
+    /* the first client uses up its tokens */
+    for (i = 0; i < test_data->burst; i++)
+    {
+        if (!coap_server_admit(&server, &sin[0], 1000))
+        {
+            result = FAIL;
+        }
+    }
+    if (coap_server_admit(&server, &sin[0], 1000))
+    {
+        result = FAIL;
+    }
+
+    /* colliding clients fill the set and evict each other but not the first client */
+    for (i = 1; i < DIM(sin); i++)
+    {
+        if (!coap_server_admit(&server, &sin[i], 1000))
+        {
+            result = FAIL;
+        }
+    }
+    if (coap_server_admit(&server, &sin[0], 1000))
+    {
+        result = FAIL;
+    }
+
+    if (find_bucket(&sin[0]) == NULL)
+    {
+        result = FAIL;
+    }
+
+    /* the colliding clients use up their tokens so that the first client is evicted */
+    for (i = 1; i < DIM(sin); i++)
+    {
+        for (j = 0; j < test_data->burst; j++)
+        {
+            coap_server_admit(&server, &sin[i], 1000);
+        }
+        if (coap_server_admit(&server, &sin[i], 1000))
+        {
+            result = FAIL;
+        }
+    }
+    if (find_bucket(&sin[0]) != NULL)
+    {
+        result = FAIL;
+    }
+    /* and it comes back without any tokens */
+    if (coap_server_admit(&server, &sin[0], 1000))
+    {
+        result = FAIL;
+    }
+    teardown();
+    return result;
+}
+
+/**
+ *  @brief Test a request that costs no tokens
+ *
+ *  @param[in] data Pointer to a test data structure
+ *
+ *  @returns Test result
+ */
+static test_result_t test_cost_func(test_data_t data)
+{
+    test_coap_server_unit_data_t *test_data = (test_coap_server_unit_data_t *)data;
+    test_result_t result = PASS;
+    struct sockaddr_in sin = {0};
+    unsigned i = 0;
+    int ret = 0;
+
+    printf("%s\n", test_data->desc);
+
+    if (setup() != PASS)
+    {
+        return FAIL;
+    }
+    ret = coap_server_set_admission(&server, test_data->rate, test_data->burst, 0, test_data->max_age);
+    if (ret != 0)
+    {
+        teardown();
+        return FAIL;
+    }
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (i = 0; i < 4; i++)
+    {
+        if (!coap_server_admit(&server, &sin, 0))
+        {
+            result = FAIL;
+        }
+    }
+    if ((!coap_server_admit(&server, &sin, 1000))
+     || (coap_server_admit(&server, &sin, 0)))
+    {
+        result = FAIL;
+    }
+    teardown();
+    return result;
+}
+
+/**
+ *  @brief Test the validation of the handler latency budget
+ *
+ *  @param[in] data Pointer to a test data structure
+ *
+ *  @returns Test result
+ */
+static test_result_t test_budget_func(test_data_t data)
+{
+    test_coap_server_unit_data_t *test_data = (test_coap_server_unit_data_t *)data;
+    test_result_t result = PASS;
+
+    printf("%s\n", test_data->desc);
+
+    if (setup() != PASS)
+    {
+        return FAIL;
+    }
+    /* the budget must leave time to send an acknowledgement */
+    if ((coap_server_set_sep_resp_budget(&server, COAP_SERVER_ACK_TIMEOUT_SEC * 1000) != -EINVAL)
+     || (coap_server_set_sep_resp_budget(&server, COAP_SERVER_ACK_TIMEOUT_SEC * 1000 + 1) != -EINVAL)
+     || (server.sep_budget != 0))
+    {
+        result = FAIL;
+    }
+    if ((coap_server_set_sep_resp_budget(&server, COAP_SERVER_ACK_TIMEOUT_SEC * 1000 - 1) != 0)
+     || (server.sep_budget != COAP_SERVER_ACK_TIMEOUT_SEC * 1000 - 1))
+    {
+        result = FAIL;
+    }
+    if ((coap_server_set_sep_resp_budget(&server, 0) != 0)
+     || (server.sep_budget != 0))
+    {
+        result = FAIL;
+    }
+    teardown();
+    return result;
+}
+
+/**
+ *  @brief Test the moving average of the handler latency
+ *
+ *  @param[in] data Pointer to a test data structure
+ *
+ *  @returns Test result
+ */
+static test_result_t test_latency_func(test_data_t data)
+{
+    test_coap_server_unit_data_t *test_data = (test_coap_server_unit_data_t *)data;
+    test_result_t result = PASS;
+    coap_server_res_t res = {0};
+    struct timespec start = {0};
+    struct timespec end = {0};
+
+    printf("%s\n", test_data->desc);
+
+    /* the first sample is taken as it is */
+    start.tv_sec = 10;
+    end.tv_sec = 10;
+    end.tv_nsec = 1000000;
+    coap_server_res_update(&res, &start, &end);
+    if (res.avg_latency != 1000)
+    {
+        result = FAIL;
+    }
+    /* later samples have a weight of 1/8 */
+    end.tv_nsec = 9000000;
+    coap_server_res_update(&res, &start, &end);
+    if (res.avg_latency != 2000)
+    {
+        result = FAIL;
+    }
+    end.tv_sec = 11;
+    end.tv_nsec = 2000000;
+    coap_server_res_update(&res, &start, &end);
+    if (res.avg_latency != (2000 * 7 + 1002000) / 8)
+    {
+        result = FAIL;
+    }
+    /* time going backwards counts as zero */
+    start.tv_sec = 12;
+    coap_server_res_update(&res, &start, &end);
+    if (res.avg_latency != ((2000 * 7 + 1002000) / 8) * 7 / 8)
+    {
+        result = FAIL;
+    }
+    return result;
+}
+
+/**
+ *  @brief Find the resource structure recorded for a URI path
+ *
+ *  @param[in] path URI path
+ *
+ *  @returns Pointer to a resource structure or NULL
+ */
+static const coap_server_res_t *find_res(const char *path)
+{
+    const coap_server_res_t *res = NULL;
+    unsigned i = 0;
+
+    for (i = 0; i < COAP_SERVER_NUM_RES; i++)
+    {
+        res = coap_server_get_res(&server, i);
+        if ((res != NULL) && (strcmp(res->path, path) == 0))
+        {
+            return res;
+        }
+    }
+    return NULL;
+}
+
+/**
+ *  @brief Test the choice of a separate response for a slow handler
+ *
+ *  @param[in] data Pointer to a test data structure
+ *
+ *  @returns Test result
+ */
+static test_result_t test_sep_func(test_data_t data)
+{
+    test_coap_server_unit_data_t *test_data = (test_coap_server_unit_data_t *)data;
+    const coap_server_res_t *res = NULL;
+    test_result_t result = PASS;
+    ssize_t num = 0;
+    char resp[COAP_MSG_MAX_BUF_LEN] = {0};
+    char req[COAP_MSG_MAX_BUF_LEN] = {0};
+    size_t len = 0;
+    int ret = 0;
+
+    printf("%s\n", test_data->desc);
+
+    if (setup() != PASS)
+    {
+        return FAIL;
+    }
+    ret = coap_server_set_sep_resp_budget(&server, SLOW_DELAY_MS / 3);
+    if (ret != 0)
+    {
+        teardown();
+        return FAIL;
+    }
+    /* nothing is known about the handler for the first request */
+    if ((get(COAP_MSG_CON, SLOW_URI_PATH) != 205) || (get(COAP_MSG_CON, URI_PATH) != 205))
+    {
+        result = FAIL;
+    }
+    /* the second request is acknowledged before the handler is called */
+    len = encode_req(req, COAP_MSG_CON, msg_id++, SLOW_URI_PATH);
+    num = send_recv(req, len, resp, sizeof(resp));
+    if ((num != 4)
+     || (resp[0] != (char)((COAP_MSG_VER << 6) | (COAP_MSG_ACK << 4)))
+     || (memcmp(&resp[2], &req[2], 2) != 0))
+    {
+        result = FAIL;
+    }
+    num = recv(client_sd, resp, sizeof(resp), 0);
+    if ((num <= 0)
+     || ((((unsigned char)resp[0] >> 4) & 0x03) != COAP_MSG_CON)
+     || (parse_code(resp, num) != 205))
+    {
+        result = FAIL;
+    }
+    /* a fast handler keeps piggy-backed responses */
+    if (get(COAP_MSG_CON, URI_PATH) != 205)
+    {
+        result = FAIL;
+    }
+    res = find_res("/" SLOW_URI_PATH);
+    if ((res == NULL)
+     || (res->num_piggybacked != 1)
+     || (res->num_separate != 1)
+     || (res->avg_latency < SLOW_DELAY_MS * 1000))
+    {
+        result = FAIL;
+    }
+    res = find_res("/" URI_PATH);
+    if ((res == NULL)
+     || (res->num_piggybacked != 2)
+     || (res->num_separate != 0)
+     || (res->avg_latency >= (SLOW_DELAY_MS / 3) * 1000))
+    {
+        result = FAIL;
+    }
+    if ((coap_server_get_res(&server, COAP_SERVER_NUM_RES) != NULL)
+     || (coap_server_get_res(&server, 2) != NULL))
+    {
+        result = FAIL;
+    }
+    teardown();
+    return result;
+}
+
+/**
+ *  @brief Test that the resource structures are not flushed by URI paths used once
+ *
+ *  @param[in] data Pointer to a test data structure
+ *
+ *  @returns Test result
+ */
+static test_result_t test_flush_func(test_data_t data)
+{
+    test_coap_server_unit_data_t *test_data = (test_coap_server_unit_data_t *)data;
+    test_result_t result = PASS;
+    unsigned num = 0;
+    unsigned i = 0;
+    char path[16] = {0};
+
+    printf("%s\n", test_data->desc);
+
+    if (setup() != PASS)
+    {
+        return FAIL;
+    }
+    if ((get(COAP_MSG_CON, URI_PATH) != 205) || (get(COAP_MSG_CON, URI_PATH) != 205))
+    {
+        result = FAIL;
+    }
+    /* URI paths that are not found are not recorded */
+    for (i = 0; i < 2 * COAP_SERVER_NUM_RES; i++)
+    {
+        snprintf(path, sizeof(path), JUNK_URI_PATH "%u", i);
+        if (get(COAP_MSG_CON, path) != 404)
+        {
+            result = FAIL;
+        }
+    }
+    for (i = 0; i < COAP_SERVER_NUM_RES; i++)
+    {
+        if (coap_server_get_res(&server, i) != NULL)
+        {
+            num++;
+        }
+    }
+    if (num != 1)
+    {
+        result = FAIL;
+    }
+    /* URI paths requested once replace each other */
+    for (i = 0; i < 2 * COAP_SERVER_NUM_RES; i++)
+    {
+        snprintf(path, sizeof(path), "p%u", i);
+        if (get(COAP_MSG_CON, path) != 205)
+        {
+            result = FAIL;
+        }
+    }
+    if (find_res("/" URI_PATH) == NULL)
+    {
+        result = FAIL;
+    }
+    teardown();
+    return result;
+}
+
+/**
+ *  @brief Test the response to a duplicate confirmable request answered with a response template
+ *
+ *  @param[in] data Pointer to a test data structure
+ *
+ *  @returns Test result
+ */
+static test_result_t test_tmpl_dup_func(test_data_t data)
+{
+    test_coap_server_unit_data_t *test_data = (test_coap_server_unit_data_t *)data;
+    test_result_t result = PASS;
+    ssize_t num1 = 0;
+    ssize_t num2 = 0;
+    unsigned calls = 0;
+    char resp1[COAP_MSG_MAX_BUF_LEN] = {0};
+    char resp2[COAP_MSG_MAX_BUF_LEN] = {0};
+    char req[COAP_MSG_MAX_BUF_LEN] = {0};
+    size_t len = 0;
+
+    printf("%s\n", test_data->desc);
+
+    if (setup() != PASS)
+    {
+        return FAIL;
+    }
+    len = encode_req(req, COAP_MSG_CON, msg_id++, TMPL_URI_PATH);
+    num1 = send_recv(req, len, resp1, sizeof(resp1));
+    calls = num_handle;
+    if ((num1 <= 0)
+     || (resp1[0] != (char)((COAP_MSG_VER << 6) | (COAP_MSG_ACK << 4) | 2))
+     || (parse_code(resp1, num1) != 205)
+     || (memcmp(&resp1[2], &req[2], 4) != 0)
+     || (num1 < (ssize_t)strlen(TMPL_PAYLOAD))
+     || (memcmp(&resp1[num1 - strlen(TMPL_PAYLOAD)], TMPL_PAYLOAD, strlen(TMPL_PAYLOAD)) != 0))
+    {
+        result = FAIL;
+    }
+    /* the acknowledgement was lost and the client retransmits */
+    num2 = send_recv(req, len, resp2, sizeof(resp2));
+    if ((num2 != num1)
+     || (memcmp(resp1, resp2, num1) != 0)
+     || (num_handle != calls))
+    {
+        result = FAIL;
+    }
+    teardown();
+    return result;
+}
+
+/**
+ *  @brief Send a confirmable GET request carrying an option and return the code of the response
+ *
+ *  @param[in] path URI path of the request
+ *  @param[in] op_num Option number, 0 for none
+ *  @param[in] op_val Option value
+ *  @param[in] query Value of a Uri-Query option or NULL
+ *
+ *  @returns Response code as class * 100 + detail, 0 if there was no response, or -1 on error
+ */
+static int get_op(const char *path, unsigned op_num, const char *op_val, const char *query)
+{
+    coap_msg_t msg = {0};
+    ssize_t num = 0;
+    char resp[COAP_MSG_MAX_BUF_LEN] = {0};
+    char req[COAP_MSG_MAX_BUF_LEN] = {0};
+    char token[2] = {0};
+    int ret = 0;
+
+    token[0] = (char)(msg_id >> 8);
+    token[1] = (char)msg_id;
+    coap_msg_create(&msg);
+    ret = coap_msg_set_type(&msg, COAP_MSG_CON);
+    if (ret == 0)
+        ret = coap_msg_set_code(&msg, COAP_MSG_REQ, COAP_MSG_GET);
+    if (ret == 0)
+        ret = coap_msg_set_msg_id(&msg, msg_id++);
+    if (ret == 0)
+        ret = coap_msg_set_token(&msg, token, sizeof(token));
+    if ((ret == 0) && (op_num != 0) && (op_num < COAP_MSG_URI_PATH))
+        ret = coap_msg_add_op(&msg, op_num, strlen(op_val), op_val);
+    if (ret == 0)
+        ret = coap_msg_add_op(&msg, COAP_MSG_URI_PATH, strlen(path), path);
+    if ((ret == 0) && (query != NULL))
+        ret = coap_msg_add_op(&msg, COAP_MSG_URI_QUERY, strlen(query), query);
+    if ((ret == 0) && (op_num > COAP_MSG_URI_QUERY))
+        ret = coap_msg_add_op(&msg, op_num, strlen(op_val), op_val);
+    if (ret < 0)
+    {
+        coap_msg_destroy(&msg);
+        return -1;
+    }
+    num = coap_msg_format(&msg, req, sizeof(req));
+    coap_msg_destroy(&msg);
+    if (num < 0)
+    {
+        return -1;
+    }
+    num = send_recv(req, num, resp, sizeof(resp));
+    if (num <= 0)
+    {
+        return (int)num;
+    }
+    return parse_code(resp, num);
+}
+
+/**
+ *  @brief Test the answers to conditional requests
+ *
+ *  @param[in] data Pointer to a test data structure
+ *
+ *  @returns Test result
+ */
+static test_result_t test_cond_func(test_data_t data)
+{
+    test_coap_server_unit_data_t *test_data = (test_coap_server_unit_data_t *)data;
+    test_result_t result = PASS;
+    unsigned calls = 0;
+    int ret = 0;
+
+    printf("%s\n", test_data->desc);
+
+    if (setup() != PASS)
+    {
+        return FAIL;
+    }
+    ret = coap_server_set_etag(&server, "/" ETAG_URI_PATH, "v1", 2);
+    if (ret != 0)
+    {
+        teardown();
+        return FAIL;
+    }
+    /* conditional responses are disabled by default */
+    calls = num_handle;
+    if ((get_op(ETAG_URI_PATH, COAP_MSG_ETAG, "v1", NULL) != 205)
+     || (get_op(ETAG_URI_PATH, COAP_MSG_IF_NONE_MATCH, "", NULL) != 205)
+     || (num_handle != calls + 2))
+    {
+        result = FAIL;
+    }
+    coap_server_set_cond_resp(&server, 1);
+    calls = num_handle;
+    if ((get_op(ETAG_URI_PATH, COAP_MSG_ETAG, "v1", NULL) != 203)
+     || (get_op(ETAG_URI_PATH, COAP_MSG_IF_NONE_MATCH, "", NULL) != 412)
+     || (get_op(ETAG_URI_PATH, COAP_MSG_IF_MATCH, "v0", NULL) != 412)
+     || (num_handle != calls))
+    {
+        result = FAIL;
+    }
+    /* requests that the entity-tag does not settle reach the handler */
+    if ((get_op(ETAG_URI_PATH, COAP_MSG_IF_MATCH, "v1", NULL) != 205)
+     || (get_op(ETAG_URI_PATH, COAP_MSG_IF_MATCH, "", NULL) != 205)
+     || (get_op(ETAG_URI_PATH, 0, NULL, NULL) != 205)
+     || (get_op(URI_PATH, COAP_MSG_ETAG, "v1", NULL) != 205)
+     || (num_handle != calls + 4))
+    {
+        result = FAIL;
+    }
+    if ((find_res("/" ETAG_URI_PATH) == NULL) || (find_res("/" ETAG_URI_PATH)->num_valid != 1))
+    {
+        result = FAIL;
+    }
+    teardown();
+    return result;
+}
+
+/**
+ *  @brief Test conditional requests carrying an out of date entity-tag
+ *
+ *  @param[in] data Pointer to a test data structure
+ *
+ *  @returns Test result
+ */
+static test_result_t test_stale_func(test_data_t data)
+{
+    test_coap_server_unit_data_t *test_data = (test_coap_server_unit_data_t *)data;
+    test_result_t result = PASS;
+    unsigned calls = 0;
+
+    printf("%s\n", test_data->desc);
+
+    if (setup() != PASS)
+    {
+        return FAIL;
+    }
+    coap_server_set_cond_resp(&server, 1);
+    if ((coap_server_set_etag(&server, "/" ETAG_URI_PATH, "v1", 2) != 0)
+     || (get_op(ETAG_URI_PATH, COAP_MSG_ETAG, "v1", NULL) != 203))
+    {
+        result = FAIL;
+    }
+    /* the representation changes */
+    calls = num_handle;
+    if ((coap_server_set_etag(&server, "/" ETAG_URI_PATH, "v2", 2) != 0)
+     || (get_op(ETAG_URI_PATH, COAP_MSG_ETAG, "v1", NULL) != 205)
+     || (get_op(ETAG_URI_PATH, COAP_MSG_IF_MATCH, "v1", NULL) != 412)
+     || (get_op(ETAG_URI_PATH, COAP_MSG_ETAG, "v2", NULL) != 203)
+     || (num_handle != calls + 1))
+    {
+        result = FAIL;
+    }
+    /* the entity-tag is withdrawn */
+    calls = num_handle;
+    if ((coap_server_set_etag(&server, "/" ETAG_URI_PATH, NULL, 0) != 0)
+     || (get_op(ETAG_URI_PATH, COAP_MSG_ETAG, "v2", NULL) != 205)
+     || (get_op(ETAG_URI_PATH, COAP_MSG_IF_NONE_MATCH, "", NULL) != 205)
+     || (num_handle != calls + 2))
+    {
+        result = FAIL;
+    }
+    if ((coap_server_set_etag(&server, "/" ETAG_URI_PATH, NULL, 2) != -EINVAL)
+     || (coap_server_set_etag(&server, "/" ETAG_URI_PATH, "v3", COAP_SERVER_ETAG_MAX_LEN + 1) != -EINVAL))
+    {
+        result = FAIL;
+    }
+    teardown();
+    return result;
+}
+
+/**
+ *  @brief Test conditional requests for variants of a resource and for response templates
+ *
+ *  @param[in] data Pointer to a test data structure
+ *
+ *  @returns Test result
+ */
+static test_result_t test_variant_func(test_data_t data)
+{
+    test_coap_server_unit_data_t *test_data = (test_coap_server_unit_data_t *)data;
+    test_result_t result = PASS;
+    unsigned calls = 0;
+    char accept[1] = {0};
+
+    printf("%s\n", test_data->desc);
+
+    if (setup() != PASS)
+    {
+        return FAIL;
+    }
+    coap_server_set_cond_resp(&server, 1);
+    if (coap_server_set_etag(&server, "/" ETAG_URI_PATH, "v1", 2) != 0)
+    {
+        result = FAIL;
+    }
+    /* a query or an Accept option may select another representation */
+    calls = num_handle;
+    if ((get_op(ETAG_URI_PATH, COAP_MSG_ETAG, "v1", "q=1") != 205)
+     || (get_op(ETAG_URI_PATH, COAP_MSG_ACCEPT, accept, NULL) != 205)
+     || (get_op(ETAG_URI_PATH, COAP_MSG_IF_NONE_MATCH, "", "q=1") != 205)
+     || (num_handle != calls + 3))
+    {
+        result = FAIL;
+    }
+    /* the entity-tag of a response template is taken for the URI path */
+    calls = num_handle;
+    if ((get_op(TMPL_URI_PATH, COAP_MSG_ETAG, TMPL_ETAG, NULL) != 205)
+     || (get_op(TMPL_URI_PATH, COAP_MSG_ETAG, TMPL_ETAG, NULL) != 203)
+     || (num_handle != calls + 1))
+    {
+        result = FAIL;
+    }
+    /* but not when the template answers a variant */
+    if ((coap_server_set_etag(&server, "/" TMPL_URI_PATH, "v1", 2) != 0)
+     || (get_op(TMPL_URI_PATH, 0, NULL, "q=1") != 205)
+     || (get_op(TMPL_URI_PATH, COAP_MSG_ETAG, TMPL_ETAG, NULL) != 205)
+     || (get_op(TMPL_URI_PATH, COAP_MSG_ETAG, TMPL_ETAG, NULL) != 203))
+    {
+        result = FAIL;
+    }
+    teardown();
+    return result;
+}
+
+/**
+ *  @brief Test that resources holding an entity-tag are kept
+ *
+ *  @param[in] data Pointer to a test data structure
+ *
+ *  @returns Test result
+ */
+static test_result_t test_pin_func(test_data_t data)
+{
+    test_coap_server_unit_data_t *test_data = (test_coap_server_unit_data_t *)data;
+    test_result_t result = PASS;
+    unsigned i = 0;
+    char path[16] = {0};
+
+    printf("%s\n", test_data->desc);
+
+    if (setup() != PASS)
+    {
+        return FAIL;
+    }
+    coap_server_set_cond_resp(&server, 1);
+    if (coap_server_set_etag(&server, "/" ETAG_URI_PATH, "v1", 2) != 0)
+    {
+        result = FAIL;
+    }
+    /* fill the other resource structures with URI paths in regular use */
+    for (i = 0; i < 2 * COAP_SERVER_NUM_RES; i++)
+    {
+        snprintf(path, sizeof(path), "p%u", i);
+        if ((get(COAP_MSG_CON, path) != 205) || (get(COAP_MSG_CON, path) != 205))
+        {
+            result = FAIL;
+        }
+    }
+    if ((find_res("/" ETAG_URI_PATH) == NULL)
+     || (get_op(ETAG_URI_PATH, COAP_MSG_ETAG, "v1", NULL) != 203))
+    {
+        result = FAIL;
+    }
+    /* entity-tags replace resources that have none */
+    for (i = 1; i < COAP_SERVER_NUM_RES; i++)
+    {
+        snprintf(path, sizeof(path), "/d%u", i);
+        if (coap_server_set_etag(&server, path, "v1", 2) != 0)
+        {
+            result = FAIL;
+        }
+    }
+    if ((coap_server_set_etag(&server, "/full", "v1", 2) != -ENOSPC)
+     || (coap_server_set_etag(&server, "/full", NULL, 0) != 0)
+     || (get(COAP_MSG_CON, "new") != 205)
+     || (find_res("/new") != NULL)
+     || (find_res("/" ETAG_URI_PATH) == NULL)
+     || (find_res("/d1") == NULL))
+    {
+        result = FAIL;
+    }
+    teardown();
+    return result;
+}
+
+/**
+ *  @brief Test the response to a duplicate confirmable request answered with a piggy-backed response
+ *
+ *  @param[in] data Pointer to a test data structure
+ *
+ *  @returns Test result
+ */
+static test_result_t test_dup_con_func(test_data_t data)
+{
+    test_coap_server_unit_data_t *test_data = (test_coap_server_unit_data_t *)data;
+    test_result_t result = PASS;
+    ssize_t num1 = 0;
+    ssize_t num2 = 0;
+    unsigned calls = 0;
+    char resp1[COAP_MSG_MAX_BUF_LEN] = {0};
+    char resp2[COAP_MSG_MAX_BUF_LEN] = {0};
+    char req[COAP_MSG_MAX_BUF_LEN] = {0};
+    size_t len = 0;
+
+    printf("%s\n", test_data->desc);
+
+    if (setup() != PASS)
+    {
+        return FAIL;
+    }
+    len = encode_req(req, COAP_MSG_CON, msg_id++, URI_PATH);
+    num1 = send_recv(req, len, resp1, sizeof(resp1));
+    calls = num_handle;
+    if ((num1 <= 0)
+     || (resp1[0] != (char)((COAP_MSG_VER << 6) | (COAP_MSG_ACK << 4) | 2))
+     || (parse_code(resp1, num1) != 205))
+    {
+        result = FAIL;
+    }
+    /* the piggy-backed response was lost and the client retransmits */
+    num2 = send_recv(req, len, resp2, sizeof(resp2));
+    if ((num2 != num1)
+     || (memcmp(resp1, resp2, num1) != 0)
+     || (num_handle != calls))
+    {
+        result = FAIL;
+    }
+    teardown();
+    return result;
+}
+
+/**
+ *  @brief Test the response to a duplicate confirmable request answered with a separate response
+ *
+ *  @param[in] data Pointer to a test data structure
+ *
+ *  @returns Test result
+ */
+static test_result_t test_dup_sep_func(test_data_t data)
+{
+    test_coap_server_unit_data_t *test_data = (test_coap_server_unit_data_t *)data;
+    test_result_t result = PASS;
+    ssize_t num = 0;
+    unsigned calls = 0;
+    char resp[COAP_MSG_MAX_BUF_LEN] = {0};
+    char req[COAP_MSG_MAX_BUF_LEN] = {0};
+    size_t len = 0;
+
+    printf("%s\n", test_data->desc);
+
+    if (setup() != PASS)
+    {
+        return FAIL;
+    }
+    if (coap_server_add_sep_resp_uri_path(&server, "/" SEP_URI_PATH) != 0)
+    {
+        teardown();
+        return FAIL;
+    }
+    len = encode_req(req, COAP_MSG_CON, msg_id++, SEP_URI_PATH);
+    num = send_recv(req, len, resp, sizeof(resp));
+    if ((num != 4) || (parse_code(resp, num) != 0))
+    {
+        result = FAIL;
+    }
+    num = recv(client_sd, resp, sizeof(resp), 0);
+    if ((num <= 0)
+     || ((((unsigned char)resp[0] >> 4) & 0x03) != COAP_MSG_CON)
+     || (parse_code(resp, num) != 205))
+    {
+        result = FAIL;
+    }
+    /* the acknowledgement was lost and the client retransmits */
+    calls = num_handle;
+    num = send_recv(req, len, resp, sizeof(resp));
+    if ((num != 4)
+     || (resp[0] != (char)((COAP_MSG_VER << 6) | (COAP_MSG_ACK << 4)))
+     || (memcmp(&resp[2], &req[2], 2) != 0)
+     || (num_handle != calls))
+    {
+        result = FAIL;
+    }
+    teardown();
+    return result;
+}
+
+/**
+ *  @brief Test a duplicate non-confirmable request
+ *
+ *  @param[in] data Pointer to a test data structure
+ *
+ *  @returns Test result
+ */
+static test_result_t test_dup_non_func(test_data_t data)
+{
+    test_coap_server_unit_data_t *test_data = (test_coap_server_unit_data_t *)data;
+    test_result_t result = PASS;
+    ssize_t num = 0;
+    unsigned calls = 0;
+    char resp[COAP_MSG_MAX_BUF_LEN] = {0};
+    char req[COAP_MSG_MAX_BUF_LEN] = {0};
+    size_t len = 0;
+
+    printf("%s\n", test_data->desc);
+
+    if (setup() != PASS)
+    {
+        return FAIL;
+    }
+    len = encode_req(req, COAP_MSG_NON, msg_id++, URI_PATH);
+    num = send_recv(req, len, resp, sizeof(resp));
+    if ((num <= 0) || (parse_code(resp, num) != 205))
+    {
+        result = FAIL;
+    }
+    calls = num_handle;
+    num = send_recv(req, len, resp, sizeof(resp));
+    if ((num != 0) || (num_handle != calls))
+    {
+        result = FAIL;
+    }
+    teardown();
+    return result;
+}
+
+/**
+ *  @brief Test acknowledgement and reset messages that match no response
+ *
+ *  @param[in] data Pointer to a test data structure
+ *
+ *  @returns Test result
+ */
+static test_result_t test_stray_func(test_data_t data)
+{
+    test_coap_server_unit_data_t *test_data = (test_coap_server_unit_data_t *)data;
+    test_result_t result = PASS;
+    ssize_t num1 = 0;
+    ssize_t num2 = 0;
+    char resp1[COAP_MSG_MAX_BUF_LEN] = {0};
+    char resp2[COAP_MSG_MAX_BUF_LEN] = {0};
+    char req[COAP_MSG_MAX_BUF_LEN] = {0};
+    char stray[4] = {0};
+    size_t len = 0;
+    unsigned i = 0;
+    int ret = 0;
+
+    printf("%s\n", test_data->desc);
+
+    if (setup() != PASS)
+    {
+        return FAIL;
+    }
+    len = encode_req(req, COAP_MSG_CON, msg_id++, URI_PATH);
+    num1 = send_recv(req, len, resp1, sizeof(resp1));
+    if ((num1 <= 0) || (parse_code(resp1, num1) != 205))
+    {
+        result = FAIL;
+    }
+    /* an acknowledgement delayed past the next request and a reset */
+    for (i = 0; i < 2; i++)
+    {
+        stray[0] = (char)((COAP_MSG_VER << 6) | ((i == 0 ? COAP_MSG_ACK : COAP_MSG_RST) << 4));
+        stray[2] = (char)(msg_id >> 8);
+        stray[3] = (char)(msg_id + 0x80);
+        sendto(client_sd, stray, sizeof(stray), 0, (struct sockaddr *)&server_sin, sizeof(server_sin));
+        ret = coap_server_exchange(&server);
+        if ((ret != 0) || (recv(client_sd, resp2, sizeof(resp2), MSG_DONTWAIT) >= 0))
+        {
+            result = FAIL;
+        }
+    }
+    /* the transaction is kept */
+    num2 = send_recv(req, len, resp2, sizeof(resp2));
+    if ((num2 != num1) || (memcmp(resp1, resp2, num1) != 0))
+    {
+        result = FAIL;
+    }
+    teardown();
+    return result;
+}
+
+/**
+ *  @brief Main function for the FreeCoAP server library unit tests
+ *
+ *  @returns Operation status
+ *  @retval EXIT_SUCCESS Success
+ *  @retval EXIT_FAILURE Error
+ */
+int main(void)
+{
+    test_t tests[] = {{test_unavail_func, &test1_data},
+                      {test_unavail_func, &test2_data},
+                      {test_unavail_func, &test3_data},
+                      {test_refill_func,  &test4_data},
+                      {test_evict_func,   &test5_data},
+                      {test_cost_func,    &test6_data},
+                      {test_budget_func,  &test7_data},
+                      {test_latency_func, &test8_data},
+                      {test_sep_func,     &test9_data},
+                      {test_flush_func,   &test10_data},
+                      {test_tmpl_dup_func, &test11_data},
+                      {test_cond_func,    &test12_data},
+                      {test_stale_func,   &test13_data},
+                      {test_variant_func, &test14_data},
+                      {test_pin_func,     &test15_data},
+                      {test_dup_con_func, &test16_data},
+                      {test_dup_sep_func, &test17_data},
+                      {test_dup_non_func, &test18_data},
+                      {test_stray_func,   &test19_data}};
+    unsigned num_tests = DIM(tests);
+    unsigned num_pass = 0;
+
+    coap_log_set_level(COAP_LOG_ERROR);
+
+    num_pass = test_run(tests, num_tests);
+
+    return num_pass == num_tests ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,366 @@
+/*
+ * Copyright (c) 2015 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/**
+ *  @file test_coap_server_trans.c
+ *
+ *  @brief Source file for the FreeCoAP server transaction search tests
+ *
+ *  Includes the server source file so that the static search
+ *  functions can be called on a server structure holding
+ *  the largest number of transactions allowed. Each search is timed against a
+ *  search that reads the transaction structures themselves,
+ *  which is how the transactions were searched before the
+ *  slot structures were split out.
+ */
+
+#include "coap_server.c"
+#include "test.h"
+
+#define DIM(x) (sizeof(x) / sizeof(x[0]))                                       /**< Calculate the size of an array */
+
+#define NUM_LOOKUPS       20000                                                 /**< Number of searches timed in each test with a warm cache */
+#define NUM_COLD_LOOKUPS  100                                                   /**< Number of searches timed in each test with a cold cache */
+#define NUM_TRIALS        3                                                     /**< Number of trials per test, the fastest is kept */
+#define EVICT_LEN         (16 * 1024 * 1024)                                    /**< Length of the buffer written to evict the server structure from the cache */
+
+/**
+ *  @brief Test data structure
+ */
+typedef struct
+{
+    const char *desc;                                                           /**< Test description */
+    int miss;                                                                   /**< Search for clients that do not have a transaction */
+    int cold;                                                                   /**< Evict the server structure from the cache before each search */
+}
+test_coap_server_trans_data_t;
+
+test_coap_server_trans_data_t test1_data =
+{
+    .desc = "test 1: search for clients that have a transaction",
+    .miss = 0,
+    .cold = 0
+};
+
+test_coap_server_trans_data_t test2_data =
+{
+    .desc = "test 2: search for clients that do not have a transaction",
+    .miss = 1,
+    .cold = 0
+};
+
+test_coap_server_trans_data_t test3_data =
+{
+    .desc = "test 3: search for clients that have a transaction with a cold cache",
+    .miss = 0,
+    .cold = 1
+};
+
+test_coap_server_trans_data_t test4_data =
+{
+    .desc = "test 4: search for clients that do not have a transaction with a cold cache",
+    .miss = 1,
+    .cold = 1
+};
+
+static coap_server_t *server = NULL;                                            /**< Server structure holding COAP_SERVER_NUM_TRANS transactions */
+static coap_ipv_sockaddr_in_t *client_sin = NULL;                               /**< Array of client socket structures to search for */
+static char *evict_buf = NULL;                                                  /**< Buffer written to evict the server structure from the cache */
+
+/**
+ *  @brief Get the current time
+ *
+ *  @returns Monotonic time in nsec
+ */
+static uint64_t now_ns(void)
+{
+    struct timespec ts = {0};
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ *  @brief Fill a client socket structure
+ *
+ *  @param[out] sin Pointer to a socket structure
+ *  @param[in] i Client number
+ */
+static void set_client(coap_ipv_sockaddr_in_t *sin, unsigned i)
+{
+    memset(sin, 0, sizeof(coap_ipv_sockaddr_in_t));
+#ifdef COAP_IP6
+    sin->sin6_family = AF_INET6;
+    sin->sin6_addr.s6_addr[0] = 0xfd;
+    sin->sin6_addr.s6_addr[14] = (i >> 16) & 0xff;
+    sin->sin6_addr.s6_addr[15] = (i >> 8) & 0xff;
+#else
+    sin->sin_family = AF_INET;
+    sin->sin_addr.s_addr = htonl(0x0a000000 | (i >> 8));
+#endif
+    sin->COAP_IPV_SIN_PORT = htons(5683 + (i & 0xff));
+}
+
+/**
+ *  @brief Fill every transaction in the server structure
+ *
+ *  The transactions are filled directly rather than created
+ *  so that no sockets or timers are needed.
+ */
+static void fill_server(void)
+{
+    coap_server_trans_t *trans = NULL;
+    unsigned i = 0;
+
+    for (i = 0; i < COAP_SERVER_NUM_TRANS; i++)
+    {
+        trans = &server->trans[i];
+        trans->server = server;
+        set_client(&trans->client_sin, i);
+        trans->client_sin_len = sizeof(coap_ipv_sockaddr_in_t);
+        server->slot[i].key = coap_server_key(&trans->client_sin, trans->client_sin_len);
+        server->slot[i].last_use = COAP_SERVER_NUM_TRANS + i;
+    }
+}
+
+/**
+ *  @brief Search the transaction structures without the slot structures
+ *
+ *  @param[in] sin Pointer to a socket structure
+ *  @param[in] sin_len Length of the socket structure
+ *
+ *  @returns Pointer to a transaction structure
+ *  @retval NULL No matching transaction structure found
+ */
+static coap_server_trans_t *find_trans_unsplit(coap_ipv_sockaddr_in_t *sin, socklen_t sin_len)
+{
+    coap_server_trans_t *trans = NULL;
+    unsigned i = 0;
+
+    for (i = 0; i < COAP_SERVER_NUM_TRANS; i++)
+    {
+        trans = &server->trans[i];
+        if ((trans->client_sin_len == sin_len)
+         && (memcmp(&trans->client_sin, sin, sin_len) == 0))
+        {
+            return trans;
+        }
+    }
+    return NULL;
+}
+
+/**
+ *  @brief Time a search function
+ *
+ *  @param[in] unsplit Search the transaction structures without the slot structures
+ *  @param[in] miss Search for clients that do not have a transaction
+ *  @param[in] cold Evict the server structure from the cache before each search
+ *  @param[out] ns Average time (nsec) per search
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 A search returned the wrong transaction
+ */
+static int time_find(int unsplit, int miss, int cold, double *ns)
+{
+    coap_server_trans_t *trans = NULL;
+    coap_ipv_sockaddr_in_t *sin = NULL;
+    socklen_t sin_len = sizeof(coap_ipv_sockaddr_in_t);
+    uint64_t total = 0;
+    uint64_t start = 0;
+    unsigned num = cold ? NUM_COLD_LOOKUPS : NUM_LOOKUPS;
+    unsigned index = 0;
+    unsigned i = 0;
+
+    start = now_ns();
+    for (i = 0; i < num; i++)
+    {
+        index = (i * 2654435761u) % COAP_SERVER_NUM_TRANS;
+        sin = &client_sin[miss ? COAP_SERVER_NUM_TRANS + index : index];
+        if (cold)
+        {
+            memset(evict_buf, i, EVICT_LEN);
+            start = now_ns();
+        }
+        if (unsplit)
+        {
+            trans = find_trans_unsplit(sin, sin_len);
+        }
+        else
+        {
+            trans = coap_server_find_trans(server, sin, sin_len);
+        }
+        if (cold)
+        {
+            total += now_ns() - start;
+        }
+        if (trans != (miss ? NULL : &server->trans[index]))
+        {
+            return -1;
+        }
+    }
+    if (!cold)
+    {
+        total = now_ns() - start;
+    }
+    *ns = (double)total / num;
+    return 0;
+}
+
+/**
+ *  @brief Compare the time taken to search the slot structures with the time taken to search the transaction structures
+ *
+ *  @param[in] data Pointer to a test data structure
+ *
+ *  @returns Test result
+ */
+test_result_t test_find_func(test_data_t data)
+{
+    test_coap_server_trans_data_t *test_data = (test_coap_server_trans_data_t *)data;
+    test_result_t result = PASS;
+    unsigned i = 0;
+    double split_ns = 0.0;
+    double unsplit_ns = 0.0;
+    double ns = 0.0;
+    int ret = 0;
+
+    printf("%s\n", test_data->desc);
+
+    for (i = 0; i < NUM_TRIALS; i++)
+    {
+        ret = time_find(0, test_data->miss, test_data->cold, &ns);
+        if (ret < 0)
+        {
+            printf("    wrong transaction found\n");
+            return FAIL;
+        }
+        if ((i == 0) || (ns < split_ns))
+        {
+            split_ns = ns;
+        }
+        ret = time_find(1, test_data->miss, test_data->cold, &ns);
+        if (ret < 0)
+        {
+            printf("    wrong transaction found\n");
+            return FAIL;
+        }
+        if ((i == 0) || (ns < unsplit_ns))
+        {
+            unsplit_ns = ns;
+        }
+    }
+    printf("    %u transactions, slot %zu bytes, transaction %zu bytes\n",
+           COAP_SERVER_NUM_TRANS, sizeof(coap_server_slot_t), sizeof(coap_server_trans_t));
+    printf("    search slots:        %10.0f nsec\n", split_ns);
+    printf("    search transactions: %10.0f nsec\n", unsplit_ns);
+    if (split_ns >= unsplit_ns)
+    {
+        result = FAIL;
+    }
+    return result;
+}
+
+/**
+ *  @brief Check the searches for empty and oldest transactions
+ *
+ *  @param[in] data Unused
+ *
+ *  @returns Test result
+ */
+test_result_t test_find_empty_oldest_func(test_data_t data)
+{
+    test_result_t result = PASS;
+    coap_server_trans_t *trans = NULL;
+    unsigned oldest = COAP_SERVER_NUM_TRANS / 3;
+    unsigned empty = COAP_SERVER_NUM_TRANS / 2;
+    uint64_t start = 0;
+    uint64_t end = 0;
+    uint32_t key = 0;
+
+    printf("test 5: search for empty and oldest transactions\n");
+
+    server->slot[oldest].last_use = 1;
+    if (coap_server_find_empty_trans(server) != NULL)
+    {
+        result = FAIL;
+    }
+    start = now_ns();
+    trans = coap_server_find_oldest_trans(server);
+    end = now_ns();
+    if (trans != &server->trans[oldest])
+    {
+        result = FAIL;
+    }
+    printf("    search for oldest:   %10.0f nsec\n", (double)(end - start));
+    key = server->slot[empty].key;
+    server->slot[empty].key = 0;
+    if (coap_server_find_empty_trans(server) != &server->trans[empty])
+    {
+        result = FAIL;
+    }
+    if (coap_server_find_trans(server, &client_sin[empty], sizeof(coap_ipv_sockaddr_in_t)) != NULL)
+    {
+        result = FAIL;
+    }
+    server->slot[empty].key = key;
+    server->slot[oldest].last_use = COAP_SERVER_NUM_TRANS + oldest;
+    return result;
+}
+
+int main(void)
+{
+    test_t tests[] = {{test_find_func,              &test1_data},
+                      {test_find_func,              &test2_data},
+                      {test_find_func,              &test3_data},
+                      {test_find_func,              &test4_data},
+                      {test_find_empty_oldest_func, NULL}};
+    unsigned num_tests = DIM(tests);
+    unsigned num_pass = 0;
+    unsigned i = 0;
+
+    server = calloc(1, sizeof(coap_server_t));
+    client_sin = calloc(2 * COAP_SERVER_NUM_TRANS, sizeof(coap_ipv_sockaddr_in_t));
+    evict_buf = malloc(EVICT_LEN);
+    if ((server == NULL) || (client_sin == NULL) || (evict_buf == NULL))
+    {
+        fprintf(stderr, "Error: %s\n", strerror(ENOMEM));
+        return EXIT_FAILURE;
+    }
+    for (i = 0; i < 2 * COAP_SERVER_NUM_TRANS; i++)
+    {
+        set_client(&client_sin[i], i);
+    }
+    fill_server();
+
+    num_pass = test_run(tests, num_tests);
+
+    free(evict_buf);
+    free(client_sin);
+    free(server);
+    return num_pass == num_tests ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,483 @@
+/*
+ * Copyright (c) 2015 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ *  @file test_coap_shared.c
+ *
+ *  @brief Source file for the FreeCoAP shared client test application
+ *
+ *  Runs a number of application threads that all submit
+ *  exchanges to two servers through one shared client and
+ *  checks that every thread receives its own responses.
+ *  Then checks that a separate response whose message ID
+ *  equals the message ID of another exchange in flight is
+ *  matched by its token.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include "coap_server.h"
+#include "coap_shared.h"
+#include "coap_log.h"
+
+#ifdef COAP_IP6
+#define SERVER_HOST             "::"                                            /**< Host address to listen on */
+#define CLIENT_HOST             "::1"                                           /**< Host address of the servers */
+#else
+#define SERVER_HOST             "0.0.0.0"                                       /**< Host address to listen on */
+#define CLIENT_HOST             "127.0.0.1"                                     /**< Host address of the servers */
+#endif
+#define NUM_SERVERS             2                                               /**< Number of servers */
+#define NUM_THREADS             8                                               /**< Number of application threads */
+#define NUM_EXCHANGES           500                                             /**< Number of exchanges per application thread */
+#define NUM_BATCH               4                                               /**< Number of exchanges each thread keeps in flight at once */
+
+#define SCRIPT_PORT             "12462"                                         /**< UDP port number of the scripted server */
+#define SCRIPT_TIMEOUT_SEC      5                                               /**< Time to wait for a message from the shared client */
+#define SCRIPT_ACK_TIMEOUT_SEC  2                                               /**< Acknowledgement and response timeout of the shared client when talking to the scripted server */
+
+static const char *server_port[NUM_SERVERS] = {"12460", "12461"};               /**< UDP port numbers of the servers */
+static coap_shared_t shared = {0};                                              /**< Shared client used by all application threads */
+
+/**
+ *  @brief Application thread structure
+ */
+typedef struct
+{
+    pthread_t thread;                                                           /**< Thread */
+    unsigned index;                                                             /**< Thread index */
+    unsigned num_ok;                                                            /**< Number of exchanges that returned the expected payload */
+    int ret;                                                                    /**< Status of the first failed exchange */
+}
+app_thread_t;
+
+/**
+ *  @brief Server call-back function to handle requests
+ *
+ *  Echo the request payload in a piggy-backed response.
+ *
+ *  @param[in,out] server Pointer to a server structure
+ *  @param[in] req Pointer to the request message
+ *  @param[out] resp Pointer to the response message
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+static int server_handle(coap_server_t *server, coap_msg_t *req, coap_msg_t *resp)
+{
+    int ret = 0;
+
+    ret = coap_msg_set_code(resp, COAP_MSG_SUCCESS, COAP_MSG_CONTENT);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    return coap_msg_set_payload(resp, coap_msg_get_payload(req), coap_msg_get_payload_len(req));
+}
+
+/**
+ *  @brief Server thread function
+ *
+ *  @param[in] data Pointer to a server structure
+ *
+ *  @returns NULL
+ */
+static void *server_thread_func(void *data)
+{
+    coap_server_run((coap_server_t *)data);
+    return NULL;
+}
+
+/**
+ *  @brief Application thread function
+ *
+ *  Submit batches of exchanges to alternating servers and
+ *  check that each response carries the payload of its own
+ *  request.
+ *
+ *  @param[in,out] data Pointer to an application thread structure
+ *
+ *  @returns NULL
+ */
+static void *app_thread_func(void *data)
+{
+    app_thread_t *app = (app_thread_t *)data;
+    coap_shared_req_t sreq[NUM_BATCH];
+    coap_msg_t resp[NUM_BATCH];
+    coap_msg_t req = {0};
+    char payload[NUM_BATCH][32];
+    unsigned i = 0;
+    unsigned j = 0;
+    int ret = 0;
+
+    for (i = 0; i < NUM_EXCHANGES; i += NUM_BATCH)
+    {
+        for (j = 0; j < NUM_BATCH; j++)
+        {
+            coap_msg_create(&req);
+            coap_msg_create(&resp[j]);
+            coap_msg_set_type(&req, (j % 2) ? COAP_MSG_NON : COAP_MSG_CON);
+            coap_msg_set_code(&req, COAP_MSG_REQ, COAP_MSG_POST);
+            snprintf(payload[j], sizeof(payload[j]), "thread %u exchange %u", app->index, i + j);
+            coap_msg_set_payload(&req, payload[j], strlen(payload[j]));
+            ret = coap_shared_submit(&shared, &sreq[j], CLIENT_HOST, server_port[(i + j) % NUM_SERVERS], &req, &resp[j]);
+            coap_msg_destroy(&req);
+            if ((ret < 0) && (app->ret == 0))
+            {
+                app->ret = ret;
+            }
+        }
+        for (j = 0; j < NUM_BATCH; j++)
+        {
+            ret = coap_shared_wait(&sreq[j]);
+            if ((ret == 0)
+             && (coap_msg_get_code_class(&resp[j]) == COAP_MSG_SUCCESS)
+             && (coap_msg_get_payload_len(&resp[j]) == strlen(payload[j]))
+             && (memcmp(coap_msg_get_payload(&resp[j]), payload[j], strlen(payload[j])) == 0))
+            {
+                app->num_ok++;
+            }
+            else if (app->ret == 0)
+            {
+                app->ret = ret < 0 ? ret : -EBADMSG;
+            }
+            coap_msg_destroy(&resp[j]);
+        }
+    }
+    return NULL;
+}
+
+/**
+ *  @brief Receive a message from the shared client on the scripted server socket
+ *
+ *  @param[in] sd Socket descriptor
+ *  @param[out] msg Pointer to a message structure
+ *  @param[out] sin Pointer to the socket structure of the sender
+ *  @param[out] sin_len Length of the socket structure
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+static int script_recv(int sd, coap_msg_t *msg, coap_ipv_sockaddr_in_t *sin, socklen_t *sin_len)
+{
+    ssize_t num = 0;
+    char buf[COAP_MSG_MAX_BUF_LEN] = {0};
+
+    *sin_len = sizeof(coap_ipv_sockaddr_in_t);
+    num = recvfrom(sd, buf, sizeof(buf), 0, (struct sockaddr *)sin, sin_len);
+    if (num < 0)
+    {
+        return -errno;
+    }
+    coap_msg_reset(msg);
+    num = coap_msg_parse(msg, buf, num);
+    if (num < 0)
+    {
+        return num;
+    }
+    return 0;
+}
+
+/**
+ *  @brief Send a message to the shared client from the scripted server socket
+ *
+ *  @param[in] sd Socket descriptor
+ *  @param[in] type Message type
+ *  @param[in] code_class Code class
+ *  @param[in] code_detail Code detail
+ *  @param[in] msg_id Message ID
+ *  @param[in] token Pointer to the token or NULL for an empty message
+ *  @param[in] token_len Length of the token
+ *  @param[in] sin Pointer to the socket structure of the shared client
+ *  @param[in] sin_len Length of the socket structure
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+static int script_send(int sd, unsigned type, unsigned code_class, unsigned code_detail, unsigned msg_id,
+                       const char *token, size_t token_len, coap_ipv_sockaddr_in_t *sin, socklen_t sin_len)
+{
+    coap_msg_t msg = {0};
+    ssize_t num = 0;
+    char buf[COAP_MSG_MAX_BUF_LEN] = {0};
+
+    coap_msg_create(&msg);
+    coap_msg_set_type(&msg, type);
+    coap_msg_set_code(&msg, code_class, code_detail);
+    coap_msg_set_msg_id(&msg, msg_id);
+    if (token != NULL)
+    {
+        coap_msg_set_token(&msg, (char *)token, token_len);
+    }
+    num = coap_msg_format(&msg, buf, sizeof(buf));
+    coap_msg_destroy(&msg);
+    if (num < 0)
+    {
+        return num;
+    }
+    num = sendto(sd, buf, num, 0, (struct sockaddr *)sin, sin_len);
+    if (num < 0)
+    {
+        return -errno;
+    }
+    return 0;
+}
+
+/**
+ *  @brief Check that a separate response is matched by its token
+ *
+ *  Two confirmable requests are sent to a scripted server.
+ *  The first is acknowledged and then answered with a
+ *  separate response that carries the message ID of the
+ *  second request, as a server may choose any message ID.
+ *  The first exchange must complete with the separate
+ *  response and the second must remain in flight until it
+ *  is answered.
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+static int test_msg_id_collision(void)
+{
+    coap_ipv_sockaddr_in_t client_sin = {0};
+    struct addrinfo hints = {0};
+    struct addrinfo *list = NULL;
+    struct timeval tv = {0};
+    coap_shared_req_t sreq[2];
+    coap_msg_t resp[2];
+    coap_msg_t req = {0};
+    coap_msg_t msg = {0};
+    socklen_t client_sin_len = 0;
+    unsigned msg_id[2] = {0};
+    size_t token_len[2] = {0};
+    char token[2][COAP_MSG_MAX_TOKEN_LEN] = {{0}};
+    int num_sent = 0;
+    int sd = -1;
+    int ret = 0;
+    int i = 0;
+
+    hints.ai_family = COAP_IPV_AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_NUMERICHOST;
+    ret = getaddrinfo(CLIENT_HOST, SCRIPT_PORT, &hints, &list);
+    if (ret != 0)
+    {
+        return -1;
+    }
+    sd = socket(COAP_IPV_AF_INET, SOCK_DGRAM, 0);
+    if (sd < 0)
+    {
+        freeaddrinfo(list);
+        return -errno;
+    }
+    ret = bind(sd, list->ai_addr, list->ai_addrlen);
+    freeaddrinfo(list);
+    if (ret < 0)
+    {
+        close(sd);
+        return -errno;
+    }
+    tv.tv_sec = SCRIPT_TIMEOUT_SEC;
+    setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    /* short enough to end the test soon if a message is lost */
+    coap_shared_set_timeouts(&shared, SCRIPT_ACK_TIMEOUT_SEC, 0, SCRIPT_ACK_TIMEOUT_SEC);
+
+    coap_msg_create(&msg);
+    for (i = 0; i < 2; i++)
+    {
+        coap_msg_create(&req);
+        coap_msg_create(&resp[i]);
+        coap_msg_set_type(&req, COAP_MSG_CON);
+        coap_msg_set_code(&req, COAP_MSG_REQ, COAP_MSG_GET);
+        ret = coap_shared_submit(&shared, &sreq[i], CLIENT_HOST, SCRIPT_PORT, &req, &resp[i]);
+        coap_msg_destroy(&req);
+        if (ret < 0)
+        {
+            goto out;
+        }
+        num_sent++;
+    }
+    for (i = 0; i < 2; i++)
+    {
+        ret = script_recv(sd, &msg, &client_sin, &client_sin_len);
+        if (ret < 0)
+        {
+            goto out;
+        }
+        msg_id[i] = coap_msg_get_msg_id(&msg);
+        token_len[i] = coap_msg_get_token_len(&msg);
+        memcpy(token[i], coap_msg_get_token(&msg), token_len[i]);
+    }
+
+    /* acknowledge the first request and answer it with the message ID of the second */
+    ret = script_send(sd, COAP_MSG_ACK, 0, 0, msg_id[0], NULL, 0, &client_sin, client_sin_len);
+    if (ret == 0)
+    {
+        ret = script_send(sd, COAP_MSG_CON, COAP_MSG_SUCCESS, COAP_MSG_CONTENT, msg_id[1],
+                          token[0], token_len[0], &client_sin, client_sin_len);
+    }
+    if (ret == 0)
+    {
+        ret = script_recv(sd, &msg, &client_sin, &client_sin_len);
+    }
+    if (ret < 0)
+    {
+        goto out;
+    }
+    if ((coap_msg_get_type(&msg) != COAP_MSG_ACK) || (coap_msg_get_msg_id(&msg) != msg_id[1]))
+    {
+        ret = -EBADMSG;
+        goto out;
+    }
+    ret = coap_shared_wait(&sreq[0]);
+    if (ret < 0)
+    {
+        goto out;
+    }
+    if ((coap_msg_get_code_class(&resp[0]) != COAP_MSG_SUCCESS)
+     || (coap_shared_poll(&sreq[1]) != -EINPROGRESS))
+    {
+        ret = -EBADMSG;
+        goto out;
+    }
+
+    /* the second exchange is still in flight */
+    ret = script_send(sd, COAP_MSG_ACK, COAP_MSG_SUCCESS, COAP_MSG_CONTENT, msg_id[1],
+                      token[1], token_len[1], &client_sin, client_sin_len);
+    if (ret < 0)
+    {
+        goto out;
+    }
+    ret = coap_shared_wait(&sreq[1]);
+    num_sent = 0;
+    if ((ret == 0) && (coap_msg_get_code_class(&resp[1]) != COAP_MSG_SUCCESS))
+    {
+        ret = -EBADMSG;
+    }
+
+out:
+    /* wait for any exchange still in flight to time out */
+    for (i = 0; i < num_sent; i++)
+    {
+        coap_shared_wait(&sreq[i]);
+    }
+    for (i = 0; i < 2; i++)
+    {
+        coap_msg_destroy(&resp[i]);
+    }
+    coap_msg_destroy(&msg);
+    close(sd);
+    return ret;
+}
+
+/**
+ *  @brief Main function for the shared client test application
+ *
+ *  @returns Operation status
+ *  @retval EXIT_SUCCESS Success
+ *  @retval EXIT_FAILURE Error
+ */
+int main()
+{
+    coap_server_t server[NUM_SERVERS] = {{0}};
+    app_thread_t app[NUM_THREADS] = {{0}};
+    struct timespec start = {0};
+    struct timespec end = {0};
+    pthread_t thread = {0};
+    unsigned num_ok = 0;
+    double sec = 0.0;
+    int ret = 0;
+    int i = 0;
+
+    coap_log_set_level(COAP_LOG_ERROR);
+    for (i = 0; i < NUM_SERVERS; i++)
+    {
+        ret = coap_server_create(&server[i], server_handle, SERVER_HOST, server_port[i]);
+        if (ret < 0)
+        {
+            fprintf(stderr, "Failed to create server: %s\n", strerror(-ret));
+            return EXIT_FAILURE;
+        }
+        ret = pthread_create(&thread, NULL, server_thread_func, &server[i]);
+        if (ret != 0)
+        {
+            fprintf(stderr, "Failed to start server thread\n");
+            return EXIT_FAILURE;
+        }
+        pthread_detach(thread);
+    }
+    ret = coap_shared_create(&shared);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to create shared client: %s\n", strerror(-ret));
+        return EXIT_FAILURE;
+    }
+
+    /* the servers run until the process exits */
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < NUM_THREADS; i++)
+    {
+        app[i].index = i;
+        pthread_create(&app[i].thread, NULL, app_thread_func, &app[i]);
+    }
+    for (i = 0; i < NUM_THREADS; i++)
+    {
+        pthread_join(app[i].thread, NULL);
+        num_ok += app[i].num_ok;
+        if (app[i].ret < 0)
+        {
+            fprintf(stderr, "Thread %d: %s\n", i, strerror(-app[i].ret));
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    sec = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%d threads %u/%d exchanges %8.3f sec %10.1f exchanges/sec\n",
+           NUM_THREADS, num_ok, NUM_THREADS * NUM_EXCHANGES, sec, num_ok / sec);
+
+    ret = test_msg_id_collision();
+    printf("separate response with the message ID of another exchange: %s\n",
+           ret == 0 ? "pass" : strerror(-ret));
+    coap_shared_destroy(&shared);
+    if ((num_ok != NUM_THREADS * NUM_EXCHANGES) || (ret < 0))
+    {
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
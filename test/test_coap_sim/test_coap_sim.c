@@ -0,0 +1,393 @@
+/*
+ * Copyright (c) 2015 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/**
+ *  @file test_coap_sim.c
+ *
+ *  @brief Source file for the FreeCoAP fleet simulation benchmark
+ *
+ *  Runs a fleet of devices, each with its own client, against a
+ *  set of servers on a virtual clock and reports the completion
+ *  time of the exchanges. An hour of periodic traffic from
+ *  thousands of devices runs in seconds.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include "coap_server.h"
+#include "coap_client.h"
+#include "coap_log.h"
+#include "coap_sim.h"
+
+#ifdef COAP_IP6
+#define SERVER_HOST             "::"                                            /**< Host address to listen on */
+#define CLIENT_HOST             "::1"                                           /**< Host address of the servers */
+#else
+#define SERVER_HOST             "0.0.0.0"                                       /**< Host address to listen on */
+#define CLIENT_HOST             "127.0.0.1"                                     /**< Host address of the servers */
+#endif
+#define FIRST_SERVER_PORT       12470                                           /**< UDP port number of the first server */
+#define URI_PATH_OP             "resource"                                      /**< URI path option value of the requests */
+#define PAYLOAD_LEN             32                                              /**< Length of the response payload */
+#define DEF_NUM_DEVICES         1000                                            /**< Default number of devices */
+#define DEF_NUM_SERVERS         4                                               /**< Default number of servers */
+#define DEF_DURATION_SEC        3600                                            /**< Default virtual duration (sec) */
+#define DEF_PERIOD_SEC          60                                              /**< Default period between the requests of a device (sec) */
+#define ACK_TIMEOUT_SEC         2                                               /**< Client ACK_TIMEOUT (sec) */
+#define MAX_RETRANSMIT          4                                               /**< Client MAX_RETRANSMIT */
+#define RESP_TIMEOUT_SEC        30                                              /**< Client response timeout (sec) */
+#define HIST_LEN                100000                                          /**< Number of 1 msec bins in the completion time histogram */
+
+static char payload[PAYLOAD_LEN] = {0};                                         /**< Response payload */
+static unsigned num_devices = DEF_NUM_DEVICES;                                  /**< Number of devices */
+static unsigned num_servers = DEF_NUM_SERVERS;                                  /**< Number of servers */
+static unsigned duration_sec = DEF_DURATION_SEC;                                /**< Virtual duration (sec) */
+static unsigned period_sec = DEF_PERIOD_SEC;                                    /**< Period between the requests of a device (sec) */
+static unsigned num_done = 0;                                                   /**< Number of devices that have finished */
+static unsigned long num_ok = 0;                                                /**< Number of successful exchanges */
+static unsigned long num_failed = 0;                                            /**< Number of failed exchanges */
+static unsigned long hist[HIST_LEN] = {0};                                      /**< Completion time histogram */
+static uint64_t end_ns = 0;                                                     /**< Virtual time (nsec) at which the devices stop */
+
+/**
+ *  @brief Server call-back function to handle requests
+ *
+ *  @param[in,out] server Pointer to a server structure
+ *  @param[in] req Pointer to the request message
+ *  @param[out] resp Pointer to the response message
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+static int server_handle(coap_server_t *server, coap_msg_t *req, coap_msg_t *resp)
+{
+    int ret = 0;
+
+    ret = coap_msg_set_code(resp, COAP_MSG_SUCCESS, COAP_MSG_CONTENT);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    return coap_msg_set_payload(resp, payload, sizeof(payload));
+}
+
+/**
+ *  @brief Server thread function
+ *
+ *  @param[in] data Pointer to a server structure
+ *
+ *  @returns NULL
+ */
+static void *server_thread_func(void *data)
+{
+    int ret = 0;
+
+    ret = coap_server_run((coap_server_t *)data);
+    coap_log_error("Server stopped: %s", strerror(-ret));
+    return NULL;
+}
+
+/**
+ *  @brief Device thread function
+ *
+ *  Sends a confirmable request to one of the servers once per
+ *  period, starting at a random offset into the first period.
+ *
+ *  @param[in] data Index of the device
+ *
+ *  @returns NULL
+ */
+static void *device_thread_func(void *data)
+{
+    coap_client_t client = {0};
+    coap_msg_t req = {0};
+    coap_msg_t resp = {0};
+    unsigned index = (unsigned)(uintptr_t)data;
+    uint64_t start = 0;
+    uint64_t ms = 0;
+    char port_str[8] = {0};
+    int ret = 0;
+
+    snprintf(port_str, sizeof(port_str), "%u", FIRST_SERVER_PORT + index % num_servers);
+    ret = coap_client_create(&client, CLIENT_HOST, port_str);
+    if (ret < 0)
+    {
+        coap_log_error("Failed to create client: %s", strerror(-ret));
+        num_done++;
+        return NULL;
+    }
+    coap_client_set_timeouts(&client, ACK_TIMEOUT_SEC, MAX_RETRANSMIT, RESP_TIMEOUT_SEC);
+    coap_sim_sleep(coap_sim_rand() % (period_sec * 1000));
+    while (coap_sim_get_time() < end_ns)
+    {
+        coap_msg_create(&req);
+        coap_msg_create(&resp);
+        coap_msg_set_type(&req, COAP_MSG_CON);
+        coap_msg_set_code(&req, COAP_MSG_REQ, COAP_MSG_GET);
+        coap_msg_add_op(&req, COAP_MSG_URI_PATH, strlen(URI_PATH_OP), URI_PATH_OP);
+        start = coap_sim_get_time();
+        ret = coap_client_exchange(&client, &req, &resp);
+        ms = (coap_sim_get_time() - start) / 1000000;
+        if ((ret == 0)
+         && (coap_msg_get_code_class(&resp) == COAP_MSG_SUCCESS)
+         && (coap_msg_get_payload_len(&resp) == PAYLOAD_LEN))
+        {
+            hist[ms < HIST_LEN ? ms : HIST_LEN - 1]++;
+            num_ok++;
+        }
+        else
+        {
+            num_failed++;
+        }
+        coap_msg_destroy(&resp);
+        coap_msg_destroy(&req);
+        ms = ms < period_sec * 1000 ? period_sec * 1000 - ms : 0;
+        coap_sim_sleep(ms);
+    }
+    coap_client_destroy(&client);
+    num_done++;
+    return NULL;
+}
+
+/**
+ *  @brief Find a percentile in the completion time histogram
+ *
+ *  @param[in] pct Percentile
+ *
+ *  @returns Completion time (msec)
+ */
+static unsigned percentile(unsigned pct)
+{
+    unsigned long target = 0;
+    unsigned long sum = 0;
+    unsigned i = 0;
+
+    target = (num_ok * pct + 99) / 100;
+    for (i = 0; i < HIST_LEN; i++)
+    {
+        sum += hist[i];
+        if ((sum >= target) && (sum > 0))
+        {
+            return i;
+        }
+    }
+    return HIST_LEN - 1;
+}
+
+/**
+ *  @brief Get the current real time
+ *
+ *  @returns Monotonic time in sec
+ */
+static double now_sec(void)
+{
+    struct timespec ts = {0};
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ *  @brief Helper function to list command line options
+ */
+static void usage(void)
+{
+    coap_log_error("Usage: test_coap_sim <options>");
+    coap_log_error("Options:");
+    coap_log_error("    -n num - number of devices (default %d)", DEF_NUM_DEVICES);
+    coap_log_error("    -s num - number of servers (default %d)", DEF_NUM_SERVERS);
+    coap_log_error("    -d sec - virtual duration (default %d)", DEF_DURATION_SEC);
+    coap_log_error("    -p sec - period between the requests of a device (default %d)", DEF_PERIOD_SEC);
+    coap_log_error("    -L pct - link loss (default 0)");
+    coap_log_error("    -D msec - one-way link delay (default 50)");
+    coap_log_error("    -J msec - link jitter (default 10)");
+    coap_log_error("    -r seed - seed for the simulation (default 1)");
+    coap_log_error("    -l log-level - set the log level (0 to 4)");
+}
+
+/**
+ *  @brief Main function for the fleet simulation benchmark
+ *
+ *  @param[in] argc Number of command line arguments
+ *  @param[in] argv Array of pointers to command line arguments
+ *
+ *  @returns Operation status
+ *  @retval EXIT_SUCCESS Success
+ *  @retval EXIT_FAILURE Error
+ */
+int main(int argc, char **argv)
+{
+    const char *opts = ":hn:s:d:p:L:D:J:r:l:";
+    coap_sim_stats_t stats = {0};
+    coap_server_t *servers = NULL;
+    unsigned delay_ms = 50;
+    unsigned jitter_ms = 10;
+    unsigned seed = 1;
+    unsigned i = 0;
+    double loss = 0.0;
+    double start = 0.0;
+    double sec = 0.0;
+    double virt = 0.0;
+    char port_str[8] = {0};
+    int log_level = COAP_LOG_ERROR;
+    int ret = 0;
+    int c = 0;
+
+    opterr = 0;
+    while ((c = getopt(argc, argv, opts)) != -1)
+    {
+        switch (c)
+        {
+        case 'h':
+            usage();
+            return EXIT_SUCCESS;
+        case 'n':
+            num_devices = atoi(optarg);
+            break;
+        case 's':
+            num_servers = atoi(optarg);
+            break;
+        case 'd':
+            duration_sec = atoi(optarg);
+            break;
+        case 'p':
+            period_sec = atoi(optarg);
+            break;
+        case 'L':
+            loss = atof(optarg) / 100.0;
+            break;
+        case 'D':
+            delay_ms = atoi(optarg);
+            break;
+        case 'J':
+            jitter_ms = atoi(optarg);
+            break;
+        case 'r':
+            seed = atoi(optarg);
+            break;
+        case 'l':
+            log_level = atoi(optarg);
+            break;
+        case ':':
+            coap_log_error("Option '%c' requires an argument", optopt);
+            return EXIT_FAILURE;
+        case '?':
+            coap_log_error("Unknown option '%c'", optopt);
+            return EXIT_FAILURE;
+        default:
+            usage();
+        }
+    }
+    if ((num_devices == 0) || (num_servers == 0) || (period_sec == 0))
+    {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    coap_log_set_level(log_level);
+    memset(payload, 'x', sizeof(payload));
+
+    ret = coap_sim_init(seed);
+    if (ret < 0)
+    {
+        coap_log_error("Failed to initialise simulation: %s", strerror(-ret));
+        return EXIT_FAILURE;
+    }
+    coap_sim_set_link(loss, delay_ms * 1000, jitter_ms * 1000);
+    end_ns = coap_sim_get_time() + (uint64_t)duration_sec * 1000000000ull;
+
+    servers = calloc(num_servers, sizeof(coap_server_t));
+    if (servers == NULL)
+    {
+        coap_log_error("Failed to allocate servers");
+        return EXIT_FAILURE;
+    }
+    for (i = 0; i < num_servers; i++)
+    {
+        snprintf(port_str, sizeof(port_str), "%u", FIRST_SERVER_PORT + i);
+        ret = coap_server_create(&servers[i], server_handle, SERVER_HOST, port_str);
+        if (ret < 0)
+        {
+            coap_log_error("Failed to create server: %s", strerror(-ret));
+            return EXIT_FAILURE;
+        }
+        ret = coap_sim_thread_create(server_thread_func, &servers[i]);
+        if (ret < 0)
+        {
+            coap_log_error("Failed to start server thread: %s", strerror(-ret));
+            return EXIT_FAILURE;
+        }
+    }
+    for (i = 0; i < num_devices; i++)
+    {
+        ret = coap_sim_thread_create(device_thread_func, (void *)(uintptr_t)i);
+        if (ret < 0)
+        {
+            coap_log_error("Failed to start device thread %u: %s", i, strerror(-ret));
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* the servers run until the process exits */
+    start = now_sec();
+    while (num_done < num_devices)
+    {
+        ret = coap_sim_sleep(1000);
+        if (ret < 0)
+        {
+            coap_log_error("Simulation stopped: %s", strerror(-ret));
+            return EXIT_FAILURE;
+        }
+    }
+    sec = now_sec() - start;
+    virt = (coap_sim_get_time() - end_ns) / 1e9 + duration_sec;
+    coap_sim_get_stats(&stats);
+
+    printf("devices: %u, servers: %u, period: %u sec, loss: %.1f%%, delay: %u+-%u ms\n\n",
+           num_devices, num_servers, period_sec, loss * 100.0, delay_ms, jitter_ms);
+    printf("exchanges ok:     %lu\n", num_ok);
+    printf("exchanges failed: %lu\n", num_failed);
+    printf("completion p50:   %u ms\n", percentile(50));
+    printf("completion p95:   %u ms\n", percentile(95));
+    printf("completion p99:   %u ms\n", percentile(99));
+    printf("completion max:   %u ms\n", percentile(100));
+    printf("datagrams:        %lu sent, %lu lost, %lu delivered, %lu unreachable, %lu overflow\n",
+           (unsigned long)stats.num_sent, (unsigned long)stats.num_lost, (unsigned long)stats.num_delivered,
+           (unsigned long)stats.num_unreachable, (unsigned long)stats.num_overflow);
+    printf("events:           %lu, context switches: %lu\n",
+           (unsigned long)stats.num_events, (unsigned long)stats.num_switches);
+    printf("virtual time:     %.1f sec\n", virt);
+    printf("real time:        %.2f sec\n", sec);
+    printf("speed-up:         %.0fx\n", sec > 0.0 ? virt / sec : 0.0);
+    return EXIT_SUCCESS;
+}
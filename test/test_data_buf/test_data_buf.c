@@ -328,9 +328,102 @@ test_result_t test1_func(test_data_t data)
     return PASS;
 }
 
+static test_data_buf_data_t test2_data =
+{
+    .desc = "test 2: pool get, put",
+    .size = 16,
+    .max_size = 32,
+    .str = "abcdefghijkl",
+    .str_len = 12
+};
+
+test_result_t test2_func(test_data_t data)
+{
+    test_data_buf_data_t *test_data = (test_data_buf_data_t *)data;
+    data_buf_pool_t pool = {0};
+    data_buf_t buf1 = {0};
+    data_buf_t buf2 = {0};
+    char *p = NULL;
+    int ret = 0;
+
+    printf("%s\n", test_data->desc);
+
+    ret = data_buf_pool_create(&pool, test_data->size, 1);
+    if (ret != 0)
+    {
+        DEBUG_PRINT("Fail: call to data_buf_pool_create failed\n");
+        return FAIL;
+    }
+    ret = data_buf_pool_get(&pool, &buf1, test_data->max_size);
+    if (ret != 0)
+    {
+        DEBUG_PRINT("Fail: call to data_buf_pool_get failed\n");
+        data_buf_pool_destroy(&pool);
+        return FAIL;
+    }
+    test_data_buf_memcpy(&buf1, test_data->str, test_data->str_len);
+    p = data_buf_get_data(&buf1);
+
+    /* a buffer of the pool size is reused and cleared */
+    data_buf_pool_put(&pool, &buf1);
+    ret = data_buf_pool_get(&pool, &buf1, test_data->max_size);
+    if ((ret != 0) || (data_buf_get_data(&buf1) != p)
+     || (data_buf_get_count(&buf1) != 0) || (data_buf_get_size(&buf1) != test_data->size)
+     || (data_buf_get_data(&buf1)[0] != '\0'))
+    {
+        DEBUG_PRINT("Fail: pooled buffer not reused\n");
+        data_buf_destroy(&buf1);
+        data_buf_pool_destroy(&pool);
+        return FAIL;
+    }
+
+    /* an expanded buffer is freed rather than pooled */
+    ret = data_buf_expand(&buf1);
+    if (ret != 0)
+    {
+        DEBUG_PRINT("Fail: call to data_buf_expand failed\n");
+        data_buf_destroy(&buf1);
+        data_buf_pool_destroy(&pool);
+        return FAIL;
+    }
+    data_buf_pool_put(&pool, &buf1);
+    if (pool.num != 0)
+    {
+        DEBUG_PRINT("Fail: expanded buffer pooled\n");
+        data_buf_pool_destroy(&pool);
+        return FAIL;
+    }
+
+    /* the pool keeps no more than its maximum number of buffers */
+    data_buf_pool_get(&pool, &buf1, test_data->max_size);
+    data_buf_pool_get(&pool, &buf2, test_data->max_size);
+    data_buf_pool_put(&pool, &buf1);
+    data_buf_pool_put(&pool, &buf2);
+    if (pool.num != 1)
+    {
+        DEBUG_PRINT("Fail: pool holds %u buffers\n", pool.num);
+        data_buf_pool_destroy(&pool);
+        return FAIL;
+    }
+
+    /* the pool size cannot exceed the max size of a buffer */
+    ret = data_buf_pool_get(&pool, &buf1, test_data->size - 1);
+    if (ret != -EINVAL)
+    {
+        DEBUG_PRINT("Fail: call to data_buf_pool_get accepted a small max size\n");
+        data_buf_destroy(&buf1);
+        data_buf_pool_destroy(&pool);
+        return FAIL;
+    }
+    data_buf_pool_destroy(&pool);
+
+    return PASS;
+}
+
 int main(void)
 {
-    test_t tests[] = {{test1_func, &test1_data}};
+    test_t tests[] = {{test1_func, &test1_data},
+                      {test2_func, &test2_data}};
     unsigned num_tests = DIM(tests);
     unsigned num_pass = 0;
 
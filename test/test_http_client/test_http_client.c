@@ -36,7 +36,9 @@
 #include <string.h>
 #include <errno.h>
 #include <getopt.h>
+#include <unistd.h>
 #include <netinet/in.h>
+#include <netdb.h>
 #include <gnutls/gnutls.h>
 #include "http_msg.h"
 #include "tls_sock.h"
@@ -63,6 +65,7 @@
 #define CRL_FILE_NAME       ""                                                  /**< TLS certificate revocation list file name */
 #define SOCKET_TIMEOUT      120                                                 /**< Timeout for TLS/IPv6 socket operations */
 #define RESP_BUF_LEN        1024                                                /**< Size of the buffer used to store responses */
+#define IDLE_WAIT_SEC       2                                                   /**< Time to let the proxy park idle connections before measuring */
 
 /**
  *  @brief HTTP client test data structure
@@ -167,6 +170,78 @@ test_http_client_data_t test6_data =
     .body = NULL
 };
 
+#define TEST7_NUM_OK       3
+#define TEST7_NUM_ERROR    1
+#ifdef COAP_IP6
+#define TEST7_BODY_LEN     "118"
+#else
+#define TEST7_BODY_LEN     "134"
+#endif
+
+test_http_client_data_t test7_data =
+{
+    .desc = "test 7: Send a batch request for several resources",
+    .req_str = "POST /batch HTTP/1.1\r\nContent-Length: "TEST7_BODY_LEN"\r\n\r\n"
+               "coaps://"SERVER_HOST":12436/resource\r\n"
+               "coaps://"SERVER_HOST":12436/unsafe\r\n"
+               "coaps://"SERVER_HOST":12436/resource\r\n"
+               "coaps://"SERVER_HOST":12436/resource\r\n",
+    .start = NULL,
+    .num_headers = 0,
+    .name = NULL,
+    .value = NULL,
+    .body = NULL
+};
+
+#define TEST8_NUM_HEADERS  1
+
+const char *test8_start[HTTP_MSG_NUM_START] = {"HTTP/1.1", "200", "OK"};
+const char *test8_name[TEST8_NUM_HEADERS] = {"Content-Length"};
+const char *test8_value[TEST8_NUM_HEADERS] = {"13"};
+const char test8_body[] = "Hello Client!";
+
+test_http_client_data_t test8_data =
+{
+    .desc = "test 8: Send GET request in TLS 1.3 early data",
+    .req_str = "GET coaps://"SERVER_HOST":12436/resource HTTP/1.1\r\nContent-Length: 13\r\n\r\nHello Server!",
+    .start = test8_start,
+    .num_headers = TEST8_NUM_HEADERS,
+    .name = test8_name,
+    .value = test8_value,
+    .body = test8_body
+};
+
+const char *test9_start[HTTP_MSG_NUM_START] = {"HTTP/1.1", "425", "Too Early"};
+
+test_http_client_data_t test9_data =
+{
+    .desc = "test 9: Send POST request in TLS 1.3 early data",
+    .req_str = "POST coaps://"SERVER_HOST":12436/resource HTTP/1.1\r\nContent-Length: 13\r\n\r\nRequest=Hello",
+    .start = test9_start,
+    .num_headers = 0,
+    .name = NULL,
+    .value = NULL,
+    .body = NULL
+};
+
+#define TEST10_NUM_HEADERS  1
+
+const char *test10_start[HTTP_MSG_NUM_START] = {"HTTP/1.1", "200", "OK"};
+const char *test10_name[TEST10_NUM_HEADERS] = {"Content-Length"};
+const char *test10_value[TEST10_NUM_HEADERS] = {"13"};
+const char test10_body[] = "Hello Client!";
+
+test_http_client_data_t test10_data =
+{
+    .desc = "test 10: Send double GET request to an upstream group with one member down",
+    .req_str = "GET coaps://pool/resource HTTP/1.1\r\nContent-Length: 13\r\n\r\nHello Server!",
+    .start = test10_start,
+    .num_headers = TEST10_NUM_HEADERS,
+    .name = test10_name,
+    .value = test10_value,
+    .body = test10_body
+};
+
 /**
  *  @brief TLS client context used by all tests
  */
@@ -409,6 +484,377 @@ static test_result_t test_double_exchange_func(test_data_t data)
     return result;
 }
 
+/**
+ *  @brief Count the occurrences of a string in a buffer
+ *
+ *  @param[in] buf String to search
+ *  @param[in] str String to look for
+ *
+ *  @returns Number of occurrences
+ */
+static unsigned count_str(const char *buf, const char *str)
+{
+    unsigned num = 0;
+
+    while ((buf = strstr(buf, str)) != NULL)
+    {
+        buf += strlen(str);
+        num++;
+    }
+    return num;
+}
+
+/**
+ *  @brief Test a batch exchange with the proxy
+ *
+ *  The response is streamed in chunks so it is read
+ *  until the last chunk arrives.
+ *
+ *  @param[in] data Pointer to a HTTP client test data structure
+ *
+ *  @returns Test result
+ */
+static test_result_t test_batch_exchange_func(test_data_t data)
+{
+    test_http_client_data_t *test_data = (test_http_client_data_t *)data;
+    test_result_t result = PASS;
+    tls_sock_t s = {0};
+    size_t len = 0;
+    char resp_buf[4 * RESP_BUF_LEN] = {0};
+    int ret = 0;
+
+    printf("%s\n", test_data->desc);
+
+    ret = tls_sock_open(&s, &client, PROXY_HOST, PROXY_PORT, SERVER_COMMON_NAME, SOCKET_TIMEOUT);
+    if (ret != SOCK_OK)
+    {
+        return FAIL;
+    }
+    ret = tls_sock_write_full(&s, test_data->req_str, strlen(test_data->req_str));
+    if (ret <= 0)
+    {
+        tls_sock_close(&s);
+        return FAIL;
+    }
+    coap_log_info("Sent: %s", test_data->req_str);
+    while (strstr(resp_buf, "\r\n0\r\n\r\n") == NULL)
+    {
+        ret = tls_sock_read(&s, resp_buf + len, sizeof(resp_buf) - len - 1);
+        if (ret <= 0)
+        {
+            tls_sock_close(&s);
+            return FAIL;
+        }
+        len += ret;
+    }
+    coap_log_info("Received: %s", resp_buf);
+    if (strncmp(resp_buf, "HTTP/1.1 200 OK\r\n", 17) != 0)
+    {
+        coap_log_warn("Unexpected start line");
+        result = FAIL;
+    }
+    if (strstr(resp_buf, "Transfer-Encoding: chunked\r\n") == NULL)
+    {
+        coap_log_warn("Response is not chunked");
+        result = FAIL;
+    }
+    if (count_str(resp_buf, "Content-Type: message/http\r\n") != TEST7_NUM_OK + TEST7_NUM_ERROR)
+    {
+        coap_log_warn("Unexpected number of parts");
+        result = FAIL;
+    }
+    /* the response itself and one part for each resource */
+    if (count_str(resp_buf, "HTTP/1.1 200 OK\r\n") != 1 + TEST7_NUM_OK)
+    {
+        coap_log_warn("Unexpected number of successful parts");
+        result = FAIL;
+    }
+    if (count_str(resp_buf, "HTTP/1.1 502 Bad Gateway\r\n") != TEST7_NUM_ERROR)
+    {
+        coap_log_warn("Unexpected number of failed parts");
+        result = FAIL;
+    }
+    if (count_str(resp_buf, "Hello Client!") != TEST7_NUM_OK)
+    {
+        coap_log_warn("Unexpected number of bodies");
+        result = FAIL;
+    }
+    if (strstr(resp_buf, "--freecoap-batch--\r\n") == NULL)
+    {
+        coap_log_warn("Missing final boundary");
+        result = FAIL;
+    }
+    tls_sock_close(&s);
+    return result;
+}
+
+/**
+ *  @brief Test an exchange with the proxy where the request is sent in TLS 1.3 early data
+ *
+ *  An exchange is made first so that the client has a session
+ *  ticket to resume. The request is then sent as early data
+ *  on a new connection that resumes the session.
+ *
+ *  @param[in] data Pointer to a HTTP client test data structure
+ *
+ *  @returns Test result
+ */
+static test_result_t test_early_exchange_func(test_data_t data)
+{
+    test_http_client_data_t *test_data = (test_http_client_data_t *)data;
+    gnutls_session_t session = {0};
+    struct addrinfo hints = {0};
+    struct addrinfo *list = NULL;
+    test_result_t result = PASS;
+    gnutls_datum_t ticket = {0};
+    http_msg_t resp_msg = {{0}};
+    tls_sock_t s = {0};
+    size_t len = 0;
+    char resp_buf[RESP_BUF_LEN] = {0};
+    char addr[SOCK_INET_ADDRSTRLEN] = {0};
+    int ret = 0;
+    int sd = 0;
+
+    printf("%s\n", test_data->desc);
+
+    /* get a session ticket */
+    ret = tls_sock_open(&s, &client, PROXY_HOST, PROXY_PORT, SERVER_COMMON_NAME, SOCKET_TIMEOUT);
+    if (ret != SOCK_OK)
+    {
+        return FAIL;
+    }
+    ret = tls_sock_write_full(&s, test1_data.req_str, strlen(test1_data.req_str));
+    if (ret > 0)
+    {
+        ret = tls_sock_read(&s, resp_buf, sizeof(resp_buf));
+    }
+    tls_sock_close(&s);
+    if (ret <= 0)
+    {
+        return FAIL;
+    }
+    memset(resp_buf, 0, sizeof(resp_buf));
+
+    hints.ai_family = SOCK_AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    ret = getaddrinfo(PROXY_HOST, PROXY_PORT, &hints, &list);
+    if (ret != 0)
+    {
+        return FAIL;
+    }
+    sd = socket(list->ai_family, list->ai_socktype, list->ai_protocol);
+    if (sd < 0)
+    {
+        freeaddrinfo(list);
+        return FAIL;
+    }
+    ret = connect(sd, list->ai_addr, list->ai_addrlen);
+    freeaddrinfo(list);
+    if (ret < 0)
+    {
+        close(sd);
+        return FAIL;
+    }
+    ret = gnutls_init(&session, GNUTLS_CLIENT);
+    if (ret != GNUTLS_E_SUCCESS)
+    {
+        close(sd);
+        return FAIL;
+    }
+    gnutls_priority_set(session, tls_get_priority_cache());
+    gnutls_credentials_set(session, GNUTLS_CRD_CERTIFICATE, tls_client_get_cred(&client));
+    gnutls_transport_set_int(session, sd);
+    /* sessions are cached against the address of the proxy */
+    snprintf(addr, sizeof(addr), "%s", PROXY_HOST);
+    ticket = tls_client_get(&client, addr);
+    if (ticket.size == 0)
+    {
+        coap_log_warn("No session ticket to resume");
+        gnutls_deinit(session);
+        close(sd);
+        return FAIL;
+    }
+    gnutls_session_set_data(session, ticket.data, ticket.size);
+    ret = gnutls_record_send_early_data(session, test_data->req_str, strlen(test_data->req_str));
+    if (ret < 0)
+    {
+        gnutls_deinit(session);
+        close(sd);
+        return FAIL;
+    }
+    do
+    {
+        ret = gnutls_handshake(session);
+    }
+    while ((ret < 0) && (!gnutls_error_is_fatal(ret)));
+    if (ret < 0)
+    {
+        coap_log_warn("Handshake failed: %s", gnutls_strerror(ret));
+        gnutls_deinit(session);
+        close(sd);
+        return FAIL;
+    }
+    if (!(gnutls_session_get_flags(session) & GNUTLS_SFLAGS_EARLY_DATA))
+    {
+        coap_log_warn("Early data was not accepted");
+        result = FAIL;
+    }
+    coap_log_info("Sent: %s", test_data->req_str);
+    ret = 0;
+    http_msg_create(&resp_msg);
+    while ((ret == 0) && (len < sizeof(resp_buf) - 1))
+    {
+        ret = gnutls_record_recv(session, resp_buf + len, sizeof(resp_buf) - len - 1);
+        if (ret == GNUTLS_E_AGAIN)
+        {
+            ret = 0;
+            continue;
+        }
+        if (ret <= 0)
+        {
+            http_msg_destroy(&resp_msg);
+            gnutls_deinit(session);
+            close(sd);
+            return FAIL;
+        }
+        len += ret;
+        http_msg_destroy(&resp_msg);
+        http_msg_create(&resp_msg);
+        ret = http_msg_parse(&resp_msg, resp_buf, len);
+        if (ret < 0)
+        {
+            break;
+        }
+    }
+    coap_log_info("Received: %s", resp_buf);
+    if (ret <= 0)
+    {
+        result = FAIL;
+    }
+    else
+    {
+        if (check_start(test_data, &resp_msg) != PASS)
+        {
+            result = FAIL;
+        }
+        if (check_headers(test_data, &resp_msg) != PASS)
+        {
+            result = FAIL;
+        }
+        if (check_body(test_data, &resp_msg) != PASS)
+        {
+            result = FAIL;
+        }
+    }
+    http_msg_destroy(&resp_msg);
+    gnutls_bye(session, GNUTLS_SHUT_WR);
+    gnutls_deinit(session);
+    close(sd);
+    return result;
+}
+
+/**
+ *  @brief Read the resident set size of a process
+ *
+ *  @param[in] pid Process ID
+ *
+ *  @returns Resident set size in bytes or 0 on error
+ */
+static long get_rss(long pid)
+{
+    char file_name[64] = {0};
+    char line[128] = {0};
+    long rss = 0;
+    FILE *file = NULL;
+
+    snprintf(file_name, sizeof(file_name), "/proc/%ld/status", pid);
+    file = fopen(file_name, "r");
+    if (file == NULL)
+    {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        if (sscanf(line, "VmRSS: %ld kB", &rss) == 1)
+        {
+            break;
+        }
+    }
+    fclose(file);
+    return rss * 1024;
+}
+
+/**
+ *  @brief Hold many idle keep-alive connections open against the proxy
+ *
+ *  Open the connections, make one exchange on each and leave
+ *  them idle. Report the growth in the resident set size of
+ *  the proxy per idle connection.
+ *
+ *  @param[in] num Number of connections
+ *  @param[in] pid Process ID of the proxy
+ *
+ *  @returns Operation status
+ *  @retval 0 Success
+ *  @retval <0 Error
+ */
+static int idle_load(unsigned num, long pid)
+{
+    tls_sock_t *s = NULL;
+    unsigned opened = 0;
+    unsigned i = 0;
+    char resp_buf[RESP_BUF_LEN] = {0};
+    long before = 0;
+    long after = 0;
+    int ret = 0;
+
+    s = (tls_sock_t *)calloc(num, sizeof(tls_sock_t));
+    if (s == NULL)
+    {
+        return -ENOMEM;
+    }
+    before = get_rss(pid);
+    for (opened = 0; opened < num; opened++)
+    {
+        ret = tls_sock_open(&s[opened], &client, PROXY_HOST, PROXY_PORT, SERVER_COMMON_NAME, SOCKET_TIMEOUT);
+        if (ret != SOCK_OK)
+        {
+            coap_log_error("Failed to open connection %u: %s", opened, sock_strerror(ret));
+            break;
+        }
+        ret = tls_sock_write_full(&s[opened], test1_data.req_str, strlen(test1_data.req_str));
+        if (ret > 0)
+        {
+            ret = tls_sock_read(&s[opened], resp_buf, sizeof(resp_buf));
+        }
+        if (ret <= 0)
+        {
+            coap_log_error("Failed exchange on connection %u", opened);
+            tls_sock_close(&s[opened]);
+            break;
+        }
+    }
+    ret = (opened == num) ? 0 : -1;
+    sleep(IDLE_WAIT_SEC);
+    after = get_rss(pid);
+    if ((opened > 0) && (before > 0) && (after > 0))
+    {
+        printf("Idle connections: %u\n", opened);
+        printf("Proxy RSS before: %ld bytes\n", before);
+        printf("Proxy RSS after:  %ld bytes\n", after);
+        printf("Bytes per idle connection: %ld\n", (after - before) / (long)opened);
+    }
+    /* tls_sock_close waits for each close notify alert so just send ours */
+    for (i = 0; i < opened; i++)
+    {
+        gnutls_bye(s[i].session, GNUTLS_SHUT_WR);
+        gnutls_deinit(s[i].session);
+        close(s[i].sd);
+    }
+    free(s);
+    return ret;
+}
+
 /**
  *  @brief Helper function to list command line options
  */
@@ -417,6 +863,8 @@ static void usage(void)
     coap_log_error("Usage: test_http_client <options> test-num");
     coap_log_error("Options:");
     coap_log_error("    -l log-level - set the log level (0 to 4)");
+    coap_log_error("    -n num - hold num idle connections open instead of running the tests");
+    coap_log_error("    -p pid - process ID of the proxy, used with -n");
 }
 
 /**
@@ -432,10 +880,12 @@ static void usage(void)
 int main(int argc, char **argv)
 {
     const char *gnutls_ver = NULL;
-    const char *opts = ":hl:";
+    const char *opts = ":hl:n:p:";
+    unsigned num_idle = 0;
     unsigned num_tests = 0;
     unsigned num_pass = 0;
     int log_level = COAP_LOG_DEBUG;
+    long proxy_pid = 0;
     int test_num = 0;
     int ret = 0;
     int c = 0;
@@ -444,7 +894,11 @@ int main(int argc, char **argv)
                       {test_exchange_func,        &test3_data},
                       {test_exchange_func,        &test4_data},
                       {test_exchange_func,        &test5_data},
-                      {test_exchange_func,        &test6_data}};
+                      {test_exchange_func,        &test6_data},
+                      {test_batch_exchange_func,  &test7_data},
+                      {test_early_exchange_func,  &test8_data},
+                      {test_early_exchange_func,  &test9_data},
+                      {test_double_exchange_func, &test10_data}};
 
     opterr = 0;
     while ((c = getopt(argc, argv, opts)) != -1)
@@ -457,6 +911,12 @@ int main(int argc, char **argv)
         case 'l':
             log_level = atoi(optarg);
             break;
+        case 'n':
+            num_idle = atoi(optarg);
+            break;
+        case 'p':
+            proxy_pid = atol(optarg);
+            break;
         case ':':
             coap_log_error("Option '%c' requires an argument", optopt);
             return EXIT_FAILURE;
@@ -497,6 +957,14 @@ int main(int argc, char **argv)
         return EXIT_FAILURE;
     }
 
+    if (num_idle > 0)
+    {
+        ret = idle_load(num_idle, proxy_pid);
+        tls_client_destroy(&client);
+        tls_deinit();
+        return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
     switch (test_num)
     {
     case 1:
@@ -523,8 +991,24 @@ int main(int argc, char **argv)
         num_tests = 1;
         num_pass = test_run(&tests[5], num_tests);
         break;
+    case 7:
+        num_tests = 1;
+        num_pass = test_run(&tests[6], num_tests);
+        break;
+    case 8:
+        num_tests = 1;
+        num_pass = test_run(&tests[7], num_tests);
+        break;
+    case 9:
+        num_tests = 1;
+        num_pass = test_run(&tests[8], num_tests);
+        break;
+    case 10:
+        num_tests = 1;
+        num_pass = test_run(&tests[9], num_tests);
+        break;
     default:
-        num_tests = 6;
+        num_tests = 10;
         num_pass = test_run(tests, num_tests);
     }
 
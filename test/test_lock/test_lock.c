@@ -33,11 +33,20 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 #include "lock.h"
 #include "test.h"
+#ifdef LOCK_PROF
+#include "coap_log.h"
+#endif
 
 #define DIM(x) (sizeof(x) / sizeof(x[0]))
 
+#define BENCH_NUM_THREADS  4
+#define BENCH_NUM_ITER     200000
+#define BENCH_READ_PCT     90                                                   /* percentage of reads in the reader-writer lock benchmark */
+
 typedef struct
 {
     const char *desc;
@@ -218,16 +227,395 @@ test_result_t test4_func(test_data_t data)
     return result;
 }
 
+typedef struct
+{
+    const char *desc;
+}
+test_lock_data5_t;
+
+test_lock_data5_t test5_data =
+{
+    .desc = "test 5: reader-writer lock, get for reading twice, then for writing",
+};
+
+test_result_t test5_func(test_data_t data)
+{
+    test_lock_data5_t *test_data = (test_lock_data5_t *)data;
+    test_result_t result = PASS;
+    lock_rw_t lock;
+    int ret = 0;
+
+    printf("%s\n", test_data->desc);
+
+    ret = lock_rw_create(&lock);
+    if (ret != 0)
+    {
+        return FAIL;
+    }
+    if ((lock_rw_get_read(&lock) != 0)
+     || (lock_rw_get_read(&lock) != 0)
+     || (lock_rw_put(&lock) != 0)
+     || (lock_rw_put(&lock) != 0)
+     || (lock_rw_get_write(&lock) != 0)
+     || (lock_rw_put(&lock) != 0))
+    {
+        result = FAIL;
+    }
+    lock_rw_destroy(&lock);
+    return result;
+}
+
+typedef struct
+{
+    const char *desc;
+}
+test_lock_data6_t;
+
+test_lock_data6_t test6_data =
+{
+    .desc = "test 6: spin lock, get, put",
+};
+
+test_result_t test6_func(test_data_t data)
+{
+    test_lock_data6_t *test_data = (test_lock_data6_t *)data;
+    test_result_t result = PASS;
+    lock_spin_t lock;
+    int ret = 0;
+
+    printf("%s\n", test_data->desc);
+
+    ret = lock_spin_create(&lock);
+    if (ret != 0)
+    {
+        return FAIL;
+    }
+    if ((lock_spin_get(&lock) != 0)
+     || (lock_spin_put(&lock) != 0))
+    {
+        result = FAIL;
+    }
+    lock_spin_destroy(&lock);
+    return result;
+}
+
+typedef struct
+{
+    const char *desc;
+    unsigned num_keys;
+}
+test_lock_data7_t;
+
+test_lock_data7_t test7_data =
+{
+    .desc = "test 7: sharded lock, keys select the same lock each time and spread over the shards",
+    .num_keys = 1000
+};
+
+test_result_t test7_func(test_data_t data)
+{
+    test_lock_data7_t *test_data = (test_lock_data7_t *)data;
+    test_result_t result = PASS;
+    lock_shard_t lock;
+    unsigned used[LOCK_NUM_SHARDS] = {0};
+    unsigned num_used = 0;
+    unsigned index = 0;
+    unsigned i = 0;
+    lock_t *l = NULL;
+    int ret = 0;
+
+    printf("%s\n", test_data->desc);
+
+    ret = lock_shard_create(&lock);
+    if (ret != 0)
+    {
+        return FAIL;
+    }
+    for (i = 0; i < test_data->num_keys; i++)
+    {
+        l = lock_shard_select(&lock, i);
+        if (l != lock_shard_select(&lock, i))
+        {
+            result = FAIL;
+        }
+        if ((lock_get(l) != 0) || (lock_put(l) != 0))
+        {
+            result = FAIL;
+        }
+        index = (lock_shard_entry_t *)l - lock.shard;
+        if (used[index]++ == 0)
+        {
+            num_used++;
+        }
+    }
+    if (num_used != LOCK_NUM_SHARDS)
+    {
+        result = FAIL;
+    }
+    lock_shard_destroy(&lock);
+    return result;
+}
+
+#ifdef LOCK_PROF
+
+typedef struct
+{
+    const char *desc;
+    unsigned num_get;
+}
+test_lock_data8_t;
+
+test_lock_data8_t test8_data =
+{
+    .desc = "test 8: profile a lock",
+    .num_get = 10
+};
+
+test_result_t test8_func(test_data_t data)
+{
+    test_lock_data8_t *test_data = (test_lock_data8_t *)data;
+    test_result_t result = PASS;
+    lock_prof_t *prof = NULL;
+    unsigned long num_hold = 0;
+    unsigned i = 0;
+    lock_t lock;
+    int ret = 0;
+
+    printf("%s\n", test_data->desc);
+
+    ret = lock_create_named(&lock, "test 8");
+    if (ret != 0)
+    {
+        return FAIL;
+    }
+    for (i = 0; i < test_data->num_get; i++)
+    {
+        lock_get(&lock);
+        lock_put(&lock);
+    }
+    lock_destroy(&lock);
+    prof = lock_prof_get("test 8");
+    if ((prof == NULL) || (prof->num_get != test_data->num_get) || (prof->num_contended != 0))
+    {
+        result = FAIL;
+    }
+    else
+    {
+        for (i = 0; i < LOCK_PROF_NUM_BUCKETS; i++)
+        {
+            num_hold += prof->hold_hist[i];
+        }
+        if ((num_hold != test_data->num_get) || (prof->wait_hist[0] != test_data->num_get))
+        {
+            result = FAIL;
+        }
+    }
+    return result;
+}
+
+#endif  /* LOCK_PROF */
+
+typedef enum
+{
+    BENCH_LOCK = 0,
+    BENCH_SPIN,
+    BENCH_RW,
+    BENCH_SHARD
+}
+bench_type_t;
+
+typedef struct
+{
+    const char *desc;
+    bench_type_t type;
+}
+test_lock_bench_data_t;
+
+test_lock_bench_data_t test9_data =
+{
+    .desc = "test 9: contention benchmark, error checking mutex",
+    .type = BENCH_LOCK
+};
+
+test_lock_bench_data_t test10_data =
+{
+    .desc = "test 10: contention benchmark, adaptive spin lock",
+    .type = BENCH_SPIN
+};
+
+test_lock_bench_data_t test11_data =
+{
+    .desc = "test 11: contention benchmark, reader-writer lock with mostly reads",
+    .type = BENCH_RW
+};
+
+test_lock_bench_data_t test12_data =
+{
+    .desc = "test 12: contention benchmark, sharded lock",
+    .type = BENCH_SHARD
+};
+
+typedef struct
+{
+    bench_type_t type;
+    lock_t lock;
+    lock_spin_t spin;
+    lock_rw_t rw;
+    lock_shard_t shard;
+    unsigned long count[LOCK_NUM_SHARDS];                                       /* count[0] for the unsharded locks */
+    unsigned long reads[BENCH_NUM_THREADS];
+    unsigned long max_read[BENCH_NUM_THREADS];                                  /* largest count seen by a reader */
+}
+bench_t;
+
+static bench_t bench;
+
+static void *bench_thread_func(void *data)
+{
+    unsigned long max_read = 0;
+    unsigned long index = (unsigned long)data;
+    unsigned long seed = index + 1;
+    unsigned long reads = 0;
+    unsigned long key = 0;
+    unsigned i = 0;
+    lock_t *l = NULL;
+
+    for (i = 0; i < BENCH_NUM_ITER; i++)
+    {
+        seed = seed * 6364136223846793005ul + 1442695040888963407ul;
+        key = seed >> 33;
+        switch (bench.type)
+        {
+        case BENCH_LOCK:
+            lock_get(&bench.lock);
+            bench.count[0]++;
+            lock_put(&bench.lock);
+            break;
+        case BENCH_SPIN:
+            lock_spin_get(&bench.spin);
+            bench.count[0]++;
+            lock_spin_put(&bench.spin);
+            break;
+        case BENCH_RW:
+            if (key % 100 < BENCH_READ_PCT)
+            {
+                lock_rw_get_read(&bench.rw);
+                if (bench.count[0] > max_read)
+                {
+                    max_read = bench.count[0];
+                }
+                reads++;
+                lock_rw_put(&bench.rw);
+            }
+            else
+            {
+                lock_rw_get_write(&bench.rw);
+                bench.count[0]++;
+                lock_rw_put(&bench.rw);
+            }
+            break;
+        case BENCH_SHARD:
+            l = lock_shard_select(&bench.shard, key);
+            lock_get(l);
+            bench.count[(lock_shard_entry_t *)l - bench.shard.shard]++;
+            lock_put(l);
+            break;
+        }
+    }
+    bench.reads[index] = reads;
+    bench.max_read[index] = max_read;
+    return NULL;
+}
+
+test_result_t test_bench_func(test_data_t data)
+{
+    test_lock_bench_data_t *test_data = (test_lock_bench_data_t *)data;
+    test_result_t result = PASS;
+    struct timespec start = {0};
+    struct timespec end = {0};
+    unsigned long total = 0;
+    pthread_t thread[BENCH_NUM_THREADS];
+    unsigned num_threads = 0;
+    unsigned i = 0;
+    double ns = 0.0;
+    int ret = 0;
+
+    printf("%s\n", test_data->desc);
+
+    memset(&bench, 0, sizeof(bench));
+    bench.type = test_data->type;
+    if ((lock_create(&bench.lock) != 0)
+     || (lock_spin_create(&bench.spin) != 0)
+     || (lock_rw_create(&bench.rw) != 0)
+     || (lock_shard_create(&bench.shard) != 0))
+    {
+        return FAIL;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < BENCH_NUM_THREADS; i++)
+    {
+        ret = pthread_create(&thread[i], NULL, bench_thread_func, (void *)(unsigned long)i);
+        if (ret != 0)
+        {
+            result = FAIL;
+            break;
+        }
+        num_threads++;
+    }
+    for (i = 0; i < num_threads; i++)
+    {
+        pthread_join(thread[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    for (i = 0; i < LOCK_NUM_SHARDS; i++)
+    {
+        total += bench.count[i];
+    }
+    for (i = 0; i < BENCH_NUM_THREADS; i++)
+    {
+        total += bench.reads[i];
+        if (bench.max_read[i] > bench.count[0])
+        {
+            result = FAIL;
+        }
+    }
+    if (total != (unsigned long)num_threads * BENCH_NUM_ITER)
+    {
+        result = FAIL;
+    }
+    ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+    printf("    %u threads, %.1f nsec per operation\n", num_threads, ns / ((double)num_threads * BENCH_NUM_ITER));
+    lock_shard_destroy(&bench.shard);
+    lock_rw_destroy(&bench.rw);
+    lock_spin_destroy(&bench.spin);
+    lock_destroy(&bench.lock);
+    return result;
+}
+
 int main()
 {
     test_t tests[] = {{test1_func, &test1_data},
                       {test2_func, &test2_data},
                       {test3_func, &test3_data},
-                      {test4_func, &test4_data}};
+                      {test4_func, &test4_data},
+                      {test5_func, &test5_data},
+                      {test6_func, &test6_data},
+                      {test7_func, &test7_data},
+#ifdef LOCK_PROF
+                      {test8_func, &test8_data},
+#endif
+                      {test_bench_func, &test9_data},
+                      {test_bench_func, &test10_data},
+                      {test_bench_func, &test11_data},
+                      {test_bench_func, &test12_data}};
     unsigned num_tests = DIM(tests);
     unsigned num_pass = 0;
 
+#ifdef LOCK_PROF
+    coap_log_set_level(COAP_LOG_INFO);
+#endif
     num_pass = test_run(tests, num_tests);
+    lock_prof_log();
 
     return num_pass == num_tests ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -0,0 +1,371 @@
+/*
+ * Copyright (c) 2014 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ *  @file test_param.c
+ *
+ *  @brief Source file for the FreeCoAP HTTP/CoAP proxy parameter unit tests
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "param.h"
+#include "coap_log.h"
+#include "test.h"
+
+#define FILE_NAME  "test_param.conf"
+
+#define DIM(x) (sizeof(x) / sizeof(x[0]))
+
+typedef struct
+{
+    const char *host;                                                           /* host name passed to param_get_route */
+    const char *route_host;                                                     /* host of the expected route, NULL for the default route */
+    unsigned ack_timeout;
+    unsigned max_retransmit;
+    unsigned deadline;
+}
+lookup_t;
+
+typedef struct
+{
+    const char *desc;
+    const char *str;
+    int create_ret;
+    lookup_t *lookup;
+    unsigned num_lookup;
+    const char *vhost_name;                                                     /* server name of the first virtual host, NULL for none */
+    const char *vhost_cert_file_name;
+}
+test_param_data_t;
+
+#define TEST_PARAM_COMMON                                                        \
+    "[http_server]\n"                                                            \
+    "cert_file = \"server_cert.pem\"\n"                                          \
+    "key_file = \"server_privkey.pem\"\n"                                        \
+    "[coap_client]\n"                                                            \
+    "ack_timeout = 3\n"                                                          \
+    "max_retransmit = 5\n"
+
+lookup_t test1_lookup[] =
+{
+    {"coap.example.com",    "coap.example.com", 7, 5},
+    {"COAP.Example.COM",    "coap.example.com", 7, 5},
+    {"coap.example.org",    NULL,               3, 5},
+    {"localhost",           NULL,               3, 5},
+    {"",                    NULL,               3, 5}
+};
+
+test_param_data_t test1_data =
+{
+    .desc = "test 1: route selected by the full host name",
+    .str = TEST_PARAM_COMMON
+           "[route_full]\n"
+           "host = \"coap.example.com\"\n"
+           "ack_timeout = 7\n",
+    .create_ret = 0,
+    .lookup = test1_lookup,
+    .num_lookup = DIM(test1_lookup),
+    .vhost_name = NULL,
+    .vhost_cert_file_name = NULL
+};
+
+lookup_t test2_lookup[] =
+{
+    {"sensors",             "sensors",          4, 6},
+    {"sensors.example.com", "sensors",          4, 6},
+    {"sensors.a.b.c",       "sensors",          4, 6},
+    {"sensor.example.com",  NULL,               3, 5},
+    {"example.sensors",     NULL,               3, 5}
+};
+
+test_param_data_t test2_data =
+{
+    .desc = "test 2: route selected by the first label of the host name",
+    .str = TEST_PARAM_COMMON
+           "[route_label]\n"
+           "host = \"sensors\"\n"
+           "ack_timeout = 4\n"
+           "max_retransmit = 6\n",
+    .create_ret = 0,
+    .lookup = test2_lookup,
+    .num_lookup = DIM(test2_lookup),
+    .vhost_name = NULL,
+    .vhost_cert_file_name = NULL
+};
+
+lookup_t test3_lookup[] =
+{
+    {"coap.example.com",    "coap.example.com", 8, 5},
+    {"coap.example.org",    "coap",             9, 5},
+    {"coap",                "coap",             9, 5},
+    {"other.example.com",   NULL,               3, 5}
+};
+
+test_param_data_t test3_data =
+{
+    .desc = "test 3: full host name preferred to first label",
+    .str = TEST_PARAM_COMMON
+           "[route_label]\n"
+           "host = \"coap\"\n"
+           "ack_timeout = 9\n"
+           "[route_full]\n"
+           "host = \"coap.example.com\"\n"
+           "ack_timeout = 8\n",
+    .create_ret = 0,
+    .lookup = test3_lookup,
+    .num_lookup = DIM(test3_lookup),
+    .vhost_name = NULL,
+    .vhost_cert_file_name = NULL
+};
+
+test_param_data_t test4_data =
+{
+    .desc = "test 4: virtual host with the default key file",
+    .str = TEST_PARAM_COMMON
+           "[vhost_example]\n"
+           "server_name = \"example.com\"\n"
+           "cert_file = \"example_cert.pem\"\n",
+    .create_ret = 0,
+    .lookup = NULL,
+    .num_lookup = 0,
+    .vhost_name = "example.com",
+    .vhost_cert_file_name = "example_cert.pem"
+};
+
+test_param_data_t test5_data =
+{
+    .desc = "test 5: route without a host",
+    .str = TEST_PARAM_COMMON
+           "[route_bad]\n"
+           "ack_timeout = 7\n",
+    .create_ret = -1,
+    .lookup = NULL,
+    .num_lookup = 0,
+    .vhost_name = NULL,
+    .vhost_cert_file_name = NULL
+};
+
+test_param_data_t test6_data =
+{
+    .desc = "test 6: duplicate route host",
+    .str = TEST_PARAM_COMMON
+           "[route_a]\n"
+           "host = \"coap.example.com\"\n"
+           "[route_b]\n"
+           "host = \"COAP.example.com\"\n",
+    .create_ret = -1,
+    .lookup = NULL,
+    .num_lookup = 0,
+    .vhost_name = NULL,
+    .vhost_cert_file_name = NULL
+};
+
+test_param_data_t test7_data =
+{
+    .desc = "test 7: route with a zero ack_timeout",
+    .str = TEST_PARAM_COMMON
+           "[route_bad]\n"
+           "host = \"coap\"\n"
+           "ack_timeout = 0\n",
+    .create_ret = -1,
+    .lookup = NULL,
+    .num_lookup = 0,
+    .vhost_name = NULL,
+    .vhost_cert_file_name = NULL
+};
+
+lookup_t test8_lookup[] =
+{
+    {"coap.example.com",    "coap.example.com", 3, 5, 120000},
+    {"coap.example.org",    NULL,               3, 5, 0}
+};
+
+test_param_data_t test8_data =
+{
+    .desc = "test 8: route with a deadline longer than 65535 msec",
+    .str = TEST_PARAM_COMMON
+           "[route_full]\n"
+           "host = \"coap.example.com\"\n"
+           "deadline = 120000\n"
+           "hedge_delay = 60000\n",
+    .create_ret = 0,
+    .lookup = test8_lookup,
+    .num_lookup = DIM(test8_lookup),
+    .vhost_name = NULL,
+    .vhost_cert_file_name = NULL
+};
+
+test_param_data_t test9_data =
+{
+    .desc = "test 9: route with a hedge_delay longer than 60000 msec",
+    .str = TEST_PARAM_COMMON
+           "[route_bad]\n"
+           "host = \"coap\"\n"
+           "hedge_delay = 60001\n",
+    .create_ret = -1,
+    .lookup = NULL,
+    .num_lookup = 0,
+    .vhost_name = NULL,
+    .vhost_cert_file_name = NULL
+};
+
+static int write_file(const char *str)
+{
+    FILE *file = NULL;
+    size_t num = 0;
+
+    file = fopen(FILE_NAME, "w");
+    if (file == NULL)
+    {
+        return -1;
+    }
+    num = fwrite(str, 1, strlen(str), file);
+    fclose(file);
+    if (num != strlen(str))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+static test_result_t test_lookup(param_t *param, lookup_t *lookup)
+{
+    param_route_t *route = NULL;
+
+    route = param_get_route(param, lookup->host);
+    DEBUG_PRINT("host: '%s', route: '%s'\n", lookup->host, route->host != NULL ? route->host : "(default)");
+    if (lookup->route_host == NULL)
+    {
+        if (route != param_get_default_route(param))
+        {
+            return FAIL;
+        }
+    }
+    else
+    {
+        if ((route == param_get_default_route(param))
+         || (strcmp(route->host, lookup->route_host) != 0))
+        {
+            return FAIL;
+        }
+    }
+    if ((route->coap_client_ack_timeout != lookup->ack_timeout)
+     || (route->coap_client_max_retransmit != lookup->max_retransmit)
+     || (route->coap_client_deadline != lookup->deadline))
+    {
+        return FAIL;
+    }
+    /* file names not given in a route section come from the coap_client section */
+    if ((route->coap_client_cert_file_name == NULL)
+     || (strcmp(route->coap_client_cert_file_name, param->coap_client_cert_file_name) != 0))
+    {
+        return FAIL;
+    }
+    return PASS;
+}
+
+static test_result_t test_param_func(test_data_t data)
+{
+    test_param_data_t *test_data = (test_param_data_t *)data;
+    test_result_t result = PASS;
+    param_vhost_t *vhost = NULL;
+    param_t param = {0};
+    unsigned i = 0;
+    int ret = 0;
+
+    printf("%s\n", test_data->desc);
+
+    ret = write_file(test_data->str);
+    if (ret != 0)
+    {
+        return FAIL;
+    }
+    ret = param_create(&param, FILE_NAME);
+    remove(FILE_NAME);
+    if (ret != test_data->create_ret)
+    {
+        if (ret == 0)
+        {
+            param_destroy(&param);
+        }
+        return FAIL;
+    }
+    if (ret != 0)
+    {
+        return PASS;
+    }
+    for (i = 0; i < test_data->num_lookup; i++)
+    {
+        if (test_lookup(&param, &test_data->lookup[i]) != PASS)
+        {
+            result = FAIL;
+        }
+    }
+    vhost = param_get_first_vhost(&param);
+    if (test_data->vhost_name == NULL)
+    {
+        if (vhost != NULL)
+        {
+            result = FAIL;
+        }
+    }
+    else
+    {
+        if ((vhost == NULL)
+         || (strcmp(vhost->server_name, test_data->vhost_name) != 0)
+         || (strcmp(vhost->cert_file_name, test_data->vhost_cert_file_name) != 0)
+         || (strcmp(vhost->key_file_name, param_get_http_server_key_file_name(&param)) != 0))
+        {
+            result = FAIL;
+        }
+    }
+    param_destroy(&param);
+    return result;
+}
+
+int main(void)
+{
+    test_t tests[] = {{test_param_func, &test1_data},
+                      {test_param_func, &test2_data},
+                      {test_param_func, &test3_data},
+                      {test_param_func, &test4_data},
+                      {test_param_func, &test5_data},
+                      {test_param_func, &test6_data},
+                      {test_param_func, &test7_data},
+                      {test_param_func, &test8_data},
+                      {test_param_func, &test9_data}};
+    unsigned num_tests = DIM(tests);
+    unsigned num_pass = 0;
+
+    coap_log_set_level(COAP_LOG_ERROR);
+
+    num_pass = test_run(tests, num_tests);
+
+    return num_pass == num_tests ? EXIT_SUCCESS : EXIT_FAILURE;
+}
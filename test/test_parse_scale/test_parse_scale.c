@@ -0,0 +1,516 @@
+/*
+ * Copyright (c) 2015 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/**
+ *  @file test_parse_scale.c
+ *
+ *  @brief Source file for the FreeCoAP parser complexity tests
+ *
+ *  Feeds crafted worst-case inputs of growing size to each
+ *  parser and checks that the time per byte stays flat, then
+ *  checks that the per-message limits are enforced.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "coap_msg.h"
+#include "http_msg.h"
+#include "uri.h"
+#include "config.h"
+#include "test.h"
+
+#define DIM(x) (sizeof(x) / sizeof(x[0]))
+
+#define NUM_SIZES     5                                                         /**< Number of input sizes, each twice the previous one */
+#define NUM_TRIALS    3                                                         /**< Number of trials per input size, the fastest is kept */
+#define WORK_LEN      (4 * 1024 * 1024)                                         /**< Number of input units processed per trial */
+#define MAX_RATIO     4.0                                                       /**< Maximum ratio of the slowest to the fastest time per unit */
+#define BUF_LEN       (256 * 1024)                                              /**< Length of the input buffer */
+
+/**
+ *  @brief Test data structure
+ */
+typedef struct
+{
+    const char *desc;                                                           /**< Test description */
+    const char *unit;                                                           /**< Name of the unit that input size is measured in */
+    unsigned first;                                                             /**< Smallest input size */
+    void (*setup)(unsigned);                                                    /**< Builds an input of the given size */
+    int (*run)(unsigned);                                                       /**< Parses the input, returns 0 on success */
+}
+test_parse_scale_data_t;
+
+static char buf[BUF_LEN] = {0};                                                 /**< Input buffer */
+static size_t buf_len = 0;                                                      /**< Length of the input in the buffer */
+
+/**
+ *  @brief Get the current time
+ *
+ *  @returns Monotonic time in sec
+ */
+static double now_sec(void)
+{
+    struct timespec ts = {0};
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* a CoAP message with n Uri-Path options */
+static void coap_parse_setup(unsigned n)
+{
+    unsigned i = 0;
+
+    buf[0] = 0x40;  /* version 1, confirmable, no token */
+    buf[1] = 0x01;  /* GET */
+    buf[2] = 0x00;
+    buf[3] = 0x01;
+    buf_len = 4;
+    for (i = 0; i < n; i++)
+    {
+        buf[buf_len++] = i == 0 ? 0xb1 : 0x01;  /* delta 11 then 0, length 1 */
+        buf[buf_len++] = 'a';
+    }
+}
+
+static int coap_parse_run(unsigned n)
+{
+    coap_msg_t msg = {0};
+    ssize_t num = 0;
+
+    coap_msg_create(&msg);
+    num = coap_msg_parse(&msg, buf, buf_len);
+    coap_msg_destroy(&msg);
+    return num;
+}
+
+static void coap_add_setup(unsigned n)
+{
+}
+
+/* options with the same number added in order, each used to walk the whole list */
+static int coap_add_run(unsigned n)
+{
+    coap_msg_t msg = {0};
+    unsigned i = 0;
+    int ret = 0;
+
+    coap_msg_create(&msg);
+    for (i = 0; i < n; i++)
+    {
+        ret = coap_msg_add_op(&msg, COAP_MSG_URI_PATH, 1, "a");
+        if (ret < 0)
+        {
+            break;
+        }
+    }
+    coap_msg_destroy(&msg);
+    return ret;
+}
+
+/* an HTTP message with n chunks of one byte, each used to scan the rest of the body */
+static void http_chunk_setup(unsigned n)
+{
+    unsigned i = 0;
+
+    buf_len = snprintf(buf, sizeof(buf), "POST /path HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n");
+    for (i = 0; i < n; i++)
+    {
+        memcpy(buf + buf_len, "1\r\nx\r\n", 6);
+        buf_len += 6;
+    }
+    memcpy(buf + buf_len, "0\r\n\r\n", 5);
+    buf_len += 5;
+}
+
+static int http_chunk_run(unsigned n)
+{
+    http_msg_t msg = {0};
+    ssize_t num = 0;
+
+    http_msg_create(&msg);
+    num = http_msg_parse(&msg, buf, buf_len);
+    if ((num == (ssize_t)buf_len) && (http_msg_get_body_len(&msg) != n))
+    {
+        num = -1;
+    }
+    http_msg_destroy(&msg);
+    return num == (ssize_t)buf_len ? 0 : -1;
+}
+
+/* an HTTP message of n bytes with one long header */
+static void http_scan_setup(unsigned n)
+{
+    buf_len = snprintf(buf, sizeof(buf), "GET /path HTTP/1.1\r\nX-Long: ");
+    memset(buf + buf_len, 'v', n);
+    buf_len += n;
+    memcpy(buf + buf_len, "\r\nContent-Length: 4\r\n\r\nbody", 27);
+    buf_len += 27;
+}
+
+/* the message arrives one byte at a time and is parsed once it is complete */
+static int http_scan_run(unsigned n)
+{
+    http_msg_scan_t scan = {0};
+    http_msg_t msg = {0};
+    ssize_t num = 0;
+    size_t i = 0;
+
+    http_msg_scan_create(&scan);
+    for (i = 1; i <= buf_len; i++)
+    {
+        num = http_msg_scan(&scan, buf, i);
+        if (num != -EAGAIN)
+        {
+            break;
+        }
+    }
+    if (num != (ssize_t)buf_len)
+    {
+        return -1;
+    }
+    http_msg_create(&msg);
+    num = http_msg_parse(&msg, buf, buf_len);
+    http_msg_destroy(&msg);
+    return num == (ssize_t)buf_len ? 0 : -1;
+}
+
+/* a URI with a path of n bytes in two byte segments */
+static void uri_setup(unsigned n)
+{
+    unsigned i = 0;
+
+    buf_len = snprintf(buf, sizeof(buf), "coap://[::1]:5683");
+    for (i = 0; i < n / 2; i++)
+    {
+        memcpy(buf + buf_len, "/a", 2);
+        buf_len += 2;
+    }
+    memcpy(buf + buf_len, "?q=%41#f", 9);
+    buf_len += 8;
+}
+
+static int uri_run(unsigned n)
+{
+    uri_t uri = {0};
+    int ret = 0;
+
+    uri_create(&uri);
+    ret = uri_parse(&uri, buf);
+    uri_destroy(&uri);
+    return ret;
+}
+
+/* a configuration with n entries in one section, each used to search all the entries before it */
+static void config_setup(unsigned n)
+{
+    unsigned i = 0;
+
+    buf_len = snprintf(buf, sizeof(buf), "[section]\n");
+    for (i = 0; i < n; i++)
+    {
+        buf_len += snprintf(buf + buf_len, sizeof(buf) - buf_len, "e%u = %u\n", i, i);
+    }
+}
+
+static int config_run(unsigned n)
+{
+    config_t config = {0};
+    unsigned line = 0;
+    unsigned col = 0;
+    int ret = 0;
+
+    config_create(&config);
+    ret = config_parse(&config, buf, &line, &col);
+    config_destroy(&config);
+    return ret;
+}
+
+/* a configuration with one long value followed by n / 16 short entries, each used to clear the longest token */
+static void config_token_setup(unsigned n)
+{
+    unsigned i = 0;
+
+    buf_len = snprintf(buf, sizeof(buf), "[s]\nlong = \"");
+    memset(buf + buf_len, 'v', n / 2);
+    buf_len += n / 2;
+    buf_len += snprintf(buf + buf_len, sizeof(buf) - buf_len, "\"\n");
+    for (i = 0; i < n / 16; i++)
+    {
+        buf_len += snprintf(buf + buf_len, sizeof(buf) - buf_len, "[t%u]\n", i % CONFIG_MAX_SECTIONS);
+    }
+}
+
+test_parse_scale_data_t test1_data =
+{
+    .desc = "test 1: parse a CoAP message with many options",
+    .unit = "options",
+    .first = COAP_MSG_MAX_OPS / 16,
+    .setup = coap_parse_setup,
+    .run = coap_parse_run
+};
+
+test_parse_scale_data_t test2_data =
+{
+    .desc = "test 2: add options to a CoAP message in order",
+    .unit = "options",
+    .first = COAP_MSG_MAX_OPS / 16,
+    .setup = coap_add_setup,
+    .run = coap_add_run
+};
+
+test_parse_scale_data_t test3_data =
+{
+    .desc = "test 3: parse an HTTP message with many chunks",
+    .unit = "chunks",
+    .first = HTTP_MSG_MAX_CHUNKS / 16,
+    .setup = http_chunk_setup,
+    .run = http_chunk_run
+};
+
+test_parse_scale_data_t test4_data =
+{
+    .desc = "test 4: scan an HTTP message that arrives one byte at a time",
+    .unit = "bytes",
+    .first = 1024,
+    .setup = http_scan_setup,
+    .run = http_scan_run
+};
+
+test_parse_scale_data_t test5_data =
+{
+    .desc = "test 5: parse a URI with a long path",
+    .unit = "bytes",
+    .first = 2048,
+    .setup = uri_setup,
+    .run = uri_run
+};
+
+test_parse_scale_data_t test6_data =
+{
+    .desc = "test 6: parse a configuration with many entries",
+    .unit = "entries",
+    .first = CONFIG_MAX_ENTRIES / 16,
+    .setup = config_setup,
+    .run = config_run
+};
+
+test_parse_scale_data_t test7_data =
+{
+    .desc = "test 7: parse a configuration with a long token",
+    .unit = "bytes",
+    .first = 8192,
+    .setup = config_token_setup,
+    .run = config_run
+};
+
+/**
+ *  @brief Check that the time taken by a parser grows linearly with its input
+ *
+ *  @param[in] data Pointer to a test data structure
+ *
+ *  @returns Test result
+ */
+test_result_t test_scale_func(test_data_t data)
+{
+    test_parse_scale_data_t *test_data = (test_parse_scale_data_t *)data;
+    test_result_t result = PASS;
+    unsigned reps = 0;
+    unsigned n = 0;
+    unsigned i = 0;
+    unsigned j = 0;
+    unsigned k = 0;
+    double best[NUM_SIZES] = {0};
+    double min = 0.0;
+    double max = 0.0;
+    double t = 0.0;
+
+    printf("%s\n", test_data->desc);
+
+    for (i = 0; i < NUM_SIZES; i++)
+    {
+        n = test_data->first << i;
+        (*test_data->setup)(n);
+        reps = WORK_LEN / n / (1 << (NUM_SIZES - 1)) + 1;
+        for (j = 0; j < NUM_TRIALS; j++)
+        {
+            t = now_sec();
+            for (k = 0; k < reps; k++)
+            {
+                if ((*test_data->run)(n) != 0)
+                {
+                    printf("    parse failed for %u %s\n", n, test_data->unit);
+                    return FAIL;
+                }
+            }
+            t = (now_sec() - t) / ((double)reps * n);
+            if ((j == 0) || (t < best[i]))
+            {
+                best[i] = t;
+            }
+        }
+        printf("    %6u %-8s %8.1f ns per unit\n", n, test_data->unit, best[i] * 1e9);
+        if ((i == 0) || (best[i] < min))
+        {
+            min = best[i];
+        }
+        if ((i == 0) || (best[i] > max))
+        {
+            max = best[i];
+        }
+    }
+    if (max > MAX_RATIO * min)
+    {
+        result = FAIL;
+    }
+    return result;
+}
+
+/**
+ *  @brief Check that the per-message limits are enforced
+ *
+ *  @param[in] data Unused
+ *
+ *  @returns Test result
+ */
+test_result_t test_limits_func(test_data_t data)
+{
+    test_result_t result = PASS;
+    http_msg_scan_t scan = {0};
+    http_msg_t http_msg = {0};
+    coap_msg_t coap_msg = {0};
+    config_t config = {0};
+    unsigned line = 0;
+    unsigned col = 0;
+    unsigned i = 0;
+    ssize_t num = 0;
+    int ret = 0;
+
+    printf("test 8: reject messages that exceed the limits\n");
+
+    /* one option too many */
+    coap_parse_setup(COAP_MSG_MAX_OPS);
+    coap_msg_create(&coap_msg);
+    num = coap_msg_parse(&coap_msg, buf, buf_len);
+    coap_msg_destroy(&coap_msg);
+    if (num != 0)
+    {
+        result = FAIL;
+    }
+    coap_parse_setup(COAP_MSG_MAX_OPS + 1);
+    coap_msg_create(&coap_msg);
+    num = coap_msg_parse(&coap_msg, buf, buf_len);
+    coap_msg_destroy(&coap_msg);
+    if (num != -EBADMSG)
+    {
+        result = FAIL;
+    }
+    coap_msg_create(&coap_msg);
+    for (i = 0; i <= COAP_MSG_MAX_OPS; i++)
+    {
+        ret = coap_msg_add_op(&coap_msg, COAP_MSG_URI_PATH, 1, "a");
+        if (ret < 0)
+        {
+            break;
+        }
+    }
+    coap_msg_destroy(&coap_msg);
+    if ((ret != -EINVAL) || (i != COAP_MSG_MAX_OPS))
+    {
+        result = FAIL;
+    }
+
+    /* one chunk too many */
+    http_chunk_setup(HTTP_MSG_MAX_CHUNKS + 1);
+    http_msg_create(&http_msg);
+    num = http_msg_parse(&http_msg, buf, buf_len);
+    http_msg_destroy(&http_msg);
+    if (num != -EBADMSG)
+    {
+        result = FAIL;
+    }
+    http_msg_scan_create(&scan);
+    num = http_msg_scan(&scan, buf, buf_len);
+    if (num != -EBADMSG)
+    {
+        result = FAIL;
+    }
+
+    /* one header too many */
+    buf_len = snprintf(buf, sizeof(buf), "GET /path HTTP/1.1\r\n");
+    for (i = 0; i <= HTTP_MSG_MAX_HEADERS; i++)
+    {
+        buf_len += snprintf(buf + buf_len, sizeof(buf) - buf_len, "X-H%u: v\r\n", i);
+    }
+    buf_len += snprintf(buf + buf_len, sizeof(buf) - buf_len, "\r\n");
+    http_msg_create(&http_msg);
+    num = http_msg_parse(&http_msg, buf, buf_len);
+    http_msg_destroy(&http_msg);
+    if (num != -EBADMSG)
+    {
+        result = FAIL;
+    }
+    http_msg_scan_create(&scan);
+    num = http_msg_scan(&scan, buf, buf_len);
+    if (num != -EBADMSG)
+    {
+        result = FAIL;
+    }
+
+    /* one entry too many */
+    config_setup(CONFIG_MAX_ENTRIES + 1);
+    config_create(&config);
+    ret = config_parse(&config, buf, &line, &col);
+    config_destroy(&config);
+    if (ret != CONFIG_ELIMIT)
+    {
+        result = FAIL;
+    }
+    return result;
+}
+
+int main(void)
+{
+    test_t tests[] = {{test_scale_func,  &test1_data},
+                      {test_scale_func,  &test2_data},
+                      {test_scale_func,  &test3_data},
+                      {test_scale_func,  &test4_data},
+                      {test_scale_func,  &test5_data},
+                      {test_scale_func,  &test6_data},
+                      {test_scale_func,  &test7_data},
+                      {test_limits_func, NULL}};
+    unsigned num_tests = DIM(tests);
+    unsigned num_pass = 0;
+
+    num_pass = test_run(tests, num_tests);
+
+    return num_pass == num_tests ? EXIT_SUCCESS : EXIT_FAILURE;
+}
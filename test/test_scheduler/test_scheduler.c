@@ -0,0 +1,447 @@
+/*
+ * Copyright (c) 2014 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ *  @file test_scheduler.c
+ *
+ *  @brief Source file for the FreeCoAP HTTP/CoAP proxy scheduler unit tests
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "scheduler.c"
+#include "test.h"
+
+#define DIM(x) (sizeof(x) / sizeof(x[0]))
+
+#define HOST           "coap.example.com"
+#define PORT           "5683"
+#define LONG_MSEC      5000                                                     /* queue timeout that does not expire during a test */
+#define SHORT_MSEC     100                                                      /* queue timeout or deadline that expires during a test */
+#define MAX_REQS       8
+
+typedef struct
+{
+    const char *desc;
+}
+test_scheduler_data_t;
+
+test_scheduler_data_t test1_data =
+{
+    .desc = "test 1: no limit on the number of exchanges in progress"
+};
+
+test_scheduler_data_t test2_data =
+{
+    .desc = "test 2: waiting requests proceed in proportion to the weight of their flow"
+};
+
+test_scheduler_data_t test3_data =
+{
+    .desc = "test 3: a request that finds the queue full fails at once"
+};
+
+test_scheduler_data_t test4_data =
+{
+    .desc = "test 4: a request that waits longer than the queue timeout gives its share back"
+};
+
+test_scheduler_data_t test5_data =
+{
+    .desc = "test 5: a request that waits past its deadline fails"
+};
+
+/* a request made from its own thread */
+typedef struct
+{
+    param_route_t *route;
+    const char *flow;
+    unsigned weight;
+    const char *name;                                                           /* recorded when the request proceeds */
+    int ret;
+    pthread_t thread;
+}
+req_t;
+
+static pthread_mutex_t order_mutex = PTHREAD_MUTEX_INITIALIZER;
+static const char *order[MAX_REQS] = {NULL};                                    /* names of the requests in the order they proceeded */
+static unsigned num_order = 0;
+
+static void *req_func(void *data)
+{
+    scheduler_server_t *server = NULL;
+    struct timespec deadline = {0};
+    req_t *req = (req_t *)data;
+
+    req->ret = scheduler_acquire(req->route, HOST, PORT, req->flow, req->weight, &deadline, &server);
+    if (req->ret == 0)
+    {
+        pthread_mutex_lock(&order_mutex);
+        if (num_order < MAX_REQS)
+        {
+            order[num_order] = req->name;
+        }
+        num_order++;
+        pthread_mutex_unlock(&order_mutex);
+        scheduler_release(server);
+    }
+    return NULL;
+}
+
+/* wait until the number of requests queued for a server reaches a value */
+static int wait_queued(scheduler_server_t *server, unsigned num)
+{
+    unsigned i = 0;
+
+    for (i = 0; i < 1000; i++)
+    {
+        lock_get(&scheduler_lock);
+        if (server->num_queued == num)
+        {
+            lock_put(&scheduler_lock);
+            return 0;
+        }
+        lock_put(&scheduler_lock);
+        usleep(1000);
+    }
+    return -1;
+}
+
+/* start a request from its own thread and wait until it is queued */
+static int start_req(req_t *req, scheduler_server_t *server)
+{
+    unsigned num = server->num_queued;
+    int ret = 0;
+
+    ret = pthread_create(&req->thread, NULL, req_func, req);
+    if (ret != 0)
+    {
+        return -1;
+    }
+    return wait_queued(server, num + 1);
+}
+
+static scheduler_flow_t *find_flow(scheduler_server_t *server, const char *name)
+{
+    scheduler_flow_t *flow = NULL;
+
+    for (flow = server->flow; flow != NULL; flow = flow->next)
+    {
+        if (strcmp(flow->name, name) == 0)
+        {
+            return flow;
+        }
+    }
+    return NULL;
+}
+
+static void set_route(param_route_t *route, unsigned max_concurrent, unsigned max_queued, unsigned queue_timeout)
+{
+    memset(route, 0, sizeof(param_route_t));
+    route->coap_client_max_concurrent = max_concurrent;
+    route->coap_client_max_queued = max_queued;
+    route->coap_client_queue_timeout = queue_timeout;
+}
+
+static test_result_t test_unlimited_func(test_data_t data)
+{
+    test_scheduler_data_t *test_data = (test_scheduler_data_t *)data;
+    scheduler_server_t *server = (scheduler_server_t *)1;
+    struct timespec deadline = {0};
+    test_result_t result = PASS;
+    param_route_t route = {0};
+    unsigned i = 0;
+    int ret = 0;
+
+    printf("%s\n", test_data->desc);
+
+    if (scheduler_init() < 0)
+    {
+        return FAIL;
+    }
+    set_route(&route, 0, 0, SHORT_MSEC);
+    for (i = 0; i < 4; i++)
+    {
+        ret = scheduler_acquire(&route, HOST, PORT, "a", 1, &deadline, &server);
+        if ((ret != 0) || (server != NULL))
+        {
+            result = FAIL;
+        }
+        scheduler_release(server);
+    }
+    scheduler_deinit();
+    return result;
+}
+
+static test_result_t test_order_func(test_data_t data)
+{
+    test_scheduler_data_t *test_data = (test_scheduler_data_t *)data;
+    scheduler_server_t *server = NULL;
+    struct timespec deadline = {0};
+    test_result_t result = PASS;
+    param_route_t route = {0};
+    const char *exp[] = {"b1", "b2", "b3", "a1", "b4", "a2"};
+    req_t req[] = {{.flow = "a", .weight = 1, .name = "a1"},
+                   {.flow = "a", .weight = 1, .name = "a2"},
+                   {.flow = "b", .weight = 3, .name = "b1"},
+                   {.flow = "b", .weight = 3, .name = "b2"},
+                   {.flow = "b", .weight = 3, .name = "b3"},
+                   {.flow = "b", .weight = 3, .name = "b4"}};
+    unsigned num_started = 0;
+    unsigned i = 0;
+    int ret = 0;
+
+    printf("%s\n", test_data->desc);
+
+    if (scheduler_init() < 0)
+    {
+        return FAIL;
+    }
+    num_order = 0;
+    set_route(&route, 1, MAX_REQS, LONG_MSEC);
+
+    /* hold the only slot while the requests queue up */
+    ret = scheduler_acquire(&route, HOST, PORT, "holder", 1, &deadline, &server);
+    if ((ret != 0) || (server == NULL))
+    {
+        scheduler_deinit();
+        return FAIL;
+    }
+    for (i = 0; i < DIM(req); i++)
+    {
+        req[i].route = &route;
+        if (start_req(&req[i], server) < 0)
+        {
+            result = FAIL;
+            break;
+        }
+        num_started++;
+    }
+    scheduler_release(server);
+    for (i = 0; i < num_started; i++)
+    {
+        pthread_join(req[i].thread, NULL);
+        if (req[i].ret != 0)
+        {
+            result = FAIL;
+        }
+    }
+    if (num_order != DIM(exp))
+    {
+        result = FAIL;
+    }
+    for (i = 0; (i < DIM(exp)) && (i < num_order); i++)
+    {
+        printf("%s ", order[i]);
+        if (strcmp(order[i], exp[i]) != 0)
+        {
+            result = FAIL;
+        }
+    }
+    printf("\n");
+    if ((server->num_active != 0) || (server->num_queued != 0))
+    {
+        result = FAIL;
+    }
+    scheduler_deinit();
+    return result;
+}
+
+static test_result_t test_busy_func(test_data_t data)
+{
+    test_scheduler_data_t *test_data = (test_scheduler_data_t *)data;
+    scheduler_server_t *server = NULL;
+    scheduler_server_t *other = NULL;
+    struct timespec deadline = {0};
+    test_result_t result = PASS;
+    param_route_t route = {0};
+    req_t req = {.flow = "a", .weight = 1, .name = "a1"};
+    int ret = 0;
+
+    printf("%s\n", test_data->desc);
+
+    if (scheduler_init() < 0)
+    {
+        return FAIL;
+    }
+    num_order = 0;
+    set_route(&route, 1, 1, LONG_MSEC);
+    req.route = &route;
+    ret = scheduler_acquire(&route, HOST, PORT, "holder", 1, &deadline, &server);
+    if ((ret != 0) || (server == NULL) || (start_req(&req, server) < 0))
+    {
+        scheduler_deinit();
+        return FAIL;
+    }
+    ret = scheduler_acquire(&route, HOST, PORT, "b", 1, &deadline, &other);
+    if ((ret != -EBUSY) || (other != NULL) || (find_flow(server, "b") != NULL))
+    {
+        result = FAIL;
+    }
+    /* another server has its own queue */
+    ret = scheduler_acquire(&route, "other.example.com", PORT, "b", 1, &deadline, &other);
+    if ((ret != 0) || (other == NULL) || (other == server))
+    {
+        result = FAIL;
+    }
+    scheduler_release(other);
+    scheduler_release(server);
+    pthread_join(req.thread, NULL);
+    if ((req.ret != 0) || (num_order != 1))
+    {
+        result = FAIL;
+    }
+    scheduler_deinit();
+    return result;
+}
+
+static test_result_t test_queue_timeout_func(test_data_t data)
+{
+    test_scheduler_data_t *test_data = (test_scheduler_data_t *)data;
+    scheduler_server_t *server = NULL;
+    scheduler_server_t *other = NULL;
+    scheduler_flow_t *flow = NULL;
+    struct timespec deadline = {0};
+    struct timespec start = {0};
+    struct timespec end = {0};
+    test_result_t result = PASS;
+    param_route_t route = {0};
+    long msec = 0;
+    int ret = 0;
+
+    printf("%s\n", test_data->desc);
+
+    if (scheduler_init() < 0)
+    {
+        return FAIL;
+    }
+    set_route(&route, 1, MAX_REQS, SHORT_MSEC);
+    ret = scheduler_acquire(&route, HOST, PORT, "holder", 1, &deadline, &server);
+    if ((ret != 0) || (server == NULL))
+    {
+        scheduler_deinit();
+        return FAIL;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ret = scheduler_acquire(&route, HOST, PORT, "a", 1, &deadline, &other);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    msec = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+    if ((ret != -EAGAIN) || (other != NULL) || (msec < SHORT_MSEC) || (msec > 10 * SHORT_MSEC))
+    {
+        result = FAIL;
+    }
+    /* the flow is not charged for the request that was not served */
+    flow = find_flow(server, "a");
+    if ((flow == NULL) || (flow->finish != server->vtime) || (flow->num_queued != 0) || (server->num_queued != 0))
+    {
+        result = FAIL;
+    }
+    scheduler_release(server);
+    ret = scheduler_acquire(&route, HOST, PORT, "a", 1, &deadline, &other);
+    if ((ret != 0) || (other != server))
+    {
+        result = FAIL;
+    }
+    scheduler_release(other);
+    scheduler_deinit();
+    return result;
+}
+
+static test_result_t test_deadline_func(test_data_t data)
+{
+    test_scheduler_data_t *test_data = (test_scheduler_data_t *)data;
+    scheduler_server_t *server = NULL;
+    scheduler_server_t *other = NULL;
+    scheduler_flow_t *flow = NULL;
+    struct timespec deadline = {0};
+    struct timespec none = {0};
+    struct timespec end = {0};
+    test_result_t result = PASS;
+    param_route_t route = {0};
+    int ret = 0;
+
+    printf("%s\n", test_data->desc);
+
+    if (scheduler_init() < 0)
+    {
+        return FAIL;
+    }
+    set_route(&route, 1, MAX_REQS, LONG_MSEC);
+    ret = scheduler_acquire(&route, HOST, PORT, "holder", 1, &none, &server);
+    if ((ret != 0) || (server == NULL))
+    {
+        scheduler_deinit();
+        return FAIL;
+    }
+    /* the deadline comes before the queue timeout */
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_nsec += SHORT_MSEC * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    ret = scheduler_acquire(&route, HOST, PORT, "a", 1, &deadline, &other);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if ((ret != -ETIMEDOUT)
+     || (other != NULL)
+     || (end.tv_sec < deadline.tv_sec)
+     || ((end.tv_sec == deadline.tv_sec) && (end.tv_nsec < deadline.tv_nsec))
+     || (end.tv_sec > deadline.tv_sec + 1))
+    {
+        result = FAIL;
+    }
+    flow = find_flow(server, "a");
+    if ((flow == NULL) || (flow->finish != server->vtime) || (server->num_queued != 0))
+    {
+        result = FAIL;
+    }
+    scheduler_release(server);
+    scheduler_deinit();
+    return result;
+}
+
+int main(void)
+{
+    test_t tests[] = {{test_unlimited_func,     &test1_data},
+                      {test_order_func,         &test2_data},
+                      {test_busy_func,          &test3_data},
+                      {test_queue_timeout_func, &test4_data},
+                      {test_deadline_func,      &test5_data}};
+    unsigned num_tests = DIM(tests);
+    unsigned num_pass = 0;
+
+    coap_log_set_level(COAP_LOG_ERROR);
+
+    num_pass = test_run(tests, num_tests);
+
+    return num_pass == num_tests ? EXIT_SUCCESS : EXIT_FAILURE;
+}
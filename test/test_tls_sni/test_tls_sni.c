@@ -0,0 +1,283 @@
+/*
+ * Copyright (c) 2014 Keith Cullen.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ *  @file test_tls_sni.c
+ *
+ *  @brief Source file for the FreeCoAP TLS server name indication unit tests
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <gnutls/gnutls.h>
+#include <gnutls/x509.h>
+#include "tls.h"
+#include "coap_log.h"
+#include "test.h"
+
+#define SERVER_CERT_FILE_NAME  "../../certs/server_cert.pem"
+#define SERVER_KEY_FILE_NAME   "../../certs/server_privkey.pem"
+#define SNI_CERT_FILE_NAME     "../../certs/client_cert.pem"
+#define SNI_KEY_FILE_NAME      "../../certs/client_privkey.pem"
+#define SNI_NAME               "sni.example.com"
+
+#define DIM(x) (sizeof(x) / sizeof(x[0]))
+
+typedef struct
+{
+    const char *desc;
+    const char *server_name;                                                    /* server name sent by the client, NULL for none */
+    const char *cert_file_name;                                                 /* certificate expected from the server */
+}
+test_tls_sni_data_t;
+
+test_tls_sni_data_t test1_data =
+{
+    .desc = "test 1: registered server name selects its certificate",
+    .server_name = SNI_NAME,
+    .cert_file_name = SNI_CERT_FILE_NAME
+};
+
+test_tls_sni_data_t test2_data =
+{
+    .desc = "test 2: server name matched without regard to case",
+    .server_name = "SNI.Example.COM",
+    .cert_file_name = SNI_CERT_FILE_NAME
+};
+
+test_tls_sni_data_t test3_data =
+{
+    .desc = "test 3: unknown server name selects the default certificate",
+    .server_name = "other.example.com",
+    .cert_file_name = SERVER_CERT_FILE_NAME
+};
+
+test_tls_sni_data_t test4_data =
+{
+    .desc = "test 4: no server name selects the default certificate",
+    .server_name = NULL,
+    .cert_file_name = SERVER_CERT_FILE_NAME
+};
+
+static tls_server_t server = {0};
+
+/* ignore broken pipe signal, i.e. don't terminate if the client closes first */
+static void set_signal(void)
+{
+    struct sigaction sa = {{0}};
+    sa.sa_handler = SIG_IGN;
+    sa.sa_flags = 0;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPIPE, &sa, NULL);
+}
+
+typedef struct
+{
+    int sd;
+    int ret;
+}
+server_arg_t;
+
+static void *server_thread_func(void *data)
+{
+    server_arg_t *arg = (server_arg_t *)data;
+    gnutls_session_t session = NULL;
+
+    arg->ret = gnutls_init(&session, GNUTLS_SERVER);
+    if (arg->ret != GNUTLS_E_SUCCESS)
+    {
+        return NULL;
+    }
+    gnutls_priority_set(session, tls_get_priority_cache());
+    gnutls_credentials_set(session, GNUTLS_CRD_CERTIFICATE, tls_server_get_cred(&server));
+    gnutls_session_set_ptr(session, &server);
+    gnutls_handshake_set_post_client_hello_function(session, tls_server_select_cred);
+    gnutls_transport_set_int(session, arg->sd);
+    do
+    {
+        arg->ret = gnutls_handshake(session);
+    }
+    while ((arg->ret < 0) && (gnutls_error_is_fatal(arg->ret) == 0));
+    if (arg->ret == GNUTLS_E_SUCCESS)
+    {
+        gnutls_bye(session, GNUTLS_SHUT_WR);
+    }
+    gnutls_deinit(session);
+    return NULL;
+}
+
+/* compare the certificate sent by the server with a certificate file */
+static test_result_t compare_cert(gnutls_session_t session, const char *file_name)
+{
+    const gnutls_datum_t *list = NULL;
+    gnutls_x509_crt_t crt = NULL;
+    gnutls_datum_t pem = {0};
+    gnutls_datum_t der = {0};
+    test_result_t result = FAIL;
+    unsigned num = 0;
+    int ret = 0;
+
+    list = gnutls_certificate_get_peers(session, &num);
+    if ((list == NULL) || (num == 0))
+    {
+        return FAIL;
+    }
+    ret = gnutls_load_file(file_name, &pem);
+    if (ret != GNUTLS_E_SUCCESS)
+    {
+        return FAIL;
+    }
+    ret = gnutls_x509_crt_init(&crt);
+    if (ret == GNUTLS_E_SUCCESS)
+    {
+        ret = gnutls_x509_crt_import(crt, &pem, GNUTLS_X509_FMT_PEM);
+        if (ret == GNUTLS_E_SUCCESS)
+        {
+            ret = gnutls_x509_crt_export2(crt, GNUTLS_X509_FMT_DER, &der);
+            if (ret == GNUTLS_E_SUCCESS)
+            {
+                if ((der.size == list[0].size) && (memcmp(der.data, list[0].data, der.size) == 0))
+                {
+                    result = PASS;
+                }
+                gnutls_free(der.data);
+            }
+        }
+        gnutls_x509_crt_deinit(crt);
+    }
+    gnutls_free(pem.data);
+    return result;
+}
+
+static test_result_t test_sni_func(test_data_t data)
+{
+    test_tls_sni_data_t *test_data = (test_tls_sni_data_t *)data;
+    gnutls_certificate_credentials_t cred = NULL;
+    gnutls_session_t session = NULL;
+    test_result_t result = PASS;
+    server_arg_t arg = {0};
+    pthread_t thread = {0};
+    int sd[2] = {-1, -1};
+    int ret = 0;
+
+    printf("%s\n", test_data->desc);
+
+    ret = socketpair(AF_UNIX, SOCK_STREAM, 0, sd);
+    if (ret < 0)
+    {
+        return FAIL;
+    }
+    arg.sd = sd[1];
+    ret = pthread_create(&thread, NULL, server_thread_func, &arg);
+    if (ret != 0)
+    {
+        close(sd[0]);
+        close(sd[1]);
+        return FAIL;
+    }
+    gnutls_certificate_allocate_credentials(&cred);
+    gnutls_init(&session, GNUTLS_CLIENT);
+    gnutls_priority_set(session, tls_get_priority_cache());
+    gnutls_credentials_set(session, GNUTLS_CRD_CERTIFICATE, cred);
+    if (test_data->server_name != NULL)
+    {
+        gnutls_server_name_set(session, GNUTLS_NAME_DNS, test_data->server_name, strlen(test_data->server_name));
+    }
+    gnutls_transport_set_int(session, sd[0]);
+    do
+    {
+        ret = gnutls_handshake(session);
+    }
+    while ((ret < 0) && (gnutls_error_is_fatal(ret) == 0));
+    if (ret != GNUTLS_E_SUCCESS)
+    {
+        DEBUG_PRINT("gnutls_handshake returned: %s\n", gnutls_strerror(ret));
+        result = FAIL;
+    }
+    else
+    {
+        result = compare_cert(session, test_data->cert_file_name);
+    }
+    /* closing the client socket ends a failed handshake in the server */
+    close(sd[0]);
+    pthread_join(thread, NULL);
+    close(sd[1]);
+    if (arg.ret != GNUTLS_E_SUCCESS)
+    {
+        result = FAIL;
+    }
+    gnutls_deinit(session);
+    gnutls_certificate_free_credentials(cred);
+    return result;
+}
+
+int main(void)
+{
+    test_t tests[] = {{test_sni_func, &test1_data},
+                      {test_sni_func, &test2_data},
+                      {test_sni_func, &test3_data},
+                      {test_sni_func, &test4_data}};
+    unsigned num_tests = DIM(tests);
+    unsigned num_pass = 0;
+    int ret = 0;
+
+    set_signal();
+    coap_log_set_level(COAP_LOG_ERROR);
+
+    ret = tls_init();
+    if (ret != SOCK_OK)
+    {
+        fprintf(stderr, "Error: tls_init: %s\n", sock_strerror(ret));
+        return EXIT_FAILURE;
+    }
+    ret = tls_server_create(&server, NULL, SERVER_CERT_FILE_NAME, SERVER_KEY_FILE_NAME);
+    if (ret != SOCK_OK)
+    {
+        fprintf(stderr, "Error: tls_server_create: %s\n", sock_strerror(ret));
+        tls_deinit();
+        return EXIT_FAILURE;
+    }
+    ret = tls_server_add_sni(&server, SNI_NAME, NULL, SNI_CERT_FILE_NAME, SNI_KEY_FILE_NAME);
+    if (ret != SOCK_OK)
+    {
+        fprintf(stderr, "Error: tls_server_add_sni: %s\n", sock_strerror(ret));
+        tls_server_destroy(&server);
+        tls_deinit();
+        return EXIT_FAILURE;
+    }
+
+    num_pass = test_run(tests, num_tests);
+
+    tls_server_destroy(&server);
+    tls_deinit();
+    return num_pass == num_tests ? EXIT_SUCCESS : EXIT_FAILURE;
+}